@@ -27,6 +27,20 @@ macro(ADD_OSQUERY_TEST IS_CORE TEST_NAME SOURCE)
   endif()
 endmacro(ADD_OSQUERY_TEST)
 
+# Benchmarks are built when Google Benchmark is found, they are not tests.
+macro(ADD_OSQUERY_BENCHMARK IS_CORE BENCHMARK_NAME SOURCE)
+  if(NOT DEFINED ENV{SKIP_BENCHMARKS} AND BENCHMARK_LIBRARY AND
+      (${IS_CORE} OR NOT OSQUERY_BUILD_SDK_ONLY))
+    add_executable(${BENCHMARK_NAME} ${SOURCE})
+    TARGET_OSQUERY_LINK_WHOLE(${BENCHMARK_NAME} libosquery)
+    if(NOT ${IS_CORE})
+      target_link_libraries(${BENCHMARK_NAME} libosquery_additional)
+    endif()
+    target_link_libraries(${BENCHMARK_NAME} ${BENCHMARK_LIBRARY})
+    SET_OSQUERY_COMPILE(${BENCHMARK_NAME} "${OPTIONAL_FLAGS}")
+  endif()
+endmacro(ADD_OSQUERY_BENCHMARK)
+
 # Core/non core link helping macros (tell the build to link ALL).
 macro(ADD_OSQUERY_LINK IS_CORE LINK)
   if(${IS_CORE})
@@ -38,7 +38,6 @@ elseif(LINUX)
       "zlib"
       "snappy"
       "bzip2-libs"
-      "procps"
       "libudev"
       "rpm-libs"
     )
@@ -24,6 +24,22 @@ namespace osquery {
 /// The builder or invoker may change the default config plugin.
 DECLARE_string(config_retriever);
 
+/**
+ * @brief The limits on the events an EventSubscriber stores.
+ *
+ * A noisy event source may be rate limited by a token bucket refilled with
+ * max_events_per_second tokens each second, holding up to burst tokens, and
+ * sampled such that 1 in sample of the events within the rate are stored.
+ */
+struct OsqueryEventLimits {
+  /// The sustained events per second, 0 is unlimited.
+  size_t max_events_per_second;
+  /// The events allowed at once above the sustained rate.
+  size_t burst;
+  /// Store 1 in sample events, 0 and 1 store every event.
+  size_t sample;
+};
+
 /**
  * @brief A native representation of osquery configuration data.
  *
@@ -34,6 +50,8 @@ struct OsqueryConfig {
   /// A vector of all of the queries that are scheduled to execute.
   std::vector<OsqueryScheduledQuery> scheduledQueries;
   std::map<std::string, std::string> options;
+  /// The limits of EventSubscriber%s by subscriber name.
+  std::map<std::string, OsqueryEventLimits> eventLimits;
 };
 
 /**
@@ -75,6 +93,8 @@ class Config {
    * @brief Call the genConfig method of the config retriever plugin.
    *
    * This may perform a resource load such as TCP request or filesystem read.
+   * The MD5 of the last loaded content is sent with the request, content
+   * the retriever reports as unchanged is not parsed again.
    */
   Status load();
 
@@ -95,7 +115,17 @@ class Config {
   std::vector<OsqueryScheduledQuery> getScheduledQueries();
 
   /**
-   * @brief Calculate the has of the osquery config
+   * @brief Get the configured limits of each EventSubscriber.
+   *
+   * @return a map of subscriber names to their limits
+   */
+  std::map<std::string, OsqueryEventLimits> getEventLimits();
+
+  /**
+   * @brief Get the hash of the osquery config
+   *
+   * The hash is computed when the config is loaded, the config is only
+   * retrieved again if it has not been loaded.
    *
    * @return The MD5 of the osquery config
    */
@@ -110,6 +140,21 @@ class Config {
    */
   static osquery::Status checkConfig();
 
+  /// Parse config JSON into a config struct.
+  static osquery::Status parseConfig(const std::string& config_string,
+                                     OsqueryConfig& conf);
+
+  /**
+   * @brief Ask the config retriever for pending distributed queries.
+   *
+   * @param requests output, the queries to run, empty if none are pending.
+   *
+   * @return an instance of osquery::Status, indicating the success or failure
+   * of the operation.
+   */
+  static osquery::Status genDistributedQueries(
+      std::vector<DistributedQueryRequest>& requests);
+
  private:
   /**
    * @brief Default constructor.
@@ -158,12 +203,26 @@ class Config {
    */
   static osquery::Status genConfig(std::string& conf);
 
+  /**
+   * @brief Retrieve the config JSON unless it matches a hash.
+   *
+   * @param hash the MD5 of the last loaded config, or empty.
+   * @param conf the config JSON, if it changed.
+   * @param changed set false if the retriever reports the same content.
+   */
+  static osquery::Status genConfig(const std::string& hash,
+                                   std::string& conf,
+                                   bool& changed);
+
  private:
   /**
    * @brief the private member that stores the raw osquery config data in a
    * native format
    */
   OsqueryConfig cfg_;
+
+  /// The MD5 of the config content cfg_ was parsed from.
+  std::string hash_;
 };
 
 /**
@@ -206,6 +265,37 @@ class ConfigPlugin : public Plugin {
    * should be returned in pair.second.
    */
   virtual std::pair<osquery::Status, std::string> genConfig() = 0;
+
+  /**
+   * @brief Retrieve the config only if its content hash changed.
+   *
+   * Requests carrying a "hash" use this method, and an unchanged config is
+   * answered with an "unchanged" response instead of the content. Remote
+   * retrievers should override it to make a conditional request, such as
+   * sending the hash as an ETag. The default retrieves the config and
+   * compares the MD5 of the content.
+   *
+   * @param hash the MD5 of the config content the caller last loaded.
+   * @param changed set false if the content has the same hash.
+   */
+  virtual std::pair<osquery::Status, std::string> genConfigIfChanged(
+      const std::string& hash, bool& changed);
+
+  /**
+   * @brief Retrieve ad-hoc queries to run once, outside of the schedule.
+   *
+   * Requests with the "genDistributed" action use this method, and each
+   * query is answered with a response item of its "id", "query" and optional
+   * "timeout_ms" and "cpu_ms". Retrievers connected to a fleet manager should
+   * override it, the default has no queries.
+   *
+   * @param requests output, the pending queries.
+   */
+  virtual Status genDistributedQueries(
+      std::vector<DistributedQueryRequest>& requests) {
+    return Status(0, "OK");
+  }
+
   Status call(const PluginRequest& request, PluginResponse& response);
 };
 
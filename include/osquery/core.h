@@ -10,6 +10,8 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -52,6 +54,131 @@ enum osqueryTool {
  */
 void initOsquery(int argc, char* argv[], int tool = OSQUERY_TOOL_TEST);
 
+/// The name and milliseconds of each startup phase, in the order recorded.
+typedef std::vector<std::pair<std::string, size_t> > StartupPhases;
+
+/**
+ * @brief Record the duration of a startup phase, such as parsing flags.
+ *
+ * Phases run concurrently by initOsquery each record their own duration.
+ *
+ * @param phase a short name for the phase.
+ * @param duration_ms the milliseconds the phase took.
+ */
+void recordStartupPhase(const std::string& phase, size_t duration_ms);
+
+/// The startup phases recorded so far.
+StartupPhases getStartupPhases();
+
+/// The memory attributed to one subsystem, such as SQLite.
+struct MemoryUsage {
+  std::string subsystem;
+  /// The approximate bytes used.
+  size_t bytes;
+  /// The number of items, such as cached results, or 0 if not applicable.
+  size_t items;
+};
+
+/**
+ * @brief Account for the memory used by each subsystem.
+ *
+ * The process's resident size and allocator totals are included, such that
+ * the unattributed remainder can be estimated.
+ *
+ * @param usage [output] the memory used by each subsystem.
+ */
+void getMemoryUsage(std::vector<MemoryUsage>& usage);
+
+/**
+ * @brief Return the allocator's free pages to the operating system.
+ *
+ * A large query result is freed as many small rows, the allocator otherwise
+ * keeps those pages and the process's resident size stays at its peak.
+ */
+void releaseFreeMemory();
+
+/// The context samples of the sampling profiler are tagged with.
+enum SampleTagType {
+  SAMPLE_TAG_QUERY = 0,
+  SAMPLE_TAG_TABLE = 1,
+};
+
+/**
+ * @brief Tag the profiler samples of the calling thread while in scope.
+ *
+ * The scheduler tags samples with the running query and the SQLite virtual
+ * table module with the table generating rows. The name must outlive the tag.
+ */
+class SampleTag {
+ public:
+  SampleTag(SampleTagType type, const std::string& name);
+  ~SampleTag();
+
+ private:
+  SampleTagType type_;
+  const char* previous_;
+};
+
+/**
+ * @brief Sample the process's stacks hz times per second of CPU time.
+ *
+ * Samples are folded by stack, beginning with their query and table tags,
+ * and written to `--profiler_path` about once a second in the format read
+ * by flamegraph.pl.
+ *
+ * @param hz the samples per CPU second.
+ */
+Status startSampling(int hz);
+
+/// Stop sampling and write the remaining samples.
+void stopSampling();
+
+/**
+ * @brief Handle SIGUSR2 and start sampling if `--profiler_hz` is set.
+ *
+ * Only a worker with a `--profiler_path` handles SIGUSR2, which starts or
+ * stops sampling. Without a path no handler or folding thread is started.
+ */
+void initSampler();
+
+/**
+ * @brief A timed stage of a query's lifecycle, ending when destroyed.
+ *
+ * Spans opened while another span is open on the same thread are its
+ * children. When a thread's outermost span ends its trace is appended to
+ * `--trace_path` as Chrome trace JSON and sent as a JSON line of
+ * OpenTelemetry-style spans to the `--trace_receiver` logger plugins.
+ * A span costs one atomic load when tracing is off.
+ */
+class TraceSpan {
+ public:
+  /// The name must be a literal, the detail is copied.
+  explicit TraceSpan(const char* name);
+  TraceSpan(const char* name, const std::string& detail);
+  ~TraceSpan();
+
+ private:
+  bool active_;
+  const char* name_;
+  std::string detail_;
+  uint64_t span_id_;
+  TraceSpan* parent_;
+  uint64_t epoch_start_;
+  std::chrono::steady_clock::time_point start_;
+
+ private:
+  TraceSpan(const TraceSpan&);
+  void operator=(const TraceSpan&);
+};
+
+/**
+ * @brief Read the tracing flags, spans are only recorded once they are set.
+ *
+ * The flags may be set by the config, tracing is initialized again after
+ * each config load.
+ */
+void initTracing();
+
 /**
  * @brief Turns of various aspects of osquery such as event loops.
  *
@@ -128,18 +255,14 @@ inline size_t incUtf8StringIterator(_Iterator1& it, const _Iterator2& last) {
 /**
  * @brief Get the length of a UTF-8 string
  *
+ * Characters are counted 16 bytes at a time with SSE2 or NEON, the length
+ * equals that of iterating with incUtf8StringIterator.
+ *
  * @param str The UTF-8 string
  *
  * @return the length of the string
  */
-inline size_t utf8StringSize(const std::string& str) {
-  size_t res = 0;
-  std::string::const_iterator it = str.begin();
-  for (; it != str.end(); incUtf8StringIterator(it, str.end()))
-    res++;
-
-  return res;
-}
+size_t utf8StringSize(const std::string& str);
 
 /**
  * @brief Create a pid file
@@ -147,4 +270,38 @@ inline size_t utf8StringSize(const std::string& str) {
  * @return A status object indicating the success or failure of the operation
  */
 Status createPidFile();
+
+/// The long-lived threads that may be given a CPU affinity and priority.
+enum ThreadRole {
+  /// Dispatcher workers, which also run scheduled queries.
+  kDispatcherThread,
+  /// Event publisher run loops and the event reactor.
+  kEventThread,
+  /// The scheduler's interval loop.
+  kSchedulerThread,
+};
+
+/**
+ * @brief Parse a list of CPU numbers and ranges, such as "0-3,6".
+ *
+ * @param list the comma-separated CPU numbers or inclusive ranges
+ * @param cpus output, the listed CPU numbers
+ *
+ * @return A status object indicating the success or failure of the operation
+ */
+Status parseCPUList(const std::string& list, std::vector<size_t>& cpus);
+
+/**
+ * @brief Apply a role's CPU affinity and priority to the calling thread.
+ *
+ * The affinity and nice value of each role are set with the
+ * `--worker_*`, `--events_*`, and `--scheduler_*` flags. Dispatcher workers
+ * may also use the idle CPU scheduling class and IO priority, such that
+ * queries only run on otherwise idle capacity.
+ *
+ * @param role the role of the calling thread
+ *
+ * @return A status object indicating the success or failure of the operation
+ */
+Status setThreadPolicy(ThreadRole role);
 }
@@ -10,7 +10,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -22,6 +26,8 @@
 namespace osquery {
 
 DECLARE_string(db_path);
+DECLARE_string(db_checkpoint_path);
+DECLARE_int32(db_checkpoint_interval);
 
 /////////////////////////////////////////////////////////////////////////////
 // Constants
@@ -49,6 +55,96 @@ extern const std::string kConfigurations;
 /// The "domain" where event results are stored, queued for querytime
 extern const std::string kEvents;
 
+/// The "domain" where the rows of fingerprinted query results are stored
+extern const std::string kQueryRows;
+
+/// The "domain" where file content hashes are cached by file identity
+extern const std::string kHashes;
+
+/// The "domain" where tables store how far they have read appended files
+extern const std::string kFileOffsets;
+
+/// The "domain" where strings are spooled for logger receivers to retry
+extern const std::string kLogs;
+
+/// The "domain" where the start time of each query's last run is stored
+extern const std::string kQueryRuns;
+
+/// The "domain" where the hash of each snapshot's last logged rows is stored
+extern const std::string kSnapshots;
+
+/////////////////////////////////////////////////////////////////////////////
+// DBBatch
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief A set of Put and Delete operations applied by DBHandle::Write
+ *
+ * The operations of a batch are applied in order, atomically, with a single
+ * write to the RocksDB write-ahead log.
+ */
+class DBBatch {
+ public:
+  /// Add a Put of the value of key in domain.
+  void Put(const std::string& domain,
+           const std::string& key,
+           const std::string& value);
+
+  /// Add a Delete of key in domain.
+  void Delete(const std::string& domain, const std::string& key);
+
+  /// The number of operations in the batch.
+  size_t size() const { return operations_.size(); }
+
+ private:
+  /// A Put, or a Delete if the value is absent.
+  struct Operation {
+    std::string domain;
+    std::string key;
+    std::string value;
+    bool remove;
+  };
+
+  std::vector<Operation> operations_;
+
+ private:
+  friend class DBHandle;
+};
+
+/**
+ * @brief A consistent view of every domain, taken by DBHandle::getSnapshot
+ * Reads through a snapshot do not see writes applied after it was taken,
+ * such that several reads agree without locking out writers. The snapshot
+ * is released with its last reference, before the DBHandle is destroyed.
+ */
+class DBSnapshot {
+ public:
+  ~DBSnapshot() { db_->ReleaseSnapshot(snapshot_); }
+
+  /// The RocksDB snapshot, for the ReadOptions of reads from it.
+  const rocksdb::Snapshot* getSnapshot() const { return snapshot_; }
+
+ private:
+  DBSnapshot(rocksdb::DB* db) : db_(db), snapshot_(db->GetSnapshot()) {}
+
+  rocksdb::DB* db_;
+  const rocksdb::Snapshot* snapshot_;
+
+ private:
+  friend class DBHandle;
+};
+
+typedef std::shared_ptr<DBSnapshot> DBSnapshotRef;
+
+/**
+ * @brief A callback for each key and value visited by a DBHandle scan
+ *
+ * The slices are only valid for the duration of the call. Return false to
+ * stop the scan.
+ */
+typedef std::function<bool(const rocksdb::Slice& key,
+                           const rocksdb::Slice& value)> DBScanCallback;
+
 /////////////////////////////////////////////////////////////////////////////
 // DBHandle RAII singleton
 /////////////////////////////////////////////////////////////////////////////
@@ -110,13 +206,31 @@ class DBHandle {
    * @param key the string key that you'd like to get
    * @param value a non-const string reference where the result of the
    * operation will be stored
+   * @param snapshot an optional snapshot to read from
    *
    * @return an instance of osquery::Status indicating the success or failure
    * of the operation.
    */
   Status Get(const std::string& domain,
              const std::string& key,
-             std::string& value);
+             std::string& value,
+             const DBSnapshotRef& snapshot = nullptr);
+
+  /**
+   * @brief Check if a key exists in the database
+   *
+   * RocksDB's bloom filters and memtables answer most checks without reading
+   * the value, otherwise the value is read once.
+   *
+   * @param domain the "domain" or "column family" to check
+   * @param key the string key that you'd like to check for
+   * @param snapshot an optional snapshot to read from
+   *
+   * @return true if the key exists, false if it does not or on error.
+   */
+  bool Exists(const std::string& domain,
+              const std::string& key,
+              const DBSnapshotRef& snapshot = nullptr);
 
   /**
    * @brief Put data into the database
@@ -145,6 +259,16 @@ class DBHandle {
    */
   Status Delete(const std::string& domain, const std::string& key);
 
+  /**
+   * @brief Apply a batch of operations atomically
+   *
+   * @param batch the Put and Delete operations to apply
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation, no operation is applied on failure.
+   */
+  Status Write(const DBBatch& batch);
+
   /**
    * @brief List the data in a "domain"
    *
@@ -158,6 +282,126 @@ class DBHandle {
    */
   Status Scan(const std::string& domain, std::vector<std::string>& results);
 
+  /**
+   * @brief Visit the keys and values in a "domain" beginning with a prefix
+   *
+   * The iterator seeks to the prefix, keys are visited in order and the scan
+   * stops at the first key without the prefix.
+   *
+   * @param domain the "domain" or "column family" that you'd like to read
+   * @param prefix the key prefix, an empty prefix visits the whole domain
+   * @param callback called with each key and value, return false to stop
+   * @param snapshot an optional snapshot to read from
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation.
+   */
+  Status Scan(const std::string& domain,
+              const std::string& prefix,
+              const DBScanCallback& callback,
+              const DBSnapshotRef& snapshot = nullptr);
+
+  /**
+   * @brief Visit the keys and values in a "domain" within a key range
+   *
+   * @param domain the "domain" or "column family" that you'd like to read
+   * @param start the first key of the range, inclusive
+   * @param stop the end of the range, exclusive, or empty for no end
+   * @param callback called with each key and value, return false to stop
+   * @param snapshot an optional snapshot to read from
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation.
+   */
+  Status ScanRange(const std::string& domain,
+                   const std::string& start,
+                   const std::string& stop,
+                   const DBScanCallback& callback,
+                   const DBSnapshotRef& snapshot = nullptr);
+
+  /**
+   * @brief Take a consistent view of every domain
+   *
+   * A single Get or scan already reads a consistent view, a snapshot is
+   * shared by the reads of results that must agree with each other.
+   *
+   * @return a reference to the snapshot, released with its last reference
+   */
+  DBSnapshotRef getSnapshot();
+
+  /**
+   * @brief Delete the keys in a "domain" within a key range
+   *
+   * Table files holding only keys of the range are dropped, the remaining
+   * keys are deleted in a single batch. Large ranges are compacted such that
+   * the space of their deleted keys is reclaimed.
+   *
+   * Dropped table files are not kept for snapshots, reads through a snapshot
+   * taken before the call may not find keys of the range. Only delete ranges
+   * which no snapshot reader needs, such as expired events.
+   *
+   * @param domain the "domain" or "column family" that you'd like to delete
+   * data from
+   * @param start the first key of the range, inclusive
+   * @param stop the end of the range, exclusive, or empty for no end
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation.
+   */
+  Status DeleteRange(const std::string& domain,
+                     const std::string& start,
+                     const std::string& stop);
+
+  /**
+   * @brief Create a "domain" at runtime if it does not exist
+   *
+   * Each event subscriber stores its events in a domain of its own, named
+   * kEvents, '.' and the subscriber namespace. The column family has its own
+   * memtables and compactions, uses the options of kEvents and the
+   * db_events_write_buffer_mb memtable size, and is opened with the database.
+   *
+   * @param domain the name of the "domain" or "column family"
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation.
+   */
+  Status createDomain(const std::string& domain);
+
+  /**
+   * @brief Save every domain to the db_checkpoint_path
+   *
+   * An in-memory database restores the checkpoint when it is created, such
+   * that events and query differentials persist across restarts without a
+   * writable database path.
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation.
+   */
+  Status Checkpoint();
+
+  /**
+   * @brief Save every domain to a checkpoint file
+   *
+   * The file is replaced once the new checkpoint is completely written.
+   *
+   * @param path the path of the checkpoint file
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation.
+   */
+  Status Checkpoint(const std::string& path);
+
+  /// The approximate bytes of memtables and tables of all domains.
+  size_t getMemoryUsage();
+
+  /// The sum of a numeric RocksDB property, such as memtable bytes, across
+  /// all domains.
+  size_t getIntProperty(const std::string& property);
+
+  /// The bytes of the database's files, including its write-ahead log, or 0
+  /// if the database is kept in memory.
+  size_t getDiskUsage();
+
  private:
   /**
    * @brief Default constructor
@@ -195,7 +439,7 @@ class DBHandle {
   /**
    * @brief A method which gets you an in-memory RocksDB instance.
    *
-   * This should only be used by unit tests. Never use it in production code.
+   * Use the use_in_memory_database flag to select an in-memory database.
    *
    * @return a shared pointer to an instance of DBHandle
    */
@@ -222,6 +466,12 @@ class DBHandle {
    */
   rocksdb::ColumnFamilyHandle* getHandleForColumnFamily(const std::string& cf);
 
+  /// Replay a checkpoint written by DBHandle::Checkpoint.
+  Status restoreCheckpoint(const std::string& path);
+
+  /// True if an in-memory database exceeds its db_memory_mb budget.
+  bool isFull();
+
  private:
   /////////////////////////////////////////////////////////////////////////////
   // Private members
@@ -233,12 +483,39 @@ class DBHandle {
   /// Column family descriptors which are used to connect to RocksDB
   std::vector<rocksdb::ColumnFamilyDescriptor> column_families_;
 
-  /// A vector of pointers to column family handles
+  /// The column family handles of the static domains, fixed once opened
   std::vector<rocksdb::ColumnFamilyHandle*> handles_;
 
+  /// The column family handles of domains created at runtime
+  std::map<std::string, rocksdb::ColumnFamilyHandle*> domains_;
+
+  /// Protects the domains created at runtime and their handles
+  std::mutex domains_mutex_;
+
+  /// The column family options of domains created at runtime
+  rocksdb::ColumnFamilyOptions event_options_;
+
   /// The RocksDB connection options that are used to connect to RocksDB
   rocksdb::Options options_;
 
+  /// The memory environment of an in-memory database
+  rocksdb::Env* env_{nullptr};
+
+  /// The path the database was opened at
+  std::string path_;
+
+  /// True if the database is kept in memory
+  bool in_memory_{false};
+
+  /// The bytes an in-memory database may use before event writes fail
+  size_t memory_budget_{0};
+
+  /// The writes since the size of an in-memory database was checked
+  std::atomic<size_t> writes_{0};
+
+  /// True if an in-memory database was last found above its budget
+  std::atomic<bool> full_{false};
+
  private:
   /////////////////////////////////////////////////////////////////////////////
   // Unit tests which can access private members
@@ -247,6 +524,9 @@ class DBHandle {
   friend class DBHandleTests;
   friend class EventsTests;
   friend class EventsDatabaseTests;
+  friend class FileHashEventsTests;
   friend class QueryTests;
+  friend class HashCacheTests;
+  friend class LoggerTests;
 };
 }
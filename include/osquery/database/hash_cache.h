@@ -0,0 +1,53 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <string>
+
+#include <osquery/hash.h>
+
+namespace osquery {
+
+/**
+ * @brief Compute several hash digests of a file, using cached digests.
+ *
+ * Digests are cached in the backing store keyed by the file's device and
+ * inode and are reused while the file's size, mtime, and ctime are unchanged.
+ * Hashing an unchanged file costs a stat and a single backing store read.
+ * Caching is disabled with the `hash_cache` flag.
+ *
+ * At most `hash_cache_max` files are cached, the least recently hashed are
+ * removed first.
+ *
+ * @param mask A bitwise OR of the osquery-supported hash algorithms.
+ * @param path Filesystem path, the hash target.
+ * @return The requested string (hex) representations of the hash digests.
+ */
+MultiHashes hashMultiFromFileCached(int mask, const std::string& path);
+
+/// As hashMultiFromFileCached, with a hasher's contexts and buffer.
+MultiHashes hashMultiFromFileCached(FileHasher& hasher,
+                                    int mask,
+                                    const std::string& path);
+
+/**
+ * @brief The digests last cached for a file, even if it changed since.
+ *
+ * The cache entry of the file's device and inode is read without comparing
+ * the file's size and times, such as to compare a changed file with the
+ * content it had when it was last hashed. Digests not cached are empty.
+ *
+ * @param mask A bitwise OR of the osquery-supported hash algorithms.
+ * @param path Filesystem path, the hash target.
+ * @return The cached (hex) representations of the hash digests.
+ */
+MultiHashes getCachedHashes(int mask, const std::string& path);
+}
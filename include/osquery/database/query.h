@@ -26,6 +26,8 @@
 
 namespace osquery {
 
+DECLARE_bool(query_fingerprints);
+
 /// Error message used when a query name isn't found in the database
 extern const std::string kQueryNameNotFoundError;
 
@@ -186,7 +188,7 @@ class Query {
    * @return an instance of osquery::Status indicating the success or failure
    * of the operation
    */
-  osquery::Status addNewResults(const osquery::QueryData& qd, int unix_time);
+  osquery::Status addNewResults(osquery::QueryData qd, int unix_time);
 
  private:
   /**
@@ -204,7 +206,7 @@ class Query {
    * @return an instance of osquery::Status indicating the success or failure
    * of the operation
    */
-  osquery::Status addNewResults(const osquery::QueryData& qd,
+  osquery::Status addNewResults(osquery::QueryData qd,
                                 int unix_time,
                                 std::shared_ptr<DBHandle> db);
 
@@ -227,10 +229,35 @@ class Query {
    * @return an instance of osquery::Status indicating the success or failure
    * of the operation
    */
-  osquery::Status addNewResults(const osquery::QueryData& qd,
+  osquery::Status addNewResults(osquery::QueryData qd,
                                 osquery::DiffResults& dr,
                                 int unix_time);
 
+  /**
+   * @brief Get the diff results of a new set of results without storing
+   * them yet.
+   *
+   * The same as addNewResults() with a diff, but the writes storing the
+   * results are added to a batch. The caller writes the batch with
+   * DBHandle::Write once the diff is logged, until then the next results
+   * are diffed against the previous ones again.
+   *
+   * @param qd the QueryData object, which has the results of the query which
+   * you would like to store
+   * @param dr a reference to a DiffResults object, which will be populated
+   * with the difference of the execution which is currently in the database
+   * and the execution you would like to store
+   * @param unix_time the time that the query was executed
+   * @param batch output, the writes storing the results
+   *
+   * @return an instance of osquery::Status indicating the success or failure
+   * of the operation
+   */
+  osquery::Status addNewResults(osquery::QueryData qd,
+                                osquery::DiffResults& dr,
+                                int unix_time,
+                                DBBatch& batch);
+
  private:
   /**
    * @brief Add a new set of results to the persistant storage and get back
@@ -251,12 +278,57 @@ class Query {
    * @return an instance of osquery::Status indicating the success or failure
    * of the operation
    */
-  osquery::Status addNewResults(const osquery::QueryData& qd,
+  osquery::Status addNewResults(osquery::QueryData qd,
                                 osquery::DiffResults& dr,
                                 bool calculate_diff,
                                 int unix_time,
                                 std::shared_ptr<DBHandle> db);
 
+  /// The same as addNewResults(), the writes are added to a batch.
+  osquery::Status addNewResults(osquery::QueryData qd,
+                                osquery::DiffResults& dr,
+                                bool calculate_diff,
+                                int unix_time,
+                                std::shared_ptr<DBHandle> db,
+                                DBBatch& batch);
+
+  /**
+   * @brief Add a new set of results to the persistant storage as row
+   * fingerprints
+   *
+   * This method is used by addNewResults() when query_fingerprints is set.
+   * Only the fingerprints of the results are stored as the query's value,
+   * and only the rows which were added are written. The diff is computed from
+   * fingerprints and only the removed rows are read back.
+   *
+   * The diff merges the sorted fingerprints of the new rows with the stored
+   * list as it is parsed, so memory is bounded by the new results. Added rows
+   * are moved out of qd into the diff.
+   *
+   * @see addNewResults
+   */
+  osquery::Status addNewFingerprints(osquery::QueryData& qd,
+                                     osquery::DiffResults& dr,
+                                     bool calculate_diff,
+                                     int unix_time,
+                                     std::shared_ptr<DBHandle> db,
+                                     DBBatch& batch);
+
+  /**
+   * @brief Read the most recent results to diff against, in compact form
+   *
+   * The rows stored by addNewResults() are decoded without building a Row
+   * each, only the rows removed by the diff are expanded.
+   *
+   * @param results output, the most recent results
+   * @param db the database handle to read from
+   *
+   * @return an instance of osquery::Status, STATUS_NOT_FOUND if the query
+   * has no stored results
+   */
+  osquery::Status getCompactResults(osquery::CompactQueryData& results,
+                                    std::shared_ptr<DBHandle> db);
+
  public:
   /**
    * @brief A getter for the most recent result set for a scheduled query
@@ -303,11 +375,15 @@ class Query {
 
   FRIEND_TEST(QueryTests, test_private_members);
   FRIEND_TEST(QueryTests, test_add_and_get_current_results);
+  FRIEND_TEST(QueryTests, test_add_pending_results);
   FRIEND_TEST(QueryTests, test_is_query_name_in_database);
   FRIEND_TEST(QueryTests, test_get_stored_query_names);
   FRIEND_TEST(QueryTests, test_get_executions);
   FRIEND_TEST(QueryTests, test_get_current_results);
   FRIEND_TEST(QueryTests, test_get_historical_query_results);
   FRIEND_TEST(QueryTests, test_query_name_not_found_in_db);
+  FRIEND_TEST(QueryTests, test_add_fingerprints);
+  FRIEND_TEST(QueryTests, test_add_fingerprints_duplicates);
+  FRIEND_TEST(QueryTests, test_add_unescaped_results);
 };
 }
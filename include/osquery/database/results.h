@@ -10,9 +10,15 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <deque>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <boost/property_tree/ptree.hpp>
@@ -65,6 +71,25 @@ Status serializeRowJSON(const Row& r, std::string& json);
 Status deserializeRow(const boost::property_tree::ptree& tree, Row& r);
 Status deserializeRowJSON(const std::string& json, Row& r);
 
+/**
+ * @brief Append a quoted JSON string to a buffer
+ *
+ * Characters are escaped as boost::property_tree's JSON writer escapes them,
+ * such that the output of both writers is the same.
+ *
+ * @param json the buffer to append to
+ * @param value the unescaped string
+ */
+void appendJSONString(std::string& json, const std::string& value);
+
+/**
+ * @brief Append a Row to a buffer as a JSON object of string values
+ *
+ * @param json the buffer to append to
+ * @param r the Row to write
+ */
+void appendRowJSON(std::string& json, const Row& r);
+
 /////////////////////////////////////////////////////////////////////////////
 // QueryData
 /////////////////////////////////////////////////////////////////////////////
@@ -90,6 +115,167 @@ typedef std::vector<Row> QueryData;
 Status serializeQueryData(const QueryData& q,
                           boost::property_tree::ptree& tree);
 
+/////////////////////////////////////////////////////////////////////////////
+// CompactQueryData
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief The column names shared by the rows of a CompactQueryData
+ *
+ * Each name is stored once and rows refer to their columns by ordinal.
+ * Ordinals follow the sorted order of the names, such that a CompactRow
+ * iterates its columns in the order of the equivalent Row.
+ */
+class RowSchema {
+ public:
+  RowSchema() {}
+
+  /// Create a schema of the distinct names, in any order.
+  explicit RowSchema(std::vector<std::string> names);
+
+  /// The number of columns.
+  size_t size() const { return names_.size(); }
+
+  /// The name of the column at an ordinal.
+  const std::string& name(size_t ordinal) const { return names_[ordinal]; }
+
+  /// The ordinal of a column, or size() if the schema has no such column.
+  size_t ordinal(const std::string& name) const;
+
+ private:
+  std::vector<std::string> names_;
+};
+
+typedef std::shared_ptr<const RowSchema> RowSchemaRef;
+
+/**
+ * @brief A Row stored as a vector of values indexed by column ordinal
+ *
+ * The column names are kept once in the shared RowSchema rather than copied
+ * into a tree node per row. The const accessors mirror those of Row, such
+ * that code reading a Row may read a CompactRow. A row may lack some of its
+ * schema's columns, as rows of a QueryData may.
+ */
+class CompactRow {
+ public:
+  /// A column as a pair of references to its name and value.
+  typedef std::pair<const std::string&, const RowData&> value_type;
+
+  /// Iterates the present columns in the order of the equivalent Row.
+  class const_iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef CompactRow::value_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef value_type reference;
+
+    struct pointer {
+      value_type value;
+      const value_type* operator->() const { return &value; }
+    };
+
+    const_iterator(const CompactRow& row, size_t ordinal)
+        : row_(&row), ordinal_(ordinal) {
+      skipMissing();
+    }
+
+    value_type operator*() const {
+      return value_type(row_->schema_->name(ordinal_),
+                        row_->values_[ordinal_]);
+    }
+
+    pointer operator->() const {
+      pointer p = {**this};
+      return p;
+    }
+
+    const_iterator& operator++() {
+      ++ordinal_;
+      skipMissing();
+      return *this;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return ordinal_ == other.ordinal_;
+    }
+
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    void skipMissing() {
+      while (ordinal_ < row_->values_.size() && !row_->present_[ordinal_]) {
+        ++ordinal_;
+      }
+    }
+
+   private:
+    const CompactRow* row_;
+    size_t ordinal_;
+  };
+
+ public:
+  /// Create a row without values for the columns of a schema.
+  explicit CompactRow(RowSchemaRef schema);
+
+  /// Create a row of the schema from the columns of a Row in the schema.
+  CompactRow(RowSchemaRef schema, const Row& r);
+
+  /// Set the value of the column at an ordinal of the schema.
+  void set(size_t ordinal, RowData value);
+
+  /// Copy the present columns into a Row.
+  Row toRow() const;
+
+  const_iterator begin() const { return const_iterator(*this, 0); }
+  const_iterator end() const { return const_iterator(*this, values_.size()); }
+  const_iterator find(const std::string& column) const;
+
+  size_t count(const std::string& column) const {
+    return (find(column) != end()) ? 1 : 0;
+  }
+
+  /// The value of a present column, throws std::out_of_range as Row does.
+  const RowData& at(const std::string& column) const;
+
+  /// The number of present columns.
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  bool operator==(const CompactRow& other) const;
+  bool operator!=(const CompactRow& other) const { return !(*this == other); }
+
+  /// Compare to a Row with the same columns and values.
+  bool operator==(const Row& r) const;
+  bool operator!=(const Row& r) const { return !(*this == r); }
+
+ private:
+  RowSchemaRef schema_;
+  std::vector<RowData> values_;
+  std::vector<bool> present_;
+  size_t size_;
+};
+
+/**
+ * @brief A QueryData whose rows share one RowSchema
+ *
+ * Results held between query runs, such as the previous results of a
+ * scheduled query while they are diffed, store each column name once.
+ */
+struct CompactQueryData {
+  RowSchemaRef schema;
+  std::vector<CompactRow> rows;
+
+  CompactQueryData() : schema(std::make_shared<RowSchema>()) {}
+
+  /// Create a schema of the columns of q and compact each of its rows.
+  explicit CompactQueryData(const QueryData& q);
+
+  /// Copy the rows into a QueryData.
+  QueryData toQueryData() const;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 // DiffResults
 /////////////////////////////////////////////////////////////////////////////
@@ -143,9 +329,49 @@ Status serializeDiffResults(const DiffResults& d,
  */
 Status serializeDiffResultsJSON(const DiffResults& d, std::string& json);
 
+/**
+ * @brief Append a DiffResults to a buffer as a JSON object
+ *
+ * The rows are written directly from d, without a property tree.
+ *
+ * @param json the buffer to append to
+ * @param d the DiffResults to write
+ */
+void appendDiffResultsJSON(std::string& json, const DiffResults& d);
+
+/**
+ * @brief Compute a 64-bit fingerprint of a Row
+ *
+ * Equal rows have equal fingerprints. Different rows rarely collide, callers
+ * needing exact results must compare rows with equal fingerprints.
+ *
+ * @param r the Row to fingerprint
+ *
+ * @return the fingerprint of the column names and values of r
+ */
+uint64_t getRowFingerprint(const Row& r);
+
+/// The fingerprint of a CompactRow, equal to that of the equivalent Row.
+uint64_t getRowFingerprint(const CompactRow& r);
+
+/**
+ * @brief Compute a 64-bit fingerprint of the rows of a QueryData
+ *
+ * The row fingerprints are combined independent of the rows' order, equal
+ * results generated in any order have equal fingerprints.
+ *
+ * @param qd the QueryData to fingerprint
+ *
+ * @return the fingerprint of the rows of qd
+ */
+uint64_t getQueryDataFingerprint(const QueryData& qd);
+
 /**
  * @brief Diff two QueryData objects and create a DiffResults object
  *
+ * Rows are matched by fingerprint in linear time. Added rows keep their
+ * order within new_, and removed rows their order within old_.
+ *
  * @param old_ the "old" set of results
  * @param new_ the "new" set of results
  *
@@ -155,6 +381,14 @@ Status serializeDiffResultsJSON(const DiffResults& d, std::string& json);
  */
 DiffResults diff(const QueryData& old_, const QueryData& new_);
 
+/**
+ * @brief Diff compact previous results and a new QueryData
+ *
+ * The result equals that of diffing the equivalent QueryData, only removed
+ * rows are copied out of old_.
+ */
+DiffResults diff(const CompactQueryData& old_, const QueryData& new_);
+
 /////////////////////////////////////////////////////////////////////////////
 // HistoricalQueryResults
 /////////////////////////////////////////////////////////////////////////////
@@ -242,6 +476,161 @@ Status deserializeHistoricalQueryResults(
 Status deserializeHistoricalQueryResultsJSON(const std::string& json,
                                              HistoricalQueryResults& r);
 
+/////////////////////////////////////////////////////////////////////////////
+// Binary encoding
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief The version of the binary encoding of results stored in RocksDB
+ *
+ * Binary encoded values begin with a NUL, "osq" and this version. Strings are
+ * prefixed by their varint length. QueryData stores each column name once,
+ * rows refer to columns by their index.
+ */
+extern const unsigned char kBinaryEncodingVersion;
+
+/**
+ * @brief Serialize a Row into the binary encoding used within RocksDB
+ *
+ * @param r the Row to serialize
+ * @param data output, the encoded Row
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation
+ */
+Status serializeRowBinary(const Row& r, std::string& data);
+
+/**
+ * @brief Encode a Row into the binary encoding one column at a time
+ *
+ * Event subscribers write typed columns straight into the stored encoding,
+ * rather than building a Row and stringifying numbers before serializing it.
+ * The column count is known up front, deserializeRowBinary reads the result
+ * as the equivalent Row.
+ */
+class RowEncoder {
+ public:
+  /// Start the encoding of a row with a number of columns.
+  explicit RowEncoder(size_t columns);
+
+  /// Add a TEXT column.
+  RowEncoder& add(const std::string& column, const std::string& value);
+
+  /// Add an integer column, formatted in decimal without a temporary string.
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value, RowEncoder&>::type add(
+      const std::string& column, T value) {
+    bool negative = std::is_signed<T>::value && value < 0;
+    auto magnitude = (negative) ? 0 - (unsigned long long)value
+                                : (unsigned long long)value;
+    return addInteger(column, negative, magnitude);
+  }
+
+  /// Check if every column of the row was added.
+  bool complete() const { return added_ == columns_; }
+
+  /// The binary encoded Row.
+  const std::string& data() const { return data_; }
+
+ private:
+  RowEncoder& addInteger(const std::string& column,
+                         bool negative,
+                         unsigned long long magnitude);
+
+ private:
+  std::string data_;
+  size_t columns_;
+  size_t added_;
+};
+
+/**
+ * @brief Deserialize a Row stored within RocksDB
+ *
+ * Rows stored as JSON before the binary encoding are also accepted.
+ *
+ * @param data the binary encoded or JSON Row
+ * @param r output, the deserialized Row
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation
+ */
+Status deserializeRowBinary(const std::string& data, Row& r);
+
+/**
+ * @brief Serialize a HistoricalQueryResults into the binary encoding
+ *
+ * @param r the HistoricalQueryResults to serialize
+ * @param data output, the encoded HistoricalQueryResults
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation
+ */
+Status serializeHistoricalQueryResultsBinary(const HistoricalQueryResults& r,
+                                             std::string& data);
+
+/**
+ * @brief Deserialize a HistoricalQueryResults stored within RocksDB
+ *
+ * Results stored as JSON before the binary encoding are also accepted.
+ *
+ * @param data the binary encoded or JSON HistoricalQueryResults
+ * @param r output, the deserialized HistoricalQueryResults
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation
+ */
+Status deserializeHistoricalQueryResultsBinary(const std::string& data,
+                                               HistoricalQueryResults& r);
+
+/**
+ * @brief Deserialize a HistoricalQueryResults into CompactQueryData
+ *
+ * The stored column names become the schema, rows are decoded without
+ * building a Row for each.
+ *
+ * @param data the binary encoded or JSON HistoricalQueryResults
+ * @param time output, the time of the stored results
+ * @param results output, the stored results
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation
+ */
+Status deserializeHistoricalQueryResultsBinary(const std::string& data,
+                                               int& time,
+                                               CompactQueryData& results);
+
+/**
+ * @brief Serialize a batch of rows column by column
+ *
+ * Used to move generated table rows across a registry boundary. Each
+ * column's distinct values are written once, followed by an index per row,
+ * such that repeated values (e.g., paths, users, states) are sent once per
+ * batch. Only the listed columns are encoded, values missing from a row
+ * remain missing when deserialized.
+ *
+ * @param columns the column names to encode
+ * @param q the rows to serialize
+ * @param begin the first row of q in the batch
+ * @param end one past the last row of q in the batch
+ * @param data output, the encoded batch
+ */
+void serializeQueryDataColumnar(const std::vector<std::string>& columns,
+                                const QueryData& q,
+                                size_t begin,
+                                size_t end,
+                                std::string& data);
+
+/**
+ * @brief Deserialize a batch of rows encoded column by column
+ *
+ * @param data the encoded batch
+ * @param q output, the rows are appended
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation
+ */
+Status deserializeQueryDataColumnar(const std::string& data, QueryData& q);
+
 /**
  * @brief Add a Row to a QueryData if the Row hasn't appeared in the QueryData
  * already
@@ -258,17 +647,72 @@ Status deserializeHistoricalQueryResultsJSON(const std::string& json,
  */
 bool addUniqueRowToQueryData(QueryData& q, const Row& r);
 
+/// A scheduled query's results, see osquery/scheduler.h.
+struct ScheduledQueryLogItem;
+
+/// The version of the binary log frame encoding.
+extern const unsigned char kLogFrameVersion;
+
+/// A log frame flag, the frame's payload is deflated with zlib.
+extern const unsigned char kLogFrameCompressed;
+
 /**
- * @brief Construct a new QueryData from an existing one, replacing all
- * non-ascii characters with their \u encoding.
+ * @brief Serialize a log item's dictionary and item records for a frame.
  *
- * This function is intended as a workaround for
- * https://svn.boost.org/trac/boost/ticket/8883,
- * and will allow rows containing data with non-ascii characters to be stored in
- * the database and parsed back into a property tree.
- *
- * @param oldData the old QueryData to copy
- * @param newData the new escaped QueryData object
+ * The records do not depend on earlier items, a LogItemFrameEncoder makes
+ * them a frame for one stream.
+ */
+Status serializeLogItemFrameRecords(const ScheduledQueryLogItem& item,
+                                    std::string& records);
+
+/**
+ * @brief Encodes ScheduledQueryLogItems as length-prefixed binary frames.
+ *
+ * A frame is "OSQF", the version, a flags byte, the payload's varint length
+ * and the payload. A compressed payload begins with its varint inflated
+ * length. The payload is a list of records:
+ *
+ *   'D' name, column count, column names: a query's column dictionary.
+ *   'I' name, hostIdentifier, calendarTime, unixTime, the added and removed
+ *       row counts and the rows, each as one value per dictionary column.
+ *
+ * Numbers are varints and strings are varint length-prefixed. A value is a
+ * tag, 0 for a missing column, 1 before a string or 2 before an integer as
+ * a zigzag varint. A dictionary is written before a query's first item,
+ * when its columns change and periodically, such that a reader may start
+ * at any frame after a rotation. tools/decode_log_frames.py writes frames
+ * as JSON log items.
+ *
+ * Whether a dictionary is written depends on the frames already in a
+ * stream, so each logger receiver has its own encoder. Results are logged as
+ * the records of serializeLogItemFrameRecords, which receivers encode.
  */
-void escapeQueryData(const osquery::QueryData &oldData, osquery::QueryData &newData);
+class LogItemFrameEncoder {
+ public:
+  explicit LogItemFrameEncoder(bool compress = false) : compress_(compress) {}
+
+  /// Encode a log item as one frame, with its dictionary if needed.
+  Status encode(const ScheduledQueryLogItem& item, std::string& frame);
+
+  /// Encode the records of a log item as one frame.
+  Status encode(const std::string& records, std::string& frame);
+
+  /// Forget the written dictionaries, such as when a new stream starts.
+  void reset();
+
+  /// Check if a logged string holds records to encode.
+  static bool isRecords(const std::string& records);
+
+ private:
+  /// A query's dictionary record and the items encoded since it was written.
+  struct Dictionary {
+    std::string record;
+    size_t items;
+  };
+
+ private:
+  bool compress_;
+  std::map<std::string, Dictionary> dictionaries_;
+  std::mutex mutex_;
+};
 }
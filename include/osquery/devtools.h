@@ -10,9 +10,12 @@
 
 #pragma once
 
+#include <ostream>
 #include <string>
 
 #include <osquery/database/results.h>
+#include <osquery/scheduler.h>
+#include <osquery/tables.h>
 
 namespace osquery {
 
@@ -37,6 +40,63 @@ namespace osquery {
  */
 int launchIntoShell(int argc, char** argv);
 
+/// The cost of running a scheduled query once.
+struct QueryCost {
+  std::string name;
+  /// The seconds between scheduled runs.
+  int interval;
+  double wall_ms;
+  /// The user and system CPU time of the process while the query ran.
+  double cpu_ms;
+  /// The CPU time an hour of scheduled runs is expected to use.
+  double hourly_cpu_ms;
+  size_t rows;
+  /// The bytes read and written, and the read and write syscalls (Linux).
+  size_t io_bytes;
+  size_t syscalls;
+  /// The tables generating every row, without a constraint.
+  std::vector<std::string> scans;
+  /// The cost of each virtual table the query used, and the constraints
+  /// each table's generator was given.
+  tables::QueryProfile tables;
+
+  QueryCost()
+      : interval(0),
+        wall_ms(0),
+        cpu_ms(0),
+        hourly_cpu_ms(0),
+        rows(0),
+        io_bytes(0),
+        syscalls(0) {}
+};
+
+/**
+ * @brief Run a scheduled query once and measure its cost.
+ *
+ * @param query the scheduled query to run.
+ * @param cost [output] the measured cost.
+ *
+ * @return the status of the query, a query that fails has no cost.
+ */
+Status measureQueryCost(const OsqueryScheduledQuery& query, QueryCost& cost);
+
+/**
+ * @brief The bytes read and written and the read and write syscalls so far.
+ *
+ * The counters are read from /proc/self/io and are 0 on other platforms.
+ */
+void getIOCounters(size_t& bytes, size_t& syscalls);
+
+/**
+ * @brief Run each configured scheduled query once and print its cost.
+ *
+ * Queries are flagged when an hour of their scheduled runs is expected to use
+ * more than `--profile_budget_ms` of CPU time.
+ *
+ * @return 1 if a query failed or was over budget, otherwise 0.
+ */
+int profileScheduledQueries();
+
 /**
  * @brief Generate a pretty representation of a QueryData object
  *
@@ -66,6 +126,50 @@ void prettyPrint(const QueryData& q, const std::vector<std::string>& order);
  */
 void jsonPrint(const QueryData& q);
 
+/**
+ * @brief Pretty print rows as they are returned.
+ *
+ * The column widths are computed from the first sample rows, which are then
+ * printed along with every following row as it is added. A later row wider
+ * than a column widens it and repeats the header, so only the sample rows
+ * are held in memory.
+ */
+class PrettyPrinter {
+ public:
+  explicit PrettyPrinter(std::ostream& out) : out_(out) {}
+
+  /**
+   * @brief Start printing the results of a query.
+   *
+   * @param order The order of the keys (since maps are unordered)
+   * @param sample_rows The rows used to size columns, 0 to buffer every row
+   */
+  void begin(const std::vector<std::string>& order, size_t sample_rows);
+
+  /// Print (or, while sampling, hold) a row of the current query.
+  void addRow(const Row& r);
+
+  /// Print any held rows and the closing separator of the current query.
+  void finish();
+
+  /// True if begin was called without a following finish.
+  bool begun() const { return begun_; }
+
+ private:
+  /// Size the columns from the held rows and print them.
+  void printSample();
+
+ private:
+  std::ostream& out_;
+  std::vector<std::string> order_;
+  std::map<std::string, int> lengths_;
+  std::string separator_;
+  QueryData sample_;
+  size_t sample_rows_{0};
+  bool begun_{false};
+  bool printing_{false};
+};
+
 /**
  * @brief Compute a map of metadata about the supplied QueryData object
  *
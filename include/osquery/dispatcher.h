@@ -10,9 +10,16 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #ifdef FBOSQUERY
@@ -37,12 +44,128 @@ namespace osquery {
  */
 extern const int kDefaultThreadPoolSize;
 
+/**
+ * @brief A move-only callable run by the Dispatcher's workers.
+ *
+ * Callables of up to kInlineSize bytes, such as lambdas capturing a few
+ * pointers or a shared_ptr, are stored within the task. Adding them to the
+ * Dispatcher does not allocate. Larger callables are moved to the heap.
+ */
+class DispatcherTask {
+ public:
+  /// The bytes of a callable stored without an allocation.
+  static const size_t kInlineSize = 64;
+
+  DispatcherTask() : ops_(nullptr) {}
+
+  template <class F,
+            class T = typename std::decay<F>::type,
+            class = typename std::enable_if<
+                !std::is_same<T, DispatcherTask>::value>::type,
+            class = decltype(std::declval<T&>()())>
+  DispatcherTask(F&& f)
+      : ops_(nullptr) {
+    emplace<T>(std::forward<F>(f));
+  }
+
+  DispatcherTask(DispatcherTask&& other) : ops_(nullptr) { take(other); }
+
+  DispatcherTask& operator=(DispatcherTask&& other) {
+    if (this != &other) {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+
+  ~DispatcherTask() { reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  void operator()() { ops_->invoke(&storage_); }
+
+ private:
+  typedef std::aligned_storage<kInlineSize>::type Storage;
+
+  struct Ops {
+    void (*invoke)(void*);
+    void (*move)(void* from, void* to);
+    void (*destroy)(void*);
+  };
+
+  /// Operations on a callable stored within the task.
+  template <class T>
+  struct Inline {
+    static void invoke(void* p) { (*(T*)p)(); }
+    static void move(void* from, void* to) {
+      new (to) T(std::move(*(T*)from));
+      ((T*)from)->~T();
+    }
+    static void destroy(void* p) { ((T*)p)->~T(); }
+    static const Ops* ops() {
+      static const Ops ops = {&invoke, &move, &destroy};
+      return &ops;
+    }
+  };
+
+  /// Operations on a callable too large to store within the task.
+  template <class T>
+  struct Heap {
+    static void invoke(void* p) { (**(T**)p)(); }
+    static void move(void* from, void* to) { *(T**)to = *(T**)from; }
+    static void destroy(void* p) { delete *(T**)p; }
+    static const Ops* ops() {
+      static const Ops ops = {&invoke, &move, &destroy};
+      return &ops;
+    }
+  };
+
+  template <class T, class F>
+  void emplace(F&& f) {
+    if (sizeof(T) <= sizeof(Storage) &&
+        std::alignment_of<T>::value <= std::alignment_of<Storage>::value) {
+      new (&storage_) T(std::forward<F>(f));
+      ops_ = Inline<T>::ops();
+    } else {
+      *(T**)&storage_ = new T(std::forward<F>(f));
+      ops_ = Heap<T>::ops();
+    }
+  }
+
+  void take(DispatcherTask& other) {
+    if (other.ops_ != nullptr) {
+      other.ops_->move(&other.storage_, &storage_);
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+
+  void reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+ private:
+  DispatcherTask(const DispatcherTask&);
+  void operator=(const DispatcherTask&);
+
+ private:
+  Storage storage_;
+  const Ops* ops_;
+};
+
 /**
  * @brief Singleton for queueing asynchronous tasks to be executed in parallel
  *
  * Dispatcher is a singleton which can be used to coordinate the parallel
- * execution of asynchronous tasks across an application. Internally,
- * Dispatcher is back by the Apache Thrift thread pool.
+ * execution of asynchronous tasks across an application.
+ *
+ * Each worker thread owns a deque of tasks. Tasks added by a worker, such as
+ * the per-file work of a directory hash, are pushed to and run from the back
+ * of its own deque. Idle workers steal from the front of other deques, and
+ * tasks added by other threads are shared through one queue.
  */
 class Dispatcher {
  public:
@@ -89,37 +212,42 @@ class Dispatcher {
   Status add(std::shared_ptr<apache::thrift::concurrency::Runnable> task);
 
   /**
-   * @brief Getter for the underlying thread manager instance.
-   *
-   * Use this getter if you'd like to perform some operations which the
-   * Dispatcher API doesn't support, but you are certain are supported by the
-   * backing Apache Thrift thread manager.
-   *
-   * Use this method with caution, as it only exists to allow developers to
-   * iterate quickly in the event that the pragmatic decision to access the
-   * underlying thread manager has been determined to be necessary.
+   * @brief add a callable task to the dispatcher.
    *
    * @code{.cpp}
-   *   auto t = osquery::Dispatcher::getInstance()->getThreadManager();
+   *   int i = 5;
+   *   osquery::Dispatcher::getInstance().add([&i]() { ++i; });
    * @endcode
    *
-   * @return a shared pointer to the Apache Thrift `ThreadManager` instance
-   * which is currently being used to orchestrate multi-threaded operations.
+   * @param task a callable, see DispatcherTask. The task is only moved from
+   * if it was added.
+   *
+   * @return an instance of osquery::Status, indicating the success or failure
+   * of the operation.
+   */
+  Status add(DispatcherTask&& task);
+
+  /**
+   * @brief Run one pending task on the calling thread, if there is one.
+   *
+   * Threads waiting for the completion of tasks (see TaskGroup::wait) help
+   * run them, such that workers waiting on nested tasks do not deadlock.
+   *
+   * @return true if a task was run.
    */
-  std::shared_ptr<apache::thrift::concurrency::ThreadManager>
-  getThreadManager();
+  bool runPending();
 
   /**
-   * @brief Joins the thread manager.
+   * @brief Joins the worker threads.
    *
-   * This is the same as stop, except that it will block until all the workers
-   * have finished their work. At that point the ThreadManager will transition
-   * into the STOPPED state.
+   * This will block until all the pending tasks have been run and the
+   * workers have exited. At that point the Dispatcher will transition into
+   * the STOPPED state and no longer accept tasks.
    */
   void join();
 
   /**
-   * @brief Get the current state of the thread manager.
+   * @brief Get the current state of the workers.
    *
    * @return an Apache Thrift STATE enum.
    */
@@ -182,7 +310,7 @@ class Dispatcher {
   /**
    * @brief Gets the maximum pending task count. 0 indicates no maximum.
    *
-   * @return the maximum pending task count. 0 indicates no maximum.
+   * @return the maximum pending task count, always 0.
    */
   size_t pendingTaskCountMax() const;
 
@@ -190,7 +318,7 @@ class Dispatcher {
    * @brief Gets the number of tasks which have been expired without being
    * run.
    *
-   * @return he number of tasks which have been expired without being run.
+   * @return the number of tasks which have been expired, always 0.
    */
   size_t expiredTaskCount() const;
 
@@ -203,17 +331,114 @@ class Dispatcher {
    */
   Dispatcher();
 
+  /// Stops and joins the workers without running pending tasks.
+  ~Dispatcher();
+
+  /// A worker thread and the deque of tasks it added.
+  struct Worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::deque<DispatcherTask> tasks;
+  };
+
+  /// The loop of the worker at an index of workers_.
+  void work(size_t index);
+
+  /// Take a task from a worker's own deque, the shared queue, or a steal.
+  bool take(int index, DispatcherTask& task);
+
+  /// Run a taken task.
+  void run(DispatcherTask& task);
+
+  /// Signal workers to exit and join them.
+  void stop();
+
  private:
-  /**
-   * @brief Internal shared pointer which references Thrift's thread manager
-   *
-   * All thread operations occur via Apache Thrift's ThreadManager class. This
-   * private member represents a shared pointer to an instantiation os that
-   * thread manager, which can be used to accomplish various threading
-   * objectives.
-   *
-   * @see getThreadManager
-   */
-  std::shared_ptr<apache::thrift::concurrency::ThreadManager> thread_manager_;
+  /// The maximum number of workers started over the Dispatcher's life.
+  static const size_t kMaxWorkers = 64;
+
+  /// Worker slots are allocated up front, stealing reads them unlocked.
+  std::vector<std::unique_ptr<Worker> > workers_;
+  /// The number of slots in workers_ that have been started.
+  std::atomic<size_t> started_;
+
+  /// Tasks added by threads that are not workers.
+  std::deque<DispatcherTask> shared_;
+  /// The size of shared_, read by workers before locking it.
+  std::atomic<size_t> shared_count_;
+
+  /// Protects shared_, the state, and worker sleep and exit.
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+
+  apache::thrift::concurrency::ThreadManager::STATE state_;
+  std::atomic<size_t> queued_;
+  std::atomic<size_t> running_;
+  std::atomic<size_t> idle_;
+  std::atomic<size_t> active_;
+  /// Workers requested to exit by removeWorker.
+  size_t retiring_;
+};
+
+/**
+ * @brief A set of Dispatcher tasks that may be waited on.
+ *
+ * @code{.cpp}
+ *   TaskGroup group;
+ *   for (const auto& pid : pids) {
+ *     group.run([&pid, &results]() { readProcess(pid, results[pid]); });
+ *   }
+ *   group.wait();
+ * @endcode
+ *
+ * The thread waiting runs pending tasks, so groups may be waited on from
+ * within tasks. A group waits for its tasks when it is destroyed.
+ */
+class TaskGroup {
+ public:
+  TaskGroup() : pending_(0) {}
+  ~TaskGroup() { wait(); }
+
+  /// Add a callable to the Dispatcher as part of this group.
+  template <class F>
+  void run(F&& f) {
+    pending_++;
+    DispatcherTask task(
+        GroupTask<typename std::decay<F>::type>(this, std::forward<F>(f)));
+    if (!Dispatcher::getInstance().add(std::move(task)).ok()) {
+      // A stopped Dispatcher does not accept tasks, run it inline.
+      task();
+    }
+  }
+
+  /// Wait for every task added to the group to complete.
+  void wait();
+
+ private:
+  template <class T>
+  struct GroupTask {
+    template <class F>
+    GroupTask(TaskGroup* group, F&& f)
+        : group(group), f(std::forward<F>(f)) {}
+
+    void operator()() {
+      f();
+      group->done();
+    }
+
+    TaskGroup* group;
+    T f;
+  };
+
+  void done();
+
+ private:
+  TaskGroup(const TaskGroup&);
+  void operator=(const TaskGroup&);
+
+ private:
+  std::atomic<size_t> pending_;
+  std::mutex mutex_;
+  std::condition_variable complete_;
 };
 }
@@ -10,16 +10,22 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <map>
+#include <set>
 #include <vector>
 
 #include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include <osquery/config.h>
 #include <osquery/database.h>
 #include <osquery/registry.h>
 #include <osquery/status.h>
@@ -27,6 +33,12 @@
 
 namespace osquery {
 
+DECLARE_int32(event_pubsub_expiry);
+DECLARE_int32(event_pubsub_queue_size);
+DECLARE_int32(event_pubsub_coalesce_ms);
+DECLARE_int32(event_pubsub_memory_bytes);
+DECLARE_int32(event_pubsub_memory_seconds);
+
 struct Subscription;
 template <class SC, class EC> class EventPublisher;
 template <class PUB> class EventSubscriber;
@@ -37,7 +49,15 @@ typedef const std::string EventSubscriberID;
 typedef const std::string EventID;
 typedef uint32_t EventContextID;
 typedef uint32_t EventTime;
-typedef std::pair<EventID, EventTime> EventRecord;
+
+/// Upper bounds, in microseconds, of the event write latency histogram.
+extern const std::vector<size_t> kEventLatencyBounds;
+
+/// A bucket per bound and a last bucket for writes slower than every bound.
+const size_t kEventLatencyBuckets = 6;
+
+/// The most legacy events moved to a subscriber's domain by each batch.
+const size_t kEventMigrateChunkSize = 4096;
 
 /**
  * @brief An EventPublisher will define a SubscriptionContext for
@@ -68,8 +88,10 @@ struct EventContext {
   EventContextID id;
   /// The time the event occurred.
   EventTime time;
-  /// The string representation of the time, often used for indexing.
-  std::string time_string;
+  /// The number of identical events coalesced into this EventContext.
+  size_t count;
+
+  EventContext() : id(0), time(0), count(1) {}
 };
 
 typedef std::shared_ptr<Subscription> SubscriptionRef;
@@ -86,9 +108,6 @@ typedef std::function<Status(const EventContextRef&)> EventCallback;
 /// An EventPublisher must track every subscription added.
 typedef std::vector<SubscriptionRef> SubscriptionVector;
 
-/// The set of search-time binned lookup tables.
-extern const std::vector<size_t> kEventTimeLists;
-
 /**
  * @brief DECLARE_PUBLISHER supplies needed boilerplate code that applies a
  * string-type EventPublisherID to identify the publisher declaration.
@@ -185,6 +204,24 @@ class EventPublisherPlugin : public Plugin {
    */
   virtual Status run() { return Status(1, "No runloop required"); }
 
+  /**
+   * @brief A readable descriptor multiplexed by the shared event reactor.
+   *
+   * Publishers with a descriptor are not given a run loop thread. Instead the
+   * EventFactory reactor calls `process` whenever the descriptor is readable.
+   *
+   * @return A pollable file descriptor, or -1 to use a `run` loop thread.
+   */
+  virtual int getDescriptor() { return -1; }
+
+  /**
+   * @brief Handle a readable descriptor without blocking.
+   *
+   * @return A FAILED status removes the descriptor from the reactor and
+   * tears down the EventPublisher, as a failed `run` would.
+   */
+  virtual Status process() { return Status(1, "No descriptor to process"); }
+
   /**
    * @brief A new EventSubscriber is subscriptioning events of this
    * EventPublisher.
@@ -195,10 +232,20 @@ class EventPublisherPlugin : public Plugin {
    * @return If the Subscription is not appropriate (mismatched type) fail.
    */
   virtual Status addSubscription(const SubscriptionRef& subscription) {
+    boost::lock_guard<boost::mutex> lock(subscription_lock_);
     subscriptions_.push_back(subscription);
     return Status(0, "OK");
   }
 
+  /**
+   * @brief Remove every Subscription using a SubscriptionContext.
+   *
+   * @param sc The SubscriptionContext of the Subscription%s to remove.
+   *
+   * @return Fail if no Subscription used the SubscriptionContext.
+   */
+  virtual Status removeSubscription(const SubscriptionContextRef& sc);
+
   /**
    * @brief The generic check loop to call SubscriptionContext callback methods.
    *
@@ -211,7 +258,10 @@ class EventPublisherPlugin : public Plugin {
   void fire(const EventContextRef& ec, EventTime time = 0);
 
   /// Number of Subscription%s watching this EventPublisher.
-  size_t numSubscriptions() const { return subscriptions_.size(); }
+  size_t numSubscriptions() const {
+    boost::lock_guard<boost::mutex> lock(subscription_lock_);
+    return subscriptions_.size();
+  }
 
   /**
    * @brief The number of events fired by this EventPublisher.
@@ -220,8 +270,28 @@ class EventPublisherPlugin : public Plugin {
    */
   size_t numEvents() const { return next_ec_id_; }
 
+  /**
+   * @brief Deliver coalesced events whose coalescing window has elapsed.
+   *
+   * The EventFactory calls this after each step of a publisher's run loop so
+   * a burst is delivered once the publisher becomes quiet.
+   *
+   * @param force Deliver every pending event regardless of the window.
+   */
+  void flushCoalesced(bool force = false);
+
+  /// The number of fired events merged into a pending EventContext.
+  size_t numCoalesced() const { return coalesced_events_; }
+
+  /// Check if fired events are waiting in a coalescing window.
+  bool hasCoalesced();
+
+  /// The number of times events were lost by the publisher's event source.
+  virtual size_t numOverflows() const { return 0; }
+
   /// Overriding the EventPublisher constructor is not recommended.
-  EventPublisherPlugin() : next_ec_id_(0), ending_(false), started_(false) {};
+  EventPublisherPlugin()
+      : next_ec_id_(0), ending_(false), started_(false), coalesced_events_(0) {}
   virtual ~EventPublisherPlugin() {}
 
   /// Return a string identifier associated with this EventPublisher.
@@ -237,9 +307,52 @@ class EventPublisherPlugin : public Plugin {
   virtual void fireCallback(const SubscriptionRef& sub,
                             const EventContextRef& ec) const = 0;
 
+  /**
+   * @brief Optionally key a fired EventContext for coalescing.
+   *
+   * Events fired with an equal, non-empty key within the coalescing window
+   * (event_pubsub_coalesce_ms) are merged into the first pending EventContext
+   * and its `count` is incremented. The default never coalesces.
+   *
+   * @param ec The EventContext fired by this EventPublisher.
+   * @return A key identifying duplicate events, empty to deliver immediately.
+   */
+  virtual std::string getCoalesceKey(const EventContextRef& ec) const {
+    return "";
+  }
+
+  /**
+   * @brief Optionally route a fired EventContext to candidate Subscription%s.
+   *
+   * Publishers with many Subscription%s may index them, such that each event
+   * is checked by `shouldFire` only for those that could match it.
+   *
+   * @param ec The EventContext fired by this EventPublisher.
+   * @param subscriptions output, the candidate Subscription%s.
+   * @return true if routed, otherwise every Subscription is checked.
+   */
+  virtual bool routeEvent(const EventContextRef& ec,
+                          SubscriptionVector& subscriptions) {
+    return false;
+  }
+
+  /**
+   * @brief A copy of the Subscription%s, safe to iterate.
+   *
+   * Subscription%s may be removed while the publisher configures itself or
+   * fires events, iterate the copy rather than subscriptions_.
+   */
+  SubscriptionVector getSubscriptions() const {
+    boost::lock_guard<boost::mutex> lock(subscription_lock_);
+    return subscriptions_;
+  }
+
   /// The EventPublisher will keep track of Subscription%s that contain callins.
   SubscriptionVector subscriptions_;
 
+  /// Lock used when adding, removing or copying Subscription%s.
+  mutable boost::mutex subscription_lock_;
+
   /// An Event ID is assigned by the EventPublisher within the EventContext.
   /// This is not used to store event date in the backing store.
   EventContextID next_ec_id_;
@@ -257,6 +370,18 @@ class EventPublisherPlugin : public Plugin {
   /// A lock for incrementing the next EventContextID.
   boost::mutex ec_id_lock_;
 
+  /// Call each Subscription's callback for a (possibly coalesced) event.
+  void deliver(const EventContextRef& ec);
+
+  /// Pending coalesced events and the time their window started.
+  std::map<std::string,
+           std::pair<EventContextRef, std::chrono::steady_clock::time_point> >
+      coalesced_;
+  /// The number of events merged into pending coalesced events.
+  std::atomic<size_t> coalesced_events_;
+  /// A lock protecting the pending coalesced events.
+  boost::mutex coalesce_lock_;
+
  private:
   FRIEND_TEST(EventsTests, test_event_pub);
   FRIEND_TEST(EventsTests, test_fire_event);
@@ -401,6 +526,17 @@ class EventFactory {
   /// Once the event publisher has been down-casted, call it's API.
   static Status registerEventPublisher(const EventPublisherRef& pub);
 
+  /**
+   * @brief Add several EventPublisher%s, setting them up concurrently.
+   *
+   * Publishers whose setUp fails are not added, as with
+   * registerEventPublisher.
+   *
+   * @param pubs the publishers to set up and add.
+   */
+  static void registerEventPublishers(
+      const std::vector<EventPublisherRef>& pubs);
+
   /**
    * @brief Add an EventSubscriber to the factory.
    *
@@ -464,6 +600,20 @@ class EventFactory {
   static Status addSubscription(EventPublisherID& type_id,
                                 const SubscriptionRef& subscription);
 
+  /**
+   * @brief Remove the Subscription%s using a SubscriptionContext.
+   *
+   * The EventPublisher is configured afterward, and applies only the
+   * difference to the resources it monitors.
+   *
+   * @param type_id The string for the EventPublisher holding the Subscription.
+   * @param mc The SubscriptionContext used to add the Subscription.
+   *
+   * @return Was a Subscription using the SubscriptionContext removed.
+   */
+  static Status removeSubscription(EventPublisherID& type_id,
+                                   const SubscriptionContextRef& mc);
+
   /// Get the total number of Subscription%s across ALL EventPublisher%s.
   static size_t numSubscriptions(EventPublisherID& type_id);
 
@@ -504,6 +654,25 @@ class EventFactory {
   /// An initializer's entrypoint for spawning all event type run loops.
   static void delay();
 
+  /**
+   * @brief The shared event reactor's entrypoint.
+   *
+   * EventPublisher%s with a descriptor are multiplexed on a single epoll set
+   * and `process`ed when readable, rather than each polling in a thread.
+   *
+   * @param publishers The EventPublisher%s with a pollable descriptor.
+   */
+  static Status runReactor(std::vector<EventPublisherRef> publishers);
+
+  /**
+   * @brief The expiration thread's entrypoint.
+   *
+   * Every event_pubsub_expiry_interval seconds each EventSubscriber removes
+   * the events older than event_pubsub_expiry, such that queries only read
+   * the backing store and hosts that are never queried stay bounded.
+   */
+  static void runExpiration();
+
   /// If a static EventPublisher callback wants to fire
   template <typename PUB>
   static void fire(const EventContextRef& ec) {
@@ -536,6 +705,18 @@ class EventFactory {
 
   /// Set of running EventPublisher run loop threads.
   std::vector<std::shared_ptr<boost::thread> > threads_;
+
+  /// Lock used when waiting between and ending event expirations.
+  boost::mutex expiration_lock_;
+
+  /// Signaled when the expiration thread should end.
+  boost::condition_variable expiration_cv_;
+
+  /// True when the expiration thread should end.
+  bool expiration_ending_{false};
+
+  /// An eventfd written to wake and end the event reactor.
+  int reactor_wake_{-1};
 };
 
 class EventSubscriberPlugin : public Plugin {
@@ -557,31 +738,39 @@ class EventSubscriberPlugin : public Plugin {
    */
   virtual Status add(const osquery::Row& r, EventTime time) final;
 
+  /**
+   * @brief Store an event encoded column by column.
+   *
+   * Identical to adding a Row, without building and serializing the Row.
+   * Subscribers write the typed EventContext fields into the RowEncoder.
+   *
+   * @param row The encoded row, every column must be added.
+   * @param time The time the added event occurred.
+   *
+   * @return Was the element added to the backing store.
+   */
+  Status add(const RowEncoder& row, EventTime time);
+
   /**
    * @brief Return all events added by this EventSubscriber within start, stop.
    *
    * This is used internally (for the most part) by EventSubscriber::genTable.
    *
+   * Reads from a snapshot agree with the other reads of the snapshot, such
+   * as the events of other subscribers. They do not flush the event queue
+   * or use the recent events, events queued when it was taken are not read.
+   * genTable reads the snapshot of the query's EventWindow, if it has one.
+   *
    * @param start Inclusive lower bound time limit.
    * @param stop Inclusive upper bound time limit.
+   * @param snapshot An optional backing store snapshot to read from.
    * @return Set of event rows matching time limits.
    */
-  virtual QueryData get(EventTime start, EventTime stop);
+  virtual QueryData get(EventTime start,
+                        EventTime stop,
+                        const DBSnapshotRef& snapshot = nullptr);
 
  private:
-  /*
-   * @brief When `get`ting event results, return EventID%s from time indexes.
-   *
-   * Used by EventSubscriber::get to retrieve EventID, EventTime indexes. This
-   * applies the lookup-efficiency checks for time list appropriate bins.
-   * If the time range in 24 hours and there is a 24-hour list bin it will
-   * be queried using a single backing store `Get` followed by two `Get`s of
-   * the most-specific boundary lists.
-   *
-   * @return List of EventID, EventTime%s
-   */
-  std::vector<EventRecord> getRecords(const std::vector<std::string>& indexes);
-
   /**
    * @brief Get a unique storage-related EventID.
    *
@@ -593,50 +782,110 @@ class EventSubscriberPlugin : public Plugin {
    * indexing is required within-EventCallback consider an
    * EventSubscriber%-unique indexing, counting mechanic.
    *
-   * @return A unique ID for backing storage.
+   * IDs are allocated in memory from blocks reserved in the backing store,
+   * only reserving a block writes to the backing store.
+   *
+   * @return A unique ID for backing storage, "0" if none could be reserved.
    */
   EventID getEventID();
 
   /**
-   * @brief Plan the best set of indexes for event record access.
+   * @brief Store (or queue) an encoded, sampled, and rate-limited event.
    *
-   * @param start an inclusive time to begin searching.
-   * @param stop an inclusive time to end searching.
-   * @param list_key optional key to bind to a specific index binning.
+   * @param data The binary encoded event Row.
+   * @param time The event time.
+   * @param row The event Row if it was encoded from one, the values of the
+   * indexed columns are then read without deserializing the data.
+   */
+  Status addEvent(std::string data, EventTime time, const Row* row = nullptr);
+
+  /// The writer thread, writes every queued event with a single batch.
+  void writeEvents();
+
+  /// Keep an added event in memory, evicting the oldest beyond the bounds.
+  void keepRecentEvent(const std::string& key,
+                       const std::string& data,
+                       EventTime time,
+                       const Row* row);
+
+  /**
+   * @brief Read the events of a time range from memory, if they are kept.
+   *
+   * @return false if events before the range start may not be in memory,
+   * the backing store is then read.
+   */
+  bool getRecentEvents(EventTime start, EventTime stop, QueryData& results);
+
+  /// The values of the indexed columns, from the Row or the encoded data.
+  Row getIndexedValues(const std::string& data, const Row* row) const;
+
+  /**
+   * @brief Add or remove a recent event's values of the indexed columns.
+   *
+   * @return The bytes of the index entries and the kept values.
+   */
+  size_t indexRecentEvent(const std::string& key,
+                          const Row& values,
+                          bool insert);
+
+  /**
+   * @brief Read the recent events with a value of an indexed column.
+   *
+   * Only the events with one of the values are deserialized, as with
+   * getRecentEvents the backing store must be read if false is returned.
+   *
+   * @param column An indexed column.
+   * @param values The EQUALS constraints of the column.
+   * @param start Inclusive lower bound time limit.
+   * @param stop Inclusive upper bound time limit, 0 is unbounded.
+   * @param results output, the matching events in time order.
    *
-   * @return List of 'index.step' index strings.
+   * @return false if events before the range start may not be in memory.
    */
-  std::vector<std::string> getIndexes(EventTime start, 
-                                      EventTime stop,
-                                      int list_key = 0);
+  bool getIndexedEvents(const std::string& column,
+                        const std::set<std::string>& values,
+                        EventTime start,
+                        EventTime stop,
+                        QueryData& results);
+
+  /// True if an added event is sampled, 1 in limits_.sample events are.
+  bool isSampled();
+
+  /// True if an added event exceeds the rate limit, otherwise take a token.
+  bool isRateLimited();
 
   /**
-   * @brief Expire indexes and eventually records.
+   * @brief The backing store key of an event.
+   *
+   * Keys sort by the big-endian time then EventID such that a time range is
+   * a single range scan. An empty EventID is the first key of the time.
    *
-   * @param list_type the string representation of list binning type.
-   * @param indexes complete set of 'index.step' indexes for the list_type.
-   * @param expirations of the indexes, the set to expire.
+   * @param time The time when the event occurred.
+   * @param eid The EventID of the event.
    *
-   * @return status if the indexes and records were removed.
+   * @return The key of the event in the events domain.
    */
-  Status expireIndexes(const std::string& list_type,
-                       const std::vector<std::string>& indexes,
-                       const std::vector<std::string>& expirations);
+  std::string getEventKey(uint64_t time, const std::string& eid = "") const;
 
   /**
-   * @brief Add an EventID, EventTime pair to all matching list types.
+   * @brief Remove the events before an expire time.
    *
-   * The list types are defined by time size. Based on the EventTime this pair
-   * is added to the list bin for each list type. If there are two list types:
-   * 60 seconds and 3600 seconds and `time` is 92, this pair will be added to
-   * list type 1 bin 4 and list type 2 bin 1.
+   * @param expire_time events before this time are removed.
+   *
+   * @return status if the events were removed.
+   */
+  Status expireEvents(EventTime expire_time);
+
+  /**
+   * @brief Create the subscriber's domain once, before it is read or written.
    *
-   * @param eid A unique EventID.
-   * @param time The time when this EventID%'s event occurred.
+   * The events and EventID high-water mark a previous version stored in the
+   * shared kEvents domain are moved to the subscriber's domain, at most
+   * kEventMigrateChunkSize events per batch and the high-water mark last.
    *
-   * @return Were the indexes recorded.
+   * @return status if the domain can be used.
    */
-  Status recordEvent(EventID& eid, EventTime time);
+  Status openDomain();
 
  public:
   /**
@@ -650,8 +899,13 @@ class EventSubscriberPlugin : public Plugin {
   EventSubscriberPlugin() {
     expire_events_ = true;
     expire_time_ = 0;
+    // Events of earlier runs, in the backing store only, are before this.
+    recent_floor_ = getUnixTime() + 1;
+    for (auto& bucket : write_latencies_) {
+      bucket = 0;
+    }
   }
-  virtual ~EventSubscriberPlugin() {}
+  virtual ~EventSubscriberPlugin();
 
   /**
    * @brief Suggested entrypoint for table generation.
@@ -660,26 +914,101 @@ class EventSubscriberPlugin : public Plugin {
    * subscriptioning and acting. The `genTable` static entrypoint is the
    * suggested method for table specs.
    *
+   * Constraints on the `time` column and the query's event window limit the
+   * range of events read, EQUALS constraints on an indexed column read only
+   * the matching recent events. Other constraints are applied by SQLite.
+   *
    * @return The query-time table data, retrieved from a backing store.
    */
   virtual QueryData genTable(tables::QueryContext& context)
-      __attribute__((used)) {
-    return get(0, 0);
-  }
+      __attribute__((used));
 
   /// The string name identifying this EventSubscriber.
   virtual EventSubscriberID name() const { return "subscriber"; }
 
+  /// Wait until the events queued before this call are written.
+  void flush();
+
+  /**
+   * @brief Remove the events older than event_pubsub_expiry.
+   *
+   * @param now the current time.
+   *
+   * @return status if the expired events were removed.
+   */
+  Status expire(EventTime now);
+
+  /// The number of queued events not yet written to the backing store.
+  size_t queueDepth();
+
+  /// The bytes of the queued events' keys and encoded data.
+  size_t queueBytes();
+
+  /// The number of recent events kept in memory.
+  size_t recentEvents();
+
+  /// The number of events dropped because the queue was full or a write
+  /// to the backing store failed.
+  size_t droppedEvents() const { return events_dropped_; }
+
+  /// Limit the rate of, and sample, the events added.
+  void setLimits(const OsqueryEventLimits& limits);
+
+  /// The number of events dropped above the rate limit.
+  size_t limitedEvents() const { return events_limited_; }
+
+  /// The number of events not sampled.
+  size_t sampledEvents() const { return events_sampled_; }
+
+  /// The number of events added, queued or written to the backing store.
+  size_t addedEvents() const { return events_added_; }
+
+  /// The number of EventCallback%s called for this subscriber.
+  size_t numCallbacks() const { return callbacks_; }
+
+  /// The total time, in microseconds, spent in EventCallback%s.
+  size_t callbackTime() const { return callback_time_; }
+
+  /**
+   * @brief The number of backing store writes by latency.
+   *
+   * Each count is the number of writes (a batch or a single event) taking
+   * less than the bound at the same index of kEventLatencyBounds.
+   *
+   * @return One count per bound and a last count for slower writes.
+   */
+  std::vector<size_t> writeLatencies() const;
+
  protected:
+  /// Count an EventCallback call and the microseconds it took.
+  void recordCallback(size_t time) {
+    callbacks_++;
+    callback_time_ += time;
+  }
+
+  /// Count a backing store write in the write latency histogram.
+  void recordWrite(size_t time);
+
   /// Backing storage indexing namespace definition methods.
   EventPublisherID dbNamespace() const { return type() + "." + name(); }
 
+  /// The backing storage domain holding this subscriber's events.
+  std::string dbDomain() const { return kEvents + "." + dbNamespace(); }
+
   /// The string EventPublisher identifying this EventSubscriber.
   virtual EventPublisherID type() const = 0;
 
   /// Disable event expiration for this subscriber.
   void doNotExpire() { expire_events_ = false; }
 
+  /**
+   * @brief Index the recent events by the values of a column.
+   *
+   * Queries with EQUALS constraints on an indexed column, such as a path or
+   * an action, read only the matching recent events. Call within `init`.
+   */
+  void indexColumn(const std::string& column);
+
  private:
   EventSubscriberPlugin(EventSubscriberPlugin const&);
   void operator=(EventSubscriberPlugin const&);
@@ -689,19 +1018,128 @@ class EventSubscriberPlugin : public Plugin {
   bool expire_events_;
 
   /// Events before the expire_time_ are invalid and will be purged.
-  EventTime expire_time_;
+  std::atomic<EventTime> expire_time_;
 
-  /// Lock used when incrementing the EventID database index.
+  /// Lock used when loading or reserving EventID%s in the database index.
   boost::mutex event_id_lock_;
 
-  /// Lock used when recording an EventID and time into search bins.
-  boost::mutex event_record_lock_;
+  /// Lock used when creating the subscriber's domain.
+  boost::mutex domain_lock_;
+
+  /// True once the subscriber's domain is created.
+  std::atomic<bool> domain_opened_{false};
+
+  /// The subscriber's domain, the writer thread may outlive type().
+  std::string domain_;
+
+  /// True once the EventID high-water mark is loaded from the database.
+  std::atomic<bool> eid_loaded_{false};
+
+  /// The next EventID to allocate.
+  std::atomic<uint64_t> next_eid_{0};
+
+  /// The EventIDs below this one are reserved in the database index.
+  std::atomic<uint64_t> reserved_eid_{0};
+
+  /// Events waiting for the writer thread, the event key and serialized row.
+  std::deque<std::pair<std::string, std::string> > event_queue_;
+
+  /// Lock used when queueing, writing and flushing events.
+  boost::mutex event_queue_lock_;
+
+  /// Signaled when events are queued or a batch of events is written.
+  boost::condition_variable event_queue_cv_;
+
+  /// The thread writing queued events in batches, started by the first add.
+  std::shared_ptr<boost::thread> event_writer_;
+
+  /// The number of events ever queued, the sequence of the newest event.
+  size_t event_queue_sequence_{0};
+
+  /// The sequence of the newest event the writer thread has written.
+  size_t event_written_sequence_{0};
+
+  /// True when the writer thread should exit once the queue is empty.
+  bool event_writer_ending_{false};
+
+  /// The number of events dropped.
+  std::atomic<size_t> events_dropped_{0};
+
+  /// An event kept in memory, with its values of the indexed columns.
+  struct RecentEvent {
+    EventTime time;
+    std::string data;
+    Row indexed;
+  };
+
+  /// Recent events by event key, in time order.
+  std::map<std::string, RecentEvent> recent_events_;
+
+  /// The bytes of the recent events' keys, encoded data, and index entries.
+  size_t recent_bytes_{0};
+
+  /// Every event added at or after this time is kept in recent_events_.
+  EventTime recent_floor_;
+
+  /// Lock used when keeping and reading recent events.
+  boost::mutex recent_lock_;
+
+  /// The columns of recent events indexed in recent_index_.
+  std::set<std::string> indexed_columns_;
+
+  /// The keys of recent events by indexed column then value, in time order.
+  std::map<std::string, std::map<std::string, std::set<std::string> > >
+      recent_index_;
+
+  /// Lock used when refilling and taking rate limit tokens.
+  boost::mutex limits_lock_;
+
+  /// The rate limit and sampling of added events.
+  OsqueryEventLimits limits_ = {0, 0, 1};
+
+  /// The rate limit tokens, an event takes a token.
+  double tokens_{0};
+
+  /// The time the tokens were last refilled.
+  std::chrono::steady_clock::time_point tokens_time_;
+
+  /// The number of events seen by sampling.
+  std::atomic<size_t> events_seen_{0};
+
+  /// The number of events dropped above the rate limit.
+  std::atomic<size_t> events_limited_{0};
+
+  /// The number of events not sampled.
+  std::atomic<size_t> events_sampled_{0};
+
+  /// The number of events added.
+  std::atomic<size_t> events_added_{0};
+
+  /// The number of EventCallback%s called.
+  std::atomic<size_t> callbacks_{0};
+
+  /// The microseconds spent in EventCallback%s.
+  std::atomic<size_t> callback_time_{0};
+
+  /// The write latency histogram, bucketed by kEventLatencyBounds.
+  std::atomic<size_t> write_latencies_[kEventLatencyBuckets];
 
  private:
   FRIEND_TEST(EventsDatabaseTests, test_event_module_id);
-  FRIEND_TEST(EventsDatabaseTests, test_record_indexing);
-  FRIEND_TEST(EventsDatabaseTests, test_record_range);
-  FRIEND_TEST(EventsDatabaseTests, test_record_expiration);
+  FRIEND_TEST(EventsDatabaseTests, test_event_id_reservation);
+  FRIEND_TEST(EventsDatabaseTests, test_event_keys);
+  FRIEND_TEST(EventsDatabaseTests, test_event_range);
+  FRIEND_TEST(EventsDatabaseTests, test_event_expiration);
+  FRIEND_TEST(EventsDatabaseTests, test_event_expire);
+  FRIEND_TEST(EventsDatabaseTests, test_event_domain);
+  FRIEND_TEST(EventsDatabaseTests, test_event_limits);
+  FRIEND_TEST(EventsDatabaseTests, test_event_queue);
+  FRIEND_TEST(EventsDatabaseTests, test_event_add_encoded);
+  FRIEND_TEST(EventsDatabaseTests, test_event_counters);
+  FRIEND_TEST(EventsDatabaseTests, test_event_recent);
+  FRIEND_TEST(EventsDatabaseTests, test_event_recent_index);
+  FRIEND_TEST(EventsDatabaseTests, test_event_snapshot_get);
+  FRIEND_TEST(EventsDatabaseTests, test_event_parallel_get);
 };
 
 /**
@@ -751,9 +1189,16 @@ class EventSubscriber : public EventSubscriberPlugin {
     // Down-cast the pointer to the member function.
     auto base_entry =
         reinterpret_cast<Status (T::*)(const EventContextRef&)>(entry);
-    // Create a callable theo the member function using the instance of the
-    // EventSubscriber and a single parameter placeholder (the EventContext).
-    auto cb = std::bind(base_entry, self, _1);
+    // Create a callable to the member function using the instance of the
+    // EventSubscriber, the time spent in the callback is recorded.
+    auto cb = [self, base_entry](const EventContextRef& ec) {
+      auto start = std::chrono::steady_clock::now();
+      auto status = (self->*base_entry)(ec);
+      self->recordCallback(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - start).count());
+      return status;
+    };
     // Add a subscription using the callable and SubscriptionContext.
     EventFactory::addSubscription(type(), sc, cb);
   }
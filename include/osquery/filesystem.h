@@ -11,9 +11,12 @@
 #pragma once
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <sys/stat.h>
+
 #include <boost/filesystem/path.hpp>
 #include <boost/property_tree/ptree.hpp>
 
@@ -106,6 +109,10 @@ Status listDirectoriesInDirectory(const boost::filesystem::path& path,
 /**
  * @brief Given a wildcard filesystem patten, resolve all possible paths
  *
+ * A '%' (or '*') component matches every directory, or every file if it is
+ * last, and a trailing '%%' matches every file below a directory. Within a
+ * name, such as "%.conf", each '%' or '*' matches any characters.
+ *
  * @code{.cpp}
  *   std::vector<std::string> results;
  *   auto s = resolveFilePattern("/Users/marpaia/Downloads/%", results);
@@ -125,6 +132,123 @@ Status listDirectoriesInDirectory(const boost::filesystem::path& path,
 Status resolveFilePattern(const boost::filesystem::path& fs_path,
                           std::vector<std::string>& results);
 
+/**
+ * @brief Resolve several wildcard filesystem patterns together.
+ *
+ * Each directory is listed at most once while resolving the set, such as
+ * the file paths of a config.
+ *
+ * @param patterns The filesystem patterns
+ * @param results The vector in which the results of every pattern are added
+ *
+ * @return The failure of the last pattern that failed, otherwise success.
+ */
+Status resolveFilePatterns(const std::vector<std::string>& patterns,
+                           std::vector<std::string>& results);
+
+/**
+ * @brief Resolve SQL LIKE patterns to the existing paths they match.
+ *
+ * Unlike a file pattern, a LIKE pattern compares ASCII letters ignoring case
+ * and its '%' matches '/' too. Only patterns resolved exactly are supported:
+ * absolute paths without '_' and with '%' only at their end. A trailing '%'
+ * matches every file and directory below, without following symlinks.
+ *
+ * @param patterns The LIKE patterns
+ * @param results The vector in which the matches of every pattern are added
+ *
+ * @return A failure if a pattern is not supported or too deep to resolve.
+ */
+Status resolveLikePatterns(const std::vector<std::string>& patterns,
+                           std::vector<std::string>& results);
+
+/**
+ * @brief Match paths against a set of wildcard filesystem patterns at once.
+ *
+ * Patterns use the syntax of resolveFilePattern and are compiled into a tree
+ * of path components shared by their common prefixes. Literal components are
+ * looked up by name, so the cost of a match depends on the path's depth and
+ * the wildcards along it rather than the number of patterns.
+ *
+ * Paths are never read: a literal or '%' last component matches one name, a
+ * trailing '%%' matches every path below its directory.
+ */
+class FilePatternMatcher {
+ public:
+  FilePatternMatcher();
+  ~FilePatternMatcher();
+
+  /// Add a pattern, such as "/etc/%.conf" or "/var/www/%%".
+  void add(const std::string& pattern);
+
+  /// Remove every pattern.
+  void clear();
+
+  /// Check if any added pattern matches an absolute path.
+  bool matches(const std::string& path) const;
+
+  /// The number of patterns added.
+  size_t size() const { return patterns_; }
+
+ private:
+  struct Node;
+
+  FilePatternMatcher(const FilePatternMatcher&) = delete;
+  FilePatternMatcher& operator=(const FilePatternMatcher&) = delete;
+
+ private:
+  /// The root directory, children are the first components of patterns.
+  std::unique_ptr<Node> root_;
+  size_t patterns_;
+};
+
+/// Options for a FilesystemWalker, defaults are set by walk flags.
+struct FilesystemWalkOptions {
+  /// Only descend into directories on the same device as their root.
+  bool same_device;
+  /// Directories that are not descended into, such as /proc.
+  std::vector<std::string> excludes;
+  /// The number of directories read concurrently.
+  size_t parallelism;
+
+  FilesystemWalkOptions();
+};
+
+struct FilesystemWalkState;
+
+/**
+ * @brief A parallel, pull-based walk of filesystem trees.
+ *
+ * Every file and directory below the roots is returned with its lstat
+ * information; symlinks are never followed below the roots. Dispatcher
+ * workers read directories ahead of the caller into a bounded queue, and
+ * the caller reads directories itself when the queue is empty, so a walk
+ * finishes even when no worker is idle. Entries are not returned in any
+ * order.
+ *
+ * @code{.cpp}
+ *   FilesystemWalker walker({"/usr/bin"}, FilesystemWalkOptions());
+ *   std::string path;
+ *   struct stat info;
+ *   while (walker.next(path, info)) {
+ *     // Stop early by destroying the walker.
+ *   }
+ * @endcode
+ */
+class FilesystemWalker {
+ public:
+  FilesystemWalker(const std::vector<std::string>& roots,
+                   const FilesystemWalkOptions& options);
+  ~FilesystemWalker();
+
+  /// Get the next entry, false once every directory was read.
+  bool next(std::string& path, struct stat& info);
+
+ private:
+  /// Shared with workers, which may outlive the walker.
+  std::shared_ptr<FilesystemWalkState> state_;
+};
+
 /**
  * @brief Get directory portion of a path.
  *
@@ -202,6 +326,24 @@ Status parsePlist(const boost::filesystem::path& path,
  */
 Status parsePlistContent(const std::string& fileContent,
                          boost::property_tree::ptree& tree);
+
+/**
+ * @brief Read selected top-level values of a property list on disk.
+ *
+ * Only scalar values of the requested keys are converted, as parsePlist
+ * would represent them; data and containers are skipped. Binary plists are
+ * read through their offset table and reading stops once every key is found.
+ *
+ * @param path the path of the property list
+ * @param keys the top-level keys to read
+ * @param values populated with the value of each key that was found
+ *
+ * @return an instance of Status, indicating the success or failure
+ * of the operation.
+ */
+Status parsePlistKeys(const boost::filesystem::path& path,
+                      const std::vector<std::string>& keys,
+                      std::map<std::string, std::string>& values);
 #endif
 
 #ifdef __linux__
@@ -238,6 +380,16 @@ Status procReadDescriptor(const std::string& process,
                           const std::string& descriptor,
                           std::string& result);
 
+/**
+ * @brief Parse the inode of a socket descriptor's virtual path.
+ *
+ * @param link a descriptor's virtual path, as read by procReadDescriptor.
+ * @param inode output, the socket inode if the descriptor is a socket.
+ *
+ * @return true if the path is a socket's, "socket:[<inode>]".
+ */
+bool procSocketInode(const std::string& link, std::string& inode);
+
 /**
  * @brief Read bytes from Linux's raw memory.
  *
@@ -261,5 +413,32 @@ Status procReadDescriptor(const std::string& process,
  */
 Status readRawMem(size_t base, size_t length, void** buffer);
 
+/// A read-only view of physical memory, which keeps its pages mapped.
+typedef std::shared_ptr<const uint8_t> RawMemView;
+
+/**
+ * @brief Map bytes from Linux's raw memory without copying them.
+ *
+ * The page-aligned window containing the bytes is mapped once and reused by
+ * later calls for bytes within it, such as the SMBIOS entry point and the
+ * tables it points to. Ranges that cannot be mapped are read instead. The
+ * same restrictions as readRawMem apply.
+ *
+ * @param base The absolute memory address, which need not be page aligned.
+ * @param length The length of the view with a max of 0x10000.
+ * @param view The output view of length bytes, empty if the call fails.
+ * @return status The status of the map.
+ */
+Status mapRawMem(size_t base, size_t length, RawMemView& view);
+
+/**
+ * @brief Unmap the windows of physical memory kept for reuse.
+ *
+ * Call when a table's generate finishes reading raw memory, such that pages
+ * are not kept mapped between queries. Views still held keep their window
+ * mapped until they are released.
+ */
+void releaseRawMem();
+
 #endif
 }
@@ -8,6 +8,9 @@
  *
  */
 
+#pragma once
+
+#include <memory>
 #include <string>
 
 namespace osquery {
@@ -69,6 +72,9 @@ class Hash {
    */
   std::string digest();
 
+  /// Restart the hash of new content, reusing the context.
+  void reset();
+
  private:
   /**
    * @brief Private default constructor
@@ -108,4 +114,68 @@ std::string hashFromBuffer(HashType hash_type, const void* buffer, size_t size);
  * @return A string (hex) representation of the hash digest.
  */
 std::string hashFromFile(HashType hash_type, const std::string& path);
+
+/**
+ * @brief The hex digests of a file computed by hashMultiFromFile.
+ *
+ * A digest is empty if its HashType was not requested or the file could not
+ * be read.
+ */
+struct MultiHashes {
+  /// The requested HashType%s, a bitwise OR of HashType values.
+  int mask;
+  std::string md5;
+  std::string sha1;
+  std::string sha256;
+
+  MultiHashes() : mask(0) {}
+};
+
+/**
+ * @brief Compute several hash digests from a single read of a file.
+ *
+ * Each chunk read from the file updates every requested digest, so callers
+ * needing more than one digest do not re-read the file for each.
+ *
+ * @code{.cpp}
+ *   auto hashes = hashMultiFromFile(HASH_TYPE_MD5 | HASH_TYPE_SHA256, path);
+ *   std::cout << hashes.md5 << " " << hashes.sha256;
+ * @endcode
+ *
+ * @param mask A bitwise OR of the osquery-supported hash algorithms.
+ * @param path Filesystem path, the hash target.
+ * @return The requested string (hex) representations of the hash digests.
+ */
+MultiHashes hashMultiFromFile(int mask, const std::string& path);
+
+/**
+ * @brief Compute the hash digests of many files, reusing the hashing state.
+ *
+ * Hashing a small file is dominated by allocating the digest contexts and
+ * the aligned read buffer rather than by hashing its content. A FileHasher
+ * keeps them between files, callers hashing many files, such as the files
+ * of a directory, hash each with the same hasher. The digest functions
+ * select the CPU's SHA extensions when they are present.
+ *
+ * A FileHasher must only be used by one thread at a time.
+ */
+class FileHasher {
+ public:
+  FileHasher();
+  ~FileHasher();
+
+  /// As hashMultiFromFile, with this hasher's contexts and buffer.
+  MultiHashes hash(int mask, const std::string& path);
+
+ private:
+  FileHasher(FileHasher const&);
+  void operator=(FileHasher const&);
+
+ private:
+  /// The MD5, SHA1, and SHA256 contexts, created when first requested.
+  std::unique_ptr<Hash> digests_[3];
+
+  /// The aligned read buffer, allocated by the first hashed file.
+  void* buffer_{nullptr};
+};
 }
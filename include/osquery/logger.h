@@ -10,7 +10,15 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <glog/logging.h>
@@ -32,11 +40,14 @@ namespace osquery {
 extern const std::string kDefaultLogReceiverName;
 
 /**
- * @brief Log a string using the default logger receiver.
+ * @brief Log a string using the default logger receivers.
  *
  * Note that this method should only be used to log results. If you'd like to
  * log normal osquery operations, use Google Logging.
  *
+ * The string is sent to each receiver in the log_receiver list through the
+ * LoggerDispatcher, which may queue it for the receiver's thread.
+ *
  * @param s the string to log
  *
  * @return an instance of osquery::Status, indicating the success or failure
@@ -44,6 +55,9 @@ extern const std::string kDefaultLogReceiverName;
  */
 Status logString(const std::string& s);
 
+/// Log a string using the default logger receivers, without copying it.
+Status logString(std::string&& s);
+
 /**
  * @brief Log a string using a specific logger receiver.
  *
@@ -58,6 +72,22 @@ Status logString(const std::string& s);
  */
 Status logString(const std::string& s, const std::string& receiver);
 
+/**
+ * @brief Log several strings, in order, using the default logger receivers.
+ *
+ * Receivers get the strings with one LoggerPlugin::logStringBatch call,
+ * together with any other strings queued for them.
+ *
+ * @param strings the strings to log
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation.
+ */
+Status logStringBatch(const std::vector<std::string>& strings);
+
+/// Log several strings using the default logger receivers, moving them.
+Status logStringBatch(std::vector<std::string>&& strings);
+
 /**
  * @brief Directly log results of scheduled queries to the default receiver
  *
@@ -80,6 +110,37 @@ Status logScheduledQueryLogItem(const ScheduledQueryLogItem& item);
 Status logScheduledQueryLogItem(const ScheduledQueryLogItem& item,
                                 const std::string& receiver);
 
+/**
+ * @brief Serialize results of scheduled queries as they are logged
+ *
+ * Results are serialized as one JSON line, or as a line per row when
+ * log_result_events is set.
+ *
+ * @param item a struct representing the results of a scheduled query
+ * @param json output, the serialized results
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation.
+ */
+Status serializeScheduledQueryLogItemForLogger(const ScheduledQueryLogItem& item,
+                                               std::string& json);
+
+/**
+ * @brief Serialize results of scheduled queries as batches of log strings
+ *
+ * When log_result_events is set the events are written in batches of at
+ * most log_result_events_batch bytes, otherwise the single serialized
+ * string is written as a batch of one.
+ *
+ * @param item a struct representing the results of a scheduled query
+ * @param writer the function receiving each batch of log strings
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation.
+ */
+Status serializeScheduledQueryLogItemForLogger(
+    const ScheduledQueryLogItem& item, const LogBatchWriter& writer);
+
 /**
  * @brief Superclass for the pluggable config component.
  *
@@ -124,6 +185,27 @@ class LoggerPlugin : public Plugin {
    *  failure of the operation.
    */
   virtual Status logString(const std::string& s) = 0;
+
+  /**
+   * @brief Log several strings, in order.
+   *
+   * Network plugins may override this to send the strings together. The
+   * default calls logString for each string.
+   *
+   * @return a failure if any string failed, some strings may have been
+   * logged.
+   */
+  virtual Status logStringBatch(const std::vector<std::string>& strings);
+
+  /**
+   * @brief The number of new streams the plugin has started writing.
+   *
+   * A plugin counts each output a reader may start from, such as a log file
+   * opened after a rotation. Receivers write log frame dictionaries again
+   * when the count changes.
+   */
+  virtual size_t getStreams() { return 0; }
+
   Status call(const PluginRequest& request, PluginResponse& response);
 };
 
@@ -135,4 +217,278 @@ class LoggerPlugin : public Plugin {
  * a helper member for transforming PluginRequest%s to strings.
  */
 CREATE_REGISTRY(LoggerPlugin, "logger");
+
+/// The counters of a LoggerReceiver.
+struct LoggerReceiverStats {
+  /// The number of strings the receiver's plugin logged.
+  size_t sent;
+
+  /// The number of strings dropped because the queue was full.
+  size_t dropped;
+
+  /// The number of strings the receiver's plugin failed to log.
+  size_t failures;
+
+  /// The number of strings waiting in the queue.
+  size_t backlog;
+
+  /// The average time of the plugin's calls in microseconds.
+  size_t latency;
+
+  /// The number of failed strings spooled for a retry.
+  size_t spooled;
+
+  /// The number of spooled strings removed to stay within the spool size.
+  size_t evicted;
+};
+
+/**
+ * @brief Strings a receiver failed to log, kept in the backing store.
+ *
+ * Spooled strings are stored in the kLogs domain in the order they were
+ * added, keyed by the receiver's name and a sequence number, such that they
+ * are retried after a restart. The oldest strings are removed once the
+ * spool would exceed its size in bytes.
+ */
+class LoggerSpool {
+ public:
+  /// The sending function of a retry, normally LoggerReceiver::send.
+  typedef std::function<Status(const std::string&)> Sender;
+
+  LoggerSpool(const std::string& name, size_t size);
+
+  /// Read the strings spooled by a previous run.
+  void recover();
+
+  /// Append a string, removing the oldest strings to make room.
+  Status add(const std::string& s);
+
+  /**
+   * @brief Send spooled strings in order, stopping at the first failure.
+   *
+   * @param sender the function sending each string.
+   * @param batch the most strings sent, they are removed with one write.
+   * @return the number of strings sent and removed.
+   */
+  size_t retry(const Sender& sender, size_t batch);
+
+  /// The number of spooled strings.
+  size_t count() const { return sizes_.size(); }
+
+  /// The number of strings removed to stay within the spool size.
+  size_t evicted() const { return evicted_; }
+
+ private:
+  /// The key of a sequence number, ordered as the numbers are.
+  std::string getKey(size_t sequence) const;
+
+ private:
+  std::string name_;
+  size_t size_;
+
+  /// The sequence number of the oldest spooled string.
+  size_t head_;
+  /// The size of each spooled string, oldest first.
+  std::deque<size_t> sizes_;
+  size_t bytes_;
+  size_t evicted_;
+};
+
+class LogItemFrameEncoder;
+template <typename T>
+class BoundedQueue;
+
+/**
+ * @brief Sends logged strings to one logger plugin from a dedicated thread.
+ *
+ * Strings wait in a bounded queue. Once it is full, add either blocks until
+ * the receiver catches up or drops the string.
+ *
+ * Log frame records are encoded as they are sent, by the receiver's own
+ * encoder, so a frame's dictionaries are those of the receiver's stream.
+ * Dropped records never reach the encoder. A failed send, or a new stream
+ * started by the plugin, resets it.
+ */
+class LoggerReceiver {
+ public:
+  /**
+   * @param name the logger plugin name.
+   * @param capacity the number of queued strings, 0 logs from add itself.
+   * @param block block while the queue is full instead of dropping.
+   * @param spool the bytes of failed strings spooled, 0 disables the spool.
+   */
+  LoggerReceiver(const std::string& name,
+                 size_t capacity,
+                 bool block,
+                 size_t spool = 0);
+  ~LoggerReceiver();
+
+  /// Queue, or log, a string. Fails if the string was dropped or not logged.
+  Status add(std::string s);
+
+  /// Queue, or log with one plugin call, several strings.
+  Status add(std::vector<std::string> strings);
+
+  /// Log every queued string, then stop the receiver's thread.
+  void stop();
+
+  /// The receiver's counters.
+  LoggerReceiverStats getStats();
+
+ private:
+  /// Log a string through the plugin, counting the call.
+  Status send(const std::string& s);
+
+  /// Log strings with one plugin call, counting the call.
+  Status send(const std::vector<std::string>& strings);
+
+  /// The string to send, `frame` holds it if `s` is log frame records.
+  const std::string& encode(const std::string& s, std::string& frame);
+
+  /// Send a string after any spooled strings, spooling it on failure.
+  Status deliver(const std::string& s);
+
+  /**
+   * @brief Send strings after any spooled strings, spooling them on failure.
+   *
+   * A failed call may have logged some strings, they are spooled again and
+   * may be logged twice.
+   */
+  Status deliver(const std::vector<std::string>& strings);
+
+  /// Retry the spooled strings if the retry interval has passed.
+  void retrySpool();
+
+  /// The receiver thread's loop.
+  void run();
+
+ private:
+  std::string name_;
+  bool block_;
+  std::unique_ptr<BoundedQueue<std::string> > queue_;
+  std::thread worker_;
+  std::once_flag stopped_;
+
+  /// Accessed by the receiver's thread, or by add without a queue.
+  std::unique_ptr<LoggerSpool> spool_;
+  std::chrono::steady_clock::time_point next_retry_;
+  std::mutex spool_mutex_;
+
+  /// Encodes frames for the plugin's stream, and the stream count seen.
+  std::unique_ptr<LogItemFrameEncoder> frames_;
+  std::atomic<size_t> streams_;
+
+  std::atomic<size_t> sent_;
+  std::atomic<size_t> dropped_;
+  std::atomic<size_t> failures_;
+  std::atomic<size_t> calls_;
+  std::atomic<size_t> call_time_;
+  /// Spool counters, readable without waiting for a retry.
+  std::atomic<size_t> spooled_;
+  std::atomic<size_t> evicted_;
+};
+
+/**
+ * @brief Fans logged strings out to each receiver in the log_receiver list.
+ *
+ * Every receiver has its own queue and thread such that a slow receiver,
+ * such as a network logger, does not delay the others or the caller.
+ */
+class LoggerDispatcher {
+ public:
+  static LoggerDispatcher& getInstance() {
+    static LoggerDispatcher dispatcher;
+    return dispatcher;
+  }
+
+  ~LoggerDispatcher() { stop(); }
+
+  /**
+   * @brief Send a string to every receiver, fails if any receiver failed.
+   *
+   * The string is moved to the last receiver, the others queue copies.
+   */
+  Status log(std::string s);
+
+  /// Send several strings to every receiver, moving them to the last.
+  Status log(std::vector<std::string> strings);
+
+  /// Log every queued string and stop the receivers.
+  void stop();
+
+  /// The counters of each receiver by name.
+  std::map<std::string, LoggerReceiverStats> getStats();
+
+ private:
+  LoggerDispatcher() {}
+
+  /// Start receivers for a log_receiver value, the lock is held.
+  void setReceivers(const std::string& receivers);
+
+  /// The current receivers, started for the log_receiver flag.
+  std::map<std::string, std::shared_ptr<LoggerReceiver> > getReceivers();
+
+ private:
+  /// The log_receiver value the receivers were started for.
+  std::string receivers_flag_;
+  std::map<std::string, std::shared_ptr<LoggerReceiver> > receivers_;
+  std::mutex mutex_;
+};
+
+/**
+ * @brief Forwards status logs, those written with glog, to logger receivers.
+ *
+ * Each status log is serialized as a JSON line and queued for receivers that
+ * drop lines once their queue is full, such that a status log never waits on
+ * a logger plugin. Each call site, a file and line, forwards at most `rate`
+ * logs a second, the number suppressed is included in the next log. Up to
+ * kStatusLogMaxSites call sites are tracked, expired windows are pruned
+ * when a new call site would exceed it.
+ */
+class StatusLogSink : public google::LogSink {
+ public:
+  /**
+   * @param receivers comma-separated logger plugin names.
+   * @param severity the least severity forwarded.
+   * @param rate the logs forwarded by a call site each second, 0 for all.
+   */
+  StatusLogSink(const std::string& receivers, int severity, size_t rate);
+  ~StatusLogSink();
+
+  void send(google::LogSeverity severity,
+            const char* full_filename,
+            const char* base_filename,
+            int line,
+            const struct ::tm* tm_time,
+            const char* message,
+            size_t message_len);
+
+  /// Log every queued status log, then stop the receivers.
+  void stop();
+
+  /// The counters of each receiver by name.
+  std::map<std::string, LoggerReceiverStats> getStats();
+
+ private:
+  /// The rate limit window of a call site.
+  struct CallSite {
+    std::chrono::steady_clock::time_point start;
+    size_t count;
+    size_t suppressed;
+  };
+
+ private:
+  int severity_;
+  size_t rate_;
+  std::map<std::string, std::shared_ptr<LoggerReceiver> > receivers_;
+  /// Call sites by their __FILE__ pointer and line, kStatusLogMaxSites at most.
+  std::map<std::pair<const char*, int>, CallSite> sites_;
+  std::mutex mutex_;
+};
+
+/// Forward status logs to the logger_status_receiver plugins, if any.
+void initStatusLogger();
+
+/// Stop forwarding status logs.
+void shutdownStatusLogger();
 }
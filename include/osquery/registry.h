@@ -10,12 +10,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <map>
 #include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 #include <boost/noncopyable.hpp>
 #include <boost/property_tree/ptree.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include <osquery/status.h>
 
@@ -48,7 +53,7 @@ namespace osquery {
 /**
  * @brief A boilerplate code helper to create a registry given a name and
  * plugin base class type. This 'lazy' registry does not automatically run
- * Plugin::setUp on all items.
+ * Plugin::setUp on any items.
  *
  * @param type A typename that derives from Plugin.
  * @param name A string identifier for the registry.
@@ -79,6 +84,44 @@ typedef std::map<std::string, std::string> RouteInfo;
 typedef std::map<std::string, RouteInfo> RegistryRoutes;
 /// An extension or core's broadcast includes routes from every Registry.
 typedef std::map<std::string, RegistryRoutes> RegistryBroadcast;
+/// The generation of each registry a broadcast was built from.
+typedef std::map<std::string, size_t> RegistryVersions;
+
+/**
+ * @brief The changes to a broadcast since a set of registry versions.
+ *
+ * A consumer that has applied a full broadcast keeps its versions and asks
+ * for deltas. Only items added or removed since those versions are sent.
+ */
+struct RegistryBroadcastDelta {
+  /// The registry versions the consumer has after applying this delta.
+  RegistryVersions versions;
+  /// Added items and their routes, or every route of a reset registry.
+  RegistryBroadcast added;
+  /// The identifiers of removed items, by registry name.
+  std::map<std::string, std::vector<std::string> > removed;
+  /// Registries whose changes were not retained, their routes are replaced.
+  std::vector<std::string> reset;
+
+  /// True if the consumer's broadcast is current.
+  bool empty() const {
+    return added.empty() && removed.empty() && reset.empty();
+  }
+};
+
+/**
+ * @brief Apply a broadcast delta to a consumer's broadcast and versions.
+ *
+ * @param delta the changes from RegistryFactory::getBroadcastDelta.
+ * @param broadcast the consumer's copy of the broadcast.
+ * @param versions the consumer's registry versions, updated.
+ */
+void applyBroadcastDelta(const RegistryBroadcastDelta& delta,
+                         RegistryBroadcast& broadcast,
+                         RegistryVersions& versions);
+
+/// The number of item changes each registry keeps for broadcast deltas.
+const size_t kRegistryChangeHistory = 256;
 
 /**
  * @brief The request part of a plugin (registry item's) call.
@@ -104,6 +147,13 @@ typedef std::vector<PluginRequest> PluginResponse;
  * The osquery Registry is partitioned into types. These are literal types
  * but use a canonical string key for lookups and actions.
  * Registries are created using Registry::create with a RegistryType and key.
+ *
+ * Items may be added and removed while other threads call them, for example
+ * when extensions register. Lookups take a shared lock on a hashed index and
+ * plugins are called after the lock is released, holding a reference.
+ *
+ * Once the registry is set up each item's Plugin::setUp runs the first time
+ * it is found or called, plugins that are never used are never set up.
  */
 template <class RegistryType>
 class RegistryCore {
@@ -112,7 +162,8 @@ class RegistryCore {
   virtual void type() {}
 
  public:
-  RegistryCore(bool auto_setup = true) : auto_setup_(auto_setup) {}
+  RegistryCore(bool auto_setup = true)
+      : auto_setup_(auto_setup), ready_(false), generation_(0) {}
   virtual ~RegistryCore() {}
 
   /**
@@ -129,7 +180,8 @@ class RegistryCore {
    */
   template <class Item>
   Status add(const std::string& item_name) {
-    if (items_.count(item_name) > 0) {
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    if (index_.count(item_name) > 0) {
       return Status(1, "Duplicate registry item exists: " + item_name);
     }
 
@@ -140,42 +192,152 @@ class RegistryCore {
     // used when it was created using the registry factory.
     std::shared_ptr<RegistryType> shared_item(item);
     items_[item_name] = shared_item;
+    index_[item_name] = {shared_item, ready_};
+    recordChange(item_name);
     return Status(0, "OK");
   }
 
   /**
    * @brief A raw accessor for a registry plugin.
    *
-   * If there is no plugin with an item_name identifier this will throw
-   * and out_of_range exception.
+   * If there is no plugin with an item_name identifier, or its setUp
+   * failed, this will throw an out_of_range exception.
    *
    * @param item_name An identifier for this registry plugin.
    * @return A std::shared_ptr of type RegistryType.
    */
   RegistryTypeRef get(const std::string& item_name) {
-    return items_.at(item_name);
+    auto item = find(item_name);
+    if (item == nullptr) {
+      throw std::out_of_range("Registry item not found: " + item_name);
+    }
+    return item;
+  }
+
+  /**
+   * @brief A non-throwing accessor for a registry plugin.
+   *
+   * An item waiting for its setUp is set up before it is returned.
+   *
+   * @param item_name An identifier for this registry plugin.
+   * @return The plugin, or nullptr if there is no item_name identifier.
+   */
+  RegistryTypeRef find(const std::string& item_name) {
+    RegistryTypeRef item;
+    bool pending = false;
+    {
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+      auto entry = index_.find(item_name);
+      if (entry == index_.end()) {
+        return nullptr;
+      }
+      item = entry->second.item;
+      pending = entry->second.pending;
+    }
+
+    if (pending && !setUpItem(item_name, item)) {
+      return nullptr;
+    }
+    return item;
   }
 
   /**
    * @brief Remove a registry item by its identifier.
    *
+   * The item is torn down after it is removed, callers holding a reference
+   * may finish their calls. Items that were never set up are not torn down.
+   *
    * @param item_name An identifier for this registry plugin.
    */
   void remove(const std::string& item_name) {
-    if (items_.count(item_name) > 0) {
-      items_[item_name]->tearDown();
+    RegistryTypeRef item;
+    {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      auto it = index_.find(item_name);
+      if (it == index_.end()) {
+        return;
+      }
+      if (!it->second.pending) {
+        item = it->second.item;
+      }
+      index_.erase(it);
       items_.erase(item_name);
+      recordChange(item_name);
+    }
+
+    if (item != nullptr) {
+      item->tearDown();
     }
   }
 
   RegistryRoutes getRoutes() {
+    size_t generation;
+    return getRoutes(generation);
+  }
+
+  /// The routes of every item, and the generation they were read at.
+  RegistryRoutes getRoutes(size_t& generation) {
+    std::map<std::string, RegistryTypeRef> items;
+    {
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+      items = items_;
+      generation = generation_;
+    }
+
     RegistryRoutes route_table;
-    for (const auto& item : items_) {
+    for (const auto& item : items) {
       route_table[item.first] = item.second->routeInfo();
     }
     return route_table;
   }
 
+  /**
+   * @brief The items changed since a generation of this registry.
+   *
+   * @param since a generation from getRoutes or a previous call.
+   * @param added routes of items added since, including replaced items.
+   * @param removed identifiers of items removed since.
+   * @param generation the current generation the changes lead to.
+   * @return Failure if the changes since that generation were not retained.
+   */
+  Status getRoutesSince(size_t since,
+                        RegistryRoutes& added,
+                        std::vector<std::string>& removed,
+                        size_t& generation) {
+    std::map<std::string, RegistryTypeRef> changed;
+    {
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+      generation = generation_;
+      if (since > generation_) {
+        return Status(1, "Unknown registry generation");
+      }
+      if (since < generation_ &&
+          (changes_.empty() || changes_.front().first > since + 1)) {
+        return Status(1, "Registry changes are no longer retained");
+      }
+
+      for (auto it = changes_.rbegin();
+           it != changes_.rend() && it->first > since;
+           ++it) {
+        if (changed.count(it->second) > 0) {
+          continue;
+        }
+        auto entry = index_.find(it->second);
+        changed[it->second] =
+            (entry != index_.end()) ? entry->second.item : nullptr;
+      }
+    }
+
+    for (const auto& item : changed) {
+      if (item.second != nullptr) {
+        added[item.first] = item.second->routeInfo();
+      } else {
+        removed.push_back(item.first);
+      }
+    }
+    return Status(0, "OK");
+  }
+
   /**
    * @brief The only method a plugin user should call.
    *
@@ -195,13 +357,23 @@ class RegistryCore {
   Status call(const std::string& item_name,
               const PluginRequest& request,
               PluginResponse& response) {
-    if (items_.count(item_name) > 0) {
-      return items_[item_name]->call(request, response);
+    auto item = find(item_name);
+    if (item != nullptr) {
+      return item->call(request, response);
     }
     return Status(1, "Cannot call registry item: " + item_name);
   }
 
-  const std::map<std::string, RegistryTypeRef>& all() { return items_; }
+  /**
+   * @brief A copy of the registry items, sorted by their identifiers.
+   *
+   * Items are returned whether or not they are set up, use find to set up
+   * an item before using it.
+   */
+  std::map<std::string, RegistryTypeRef> all() {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return items_;
+  }
 
   /**
    * @brief Allow a plugin to perform some setup functions when osquery starts.
@@ -211,8 +383,10 @@ class RegistryCore {
    * instanciation. To have a reliable state (aka, flags have been parsed,
    * and logs are ready to stream), do construction work in Plugin::setUp.
    *
-   * The registry `setUp` will iterate over all of its registry items and call
-   * their setup unless the registry is lazy (see CREATE_REGISTRY).
+   * The registry `setUp` marks each of its registry items, and items added
+   * later, to be set up when they are first found or called, unless the
+   * registry is lazy (see CREATE_REGISTRY). Items failing their setUp are
+   * removed from the registry.
    */
   void setUp() {
     // If this registry does not auto-setup do NOT setup the registry items.
@@ -220,27 +394,26 @@ class RegistryCore {
       return;
     }
 
-    // Try to set up each of the registry items.
-    // If they fail, remove them from the registry.
-    std::vector<std::string> failed;
-    for (auto& item : items_) {
-      if (!item.second->setUp().ok()) {
-        failed.push_back(item.first);
-      }
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    if (ready_) {
+      return;
     }
-
-    for (const auto& failed_item : failed) {
-      remove(failed_item);
+    ready_ = true;
+    for (auto& entry : index_) {
+      entry.second.pending = true;
     }
   }
 
-  /// Facility method to check if a registry item exists.
+  /// Facility method to check if a registry item exists, without setting
+  /// it up.
   bool exists(const std::string& item_name) {
-    return (items_.count(item_name) > 0);
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return (index_.count(item_name) > 0);
   }
 
   /// Facility method to list the registry item identifiers.
   std::vector<std::string> names() {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
     std::vector<std::string> names;
     for (const auto& item : items_) {
       names.push_back(item.first);
@@ -249,7 +422,19 @@ class RegistryCore {
   }
 
   /// Facility method to count the number of items in this registry.
-  size_t count() { return items_.size(); }
+  size_t count() {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return items_.size();
+  }
+
+  /**
+   * @brief A counter incremented each time an item is added or removed.
+   *
+   * Consumers that cache state derived from the set of registry items, such
+   * as SQLite connections with every table attached, may compare generations
+   * to detect when that state must be rebuilt.
+   */
+  size_t generation() const { return generation_; }
 
   /// Allow the registry to introspect into the registered name (for logging).
   void setName(const std::string& name) { name_ = name; }
@@ -258,13 +443,76 @@ class RegistryCore {
   RegistryCore(RegistryCore const&);
   void operator=(RegistryCore const&);
 
+  /// Run an item's pending setUp, removing the item if the setUp fails.
+  bool setUpItem(const std::string& item_name, const RegistryTypeRef& item) {
+    // Plugins are set up one at a time, a setUp may find other items.
+    std::lock_guard<std::recursive_mutex> setup_lock(setup_mutex_);
+    {
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+      auto entry = index_.find(item_name);
+      if (entry == index_.end() || entry->second.item != item) {
+        // Another caller's setUp of this item failed.
+        return false;
+      }
+      if (!entry->second.pending) {
+        return true;
+      }
+    }
+
+    auto status = item->setUp();
+    {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      auto entry = index_.find(item_name);
+      if (entry == index_.end() || entry->second.item != item) {
+        return false;
+      }
+      if (status.ok()) {
+        entry->second.pending = false;
+        return true;
+      }
+      index_.erase(entry);
+      items_.erase(item_name);
+      recordChange(item_name);
+    }
+
+    item->tearDown();
+    return false;
+  }
+
+  /// Count a change to an item, the caller holds the unique lock.
+  void recordChange(const std::string& item_name) {
+    generation_++;
+    changes_.push_back(std::make_pair(generation_.load(), item_name));
+    if (changes_.size() > kRegistryChangeHistory) {
+      changes_.pop_front();
+    }
+  }
+
  private:
+  /// A hashed registry item, and whether its setUp has yet to run.
+  struct IndexEntry {
+    RegistryTypeRef item;
+    bool pending;
+  };
+
   /// The identifier for this registry, used to register items.
   std::string name_;
   /// A map of registered plugin instances to their registered identifier.
   std::map<std::string, RegistryTypeRef> items_;
-  /// Does this registry run setUp on each registry item at initialization.
+  /// The same plugin instances, hashed for calls and lookups.
+  std::unordered_map<std::string, IndexEntry> index_;
+  /// Protects items_ and index_, calls only hold a shared lock.
+  boost::shared_mutex mutex_;
+  /// Serializes item setUp calls.
+  std::recursive_mutex setup_mutex_;
+  /// Does this registry run setUp on each registry item when it is used.
   bool auto_setup_;
+  /// Has the registry been set up, new items will set up on first use.
+  bool ready_;
+  /// The number of add/remove changes applied to the registry items.
+  std::atomic<size_t> generation_;
+  /// The most recent changes, the generation each made and the item name.
+  std::deque<std::pair<size_t, std::string> > changes_;
 };
 
 template <class TypeAPI>
@@ -325,7 +573,7 @@ class RegistryFactory : private boost::noncopyable {
     return instance().registries_;
   }
 
-  static const std::map<std::string, TypeAPIRef>& all(
+  static std::map<std::string, TypeAPIRef> all(
       const std::string& registry_name) {
     return instance().registry(registry_name)->all();
   }
@@ -335,21 +583,76 @@ class RegistryFactory : private boost::noncopyable {
     return instance().registry(registry_name)->get(item_name);
   }
 
+  static TypeAPIRef find(const std::string& registry_name,
+                         const std::string& item_name) {
+    auto registry = instance().registries_.find(registry_name);
+    if (registry == instance().registries_.end()) {
+      return nullptr;
+    }
+    return registry->second->find(item_name);
+  }
+
   static RegistryBroadcast getBroadcast() {
+    RegistryVersions versions;
+    return getBroadcast(versions);
+  }
+
+  /**
+   * @brief A full broadcast, and the registry versions it was built from.
+   *
+   * The versions may be used to request a getBroadcastDelta later.
+   */
+  static RegistryBroadcast getBroadcast(RegistryVersions& versions) {
     RegistryBroadcast broadcast;
     for (const auto& registry : instance().registries_) {
-      broadcast[registry.first] = registry.second->getRoutes();
+      broadcast[registry.first] =
+          registry.second->getRoutes(versions[registry.first]);
     }
     return broadcast;
   }
 
+  /**
+   * @brief The broadcast changes since a consumer's registry versions.
+   *
+   * Registries that are unchanged are not included. Registries missing from
+   * the versions, or whose changes were not retained, are sent in full.
+   *
+   * @param since the consumer's versions, from getBroadcast or a delta.
+   * @param delta the changes and the consumer's new versions.
+   */
+  static void getBroadcastDelta(const RegistryVersions& since,
+                                RegistryBroadcastDelta& delta) {
+    for (const auto& registry : instance().registries_) {
+      auto& generation = delta.versions[registry.first];
+      auto known = since.find(registry.first);
+      if (known != since.end()) {
+        RegistryRoutes added;
+        std::vector<std::string> removed;
+        auto status = registry.second->getRoutesSince(
+            known->second, added, removed, generation);
+        if (status.ok()) {
+          if (!added.empty()) {
+            delta.added[registry.first] = std::move(added);
+          }
+          if (!removed.empty()) {
+            delta.removed[registry.first] = std::move(removed);
+          }
+          continue;
+        }
+      }
+
+      delta.reset.push_back(registry.first);
+      delta.added[registry.first] = registry.second->getRoutes(generation);
+    }
+  }
+
   static Status call(const std::string& registry_name,
                      const std::string item_name,
                      const PluginRequest& request,
                      PluginResponse& response) {
-    if (instance().registries_.count(registry_name) > 0) {
-      return instance().registries_[registry_name]->call(
-          item_name, request, response);
+    auto registry = instance().registries_.find(registry_name);
+    if (registry != instance().registries_.end()) {
+      return registry->second->call(item_name, request, response);
     }
     return Status(1, "Cannot call " + registry_name + ":" + item_name);
   }
@@ -369,10 +672,11 @@ class RegistryFactory : private boost::noncopyable {
 
   static bool exists(const std::string& registry_name,
                      const std::string& item_name) {
-    if (instance().registries_.count(registry_name) == 0) {
+    auto registry = instance().registries_.find(registry_name);
+    if (registry == instance().registries_.end()) {
       return false;
     }
-    return (instance().registry(registry_name)->exists(item_name));
+    return registry->second->exists(item_name);
   }
 
   static std::vector<std::string> names(const std::string& registry_name) {
@@ -392,6 +696,13 @@ class RegistryFactory : private boost::noncopyable {
     return instance().registry(registry_name)->count();
   }
 
+  static size_t generation(const std::string& registry_name) {
+    if (instance().registries_.count(registry_name) == 0) {
+      return 0;
+    }
+    return instance().registry(registry_name)->generation();
+  }
+
  protected:
   RegistryFactory() {}
   RegistryFactory(RegistryFactory const&);
@@ -456,4 +767,37 @@ class Plugin {
  * implement the Plugin and RegistryType interfaces.
  */
 class Registry : public RegistryFactory<Plugin> {};
+
+/**
+ * @brief A registry item resolved once for repeated calls.
+ *
+ * Callers on a hot path, such as a virtual table filtering on each query,
+ * keep a handle instead of looking up the registry and item each call.
+ * The item is only looked up again after the registry generation changes.
+ *
+ * A handle is not synchronized, each thread should use its own handle.
+ */
+class PluginHandle {
+ public:
+  PluginHandle() : generation_(0), resolved_(false) {}
+  PluginHandle(const std::string& registry_name, const std::string& item_name)
+      : registry_name_(registry_name),
+        item_name_(item_name),
+        generation_(0),
+        resolved_(false) {}
+
+  /// The registry item, or nullptr if it does not exist.
+  std::shared_ptr<Plugin> get();
+
+  /// Call the registry item, equivalent to Registry::call.
+  Status call(const PluginRequest& request, PluginResponse& response);
+
+ private:
+  std::string registry_name_;
+  std::string item_name_;
+  /// The registry generation when the item was resolved.
+  size_t generation_;
+  bool resolved_;
+  std::shared_ptr<Plugin> plugin_;
+};
 }
@@ -10,6 +10,10 @@
 
 #pragma once
 
+#include <functional>
+#include <string>
+#include <vector>
+
 #include <osquery/database/results.h>
 
 namespace osquery {
@@ -30,10 +34,31 @@ struct OsqueryScheduledQuery {
   /// interval represents how often the query should be executed, in minutes.
   int interval;
 
+  /// The wall-clock milliseconds a run may take before it is cancelled, or 0.
+  int timeout_ms;
+
+  /// The CPU milliseconds a run may use before it is cancelled, or 0.
+  int cpu_ms;
+
+  /// Log the full results of every run instead of differentials.
+  bool snapshot;
+
+  /// The bytes of results logged each quota interval before limiting, or 0.
+  int max_bytes;
+
+  /// Log aggregates of the runs within windows of this many seconds, or 0.
+  int rollup;
+
+  /// Comma-separated columns identifying a rolled up row, see QueryRollup.
+  std::string rollup_key;
+
   /// equals operator
   bool operator==(const OsqueryScheduledQuery& comp) const {
     return (comp.name == name) && (comp.query == query) &&
-           (comp.interval == interval);
+           (comp.interval == interval) && (comp.timeout_ms == timeout_ms) &&
+           (comp.cpu_ms == cpu_ms) && (comp.snapshot == snapshot) &&
+           (comp.max_bytes == max_bytes) && (comp.rollup == rollup) &&
+           (comp.rollup_key == rollup_key);
   }
 
   /// not equals operator
@@ -42,6 +67,28 @@ struct OsqueryScheduledQuery {
   }
 };
 
+/**
+ * @brief An ad-hoc query requested through the distributed query channel.
+ *
+ * Config retrievers return requests from ConfigPlugin::genDistributedQueries
+ * and each is run once, see runDistributedQuery.
+ */
+struct DistributedQueryRequest {
+  /// The identifier the results of the query are logged with.
+  std::string id;
+
+  /// The SQL query, a single statement.
+  std::string query;
+
+  /// The wall-clock milliseconds the query may take, or 0 for the default.
+  int timeout_ms;
+
+  /// The CPU milliseconds the query may use, or 0 for the default.
+  int cpu_ms;
+
+  DistributedQueryRequest() : timeout_ms(0), cpu_ms(0) {}
+};
+
 /////////////////////////////////////////////////////////////////////////////
 // ScheduledQueryLogItem
 /////////////////////////////////////////////////////////////////////////////
@@ -71,6 +118,9 @@ struct ScheduledQueryLogItem {
   /// The time that the query was executed, in ASCII
   std::string calendarTime;
 
+  /// The content hash of a snapshot's rows, empty if it is not logged.
+  std::string snapshotHash;
+
   /// equals operator
   bool operator==(const ScheduledQueryLogItem& comp) const {
     return (comp.diffResults == diffResults) && (comp.name == name);
@@ -109,6 +159,22 @@ Status serializeScheduledQueryLogItem(const ScheduledQueryLogItem& i,
 Status serializeScheduledQueryLogItemJSON(const ScheduledQueryLogItem& i,
                                           std::string& json);
 
+/**
+ * @brief Serialize a reference to the last logged results of a snapshot
+ *
+ * When a snapshot's results are unchanged only the log item's fields and
+ * its snapshotHash are logged, with the action "unchanged". The hash is
+ * that of the last snapshot logged with its rows.
+ *
+ * @param i the ScheduledQueryLogItem of the snapshot, without rows
+ * @param json output, the serialized reference
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation
+ */
+Status serializeUnchangedSnapshotJSON(const ScheduledQueryLogItem& i,
+                                      std::string& json);
+
 /**
  * @brief Serialize a ScheduledQueryLogItem object into a property tree
  * of events, a list of actions.
@@ -138,6 +204,51 @@ Status serializeScheduledQueryLogItemAsEvents(
 Status serializeScheduledQueryLogItemAsEventsJSON(
     const ScheduledQueryLogItem& i, std::string& json);
 
+/// Receives a batch of serialized log strings, which it may move from.
+typedef std::function<Status(std::vector<std::string>&)> LogBatchWriter;
+
+/**
+ * @brief Serialize a ScheduledQueryLogItem as events, a batch at a time.
+ *
+ * Each row is serialized as one event string, as by
+ * serializeScheduledQueryLogItemAsEventsJSON, and the fields shared by every
+ * event are serialized once. Events are given to the writer whenever
+ * `batch_size` bytes are buffered, such that the memory used does not grow
+ * with the number of rows.
+ *
+ * @param i the ScheduledQueryLogItem to serialize
+ * @param batch_size the bytes of events buffered before each write
+ * @param writer the function receiving each batch of events
+ *
+ * @return the first failed write's status, later rows are not serialized.
+ */
+Status serializeScheduledQueryLogItemAsEvents(const ScheduledQueryLogItem& i,
+                                              size_t batch_size,
+                                              const LogBatchWriter& writer);
+
+/**
+ * @brief Get the identifier of this host used within logged results.
+ *
+ * The identifier is named by the host_identifier flag, either the "hostname"
+ * or a "uuid" stored in the database. It is resolved once and cached until
+ * the flag changes.
+ *
+ * @param ident output, the host identifier.
+ *
+ * @return an instance of osquery::Status, indicating the success or failure
+ * of the operation.
+ */
+Status getHostIdentifier(std::string& ident);
+
+/**
+ * @brief Ask the scheduler to shed caches and briefly defer due queries.
+ *
+ * The watchdog signals a worker nearing its memory or CPU limits, such that
+ * the worker may recover before it is throttled or stopped. Deferred queries
+ * run once the deferral ends. This is safe to call from a signal handler.
+ */
+void deferScheduledQueries();
+
 /**
  * @brief Launch the scheduler.
  *
@@ -153,6 +264,41 @@ Status serializeScheduledQueryLogItemAsEventsJSON(
  */
 void initializeScheduler();
 
+/**
+ * @brief Run a distributed query, logging its results a page at a time.
+ *
+ * The query runs on a pooled connection under the request's budget. Rows are
+ * serialized as they are generated and given to the writer in pages of at
+ * most --distributed_page_bytes, such that the complete results are never
+ * held in memory. Each row is a JSON line with the request "id", the "page"
+ * number and the row "columns". The last page ends with a line holding the
+ * query's "status" and the total "rows", it is written even if the query
+ * fails.
+ *
+ * @param request the query and its limits.
+ * @param writer the function receiving each page, logStringBatch by default.
+ * @return the status of the query, or of the first failed write.
+ */
+Status runDistributedQuery(const DistributedQueryRequest& request,
+                           const LogBatchWriter& writer);
+
+/**
+ * @brief Poll the config retriever for distributed queries and run them.
+ *
+ * Queries are requested every --distributed_interval seconds, the function
+ * returns immediately if the interval is 0. Use it as a thread entry point,
+ * like initializeScheduler, and stop it with stopDistributed.
+ */
+void initializeDistributed();
+
+/**
+ * @brief Stop the thread running initializeDistributed.
+ *
+ * A running distributed query is cancelled, the thread returns once the
+ * query's last page is logged. Queries run afterward are cancelled too.
+ */
+void stopDistributed();
+
 /**
  * @brief Calculate a splayed integer based on a variable splay percentage
  *
@@ -165,4 +311,50 @@ void initializeScheduler();
  * @return The modified version of original
  */
 int splayValue(int original, int splayPercent);
+
+/**
+ * @brief Calculate a splayed integer chosen deterministically from a seed
+ *
+ * Identical to splayValue, but the host identifier and query name seed the
+ * choice such that every host uses a different value and recomputing the
+ * splay, e.g. after a config reload, yields the same value.
+ *
+ * @param original The original value to be modified
+ * @param splayPercent The percent in which to splay the original value by
+ * @param seed A host and query specific seed
+ *
+ * @return The modified version of original
+ */
+int splayValue(int original, int splayPercent, const std::string& seed);
+
+/**
+ * @brief Calculate a query's phase within its interval from a seed
+ *
+ * A query is due whenever the unix time modulo its interval equals its phase.
+ * Seeding the phase with the host identifier spreads the runs of a query
+ * across the fleet instead of aligning them on the same second.
+ *
+ * @param interval The query interval in seconds
+ * @param seed A host and query specific seed
+ *
+ * @return A phase in the range [0, interval)
+ */
+int splayPhase(int interval, const std::string& seed);
+
+/**
+ * @brief Calculate when to run a query that missed runs while stopped
+ *
+ * A restarted daemon runs each query that missed a run once, spread over a
+ * window from the start instead of all at the same time.
+ *
+ * @param interval The query interval in seconds
+ * @param since_run The seconds since the query's last run started
+ * @param next The seconds until the query's next scheduled run
+ * @param window The seconds runs are spread over, 0 disables catching up
+ * @param seed A host and query specific seed
+ *
+ * @return The seconds until the catch-up run, or -1 if none is needed
+ */
+int catchUpOffset(
+    int interval, int since_run, int next, int window, const std::string& seed);
 }
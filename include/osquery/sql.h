@@ -11,6 +11,7 @@
 #pragma once
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,11 @@
 #include <osquery/tables.h>
 
 namespace osquery {
+
+/// The SQL representation of each constraint operator, such as "=".
+extern const std::map<tables::ConstraintOperator, std::string>
+    kSQLOperatorRepr;
+
 /**
  * @brief The core interface to executing osquery SQL commands
  *
@@ -138,6 +144,26 @@ class SQL {
  */
 Status query(const std::string& query, QueryData& results);
 
+/**
+ * @brief Execute a query that is expected to run repeatedly
+ *
+ * Identical to osquery::query, but the prepared statement for the query text
+ * is cached and reused on later calls. Use this for scheduled queries or
+ * similar fixed query strings, not for ad-hoc or generated queries.
+ *
+ * @param q the query to execute
+ * @param results A QueryData structure to emit result rows on success.
+ * @param budget optional time and CPU limits, the query fails if exceeded.
+ * @param snapshot optional tables shared with other queries.
+ * @param events optional range of event times read from event tables.
+ * @return A status indicating query success.
+ */
+Status queryCached(const std::string& query,
+                   QueryData& results,
+                   const tables::QueryBudgetRef& budget = nullptr,
+                   const tables::TableSnapshotRef& snapshot = nullptr,
+                   const tables::EventWindow& events = tables::EventWindow());
+
 /**
  * @brief Analyze a query, providing information about the result columns
  *
@@ -152,4 +178,39 @@ Status query(const std::string& query, QueryData& results);
  * @return status indicating success or failure of the operation
  */
 Status getQueryColumns(const std::string& q, tables::TableColumns& columns);
+
+/**
+ * @brief Analyze a query, providing the names of the tables it reads
+ *
+ * @param q the query to analyze
+ * @param tables the set to fill with table names
+ *
+ * @return status indicating success or failure of the operation
+ */
+Status getQueryTables(const std::string& q, std::set<std::string>& tables);
+
+/// The result of preparing a query without running it.
+struct QueryPlan {
+  /// The names and types of the result columns.
+  tables::TableColumns columns;
+
+  /// The tables the query reads.
+  std::set<std::string> tables;
+
+  /// The tables that generate every row, without a constraint.
+  std::vector<std::string> scans;
+};
+
+/**
+ * @brief Prepare a query, providing its columns, tables, and full scans
+ *
+ * The prepared statement is kept in a pooled connection's statement cache
+ * such that the first run of the query does not prepare it again.
+ *
+ * @param q the query to analyze
+ * @param plan the plan to fill with query information
+ *
+ * @return status indicating if the query is valid
+ */
+Status getQueryPlan(const std::string& q, QueryPlan& plan);
 }
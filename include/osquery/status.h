@@ -10,11 +10,24 @@
 
 #pragma once
 
+#include <cstring>
 #include <sstream>
 #include <string>
 
 namespace osquery {
 
+/// Status codes callers may branch on, other failures use 1.
+enum StatusCode {
+  STATUS_OK = 0,
+  STATUS_ERROR = 1,
+  /// A traversal stopped at its maximum depth.
+  STATUS_MAX_DEPTH = 2,
+  /// The requested name or key does not exist.
+  STATUS_NOT_FOUND = 3,
+  /// The backing store failed the operation, such as on corruption or I/O.
+  STATUS_DB_ERROR = 4,
+};
+
 /**
  * @brief A utility class which is used to express the state of operations.
  *
@@ -28,6 +41,9 @@ namespace osquery {
  *     }
  *   }
  * @endcode
+ *
+ * A successful status with the "OK" message stores no string, such that the
+ * common `return Status(0, "OK")` neither allocates nor copies.
  */
 class Status {
  public:
@@ -37,7 +53,7 @@ class Status {
    * Note that the default constructor initialized an osquery::Status instance
    * to a state such that a successful operation is indicated.
    */
-  Status() : code_(0), message_("OK") {}
+  Status() : code_(0) {}
 
   /**
    * @brief A constructor which can be used to concisely express the status of
@@ -51,7 +67,23 @@ class Status {
    * Otherwise, it doesn't matter what the string is, as long as both the
    * setter and caller agree.
    */
-  Status(int c, std::string m) : code_(c), message_(m) {}
+  Status(int c, const char* m) : code_(c) {
+    if (c != 0 || strcmp(m, "OK") != 0) {
+      message_ = m;
+    }
+  }
+
+  Status(int c, const std::string& m) : code_(c) {
+    if (c != 0 || m != "OK") {
+      message_ = m;
+    }
+  }
+
+  Status(int c, std::string&& m) : code_(c) {
+    if (c != 0 || m != "OK") {
+      message_ = std::move(m);
+    }
+  }
 
  public:
   /**
@@ -68,7 +100,9 @@ class Status {
    * success or failure of an operation. On successful operations, the idiom
    * is for the message to be "OK"
    */
-  std::string getMessage() const { return message_; }
+  const std::string& getMessage() const {
+    return (code_ == 0 && message_.empty()) ? okMessage() : message_;
+  }
 
   /**
    * @brief A convenience method to check if the return code is 0
@@ -91,8 +125,8 @@ class Status {
    *
    * @see getMessage()
    */
-  std::string toString() const { return getMessage(); }
-  std::string what() const { return getMessage(); }
+  const std::string& toString() const { return getMessage(); }
+  const std::string& what() const { return getMessage(); }
 
   /**
    * @brief implicit conversion to bool
@@ -111,7 +145,7 @@ class Status {
 
   // Enables use of gtest (ASSERT|EXPECT)_EQ
   bool operator==(const Status& rhs) const {
-    return (code_ == rhs.getCode()) && (message_ == rhs.getMessage());
+    return (code_ == rhs.getCode()) && (getMessage() == rhs.getMessage());
   }
 
   // Enables use of gtest (ASSERT|EXPECT)_NE
@@ -120,11 +154,18 @@ class Status {
   // Enables pretty-printing in gtest (ASSERT|EXPECT)_(EQ|NE)
   friend ::std::ostream& operator<<(::std::ostream& os, const Status& s);
 
+ private:
+  /// The message of a successful status without its own.
+  static const std::string& okMessage() {
+    static const std::string message("OK");
+    return message;
+  }
+
  private:
   /// the internal storage of the status code
   int code_;
 
-  /// the internal storage of the status message
+  /// the internal storage of the status message, empty if "OK"
   std::string message_;
 };
 }
@@ -10,8 +10,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <boost/lexical_cast.hpp>
@@ -28,6 +37,12 @@
 #endif
 
 namespace osquery {
+
+class DBSnapshot;
+
+/// A consistent view of the backing store, see DBHandle::getSnapshot.
+typedef std::shared_ptr<DBSnapshot> DBSnapshotRef;
+
 namespace tables {
 
 /**
@@ -69,7 +84,6 @@ namespace tables {
 /// Helper alias for TablePlugin names.
 typedef std::string TableName;
 typedef std::vector<std::pair<std::string, std::string> > TableColumns;
-typedef std::map<std::string, std::vector<std::string> > TableData;
 
 /**
  * @brief A ConstraintOperator is applied in an query predicate.
@@ -82,7 +96,9 @@ enum ConstraintOperator {
   GREATER_THAN = 4,
   LESS_THAN_OR_EQUALS = 8,
   LESS_THAN = 16,
-  GREATER_THAN_OR_EQUALS = 32
+  GREATER_THAN_OR_EQUALS = 32,
+  /// A LIKE pattern, matched by the generator as it chooses.
+  LIKE = 65
 };
 
 /**
@@ -104,6 +120,79 @@ struct Constraint {
   }
 };
 
+/// The SQLite affinity of a ConstraintList, parsed once from its name.
+enum ConstraintAffinity {
+  AFFINITY_TEXT,
+  AFFINITY_INTEGER,
+  AFFINITY_BIGINT,
+  AFFINITY_UNSIGNED_BIGINT,
+  AFFINITY_UNSUPPORTED,
+};
+
+/**
+ * @brief The interval of values allowed by a conjunction of comparisons.
+ *
+ * Each constraint narrows a bound, `x > 5 AND x < 10 AND x > 7` keeps the
+ * single interval (7, 10) and an equality is an interval of one value.
+ */
+template <typename T>
+struct ConstraintRange {
+  bool has_lower;
+  bool lower_inclusive;
+  T lower;
+  bool has_upper;
+  bool upper_inclusive;
+  T upper;
+
+  ConstraintRange()
+      : has_lower(false),
+        lower_inclusive(false),
+        lower(),
+        has_upper(false),
+        upper_inclusive(false),
+        upper() {}
+
+  /// Narrow the range by a comparison, false if the operator is unsupported.
+  bool narrow(unsigned char op, const T& value) {
+    if (op == EQUALS) {
+      narrowLower(value, true);
+      narrowUpper(value, true);
+    } else if (op == GREATER_THAN || op == GREATER_THAN_OR_EQUALS) {
+      narrowLower(value, op == GREATER_THAN_OR_EQUALS);
+    } else if (op == LESS_THAN || op == LESS_THAN_OR_EQUALS) {
+      narrowUpper(value, op == LESS_THAN_OR_EQUALS);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  bool contains(const T& value) const {
+    if (has_lower && (value < lower || (value == lower && !lower_inclusive))) {
+      return false;
+    }
+    return !(has_upper &&
+             (upper < value || (value == upper && !upper_inclusive)));
+  }
+
+ private:
+  void narrowLower(const T& value, bool inclusive) {
+    if (!has_lower || lower < value || (value == lower && !inclusive)) {
+      has_lower = true;
+      lower = value;
+      lower_inclusive = inclusive;
+    }
+  }
+
+  void narrowUpper(const T& value, bool inclusive) {
+    if (!has_upper || value < upper || (value == upper && !inclusive)) {
+      has_upper = true;
+      upper = value;
+      upper_inclusive = inclusive;
+    }
+  }
+};
+
 /**
  * @brief A ConstraintList is a set of constraints for a column. This list
  * should be mapped to a left-hand-side column name.
@@ -115,9 +204,15 @@ struct Constraint {
  * A constraint list supports all AS_LITERAL types, and all ConstraintOperators.
  */
 struct ConstraintList {
-  /// The SQLite affinity type.
+  /// The SQLite affinity type, changed with setAffinity.
   std::string affinity;
 
+  /// Set the SQLite affinity type, it is resolved when the list is compiled.
+  void setAffinity(const std::string& _affinity) {
+    affinity = _affinity;
+    compiled_ = false;
+  }
+
   /**
    * @brief Check if an expression matches the query constraints.
    *
@@ -184,12 +279,6 @@ struct ConstraintList {
     return (!exists() || matches(expr));
   }
 
-  /**
-   * @brief Helper templated function for ConstraintList::matches.
-   */
-  template <typename T>
-  bool literal_matches(const T& base_expr);
-
   /**
    * @brief Get all expressions for a given ConstraintOperator.
    *
@@ -197,7 +286,7 @@ struct ConstraintList {
    * The generator may `getAll(EQUALS)` then iterate.
    *
    * @param op the ConstraintOperator.
-   * @return A list of TEXT%-represented types matching the operator.
+   * @return The distinct TEXT%-represented expressions, in query order.
    */
   std::vector<std::string> getAll(ConstraintOperator op);
 
@@ -208,8 +297,19 @@ struct ConstraintList {
    */
   void add(const struct Constraint& constraint) {
     constraints_.push_back(constraint);
+    compiled_ = false;
   }
 
+  /**
+   * @brief Parse the affinity and constraint expressions into a range.
+   *
+   * `matches` then compares values to the range's typed bounds. The SQLite
+   * module compiles each list once its constraints are known, such that
+   * generators may call `matches` from several threads. Otherwise the list
+   * is compiled by the first `matches` after `add` or `setAffinity`.
+   */
+  void compile();
+
   /**
    * @brief Serialize a ConstraintList into a property tree.
    *
@@ -224,12 +324,31 @@ struct ConstraintList {
   void serialize(boost::property_tree::ptree& tree) const;
   void unserialize(const boost::property_tree::ptree& tree);
 
-  ConstraintList() { affinity = "TEXT"; }
+  /// A compact representation of the constraints, e.g. "2:1:a4:2:10".
+  std::string key() const;
+
+  ConstraintList() : compiled_(false), unsatisfiable_(false) {
+    affinity = "TEXT";
+  }
+
+ private:
+  /// Narrow a range by each constraint, parsed as the literal type L.
+  template <typename L, typename T>
+  bool compileRange(ConstraintRange<T>& range);
 
  private:
   /// List of constraint operator/expressions.
   std::vector<struct Constraint> constraints_;
 
+  /// The compiled affinity and range of the constraints.
+  bool compiled_;
+  ConstraintAffinity affinity_;
+  /// A constraint is unsupported or its expression is not of the affinity.
+  bool unsatisfiable_;
+  ConstraintRange<std::string> text_range_;
+  ConstraintRange<long long> integer_range_;
+  ConstraintRange<unsigned long long> unsigned_range_;
+
  private:
   FRIEND_TEST(TablesTests, test_constraint_list);
 };
@@ -238,6 +357,223 @@ struct ConstraintList {
 typedef std::map<std::string, struct ConstraintList> ConstraintMap;
 /// Populate a containst list from a query's parsed predicate.
 typedef std::vector<std::pair<std::string, struct Constraint> > ConstraintSet;
+/// The set of column names a query references.
+typedef std::set<std::string> UsedColumns;
+
+/**
+ * @brief Column attributes a table spec may declare to help query planning.
+ *
+ * The options are a bitmask mapped to a column name in TableColumnOptions.
+ */
+enum ColumnOptions {
+  /// The generator applies EQUALS constraints on this column exactly.
+  COLUMN_INDEX = 1,
+  /// The generator requires a constraint on one of its required columns.
+  COLUMN_REQUIRED = 2,
+};
+
+/// Map a column name to its ColumnOptions bitmask.
+typedef std::map<std::string, int> TableColumnOptions;
+
+/**
+ * @brief The wall-clock and CPU limits of a running query.
+ *
+ * The scheduler creates a budget for queries configured with a timeout_ms or
+ * cpu_ms. SQLite checks it between virtual machine steps and interrupts the
+ * query once it is exceeded, long-running generators should poll
+ * QueryContext::cancelled.
+ */
+class QueryBudget {
+ public:
+  /**
+   * @brief Start the budget of a query.
+   *
+   * @param timeout_ms the wall-clock limit in milliseconds, 0 for none.
+   * @param cpu_ms the CPU time limit of the thread executing the query in
+   * milliseconds, 0 for none.
+   */
+  QueryBudget(size_t timeout_ms, size_t cpu_ms);
+
+  /**
+   * @brief Check if the query exceeded its limits.
+   *
+   * CPU time is only measured on the thread that created the budget, other
+   * threads check the wall-clock limit. Once exceeded the budget remains so.
+   */
+  bool exceeded();
+
+  /// Cancel the query regardless of its limits.
+  void cancel() { exceeded_ = true; }
+
+ private:
+  std::chrono::steady_clock::time_point deadline_;
+  size_t timeout_ms_;
+  size_t cpu_ms_;
+  /// The creating thread's CPU time at the start, in microseconds.
+  unsigned long long cpu_start_;
+  std::thread::id thread_;
+  std::atomic<bool> exceeded_;
+};
+
+typedef std::shared_ptr<QueryBudget> QueryBudgetRef;
+
+/// The cost of one virtual table within a profiled query.
+struct TableProfile {
+  /// The number of xFilter calls, one for each scan of the table.
+  size_t filters;
+  /// Microseconds spent in xFilter and fetching rows from a cursor.
+  size_t generate_us;
+  /// The number of rows generated.
+  size_t rows;
+  /// The number of rows SQLite read, before its own constraint checks.
+  size_t returned;
+  /// The bytes of generated values stored for SQLite to read.
+  size_t bytes;
+  /// The constraints xBestIndex passed to the generator, such as "pid =".
+  std::set<std::string> constraints;
+
+  TableProfile()
+      : filters(0), generate_us(0), rows(0), returned(0), bytes(0) {}
+};
+
+/// The cost of each virtual table used by a profiled query, by table name.
+typedef std::map<std::string, TableProfile> QueryProfile;
+typedef std::shared_ptr<QueryProfile> QueryProfileRef;
+
+/// Generated rows shared between queries.
+typedef std::shared_ptr<const QueryData> QueryDataRef;
+
+/**
+ * @brief Generated tables shared by a group of queries.
+ *
+ * Scheduled queries due at the same time often read the same tables with
+ * different constraints. The scheduler gives such a group one snapshot and
+ * each shared table is generated once, without constraints, for the group.
+ * SQLite applies every query's constraints to the snapshot rows, so tables
+ * with index or required columns, which generate rows for their constraints
+ * only, are never shared.
+ */
+class TableSnapshot {
+ public:
+  /// Create a snapshot sharing the given tables.
+  explicit TableSnapshot(const std::set<std::string>& tables)
+      : tables_(tables) {}
+
+  /// Check if a table is shared by the snapshot.
+  bool shares(const std::string& table) const {
+    return (tables_.count(table) > 0);
+  }
+
+  /**
+   * @brief Get the rows of a shared table, generating them once.
+   *
+   * Concurrent callers wait for the first caller's generation.
+   *
+   * @param table the table name, suffixed by a bounded event window.
+   * @param generate generates the table's rows without constraints.
+   */
+  QueryDataRef get(const std::string& table,
+                   const std::function<QueryDataRef()>& generate);
+
+ private:
+  std::set<std::string> tables_;
+  std::map<std::string, std::shared_future<QueryDataRef> > rows_;
+  std::mutex mutex_;
+};
+
+typedef std::shared_ptr<TableSnapshot> TableSnapshotRef;
+
+/**
+ * @brief The offsets a scheduled query's run read appended files up to.
+ *
+ * Tables returning only the lines appended to a file since the last read
+ * keep an offset per query, so queries reading the same file do not consume
+ * each other's lines. A generator reads the query's stored offset under
+ * key(path) and records where it stopped with set. The scheduler stores the
+ * recorded offsets only once the run's results are logged, so a failed run
+ * reads the same lines again.
+ */
+class ReadOffsets {
+ public:
+  explicit ReadOffsets(const std::string& consumer) : consumer_(consumer) {}
+
+  /// The backing store key of a file's offset for this consumer.
+  std::string key(const std::string& path) const {
+    return consumer_ + ":" + path;
+  }
+
+  /// Record the offset this run read a file up to.
+  void set(const std::string& path, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_[key(path)] = value;
+  }
+
+  /// Take the recorded offsets, by backing store key.
+  std::map<std::string, std::string> take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, std::string> pending;
+    pending.swap(pending_);
+    return pending;
+  }
+
+ private:
+  std::string consumer_;
+  std::map<std::string, std::string> pending_;
+  std::mutex mutex_;
+};
+
+typedef std::shared_ptr<ReadOffsets> ReadOffsetsRef;
+
+/**
+ * @brief The range of event times a query reads from event-backed tables.
+ *
+ * The scheduler gives snapshot queries a window such that each run reads only
+ * the events added since its previous run. The window includes `start` and
+ * excludes `stop`, a 0 leaves that end of the window unbounded.
+ *
+ * Scheduled queries also carry their file read offsets, see ReadOffsets.
+ */
+struct EventWindow {
+  size_t start;
+  size_t stop;
+  /// The running query's file read offsets, if it is scheduled.
+  ReadOffsetsRef offsets;
+  /// The snapshot every event table of the query reads, if it has one.
+  DBSnapshotRef snapshot;
+
+  EventWindow() : start(0), stop(0) {}
+  EventWindow(size_t _start, size_t _stop) : start(_start), stop(_stop) {}
+
+  /// Check if the window limits the events read.
+  bool bounded() const { return (start > 0 || stop > 0); }
+};
+
+/**
+ * @brief State the generators of one query share, created for each query.
+ *
+ * Tables that read the same expensive source, such as several tables of one
+ * join, may keep it here rather than in a process-wide cache. The state is
+ * released when the query finishes, so it is never seen by another query.
+ */
+class QueryScope {
+ public:
+  /// Get the named state of the query, default constructed on first use.
+  template <typename T>
+  std::shared_ptr<T> get(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& value = values_[name];
+    if (value == nullptr) {
+      value = std::make_shared<T>();
+    }
+    return std::static_pointer_cast<T>(value);
+  }
+
+ private:
+  std::map<std::string, std::shared_ptr<void> > values_;
+  std::mutex mutex_;
+};
+
+typedef std::shared_ptr<QueryScope> QueryScopeRef;
 
 /**
  * @brief A QueryContext is provided to every table generator for optimization
@@ -247,13 +583,364 @@ struct QueryContext {
   ConstraintMap constraints;
   /// Support a limit to the number of results.
   int limit;
+  /// The columns the query references, only valid if colsUsedSet is true.
+  UsedColumns colsUsed;
+  /// SQLite provided the used columns for this query.
+  bool colsUsedSet;
+  /// The budget of the running query, if it has one.
+  QueryBudgetRef budget;
+  /// The event times the running query reads, if it has a window.
+  EventWindow events;
+  /// The running query's shared generator state, if it has one.
+  QueryScopeRef scope;
+
+  QueryContext() : limit(0), colsUsedSet(false) {}
 
-  QueryContext() : limit(0) {}
+  /**
+   * @brief Check if a generator has produced enough rows for the query.
+   *
+   * SQLite provides a limit only when the query has no other constraints on
+   * the table, so generators may stop as soon as the limit is reached.
+   * The limit includes any OFFSET.
+   *
+   * @param rows the number of rows generated.
+   * @return true if no more rows are needed.
+   */
+  bool limitReached(size_t rows) const {
+    return (limit > 0 && rows >= (size_t)limit);
+  }
+
+  /**
+   * @brief Check if the query was cancelled for exceeding its budget.
+   *
+   * Generators walking a filesystem or hashing files should check between
+   * items and return the rows generated so far, which are discarded.
+   */
+  bool cancelled() const { return (budget != nullptr && budget->exceeded()); }
+
+  /**
+   * @brief A key identifying the rows a generator will produce.
+   *
+   * The key includes the constraints, used columns, and limit such that two
+   * contexts with equal keys generate equivalent results.
+   */
+  std::string key() const;
+
+  /**
+   * @brief Check if a column is used by the query.
+   *
+   * Generators may skip populating expensive columns that are not selected,
+   * constrained, or otherwise referenced by the query. If SQLite did not
+   * report the used columns every column is considered used.
+   *
+   * @param column the column name.
+   * @return true if the column's value may be read.
+   */
+  bool isColumnUsed(const std::string& column) const {
+    return (!colsUsedSet || colsUsed.count(column) > 0);
+  }
 };
 
 typedef struct QueryContext QueryContext;
 typedef struct Constraint Constraint;
 
+/**
+ * @brief A generated value kept in its SQLite storage type.
+ *
+ * Typed cursors produce ColumnValues such that numbers reach SQLite without
+ * being formatted as TEXT and parsed back. A default ColumnValue is NULL,
+ * which generators should use for unknown values instead of -1.
+ */
+struct ColumnValue {
+  enum Type {
+    kNull,
+    kInteger,
+    kDouble,
+    kText,
+  };
+
+  Type type;
+  long long int integer;
+  double real;
+  std::string text;
+
+  ColumnValue() : type(kNull), integer(0), real(0) {}
+
+  ColumnValue(const char* value)
+      : type(kText), integer(0), real(0), text(value) {}
+
+  ColumnValue(std::string value)
+      : type(kText), integer(0), real(0), text(std::move(value)) {}
+
+  ColumnValue(double value) : type(kDouble), integer(0), real(value) {}
+
+  template <typename T,
+            typename =
+                typename std::enable_if<std::is_integral<T>::value>::type>
+  ColumnValue(T value)
+      : type(kInteger), integer((long long int)value), real(0) {
+    // SQLite integers are signed, larger unsigned values are kept as TEXT.
+    if (std::is_unsigned<T>::value &&
+        (unsigned long long)value > (unsigned long long)LLONG_MAX) {
+      type = kText;
+      integer = 0;
+      text = std::to_string((unsigned long long)value);
+    }
+  }
+
+  /// The value as a Row stores it, NULL values are not stored.
+  std::string toString() const;
+};
+
+/// A generated row of typed values, keyed by column name.
+typedef std::map<std::string, ColumnValue> TypedRow;
+
+/**
+ * @brief A pull-based cursor over the rows of a table.
+ *
+ * Tables that enumerate large sets, such as filesystem walks, may implement a
+ * cursor instead of a materialized QueryData. SQLite requests rows one at a
+ * time and stops as soon as the query is satisfied, for example by a LIMIT.
+ */
+class TableCursor {
+ public:
+  virtual ~TableCursor() {}
+
+  /**
+   * @brief Produce the next row.
+   *
+   * @param r [output] the row to fill.
+   * @return false when the table has no more rows.
+   */
+  virtual bool next(Row& r) = 0;
+
+  /**
+   * @brief Produce the next row as typed values, if the cursor is typed.
+   *
+   * @param r [output] the row to fill.
+   * @return false when the table has no more rows.
+   */
+  virtual bool nextTyped(TypedRow& r) { return false; }
+
+  /// SQLite pulls the rows of typed cursors with nextTyped.
+  virtual bool typed() const { return false; }
+};
+
+typedef std::shared_ptr<TableCursor> TableCursorRef;
+
+/**
+ * @brief A cursor producing typed rows.
+ *
+ * Numeric columns are stored from the typed values without a conversion to
+ * TEXT. Callers pulling Rows, such as the registry call API, receive the
+ * values as TEXT.
+ */
+class TypedTableCursor : public TableCursor {
+ public:
+  virtual bool nextTyped(TypedRow& r) = 0;
+
+  bool next(Row& r);
+
+  bool typed() const { return true; }
+};
+
+/**
+ * @brief Rows parsed from files, reused while the files are unchanged.
+ *
+ * Tables parsing text files that rarely change, such as /etc/hosts, key
+ * their rows by the identity of the files: the path, modification time,
+ * size, and inode of each. A directory's identity includes the identity of
+ * each entry directly within it, from lstat, so links below a directory are
+ * not followed. Rows are parsed again only if an identity changed.
+ *
+ * At most a few keys are cached, the least recently used is removed first.
+ */
+class FileBackedCache {
+ public:
+  FileBackedCache() : uses_(0) {}
+
+  /**
+   * @brief The identity of a set of files, empty values for missing files.
+   *
+   * @param paths files or directories the rows are parsed from.
+   */
+  static std::string identify(const std::vector<std::string>& paths);
+
+  /**
+   * @brief Get the rows for a key, generating them if the files changed.
+   *
+   * @param key the rows' key, such as a QueryContext key.
+   * @param paths files or directories the rows are parsed from.
+   * @param generate parses the files, its rows are cached.
+   */
+  QueryData get(const std::string& key,
+                const std::vector<std::string>& paths,
+                const std::function<QueryData()>& generate);
+
+  /// Forget the rows of a key.
+  void erase(const std::string& key);
+
+ private:
+  /// Rows with the identity of the files they came from.
+  struct Entry {
+    std::string identity;
+    QueryData rows;
+    /// The value of uses_ when the rows were last read.
+    size_t used;
+  };
+
+  /// The rows of each key.
+  std::map<std::string, Entry> rows_;
+  /// Counts reads, ordering the keys by their most recent use.
+  size_t uses_;
+  std::mutex mutex_;
+};
+
+/**
+ * @brief Generate a table in a short-lived helper process.
+ *
+ * Generators allocating heavily through third-party libraries fragment the
+ * worker's heap, which is rarely returned. The helper is the worker's own
+ * executable started again, with the worker's flags, naming the table and
+ * its serialized context in its environment. It generates the table, writes
+ * each row over a pipe in the binary row encoding, then exits with its heap.
+ * The worker is not forked, its threads and their locks are not copied into
+ * the helper. At most `--table_helper_processes` helpers run at once, a
+ * helper running past `--table_helper_timeout` seconds is killed.
+ *
+ * @param table the name of the table plugin the helper generates.
+ * @param context the query context, passed to the helper.
+ * @param generator generates the rows in process if a helper cannot start.
+ * @param results the rows read from the helper.
+ * @return Failure if the helper failed or its rows could not be read.
+ */
+Status generateInHelper(const std::string& table,
+                        const QueryContext& context,
+                        const std::function<QueryData()>& generator,
+                        QueryData& results);
+
+/// Keep the process's arguments, table helpers are started with them.
+void setHelperArguments(int argc, char* argv[]);
+
+/// The process was started by generateInHelper to generate a table.
+bool isTableHelper();
+
+/**
+ * @brief Generate the table a helper was started for and write its rows.
+ *
+ * Called by a helper once its flags are parsed, before any other setup.
+ *
+ * @return The helper's exit code, 0 if every row was written.
+ */
+int runTableHelper();
+
+/// Inputs of fewer than twice this many items are generated serially.
+const size_t kParallelMinItems = 8;
+
+/**
+ * @brief The number of chunks parallelMap splits a number of items into.
+ *
+ * At most `--table_parallelism` chunks of at least kParallelMinItems each,
+ * or 1 if the input is too small to be worth dispatching.
+ */
+size_t parallelChunks(size_t items);
+
+/**
+ * @brief Run work(chunk, begin, end) for each chunk of items in parallel.
+ *
+ * Chunks after the first are run by Dispatcher workers, the calling thread
+ * runs the first chunk and then waits for the others.
+ */
+void parallelRun(size_t items,
+                 size_t chunks,
+                 const std::function<void(size_t, size_t, size_t)>& work);
+
+/**
+ * @brief Call f(item) for each item using the Dispatcher workers.
+ *
+ * Items are skipped once the query is cancelled. f is called concurrently
+ * and must synchronize any state it shares.
+ */
+template <class T, class F>
+void parallelForEach(QueryContext& context,
+                     const std::vector<T>& items,
+                     const F& f) {
+  parallelRun(items.size(),
+              parallelChunks(items.size()),
+              [&context, &items, &f](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end && !context.cancelled(); ++i) {
+                  f(items[i]);
+                }
+              });
+}
+
+/**
+ * @brief Generate rows with f(item, results) for each item in parallel.
+ *
+ * Each chunk of items appends to its own QueryData, the chunks are merged
+ * in order without locking. Rows are returned in the order a serial loop
+ * over the items would generate them.
+ *
+ * @code{.cpp}
+ *   return parallelMap(context, pids, [](const std::string& pid,
+ *                                        QueryData& results) {
+ *     genProcessFiles(pid, results);
+ *   });
+ * @endcode
+ */
+template <class T, class F>
+QueryData parallelMap(QueryContext& context,
+                      const std::vector<T>& items,
+                      const F& f) {
+  auto chunks = parallelChunks(items.size());
+  std::vector<QueryData> partial(chunks);
+  parallelRun(
+      items.size(),
+      chunks,
+      [&context, &items, &f, &partial](size_t chunk, size_t begin, size_t end) {
+        for (size_t i = begin; i < end && !context.cancelled(); ++i) {
+          f(items[i], partial[chunk]);
+        }
+      });
+
+  QueryData results = std::move(partial[0]);
+  for (size_t i = 1; i < chunks; ++i) {
+    results.insert(results.end(),
+                   std::make_move_iterator(partial[i].begin()),
+                   std::make_move_iterator(partial[i].end()));
+  }
+  return results;
+}
+
+/// The default number of rows in each "generate_batches" response batch.
+const size_t kTableBatchRows = 1024;
+
+/**
+ * @brief A table's schema and planning hints, read when it is attached.
+ *
+ * In-process tables provide the definition directly, see
+ * TablePlugin::definition. Tables crossing a registry boundary describe it
+ * with the "statement" and "columns" actions.
+ */
+struct TableDefinition {
+  /// The SQL CREATE TABLE statement.
+  std::string statement;
+  /// The parenthesized column list of the statement.
+  std::string column_definition;
+  TableColumns columns;
+  /// The column generated rows are sorted by, or empty.
+  std::string ordered;
+  TableColumnOptions options;
+  /// The expected number of rows in a full scan, 0 if unknown.
+  size_t estimated_rows;
+  bool cacheable;
+  /// Rows depend on the query's ReadOffsets, see TablePlugin::incremental.
+  bool incremental;
+
+  TableDefinition()
+      : estimated_rows(0), cacheable(false), incremental(false) {}
+};
+
 /**
  * @brief The TablePlugin defines the name, types, and column information.
  *
@@ -279,7 +966,115 @@ class TablePlugin : public Plugin {
     return data;
   }
 
+  /**
+   * @brief The column generated rows are sorted by, ascending, if any.
+   *
+   * SQLite will not sort the results of an `ORDER BY` on this column, and a
+   * query's LIMIT may then be passed to the generator.
+   */
+  virtual std::string naturalOrder() { return ""; }
+
+  /// Planning options for the table's columns, see ColumnOptions.
+  virtual TableColumnOptions columnOptions() {
+    TableColumnOptions options;
+    return options;
+  }
+
+  /// The expected number of rows in a full scan, 0 if unknown.
+  virtual size_t estimatedRows() { return 0; }
+
+  /**
+   * @brief Generated results may be reused for `--table_cache_ttl` seconds.
+   *
+   * Tables reading volatile but expensive state, such as process listings,
+   * opt into reuse between queries running at nearly the same time.
+   */
+  virtual bool cacheable() { return false; }
+
+  /**
+   * @brief Files the table's rows are parsed from, if any.
+   *
+   * Rows generated for a query context are reused until one of the files
+   * changes, see FileBackedCache. Set by `source_files` in a table spec.
+   */
+  virtual std::vector<std::string> sourceFiles() { return {}; }
+
+  /**
+   * @brief Generated rows do not change while the system is up.
+   *
+   * Tables reading firmware, such as SMBIOS or ACPI tables, generate their
+   * rows once, without constraints, and reuse them for the life of the
+   * process. Each query context reads the rows matching its text equality
+   * constraints. Set by `cacheable(BOOT)` in a table spec.
+   */
+  virtual bool bootCacheable() { return false; }
+
+  /**
+   * @brief Generate rows in a helper process, see generateInHelper.
+   *
+   * Tables whose libraries leave the heap fragmented, such as a package
+   * database reader, keep the worker's memory from growing toward the
+   * watchdog limit. Set by `isolated()` in a table spec.
+   */
+  virtual bool isolated() { return false; }
+
+  /**
+   * @brief Generated rows are only those appended since the query's last run.
+   *
+   * Tables reading appended file contents with the query's ReadOffsets
+   * generate different rows for each scheduled query, so their scans are
+   * never shared. Set by `incremental()` in a table spec.
+   */
+  virtual bool incremental() { return false; }
+
  public:
+  /**
+   * @brief Open a cursor over the table's rows, if the table supports it.
+   *
+   * The default implementation returns nullptr and the table is generated
+   * with TablePlugin::generate. A table implementing a cursor does not need
+   * to implement generate, the rows are pulled from the cursor when the
+   * call crosses a registry boundary.
+   *
+   * @param request the query context, which must outlive the cursor.
+   * @return A cursor or nullptr if the table only supports generate.
+   */
+  virtual TableCursorRef cursor(QueryContext& request) { return nullptr; }
+
+  /**
+   * @brief Generate the table's rows for an in-process caller.
+   *
+   * The SQLite virtual table module calls this directly when the table plugin
+   * belongs to the process, avoiding a PluginRequest serialization of the
+   * QueryContext. Calls crossing a registry boundary use the "generate" action.
+   * Tables with source files, or cached for the boot, may return rows cached
+   * for the same context.
+   *
+   * @param request the query context.
+   * @return The generated rows.
+   */
+  QueryData generateRows(QueryContext& request);
+
+  /**
+   * @brief The table's definition for an in-process caller.
+   *
+   * The definition is built once from the statement, columns, and planning
+   * hints and shared by every connection attaching the table.
+   */
+  const TableDefinition& definition();
+
+  /**
+   * @brief Generate the table's rows as columnar batches.
+   *
+   * The "generate_batches" action used by callers in another process. Each
+   * response item holds a "batch" of at most batch_rows rows encoded with
+   * serializeQueryDataColumnar. Constraints and the limit are read from the
+   * serialized context, streaming tables are not pulled past the limit.
+   */
+  void generateBatches(QueryContext& context,
+                       size_t batch_rows,
+                       PluginResponse& response);
+
   /// Public API methods.
   Status call(const PluginRequest& request, PluginResponse& response);
 
@@ -289,12 +1084,29 @@ class TablePlugin : public Plugin {
                                     PluginRequest& request);
   static void setResponseFromQueryData(const QueryData& data,
                                        PluginResponse& response);
+  /// Move generated rows into a response without copying their values.
+  static void setResponseFromQueryData(QueryData&& data,
+                                       PluginResponse& response);
   static void setContextFromRequest(const PluginRequest& request,
                                     QueryContext& context);
+  /// Parse the "statement" and "columns" action responses.
+  static Status setDefinitionFromResponse(const PluginResponse& statement,
+                                          const PluginResponse& columns,
+                                          TableDefinition& definition);
 
  private:
   FRIEND_TEST(VirtualTableTests, test_tableplugin_columndefinition);
   FRIEND_TEST(VirtualTableTests, test_tableplugin_statement);
+  friend int runTableHelper();
+
+  /// Generate rows in a helper process, empty if the helper failed.
+  QueryData generateIsolated(QueryContext& request);
+
+  /// Rows of tables with source files.
+  FileBackedCache source_cache_;
+
+  std::once_flag definition_once_;
+  TableDefinition definition_;
 };
 
 CREATE_REGISTRY(TablePlugin, "table");
@@ -3,6 +3,10 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 /* Crypto */
 #include <linux/crypto.h>
@@ -12,55 +16,139 @@
 
 #include "hash.h"
 
-unsigned char *kernel_text_hash(void) {
-  return (unsigned char *) hash_data((void *) TEXT_SEGMENT_START,
-                                     TEXT_SEGMENT_END - TEXT_SEGMENT_START);
+#define TEXT_SEGMENT_SIZE (TEXT_SEGMENT_END - TEXT_SEGMENT_START)
+#define TEXT_SEGMENT_PAGES ((TEXT_SEGMENT_SIZE + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/* Pages of the .text segment verified by each read of text_segment_hash */
+static unsigned int check_pages = 256;
+module_param(check_pages, uint, 0644);
+MODULE_PARM_DESC(check_pages, "Kernel text pages verified per hash read");
+
+static DEFINE_MUTEX(text_hash_lock);
+static struct hash_desc text_desc;
+
+/* The digest of each page when the module loaded, and when last verified */
+static unsigned char *text_baseline;
+static unsigned char *text_digests;
+
+/* Pages are verified in rotation, starting with this page */
+static size_t text_next_page;
+
+/* The root over the last verified page digests, as a hex string */
+static char text_root[SHA1_DIGEST_SIZE * 2 + 1];
+
+static void hex_digest(const unsigned char *digest, char *out) {
+  size_t i;
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
+    snprintf(out + i * 2, 3, "%02x", digest[i]);
+  }
+}
+
+static int hash_page(size_t page, unsigned char *digest) {
+  struct scatterlist sg;
+  size_t offset = page * PAGE_SIZE;
+  size_t len = min((size_t) PAGE_SIZE, (size_t) TEXT_SEGMENT_SIZE - offset);
+
+  sg_init_one(&sg, (void *) (TEXT_SEGMENT_START + offset), len);
+  return crypto_hash_digest(&text_desc, &sg, len, digest);
 }
 
 /**
- * @brief Generic function for performing a SHA-1 hash of a memory range
- *
- * @param data - Beginning memory address to perform hash
- * @param len - size in bytes of the address range to hash
+ * @brief Hash the concatenated page digests into the text segment's root
  *
- * @return allocated buffer containing the hash string; or NULL upon error.
+ * @return 0 on success; or the crypto error.
  */
-unsigned char *hash_data(const void *data, size_t len) {
+static int hash_root(void) {
   struct scatterlist sg;
-  struct hash_desc desc;
-  size_t out_len = SHA1_DIGEST_SIZE * 2 + 1;
-  unsigned char hashtext[SHA1_DIGEST_SIZE];
-  unsigned char *hashtext_out = kmalloc(out_len, GFP_KERNEL);
-
-  if (!hashtext_out) {
-    printk(KERN_INFO "Could not allocate space for hash\n");
-    return NULL;
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  size_t len = TEXT_SEGMENT_PAGES * SHA1_DIGEST_SIZE;
+  int err;
+
+  sg_init_one(&sg, text_digests, len);
+  if ((err = crypto_hash_digest(&text_desc, &sg, len, digest)) == 0) {
+    hex_digest(digest, text_root);
+  }
+  return err;
+}
+
+/**
+ * @brief Verify the next pages of the rotation, updating the root if one of
+ *        them changed since it was last verified.
+ *
+ * @param count - the number of pages to verify, the caller holds the lock
+ *
+ * @return 0 on success; or the crypto error.
+ */
+static int verify_pages(size_t count) {
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  unsigned char *verified;
+  size_t i;
+  int changed = 0, err;
+
+  for (i = 0; i < count && i < TEXT_SEGMENT_PAGES; i++) {
+    if ((err = hash_page(text_next_page, digest)) != 0) {
+      return err;
+    }
+
+    verified = text_digests + text_next_page * SHA1_DIGEST_SIZE;
+    if (memcmp(verified, digest, SHA1_DIGEST_SIZE) != 0) {
+      memcpy(verified, digest, SHA1_DIGEST_SIZE);
+      changed = 1;
+    }
+    text_next_page = (text_next_page + 1) % TEXT_SEGMENT_PAGES;
+  }
+
+  return (changed) ? hash_root() : 0;
+}
+
+/**
+ * @brief Hash each page of the kernel's .text segment as the baseline later
+ *        reads are verified against.
+ *
+ * @return 0 on success; or a negative error.
+ */
+int text_hash_init(void) {
+  size_t page, len = TEXT_SEGMENT_PAGES * SHA1_DIGEST_SIZE;
+  int err;
+
+  text_desc.flags = 0;
+  text_desc.tfm = crypto_alloc_hash("sha1", 0, CRYPTO_ALG_ASYNC);
+  if (IS_ERR(text_desc.tfm)) {
+    printk(KERN_INFO "Could not allocate hash\n");
+    return PTR_ERR(text_desc.tfm);
+  }
+
+  text_baseline = kmalloc(len, GFP_KERNEL);
+  text_digests = kmalloc(len, GFP_KERNEL);
+  if (!text_baseline || !text_digests) {
+    printk(KERN_INFO "Could not allocate space for page digests\n");
+    text_hash_exit();
+    return -ENOMEM;
   }
 
-  sg_init_one(&sg, data, len);
-  desc.flags = 0;
-  desc.tfm = crypto_alloc_hash("sha1", 0, CRYPTO_ALG_ASYNC);
-
-  crypto_hash_init(&desc);
-  crypto_hash_update(&desc, &sg, sg.length);
-  crypto_hash_final(&desc, hashtext);
-
-  snprintf(hashtext_out,
-           out_len,
-           "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"
-           "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-           hashtext[0], hashtext[1], hashtext[2], hashtext[3],
-           hashtext[4], hashtext[5], hashtext[6], hashtext[7],
-           hashtext[8], hashtext[9], hashtext[10], hashtext[11],
-           hashtext[12], hashtext[13], hashtext[14], hashtext[15],
-           hashtext[16], hashtext[17], hashtext[18], hashtext[19]
-  );
-
-  if (desc.tfm) {
-    crypto_free_hash(desc.tfm);
+  for (page = 0; page < TEXT_SEGMENT_PAGES; page++) {
+    if ((err = hash_page(page, text_baseline + page * SHA1_DIGEST_SIZE))) {
+      text_hash_exit();
+      return err;
+    }
   }
+  memcpy(text_digests, text_baseline, len);
 
-  return hashtext_out;
+  if ((err = hash_root()) != 0) {
+    text_hash_exit();
+  }
+  return err;
+}
+
+void text_hash_exit(void) {
+  kfree(text_baseline);
+  kfree(text_digests);
+  text_baseline = NULL;
+  text_digests = NULL;
+  if (!IS_ERR_OR_NULL(text_desc.tfm)) {
+    crypto_free_hash(text_desc.tfm);
+  }
+  text_desc.tfm = NULL;
 }
 
 /**
@@ -68,6 +156,10 @@ unsigned char *hash_data(const void *data, size_t len) {
  *        read(2) (or equivalent) from within sysfs. E.g. cat /sys/foo/bar will
  *        call bar's *_show callback method.
  *
+ *        Each read verifies check_pages pages of the rotation and shows the
+ *        root over the page digests, which changes once a modified page is
+ *        verified.
+ *
  * @param obj - reference to a kernel object within the sysfs filesystem
  * @param attr - attribute of said kernel object
  * @param buf - buffer that will be allocated and filled with the hash
@@ -77,15 +169,47 @@ unsigned char *hash_data(const void *data, size_t len) {
 ssize_t text_segment_hash_show(struct kobject *obj,
                                struct attribute *attr,
                                char *buf) {
-  ssize_t ret;
-  char *hash = kernel_text_hash();
-
-  if (hash) {
-    ret = scnprintf(buf, PAGE_SIZE, "%s\n", hash);
-    kfree(hash);
-  } else {
-    ret = -1;
+  ssize_t ret = -1;
+
+  mutex_lock(&text_hash_lock);
+  if (verify_pages(check_pages) == 0) {
+    ret = scnprintf(buf, PAGE_SIZE, "%s\n", text_root);
+  }
+  mutex_unlock(&text_hash_lock);
+
+  return ret;
+}
+
+/**
+ * @brief Callback for the sysfs object read listing the addresses of the
+ *        pages whose last verified digest differs from the baseline.
+ *
+ * @param obj - reference to a kernel object within the sysfs filesystem
+ * @param attr - attribute of said kernel object
+ * @param buf - buffer that will be filled with space-separated addresses
+ *
+ * @return size in bytes of the address list.
+ */
+ssize_t text_segment_modified_pages_show(struct kobject *obj,
+                                         struct attribute *attr,
+                                         char *buf) {
+  ssize_t ret = 0;
+  size_t page, offset;
+
+  mutex_lock(&text_hash_lock);
+  for (page = 0; page < TEXT_SEGMENT_PAGES; page++) {
+    offset = page * SHA1_DIGEST_SIZE;
+    if (memcmp(text_baseline + offset,
+               text_digests + offset,
+               SHA1_DIGEST_SIZE) != 0) {
+      ret += scnprintf(buf + ret,
+                       PAGE_SIZE - ret,
+                       (ret == 0) ? "0x%lx" : " 0x%lx",
+                       (unsigned long) TEXT_SEGMENT_START + page * PAGE_SIZE);
+    }
   }
+  mutex_unlock(&text_hash_lock);
 
+  ret += scnprintf(buf + ret, PAGE_SIZE - ret, "\n");
   return ret;
 }
@@ -1,4 +1,4 @@
 // Copyright 2004-present Facebook. All Rights Reserved.
 
-unsigned char *kernel_text_hash(void);
-unsigned char *hash_data(const void *, size_t);
+int text_hash_init(void);
+void text_hash_exit(void);
@@ -64,8 +64,15 @@ void grab_syscall_table(void) {
 static int __init camb_init(void) {
   printk(KERN_INFO "[%s] init\n", module_str);
 
+  /* Hash each page of the .text segment once, reads verify a few pages */
+  if (text_hash_init()) {
+    printk(KERN_ERR "Cannot hash the kernel text segment\n");
+    return -1;
+  }
+
   if (expose_sysfs()) {
     printk(KERN_ERR "Cannot expose self to sysfs\n");
+    text_hash_exit();
     return -1;
   }
 
@@ -86,6 +93,7 @@ static void __exit camb_exit(void) {
     kobject_put(camb_kobj);
   }
 
+  text_hash_exit();
 }
 
 module_init(camb_init);
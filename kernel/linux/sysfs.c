@@ -16,6 +16,9 @@ extern ssize_t syscall_addr_modified_show(struct kobject *obj,
 extern ssize_t text_segment_hash_show(struct kobject *obj,
                                       struct attribute *attr,
                                       char *buf);
+extern ssize_t text_segment_modified_pages_show(struct kobject *obj,
+                                                struct attribute *attr,
+                                                char *buf);
 
 struct kobj_attribute attr_syscall_addr_modified =
   __ATTR(syscall_addr_modified, 0444, syscall_addr_modified_show, NULL);
@@ -23,8 +26,15 @@ struct kobj_attribute attr_syscall_addr_modified =
 struct kobj_attribute attr_text_segment_hash =
   __ATTR(text_segment_hash, 0444, text_segment_hash_show, NULL);
 
+struct kobj_attribute attr_text_segment_modified_pages =
+  __ATTR(text_segment_modified_pages,
+         0444,
+         text_segment_modified_pages_show,
+         NULL);
+
 struct attribute *camb_attrs[] = {
   &attr_text_segment_hash.attr,
+  &attr_text_segment_modified_pages.attr,
   &attr_syscall_addr_modified.attr,
   NULL,
 };
@@ -8,20 +8,21 @@
  *
  */
 
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <functional>
 #include <mutex>
-#include <sstream>
 
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
 #include <boost/thread/shared_mutex.hpp>
 
 #include <osquery/config.h>
+#include <osquery/core.h>
 #include <osquery/flags.h>
 #include <osquery/hash.h>
 #include <osquery/logger.h>
 
-namespace pt = boost::property_tree;
-
 namespace osquery {
 
 DEFINE_osquery_flag(string,
@@ -31,16 +32,391 @@ DEFINE_osquery_flag(string,
 
 static boost::shared_mutex rw_lock;
 
+/// The deepest nesting of JSON values skipped within a config.
+const size_t kMaxConfigDepth = 512;
+
+/**
+ * @brief A pull parser over config JSON.
+ *
+ * Values are read as they are found, the config is never held as a tree.
+ * Scalars are returned as text: strings are unescaped, numbers and literals
+ * are returned as written, as boost::property_tree would store them.
+ */
+class ConfigReader {
+ public:
+  explicit ConfigReader(const std::string& json) : json_(json), pos_(0) {}
+
+  /// Call member with each key of an object, which must read the value.
+  Status readObject(const std::function<Status(const std::string&)>& member) {
+    if (!consume('{')) {
+      return error("Expected an object");
+    }
+    if (consume('}')) {
+      return Status(0, "OK");
+    }
+
+    do {
+      std::string key;
+      auto status = readString(key);
+      if (!status.ok()) {
+        return status;
+      }
+      if (!consume(':')) {
+        return error("Expected ':'");
+      }
+      status = member(key);
+      if (!status.ok()) {
+        return status;
+      }
+    } while (consume(','));
+
+    return (consume('}')) ? Status(0, "OK") : error("Expected '}'");
+  }
+
+  /// Call element for each value of an array, which must read the value.
+  Status readArray(const std::function<Status()>& element) {
+    if (!consume('[')) {
+      return error("Expected an array");
+    }
+    if (consume(']')) {
+      return Status(0, "OK");
+    }
+
+    do {
+      auto status = element();
+      if (!status.ok()) {
+        return status;
+      }
+    } while (consume(','));
+
+    return (consume(']')) ? Status(0, "OK") : error("Expected ']'");
+  }
+
+  /// Read a string, number, or literal as text.
+  Status readScalar(std::string& value) {
+    skipWhitespace();
+    if (pos_ < json_.size() && json_[pos_] == '"') {
+      return readString(value);
+    }
+
+    size_t start = pos_;
+    while (pos_ < json_.size() &&
+           (isalnum(json_[pos_]) || json_[pos_] == '-' || json_[pos_] == '+' ||
+            json_[pos_] == '.')) {
+      pos_++;
+    }
+    if (pos_ == start) {
+      return error("Expected a value");
+    }
+
+    value = json_.substr(start, pos_ - start);
+    if (!isdigit(value[0]) && value[0] != '-' && value != "true" &&
+        value != "false" && value != "null") {
+      return error("Unknown literal " + value);
+    }
+    return Status(0, "OK");
+  }
+
+  /// Read a scalar, objects and arrays are skipped and read as empty.
+  Status readData(std::string& value) {
+    value.clear();
+    if (peek('{') || peek('[')) {
+      return skipValue();
+    }
+    return readScalar(value);
+  }
+
+  /// Skip a value of any type.
+  Status skipValue(size_t depth = 0) {
+    if (depth > kMaxConfigDepth) {
+      return error("Config nesting is too deep");
+    }
+
+    if (peek('{')) {
+      return readObject([this, depth](const std::string&) {
+        return skipValue(depth + 1);
+      });
+    } else if (peek('[')) {
+      return readArray([this, depth]() { return skipValue(depth + 1); });
+    }
+    std::string value;
+    return readScalar(value);
+  }
+
+  /// Check that only whitespace follows the parsed value.
+  bool done() {
+    skipWhitespace();
+    return pos_ == json_.size();
+  }
+
+ private:
+  void skipWhitespace() {
+    while (pos_ < json_.size() && isspace(json_[pos_])) {
+      pos_++;
+    }
+  }
+
+  bool peek(char c) {
+    skipWhitespace();
+    return pos_ < json_.size() && json_[pos_] == c;
+  }
+
+  bool consume(char c) {
+    if (!peek(c)) {
+      return false;
+    }
+    pos_++;
+    return true;
+  }
+
+  Status error(const std::string& message) {
+    return Status(1, message + " at offset " + std::to_string(pos_));
+  }
+
+  /// Read the 4 hex digits of a \u escape.
+  bool readHex(unsigned int& code) {
+    if (pos_ + 4 > json_.size()) {
+      return false;
+    }
+    code = 0;
+    for (size_t i = 0; i < 4; i++) {
+      char c = json_[pos_++];
+      code <<= 4;
+      if (c >= '0' && c <= '9') {
+        code |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        code |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        code |= c - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Append a code point as UTF-8.
+  static void appendUTF8(std::string& value, unsigned int code) {
+    if (code < 0x80) {
+      value += (char)code;
+    } else if (code < 0x800) {
+      value += (char)(0xC0 | (code >> 6));
+      value += (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      value += (char)(0xE0 | (code >> 12));
+      value += (char)(0x80 | ((code >> 6) & 0x3F));
+      value += (char)(0x80 | (code & 0x3F));
+    } else {
+      value += (char)(0xF0 | (code >> 18));
+      value += (char)(0x80 | ((code >> 12) & 0x3F));
+      value += (char)(0x80 | ((code >> 6) & 0x3F));
+      value += (char)(0x80 | (code & 0x3F));
+    }
+  }
+
+  Status readString(std::string& value) {
+    if (!consume('"')) {
+      return error("Expected a string");
+    }
+
+    value.clear();
+    while (pos_ < json_.size()) {
+      // Copy runs of unescaped characters at once.
+      size_t end = json_.find_first_of("\"\\", pos_);
+      if (end == std::string::npos) {
+        break;
+      }
+      value.append(json_, pos_, end - pos_);
+      pos_ = end + 1;
+      if (json_[end] == '"') {
+        return Status(0, "OK");
+      }
+
+      if (pos_ >= json_.size()) {
+        break;
+      }
+      char escape = json_[pos_++];
+      switch (escape) {
+      case '"':
+      case '\\':
+      case '/':
+        value += escape;
+        break;
+      case 'b':
+        value += '\b';
+        break;
+      case 'f':
+        value += '\f';
+        break;
+      case 'n':
+        value += '\n';
+        break;
+      case 'r':
+        value += '\r';
+        break;
+      case 't':
+        value += '\t';
+        break;
+      case 'u': {
+        unsigned int code;
+        if (!readHex(code)) {
+          return error("Invalid unicode escape");
+        }
+        // A high surrogate is followed by the low surrogate of the pair.
+        if (code >= 0xD800 && code < 0xDC00 &&
+            json_.compare(pos_, 2, "\\u") == 0) {
+          pos_ += 2;
+          unsigned int low;
+          if (!readHex(low) || low < 0xDC00 || low >= 0xE000) {
+            return error("Invalid unicode surrogate pair");
+          }
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        }
+        appendUTF8(value, code);
+        break;
+      }
+      default:
+        return error("Invalid escape");
+      }
+    }
+    return error("Unterminated string");
+  }
+
+ private:
+  const std::string& json_;
+  size_t pos_;
+};
+
+/// Convert a scalar as boost::property_tree's get<int> would.
+static Status toInteger(const std::string& key,
+                        const std::string& data,
+                        long long& value) {
+  char* end = nullptr;
+  errno = 0;
+  value = strtoll(data.c_str(), &end, 10);
+  if (data.empty() || errno != 0 || *end != 0) {
+    return Status(1, "Invalid integer for " + key + ": " + data);
+  }
+  return Status(0, "OK");
+}
+
+/// Convert a scalar as boost::property_tree's get<bool> would.
+static Status toBool(const std::string& key,
+                     const std::string& data,
+                     bool& value) {
+  if (data == "true" || data == "1") {
+    value = true;
+  } else if (data == "false" || data == "0") {
+    value = false;
+  } else {
+    return Status(1, "Invalid boolean for " + key + ": " + data);
+  }
+  return Status(0, "OK");
+}
+
+/// Read one scheduled query object.
+static Status readScheduledQuery(ConfigReader& reader,
+                                 OsqueryScheduledQuery& q) {
+  std::map<std::string, std::string> fields;
+  auto status = reader.readObject([&reader, &fields](const std::string& key) {
+    return reader.readData(fields[key]);
+  });
+  if (!status.ok()) {
+    return status;
+  }
+
+  for (const auto& required : {"name", "query", "interval"}) {
+    if (fields.count(required) == 0) {
+      return Status(1, std::string("No such node (") + required + ")");
+    }
+  }
+  q.name = fields.at("name");
+  q.query = fields.at("query");
+
+  std::vector<std::pair<std::string, int*> > integers = {
+      {"interval", &q.interval},
+      {"timeout_ms", &q.timeout_ms},
+      {"cpu_ms", &q.cpu_ms},
+      {"max_bytes", &q.max_bytes},
+      {"rollup", &q.rollup},
+  };
+  for (const auto& field : integers) {
+    long long number = 0;
+    if (fields.count(field.first) > 0) {
+      status = toInteger(field.first, fields.at(field.first), number);
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    *field.second = (int)number;
+  }
+
+  q.rollup_key = "";
+  if (fields.count("rollup_key") > 0) {
+    q.rollup_key = fields.at("rollup_key");
+  }
+  q.snapshot = false;
+  if (fields.count("snapshot") > 0) {
+    return toBool("snapshot", fields.at("snapshot"), q.snapshot);
+  }
+  return Status(0, "OK");
+}
+
+/// Read the limits object of an event subscriber.
+static Status readEventLimits(ConfigReader& reader,
+                              OsqueryEventLimits& limits) {
+  std::map<std::string, std::string> fields;
+  auto status = reader.readObject([&reader, &fields](const std::string& key) {
+    return reader.readData(fields[key]);
+  });
+  if (!status.ok()) {
+    return status;
+  }
+
+  long long number = 0;
+  limits.max_events_per_second = 0;
+  if (fields.count("max_events_per_second") > 0) {
+    status = toInteger("max_events_per_second",
+                       fields.at("max_events_per_second"),
+                       number);
+    limits.max_events_per_second = (size_t)number;
+  }
+  limits.burst = limits.max_events_per_second;
+  if (status.ok() && fields.count("burst") > 0) {
+    status = toInteger("burst", fields.at("burst"), number);
+    limits.burst = (size_t)number;
+  }
+  limits.sample = 1;
+  if (status.ok() && fields.count("sample") > 0) {
+    status = toInteger("sample", fields.at("sample"), number);
+    limits.sample = (size_t)number;
+  }
+  return status;
+}
+
 std::shared_ptr<Config> Config::getInstance() {
   static std::shared_ptr<Config> config = std::shared_ptr<Config>(new Config());
   return config;
 }
 
 Status Config::load() {
+  TraceSpan span("config.load");
   boost::unique_lock<boost::shared_mutex> lock(rw_lock);
-  OsqueryConfig conf;
+  std::string config_string;
+  bool changed = true;
+  auto s = Config::genConfig(hash_, config_string, changed);
+  if (!s.ok()) {
+    return Status(1, "Cannot generate config");
+  }
 
-  auto s = Config::genConfig(conf);
+  if (!changed) {
+    // The content is the same as the last load, there is nothing to parse.
+    VLOG(1) << "Config content is unchanged: " << hash_;
+    return Status(0, "OK");
+  }
+
+  OsqueryConfig conf;
+  s = Config::parseConfig(config_string, conf);
   if (!s.ok()) {
     return Status(1, "Cannot generate config");
   }
@@ -56,24 +432,47 @@ Status Config::load() {
   }
 
   cfg_ = conf;
+  hash_ = hashFromBuffer(
+      HASH_TYPE_MD5, (void*)config_string.c_str(), config_string.length());
   return Status(0, "OK");
 }
 
 Status Config::genConfig(std::string& conf) {
+  bool changed = true;
+  return genConfig("", conf, changed);
+}
+
+Status Config::genConfig(const std::string& hash,
+                         std::string& conf,
+                         bool& changed) {
   if (!Registry::exists("config", FLAGS_config_retriever)) {
     LOG(ERROR) << "Config retriever " << FLAGS_config_retriever << " not found";
     return Status(1, "Config retriever not found");
   }
 
-  PluginResponse response;
-  auto status = Registry::call(
-      "config", FLAGS_config_retriever, {{"action", "genConfig"}}, response);
+  PluginRequest request = {{"action", "genConfig"}};
+  if (!hash.empty()) {
+    request["hash"] = hash;
+  }
 
+  PluginResponse response;
+  auto status =
+      Registry::call("config", FLAGS_config_retriever, request, response);
   if (!status.ok()) {
     return status;
   }
 
-  conf = response[0].at("data");
+  if (response.size() == 0) {
+    return Status(1, "Config retriever returned no config");
+  }
+
+  changed = (response[0].count("unchanged") == 0);
+  if (changed) {
+    if (response[0].count("data") == 0) {
+      return Status(1, "Config retriever returned no config");
+    }
+    conf = response[0].at("data");
+  }
   return Status(0, "OK");
 }
 
@@ -83,34 +482,49 @@ Status Config::genConfig(OsqueryConfig& conf) {
   if (!s.ok()) {
     return s;
   }
+  return parseConfig(config_string, conf);
+}
 
-  std::stringstream json;
-  pt::ptree tree;
-  try {
-    json << config_string;
-    pt::read_json(json, tree);
-
-    // Parse each scheduled query from the config.
-    for (const pt::ptree::value_type& v : tree.get_child("scheduledQueries")) {
-      OsqueryScheduledQuery q;
-      q.name = (v.second).get<std::string>("name");
-      q.query = (v.second).get<std::string>("query");
-      q.interval = (v.second).get<int>("interval");
-      conf.scheduledQueries.push_back(q);
+Status Config::parseConfig(const std::string& config_string,
+                           OsqueryConfig& conf) {
+  // Large query packs are read in one pass, without a property tree.
+  ConfigReader reader(config_string);
+  bool scheduled = false;
+  auto status = reader.readObject([&](const std::string& key) {
+    if (key == "scheduledQueries") {
+      scheduled = true;
+      return reader.readArray([&reader, &conf]() {
+        OsqueryScheduledQuery q;
+        auto status = readScheduledQuery(reader, q);
+        if (status.ok()) {
+          conf.scheduledQueries.push_back(std::move(q));
+        }
+        return status;
+      });
+    } else if (key == "events") {
+      // Subscribers may limit the events they store.
+      return reader.readObject([&reader, &conf](const std::string& name) {
+        return readEventLimits(reader, conf.eventLimits[name]);
+      });
+    } else if (key == "options") {
+      // Flags may be set as 'options' within the config.
+      return reader.readObject([&reader, &conf](const std::string& name) {
+        return reader.readData(conf.options[name]);
+      });
     }
+    return reader.skipValue();
+  });
 
-    // Flags may be set as 'options' within the config.
-    if (tree.count("options") > 0) {
-      for (const pt::ptree::value_type& v : tree.get_child("options")) {
-        conf.options[v.first.data()] = v.second.data();
-      }
-    }
-  } catch (const std::exception& e) {
-    LOG(ERROR) << "Error parsing config JSON: " << e.what();
-    return Status(1, e.what());
+  if (status.ok() && !reader.done()) {
+    status = Status(1, "Unexpected data after the config");
+  } else if (status.ok() && !scheduled) {
+    status = Status(1, "No such node (scheduledQueries)");
   }
 
-  return Status(0, "OK");
+  if (!status.ok()) {
+    LOG(ERROR) << "Error parsing config JSON: " << status.getMessage();
+  }
+  return status;
 }
 
 std::vector<OsqueryScheduledQuery> Config::getScheduledQueries() {
@@ -118,7 +532,21 @@ std::vector<OsqueryScheduledQuery> Config::getScheduledQueries() {
   return cfg_.scheduledQueries;
 }
 
+std::map<std::string, OsqueryEventLimits> Config::getEventLimits() {
+  boost::shared_lock<boost::shared_mutex> lock(rw_lock);
+  return cfg_.eventLimits;
+}
+
 Status Config::getMD5(std::string& hash_string) {
+  {
+    boost::shared_lock<boost::shared_mutex> lock(rw_lock);
+    if (!hash_.empty()) {
+      hash_string = hash_;
+      return Status(0, "OK");
+    }
+  }
+
+  // The config has not been loaded, such as within the shell.
   std::string config_string;
   auto s = genConfig(config_string);
   if (!s.ok()) {
@@ -136,6 +564,66 @@ Status Config::checkConfig() {
   return genConfig(c);
 }
 
+/// Read an optional millisecond limit of a distributed query request.
+static Status readLimit(const std::map<std::string, std::string>& item,
+                        const std::string& key,
+                        int& limit) {
+  long long value = 0;
+  if (item.count(key) > 0) {
+    auto status = toInteger(key, item.at(key), value);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  limit = (value > 0 && value <= INT_MAX) ? (int)value : 0;
+  return Status(0, "OK");
+}
+
+Status Config::genDistributedQueries(
+    std::vector<DistributedQueryRequest>& requests) {
+  if (!Registry::exists("config", FLAGS_config_retriever)) {
+    return Status(1, "Config retriever not found");
+  }
+
+  PluginRequest request = {{"action", "genDistributed"}};
+  PluginResponse response;
+  auto status =
+      Registry::call("config", FLAGS_config_retriever, request, response);
+  if (!status.ok()) {
+    return status;
+  }
+
+  for (const auto& item : response) {
+    if (item.count("id") == 0 || item.count("query") == 0) {
+      return Status(1, "Distributed queries require an id and query");
+    }
+    DistributedQueryRequest r;
+    r.id = item.at("id");
+    r.query = item.at("query");
+    status = readLimit(item, "timeout_ms", r.timeout_ms);
+    if (status.ok()) {
+      status = readLimit(item, "cpu_ms", r.cpu_ms);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+    requests.push_back(std::move(r));
+  }
+  return Status(0, "OK");
+}
+
+std::pair<Status, std::string> ConfigPlugin::genConfigIfChanged(
+    const std::string& hash, bool& changed) {
+  auto config_data = genConfig();
+  if (config_data.first.ok()) {
+    const auto& content = config_data.second;
+    changed = (hashFromBuffer(HASH_TYPE_MD5,
+                              (void*)content.c_str(),
+                              content.length()) != hash);
+  }
+  return config_data;
+}
+
 Status ConfigPlugin::call(const PluginRequest& request,
                           PluginResponse& response) {
   if (request.count("action") == 0) {
@@ -143,9 +631,30 @@ Status ConfigPlugin::call(const PluginRequest& request,
   }
 
   if (request.at("action") == "genConfig") {
+    if (request.count("hash") > 0) {
+      bool changed = true;
+      auto config_data = genConfigIfChanged(request.at("hash"), changed);
+      if (!changed) {
+        response.push_back({{"unchanged", "1"}});
+      } else {
+        response.push_back({{"data", config_data.second}});
+      }
+      return config_data.first;
+    }
+
     auto config_data = genConfig();
     response.push_back({{"data", config_data.second}});
     return config_data.first;
+  } else if (request.at("action") == "genDistributed") {
+    std::vector<DistributedQueryRequest> requests;
+    auto status = genDistributedQueries(requests);
+    for (const auto& r : requests) {
+      response.push_back({{"id", r.id},
+                          {"query", r.query},
+                          {"timeout_ms", std::to_string(r.timeout_ms)},
+                          {"cpu_ms", std::to_string(r.cpu_ms)}});
+    }
+    return status;
   }
   return Status(1, "Config plugin action unknown: " + request.at("action"));
 }
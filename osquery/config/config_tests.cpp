@@ -13,6 +13,7 @@
 #include <osquery/config.h>
 #include <osquery/core.h>
 #include <osquery/flags.h>
+#include <osquery/hash.h>
 #include <osquery/registry.h>
 #include <osquery/sql.h>
 
@@ -56,6 +57,121 @@ TEST_F(ConfigTests, test_plugin) {
   EXPECT_EQ(response[0].at("data"), "foobar");
 }
 
+class CountingConfigPlugin : public ConfigPlugin {
+ public:
+  CountingConfigPlugin() : calls(0) {}
+
+  std::pair<Status, std::string> genConfig() {
+    calls++;
+    return std::make_pair(Status(0, "OK"),
+                          "{\"scheduledQueries\": [{\"name\": \"time\", "
+                          "\"query\": \"SELECT 1\", \"interval\": 1}]}");
+  }
+
+  size_t calls;
+};
+
+TEST_F(ConfigTests, test_config_hash) {
+  Registry::add<CountingConfigPlugin>("config", "counting");
+  auto plugin = std::dynamic_pointer_cast<CountingConfigPlugin>(
+      Registry::get("config", "counting"));
+
+  // A request with the content's hash is answered without the content.
+  PluginResponse response;
+  EXPECT_TRUE(plugin->call({{"action", "genConfig"}}, response).ok());
+  auto data = response[0].at("data");
+  auto hash = hashFromBuffer(HASH_TYPE_MD5, (void*)data.c_str(), data.size());
+  response.clear();
+  EXPECT_TRUE(
+      plugin->call({{"action", "genConfig"}, {"hash", hash}}, response).ok());
+  EXPECT_EQ(response[0].count("data"), 0);
+  EXPECT_EQ(response[0].at("unchanged"), "1");
+
+  // The hash is stored by a load, and not computed again by fetching.
+  FLAGS_config_retriever = "counting";
+  auto c = Config::getInstance();
+  EXPECT_TRUE(c->load().ok());
+  size_t calls = plugin->calls;
+  std::string md5;
+  EXPECT_TRUE(c->getMD5(md5).ok());
+  EXPECT_EQ(md5, hash);
+  EXPECT_EQ(plugin->calls, calls);
+
+  // An unchanged config keeps the loaded schedule.
+  EXPECT_TRUE(c->load().ok());
+  ASSERT_EQ(c->getScheduledQueries().size(), 1);
+  EXPECT_EQ(c->getScheduledQueries()[0].name, "time");
+  FLAGS_config_retriever = "filesystem";
+}
+
+/// A config plugin returning the content set by a test.
+class ContentConfigPlugin : public ConfigPlugin {
+ public:
+  std::pair<Status, std::string> genConfig() {
+    return std::make_pair(Status(0, "OK"), content);
+  }
+
+  static std::string content;
+};
+
+std::string ContentConfigPlugin::content;
+
+TEST_F(ConfigTests, test_parse_config) {
+  Registry::add<ContentConfigPlugin>("config", "content");
+  FLAGS_config_retriever = "content";
+  auto c = Config::getInstance();
+
+  ContentConfigPlugin::content =
+      "{\"unknown\": {\"nested\": [1, {\"a\": null}, \"]}\"]},"
+      " \"options\": {\"test_option\": 10, \"test_bool\": true},"
+      " \"scheduledQueries\": ["
+      "  {\"name\": \"escaped\", \"query\": \"SELECT \\\"\\u00e9\\\"\","
+      "   \"interval\": \"60\", \"snapshot\": true, \"other\": [1]},"
+      "  {\"name\": \"numbers\", \"query\": \"SELECT 1\", \"interval\": 5,"
+      "   \"timeout_ms\": 100, \"cpu_ms\": 10, \"max_bytes\": 1024,"
+      "   \"rollup\": 300, \"rollup_key\": \"pid,name\"}"
+      " ],"
+      " \"events\": {\"file_events\": {\"max_events_per_second\": 5}}}";
+  ASSERT_TRUE(c->load().ok());
+  auto queries = c->getScheduledQueries();
+  ASSERT_EQ(queries.size(), 2);
+  EXPECT_EQ(queries[0].name, "escaped");
+  EXPECT_EQ(queries[0].query, "SELECT \"\xc3\xa9\"");
+  EXPECT_EQ(queries[0].interval, 60);
+  EXPECT_TRUE(queries[0].snapshot);
+  EXPECT_EQ(queries[1].interval, 5);
+  EXPECT_EQ(queries[1].timeout_ms, 100);
+  EXPECT_EQ(queries[1].cpu_ms, 10);
+  EXPECT_EQ(queries[1].max_bytes, 1024);
+  EXPECT_EQ(queries[1].rollup, 300);
+  EXPECT_EQ(queries[1].rollup_key, "pid,name");
+  EXPECT_EQ(queries[0].rollup, 0);
+  EXPECT_EQ(queries[0].rollup_key, "");
+  EXPECT_FALSE(queries[1].snapshot);
+
+  auto limits = c->getEventLimits();
+  EXPECT_EQ(limits["file_events"].max_events_per_second, 5);
+  EXPECT_EQ(limits["file_events"].burst, 5);
+  EXPECT_EQ(limits["file_events"].sample, 1);
+
+  // Invalid configs keep the loaded config.
+  std::vector<std::string> invalid = {
+      "{\"scheduledQueries\": [{\"name\": \"a\", \"query\": \"b\"}]}",
+      "{\"scheduledQueries\": [{\"name\": \"a\", \"query\": \"b\","
+      " \"interval\": \"x\"}]}",
+      "{\"scheduledQueries\": [}",
+      "{\"options\": {}}",
+      "{\"scheduledQueries\": []} trailing",
+      "{\"scheduledQueries\": [], \"x\": \"unterminated}",
+  };
+  for (const auto& content : invalid) {
+    ContentConfigPlugin::content = content;
+    EXPECT_FALSE(c->load().ok());
+  }
+  EXPECT_EQ(c->getScheduledQueries().size(), 2);
+  FLAGS_config_retriever = "filesystem";
+}
+
 TEST_F(ConfigTests, test_queries_execute) {
   auto c = Config::getInstance();
   auto queries = c->getScheduledQueries();
@@ -67,6 +183,15 @@ TEST_F(ConfigTests, test_queries_execute) {
     EXPECT_TRUE(status.ok());
   }
 }
+
+TEST_F(ConfigTests, test_event_limits) {
+  auto limits = Config::getInstance()->getEventLimits();
+  ASSERT_EQ(limits.count("passwd_changes"), 1);
+  EXPECT_EQ(limits["passwd_changes"].max_events_per_second, 100);
+  // The burst defaults to the sustained rate.
+  EXPECT_EQ(limits["passwd_changes"].burst, 100);
+  EXPECT_EQ(limits["passwd_changes"].sample, 2);
+}
 }
 
 int main(int argc, char* argv[]) {
@@ -8,14 +8,42 @@
  *
  */
 
-#include <iomanip>
+#include <memory>
 #include <sstream>
+#include <vector>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <osquery/flags.h>
 #include <osquery/hash.h>
 #include <osquery/logger.h>
 
 namespace osquery {
 
+DEFINE_osquery_flag(bool,
+                    hash_direct_io,
+                    false,
+                    "Read hashed files without using the page cache.");
+
+DEFINE_osquery_flag(bool,
+                    hash_io_idle,
+                    false,
+                    "Read hashed files with the idle IO priority.");
+
+#ifdef __linux__
+/// The ioprio_set(2) values, libc does not provide them.
+#define HASH_IOPRIO_WHO_PROCESS 1
+#define HASH_IOPRIO_CLASS_IDLE (3 << 13)
+#endif
+
 #ifdef __APPLE__
   #import <CommonCrypto/CommonDigest.h>
   #define __HASH_API(name) CC_##name
@@ -28,7 +56,9 @@ namespace osquery {
   #define SHA1_CTX SHA_CTX
 #endif
 
-#define HASH_CHUNK_SIZE 1024
+/// Files are read in large chunks, aligned for direct (uncached) reads.
+#define HASH_CHUNK_SIZE (256 * 1024)
+#define HASH_CHUNK_ALIGNMENT 4096
 
 Hash::~Hash() {
   if (ctx_ != nullptr) {
@@ -40,18 +70,26 @@ Hash::Hash(HashType algorithm) : algorithm_(algorithm) {
   if (algorithm_ == HASH_TYPE_MD5) {
     length_ = __HASH_API(MD5_DIGEST_LENGTH);
     ctx_ = (__HASH_API(MD5_CTX)*)malloc(sizeof(__HASH_API(MD5_CTX)));
-    __HASH_API(MD5_Init)((__HASH_API(MD5_CTX)*)ctx_);
   } else if (algorithm_ == HASH_TYPE_SHA1) {
     length_ = __HASH_API(SHA1_DIGEST_LENGTH);
     ctx_ = (__HASH_API(SHA1_CTX)*)malloc(sizeof(__HASH_API(SHA1_CTX)));
-    __HASH_API(SHA1_Init)((__HASH_API(SHA1_CTX)*)ctx_);
   } else if (algorithm_ == HASH_TYPE_SHA256) {
     length_ = __HASH_API(SHA256_DIGEST_LENGTH);
     ctx_ = (__HASH_API(SHA256_CTX)*)malloc(sizeof(__HASH_API(SHA256_CTX)));
-    __HASH_API(SHA256_Init)((__HASH_API(SHA256_CTX)*)ctx_);
   } else {
     throw std::domain_error("Unknown hash function");
   }
+  reset();
+}
+
+void Hash::reset() {
+  if (algorithm_ == HASH_TYPE_MD5) {
+    __HASH_API(MD5_Init)((__HASH_API(MD5_CTX)*)ctx_);
+  } else if (algorithm_ == HASH_TYPE_SHA1) {
+    __HASH_API(SHA1_Init)((__HASH_API(SHA1_CTX)*)ctx_);
+  } else if (algorithm_ == HASH_TYPE_SHA256) {
+    __HASH_API(SHA256_Init)((__HASH_API(SHA256_CTX)*)ctx_);
+  }
 }
 
 void Hash::update(const void* buffer, size_t size) {
@@ -76,12 +114,13 @@ std::string Hash::digest() {
   }
 
   // The hash value is only relevant as a hex digest.
-  std::stringstream digest;
-  for (int i = 0; i < length_; i++) {
-    digest << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string digest(length_ * 2, '0');
+  for (size_t i = 0; i < length_; i++) {
+    digest[i * 2] = kHexDigits[hash[i] >> 4];
+    digest[i * 2 + 1] = kHexDigits[hash[i] & 0xf];
   }
-
-  return digest.str();
+  return digest;
 }
 
 std::string hashFromBuffer(HashType hash_type, const void* buffer, size_t size) {
@@ -91,22 +130,139 @@ std::string hashFromBuffer(HashType hash_type, const void* buffer, size_t size)
 }
 
 std::string hashFromFile(HashType hash_type, const std::string& path) {
-  Hash hash(hash_type);
+  auto hashes = hashMultiFromFile(hash_type, path);
+  if (hash_type == HASH_TYPE_MD5) {
+    return hashes.md5;
+  } else if (hash_type == HASH_TYPE_SHA1) {
+    return hashes.sha1;
+  }
+  return hashes.sha256;
+}
+
+MultiHashes hashMultiFromFile(int mask, const std::string& path) {
+  FileHasher hasher;
+  return hasher.hash(mask, path);
+}
+
+/// The digest types in the order of a FileHasher's contexts.
+static const HashType kFileHasherTypes[] = {
+    HASH_TYPE_MD5, HASH_TYPE_SHA1, HASH_TYPE_SHA256};
 
-  FILE* file = fopen(path.c_str(), "rb");
-  if (file == nullptr) {
+FileHasher::FileHasher() {}
+
+FileHasher::~FileHasher() {
+  if (buffer_ != nullptr) {
+    ::free(buffer_);
+  }
+}
+
+MultiHashes FileHasher::hash(int mask, const std::string& path) {
+  MultiHashes hashes;
+  hashes.mask = mask;
+
+  // Only the requested digests are computed, with reused contexts.
+  std::vector<std::pair<HashType, Hash*> > digests;
+  for (size_t i = 0; i < 3; ++i) {
+    auto type = kFileHasherTypes[i];
+    if ((mask & type) == 0) {
+      continue;
+    }
+    if (digests_[i] == nullptr) {
+      digests_[i] = std::unique_ptr<Hash>(new Hash(type));
+    } else {
+      digests_[i]->reset();
+    }
+    digests.push_back(std::make_pair(type, digests_[i].get()));
+  }
+
+  if (digests.empty()) {
+    return hashes;
+  }
+
+  int flags = O_RDONLY;
+#ifdef O_DIRECT
+  flags |= (FLAGS_hash_direct_io) ? O_DIRECT : 0;
+#endif
+  int fd = ::open(path.c_str(), flags);
+  if (fd == -1 && errno == EINVAL && flags != O_RDONLY) {
+    // The filesystem does not support direct reads.
+    fd = ::open(path.c_str(), O_RDONLY);
+  }
+
+  if (fd == -1) {
     VLOG(1) << "Cannot hash/open file " << path;
-    return "";
+    return hashes;
   }
 
-  // Then call updates with read chunks.
-  size_t bytes_read = 0;
-  unsigned char buffer[HASH_CHUNK_SIZE];
-  while ((bytes_read = fread(buffer, 1, HASH_CHUNK_SIZE, file))) {
-    hash.update(buffer, bytes_read);
+#ifdef F_NOCACHE
+  if (FLAGS_hash_direct_io) {
+    ::fcntl(fd, F_NOCACHE, 1);
   }
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+  // Read ahead aggressively, the file is read once from start to end.
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-  fclose(file);
-  return hash.digest();
+  if (buffer_ == nullptr &&
+      ::posix_memalign(&buffer_, HASH_CHUNK_ALIGNMENT, HASH_CHUNK_SIZE) != 0) {
+    buffer_ = nullptr;
+    ::close(fd);
+    return hashes;
+  }
+
+#ifdef __linux__
+  // The priority applies to the calling thread and is restored once read.
+  int priority = -1;
+  if (FLAGS_hash_io_idle) {
+    priority = ::syscall(SYS_ioprio_get, HASH_IOPRIO_WHO_PROCESS, 0);
+    ::syscall(SYS_ioprio_set, HASH_IOPRIO_WHO_PROCESS, 0,
+              HASH_IOPRIO_CLASS_IDLE);
+  }
+#endif
+
+  // Then call updates on each digest with the same read chunks.
+  bool failed = false;
+  ssize_t bytes_read = 0;
+  while ((bytes_read = ::read(fd, buffer_, HASH_CHUNK_SIZE)) != 0) {
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    } else if (bytes_read == -1) {
+      VLOG(1) << "Cannot hash/read file " << path;
+      failed = true;
+      break;
+    }
+
+    for (auto& digest : digests) {
+      digest.second->update(buffer_, bytes_read);
+    }
+  }
+
+#ifdef __linux__
+  if (priority != -1) {
+    ::syscall(SYS_ioprio_set, HASH_IOPRIO_WHO_PROCESS, 0, priority);
+  }
+#endif
+
+#ifdef POSIX_FADV_DONTNEED
+  // The hashed content is not needed again, do not evict other pages for it.
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  ::close(fd);
+
+  if (failed) {
+    return hashes;
+  }
+
+  for (auto& digest : digests) {
+    if (digest.first == HASH_TYPE_MD5) {
+      hashes.md5 = digest.second->digest();
+    } else if (digest.first == HASH_TYPE_SHA1) {
+      hashes.sha1 = digest.second->digest();
+    } else if (digest.first == HASH_TYPE_SHA256) {
+      hashes.sha256 = digest.second->digest();
+    }
+  }
+  return hashes;
 }
 }
@@ -10,6 +10,7 @@
 
 #include <gtest/gtest.h>
 
+#include <osquery/filesystem.h>
 #include <osquery/hash.h>
 
 #include "osquery/core/test_util.h"
@@ -46,6 +47,58 @@ TEST_F(HashTests, test_file_hashing) {
   auto digest = hashFromFile(HASH_TYPE_MD5, kTestDataPath + "test_hashing.bin");
   EXPECT_EQ(digest, "88ee11f2aa7903f34b8b8785d92208b1");
 }
+
+TEST_F(HashTests, test_multi_file_hashing) {
+  auto path = kTestDataPath + "test_hashing.bin";
+  auto hashes = hashMultiFromFile(HASH_TYPE_MD5 | HASH_TYPE_SHA256, path);
+  EXPECT_EQ(hashes.md5, "88ee11f2aa7903f34b8b8785d92208b1");
+  EXPECT_EQ(hashes.sha256, hashFromFile(HASH_TYPE_SHA256, path));
+  // Digests that were not requested are not computed.
+  EXPECT_TRUE(hashes.sha1.empty());
+
+  hashes = hashMultiFromFile(HASH_TYPE_SHA1, kTestDataPath + "not_a_file");
+  EXPECT_TRUE(hashes.sha1.empty());
+}
+
+TEST_F(HashTests, test_large_file_hashing) {
+  // Files larger than a read chunk are hashed across several reads.
+  std::string content(600 * 1024 + 7, 'a');
+  std::string path = "/tmp/osquery-hash-large-test.txt";
+  boost::filesystem::remove(path);
+  writeTextFile(path, content);
+
+  auto hashes = hashMultiFromFile(HASH_TYPE_SHA1 | HASH_TYPE_SHA256, path);
+  EXPECT_EQ(hashes.sha1,
+            hashFromBuffer(HASH_TYPE_SHA1, content.data(), content.size()));
+  EXPECT_EQ(hashes.sha256,
+            hashFromBuffer(HASH_TYPE_SHA256, content.data(), content.size()));
+  boost::filesystem::remove(path);
+}
+
+TEST_F(HashTests, test_file_hasher) {
+  std::string small_path = "/tmp/osquery-hash-small-test.txt";
+  std::string large_path = "/tmp/osquery-hash-large-test.txt";
+  std::string large(300 * 1024, 'b');
+  writeTextFile(small_path, "small");
+  writeTextFile(large_path, large);
+
+  // A hasher's contexts and buffer are reused by each file.
+  FileHasher hasher;
+  auto hashes = hasher.hash(HASH_TYPE_MD5 | HASH_TYPE_SHA256, large_path);
+  EXPECT_EQ(hashes.sha256,
+            hashFromBuffer(HASH_TYPE_SHA256, large.data(), large.size()));
+  hashes = hasher.hash(HASH_TYPE_MD5 | HASH_TYPE_SHA1, small_path);
+  EXPECT_EQ(hashes.md5, hashFromBuffer(HASH_TYPE_MD5, "small", 5));
+  EXPECT_EQ(hashes.sha1, hashFromBuffer(HASH_TYPE_SHA1, "small", 5));
+  EXPECT_TRUE(hashes.sha256.empty());
+
+  // A failed read does not change the next file's digests.
+  EXPECT_TRUE(hasher.hash(HASH_TYPE_MD5, "/tmp/not_a_file").md5.empty());
+  EXPECT_EQ(hasher.hash(HASH_TYPE_MD5, small_path).md5,
+            hashFromBuffer(HASH_TYPE_MD5, "small", 5));
+  boost::filesystem::remove(small_path);
+  boost::filesystem::remove(large_path);
+}
 }
 
 int main(int argc, char* argv[]) {
@@ -0,0 +1,366 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#include <osquery/database/results.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+#include <osquery/registry.h>
+#include <osquery/tables.h>
+
+extern char** environ;
+
+namespace osquery {
+namespace tables {
+
+DEFINE_osquery_flag(int32,
+                    table_helper_processes,
+                    2,
+                    "Helper processes generating isolated tables at once "
+                    "(0 generates them in process)");
+
+DEFINE_osquery_flag(int32,
+                    table_helper_timeout,
+                    60,
+                    "Seconds before a table helper process is killed");
+
+/// The helper process slots, isolated tables wait for a free one.
+static std::mutex kHelperMutex;
+static std::condition_variable kHelperAvailable;
+static size_t kHelpersRunning = 0;
+
+/// The size of a frame's length prefix, each frame is one binary Row.
+const size_t kHelperFrameHeader = sizeof(uint32_t);
+
+/// A helper writes its frames to this descriptor, the worker reads a pipe.
+const int kHelperFd = 3;
+
+/// The environment of a helper names the table and its serialized context.
+const std::string kHelperTableVariable = "OSQUERY_TABLE_HELPER";
+const std::string kHelperContextVariable = "OSQUERY_TABLE_HELPER_CONTEXT";
+
+/// The worker's arguments, helpers are started with the same flags.
+static std::vector<std::string> kHelperArguments;
+
+static bool writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    auto written = ::write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    } else if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+/// The helper's side: write each row as a frame.
+static bool writeHelperFrames(int fd, const QueryData& rows) {
+  std::string row;
+  for (const auto& r : rows) {
+    serializeRowBinary(r, row);
+    uint32_t size = row.size();
+    if (!writeAll(fd, (const char*)&size, kHelperFrameHeader) ||
+        !writeAll(fd, row.data(), row.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Read the helper's frames until it closes the pipe or the deadline passes.
+static Status readHelper(int fd, std::string& data) {
+  struct timespec now;
+  ::clock_gettime(CLOCK_MONOTONIC, &now);
+  auto deadline = now.tv_sec + std::max(FLAGS_table_helper_timeout, 1);
+
+  char buffer[16384];
+  while (true) {
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec >= deadline) {
+      return Status(1, "Table helper timed out");
+    }
+
+    struct pollfd descriptor = {fd, POLLIN, 0};
+    auto ready = ::poll(&descriptor, 1, (deadline - now.tv_sec) * 1000);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    } else if (ready <= 0) {
+      return Status(1, "Table helper timed out");
+    }
+
+    auto bytes = ::read(fd, buffer, sizeof(buffer));
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes < 0) {
+      return Status(1, "Cannot read from table helper");
+    } else if (bytes == 0) {
+      return Status(0, "OK");
+    }
+    data.append(buffer, bytes);
+  }
+}
+
+static Status parseHelperFrames(const std::string& data, QueryData& results) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    uint32_t size = 0;
+    if (data.size() - offset < kHelperFrameHeader) {
+      return Status(1, "Truncated table helper frame");
+    }
+    memcpy(&size, data.data() + offset, kHelperFrameHeader);
+    offset += kHelperFrameHeader;
+    if (data.size() - offset < size) {
+      return Status(1, "Truncated table helper frame");
+    }
+
+    Row r;
+    auto status = deserializeRowBinary(data.substr(offset, size), r);
+    if (!status.ok()) {
+      return status;
+    }
+    results.push_back(std::move(r));
+    offset += size;
+  }
+  return Status(0, "OK");
+}
+
+/// Create a close-on-exec pipe above the descriptors a helper inherits.
+static bool createHelperPipe(int fds[2]) {
+  int created[2];
+  if (::pipe(created) != 0) {
+    return false;
+  }
+
+  for (size_t i = 0; i < 2; i++) {
+    fds[i] = ::fcntl(created[i], F_DUPFD_CLOEXEC, kHelperFd + 1);
+    ::close(created[i]);
+  }
+  if (fds[0] < 0 || fds[1] < 0) {
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return false;
+  }
+  return true;
+}
+
+/// The path used to start the process's own executable again.
+static std::string getHelperPath() {
+#if defined(__APPLE__)
+  char path[PATH_MAX];
+  uint32_t size = sizeof(path);
+  if (::_NSGetExecutablePath(path, &size) == 0) {
+    return path;
+  }
+#elif defined(__linux__)
+  // The link is followed by exec even if the executable was replaced.
+  return "/proc/self/exe";
+#endif
+  return (kHelperArguments.empty()) ? "" : kHelperArguments[0];
+}
+
+/// Start the executable as a helper writing the table's frames to a pipe.
+static Status spawnHelper(const std::string& table,
+                          const QueryContext& context,
+                          int fd,
+                          pid_t& pid) {
+  auto path = getHelperPath();
+  if (path.empty()) {
+    return Status(1, "Cannot find the table helper executable");
+  }
+
+  PluginRequest request;
+  TablePlugin::setRequestFromContext(context, request);
+
+  // The worker's flags are passed on, the table and context are not flags.
+  std::vector<char*> arguments;
+  for (const auto& argument : kHelperArguments) {
+    arguments.push_back(const_cast<char*>(argument.c_str()));
+  }
+  if (arguments.empty()) {
+    arguments.push_back(const_cast<char*>(path.c_str()));
+  }
+  arguments.push_back(nullptr);
+
+  std::vector<std::string> variables;
+  for (char** variable = environ; *variable != nullptr; variable++) {
+    std::string value(*variable);
+    if (value.find(kHelperTableVariable + "=") != 0 &&
+        value.find(kHelperContextVariable + "=") != 0) {
+      variables.push_back(std::move(value));
+    }
+  }
+  variables.push_back(kHelperTableVariable + "=" + table);
+  variables.push_back(kHelperContextVariable + "=" + request["context"]);
+  std::vector<char*> environment;
+  for (const auto& variable : variables) {
+    environment.push_back(const_cast<char*>(variable.c_str()));
+  }
+  environment.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  ::posix_spawn_file_actions_init(&actions);
+  ::posix_spawn_file_actions_adddup2(&actions, fd, kHelperFd);
+
+  // Worker threads may block signals, the helper starts with none blocked.
+  posix_spawnattr_t attributes;
+  ::posix_spawnattr_init(&attributes);
+  sigset_t mask;
+  sigemptyset(&mask);
+  ::posix_spawnattr_setsigmask(&attributes, &mask);
+  ::posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+  auto result = ::posix_spawn(&pid,
+                              path.c_str(),
+                              &actions,
+                              &attributes,
+                              arguments.data(),
+                              environment.data());
+  ::posix_spawnattr_destroy(&attributes);
+  ::posix_spawn_file_actions_destroy(&actions);
+  if (result != 0) {
+    pid = -1;
+    return Status(1, "Cannot start a table helper: " + std::to_string(result));
+  }
+  return Status(0, "OK");
+}
+
+void setHelperArguments(int argc, char* argv[]) {
+  kHelperArguments.assign(argv, argv + argc);
+}
+
+bool isTableHelper() {
+  return ::getenv(kHelperTableVariable.c_str()) != nullptr;
+}
+
+int runTableHelper() {
+  std::string table = ::getenv(kHelperTableVariable.c_str());
+  PluginRequest request;
+  auto context_variable = ::getenv(kHelperContextVariable.c_str());
+  if (context_variable != nullptr) {
+    request["context"] = context_variable;
+  }
+  // Processes the table starts are not helpers.
+  ::unsetenv(kHelperTableVariable.c_str());
+  ::unsetenv(kHelperContextVariable.c_str());
+
+  auto plugin =
+      std::dynamic_pointer_cast<TablePlugin>(Registry::find("table", table));
+  if (plugin == nullptr) {
+    return 1;
+  }
+
+  int code = 1;
+  try {
+    QueryContext context;
+    TablePlugin::setContextFromRequest(request, context);
+    code = (writeHelperFrames(kHelperFd, plugin->generate(context))) ? 0 : 1;
+  } catch (...) {
+    code = 1;
+  }
+  ::close(kHelperFd);
+  return code;
+}
+
+Status generateInHelper(const std::string& table,
+                        const QueryContext& context,
+                        const std::function<QueryData()>& generator,
+                        QueryData& results) {
+  if (FLAGS_table_helper_processes <= 0) {
+    results = generator();
+    return Status(0, "OK");
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(kHelperMutex);
+    kHelperAvailable.wait(lock, []() {
+      return kHelpersRunning < (size_t)FLAGS_table_helper_processes;
+    });
+    kHelpersRunning++;
+  }
+
+  std::string data;
+  auto status = Status(0, "OK");
+  int fds[2];
+  pid_t pid = -1;
+  if (!createHelperPipe(fds)) {
+    status = Status(1, "Cannot create a table helper pipe");
+  } else {
+    status = spawnHelper(table, context, fds[1], pid);
+    ::close(fds[1]);
+    if (pid > 0) {
+      status = readHelper(fds[0], data);
+      if (!status.ok()) {
+        ::kill(pid, SIGKILL);
+      }
+
+      int code = 0;
+      while (::waitpid(pid, &code, 0) < 0 && errno == EINTR) {
+      }
+      if (status.ok() && (!WIFEXITED(code) || WEXITSTATUS(code) != 0)) {
+        status = Status(1, "Table helper failed");
+      }
+    }
+    ::close(fds[0]);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(kHelperMutex);
+    kHelpersRunning--;
+  }
+  kHelperAvailable.notify_one();
+
+  if (pid < 0 && !status.ok()) {
+    // Generate in process rather than lose the rows, such as at a process
+    // limit or for a context too large to pass to the helper.
+    VLOG(1) << status.getMessage() << ", generating in process";
+    results = generator();
+    return Status(0, "OK");
+  }
+  return (status.ok()) ? parseHelperFrames(data, results) : status;
+}
+
+QueryData TablePlugin::generateIsolated(QueryContext& request) {
+  QueryData results;
+  auto status = generateInHelper(
+      name_, request, [this, &request]() { return generate(request); },
+      results);
+  if (!status.ok()) {
+    LOG(WARNING) << "Cannot generate table " << name_ << ": "
+                 << status.getMessage();
+    results.clear();
+  }
+  return results;
+}
+}
+}
@@ -8,15 +8,21 @@
  *
  */
 
+#include <chrono>
+#include <future>
+#include <mutex>
+
 #include <syslog.h>
 
 #include <osquery/config.h>
 #include <osquery/core.h>
+#include <osquery/database.h>
 #include <osquery/events.h>
 #include <osquery/flags.h>
 #include <osquery/filesystem.h>
 #include <osquery/logger.h>
 #include <osquery/registry.h>
+#include <osquery/tables.h>
 
 namespace osquery {
 
@@ -44,6 +50,27 @@ DEFINE_osquery_flag(string,
 
 namespace fs = boost::filesystem;
 
+/// Startup phase durations, recorded by the main and startup threads.
+static StartupPhases kStartupPhases;
+static std::mutex kStartupPhasesMutex;
+
+void recordStartupPhase(const std::string& phase, size_t duration_ms) {
+  std::lock_guard<std::mutex> lock(kStartupPhasesMutex);
+  kStartupPhases.push_back(std::make_pair(phase, duration_ms));
+}
+
+StartupPhases getStartupPhases() {
+  std::lock_guard<std::mutex> lock(kStartupPhasesMutex);
+  return kStartupPhases;
+}
+
+/// The milliseconds since a startup phase began.
+static size_t getPhaseDuration(
+    const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start).count();
+}
+
 void printUsage(const std::string& binary, int tool) {
   // Parse help options before gflags. Only display osquery-related options.
   fprintf(stdout, "osquery " OSQUERY_VERSION ", %s\n", kDescription.c_str());
@@ -74,6 +101,7 @@ void announce(const std::string& basename) {
 }
 
 void initOsquery(int argc, char* argv[], int tool) {
+  auto init_start = std::chrono::steady_clock::now();
   std::string binary(fs::path(std::string(argv[0])).filename().string());
   std::string first_arg = (argc > 1) ? std::string(argv[1]) : "";
 
@@ -84,8 +112,8 @@ void initOsquery(int argc, char* argv[], int tool) {
     ::exit(0);
   }
 
-  // Print the version to SYSLOG.
-  if (tool == OSQUERY_TOOL_DAEMON) {
+  // Print the version to SYSLOG, table helpers are not announced.
+  if (tool == OSQUERY_TOOL_DAEMON && !osquery::tables::isTableHelper()) {
     announce(binary);
   }
 
@@ -103,8 +131,18 @@ void initOsquery(int argc, char* argv[], int tool) {
   // Set version string from CMake build
   __GFLAGS_NAMESPACE::SetVersionString(OSQUERY_VERSION);
 
+  // Table helpers are started with the same options/flags.
+  osquery::tables::setHelperArguments(argc, argv);
+
   // Let gflags parse the non-help options/flags.
+  auto phase_start = std::chrono::steady_clock::now();
   __GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, false);
+  recordStartupPhase("flags", getPhaseDuration(phase_start));
+
+  // A table helper generates one table for its worker and exits.
+  if (osquery::tables::isTableHelper()) {
+    ::exit(osquery::tables::runTableHelper());
+  }
 
   // The log dir is used for glogging and the filesystem results logs.
   if (isWritable(FLAGS_osquery_log_dir.c_str()).ok()) {
@@ -135,17 +173,60 @@ void initOsquery(int argc, char* argv[], int tool) {
 
   google::InitGoogleLogging(argv[0]);
   VLOG(1) << "osquery starting [version=" OSQUERY_VERSION "]";
+
+  // The daemon's backing store is opened while the plugins are set up.
+  std::future<void> database;
+  if (tool == OSQUERY_TOOL_DAEMON) {
+    database = std::async(std::launch::async, []() {
+      auto start = std::chrono::steady_clock::now();
+      try {
+        DBHandle::getInstance();
+      } catch (const std::exception& e) {
+        // The daemon reports the error when it uses the backing store.
+      }
+      recordStartupPhase("database", getPhaseDuration(start));
+    });
+  }
+
+  phase_start = std::chrono::steady_clock::now();
   osquery::Registry::setUp();
+  // Status logs may be forwarded once the logger plugins are set up.
+  osquery::initStatusLogger();
+  // Traces may be sent to the logger plugins, the config load is traced as
+  // set by the command line.
+  osquery::initTracing();
+  recordStartupPhase("registry", getPhaseDuration(phase_start));
+
+  // Loading the config and attaching events both use the registry, and
+  // events may read the config once attached. The config is loaded first,
+  // the backing store still opens meanwhile.
+  phase_start = std::chrono::steady_clock::now();
+  Config::getInstance()->load();
+  // The config may set trace_path and trace_receiver.
+  osquery::initTracing();
+  recordStartupPhase("config", getPhaseDuration(phase_start));
+
+  phase_start = std::chrono::steady_clock::now();
   osquery::attachEvents();
+  recordStartupPhase("events", getPhaseDuration(phase_start));
 
-  auto config = Config::getInstance();
-  config->load();
+  if (database.valid()) {
+    database.wait();
+  }
+  recordStartupPhase("init", getPhaseDuration(init_start));
 }
 
 void shutdownOsquery() {
   // End any event type run loops.
   osquery::EventFactory::end();
 
+  // Log the results still queued for each receiver and join their threads
+  // before the logger plugins and the backing store are torn down.
+  osquery::LoggerDispatcher::getInstance().stop();
+
+  // Stop forwarding status logs to the logger plugins.
+  osquery::shutdownStatusLogger();
+
   // Hopefully release memory used by global string constructors in gflags.
   __GFLAGS_NAMESPACE::ShutDownCommandLineFlags();
 }
@@ -0,0 +1,165 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <libproc.h>
+#else
+#include <malloc.h>
+#endif
+
+#include <sqlite3.h>
+
+#include <osquery/core.h>
+#include <osquery/database.h>
+#include <osquery/events.h>
+
+#include "osquery/sql/sqlite_util.h"
+#include "osquery/sql/virtual_table.h"
+
+#ifdef __linux__
+// Allocator statistics are read from jemalloc or tcmalloc if either is linked.
+extern "C" int mallctl(const char* name,
+                       void* oldp,
+                       size_t* oldlenp,
+                       void* newp,
+                       size_t newlen) __attribute__((weak));
+extern "C" int MallocExtension_GetNumericProperty(const char* property,
+                                                  size_t* value)
+    __attribute__((weak));
+extern "C" void MallocExtension_ReleaseFreeMemory() __attribute__((weak));
+#endif
+
+namespace osquery {
+
+/// The resident bytes of this process, 0 if unknown.
+static size_t getResidentSize() {
+#ifdef __APPLE__
+  struct rusage_info_v2 info;
+  if (proc_pid_rusage(getpid(), RUSAGE_INFO_V2, (rusage_info_t*)&info) == 0) {
+    return info.ri_phys_footprint;
+  }
+#else
+  auto statm = fopen("/proc/self/statm", "r");
+  if (statm != nullptr) {
+    unsigned long long size = 0;
+    unsigned long long resident = 0;
+    auto fields = fscanf(statm, "%llu %llu", &size, &resident);
+    fclose(statm);
+    if (fields == 2) {
+      return resident * sysconf(_SC_PAGESIZE);
+    }
+  }
+#endif
+  return 0;
+}
+
+/// The bytes allocated and not freed through the allocator, 0 if unknown.
+static size_t getAllocatedSize(std::string& allocator) {
+#ifdef __linux__
+  if (mallctl != nullptr) {
+    // Statistics are cached by jemalloc until the epoch is advanced.
+    uint64_t epoch = 1;
+    size_t size = sizeof(epoch);
+    mallctl("epoch", &epoch, &size, &epoch, size);
+    size_t allocated = 0;
+    size = sizeof(allocated);
+    if (mallctl("stats.allocated", &allocated, &size, nullptr, 0) == 0) {
+      allocator = "jemalloc";
+      return allocated;
+    }
+  }
+
+  if (MallocExtension_GetNumericProperty != nullptr) {
+    size_t allocated = 0;
+    if (MallocExtension_GetNumericProperty("generic.current_allocated_bytes",
+                                           &allocated)) {
+      allocator = "tcmalloc";
+      return allocated;
+    }
+  }
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  auto info = mallinfo2();
+  allocator = "malloc";
+  return info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+  auto info = mallinfo();
+  allocator = "malloc";
+  return (size_t)(unsigned int)info.uordblks + (unsigned int)info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+void getMemoryUsage(std::vector<MemoryUsage>& usage) {
+  usage.push_back({"resident", getResidentSize(), 0});
+
+  std::string allocator = "allocator";
+  auto allocated = getAllocatedSize(allocator);
+  usage.push_back({allocator, allocated, 0});
+
+  // SQLite's allocations include every connection's statements and pages.
+  usage.push_back({"sqlite",
+                   (size_t)sqlite3_memory_used(),
+                   SQLiteDBManager::idleCount()});
+  usage.push_back({"table_result_cache",
+                   tables::TableResultCache::bytes(),
+                   tables::TableResultCache::size()});
+
+  try {
+    auto db = DBHandle::getInstance();
+    usage.push_back({"rocksdb_memtables",
+                     db->getIntProperty("rocksdb.cur-size-all-mem-tables"),
+                     0});
+    usage.push_back({"rocksdb_table_readers",
+                     db->getIntProperty("rocksdb.estimate-table-readers-mem"),
+                     0});
+  } catch (const std::runtime_error& e) {
+    // The backing store could not be opened.
+  }
+
+  size_t queue_bytes = 0;
+  size_t queue_depth = 0;
+  for (const auto& name : EventFactory::subscriberNames()) {
+    auto subscriber = EventFactory::getEventSubscriber(name);
+    if (subscriber != nullptr) {
+      queue_bytes += subscriber->queueBytes();
+      queue_depth += subscriber->queueDepth();
+    }
+  }
+  usage.push_back({"event_queues", queue_bytes, queue_depth});
+}
+
+void releaseFreeMemory() {
+#ifdef __linux__
+  if (mallctl != nullptr) {
+    // MALLCTL_ARENAS_ALL (4096) purges the dirty pages of every arena.
+    mallctl("arena.4096.purge", nullptr, nullptr, nullptr, 0);
+    return;
+  }
+
+  if (MallocExtension_ReleaseFreeMemory != nullptr) {
+    MallocExtension_ReleaseFreeMemory();
+    return;
+  }
+#endif
+
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+}
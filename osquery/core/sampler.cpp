@@ -0,0 +1,335 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <osquery/core.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+
+namespace osquery {
+
+DEFINE_osquery_flag(int32,
+                    profiler_hz,
+                    0,
+                    "Samples per CPU second of the sampling profiler (0 off)");
+
+DEFINE_osquery_flag(string,
+                    profiler_path,
+                    "",
+                    "Path the sampling profiler writes folded stacks to");
+
+/// The rate of sampling started by SIGUSR2 without --profiler_hz.
+const int kDefaultSampleHz = 99;
+
+const size_t kSampleFrames = 32;
+const size_t kSampleTagSize = 64;
+const size_t kSampleBufferSize = 2048;
+
+/// The signal handler and signal trampoline frames of each sample.
+const int kSkippedFrames = 2;
+
+struct Sample {
+  void* frames[kSampleFrames];
+  int depth;
+  /// A copy of the thread's tags, which may change before folding.
+  char tags[SAMPLE_TAG_TABLE + 1][kSampleTagSize];
+  std::atomic<bool> ready;
+};
+
+/// Samples are claimed in order, the folding thread swaps two buffers.
+struct SampleBuffer {
+  Sample samples[kSampleBufferSize];
+  std::atomic<size_t> count;
+};
+
+static SampleBuffer kSampleBuffers[2];
+static std::atomic<SampleBuffer*> kActiveBuffer(&kSampleBuffers[0]);
+static std::atomic<size_t> kDroppedSamples(0);
+static std::atomic<int> kSampleHz(0);
+
+static thread_local const char* kSampleTags[SAMPLE_TAG_TABLE + 1] = {nullptr,
+                                                                     nullptr};
+
+/// Folded stacks and their sample counts, leaked such that the folding
+/// thread may run while the process exits.
+struct FoldedSamples {
+  std::map<std::string, size_t> stacks;
+  std::map<void*, std::string> symbols;
+  std::mutex mutex;
+};
+
+static FoldedSamples& getFoldedSamples() {
+  static auto folded = new FoldedSamples();
+  return *folded;
+}
+
+SampleTag::SampleTag(SampleTagType type, const std::string& name)
+    : type_(type), previous_(kSampleTags[type]) {
+  kSampleTags[type_] = name.c_str();
+}
+
+SampleTag::~SampleTag() { kSampleTags[type_] = previous_; }
+
+/// Record the interrupted stack, only async-signal-safe calls are made.
+static void sampleHandler(int signal) {
+  int saved_errno = errno;
+  auto buffer = kActiveBuffer.load();
+  size_t i = buffer->count.load();
+  do {
+    if (i >= kSampleBufferSize) {
+      kDroppedSamples++;
+      errno = saved_errno;
+      return;
+    }
+  } while (!buffer->count.compare_exchange_weak(i, i + 1));
+
+  auto& sample = buffer->samples[i];
+  sample.depth = backtrace(sample.frames, kSampleFrames);
+  for (size_t t = 0; t <= SAMPLE_TAG_TABLE; ++t) {
+    const char* tag = kSampleTags[t];
+    size_t n = 0;
+    for (; tag != nullptr && tag[n] != 0 && n < kSampleTagSize - 1; ++n) {
+      sample.tags[t][n] = tag[n];
+    }
+    sample.tags[t][n] = 0;
+  }
+  sample.ready = true;
+  errno = saved_errno;
+}
+
+static void setSampleTimer(int hz) {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  if (hz > 0) {
+    timer.it_interval.tv_usec = 1000000 / std::min(hz, 1000);
+    timer.it_value = timer.it_interval;
+  }
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+/// SIGUSR2 starts or stops sampling, setitimer is async-signal-safe.
+static void toggleHandler(int signal) {
+  int saved_errno = errno;
+  int hz = (FLAGS_profiler_hz > 0) ? FLAGS_profiler_hz : kDefaultSampleHz;
+  int expected = 0;
+  if (!kSampleHz.compare_exchange_strong(expected, hz)) {
+    kSampleHz = 0;
+    hz = 0;
+  }
+  setSampleTimer(hz);
+  errno = saved_errno;
+}
+
+/// The function name of a frame, or its module and offset.
+static const std::string& getSymbol(FoldedSamples& folded, void* address) {
+  auto it = folded.symbols.find(address);
+  if (it != folded.symbols.end()) {
+    return it->second;
+  }
+
+  Dl_info info;
+  memset(&info, 0, sizeof(info));
+  std::string symbol;
+  if (dladdr(address, &info) != 0 && info.dli_sname != nullptr) {
+    int status = 0;
+    auto demangled =
+        abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    symbol = (status == 0) ? demangled : info.dli_sname;
+    free(demangled);
+    // Argument lists make frames long and are the same for most callers.
+    symbol = symbol.substr(0, symbol.find('('));
+  } else {
+    // Frames without a dynamic symbol are resolved later with addr2line.
+    char offset[32];
+    snprintf(offset,
+             sizeof(offset),
+             "+0x%zx",
+             (uintptr_t)address - (uintptr_t)info.dli_fbase);
+    std::string module = (info.dli_fname != nullptr) ? info.dli_fname : "";
+    symbol = module.substr(module.rfind('/') + 1) + offset;
+  }
+  std::replace(symbol.begin(), symbol.end(), ';', ':');
+  std::replace(symbol.begin(), symbol.end(), ' ', '_');
+  return folded.symbols[address] = symbol;
+}
+
+/// A sample as a root-first stack, beginning with the query and table.
+static std::string foldSample(FoldedSamples& folded, const Sample& sample) {
+  std::string stack = std::string("query:") +
+                      ((sample.tags[SAMPLE_TAG_QUERY][0] != 0)
+                           ? sample.tags[SAMPLE_TAG_QUERY]
+                           : "none");
+  if (sample.tags[SAMPLE_TAG_TABLE][0] != 0) {
+    stack += std::string(";table:") + sample.tags[SAMPLE_TAG_TABLE];
+  }
+  for (int i = sample.depth - 1; i >= kSkippedFrames; --i) {
+    stack += ";" + getSymbol(folded, sample.frames[i]);
+  }
+  return stack;
+}
+
+/// Fold the samples of the active buffer, the folded lock must be held.
+static size_t foldSamples(FoldedSamples& folded) {
+  auto buffer = kActiveBuffer.load();
+  kActiveBuffer = (buffer == &kSampleBuffers[0]) ? &kSampleBuffers[1]
+                                                 : &kSampleBuffers[0];
+
+  // Closing the buffer stops claims, claimed samples finish in the handler.
+  auto count =
+      std::min(buffer->count.exchange(kSampleBufferSize), kSampleBufferSize);
+  for (size_t i = 0; i < count; ++i) {
+    auto& sample = buffer->samples[i];
+    while (!sample.ready) {
+      std::this_thread::yield();
+    }
+    folded.stacks[foldSample(folded, sample)]++;
+    sample.ready = false;
+  }
+  buffer->count = 0;
+  return count;
+}
+
+/**
+ * @brief Replace the folded stacks file, as read by flamegraph.pl.
+ *
+ * The temporary file is created exclusively and symlinks are not followed,
+ * such that a file cannot be written through a link planted at its path.
+ * The rename replaces a link at the profiler path rather than its target.
+ */
+static void writeFoldedSamples(FoldedSamples& folded) {
+  if (FLAGS_profiler_path.empty()) {
+    return;
+  }
+
+  std::string content;
+  for (const auto& stack : folded.stacks) {
+    content += stack.first + " " + std::to_string(stack.second) + "\n";
+  }
+
+  auto path = FLAGS_profiler_path + ".tmp";
+  int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+  int fd = ::open(path.c_str(), flags, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    // A file left by an interrupted write, unlink does not follow links.
+    ::unlink(path.c_str());
+    fd = ::open(path.c_str(), flags, 0600);
+  }
+  if (fd < 0) {
+    LOG(WARNING) << "Cannot create profiler samples file " << path;
+    return;
+  }
+
+  size_t written = 0;
+  while (written < content.size()) {
+    auto bytes =
+        ::write(fd, content.data() + written, content.size() - written);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes <= 0) {
+      break;
+    }
+    written += bytes;
+  }
+  ::close(fd);
+  if (written != content.size()) {
+    LOG(WARNING) << "Cannot write profiler samples to " << path;
+    ::unlink(path.c_str());
+    return;
+  }
+  ::rename(path.c_str(), FLAGS_profiler_path.c_str());
+}
+
+/// Fold new samples and rewrite the file about once a second.
+static void foldingLoop() {
+  auto& folded = getFoldedSamples();
+  size_t dropped = 0;
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::lock_guard<std::mutex> lock(folded.mutex);
+    if (foldSamples(folded) > 0) {
+      writeFoldedSamples(folded);
+    }
+    if (kDroppedSamples > dropped) {
+      dropped = kDroppedSamples;
+      LOG(WARNING) << "Sampling profiler dropped " << dropped << " samples";
+    }
+  }
+}
+
+static void installSampler() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    // The first backtrace may allocate while loading the unwinder.
+    void* frames[kSampleFrames];
+    backtrace(frames, kSampleFrames);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = sampleHandler;
+    ::sigaction(SIGPROF, &action, nullptr);
+    action.sa_handler = toggleHandler;
+    ::sigaction(SIGUSR2, &action, nullptr);
+
+    std::thread(foldingLoop).detach();
+  });
+}
+
+Status startSampling(int hz) {
+  if (hz <= 0) {
+    return Status(1, "The sampling rate must be positive");
+  } else if (FLAGS_profiler_path.empty()) {
+    return Status(1, "No profiler_path to write samples to");
+  }
+  installSampler();
+  kSampleHz = hz;
+  setSampleTimer(hz);
+  return Status(0, "OK");
+}
+
+void stopSampling() {
+  if (kSampleHz.exchange(0) == 0) {
+    return;
+  }
+  setSampleTimer(0);
+  auto& folded = getFoldedSamples();
+  std::lock_guard<std::mutex> lock(folded.mutex);
+  foldSamples(folded);
+  writeFoldedSamples(folded);
+}
+
+void initSampler() {
+  if (FLAGS_profiler_path.empty()) {
+    // Without a path profiling is not configured, SIGUSR2 is not handled.
+    return;
+  }
+  installSampler();
+  if (FLAGS_profiler_hz > 0) {
+    startSampling(FLAGS_profiler_hz);
+  }
+}
+}
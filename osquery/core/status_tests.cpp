@@ -39,6 +39,20 @@ TEST_F(StatusTests, test_to_string) {
   auto s = Status(0, "foobar");
   EXPECT_EQ(s.toString(), "foobar");
 }
+
+TEST_F(StatusTests, test_ok_message) {
+  // Successful statuses without a message of their own are "OK".
+  EXPECT_EQ(Status(0, "OK").getMessage(), "OK");
+  EXPECT_EQ(Status(0, std::string("OK")).toString(), "OK");
+  EXPECT_TRUE(Status() == Status(0, "OK"));
+  EXPECT_TRUE(Status() != Status(1, "OK"));
+  EXPECT_EQ(Status(1, "OK").getMessage(), "OK");
+
+  std::string message = "moved";
+  auto s = Status(STATUS_NOT_FOUND, std::move(message));
+  EXPECT_EQ(s.getCode(), STATUS_NOT_FOUND);
+  EXPECT_EQ(s.getMessage(), "moved");
+}
 }
 
 int main(int argc, char* argv[]) {
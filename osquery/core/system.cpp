@@ -10,8 +10,16 @@
 
 #include <sstream>
 
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #if !defined(__FreeBSD__)
 #include <uuid/uuid.h>
@@ -46,6 +54,50 @@ DEFINE_osquery_flag(bool,
                     false,
                     "Force osqueryd to kill previously-running daemons.");
 
+DEFINE_osquery_flag(string,
+                    worker_cpu_affinity,
+                    "",
+                    "CPUs for dispatcher workers (e.g., 0-3,6)");
+
+DEFINE_osquery_flag(int32,
+                    worker_nice,
+                    0,
+                    "Nice value of dispatcher worker threads");
+
+DEFINE_osquery_flag(bool,
+                    worker_idle,
+                    false,
+                    "Run workers at the idle CPU and IO priority");
+
+DEFINE_osquery_flag(string,
+                    events_cpu_affinity,
+                    "",
+                    "CPUs for event publisher threads");
+
+DEFINE_osquery_flag(int32,
+                    events_nice,
+                    0,
+                    "Nice value of event publisher threads");
+
+DEFINE_osquery_flag(string,
+                    scheduler_cpu_affinity,
+                    "",
+                    "CPUs for the scheduler thread");
+
+DEFINE_osquery_flag(int32,
+                    scheduler_nice,
+                    0,
+                    "Nice value of the scheduler thread");
+
+/// CPU numbers in an affinity list must be smaller.
+const size_t kMaxCPUs = 1024;
+
+#ifdef __linux__
+/// The ioprio_set(2) values, libc does not provide them.
+#define THREAD_IOPRIO_WHO_PROCESS 1
+#define THREAD_IOPRIO_CLASS_IDLE (3 << 13)
+#endif
+
 std::string getHostname() {
   char hostname[256]; // Linux max should be 64.
   memset(hostname, 0, sizeof(hostname));
@@ -182,4 +234,111 @@ Status createPidFile() {
   auto status = writeTextFile(FLAGS_pidfile, pid, 0644);
   return status;
 }
+
+Status parseCPUList(const std::string& list, std::vector<size_t>& cpus) {
+  cpus.clear();
+  for (const auto& item : split(list, ",")) {
+    auto range = split(item, "-");
+    if (range.empty() || range.size() > 2 || item.front() == '-' ||
+        item.back() == '-' || item.find('-') != item.rfind('-')) {
+      return Status(1, "Invalid CPU list: " + list);
+    }
+
+    size_t first = 0;
+    size_t last = 0;
+    try {
+      first = boost::lexical_cast<size_t>(range[0]);
+      last = boost::lexical_cast<size_t>(range.back());
+    } catch (const boost::bad_lexical_cast& e) {
+      return Status(1, "Invalid CPU list: " + list);
+    }
+    if (first > last || last >= kMaxCPUs) {
+      return Status(1, "Invalid CPU range: " + item);
+    }
+    for (size_t cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+
+  if (cpus.empty()) {
+    return Status(1, "Empty CPU list");
+  }
+  return Status(0, "OK");
+}
+
+Status setThreadPolicy(ThreadRole role) {
+  std::string affinity;
+  int nice = 0;
+  bool idle = false;
+  if (role == kDispatcherThread) {
+    affinity = FLAGS_worker_cpu_affinity;
+    nice = FLAGS_worker_nice;
+    idle = FLAGS_worker_idle;
+  } else if (role == kEventThread) {
+    affinity = FLAGS_events_cpu_affinity;
+    nice = FLAGS_events_nice;
+  } else if (role == kSchedulerThread) {
+    affinity = FLAGS_scheduler_cpu_affinity;
+    nice = FLAGS_scheduler_nice;
+  }
+
+  std::vector<size_t> cpus;
+  if (!affinity.empty()) {
+    auto status = parseCPUList(affinity, cpus);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+#ifdef __linux__
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto& cpu : cpus) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    // A pid of 0 applies the affinity to the calling thread only.
+    if (::sched_setaffinity(0, sizeof(set), &set) != 0) {
+      return Status(1, std::string("Cannot set CPU affinity: ") +
+                           strerror(errno));
+    }
+  }
+
+  // Linux applies a thread ID's nice value to that thread alone.
+  pid_t thread = (pid_t)::syscall(SYS_gettid);
+  if (nice != 0 && ::setpriority(PRIO_PROCESS, thread, nice) != 0) {
+    return Status(1, std::string("Cannot set nice value: ") + strerror(errno));
+  }
+
+  if (idle) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    if (::sched_setscheduler(0, SCHED_IDLE, &param) != 0 ||
+        ::syscall(SYS_ioprio_set,
+                  THREAD_IOPRIO_WHO_PROCESS,
+                  0,
+                  THREAD_IOPRIO_CLASS_IDLE) != 0) {
+      return Status(1, std::string("Cannot set idle priority: ") +
+                           strerror(errno));
+    }
+  }
+#else
+  if (!cpus.empty() || nice != 0) {
+    return Status(1, "Thread CPU affinity and nice values require Linux");
+  }
+
+#ifdef __APPLE__
+  // Throttled IO is the thread-scoped equivalent of the idle IO class.
+  if (idle &&
+      ::setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE) !=
+          0) {
+    return Status(1, std::string("Cannot set idle priority: ") +
+                         strerror(errno));
+  }
+#endif
+#endif
+  return Status(0, "OK");
+}
 }
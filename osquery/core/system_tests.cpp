@@ -0,0 +1,66 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <osquery/core.h>
+#include <osquery/flags.h>
+
+namespace osquery {
+
+DECLARE_string(worker_cpu_affinity);
+
+class SystemTests : public testing::Test {};
+
+TEST_F(SystemTests, test_parse_cpu_list) {
+  std::vector<size_t> cpus;
+  EXPECT_TRUE(parseCPUList("0-3, 6", cpus).ok());
+  EXPECT_EQ(cpus, std::vector<size_t>({0, 1, 2, 3, 6}));
+
+  cpus.clear();
+  EXPECT_TRUE(parseCPUList("2", cpus).ok());
+  EXPECT_EQ(cpus, std::vector<size_t>({2}));
+
+  EXPECT_FALSE(parseCPUList("", cpus).ok());
+  EXPECT_FALSE(parseCPUList("3-1", cpus).ok());
+  EXPECT_FALSE(parseCPUList("1-2-3", cpus).ok());
+  EXPECT_FALSE(parseCPUList("-1", cpus).ok());
+  EXPECT_FALSE(parseCPUList("a", cpus).ok());
+  EXPECT_FALSE(parseCPUList("0-100000", cpus).ok());
+}
+
+TEST_F(SystemTests, test_set_thread_policy) {
+  // Without configured policies threads are unchanged.
+  EXPECT_TRUE(setThreadPolicy(kDispatcherThread).ok());
+  EXPECT_TRUE(setThreadPolicy(kEventThread).ok());
+  EXPECT_TRUE(setThreadPolicy(kSchedulerThread).ok());
+
+  FLAGS_worker_cpu_affinity = "0-";
+  EXPECT_FALSE(setThreadPolicy(kDispatcherThread).ok());
+
+#ifdef __linux__
+  // Every host has a CPU 0, apply the affinity to a temporary thread.
+  FLAGS_worker_cpu_affinity = "0";
+  bool applied = false;
+  std::thread([&applied]() {
+    applied = setThreadPolicy(kDispatcherThread).ok();
+  }).join();
+  EXPECT_TRUE(applied);
+#endif
+  FLAGS_worker_cpu_affinity = "";
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
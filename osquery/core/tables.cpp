@@ -8,72 +8,131 @@
  *
  */
 
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
 #include <boost/property_tree/json_parser.hpp>
 
+#include <osquery/core.h>
+#include <osquery/dispatcher.h>
+#include <osquery/flags.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
 namespace osquery {
 namespace tables {
 
+/// The per-query cap on workers used by parallelMap and parallelForEach.
+DEFINE_osquery_flag(int32,
+                    table_parallelism,
+                    4,
+                    "Workers one table scan may use to generate rows");
 
-bool ConstraintList::matches(const std::string& expr) {
-  // Support each SQL affinity type casting.
+static ConstraintAffinity getAffinity(const std::string& affinity) {
   if (affinity == "TEXT") {
-    return literal_matches<TEXT_LITERAL>(expr);
+    return AFFINITY_TEXT;
   } else if (affinity == "INTEGER") {
-    INTEGER_LITERAL lexpr = AS_LITERAL(INTEGER_LITERAL, expr);
-    return literal_matches<INTEGER_LITERAL>(lexpr);
+    return AFFINITY_INTEGER;
   } else if (affinity == "BIGINT") {
-    BIGINT_LITERAL lexpr = AS_LITERAL(BIGINT_LITERAL, expr);
-    return literal_matches<BIGINT_LITERAL>(lexpr);
+    return AFFINITY_BIGINT;
   } else if (affinity == "UNSIGNED_BIGINT") {
-    UNSIGNED_BIGINT_LITERAL lexpr = AS_LITERAL(UNSIGNED_BIGINT_LITERAL, expr);
-    return literal_matches<UNSIGNED_BIGINT_LITERAL>(lexpr);
-  } else {
-    // Unsupprted affinity type.
-    return false;
+    return AFFINITY_UNSIGNED_BIGINT;
   }
+  return AFFINITY_UNSUPPORTED;
 }
 
-template <typename T>
-bool ConstraintList::literal_matches(const T& base_expr) {
-  bool aggregate = true;
-  for (size_t i = 0; i < constraints_.size(); ++i) {
-    T constraint_expr = AS_LITERAL(T, constraints_[i].expr);
-    if (constraints_[i].op == EQUALS) {
-      aggregate = aggregate && (base_expr == constraint_expr);
-    } else if (constraints_[i].op == GREATER_THAN) {
-      aggregate = aggregate && (base_expr > constraint_expr);
-    } else if (constraints_[i].op == LESS_THAN) {
-      aggregate = aggregate && (base_expr < constraint_expr);
-    } else if (constraints_[i].op == GREATER_THAN_OR_EQUALS) {
-      aggregate = aggregate && (base_expr >= constraint_expr);
-    } else if (constraints_[i].op == LESS_THAN_OR_EQUALS) {
-      aggregate = aggregate && (base_expr <= constraint_expr);
-    } else {
-      // Unsupported constraint.
+template <typename L, typename T>
+bool ConstraintList::compileRange(ConstraintRange<T>& range) {
+  range = ConstraintRange<T>();
+  for (const auto& constraint : constraints_) {
+    T expr;
+    try {
+      expr = AS_LITERAL(L, constraint.expr);
+    } catch (const boost::bad_lexical_cast& e) {
+      // No value of the affinity equals or compares to the expression.
       return false;
     }
-    if (!aggregate) {
-      // Speed up comparison.
+    if (!range.narrow(constraint.op, expr)) {
+      // Unsupported constraint.
       return false;
     }
   }
   return true;
 }
 
+void ConstraintList::compile() {
+  affinity_ = getAffinity(affinity);
+  bool satisfiable = false;
+  if (affinity_ == AFFINITY_TEXT) {
+    satisfiable = compileRange<TEXT_LITERAL>(text_range_);
+  } else if (affinity_ == AFFINITY_INTEGER) {
+    satisfiable = compileRange<INTEGER_LITERAL>(integer_range_);
+  } else if (affinity_ == AFFINITY_BIGINT) {
+    satisfiable = compileRange<BIGINT_LITERAL>(integer_range_);
+  } else if (affinity_ == AFFINITY_UNSIGNED_BIGINT) {
+    satisfiable = compileRange<UNSIGNED_BIGINT_LITERAL>(unsigned_range_);
+  }
+  unsatisfiable_ = !satisfiable;
+  compiled_ = true;
+}
+
+bool ConstraintList::matches(const std::string& expr) {
+  if (!compiled_) {
+    compile();
+  }
+
+  // Support each SQL affinity type casting.
+  if (unsatisfiable_) {
+    return false;
+  } else if (affinity_ == AFFINITY_TEXT) {
+    return text_range_.contains(expr);
+  } else if (affinity_ == AFFINITY_INTEGER) {
+    return integer_range_.contains(AS_LITERAL(INTEGER_LITERAL, expr));
+  } else if (affinity_ == AFFINITY_BIGINT) {
+    return integer_range_.contains(AS_LITERAL(BIGINT_LITERAL, expr));
+  }
+  return unsigned_range_.contains(AS_LITERAL(UNSIGNED_BIGINT_LITERAL, expr));
+}
+
 std::vector<std::string> ConstraintList::getAll(ConstraintOperator op) {
   std::vector<std::string> set;
   for (size_t i = 0; i < constraints_.size(); ++i) {
-    if (constraints_[i].op == op) {
-      // TODO: this does not apply a distinct.
+    if (constraints_[i].op == op &&
+        std::find(set.begin(), set.end(), constraints_[i].expr) == set.end()) {
+      // Generators iterate each expression, `x = 1 OR x = 1` is one value.
       set.push_back(constraints_[i].expr);
     }
   }
   return set;
 }
 
+std::string ColumnValue::toString() const {
+  if (type == kInteger) {
+    return std::to_string(integer);
+  } else if (type == kDouble) {
+    return TEXT(real);
+  }
+  return text;
+}
+
+bool TypedTableCursor::next(Row& r) {
+  TypedRow typed;
+  if (!nextTyped(typed)) {
+    return false;
+  }
+  for (const auto& column : typed) {
+    if (column.second.type != ColumnValue::kNull) {
+      r[column.first] = column.second.toString();
+    }
+  }
+  return true;
+}
+
 void ConstraintList::serialize(boost::property_tree::ptree& tree) const {
   boost::property_tree::ptree expressions;
   for (const auto& constraint : constraints_) {
@@ -95,6 +154,299 @@ void ConstraintList::unserialize(const boost::property_tree::ptree& tree) {
     constraints_.push_back(constraint);
   }
   affinity = tree.get<std::string>("affinity");
+  compile();
+}
+
+std::string ConstraintList::key() const {
+  std::string key;
+  for (const auto& constraint : constraints_) {
+    // Length-prefix expressions, which may contain any character.
+    key += std::to_string(constraint.op) + ":" +
+           std::to_string(constraint.expr.size()) + ":" + constraint.expr;
+  }
+  return key;
+}
+
+/// The CPU time used by the calling thread, in microseconds.
+static unsigned long long getThreadCPUTime() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+  }
+#endif
+  // Fall back to the process CPU time, which overestimates the query's use.
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+QueryBudget::QueryBudget(size_t timeout_ms, size_t cpu_ms)
+    : deadline_(std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(timeout_ms)),
+      timeout_ms_(timeout_ms),
+      cpu_ms_(cpu_ms),
+      cpu_start_(getThreadCPUTime()),
+      thread_(std::this_thread::get_id()),
+      exceeded_(false) {}
+
+bool QueryBudget::exceeded() {
+  if (exceeded_) {
+    return true;
+  }
+
+  if (timeout_ms_ > 0 && std::chrono::steady_clock::now() >= deadline_) {
+    exceeded_ = true;
+  } else if (cpu_ms_ > 0 && std::this_thread::get_id() == thread_ &&
+             getThreadCPUTime() - cpu_start_ >= cpu_ms_ * 1000ULL) {
+    exceeded_ = true;
+  }
+  return exceeded_;
+}
+
+QueryDataRef TableSnapshot::get(const std::string& table,
+                                const std::function<QueryDataRef()>& generate) {
+  std::promise<QueryDataRef> promise;
+  std::shared_future<QueryDataRef> rows;
+  bool generating = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto shared = rows_.find(table);
+    if (shared != rows_.end()) {
+      rows = shared->second;
+    } else {
+      rows = promise.get_future().share();
+      rows_[table] = rows;
+      generating = true;
+    }
+  }
+
+  // Other queries wait outside the lock for the first query's generation.
+  if (generating) {
+    promise.set_value(generate());
+  }
+  return rows.get();
+}
+
+/// The most keys, such as distinct constraints, cached per table.
+const size_t kFileBackedCacheMaxKeys = 16;
+
+/// Append the identity of a stat result to an identity string.
+static void identifyStat(const struct stat& info, std::string& identity) {
+#ifdef __APPLE__
+  auto nsec = info.st_mtimespec.tv_nsec;
+#else
+  auto nsec = info.st_mtim.tv_nsec;
+#endif
+  identity += std::to_string(info.st_ino) + ":" +
+              std::to_string(info.st_size) + ":" +
+              std::to_string(info.st_mtime) + "." + std::to_string(nsec) + ";";
+}
+
+/**
+ * @brief Append the identity of a file, or a directory's entries.
+ *
+ * A symlink's identity includes its target's. Only the entries directly in a
+ * directory are identified, with lstat, such that links are never followed
+ * from a listed directory.
+ */
+static void identifyFile(const std::string& path, std::string& identity) {
+  struct stat info;
+  identity += path + ":";
+  if (::lstat(path.c_str(), &info) != 0) {
+    identity += "-;";
+    return;
+  }
+
+  identifyStat(info, identity);
+  if (S_ISLNK(info.st_mode)) {
+    if (::stat(path.c_str(), &info) != 0) {
+      identity += "-;";
+      return;
+    }
+    identifyStat(info, identity);
+  }
+  if (!S_ISDIR(info.st_mode)) {
+    return;
+  }
+
+  // Files edited in place do not change their directory's identity.
+  std::vector<std::pair<std::string, std::string> > entries;
+  auto dir = ::opendir(path.c_str());
+  if (dir != nullptr) {
+    struct dirent* entry = nullptr;
+    while ((entry = ::readdir(dir)) != nullptr) {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..") {
+        continue;
+      }
+
+      struct stat child;
+      std::string child_identity;
+      if (::fstatat(::dirfd(dir), entry->d_name, &child, AT_SYMLINK_NOFOLLOW) !=
+          0) {
+        child_identity = "-;";
+      } else {
+        identifyStat(child, child_identity);
+      }
+      entries.push_back(std::make_pair(name, child_identity));
+    }
+    ::closedir(dir);
+  }
+
+  std::sort(entries.begin(), entries.end());
+  auto prefix = (path.back() == '/') ? path : path + "/";
+  for (const auto& entry : entries) {
+    identity += prefix + entry.first + ":" + entry.second;
+  }
+}
+
+std::string FileBackedCache::identify(const std::vector<std::string>& paths) {
+  std::string identity;
+  for (const auto& path : paths) {
+    if (!path.empty()) {
+      identifyFile(path, identity);
+    }
+  }
+  return identity;
+}
+
+QueryData FileBackedCache::get(const std::string& key,
+                               const std::vector<std::string>& paths,
+                               const std::function<QueryData()>& generate) {
+  auto identity = identify(paths);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto cached = rows_.find(key);
+    if (cached != rows_.end() && cached->second.identity == identity) {
+      cached->second.used = ++uses_;
+      return cached->second.rows;
+    }
+  }
+
+  auto rows = generate();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (rows_.size() >= kFileBackedCacheMaxKeys && rows_.count(key) == 0) {
+    auto oldest = std::min_element(
+        rows_.begin(),
+        rows_.end(),
+        [](const std::pair<const std::string, Entry>& a,
+           const std::pair<const std::string, Entry>& b) {
+          return a.second.used < b.second.used;
+        });
+    rows_.erase(oldest);
+  }
+
+  auto& entry = rows_[key];
+  entry.identity = identity;
+  entry.rows = rows;
+  entry.used = ++uses_;
+  return rows;
+}
+
+void FileBackedCache::erase(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  rows_.erase(key);
+}
+
+std::string QueryContext::key() const {
+  std::string key = std::to_string(limit) + ";";
+  for (const auto& constraint : constraints) {
+    auto list = constraint.second.key();
+    if (!list.empty()) {
+      key += constraint.first + "(" + list + ")";
+    }
+  }
+
+  key += ";";
+  if (colsUsedSet) {
+    for (const auto& column : colsUsed) {
+      key += column + ",";
+    }
+  } else {
+    key += "*";
+  }
+
+  if (events.bounded()) {
+    key += ";" + std::to_string(events.start) + "-" +
+           std::to_string(events.stop);
+  }
+  return key;
+}
+
+/**
+ * @brief Keep the rows matching a request's text equality constraints.
+ *
+ * A row is kept if its value equals any of a column's expressions, SQLite
+ * applies every constraint to the results.
+ */
+static QueryData filterRows(const QueryData& rows, QueryContext& request) {
+  std::vector<std::pair<std::string, std::vector<std::string> > > equals;
+  for (auto& constraint : request.constraints) {
+    if (constraint.second.affinity == "TEXT") {
+      auto expressions = constraint.second.getAll(EQUALS);
+      if (!expressions.empty()) {
+        equals.push_back(std::make_pair(constraint.first, expressions));
+      }
+    }
+  }
+  if (equals.empty()) {
+    return rows;
+  }
+
+  QueryData results;
+  for (const auto& row : rows) {
+    bool matched = true;
+    for (const auto& column : equals) {
+      auto value = row.find(column.first);
+      if (value == row.end() ||
+          std::find(column.second.begin(),
+                    column.second.end(),
+                    value->second) == column.second.end()) {
+        matched = false;
+        break;
+      }
+    }
+    if (matched) {
+      results.push_back(row);
+    }
+  }
+  return results;
+}
+
+QueryData TablePlugin::generateRows(QueryContext& request) {
+  TraceSpan span("generate", name_);
+  auto paths = sourceFiles();
+  if (paths.empty() && bootCacheable()) {
+    // Rows cached for the boot are generated once for every context.
+    QueryContext unconstrained;
+    unconstrained.budget = request.budget;
+    auto rows = source_cache_.get("", {}, [this, &unconstrained]() {
+      return (isolated()) ? generateIsolated(unconstrained)
+                          : generate(unconstrained);
+    });
+    if (unconstrained.cancelled()) {
+      // Rows of a cancelled query are incomplete, they are not reused.
+      source_cache_.erase("");
+    }
+    return filterRows(rows, request);
+  }
+
+  auto generator = [this, &request]() {
+    return (isolated()) ? generateIsolated(request) : generate(request);
+  };
+  if (paths.empty()) {
+    return generator();
+  }
+
+  auto key = request.key();
+  auto rows = source_cache_.get(key, paths, generator);
+  if (request.cancelled()) {
+    // Rows of a cancelled query are incomplete, they are not reused.
+    source_cache_.erase(key);
+  }
+  return rows;
 }
 
 void TablePlugin::setRequestFromContext(const QueryContext& context,
@@ -114,6 +466,17 @@ void TablePlugin::setRequestFromContext(const QueryContext& context,
   }
   tree.add_child("constraints", constraints);
 
+  // Only include the used columns if they are known, otherwise all are used.
+  if (context.colsUsedSet) {
+    boost::property_tree::ptree cols_used;
+    for (const auto& column : context.colsUsed) {
+      boost::property_tree::ptree child;
+      child.put("", column);
+      cols_used.push_back(std::make_pair("", child));
+    }
+    tree.add_child("colsUsed", cols_used);
+  }
+
   // Write the property tree as a JSON string into the PluginRequest.
   std::ostringstream output;
   boost::property_tree::write_json(output, tree, false);
@@ -127,6 +490,20 @@ void TablePlugin::setResponseFromQueryData(const QueryData& data,
   }
 }
 
+void TablePlugin::setResponseFromQueryData(QueryData&& data,
+                                           PluginResponse& response) {
+  if (response.empty()) {
+    // A response is a list of rows, the generated list is reused.
+    response = std::move(data);
+    return;
+  }
+
+  response.reserve(response.size() + data.size());
+  for (auto& row : data) {
+    response.push_back(std::move(row));
+  }
+}
+
 void TablePlugin::setContextFromRequest(const PluginRequest& request,
                                         QueryContext& context) {
   if (request.count("context") == 0) {
@@ -145,6 +522,14 @@ void TablePlugin::setContextFromRequest(const PluginRequest& request,
     auto column_name = constraint.second.get<std::string>("name");
     context.constraints[column_name].unserialize(constraint.second);
   }
+
+  auto cols_used = tree.get_child_optional("colsUsed");
+  if (cols_used) {
+    context.colsUsedSet = true;
+    for (const auto& column : *cols_used) {
+      context.colsUsed.insert(column.second.data());
+    }
+  }
 }
 
 Status TablePlugin::call(const PluginRequest& request,
@@ -157,25 +542,66 @@ Status TablePlugin::call(const PluginRequest& request,
 
   if (request.at("action") == "statement") {
     // The "statement" action generates an SQL create table statement.
-    response.push_back({{"statement", statement()}});
+    const auto& table = definition();
+    response.push_back({{"statement", table.statement}});
+    if (table.estimated_rows > 0) {
+      response.back()["estimated_rows"] =
+          std::to_string(table.estimated_rows);
+    }
+    if (table.cacheable) {
+      response.back()["cacheable"] = "1";
+    }
+    if (table.incremental) {
+      response.back()["incremental"] = "1";
+    }
   } else if (request.at("action") == "generate") {
     // "generate" runs the table implementation using a PluginRequest with
     // optional serialized QueryContext and returns the QueryData results as
     // the PluginRequest data.
+    TraceSpan span("TablePlugin::call", name_);
     QueryContext context;
     if (request.count("context") > 0) {
       setContextFromRequest(request, context);
     }
-    setResponseFromQueryData(generate(context), response);
+    auto rows = cursor(context);
+    if (rows != nullptr) {
+      // Streaming tables are drained into the response.
+      Row r;
+      while (rows->next(r)) {
+        response.push_back(std::move(r));
+        r.clear();
+      }
+    } else {
+      setResponseFromQueryData(generateRows(context), response);
+    }
+  } else if (request.at("action") == "generate_batches") {
+    // "generate_batches" returns the rows as columnar batches for callers
+    // in another process, see serializeQueryDataColumnar.
+    QueryContext context;
+    if (request.count("context") > 0) {
+      setContextFromRequest(request, context);
+    }
+    size_t batch_rows = kTableBatchRows;
+    if (request.count("batch_rows") > 0) {
+      batch_rows = strtoull(request.at("batch_rows").c_str(), nullptr, 10);
+    }
+    generateBatches(context, std::max(batch_rows, (size_t)1), response);
   } else if (request.at("action") == "columns") {
     // "columns" returns a PluginRequest filled with column information
     // such as name and type.
-    auto column_list = columns();
-    for (const auto& column : column_list) {
+    const auto& table = definition();
+    for (const auto& column : table.columns) {
       response.push_back({{"name", column.first}, {"type", column.second}});
+      if (column.first == table.ordered) {
+        response.back()["ordered"] = "1";
+      }
+      auto option = table.options.find(column.first);
+      if (option != table.options.end()) {
+        response.back()["options"] = std::to_string(option->second);
+      }
     }
   } else if (request.at("action") == "columns_definition") {
-    response.push_back({{"definition", columnDefinition()}});
+    response.push_back({{"definition", definition().column_definition}});
   } else {
     return Status(1, "Unknown table plugin action: " + request.at("action"));
   }
@@ -200,5 +626,119 @@ std::string TablePlugin::statement() {
   return "CREATE TABLE " + name_ + columnDefinition();
 }
 
+void TablePlugin::generateBatches(QueryContext& context,
+                                  size_t batch_rows,
+                                  PluginResponse& response) {
+  std::vector<std::string> names;
+  for (const auto& column : definition().columns) {
+    names.push_back(column.first);
+  }
+
+  auto rows = cursor(context);
+  if (rows == nullptr) {
+    auto data = generateRows(context);
+    for (size_t i = 0; i < data.size(); i += batch_rows) {
+      std::string batch;
+      serializeQueryDataColumnar(names, data, i, i + batch_rows, batch);
+      response.push_back({{"batch", std::move(batch)}});
+    }
+    return;
+  }
+
+  // Streaming tables stop at the query's limit, pulling no further rows.
+  QueryData data;
+  size_t pulled = 0;
+  Row r;
+  while ((context.limit == 0 || pulled < (size_t)context.limit) &&
+         rows->next(r)) {
+    data.push_back(std::move(r));
+    r.clear();
+    pulled++;
+    if (data.size() == batch_rows) {
+      std::string batch;
+      serializeQueryDataColumnar(names, data, 0, data.size(), batch);
+      response.push_back({{"batch", std::move(batch)}});
+      data.clear();
+    }
+  }
+  if (!data.empty()) {
+    std::string batch;
+    serializeQueryDataColumnar(names, data, 0, data.size(), batch);
+    response.push_back({{"batch", std::move(batch)}});
+  }
+}
+
+const TableDefinition& TablePlugin::definition() {
+  std::call_once(definition_once_, [this]() {
+    definition_.statement = statement();
+    definition_.column_definition = columnDefinition();
+    definition_.columns = columns();
+    definition_.ordered = naturalOrder();
+    definition_.options = columnOptions();
+    definition_.estimated_rows = estimatedRows();
+    definition_.cacheable = cacheable();
+    definition_.incremental = incremental();
+  });
+  return definition_;
+}
+
+Status TablePlugin::setDefinitionFromResponse(const PluginResponse& statement,
+                                              const PluginResponse& columns,
+                                              TableDefinition& definition) {
+  if (statement.size() == 0 || statement[0].count("statement") == 0 ||
+      columns.size() == 0) {
+    return Status(1, "Incomplete table definition");
+  }
+
+  const auto& info = statement[0];
+  definition.statement = info.at("statement");
+  definition.cacheable =
+      (info.count("cacheable") > 0 && info.at("cacheable") == "1");
+  definition.incremental =
+      (info.count("incremental") > 0 && info.at("incremental") == "1");
+  if (info.count("estimated_rows") > 0) {
+    definition.estimated_rows =
+        strtoull(info.at("estimated_rows").c_str(), nullptr, 10);
+  }
+
+  for (const auto& column : columns) {
+    if (column.count("name") == 0 || column.count("type") == 0) {
+      return Status(1, "Table columns must include a name and type");
+    }
+    const auto& name = column.at("name");
+    definition.columns.push_back(std::make_pair(name, column.at("type")));
+    if (column.count("ordered") > 0 && column.at("ordered") == "1") {
+      definition.ordered = name;
+    }
+    if (column.count("options") > 0) {
+      definition.options[name] = atoi(column.at("options").c_str());
+    }
+  }
+  return Status(0, "OK");
+}
+
+size_t parallelChunks(size_t items) {
+  if (FLAGS_table_parallelism <= 1 || items < 2 * kParallelMinItems) {
+    return 1;
+  }
+  return std::min((size_t)FLAGS_table_parallelism, items / kParallelMinItems);
+}
+
+void parallelRun(size_t items,
+                 size_t chunks,
+                 const std::function<void(size_t, size_t, size_t)>& work) {
+  chunks = std::max(chunks, (size_t)1);
+  size_t size = (items + chunks - 1) / chunks;
+  TaskGroup group;
+  for (size_t chunk = 1; chunk < chunks && chunk * size < items; ++chunk) {
+    size_t begin = chunk * size;
+    size_t end = std::min(items, begin + size);
+    group.run([&work, chunk, begin, end]() { work(chunk, begin, end); });
+  }
+
+  // The calling thread generates the first chunk while workers run the rest.
+  work(0, 0, std::min(items, size));
+  group.wait();
+}
 }
 }
@@ -8,13 +8,26 @@
  *
  */
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include <unistd.h>
+
 #include <gtest/gtest.h>
 
+#include <osquery/flags.h>
+#include <osquery/registry.h>
 #include <osquery/tables.h>
 
 namespace osquery {
 namespace tables {
 
+DECLARE_int32(table_helper_timeout);
+
 class TablesTests : public testing::Test {};
 
 TEST_F(TablesTests, test_constraint) {
@@ -64,7 +77,7 @@ TEST_F(TablesTests, test_constraint_matching) {
   EXPECT_FALSE(cl.notExistsOrMatches("not_some"));
 
   struct ConstraintList cl2;
-  cl2.affinity = "INTEGER";
+  cl2.setAffinity("INTEGER");
   constraint = Constraint(LESS_THAN);
   constraint.expr = "1000";
   cl2.add(constraint);
@@ -101,6 +114,44 @@ TEST_F(TablesTests, test_constraint_matching) {
   EXPECT_TRUE(cl3.matches(1));
 }
 
+TEST_F(TablesTests, test_constraint_ranges) {
+  struct ConstraintList cl;
+  cl.setAffinity("BIGINT");
+  cl.add(Constraint(GREATER_THAN, "5"));
+  cl.add(Constraint(LESS_THAN, "10"));
+  cl.add(Constraint(GREATER_THAN_OR_EQUALS, "7"));
+
+  // The constraints are one range, [7, 10).
+  EXPECT_FALSE(cl.matches(6));
+  EXPECT_TRUE(cl.matches(7));
+  EXPECT_TRUE(cl.matches(9));
+  EXPECT_FALSE(cl.matches(10));
+
+  // Adding a constraint recompiles the range.
+  cl.add(Constraint(EQUALS, "8"));
+  EXPECT_FALSE(cl.matches(7));
+  EXPECT_TRUE(cl.matches(8));
+
+  // Changing the affinity compares the expressions as the new type.
+  cl.setAffinity("TEXT");
+  // As TEXT "8" sorts after "10", the range is empty.
+  EXPECT_FALSE(cl.matches("8"));
+
+  // An expression that is not of the affinity matches no value.
+  struct ConstraintList cl2;
+  cl2.setAffinity("INTEGER");
+  cl2.add(Constraint(EQUALS, "not_an_integer"));
+  EXPECT_FALSE(cl2.matches(0));
+
+  // Repeated expressions are returned once.
+  cl2.add(Constraint(EQUALS, "1"));
+  cl2.add(Constraint(EQUALS, "not_an_integer"));
+  auto all_equals = cl2.getAll(EQUALS);
+  ASSERT_EQ(all_equals.size(), 2);
+  EXPECT_EQ(all_equals[0], "not_an_integer");
+  EXPECT_EQ(all_equals[1], "1");
+}
+
 TEST_F(TablesTests, test_constraint_map) {
   ConstraintMap cm;
   ConstraintList cl;
@@ -110,6 +161,304 @@ TEST_F(TablesTests, test_constraint_map) {
 
   EXPECT_TRUE(cm["path"].matches("some"));
 }
+
+TEST_F(TablesTests, test_context_columns_used) {
+  QueryContext context;
+  // Without information from SQLite every column is used.
+  EXPECT_TRUE(context.isColumnUsed("path"));
+
+  context.colsUsedSet = true;
+  context.colsUsed.insert("pid");
+  EXPECT_TRUE(context.isColumnUsed("pid"));
+  EXPECT_FALSE(context.isColumnUsed("path"));
+
+  // The used columns survive the plugin request serialization.
+  PluginRequest request;
+  TablePlugin::setRequestFromContext(context, request);
+  QueryContext output;
+  TablePlugin::setContextFromRequest(request, output);
+  EXPECT_TRUE(output.colsUsedSet);
+  EXPECT_TRUE(output.isColumnUsed("pid"));
+  EXPECT_FALSE(output.isColumnUsed("path"));
+
+  // An empty set of used columns is distinct from an unknown set.
+  QueryContext none;
+  none.colsUsedSet = true;
+  request.clear();
+  TablePlugin::setRequestFromContext(none, request);
+  QueryContext none_output;
+  TablePlugin::setContextFromRequest(request, none_output);
+  EXPECT_TRUE(none_output.colsUsedSet);
+  EXPECT_FALSE(none_output.isColumnUsed("pid"));
+}
+
+TEST_F(TablesTests, test_query_budget) {
+  // A context without a budget is never cancelled.
+  QueryContext context;
+  EXPECT_FALSE(context.cancelled());
+
+  context.budget = std::make_shared<QueryBudget>(0, 0);
+  EXPECT_FALSE(context.cancelled());
+  context.budget->cancel();
+  EXPECT_TRUE(context.cancelled());
+
+  context.budget = std::make_shared<QueryBudget>(10, 0);
+  EXPECT_FALSE(context.cancelled());
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_TRUE(context.cancelled());
+
+  // CPU time is measured on the thread running the query.
+  context.budget = std::make_shared<QueryBudget>(0, 10);
+  volatile size_t spin = 0;
+  while (!context.cancelled()) {
+    spin++;
+  }
+  EXPECT_GT(spin, 0);
+}
+
+TEST_F(TablesTests, test_response_from_query_data) {
+  QueryData rows = {{{"name", std::string(1024, 'a')}}, {{"name", "b"}}};
+  auto value = rows[0]["name"].data();
+
+  // Moved rows keep their values' storage.
+  PluginResponse response;
+  TablePlugin::setResponseFromQueryData(std::move(rows), response);
+  ASSERT_EQ(response.size(), 2U);
+  EXPECT_EQ(response[0]["name"].data(), value);
+  EXPECT_EQ(response[1]["name"], "b");
+
+  // Rows are appended to a response that has rows.
+  TablePlugin::setResponseFromQueryData(QueryData({{{"name", "c"}}}), response);
+  ASSERT_EQ(response.size(), 3U);
+  EXPECT_EQ(response[2]["name"], "c");
+}
+
+TEST_F(TablesTests, test_parallel_map) {
+  std::vector<int> items;
+  for (int i = 0; i < 1000; i++) {
+    items.push_back(i);
+  }
+
+  // Rows are merged in the order of the items.
+  QueryContext context;
+  auto results = parallelMap(context, items, [](int item, QueryData& rows) {
+    rows.push_back({{"item", std::to_string(item)}});
+  });
+  ASSERT_EQ(results.size(), items.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    EXPECT_EQ(results[i]["item"], std::to_string(i));
+  }
+
+  std::atomic<int> sum(0);
+  parallelForEach(context, items, [&sum](int item) { sum += item; });
+  EXPECT_EQ(sum, 999 * 1000 / 2);
+
+  // Small inputs are generated on the calling thread.
+  EXPECT_EQ(parallelChunks(kParallelMinItems), 1U);
+  auto thread = std::this_thread::get_id();
+  std::atomic<size_t> elsewhere(0);
+  parallelForEach(context,
+                  std::vector<int>(kParallelMinItems),
+                  [&thread, &elsewhere](int item) {
+                    if (std::this_thread::get_id() != thread) {
+                      elsewhere++;
+                    }
+                  });
+  EXPECT_EQ(elsewhere, 0U);
+
+  // Cancelled queries skip the remaining items.
+  context.budget = std::make_shared<QueryBudget>(0, 0);
+  context.budget->cancel();
+  results = parallelMap(context, items, [](int item, QueryData& rows) {
+    rows.push_back({{"item", std::to_string(item)}});
+  });
+  EXPECT_TRUE(results.empty());
+}
+
+TEST_F(TablesTests, test_file_backed_cache) {
+  const std::string directory = "/tmp/osquery-tables-file-cache";
+  const std::string path = directory + "/source";
+  ::system(("rm -rf " + directory + " && mkdir -p " + directory).c_str());
+  std::ofstream(path) << "first";
+
+  FileBackedCache cache;
+  size_t generated = 0;
+  auto generate = [&generated]() {
+    generated++;
+    return QueryData({{{"generation", std::to_string(generated)}}});
+  };
+
+  auto rows = cache.get("key", {path}, generate);
+  ASSERT_EQ(rows.size(), 1U);
+  EXPECT_EQ(rows[0]["generation"], "1");
+
+  // Unchanged sources reuse the rows of the same key only.
+  rows = cache.get("key", {path}, generate);
+  EXPECT_EQ(rows[0]["generation"], "1");
+  rows = cache.get("other", {path}, generate);
+  EXPECT_EQ(rows[0]["generation"], "2");
+
+  // A different size changes the identity.
+  std::ofstream(path) << "second";
+  rows = cache.get("key", {path}, generate);
+  EXPECT_EQ(rows[0]["generation"], "3");
+
+  // Directories include the identities of their entries.
+  auto identity = FileBackedCache::identify({directory});
+  EXPECT_NE(identity.find(path), std::string::npos);
+  std::ofstream(directory + "/added") << "added";
+  EXPECT_NE(FileBackedCache::identify({directory}), identity);
+
+  // Links within a directory are not followed, a loop is identified once.
+  ::symlink(directory.c_str(), (directory + "/loop").c_str());
+  identity = FileBackedCache::identify({directory});
+  EXPECT_NE(identity.find(directory + "/loop:"), std::string::npos);
+  EXPECT_EQ(identity.find(directory + "/loop/"), std::string::npos);
+
+  cache.erase("key");
+  rows = cache.get("key", {path}, generate);
+  EXPECT_EQ(rows[0]["generation"], "4");
+  ::system(("rm -rf " + directory).c_str());
+}
+
+TEST_F(TablesTests, test_file_backed_cache_eviction) {
+  FileBackedCache cache;
+  size_t generated = 0;
+  auto generate = [&generated]() {
+    generated++;
+    return QueryData({{{"generation", std::to_string(generated)}}});
+  };
+
+  // The least recently used key is removed once 16 keys are cached.
+  for (size_t i = 0; i < 16; ++i) {
+    cache.get(std::to_string(i), {}, generate);
+  }
+  cache.get("0", {}, generate);
+  cache.get("16", {}, generate);
+  EXPECT_EQ(generated, 17U);
+
+  auto rows = cache.get("0", {}, generate);
+  EXPECT_EQ(rows[0]["generation"], "1");
+  rows = cache.get("1", {}, generate);
+  EXPECT_EQ(rows[0]["generation"], "18");
+}
+
+class BootCacheableTablePlugin : public TablePlugin {
+ public:
+  size_t generated;
+
+  BootCacheableTablePlugin() : generated(0) {}
+
+ private:
+  bool bootCacheable() { return true; }
+
+  QueryData generate(QueryContext& request) {
+    generated++;
+    return {{{"generation", std::to_string(generated)}}};
+  }
+};
+
+TEST_F(TablesTests, test_boot_cacheable) {
+  BootCacheableTablePlugin table;
+  QueryContext context;
+  auto rows = table.generateRows(context);
+  ASSERT_EQ(rows.size(), 1U);
+  EXPECT_EQ(rows[0]["generation"], "1");
+
+  // Rows are generated once, for every context.
+  rows = table.generateRows(context);
+  EXPECT_EQ(rows[0]["generation"], "1");
+  QueryContext limited;
+  limited.limit = 1;
+  rows = table.generateRows(limited);
+  ASSERT_EQ(rows.size(), 1U);
+  EXPECT_EQ(rows[0]["generation"], "1");
+
+  // Text equality constraints filter the cached rows.
+  QueryContext constrained;
+  constrained.constraints["generation"].setAffinity("TEXT");
+  auto constraint = Constraint(EQUALS);
+  constraint.expr = "2";
+  constrained.constraints["generation"].add(constraint);
+  rows = table.generateRows(constrained);
+  EXPECT_EQ(rows.size(), 0U);
+  EXPECT_EQ(table.generated, 1U);
+}
+
+/// Held by a worker thread while a helper generates, see test_isolated_locks.
+static std::mutex kIsolatedMutex;
+
+class IsolatedTablePlugin : public TablePlugin {
+ private:
+  bool isolated() { return true; }
+
+  QueryData generate(QueryContext& request) {
+    if (request.constraints["fail"].exists()) {
+      ::abort();
+    }
+
+    // A helper forked while a worker thread held the lock would never get it.
+    std::lock_guard<std::mutex> lock(kIsolatedMutex);
+    return {{{"pid", std::to_string(getpid())}, {"empty", ""}},
+            {{"pid", std::to_string(getpid())}}};
+  }
+};
+
+// Helpers find the table by name, it is registered before initOsquery runs.
+REGISTER(IsolatedTablePlugin, "table", "isolated_test");
+
+static std::shared_ptr<TablePlugin> getIsolatedTable() {
+  return std::dynamic_pointer_cast<TablePlugin>(
+      Registry::get("table", "isolated_test"));
+}
+
+TEST_F(TablesTests, test_isolated_generate) {
+  auto table = getIsolatedTable();
+  QueryContext context;
+  auto rows = table->generateRows(context);
+  ASSERT_EQ(rows.size(), 2U);
+  EXPECT_NE(rows[0]["pid"], std::to_string(getpid()));
+  EXPECT_EQ(rows[0].count("empty"), 1U);
+  EXPECT_EQ(rows[1].size(), 1U);
+
+  // A failed helper generates no rows, the worker continues.
+  auto constraint = Constraint(EQUALS);
+  constraint.expr = "1";
+  context.constraints["fail"].add(constraint);
+  EXPECT_EQ(table->generateRows(context).size(), 0U);
+}
+
+TEST_F(TablesTests, test_isolated_locks) {
+  auto table = getIsolatedTable();
+  auto timeout = FLAGS_table_helper_timeout;
+  FLAGS_table_helper_timeout = 5;
+
+  // A worker thread holds a lock the generator takes, the helper must not
+  // inherit it.
+  std::mutex held_mutex;
+  std::condition_variable held;
+  bool holding = false;
+  std::thread holder([&held_mutex, &held, &holding]() {
+    std::lock_guard<std::mutex> thread_lock(kIsolatedMutex);
+    {
+      std::lock_guard<std::mutex> flag(held_mutex);
+      holding = true;
+    }
+    held.notify_one();
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+  });
+  {
+    std::unique_lock<std::mutex> flag(held_mutex);
+    held.wait(flag, [&holding]() { return holding; });
+  }
+
+  QueryContext context;
+  auto rows = table->generateRows(context);
+  holder.join();
+  FLAGS_table_helper_timeout = timeout;
+  ASSERT_EQ(rows.size(), 2U);
+  EXPECT_NE(rows[0]["pid"], std::to_string(getpid()));
+}
 }
 }
 
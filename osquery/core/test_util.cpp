@@ -95,6 +95,11 @@ osquery::OsqueryScheduledQuery getOsqueryScheduledQuery() {
   q.name = "foobartest";
   q.query = "SELECT filename FROM fs WHERE path = '/bin' ORDER BY filename";
   q.interval = 5;
+  q.timeout_ms = 0;
+  q.cpu_ms = 0;
+  q.snapshot = false;
+  q.max_bytes = 0;
+  q.rollup = 0;
   return q;
 }
 
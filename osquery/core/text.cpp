@@ -8,6 +8,12 @@
  *
  */
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <osquery/core.h>
 
 #include <boost/algorithm/string/split.hpp>
@@ -26,4 +32,36 @@ std::vector<std::string> split(const std::string& s, const std::string& delim) {
   }
   return elems;
 }
+
+size_t utf8StringSize(const std::string& str) {
+  // Each byte other than a continuation byte, 10xxxxxx, starts a character.
+  auto data = (const unsigned char*)str.data();
+  size_t size = str.size();
+  size_t continuations = 0;
+  size_t i = 0;
+#if defined(__SSE2__)
+  // As signed bytes, continuation bytes are less than 0xC0.
+  const auto lead = _mm_set1_epi8((char)0xC0);
+  for (; i + 16 <= size; i += 16) {
+    auto bytes = _mm_loadu_si128((const __m128i*)(data + i));
+    continuations +=
+        __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(bytes, lead)));
+  }
+#elif defined(__aarch64__)
+  for (; i + 16 <= size; i += 16) {
+    auto bytes = vandq_u8(vld1q_u8(data + i), vdupq_n_u8(0xC0));
+    auto matches = vceqq_u8(bytes, vdupq_n_u8(0x80));
+    continuations += vaddvq_u8(vshrq_n_u8(matches, 7));
+  }
+#endif
+  for (; i < size; ++i) {
+    continuations += ((data[i] & 0xC0) == 0x80) ? 1 : 0;
+  }
+
+  // The first byte is counted as a character, even if it is a continuation.
+  if (size > 0 && (data[0] & 0xC0) == 0x80) {
+    continuations--;
+  }
+  return size - continuations;
+}
 }
@@ -24,6 +24,35 @@ TEST_F(TextTests, test_split) {
     EXPECT_EQ(split(i.test_string), i.test_vector);
   }
 }
+
+static size_t iterateUtf8StringSize(const std::string& str) {
+  size_t size = 0;
+  auto it = str.begin();
+  while (it != str.end()) {
+    incUtf8StringIterator(it, str.end());
+    size++;
+  }
+  return size;
+}
+
+TEST_F(TextTests, test_utf8_string_size) {
+  EXPECT_EQ(utf8StringSize(""), 0U);
+  EXPECT_EQ(utf8StringSize("caf\xc3\xa9"), 4U);
+  EXPECT_EQ(utf8StringSize(std::string(100, 'a')), 100U);
+
+  // Strings longer than a vector of bytes, with sequences crossing vectors.
+  std::string mixed;
+  for (size_t i = 0; i < 20; ++i) {
+    mixed += "ab\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";
+  }
+  EXPECT_EQ(utf8StringSize(mixed), 100U);
+  EXPECT_EQ(utf8StringSize(mixed), iterateUtf8StringSize(mixed));
+  EXPECT_EQ(utf8StringSize(mixed.substr(1)), iterateUtf8StringSize(mixed) - 1);
+
+  // A stray continuation byte at the start is counted as a character.
+  auto stray = std::string("\xa9") + mixed;
+  EXPECT_EQ(utf8StringSize(stray), iterateUtf8StringSize(stray));
+}
 }
 
 int main(int argc, char* argv[]) {
@@ -0,0 +1,241 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+
+#include <osquery/core.h>
+#include <osquery/database/results.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+
+namespace osquery {
+
+DEFINE_osquery_flag(string,
+                    trace_path,
+                    "",
+                    "Append query lifecycle spans as Chrome trace JSON");
+
+DEFINE_osquery_flag(string,
+                    trace_receiver,
+                    "",
+                    "Comma-separated logger plugins receiving traces");
+
+/// A finished span, waiting for its trace's root span to finish.
+struct FinishedSpan {
+  const char* name;
+  std::string detail;
+  uint64_t span_id;
+  uint64_t parent_id;
+  /// Microseconds since the epoch.
+  uint64_t start;
+  uint64_t duration;
+};
+
+/// The spans of the trace running on a thread.
+struct ThreadTrace {
+  uint64_t trace_id;
+  uint64_t thread_id;
+  TraceSpan* current;
+  std::vector<FinishedSpan> spans;
+
+  ThreadTrace() : trace_id(0), thread_id(0), current(nullptr) {}
+};
+
+static std::atomic<bool> kTracing(false);
+static std::atomic<uint64_t> kThreadIds(0);
+static thread_local ThreadTrace kThreadTrace;
+
+/// The Chrome trace file, leaked such that spans may finish during exit.
+struct TraceFile {
+  std::ofstream output;
+  /// The trace_path the output was opened for.
+  std::string path;
+  /// No event was written to the file.
+  bool empty;
+  std::vector<std::string> receivers;
+  std::mutex mutex;
+};
+
+static TraceFile& getTraceFile() {
+  static auto file = new TraceFile();
+  return *file;
+}
+
+static uint64_t getRandomId() {
+  static std::mt19937_64 generator(std::random_device{}());
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  uint64_t id = 0;
+  while (id == 0) {
+    id = generator();
+  }
+  return id;
+}
+
+static std::string toHex(uint64_t id) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)id);
+  return hex;
+}
+
+static uint64_t getEpochMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/// Chrome trace "complete" events, one per line of a JSON array.
+static void writeChromeTrace(TraceFile& file, const ThreadTrace& trace) {
+  static const auto pid = std::to_string(getpid());
+  for (const auto& span : trace.spans) {
+    std::string line = (file.empty) ? "\n{\"name\":" : ",\n{\"name\":";
+    file.empty = false;
+    appendJSONString(line, span.name);
+    line += ",\"cat\":\"osquery\",\"ph\":\"X\",\"ts\":" +
+            std::to_string(span.start) + ",\"dur\":" +
+            std::to_string(span.duration) + ",\"pid\":" + pid + ",\"tid\":" +
+            std::to_string(trace.thread_id) + ",\"args\":{\"detail\":";
+    appendJSONString(line, span.detail);
+    line += "}}";
+    file.output << line;
+  }
+  file.output.flush();
+}
+
+/// The trace as one JSON line of OpenTelemetry-style spans.
+static std::string serializeTrace(const ThreadTrace& trace) {
+  auto trace_id = toHex(trace.trace_id);
+  std::string json = "{\"traceId\":\"" + trace_id + "\",\"spans\":[";
+  for (const auto& span : trace.spans) {
+    if (json.back() != '[') {
+      json += ",";
+    }
+    json += "{\"traceId\":\"" + trace_id + "\",\"spanId\":\"" +
+            toHex(span.span_id) + "\",\"parentSpanId\":\"" +
+            ((span.parent_id != 0) ? toHex(span.parent_id) : "") +
+            "\",\"name\":";
+    appendJSONString(json, span.name);
+    json += ",\"startTimeUnixNano\":" + std::to_string(span.start * 1000) +
+            ",\"endTimeUnixNano\":" +
+            std::to_string((span.start + span.duration) * 1000) +
+            ",\"attributes\":{\"detail\":";
+    appendJSONString(json, span.detail);
+    json += "}}";
+  }
+  return json + "]}";
+}
+
+static void exportTrace(const ThreadTrace& trace) {
+  auto& file = getTraceFile();
+  std::vector<std::string> receivers;
+  {
+    std::lock_guard<std::mutex> lock(file.mutex);
+    if (file.output.is_open()) {
+      writeChromeTrace(file, trace);
+    }
+    if (file.receivers.empty()) {
+      return;
+    }
+    // The receivers may change with a config refresh.
+    receivers = file.receivers;
+  }
+
+  auto json = serializeTrace(trace);
+  for (const auto& receiver : receivers) {
+    logString(json, receiver);
+  }
+}
+
+TraceSpan::TraceSpan(const char* name) : TraceSpan(name, std::string()) {}
+
+TraceSpan::TraceSpan(const char* name, const std::string& detail)
+    : active_(kTracing) {
+  if (!active_) {
+    return;
+  }
+
+  auto& trace = kThreadTrace;
+  if (trace.thread_id == 0) {
+    trace.thread_id = ++kThreadIds;
+  }
+  if (trace.current == nullptr) {
+    trace.trace_id = getRandomId();
+  }
+  name_ = name;
+  detail_ = detail;
+  span_id_ = getRandomId();
+  parent_ = trace.current;
+  trace.current = this;
+  epoch_start_ = getEpochMicroseconds();
+  start_ = std::chrono::steady_clock::now();
+}
+
+TraceSpan::~TraceSpan() {
+  if (!active_) {
+    return;
+  }
+
+  auto& trace = kThreadTrace;
+  FinishedSpan span;
+  span.name = name_;
+  span.detail = std::move(detail_);
+  span.span_id = span_id_;
+  span.parent_id = (parent_ != nullptr) ? parent_->span_id_ : 0;
+  span.start = epoch_start_;
+  span.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start_).count();
+  trace.spans.push_back(std::move(span));
+
+  trace.current = parent_;
+  if (parent_ == nullptr) {
+    // The root span finished, the trace is complete.
+    exportTrace(trace);
+    trace.spans.clear();
+  }
+}
+
+void initTracing() {
+  auto& file = getTraceFile();
+  std::lock_guard<std::mutex> lock(file.mutex);
+  if (file.output.is_open() && file.path != FLAGS_trace_path) {
+    file.output.close();
+  }
+  if (!FLAGS_trace_path.empty() && !file.output.is_open()) {
+    file.path = FLAGS_trace_path;
+    // The array is not closed, trace viewers accept an unterminated array.
+    file.output.open(FLAGS_trace_path, std::ios::app);
+    file.empty = (file.output.tellp() == 0);
+    if (file.empty) {
+      file.output << "[";
+    }
+    if (!file.output.good()) {
+      LOG(WARNING) << "Cannot write traces to " << FLAGS_trace_path;
+      file.output.close();
+    }
+  }
+
+  file.receivers.clear();
+  boost::split(file.receivers, FLAGS_trace_receiver, boost::is_any_of(","));
+  file.receivers.erase(
+      std::remove(file.receivers.begin(), file.receivers.end(), ""),
+      file.receivers.end());
+  kTracing = file.output.is_open() || !file.receivers.empty();
+}
+}
@@ -8,25 +8,60 @@
  *
  */
 
+#include <algorithm>
 #include <cstring>
 #include <sstream>
 
-#include <sys/wait.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __APPLE__
+#include <libproc.h>
+#include <mach/mach_time.h>
+#endif
 
 #include <osquery/core.h>
+#include <osquery/flags.h>
 #include <osquery/logger.h>
-#include <osquery/sql.h>
+#include <osquery/scheduler.h>
 
 #include "osquery/core/watcher.h"
 
 namespace osquery {
 
-#define WORKER_MEMORY_LIMIT (20 * 1024 * 1024)
-#define WORKER_UTILIZATION_LIMIT 60
+DEFINE_osquery_flag(int32,
+                    watchdog_memory_limit,
+                    200,
+                    "Worker resident memory limit in MB");
+
+DEFINE_osquery_flag(int32,
+                    watchdog_utilization_limit,
+                    600,
+                    "Worker CPU milliseconds per second limit");
+
+DEFINE_osquery_flag(int32,
+                    watchdog_latency_limit,
+                    5,
+                    "Seconds over the CPU limit before enforcing");
+
+DEFINE_osquery_flag(int32,
+                    watchdog_soft_percent,
+                    75,
+                    "Percent of a limit that defers a worker's queries");
+
+DEFINE_osquery_flag(bool,
+                    watchdog_cgroup,
+                    false,
+                    "Throttle workers in a delegated cgroup v2 before killing");
+
 #define WORKER_RESPAWN_LIMIT 20
 #define WORKER_RESPAWN_DELAY 5
-#define WORKER_LATENCY_LIMIT 5
+
+/// The cgroups created below the watcher's cgroup when throttling.
+const std::string kWatcherCgroup = "osquery-watcher";
+const std::string kWorkerCgroup = "osquery-worker";
 
 bool Watcher::ok() {
   ::sleep(1);
@@ -51,40 +86,285 @@ bool Watcher::watch() {
 
 void Watcher::stopWorker() {
   kill(worker_, SIGKILL);
+  closeWorker();
   worker_ = 0;
   // Clean up the defunct (zombie) process.
   waitpid(-1, 0, 0);
 }
 
+void Watcher::openWorker() {
+  closeWorker();
+#ifdef __linux__
+  auto path = "/proc/" + std::to_string(worker_);
+  stat_fd_ = ::open((path + "/stat").c_str(), O_RDONLY | O_CLOEXEC);
+  statm_fd_ = ::open((path + "/statm").c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+void Watcher::closeWorker() {
+  if (stat_fd_ >= 0) {
+    ::close(stat_fd_);
+  }
+  if (statm_fd_ >= 0) {
+    ::close(statm_fd_);
+  }
+  stat_fd_ = -1;
+  statm_fd_ = -1;
+}
+
+#ifdef __linux__
+/// Read a /proc file from the start of an open descriptor.
+static bool readProcFile(int fd, char* buffer, size_t size) {
+  if (fd < 0) {
+    return false;
+  }
+  auto bytes = ::pread(fd, buffer, size - 1, 0);
+  if (bytes <= 0) {
+    return false;
+  }
+  buffer[bytes] = '\0';
+  return true;
+}
+#endif
+
+bool Watcher::sampleWorker(size_t& user_time,
+                           size_t& system_time,
+                           size_t& footprint) {
+#ifdef __linux__
+  char buffer[1024];
+  if (!readProcFile(stat_fd_, buffer, sizeof(buffer))) {
+    return false;
+  }
+
+  // The name is within parenthesis and may itself contain spaces, the user
+  // and system times are the 14th and 15th fields in clock ticks.
+  const char* field = strrchr(buffer, ')');
+  if (field == nullptr) {
+    return false;
+  }
+  unsigned long long ticks[2] = {0, 0};
+  for (size_t index = 3; index <= 15 && *field != '\0'; ++index) {
+    while (*field == ' ' || *field == ')') {
+      ++field;
+    }
+    if (index >= 14) {
+      ticks[index - 14] = strtoull(field, nullptr, 10);
+    }
+    while (*field != ' ' && *field != '\0') {
+      ++field;
+    }
+  }
+  static const long kTicks = sysconf(_SC_CLK_TCK);
+  user_time = ticks[0] * 1000 / kTicks;
+  system_time = ticks[1] * 1000 / kTicks;
+
+  // The resident set size is the second field of statm in pages.
+  if (!readProcFile(statm_fd_, buffer, sizeof(buffer))) {
+    return false;
+  }
+  char* resident = nullptr;
+  strtoull(buffer, &resident, 10);
+  static const long kPageSize = sysconf(_SC_PAGESIZE);
+  footprint = strtoull(resident, nullptr, 10) * kPageSize;
+  return true;
+#elif defined(__APPLE__)
+  struct rusage_info_v2 info;
+  if (proc_pid_rusage(worker_, RUSAGE_INFO_V2, (rusage_info_t*)&info) != 0) {
+    return false;
+  }
+
+  // CPU times are in Mach absolute time units.
+  static mach_timebase_info_data_t timebase = {0, 0};
+  if (timebase.denom == 0) {
+    mach_timebase_info(&timebase);
+  }
+  user_time = info.ri_user_time * timebase.numer / timebase.denom / 1000000;
+  system_time =
+      info.ri_system_time * timebase.numer / timebase.denom / 1000000;
+  footprint = info.ri_phys_footprint;
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef __linux__
+/// Write a value to a cgroup control file.
+static bool writeCgroupFile(const std::string& path, const std::string& value) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    VLOG(1) << "Cannot open cgroup file " << path;
+    return false;
+  }
+  auto bytes = ::write(fd, value.c_str(), value.size());
+  ::close(fd);
+  if (bytes != (ssize_t)value.size()) {
+    VLOG(1) << "Cannot write " << value << " to cgroup file " << path;
+    return false;
+  }
+  return true;
+}
+
+/// The watcher's cgroup v2 directory, empty if cgroup v2 is not used.
+static std::string getWatcherCgroup() {
+  char buffer[4096];
+  int fd = ::open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return "";
+  }
+  auto bytes = ::read(fd, buffer, sizeof(buffer) - 1);
+  ::close(fd);
+  if (bytes <= 0) {
+    return "";
+  }
+  buffer[bytes] = '\0';
+
+  // The unified hierarchy is the "0::<path>" line.
+  std::string content(buffer);
+  auto start = (content.find("0::") == 0) ? 0 : content.find("\n0::");
+  if (start == std::string::npos) {
+    return "";
+  }
+  start = content.find("::", start) + 2;
+  auto path = content.substr(start, content.find('\n', start) - start);
+
+  // A watcher moved by an earlier throttle uses its original cgroup.
+  auto moved = "/" + kWatcherCgroup;
+  if (path.size() > moved.size() &&
+      path.compare(path.size() - moved.size(), moved.size(), moved) == 0) {
+    path.resize(path.size() - moved.size());
+  }
+  if (path == "/") {
+    path.clear();
+  }
+  return "/sys/fs/cgroup" + path;
+}
+
+/// The cgroup is delegated to the watcher with the memory and CPU controllers.
+static bool isCgroupDelegated(const std::string& cgroup) {
+  if (::access((cgroup + "/cgroup.procs").c_str(), W_OK) != 0 ||
+      ::access((cgroup + "/cgroup.subtree_control").c_str(), W_OK) != 0) {
+    VLOG(1) << "The cgroup " << cgroup << " is not delegated to the watcher";
+    return false;
+  }
+
+  char buffer[1024];
+  auto path = cgroup + "/cgroup.controllers";
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  auto bytes = ::read(fd, buffer, sizeof(buffer) - 1);
+  ::close(fd);
+  if (bytes <= 0) {
+    return false;
+  }
+  buffer[bytes] = '\0';
+
+  bool memory = false;
+  bool cpu = false;
+  std::istringstream controllers(buffer);
+  std::string controller;
+  while (controllers >> controller) {
+    memory = memory || controller == "memory";
+    cpu = cpu || controller == "cpu";
+  }
+  return memory && cpu;
+}
+#endif
+
+bool Watcher::throttleWorker() {
+#ifdef __linux__
+  auto cgroup = getWatcherCgroup();
+  if (cgroup.empty() || !isCgroupDelegated(cgroup)) {
+    return false;
+  }
+
+  // Only leaf cgroups may contain processes once controllers are enabled for
+  // their children. Both processes move to leaves before the controllers are
+  // enabled, enabling them over a cgroup with processes fails with EBUSY.
+  auto watcher = cgroup + "/" + kWatcherCgroup;
+  auto worker = cgroup + "/" + kWorkerCgroup;
+  ::mkdir(watcher.c_str(), 0755);
+  ::mkdir(worker.c_str(), 0755);
+  if (!writeCgroupFile(watcher + "/cgroup.procs",
+                       std::to_string(::getpid())) ||
+      !writeCgroupFile(worker + "/cgroup.procs", std::to_string(worker_)) ||
+      !writeCgroupFile(cgroup + "/cgroup.subtree_control", "+memory +cpu")) {
+    return false;
+  }
+
+  // Memory above memory.high is reclaimed and CPU use is capped per second.
+  size_t memory = (size_t)FLAGS_watchdog_memory_limit * 1024 * 1024;
+  size_t quota = (size_t)FLAGS_watchdog_utilization_limit * 1000;
+  return writeCgroupFile(worker + "/memory.high", std::to_string(memory)) &&
+         writeCgroupFile(worker + "/cpu.max",
+                         std::to_string(quota) + " 1000000");
+#else
+  return false;
+#endif
+}
+
 bool Watcher::isWorkerSane() {
-  auto rows =
-      SQL::selectAllFrom("processes", "pid", tables::EQUALS, INTEGER(worker_));
-  if (rows.size() == 0) {
+  size_t user_time = 0;
+  size_t system_time = 0;
+  size_t footprint = 0;
+  if (!sampleWorker(user_time, system_time, footprint)) {
     // Could not find worker process?
     return false;
   }
 
   // Compare CPU utilization since last check.
-  size_t user_time = AS_LITERAL(INTEGER_LITERAL, rows[0].at("user_time"));
-  size_t system_time = AS_LITERAL(INTEGER_LITERAL, rows[0].at("system_time"));
-  if (current_user_time_ + WORKER_UTILIZATION_LIMIT < user_time ||
-      current_system_time_ + WORKER_UTILIZATION_LIMIT < system_time) {
+  size_t utilization =
+      std::max(user_time - std::min(user_time, current_user_time_),
+               system_time - std::min(system_time, current_system_time_));
+  current_user_time_ = user_time;
+  current_system_time_ = system_time;
+
+  size_t utilization_limit = std::max(FLAGS_watchdog_utilization_limit, 1);
+  size_t latency_limit = std::max(FLAGS_watchdog_latency_limit, 1);
+  size_t memory_limit =
+      (size_t)std::max(FLAGS_watchdog_memory_limit, 1) * 1024 * 1024;
+  if (utilization > utilization_limit) {
     sustained_latency_++;
   } else {
     sustained_latency_ = 0;
   }
-  current_user_time_ = user_time;
-  current_system_time_ = system_time;
 
-  if (sustained_latency_ >= WORKER_LATENCY_LIMIT) {
-    LOG(WARNING) << "osqueryd worker system performance limits exceeded";
+  bool latency = (sustained_latency_ >= latency_limit);
+  bool memory = (footprint > memory_limit);
+  if (latency || memory) {
+    // A worker over its limits is first throttled, then stopped if it
+    // remains over them.
+    if (!throttled_ && FLAGS_watchdog_cgroup && throttleWorker()) {
+      LOG(WARNING) << "osqueryd worker limits exceeded, throttling worker";
+      throttled_ = true;
+      sustained_latency_ = 0;
+      return true;
+    }
+    if (throttled_ && ++throttled_checks_ < latency_limit) {
+      return true;
+    }
+    if (latency) {
+      LOG(WARNING) << "osqueryd worker system performance limits exceeded";
+    } else {
+      LOG(WARNING) << "osqueryd worker memory limits exceeded";
+    }
     return false;
   }
+  throttled_checks_ = 0;
 
-  size_t footprint = AS_LITERAL(INTEGER_LITERAL, rows[0].at("phys_footprint"));
-  if (footprint > WORKER_MEMORY_LIMIT) {
-    LOG(WARNING) << "osqueryd worker memory limits exceeded";
-    return false;
+  // A worker near its limits sheds caches and defers its queries.
+  size_t soft_percent =
+      std::min(std::max(FLAGS_watchdog_soft_percent, 1), 100);
+  if (footprint > memory_limit / 100 * soft_percent ||
+      utilization > utilization_limit * soft_percent / 100) {
+    if (sustained_pressure_++ % latency_limit == 0) {
+      VLOG(1) << "osqueryd worker is near its limits, deferring queries";
+      kill(worker_, SIGUSR1);
+    }
+  } else {
+    sustained_pressure_ = 0;
   }
 
   // The worker is sane, no action needed.
@@ -97,6 +377,7 @@ bool Watcher::createWorker() {
     ::sleep(WORKER_RESPAWN_DELAY);
   }
 
+  closeWorker();
   worker_ = fork();
   if (worker_ < 0) {
     // Unrecoverable error, cannot create a worker process.
@@ -110,17 +391,31 @@ bool Watcher::createWorker() {
 
   // This is still the watcher, reset performance monitoring.
   resetCounters();
+  openWorker();
   return false;
 }
 
 void Watcher::resetCounters() {
   sustained_latency_ = 0;
+  sustained_pressure_ = 0;
+  throttled_checks_ = 0;
+  throttled_ = false;
   current_user_time_ = 0;
   current_system_time_ = 0;
   last_respawn_time_ = getUnixTime();
 }
 
+/// The watcher signals a worker near its limits to defer its queries.
+static void workerPressureHandler(int signal) { deferScheduledQueries(); }
+
 void Watcher::initWorker() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = workerPressureHandler;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  ::sigaction(SIGUSR1, &action, nullptr);
+
   // Set the worker's process name.
   size_t name_size = strlen(argv_[0]);
   for (int i = 0; i < argc_; i++) {
@@ -132,6 +427,10 @@ void Watcher::initWorker() {
 }
 
 void initWorkerWatcher(const std::string& name, int argc, char* argv[]) {
+  // SIGUSR2 toggles the worker's profiler, the watcher must not exit on it.
+  // Workers inherit the disposition until their sampler handles it.
+  ::signal(SIGUSR2, SIG_IGN);
+
   // The watcher will forever monitor and spawn additional workers.
   Watcher watcher(argc, argv);
   watcher.setWorkerName(name);
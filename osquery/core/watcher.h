@@ -18,10 +18,13 @@ namespace osquery {
 
 class Watcher {
  public:
-  Watcher(int argc, char* argv[]) : worker_(0), argc_(argc), argv_(argv) {
+  Watcher(int argc, char* argv[])
+      : worker_(0), argc_(argc), argv_(argv), stat_fd_(-1), statm_fd_(-1) {
     resetCounters();
   }
 
+  ~Watcher() { closeWorker(); }
+
   void setWorkerName(const std::string& name) { name_ = name; }
   const std::string& getWorkerName() { return name_; }
 
@@ -38,11 +41,31 @@ class Watcher {
   bool isWorkerSane();
   /// If a worker as otherwise gone insane, stop it.
   void stopWorker();
+  /// Move the worker into a cgroup v2 limiting its memory and CPU.
+  bool throttleWorker();
   /// Reset the performance counting.
   void resetCounters();
+  /// Open the worker's process information, sampled by isWorkerSane.
+  void openWorker();
+  /// Close the worker's process information.
+  void closeWorker();
+  /**
+   * @brief Sample the worker's CPU times and memory footprint.
+   *
+   * @param user_time [output] user CPU time in milliseconds.
+   * @param system_time [output] system CPU time in milliseconds.
+   * @param footprint [output] resident memory in bytes.
+   * @return false if the worker could not be sampled.
+   */
+  bool sampleWorker(size_t& user_time, size_t& system_time, size_t& footprint);
 
  private:
   size_t sustained_latency_;
+  /// Checks the worker has been near its limits.
+  size_t sustained_pressure_;
+  /// Checks the throttled worker has remained over its limits.
+  size_t throttled_checks_;
+  bool throttled_;
   size_t current_user_time_;
   size_t current_system_time_;
   size_t last_respawn_time_;
@@ -56,6 +79,9 @@ class Watcher {
   char** argv_;
   /// When a worker child is spawned the process name will be changed.
   std::string name_;
+  /// The worker's open /proc/<pid>/stat and statm (Linux), or -1.
+  int stat_fd_;
+  int statm_fd_;
 };
 
 /**
@@ -0,0 +1,114 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <osquery/core.h>
+#include <osquery/database.h>
+
+#include "osquery/core/test_util.h"
+
+namespace osquery {
+
+const std::string kBenchmarkDBPath = "/tmp/rocksdb-osquery-benchmarks";
+
+/// Rows resembling a process table, starting at the given pid.
+static QueryData getBenchmarkRows(size_t rows, size_t start = 0) {
+  QueryData results;
+  for (size_t i = start; i < start + rows; ++i) {
+    results.push_back({{"pid", std::to_string(i)},
+                       {"name", "process_" + std::to_string(i)},
+                       {"path", "/usr/local/bin/process_" + std::to_string(i)},
+                       {"cmdline", "process --verbose --config=/etc/conf"},
+                       {"uid", "0"},
+                       {"resident_size", std::to_string(i * 4096)}});
+  }
+  return results;
+}
+
+static void BM_diff(benchmark::State& state) {
+  // One in ten rows changes between the runs.
+  size_t rows = state.range(0);
+  auto old_rows = getBenchmarkRows(rows);
+  auto new_rows = getBenchmarkRows(rows, rows / 10);
+  while (state.KeepRunning()) {
+    auto results = diff(old_rows, new_rows);
+    benchmark::DoNotOptimize(results);
+  }
+  state.SetItemsProcessed(state.iterations() * rows);
+}
+
+BENCHMARK(BM_diff)->Arg(100)->Arg(10000);
+
+static void BM_serialize_row_json(benchmark::State& state) {
+  auto row = getBenchmarkRows(1).front();
+  std::string json;
+  while (state.KeepRunning()) {
+    serializeRowJSON(row, json);
+  }
+  state.SetBytesProcessed(state.iterations() * json.size());
+}
+
+BENCHMARK(BM_serialize_row_json);
+
+static void BM_deserialize_row_json(benchmark::State& state) {
+  std::string json;
+  serializeRowJSON(getBenchmarkRows(1).front(), json);
+  while (state.KeepRunning()) {
+    Row row;
+    deserializeRowJSON(json, row);
+    benchmark::DoNotOptimize(row);
+  }
+  state.SetBytesProcessed(state.iterations() * json.size());
+}
+
+BENCHMARK(BM_deserialize_row_json);
+
+static void BM_serialize_historical_query_results_json(
+    benchmark::State& state) {
+  HistoricalQueryResults results;
+  results.mostRecentResults = {1, getBenchmarkRows(state.range(0))};
+  std::string json;
+  while (state.KeepRunning()) {
+    serializeHistoricalQueryResultsJSON(results, json);
+  }
+  state.SetBytesProcessed(state.iterations() * json.size());
+}
+
+BENCHMARK(BM_serialize_historical_query_results_json)->Arg(100)->Arg(10000);
+
+static void BM_query_add_new_results(benchmark::State& state) {
+  size_t rows = state.range(0);
+  auto query = getOsqueryScheduledQuery();
+  query.name = "benchmark_" + std::to_string(rows);
+  auto old_rows = getBenchmarkRows(rows);
+  auto new_rows = getBenchmarkRows(rows, rows / 10);
+
+  // Each run diffs against, and replaces, the stored previous run.
+  Query stored(query);
+  stored.addNewResults(old_rows, 1);
+  int unix_time = 2;
+  while (state.KeepRunning()) {
+    DiffResults results;
+    stored.addNewResults(
+        (unix_time % 2 == 0) ? new_rows : old_rows, results, unix_time++);
+  }
+  state.SetItemsProcessed(state.iterations() * rows);
+}
+
+BENCHMARK(BM_query_add_new_results)->Arg(100)->Arg(10000);
+}
+
+int main(int argc, char* argv[]) {
+  benchmark::Initialize(&argc, argv);
+  osquery::FLAGS_db_path = osquery::kBenchmarkDBPath;
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -9,17 +9,33 @@
  */
 
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
 #include <mutex>
 #include <stdexcept>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem/operations.hpp>
+
+#include <rocksdb/cache.h>
 #include <rocksdb/env.h>
+#include <rocksdb/filter_policy.h>
 #include <rocksdb/options.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_batch.h>
 
 #include <osquery/database/db_handle.h>
 #include <osquery/filesystem.h>
 #include <osquery/logger.h>
 #include <osquery/status.h>
 
+namespace fs = boost::filesystem;
+
 namespace osquery {
 
 /////////////////////////////////////////////////////////////////////////////
@@ -29,8 +45,22 @@ namespace osquery {
 const std::string kConfigurations = "configurations";
 const std::string kQueries = "queries";
 const std::string kEvents = "events";
+const std::string kQueryRows = "query_rows";
+const std::string kHashes = "hashes";
+const std::string kFileOffsets = "file_offsets";
+const std::string kLogs = "logs";
+const std::string kQueryRuns = "query_runs";
+const std::string kSnapshots = "snapshots";
 
-const std::vector<std::string> kDomains = {kConfigurations, kQueries, kEvents};
+const std::vector<std::string> kDomains = {kConfigurations,
+                                           kQueries,
+                                           kEvents,
+                                           kQueryRows,
+                                           kHashes,
+                                           kFileOffsets,
+                                           kLogs,
+                                           kQueryRuns,
+                                           kSnapshots};
 
 DEFINE_osquery_flag(string,
                     db_path,
@@ -42,6 +72,229 @@ DEFINE_osquery_flag(bool,
                     false,
                     "Keep osquery backing-store in memory.");
 
+DEFINE_osquery_flag(int32,
+                    db_memory_mb,
+                    256,
+                    "In-memory backing-store budget, events fail above it.");
+
+DEFINE_osquery_flag(string,
+                    db_checkpoint_path,
+                    "",
+                    "Save the in-memory backing-store to, restore it from.");
+
+DEFINE_osquery_flag(int32,
+                    db_checkpoint_interval,
+                    0,
+                    "Seconds between in-memory backing-store checkpoints.");
+
+DEFINE_osquery_flag(string,
+                    db_profile,
+                    "default",
+                    "RocksDB tuning: default, low_memory or high_throughput.");
+
+DEFINE_osquery_flag(int32,
+                    db_block_cache_mb,
+                    0,
+                    "RocksDB block cache shared by all domains (0 profile).");
+
+DEFINE_osquery_flag(int32,
+                    db_write_buffer_mb,
+                    0,
+                    "RocksDB memtable size of each domain (0 profile).");
+
+DEFINE_osquery_flag(int32,
+                    db_events_write_buffer_mb,
+                    0,
+                    "RocksDB memtable size of each subscriber's events.");
+
+DEFINE_osquery_flag(int32,
+                    db_max_open_files,
+                    0,
+                    "RocksDB open file limit (0 profile, -1 unlimited).");
+
+DEFINE_osquery_flag(string,
+                    db_compression,
+                    "",
+                    "RocksDB compression: none, snappy, lz4 (empty profile).");
+
+/// The RocksDB options of a db_profile, a 0 uses the RocksDB default.
+struct DBProfile {
+  size_t block_cache_mb;
+  size_t write_buffer_mb;
+  int max_write_buffers;
+  int max_open_files;
+  int background_threads;
+  rocksdb::CompressionType compression;
+};
+
+/// Laptops keep a small footprint, servers trade memory for throughput.
+const std::map<std::string, DBProfile> kDBProfiles = {
+    {"default", {0, 0, 0, 0, 0, rocksdb::kSnappyCompression}},
+    {"low_memory", {8, 1, 2, 64, 1, rocksdb::kLZ4Compression}},
+    {"high_throughput", {256, 64, 4, -1, 4, rocksdb::kLZ4Compression}},
+};
+
+const std::map<std::string, rocksdb::CompressionType> kDBCompressions = {
+    {"none", rocksdb::kNoCompression},
+    {"snappy", rocksdb::kSnappyCompression},
+    {"lz4", rocksdb::kLZ4Compression},
+};
+
+/// The bloom filter bits per key of the domains read by key.
+const int kDBBloomBits = 10;
+
+/// The virtual path of an in-memory database.
+const std::string kDBMemoryPath = "/osquery.db";
+
+/// The number of writes between checks of the in-memory database size.
+const size_t kDBMemoryCheckWrites = 256;
+
+/// The deleted keys of a range after which the range is compacted.
+const size_t kDBCompactDeletes = 4096;
+
+/// True for kEvents and the domains of each event subscriber.
+static bool isEventDomain(const std::string& domain) {
+  return domain.compare(0, kEvents.size(), kEvents) == 0 &&
+         (domain.size() == kEvents.size() || domain[kEvents.size()] == '.');
+}
+
+/**
+ * @brief Prefix extractor of event keys
+ *
+ * Event keys are "data." or "eid." followed by the event subscriber
+ * namespace, the publisher type then '.' and the subscriber name. The prefix
+ * up to and including the second '.' selects one kind of key of a publisher.
+ */
+class EventKeyPrefix : public rocksdb::SliceTransform {
+ public:
+  const char* Name() const { return "osquery.EventKeyPrefix"; }
+
+  rocksdb::Slice Transform(const rocksdb::Slice& key) const {
+    return rocksdb::Slice(key.data(), getPrefixSize(key));
+  }
+
+  bool InDomain(const rocksdb::Slice& key) const {
+    return getPrefixSize(key) > 0;
+  }
+
+  bool InRange(const rocksdb::Slice& dst) const {
+    return dst.size() > 0 && getPrefixSize(dst) == dst.size();
+  }
+
+ private:
+  static size_t getPrefixSize(const rocksdb::Slice& key) {
+    size_t separators = 0;
+    for (size_t i = 0; i < key.size(); ++i) {
+      if (key.data()[i] == '.' && ++separators == 2) {
+        return i + 1;
+      }
+    }
+    return 0;
+  }
+};
+
+/**
+ * @brief Replays a checkpoint into the domains named by its log records
+ *
+ * Domains created at runtime are created again before their keys are put.
+ */
+class CheckpointReader : public rocksdb::WriteBatch::Handler {
+ public:
+  explicit CheckpointReader(DBHandle* db) : db_(db) {}
+
+  void LogData(const rocksdb::Slice& blob) {
+    domain_ = blob.ToString();
+    if (status_.ok()) {
+      status_ = db_->createDomain(domain_);
+    }
+  }
+
+  rocksdb::Status PutCF(uint32_t,
+                        const rocksdb::Slice& key,
+                        const rocksdb::Slice& value) {
+    if (!domain_.empty()) {
+      batch_.Put(domain_, key.ToString(), value.ToString());
+    }
+    return rocksdb::Status::OK();
+  }
+
+  /// True if the checkpoint names the domain of its keys.
+  bool hasDomains() const { return !domain_.empty(); }
+
+  const DBBatch& getBatch() const { return batch_; }
+
+  const Status& getStatus() const { return status_; }
+
+ private:
+  DBHandle* db_;
+  std::string domain_;
+  DBBatch batch_;
+  Status status_;
+};
+
+/// Apply the db_profile and the flags overriding it.
+static DBProfile getDBProfile() {
+  auto profile = kDBProfiles.find(FLAGS_db_profile);
+  if (profile == kDBProfiles.end()) {
+    LOG(WARNING) << "Unknown db_profile " << FLAGS_db_profile
+                 << ", using the default profile";
+    profile = kDBProfiles.find("default");
+  }
+
+  auto options = profile->second;
+  if (FLAGS_db_block_cache_mb > 0) {
+    options.block_cache_mb = FLAGS_db_block_cache_mb;
+  }
+  if (FLAGS_db_write_buffer_mb > 0) {
+    options.write_buffer_mb = FLAGS_db_write_buffer_mb;
+  }
+  if (FLAGS_db_max_open_files != 0) {
+    options.max_open_files = FLAGS_db_max_open_files;
+  }
+  if (!FLAGS_db_compression.empty()) {
+    auto compression = kDBCompressions.find(FLAGS_db_compression);
+    if (compression != kDBCompressions.end()) {
+      options.compression = compression->second;
+    } else {
+      LOG(WARNING) << "Unknown db_compression " << FLAGS_db_compression;
+    }
+  }
+  return options;
+}
+
+/// The column family options of a domain.
+static rocksdb::ColumnFamilyOptions getColumnFamilyOptions(
+    const std::string& domain,
+    const DBProfile& profile,
+    const std::shared_ptr<rocksdb::Cache>& cache) {
+  rocksdb::ColumnFamilyOptions options;
+  options.compression = profile.compression;
+  if (profile.write_buffer_mb > 0) {
+    options.write_buffer_size = profile.write_buffer_mb * 1024 * 1024;
+  }
+  if (profile.max_write_buffers > 0) {
+    options.max_write_buffer_number = profile.max_write_buffers;
+  }
+
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.block_cache = cache;
+  if (domain != kConfigurations) {
+    // Queries, their rows and events are read by key.
+    table_options.filter_policy.reset(
+        rocksdb::NewBloomFilterPolicy(kDBBloomBits));
+  }
+  if (isEventDomain(domain)) {
+    options.prefix_extractor.reset(new EventKeyPrefix());
+    if (FLAGS_db_events_write_buffer_mb > 0) {
+      options.write_buffer_size =
+          (size_t)FLAGS_db_events_write_buffer_mb * 1024 * 1024;
+    }
+  }
+  options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+  return options;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // constructors and destructors
 /////////////////////////////////////////////////////////////////////////////
@@ -50,35 +303,89 @@ DBHandle::DBHandle(const std::string& path, bool in_memory) {
   options_.create_if_missing = true;
   options_.create_missing_column_families = true;
 
+  in_memory_ = in_memory;
+  auto profile = getDBProfile();
+  auto db_path = path;
   if (in_memory) {
-    // Remove when MemEnv is included in librocksdb
-    // options_.env = rocksdb::NewMemEnv(rocksdb::Env::Default());
-    throw std::runtime_error("Requires MemEnv");
-  }
-
-  if (pathExists(path).ok() && !isWritable(path).ok()) {
+    // Files, including the RocksDB LOG, are kept in memory.
+    env_ = rocksdb::NewMemEnv(rocksdb::Env::Default());
+    options_.env = env_;
+    db_path = kDBMemoryPath;
+    // Memtables are bounded by the budget and table blocks are not cached
+    // twice, the total size of the domains is checked on write.
+    memory_budget_ = (size_t)std::max(FLAGS_db_memory_mb, 1) * 1024 * 1024;
+    profile.write_buffer_mb = std::max(FLAGS_db_memory_mb / 16, 1);
+    profile.max_write_buffers = 2;
+    profile.block_cache_mb = 0;
+  } else if (pathExists(path).ok() && !isWritable(path).ok()) {
     throw std::runtime_error("Cannot write to RocksDB path: " + path);
   }
 
-  column_families_.push_back(rocksdb::ColumnFamilyDescriptor(
-      rocksdb::kDefaultColumnFamilyName, rocksdb::ColumnFamilyOptions()));
+  if (profile.max_open_files != 0) {
+    options_.max_open_files = profile.max_open_files;
+  }
+  if (profile.background_threads > 0) {
+    options_.IncreaseParallelism(profile.background_threads);
+  }
+  std::shared_ptr<rocksdb::Cache> cache;
+  if (profile.block_cache_mb > 0) {
+    cache = rocksdb::NewLRUCache(profile.block_cache_mb * 1024 * 1024);
+  }
 
-  for (const auto& cf_name : kDomains) {
+  // getHandleForColumnFamily returns the handle at the index of a domain in
+  // kDomains, the first domain uses the default column family. The options
+  // of each domain are applied to the column family holding its data.
+  std::vector<std::string> names = {rocksdb::kDefaultColumnFamilyName};
+  names.insert(names.end(), kDomains.begin(), kDomains.end());
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto domain = (i < kDomains.size()) ? kDomains[i] : "";
     column_families_.push_back(rocksdb::ColumnFamilyDescriptor(
-        cf_name, rocksdb::ColumnFamilyOptions()));
+        names[i], getColumnFamilyOptions(domain, profile, cache)));
+  }
+
+  // Every column family must be opened, the domains created at runtime by
+  // event subscribers follow the static domains.
+  event_options_ = getColumnFamilyOptions(kEvents, profile, cache);
+  std::vector<std::string> existing;
+  rocksdb::DB::ListColumnFamilies(options_, db_path, &existing);
+  for (const auto& name : existing) {
+    if (std::find(names.begin(), names.end(), name) == names.end()) {
+      column_families_.push_back(
+          rocksdb::ColumnFamilyDescriptor(name, event_options_));
+    }
   }
 
-  auto s = rocksdb::DB::Open(options_, path, column_families_, &handles_, &db_);
+  path_ = db_path;
+  auto s =
+      rocksdb::DB::Open(options_, db_path, column_families_, &handles_, &db_);
   if (!s.ok()) {
     throw std::runtime_error(s.ToString());
   }
+  // The handles of the static domains are fixed once opened, those of the
+  // runtime domains are only kept in domains_, under domains_mutex_.
+  for (size_t i = names.size(); i < handles_.size(); ++i) {
+    domains_[column_families_[i].name] = handles_[i];
+  }
+  handles_.resize(std::min(handles_.size(), names.size()));
+
+  if (in_memory && !FLAGS_db_checkpoint_path.empty()) {
+    auto status = restoreCheckpoint(FLAGS_db_checkpoint_path);
+    if (!status.ok()) {
+      LOG(WARNING) << "Cannot restore backing-store checkpoint: "
+                   << status.toString();
+    }
+  }
 }
 
 DBHandle::~DBHandle() {
   for (auto handle : handles_) {
     delete handle;
   }
+  for (auto& domain : domains_) {
+    delete domain.second;
+  }
   delete db_;
+  delete env_;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -120,22 +427,92 @@ rocksdb::ColumnFamilyHandle* DBHandle::getHandleForColumnFamily(
   } catch (const std::exception& e) {
     // pass through and return nullptr
   }
-  return nullptr;
+
+  std::lock_guard<std::mutex> lock(domains_mutex_);
+  auto domain = domains_.find(cf);
+  return (domain != domains_.end()) ? domain->second : nullptr;
+}
+
+/**
+ * @brief Map a RocksDB status to an osquery status code.
+ *
+ * RocksDB codes overlap the osquery codes, a missing key is STATUS_NOT_FOUND
+ * and every other failure is STATUS_DB_ERROR. Successful operations return
+ * a status without a message copy.
+ */
+static Status toStatus(const rocksdb::Status& s) {
+  if (s.ok()) {
+    return Status();
+  } else if (s.IsNotFound()) {
+    return Status(STATUS_NOT_FOUND, s.ToString());
+  }
+  return Status(STATUS_DB_ERROR, s.ToString());
+}
+
+osquery::Status DBHandle::createDomain(const std::string& domain) {
+  if (getHandleForColumnFamily(domain) != nullptr) {
+    return Status(0, "OK");
+  }
+
+  std::lock_guard<std::mutex> lock(domains_mutex_);
+  if (domains_.count(domain) > 0) {
+    return Status(0, "OK");
+  }
+  rocksdb::ColumnFamilyHandle* handle = nullptr;
+  auto s = getDB()->CreateColumnFamily(event_options_, domain, &handle);
+  if (!s.ok()) {
+    return toStatus(s);
+  }
+  domains_[domain] = handle;
+  return Status(0, "OK");
 }
 
 /////////////////////////////////////////////////////////////////////////////
 // Data manipulation methods
 /////////////////////////////////////////////////////////////////////////////
 
+/// The read options of a read from an optional snapshot.
+static rocksdb::ReadOptions getReadOptions(const DBSnapshotRef& snapshot) {
+  rocksdb::ReadOptions options;
+  if (snapshot != nullptr) {
+    options.snapshot = snapshot->getSnapshot();
+  }
+  return options;
+}
+
+DBSnapshotRef DBHandle::getSnapshot() {
+  return DBSnapshotRef(new DBSnapshot(getDB()));
+}
+
 osquery::Status DBHandle::Get(const std::string& domain,
                               const std::string& key,
-                              std::string& value) {
+                              std::string& value,
+                              const DBSnapshotRef& snapshot) {
   auto cfh = getHandleForColumnFamily(domain);
   if (cfh == nullptr) {
     return Status(1, "Could not get column family for " + domain);
   }
-  auto s = getDB()->Get(rocksdb::ReadOptions(), cfh, key, &value);
-  return Status(s.code(), s.ToString());
+  auto s = getDB()->Get(getReadOptions(snapshot), cfh, key, &value);
+  return toStatus(s);
+}
+
+bool DBHandle::Exists(const std::string& domain,
+                      const std::string& key,
+                      const DBSnapshotRef& snapshot) {
+  auto cfh = getHandleForColumnFamily(domain);
+  if (cfh == nullptr) {
+    return false;
+  }
+
+  std::string value;
+  bool value_found = false;
+  auto options = getReadOptions(snapshot);
+  if (!getDB()->KeyMayExist(options, cfh, key, &value, &value_found)) {
+    return false;
+  } else if (value_found) {
+    return true;
+  }
+  return getDB()->Get(options, cfh, key, &value).ok();
 }
 
 osquery::Status DBHandle::Put(const std::string& domain,
@@ -145,8 +522,11 @@ osquery::Status DBHandle::Put(const std::string& domain,
   if (cfh == nullptr) {
     return Status(1, "Could not get column family for " + domain);
   }
+  if (isEventDomain(domain) && isFull()) {
+    return Status(1, "In-memory backing-store budget exceeded");
+  }
   auto s = getDB()->Put(rocksdb::WriteOptions(), cfh, key, value);
-  return Status(s.code(), s.ToString());
+  return toStatus(s);
 }
 
 osquery::Status DBHandle::Delete(const std::string& domain,
@@ -156,23 +536,323 @@ osquery::Status DBHandle::Delete(const std::string& domain,
     return Status(1, "Could not get column family for " + domain);
   }
   auto s = getDB()->Delete(rocksdb::WriteOptions(), cfh, key);
-  return Status(s.code(), s.ToString());
+  return toStatus(s);
+}
+
+void DBBatch::Put(const std::string& domain,
+                  const std::string& key,
+                  const std::string& value) {
+  operations_.push_back({domain, key, value, false});
+}
+
+void DBBatch::Delete(const std::string& domain, const std::string& key) {
+  operations_.push_back({domain, key, "", true});
+}
+
+osquery::Status DBHandle::Write(const DBBatch& batch) {
+  rocksdb::WriteBatch write_batch;
+  bool checked = false;
+  for (const auto& operation : batch.operations_) {
+    auto cfh = getHandleForColumnFamily(operation.domain);
+    if (cfh == nullptr) {
+      return Status(1, "Could not get column family for " + operation.domain);
+    }
+    if (isEventDomain(operation.domain) && !operation.remove && !checked) {
+      if (isFull()) {
+        return Status(1, "In-memory backing-store budget exceeded");
+      }
+      checked = true;
+    }
+    if (operation.remove) {
+      write_batch.Delete(cfh, operation.key);
+    } else {
+      write_batch.Put(cfh, operation.key, operation.value);
+    }
+  }
+  auto s = getDB()->Write(rocksdb::WriteOptions(), &write_batch);
+  return toStatus(s);
 }
 
 osquery::Status DBHandle::Scan(const std::string& domain,
                                std::vector<std::string>& results) {
+  return Scan(domain,
+              "",
+              [&results](const rocksdb::Slice& key, const rocksdb::Slice&) {
+                results.push_back(key.ToString());
+                return true;
+              });
+}
+
+osquery::Status DBHandle::Scan(const std::string& domain,
+                               const std::string& prefix,
+                               const DBScanCallback& callback,
+                               const DBSnapshotRef& snapshot) {
   auto cfh = getHandleForColumnFamily(domain);
   if (cfh == nullptr) {
     return Status(1, "Could not get column family for " + domain);
   }
-  auto it = getDB()->NewIterator(rocksdb::ReadOptions(), cfh);
+  // Prefixes may be shorter or longer than the event domain key prefixes.
+  auto options = getReadOptions(snapshot);
+  options.total_order_seek = true;
+  auto it = getDB()->NewIterator(options, cfh);
   if (it == nullptr) {
     return Status(1, "Could not get iterator for " + domain);
   }
-  for (it->SeekToFirst(); it->Valid(); it->Next()) {
-    results.push_back(it->key().ToString());
+  for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+       it->Next()) {
+    if (!callback(it->key(), it->value())) {
+      break;
+    }
   }
+  auto s = it->status();
   delete it;
+  return toStatus(s);
+}
+
+osquery::Status DBHandle::ScanRange(const std::string& domain,
+                                    const std::string& start,
+                                    const std::string& stop,
+                                    const DBScanCallback& callback,
+                                    const DBSnapshotRef& snapshot) {
+  auto cfh = getHandleForColumnFamily(domain);
+  if (cfh == nullptr) {
+    return Status(1, "Could not get column family for " + domain);
+  }
+  auto options = getReadOptions(snapshot);
+  options.total_order_seek = true;
+  auto it = getDB()->NewIterator(options, cfh);
+  if (it == nullptr) {
+    return Status(1, "Could not get iterator for " + domain);
+  }
+  for (it->Seek(start); it->Valid(); it->Next()) {
+    if (!stop.empty() && it->key().compare(stop) >= 0) {
+      break;
+    }
+    if (!callback(it->key(), it->value())) {
+      break;
+    }
+  }
+  auto s = it->status();
+  delete it;
+  return toStatus(s);
+}
+
+osquery::Status DBHandle::DeleteRange(const std::string& domain,
+                                      const std::string& start,
+                                      const std::string& stop) {
+  auto cfh = getHandleForColumnFamily(domain);
+  if (cfh == nullptr) {
+    return Status(1, "Could not get column family for " + domain);
+  }
+
+  // Table files holding only keys of the range are dropped without reading
+  // them. RocksDB refuses files which may hide older values of their keys,
+  // the keys of those files are deleted as the rest of the range.
+  std::vector<rocksdb::LiveFileMetaData> files;
+  getDB()->GetLiveFilesMetaData(&files);
+  for (const auto& file : files) {
+    if (file.column_family_name == domain && file.smallestkey >= start &&
+        (stop.empty() || file.largestkey < stop)) {
+      auto s = getDB()->DeleteFile(file.name);
+      if (!s.ok()) {
+        VLOG(1) << "Cannot drop table file " << file.name << " of " << domain
+                << ", its keys are deleted instead: " << s.ToString();
+      }
+    }
+  }
+
+  DBBatch batch;
+  auto status = ScanRange(
+      domain,
+      start,
+      stop,
+      [&batch, &domain](const rocksdb::Slice& key, const rocksdb::Slice&) {
+        batch.Delete(domain, key.ToString());
+        return true;
+      });
+  if (!status.ok() || batch.size() == 0) {
+    return status;
+  }
+  status = Write(batch);
+  if (status.ok() && batch.size() >= kDBCompactDeletes) {
+    // Reclaim the deleted keys now, the range is not written again.
+    rocksdb::Slice begin(start);
+    rocksdb::Slice end(stop);
+    getDB()->CompactRange(cfh, &begin, (stop.empty()) ? nullptr : &end);
+  }
+  return status;
+}
+
+size_t DBHandle::getMemoryUsage() {
+  return getIntProperty("rocksdb.cur-size-all-mem-tables") +
+         getIntProperty("rocksdb.total-sst-files-size");
+}
+
+size_t DBHandle::getIntProperty(const std::string& property) {
+  size_t sum = 0;
+  std::vector<rocksdb::ColumnFamilyHandle*> handles = handles_;
+  {
+    std::lock_guard<std::mutex> lock(domains_mutex_);
+    for (const auto& domain : domains_) {
+      handles.push_back(domain.second);
+    }
+  }
+  for (auto handle : handles) {
+    std::string value;
+    if (getDB()->GetProperty(handle, property, &value)) {
+      sum += std::strtoull(value.c_str(), nullptr, 10);
+    }
+  }
+  return sum;
+}
+
+size_t DBHandle::getDiskUsage() {
+  if (in_memory_) {
+    return 0;
+  }
+
+  size_t size = 0;
+  boost::system::error_code ec;
+  fs::recursive_directory_iterator it(path_, ec), end;
+  for (; !ec && it != end; it.increment(ec)) {
+    if (fs::is_regular_file(it->path(), ec)) {
+      size += fs::file_size(it->path(), ec);
+    }
+  }
+  return size;
+}
+
+bool DBHandle::isFull() {
+  if (!in_memory_) {
+    return false;
+  }
+  // The size is checked periodically, deleting expired events frees memory.
+  if (writes_++ % kDBMemoryCheckWrites == 0) {
+    full_ = (getMemoryUsage() > memory_budget_);
+    if (full_) {
+      LOG(WARNING) << "In-memory backing-store budget of " << FLAGS_db_memory_mb
+                   << "MB exceeded, dropping events";
+    }
+  }
+  return full_;
+}
+
+/**
+ * @brief Write a checkpoint's content to a new file, durably.
+ *
+ * A file left by an interrupted checkpoint is replaced rather than appended
+ * to, and the content is synced before the file is renamed over the last
+ * checkpoint.
+ */
+static Status writeCheckpointFile(const std::string& path,
+                                  const std::string& content) {
+  ::unlink(path.c_str());
+  int fd = ::open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return Status(1, "Cannot create backing-store checkpoint: " + path);
+  }
+
+  const char* data = content.data();
+  size_t size = content.size();
+  while (size > 0) {
+    auto written = ::write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    } else if (written <= 0) {
+      ::close(fd);
+      return Status(1, "Cannot write backing-store checkpoint: " + path);
+    }
+    data += written;
+    size -= written;
+  }
+
+  auto synced = (::fsync(fd) == 0);
+  ::close(fd);
+  if (!synced) {
+    return Status(1, "Cannot sync backing-store checkpoint: " + path);
+  }
   return Status(0, "OK");
 }
+
+osquery::Status DBHandle::Checkpoint() {
+  if (FLAGS_db_checkpoint_path.empty()) {
+    return Status(1, "No backing-store checkpoint path");
+  }
+  return Checkpoint(FLAGS_db_checkpoint_path);
+}
+
+osquery::Status DBHandle::Checkpoint(const std::string& path) {
+  std::vector<std::pair<std::string, rocksdb::ColumnFamilyHandle*> > domains;
+  for (size_t i = 0; i < kDomains.size(); ++i) {
+    domains.push_back(std::make_pair(kDomains[i], handles_[i]));
+  }
+  {
+    std::lock_guard<std::mutex> lock(domains_mutex_);
+    domains.insert(domains.end(), domains_.begin(), domains_.end());
+  }
+
+  // A checkpoint is a write batch of every key, replayed on restore. The
+  // keys of each domain follow a log record of the domain's name, the
+  // column family IDs of domains created at runtime are not restored.
+  rocksdb::WriteBatch write_batch;
+  auto snapshot = getSnapshot();
+  auto options = getReadOptions(snapshot);
+  options.total_order_seek = true;
+  options.fill_cache = false;
+  rocksdb::Status s;
+  for (const auto& domain : domains) {
+    auto it = getDB()->NewIterator(options, domain.second);
+    if (it == nullptr) {
+      s = rocksdb::Status::IOError("Could not get iterator for " +
+                                   domain.first);
+      break;
+    }
+    write_batch.PutLogData(domain.first);
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      write_batch.Put(domain.second, it->key(), it->value());
+    }
+    s = it->status();
+    delete it;
+    if (!s.ok()) {
+      break;
+    }
+  }
+  if (!s.ok()) {
+    return toStatus(s);
+  }
+
+  // Replace the previous checkpoint only once the new one is complete.
+  auto status = writeCheckpointFile(path + ".tmp", write_batch.Data());
+  if (!status.ok()) {
+    return status;
+  }
+  if (std::rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+    return Status(1, "Cannot replace backing-store checkpoint: " + path);
+  }
+  return Status(0, "OK");
+}
+
+osquery::Status DBHandle::restoreCheckpoint(const std::string& path) {
+  if (!pathExists(path).ok()) {
+    return Status(0, "OK");
+  }
+
+  std::string content;
+  auto status = readFile(path, content);
+  if (!status.ok()) {
+    return status;
+  }
+  rocksdb::WriteBatch write_batch(content);
+  CheckpointReader reader(this);
+  auto s = write_batch.Iterate(&reader);
+  if (!s.ok()) {
+    return toStatus(s);
+  } else if (!reader.hasDomains()) {
+    // Checkpoints without domain records hold only the static domains.
+    s = getDB()->Write(rocksdb::WriteOptions(), &write_batch);
+    return toStatus(s);
+  }
+  return reader.getStatus().ok() ? Write(reader.getBatch())
+                                 : reader.getStatus();
+}
 }
@@ -15,6 +15,7 @@
 #include <gtest/gtest.h>
 
 #include <osquery/database/db_handle.h>
+#include <osquery/filesystem.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
@@ -32,6 +33,15 @@ class DBHandleTests : public testing::Test {
         DBHandle::getInstance()->getHandleForColumnFamily("foobartest");
   }
 
+  /// Create a separate in-memory database, restoring db_checkpoint_path.
+  std::shared_ptr<DBHandle> getInMemoryHandle(size_t budget = 0) {
+    auto handle = std::shared_ptr<DBHandle>(new DBHandle("", true));
+    if (budget > 0) {
+      handle->memory_budget_ = budget;
+    }
+    return handle;
+  }
+
  public:
   rocksdb::ColumnFamilyHandle* cfh_queries;
   rocksdb::ColumnFamilyHandle* cfh_foobar;
@@ -58,6 +68,11 @@ TEST_F(DBHandleTests, test_get) {
   EXPECT_TRUE(s.ok());
   EXPECT_EQ(s.toString(), "OK");
   EXPECT_EQ(r, "{}");
+
+  // A missing key is not found, rather than a backing store failure.
+  s = db->Get(kQueries, "test_query_missing", r);
+  EXPECT_FALSE(s.ok());
+  EXPECT_EQ(s.getCode(), STATUS_NOT_FOUND);
 }
 
 TEST_F(DBHandleTests, test_put) {
@@ -73,6 +88,44 @@ TEST_F(DBHandleTests, test_delete) {
   EXPECT_EQ(s.toString(), "OK");
 }
 
+TEST_F(DBHandleTests, test_exists) {
+  db->Put(kQueries, "test_exists", "baz");
+  EXPECT_TRUE(db->Exists(kQueries, "test_exists"));
+  EXPECT_FALSE(db->Exists(kQueries, "test_exists_not"));
+  EXPECT_FALSE(db->Exists("foobar", "test_exists"));
+
+  db->Delete(kQueries, "test_exists");
+  EXPECT_FALSE(db->Exists(kQueries, "test_exists"));
+}
+
+TEST_F(DBHandleTests, test_write_batch) {
+  db->Put(kQueries, "test_write_batch_old", "baz");
+
+  DBBatch batch;
+  batch.Put(kQueries, "test_write_batch_new", "foo");
+  batch.Put(kEvents, "test_write_batch_new", "bar");
+  batch.Delete(kQueries, "test_write_batch_old");
+  EXPECT_EQ(batch.size(), 3U);
+  // Nothing is written until the batch is.
+  EXPECT_FALSE(db->Exists(kQueries, "test_write_batch_new"));
+
+  auto s = db->Write(batch);
+  EXPECT_TRUE(s.ok());
+  std::string r;
+  db->Get(kQueries, "test_write_batch_new", r);
+  EXPECT_EQ(r, "foo");
+  db->Get(kEvents, "test_write_batch_new", r);
+  EXPECT_EQ(r, "bar");
+  EXPECT_FALSE(db->Exists(kQueries, "test_write_batch_old"));
+
+  // A batch naming an unknown domain writes nothing.
+  DBBatch bad_batch;
+  bad_batch.Put(kQueries, "test_write_batch_bad", "foo");
+  bad_batch.Put("foobar", "test_write_batch_bad", "foo");
+  EXPECT_FALSE(db->Write(bad_batch).ok());
+  EXPECT_FALSE(db->Exists(kQueries, "test_write_batch_bad"));
+}
+
 TEST_F(DBHandleTests, test_scan) {
   db->Put(kQueries, "test_scan_foo1", "baz");
   db->Put(kQueries, "test_scan_foo2", "baz");
@@ -87,6 +140,179 @@ TEST_F(DBHandleTests, test_scan) {
     EXPECT_NE(std::find(keys.begin(), keys.end(), i), keys.end());
   }
 }
+
+TEST_F(DBHandleTests, test_scan_prefix) {
+  db->Put(kQueries, "test_scan_prefix.2", "b");
+  db->Put(kQueries, "test_scan_prefix.1", "a");
+  db->Put(kQueries, "test_scan_prefixed", "c");
+  db->Put(kQueries, "test_scan_prefiw", "d");
+
+  std::vector<std::pair<std::string, std::string> > results;
+  auto s = db->Scan(
+      kQueries,
+      "test_scan_prefix.",
+      [&results](const rocksdb::Slice& key, const rocksdb::Slice& value) {
+        results.push_back(std::make_pair(key.ToString(), value.ToString()));
+        return true;
+      });
+  EXPECT_TRUE(s.ok());
+  ASSERT_EQ(results.size(), 2U);
+  EXPECT_EQ(results[0].first, "test_scan_prefix.1");
+  EXPECT_EQ(results[0].second, "a");
+  EXPECT_EQ(results[1].first, "test_scan_prefix.2");
+  EXPECT_EQ(results[1].second, "b");
+
+  // The callback stops the scan.
+  size_t visited = 0;
+  s = db->Scan(kQueries,
+               "test_scan_prefix",
+               [&visited](const rocksdb::Slice&, const rocksdb::Slice&) {
+                 visited++;
+                 return false;
+               });
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(visited, 1U);
+
+  s = db->Scan(kQueries,
+               "",
+               [](const rocksdb::Slice&, const rocksdb::Slice&) {
+                 return true;
+               });
+  EXPECT_TRUE(s.ok());
+  EXPECT_FALSE(db->Scan("foobar",
+                        "",
+                        [](const rocksdb::Slice&, const rocksdb::Slice&) {
+                          return true;
+                        }).ok());
+}
+
+TEST_F(DBHandleTests, test_scan_range) {
+  db->Put(kEvents, "data.test_scan_range.01", "a");
+  db->Put(kEvents, "data.test_scan_range.02", "b");
+  db->Put(kEvents, "data.test_scan_range.03", "c");
+  db->Put(kEvents, "data.test_scan_range.04", "d");
+
+  std::vector<std::string> values;
+  auto callback = [&values](const rocksdb::Slice&,
+                            const rocksdb::Slice& value) {
+    values.push_back(value.ToString());
+    return true;
+  };
+  auto s = db->ScanRange(kEvents,
+                         "data.test_scan_range.02",
+                         "data.test_scan_range.04",
+                         callback);
+  EXPECT_TRUE(s.ok());
+  std::vector<std::string> expected = {"b", "c"};
+  EXPECT_EQ(values, expected);
+
+  // An empty stop reads to the end of the domain.
+  values.clear();
+  s = db->ScanRange(kEvents, "data.test_scan_range.03", "", callback);
+  EXPECT_TRUE(s.ok());
+  ASSERT_GE(values.size(), 2U);
+  EXPECT_EQ(values[0], "c");
+  EXPECT_EQ(values[1], "d");
+}
+
+TEST_F(DBHandleTests, test_snapshot) {
+  db->Put(kQueries, "test_snapshot", "foo");
+  db->Put(kEvents, "data.test_snapshot.01", "a");
+  auto snapshot = db->getSnapshot();
+  db->Put(kQueries, "test_snapshot", "bar");
+  db->Put(kEvents, "data.test_snapshot.02", "b");
+  db->Delete(kEvents, "data.test_snapshot.01");
+
+  // Reads from the snapshot do not see the later writes.
+  std::string r;
+  EXPECT_TRUE(db->Get(kQueries, "test_snapshot", r, snapshot).ok());
+  EXPECT_EQ(r, "foo");
+  EXPECT_TRUE(db->Exists(kEvents, "data.test_snapshot.01", snapshot));
+  EXPECT_FALSE(db->Exists(kEvents, "data.test_snapshot.02", snapshot));
+  std::vector<std::string> values;
+  auto callback = [&values](const rocksdb::Slice&,
+                            const rocksdb::Slice& value) {
+    values.push_back(value.ToString());
+    return true;
+  };
+  auto s = db->Scan(kEvents, "data.test_snapshot.", callback, snapshot);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(values, std::vector<std::string>({"a"}));
+
+  values.clear();
+  EXPECT_TRUE(db->Scan(kEvents, "data.test_snapshot.", callback).ok());
+  EXPECT_EQ(values, std::vector<std::string>({"b"}));
+  EXPECT_TRUE(db->Get(kQueries, "test_snapshot", r).ok());
+  EXPECT_EQ(r, "bar");
+}
+
+TEST_F(DBHandleTests, test_create_domain) {
+  auto domain = kEvents + ".test_create_domain";
+  EXPECT_FALSE(db->Put(domain, "data.test/01", "a").ok());
+  EXPECT_TRUE(db->createDomain(domain).ok());
+  EXPECT_TRUE(db->createDomain(domain).ok());
+
+  EXPECT_TRUE(db->Put(domain, "data.test/01", "a").ok());
+  EXPECT_TRUE(db->Put(domain, "data.test/02", "b").ok());
+  EXPECT_TRUE(db->Put(domain, "data.test/03", "c").ok());
+  EXPECT_FALSE(db->Exists(kEvents, "data.test/01"));
+
+  // The range end is exclusive.
+  EXPECT_TRUE(db->DeleteRange(domain, "data.test/01", "data.test/03").ok());
+  EXPECT_FALSE(db->Exists(domain, "data.test/01"));
+  EXPECT_FALSE(db->Exists(domain, "data.test/02"));
+  EXPECT_TRUE(db->Exists(domain, "data.test/03"));
+  EXPECT_TRUE(db->DeleteRange(domain, "data.test/", "").ok());
+  EXPECT_FALSE(db->Exists(domain, "data.test/03"));
+}
+
+TEST_F(DBHandleTests, test_in_memory_checkpoint) {
+  auto checkpoint = kTestingDBHandlePath + ".checkpoint";
+  auto memory = getInMemoryHandle();
+  memory->Put(kQueries, "test_in_memory", "foo");
+  memory->Put(kEvents, "test_in_memory", "bar");
+  auto domain = kEvents + ".test_in_memory";
+  EXPECT_TRUE(memory->createDomain(domain).ok());
+  memory->Put(domain, "test_in_memory", "baz");
+  EXPECT_FALSE(db->Exists(kQueries, "test_in_memory"));
+  // A file left by an interrupted checkpoint is replaced, not appended to.
+  writeTextFile(checkpoint + ".tmp", std::string(4096, 'x'), 0600, true);
+  EXPECT_TRUE(memory->Checkpoint(checkpoint).ok());
+  EXPECT_FALSE(pathExists(checkpoint + ".tmp").ok());
+
+  // A new in-memory database restores the checkpoint.
+  FLAGS_db_checkpoint_path = checkpoint;
+  auto restored = getInMemoryHandle();
+  FLAGS_db_checkpoint_path = "";
+  std::string r;
+  EXPECT_TRUE(restored->Get(kQueries, "test_in_memory", r).ok());
+  EXPECT_EQ(r, "foo");
+  EXPECT_TRUE(restored->Get(kEvents, "test_in_memory", r).ok());
+  EXPECT_EQ(r, "bar");
+  // Domains created at runtime are created again.
+  EXPECT_TRUE(restored->Get(domain, "test_in_memory", r).ok());
+  EXPECT_EQ(r, "baz");
+  boost::filesystem::remove(checkpoint);
+}
+
+TEST_F(DBHandleTests, test_in_memory_budget) {
+  auto memory = getInMemoryHandle(1);
+  EXPECT_TRUE(memory->Put(kQueries, "test_in_memory_budget", "foo").ok());
+  EXPECT_GT(memory->getMemoryUsage(), 1U);
+  // Events are dropped above the budget, query results are still stored.
+  EXPECT_FALSE(memory->Put(kEvents, "test_in_memory_budget", "bar").ok());
+  EXPECT_TRUE(memory->Put(kQueries, "test_in_memory_budget", "bar").ok());
+
+  // The on-disk database has no budget.
+  EXPECT_TRUE(db->Put(kEvents, "test_in_memory_budget", "bar").ok());
+}
+
+TEST_F(DBHandleTests, test_disk_usage) {
+  // The files of the on-disk database include at least its write-ahead log.
+  EXPECT_TRUE(db->Put(kQueries, "test_disk_usage", "foo").ok());
+  EXPECT_GT(db->getDiskUsage(), 0U);
+  EXPECT_EQ(getInMemoryHandle()->getDiskUsage(), 0U);
+}
 }
 
 int main(int argc, char* argv[]) {
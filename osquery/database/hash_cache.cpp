@@ -0,0 +1,221 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <osquery/database/db_handle.h>
+#include <osquery/database/hash_cache.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+
+namespace osquery {
+
+DEFINE_osquery_flag(bool,
+                    hash_cache,
+                    true,
+                    "Cache file hashes by inode, size, and times.");
+
+DEFINE_osquery_flag(int32,
+                    hash_cache_max,
+                    20000,
+                    "Most files with cached hashes, 0 is unbounded.");
+
+/**
+ * @brief The cached files, most recently hashed first.
+ *
+ * The keys of the hashes domain are read once, as the least recently used,
+ * such that entries cached by a previous run are evicted first.
+ */
+class HashCacheIndex {
+ public:
+  static HashCacheIndex& getInstance() {
+    static HashCacheIndex index;
+    return index;
+  }
+
+  /// Mark a file's key as used, removing the least recently used entries.
+  void touch(DBHandle& db, const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!loaded_) {
+      std::vector<std::string> keys;
+      db.Scan(kHashes, keys);
+      for (const auto& cached : keys) {
+        if (keys_.count(cached) == 0) {
+          order_.push_back(cached);
+          keys_[cached] = std::prev(order_.end());
+        }
+      }
+      loaded_ = true;
+    }
+
+    auto it = keys_.find(key);
+    if (it != keys_.end()) {
+      order_.splice(order_.begin(), order_, it->second);
+    } else {
+      order_.push_front(key);
+      keys_[key] = order_.begin();
+    }
+
+    auto max = static_cast<size_t>(std::max(FLAGS_hash_cache_max, 0));
+    while (max > 0 && order_.size() > max) {
+      db.Delete(kHashes, order_.back());
+      keys_.erase(order_.back());
+      order_.pop_back();
+    }
+  }
+
+ private:
+  HashCacheIndex() : loaded_(false) {}
+
+ private:
+  std::list<std::string> order_;
+  std::unordered_map<std::string, std::list<std::string>::iterator> keys_;
+  bool loaded_;
+  std::mutex mutex_;
+};
+
+/// The identity of a file's content: size, mtime, and ctime.
+static std::string getHashIdentity(const struct stat& file) {
+  std::stringstream identity;
+  identity << file.st_size << ":";
+#ifdef __APPLE__
+  identity << file.st_mtimespec.tv_sec << "." << file.st_mtimespec.tv_nsec
+           << ":" << file.st_ctimespec.tv_sec << "."
+           << file.st_ctimespec.tv_nsec;
+#else
+  identity << file.st_mtim.tv_sec << "." << file.st_mtim.tv_nsec << ":"
+           << file.st_ctim.tv_sec << "." << file.st_ctim.tv_nsec;
+#endif
+  return identity.str();
+}
+
+/// The hash cache key of a file, its device and inode.
+static std::string getHashKey(const struct stat& file) {
+  return std::to_string(file.st_dev) + "." + std::to_string(file.st_ino);
+}
+
+/// Split a cached value, "identity,md5,sha1,sha256", digests may be empty.
+static std::string parseCachedHashes(const std::string& value,
+                                     MultiHashes& cached) {
+  std::stringstream stream(value);
+  std::string identity;
+  std::getline(stream, identity, ',');
+  std::getline(stream, cached.md5, ',');
+  std::getline(stream, cached.sha1, ',');
+  std::getline(stream, cached.sha256, ',');
+  return identity;
+}
+
+MultiHashes getCachedHashes(int mask, const std::string& path) {
+  MultiHashes cached;
+  cached.mask = mask;
+  struct stat file;
+  if (!FLAGS_hash_cache || ::stat(path.c_str(), &file) != 0 ||
+      !S_ISREG(file.st_mode)) {
+    return cached;
+  }
+
+  std::string value;
+  try {
+    auto db = DBHandle::getInstance();
+    if (!db->Get(kHashes, getHashKey(file), value).ok()) {
+      return cached;
+    }
+    HashCacheIndex::getInstance().touch(*db, getHashKey(file));
+  } catch (const std::runtime_error& e) {
+    return cached;
+  }
+
+  parseCachedHashes(value, cached);
+  cached.md5 = (mask & HASH_TYPE_MD5) ? cached.md5 : "";
+  cached.sha1 = (mask & HASH_TYPE_SHA1) ? cached.sha1 : "";
+  cached.sha256 = (mask & HASH_TYPE_SHA256) ? cached.sha256 : "";
+  return cached;
+}
+
+MultiHashes hashMultiFromFileCached(int mask, const std::string& path) {
+  FileHasher hasher;
+  return hashMultiFromFileCached(hasher, mask, path);
+}
+
+MultiHashes hashMultiFromFileCached(FileHasher& hasher,
+                                    int mask,
+                                    const std::string& path) {
+  struct stat file;
+  if (!FLAGS_hash_cache || ::stat(path.c_str(), &file) != 0 ||
+      !S_ISREG(file.st_mode)) {
+    return hasher.hash(mask, path);
+  }
+
+  std::shared_ptr<DBHandle> db;
+  try {
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    return hasher.hash(mask, path);
+  }
+
+  // Cached digests are reused while the file's identity is unchanged.
+  auto key = getHashKey(file);
+  auto identity = getHashIdentity(file);
+  MultiHashes cached;
+  std::string value;
+  bool hit = db->Get(kHashes, key, value).ok();
+  if (hit && parseCachedHashes(value, cached) != identity) {
+    cached = MultiHashes();
+  }
+
+  // Only the digests missing from the cache are computed.
+  int missing = mask;
+  missing &= cached.md5.empty() ? ~0 : ~HASH_TYPE_MD5;
+  missing &= cached.sha1.empty() ? ~0 : ~HASH_TYPE_SHA1;
+  missing &= cached.sha256.empty() ? ~0 : ~HASH_TYPE_SHA256;
+  if (missing != 0) {
+    auto hashes = hasher.hash(missing, path);
+    if (missing & HASH_TYPE_MD5) {
+      cached.md5 = hashes.md5;
+    }
+    if (missing & HASH_TYPE_SHA1) {
+      cached.sha1 = hashes.sha1;
+    }
+    if (missing & HASH_TYPE_SHA256) {
+      cached.sha256 = hashes.sha256;
+    }
+
+    // The file may have changed while it was read.
+    struct stat after;
+    if (::stat(path.c_str(), &after) == 0 &&
+        getHashIdentity(after) == identity) {
+      db->Put(kHashes,
+              key,
+              identity + "," + cached.md5 + "," + cached.sha1 + "," +
+                  cached.sha256);
+      hit = true;
+    }
+  }
+  if (hit) {
+    HashCacheIndex::getInstance().touch(*db, key);
+  }
+
+  // Return only the requested digests.
+  cached.mask = mask;
+  cached.md5 = (mask & HASH_TYPE_MD5) ? cached.md5 : "";
+  cached.sha1 = (mask & HASH_TYPE_SHA1) ? cached.sha1 : "";
+  cached.sha256 = (mask & HASH_TYPE_SHA256) ? cached.sha256 : "";
+  return cached;
+}
+}
@@ -0,0 +1,93 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <boost/filesystem.hpp>
+
+#include <gtest/gtest.h>
+
+#include <osquery/core.h>
+#include <osquery/database/db_handle.h>
+#include <osquery/database/hash_cache.h>
+#include <osquery/filesystem.h>
+#include <osquery/flags.h>
+
+namespace osquery {
+
+DECLARE_int32(hash_cache_max);
+
+const std::string kTestingHashCacheDBPath = "/tmp/rocksdb-osquery-hashcache";
+
+class HashCacheTests : public testing::Test {
+ public:
+  void SetUp() { DBHandle::getInstanceAtPath(kTestingHashCacheDBPath); }
+};
+
+TEST_F(HashCacheTests, test_cached_file_hashing) {
+  std::string path = "/tmp/osquery-hash-cache-test.txt";
+  boost::filesystem::remove(path);
+  writeTextFile(path, "0");
+
+  // The first hash of a file is cached.
+  auto hashes = hashMultiFromFileCached(HASH_TYPE_MD5, path);
+  EXPECT_EQ(hashes.md5, "cfcd208495d565ef66e7dff9f98764da");
+  std::vector<std::string> keys;
+  DBHandle::getInstance()->Scan(kHashes, keys);
+  EXPECT_GE(keys.size(), 1U);
+
+  // Other digests are added to the cached digests.
+  hashes = hashMultiFromFileCached(HASH_TYPE_MD5 | HASH_TYPE_SHA1, path);
+  EXPECT_EQ(hashes.md5, "cfcd208495d565ef66e7dff9f98764da");
+  EXPECT_EQ(hashes.sha1, "b6589fc6ab0dc82cf12099d1c2d40ab994e8410c");
+  EXPECT_TRUE(hashes.sha256.empty());
+  EXPECT_EQ(getCachedHashes(HASH_TYPE_SHA1, path).sha1, hashes.sha1);
+
+  // A changed file is hashed again, the text is appended.
+  writeTextFile(path, "0");
+  hashes = hashMultiFromFileCached(HASH_TYPE_MD5, path);
+  EXPECT_EQ(hashes.md5, "b4b147bc522828731f1a016bfa72c073");
+  boost::filesystem::remove(path);
+}
+
+TEST_F(HashCacheTests, test_cache_eviction) {
+  auto max = FLAGS_hash_cache_max;
+  FLAGS_hash_cache_max = 2;
+
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < 3; ++i) {
+    paths.push_back("/tmp/osquery-hash-evict-test." + std::to_string(i));
+    writeTextFile(paths.back(), std::to_string(i));
+  }
+
+  FileHasher hasher;
+  hashMultiFromFileCached(hasher, HASH_TYPE_MD5, paths[0]);
+  hashMultiFromFileCached(hasher, HASH_TYPE_MD5, paths[1]);
+  // Using the first file makes the second the least recently used.
+  hashMultiFromFileCached(hasher, HASH_TYPE_MD5, paths[0]);
+  hashMultiFromFileCached(hasher, HASH_TYPE_MD5, paths[2]);
+
+  std::vector<std::string> keys;
+  DBHandle::getInstance()->Scan(kHashes, keys);
+  EXPECT_EQ(keys.size(), 2U);
+  EXPECT_FALSE(getCachedHashes(HASH_TYPE_MD5, paths[0]).md5.empty());
+  EXPECT_TRUE(getCachedHashes(HASH_TYPE_MD5, paths[1]).md5.empty());
+  EXPECT_FALSE(getCachedHashes(HASH_TYPE_MD5, paths[2]).md5.empty());
+
+  for (const auto& path : paths) {
+    boost::filesystem::remove(path);
+  }
+  FLAGS_hash_cache_max = max;
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  osquery::initOsquery(argc, argv);
+  return RUN_ALL_TESTS();
+}
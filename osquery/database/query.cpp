@@ -9,13 +9,193 @@
  */
 
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <unordered_map>
 
+#include <osquery/core.h>
 #include <osquery/database/query.h>
 
 namespace osquery {
 
+DEFINE_osquery_flag(bool,
+                    query_fingerprints,
+                    false,
+                    "Store fingerprints of scheduled query results.");
+
 const std::string kQueryNameNotFoundError = "query name not found in database";
 
+/// The first line of historical results stored as row fingerprints.
+const std::string kFingerprintsHeader = "fingerprints:1";
+
+/////////////////////////////////////////////////////////////////////////////
+// Row fingerprint storage
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * With query_fingerprints the kQueries value of a query holds the execution
+ * time followed by the sorted fingerprints of its rows, one per line. Each
+ * distinct row is stored once in kQueryRows, keyed by the query name and the
+ * fingerprint, and is only read back when it is removed.
+ */
+static std::string getRowKey(const std::string& name, uint64_t fingerprint) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)fingerprint);
+  return name + "." + hex;
+}
+
+static bool isFingerprints(const std::string& raw) {
+  return raw.compare(0, kFingerprintsHeader.size(), kFingerprintsHeader) == 0;
+}
+
+/// The fingerprints of result rows with the rows' indexes, sorted.
+typedef std::vector<std::pair<uint64_t, size_t> > RowFingerprints;
+
+static std::string serializeFingerprints(int unix_time,
+                                         const RowFingerprints& fingerprints) {
+  std::ostringstream ss;
+  ss << kFingerprintsHeader << "\n" << unix_time << "\n" << std::hex;
+  for (const auto& fingerprint : fingerprints) {
+    ss << fingerprint.first << "\n";
+  }
+  return ss.str();
+}
+
+/**
+ * @brief A cursor over the fingerprints of a stored list, in sorted order.
+ *
+ * The list is parsed as it is merged, the fingerprints are not copied.
+ */
+class FingerprintCursor {
+ public:
+  /// Start after the header and execution time of a stored list.
+  explicit FingerprintCursor(const std::string& raw)
+      : next_(raw.c_str()), fingerprint_(0), valid_(false), malformed_(false) {
+    if (!raw.empty()) {
+      next_ += kFingerprintsHeader.size();
+      char* end = nullptr;
+      std::strtol(next_, &end, 10);
+      malformed_ = (end == next_);
+      next_ = end;
+    }
+    advance();
+  }
+
+  /// True while the cursor is at a fingerprint.
+  bool valid() const { return valid_; }
+
+  /// True if the list was not sorted hex fingerprints.
+  bool malformed() const { return malformed_; }
+
+  uint64_t fingerprint() const { return fingerprint_; }
+
+  void advance() {
+    valid_ = false;
+    while (!malformed_ && *next_ == '\n') {
+      ++next_;
+    }
+    if (malformed_ || *next_ == '\0') {
+      return;
+    }
+
+    char* end = nullptr;
+    auto fingerprint = std::strtoull(next_, &end, 16);
+    if (end == next_ || (*end != '\n' && *end != '\0') ||
+        fingerprint < fingerprint_) {
+      malformed_ = true;
+      return;
+    }
+    fingerprint_ = fingerprint;
+    next_ = end;
+    valid_ = true;
+  }
+
+ private:
+  const char* next_;
+  uint64_t fingerprint_;
+  bool valid_;
+  bool malformed_;
+};
+
+static Status deserializeFingerprints(const std::string& raw,
+                                      int& unix_time,
+                                      std::vector<uint64_t>& fingerprints) {
+  std::istringstream ss(raw.substr(kFingerprintsHeader.size()));
+  if (!(ss >> unix_time)) {
+    return Status(1, "Malformed result fingerprints");
+  }
+  uint64_t fingerprint;
+  while (ss >> std::hex >> fingerprint) {
+    fingerprints.push_back(fingerprint);
+  }
+  if (!ss.eof()) {
+    return Status(1, "Malformed result fingerprints");
+  }
+  return Status(0, "OK");
+}
+
+static Status getFingerprintRows(const std::string& name,
+                                 const std::vector<uint64_t>& fingerprints,
+                                 QueryData& rows,
+                                 std::shared_ptr<DBHandle> db,
+                                 const DBSnapshotRef& snapshot) {
+  for (const auto& fingerprint : fingerprints) {
+    std::string data;
+    auto status =
+        db->Get(kQueryRows, getRowKey(name, fingerprint), data, snapshot);
+    if (!status.ok()) {
+      return status;
+    }
+    Row row;
+    status = deserializeRowBinary(data, row);
+    if (!status.ok()) {
+      return status;
+    }
+    rows.push_back(std::move(row));
+  }
+  return Status(0, "OK");
+}
+
+static Status scanFingerprintRows(const std::string& name,
+                                  const std::vector<uint64_t>& fingerprints,
+                                  QueryData& rows,
+                                  std::shared_ptr<DBHandle> db,
+                                  const DBSnapshotRef& snapshot) {
+  // Every stored row of the query is read with a single prefix scan.
+  auto prefix = name + ".";
+  std::unordered_map<uint64_t, Row> stored;
+  Status status;
+  auto scan_status = db->Scan(
+      kQueryRows,
+      prefix,
+      [&](const rocksdb::Slice& key, const rocksdb::Slice& value) {
+        // Skip the rows of queries named with this query's name as a prefix.
+        if (key.size() != prefix.size() + 16) {
+          return true;
+        }
+        auto fingerprint = std::strtoull(
+            key.ToString().substr(prefix.size()).c_str(), nullptr, 16);
+        status = deserializeRowBinary(value.ToString(), stored[fingerprint]);
+        return status.ok();
+      },
+      snapshot);
+  if (!scan_status.ok()) {
+    return scan_status;
+  } else if (!status.ok()) {
+    return status;
+  }
+
+  for (const auto& fingerprint : fingerprints) {
+    auto row = stored.find(fingerprint);
+    if (row == stored.end()) {
+      return Status(1, "Missing row for result fingerprint");
+    }
+    rows.push_back(row->second);
+  }
+  return Status(0, "OK");
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // Getters and setters
 /////////////////////////////////////////////////////////////////////////////
@@ -36,11 +216,27 @@ Status Query::getHistoricalQueryResults(HistoricalQueryResults& hQR) {
 
 Status Query::getHistoricalQueryResults(HistoricalQueryResults& hQR,
                                         std::shared_ptr<DBHandle> db) {
-  if (isQueryNameInDatabase()) {
+  // The fingerprint list and its rows are read from the same view, rows
+  // dropped by a concurrent run are still found.
+  auto snapshot = db->getSnapshot();
+  if (db->Exists(kQueries, query_.name, snapshot)) {
     std::string raw;
-    auto get_status = db->Get(kQueries, query_.name, raw);
-    if (get_status.ok()) {
-      auto deserialize_status = deserializeHistoricalQueryResultsJSON(raw, hQR);
+    auto get_status = db->Get(kQueries, query_.name, raw, snapshot);
+    if (get_status.ok() && isFingerprints(raw)) {
+      std::vector<uint64_t> fingerprints;
+      auto status = deserializeFingerprints(
+          raw, hQR.mostRecentResults.first, fingerprints);
+      if (status.ok()) {
+        status = scanFingerprintRows(query_.name,
+                                     fingerprints,
+                                     hQR.mostRecentResults.second,
+                                     db,
+                                     snapshot);
+      }
+      return status;
+    } else if (get_status.ok()) {
+      auto deserialize_status =
+          deserializeHistoricalQueryResultsBinary(raw, hQR);
       if (!deserialize_status.ok()) {
         return deserialize_status;
       }
@@ -48,11 +244,32 @@ Status Query::getHistoricalQueryResults(HistoricalQueryResults& hQR,
       return get_status;
     }
   } else {
-    return Status(1, kQueryNameNotFoundError);
+    return Status(STATUS_NOT_FOUND, kQueryNameNotFoundError);
   }
   return Status(0, "OK");
 }
 
+Status Query::getCompactResults(CompactQueryData& results,
+                                std::shared_ptr<DBHandle> db) {
+  if (!isQueryNameInDatabase(db)) {
+    return Status(STATUS_NOT_FOUND, kQueryNameNotFoundError);
+  }
+
+  std::string raw;
+  auto status = db->Get(kQueries, query_.name, raw);
+  if (!status.ok()) {
+    return status;
+  } else if (isFingerprints(raw)) {
+    // The rows of stored fingerprints are read back from their domain.
+    HistoricalQueryResults hQR;
+    status = getHistoricalQueryResults(hQR, db);
+    results = CompactQueryData(hQR.mostRecentResults.second);
+    return status;
+  }
+  int time = 0;
+  return deserializeHistoricalQueryResultsBinary(raw, time, results);
+}
+
 std::vector<std::string> Query::getStoredQueryNames() {
   return getStoredQueryNames(DBHandle::getInstance());
 }
@@ -69,56 +286,198 @@ bool Query::isQueryNameInDatabase() {
 }
 
 bool Query::isQueryNameInDatabase(std::shared_ptr<DBHandle> db) {
-  auto names = Query::getStoredQueryNames(db);
-  return std::find(names.begin(), names.end(), query_.name) != names.end();
+  return db->Exists(kQueries, query_.name);
 }
 
-Status Query::addNewResults(const osquery::QueryData& qd, int unix_time) {
-  return addNewResults(qd, unix_time, DBHandle::getInstance());
+Status Query::addNewResults(osquery::QueryData qd, int unix_time) {
+  return addNewResults(std::move(qd), unix_time, DBHandle::getInstance());
 }
 
-Status Query::addNewResults(const QueryData& qd,
+Status Query::addNewResults(QueryData qd,
                             int unix_time,
                             std::shared_ptr<DBHandle> db) {
   DiffResults dr;
-  return addNewResults(qd, dr, false, unix_time, db);
+  return addNewResults(std::move(qd), dr, false, unix_time, db);
 }
 
-osquery::Status Query::addNewResults(const osquery::QueryData& qd,
+osquery::Status Query::addNewResults(osquery::QueryData qd,
                                      osquery::DiffResults& dr,
                                      int unix_time) {
-  return addNewResults(qd, dr, true, unix_time, DBHandle::getInstance());
+  return addNewResults(
+      std::move(qd), dr, true, unix_time, DBHandle::getInstance());
 }
 
-osquery::Status Query::addNewResults(const osquery::QueryData& qd,
+Status Query::addNewResults(QueryData qd,
+                            DiffResults& dr,
+                            int unix_time,
+                            DBBatch& batch) {
+  return addNewResults(
+      std::move(qd), dr, true, unix_time, DBHandle::getInstance(), batch);
+}
+
+osquery::Status Query::addNewResults(osquery::QueryData qd,
                                      osquery::DiffResults& dr,
                                      bool calculate_diff,
                                      int unix_time,
                                      std::shared_ptr<DBHandle> db) {
-  HistoricalQueryResults hQR;
-  auto hqr_status = getHistoricalQueryResults(hQR, db);
-  if (!hqr_status.ok() && hqr_status.toString() != kQueryNameNotFoundError) {
-    return hqr_status;
+  DBBatch batch;
+  auto status =
+      addNewResults(std::move(qd), dr, calculate_diff, unix_time, db, batch);
+  if (!status.ok()) {
+    return status;
   }
+  TraceSpan put_span("db.put", query_.name);
+  return db->Write(batch);
+}
 
-  QueryData escaped_qd;
-  // remove all non-ascii characters from the string
-  escapeQueryData(qd, escaped_qd);
+Status Query::addNewResults(QueryData qd,
+                            DiffResults& dr,
+                            bool calculate_diff,
+                            int unix_time,
+                            std::shared_ptr<DBHandle> db,
+                            DBBatch& batch) {
+  if (FLAGS_query_fingerprints) {
+    return addNewFingerprints(qd, dr, calculate_diff, unix_time, db, batch);
+  }
 
+  TraceSpan span("addNewResults", query_.name);
+  Status previous_status;
   if (calculate_diff) {
-    dr = diff(hQR.mostRecentResults.second, escaped_qd);
+    CompactQueryData previous;
+    {
+      TraceSpan get_span("db.get", query_.name);
+      previous_status = getCompactResults(previous, db);
+    }
+    if (!previous_status.ok() &&
+        previous_status.getCode() != STATUS_NOT_FOUND) {
+      return previous_status;
+    }
+    TraceSpan diff_span("diff", query_.name);
+    dr = diff(previous, qd);
   }
+
+  // Rows are escaped only when logged, the results are moved into storage.
+  HistoricalQueryResults hQR;
   hQR.mostRecentResults.first = unix_time;
-  hQR.mostRecentResults.second = escaped_qd;
-  std::string json;
-  auto serialize_status = serializeHistoricalQueryResultsJSON(hQR, json);
+  hQR.mostRecentResults.second = std::move(qd);
+  std::string data;
+  auto serialize_status = serializeHistoricalQueryResultsBinary(hQR, data);
   if (!serialize_status.ok()) {
     return serialize_status;
   }
-  auto put_status = db->Put(kQueries, query_.name, json);
-  if (!put_status.ok()) {
-    return put_status;
+  batch.Put(kQueries, query_.name, data);
+  return Status(0, "OK");
+}
+
+Status Query::addNewFingerprints(QueryData& qd,
+                                DiffResults& dr,
+                                bool calculate_diff,
+                                int unix_time,
+                                std::shared_ptr<DBHandle> db,
+                                DBBatch& batch) {
+  // The removed rows are read from the view of the previous fingerprints.
+  auto snapshot = db->getSnapshot();
+  std::string raw;
+  if (db->Exists(kQueries, query_.name, snapshot)) {
+    auto status = db->Get(kQueries, query_.name, raw, snapshot);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (!raw.empty() && !isFingerprints(raw)) {
+    // Migrate results stored in full, their rows are not yet in kQueryRows.
+    int previous_time = 0;
+    CompactQueryData previous;
+    auto status =
+        deserializeHistoricalQueryResultsBinary(raw, previous_time, previous);
+    if (!status.ok()) {
+      return status;
+    }
+    if (calculate_diff) {
+      dr = diff(previous, qd);
+    }
+    calculate_diff = false;
+    raw.clear();
+  }
+
+  // The diff is a merge of the sorted new and stored fingerprints, neither
+  // the previous rows nor a set of their fingerprints are held in memory.
+  RowFingerprints fingerprints;
+  fingerprints.reserve(qd.size());
+  for (size_t i = 0; i < qd.size(); ++i) {
+    fingerprints.push_back(std::make_pair(getRowFingerprint(qd[i]), i));
+  }
+  std::sort(fingerprints.begin(), fingerprints.end());
+
+  // The new rows, the dropped rows and the fingerprint list are one write.
+  FingerprintCursor previous(raw);
+  std::vector<size_t> added;
+  std::vector<uint64_t> removed;
+  size_t next = 0;
+  while (next < fingerprints.size() || previous.valid()) {
+    auto fingerprint = (next == fingerprints.size())
+                           ? previous.fingerprint()
+                           : fingerprints[next].first;
+    if (previous.valid()) {
+      fingerprint = std::min(fingerprint, previous.fingerprint());
+    }
+
+    // Compare the copies of the smallest fingerprint in each list.
+    size_t previous_count = 0;
+    for (; previous.valid() && previous.fingerprint() == fingerprint;
+         previous.advance()) {
+      previous_count++;
+    }
+    size_t first = next;
+    while (next < fingerprints.size() &&
+           fingerprints[next].first == fingerprint) {
+      next++;
+    }
+
+    if (calculate_diff) {
+      for (auto i = first + previous_count; i < next; ++i) {
+        added.push_back(fingerprints[i].second);
+      }
+      if (previous_count > next - first) {
+        removed.insert(
+            removed.end(), previous_count - (next - first), fingerprint);
+      }
+    }
+
+    if (previous_count == 0) {
+      // Only rows not stored by a previous execution are written.
+      std::string data;
+      auto status = serializeRowBinary(qd[fingerprints[first].second], data);
+      if (!status.ok()) {
+        return status;
+      }
+      batch.Put(kQueryRows, getRowKey(query_.name, fingerprint), data);
+    } else if (first == next) {
+      batch.Delete(kQueryRows, getRowKey(query_.name, fingerprint));
+    }
+  }
+  if (previous.malformed()) {
+    return Status(1, "Malformed result fingerprints");
+  }
+
+  if (calculate_diff) {
+    // Removed rows are the only previous rows read back.
+    auto status =
+        getFingerprintRows(query_.name, removed, dr.removed, db, snapshot);
+    if (!status.ok()) {
+      return status;
+    }
+
+    // Added rows are reported in result order and moved, not copied.
+    std::sort(added.begin(), added.end());
+    for (const auto& index : added) {
+      dr.added.push_back(std::move(qd[index]));
+    }
   }
+
+  batch.Put(
+      kQueries, query_.name, serializeFingerprints(unix_time, fingerprints));
   return Status(0, "OK");
 }
 
@@ -78,6 +78,124 @@ TEST_F(QueryTests, test_add_and_get_current_results) {
   }
 }
 
+TEST_F(QueryTests, test_add_pending_results) {
+  auto query = getOsqueryScheduledQuery();
+  query.name = "pending_query";
+  auto cf = Query(query);
+
+  Row r1 = {{"name", "bin"}};
+  Row r2 = {{"name", "sbin"}};
+  DiffResults dr;
+  EXPECT_TRUE(cf.addNewResults({r1}, dr, true, std::time(0), db).ok());
+
+  // Results are not stored until their batch is written.
+  DBBatch pending;
+  dr = DiffResults();
+  auto s = cf.addNewResults({r1, r2}, dr, true, std::time(0), db, pending);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(dr.added, QueryData({r2}));
+
+  DBBatch retry;
+  dr = DiffResults();
+  s = cf.addNewResults({r1, r2}, dr, true, std::time(0), db, retry);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(dr.added, QueryData({r2}));
+
+  EXPECT_TRUE(db->Write(retry).ok());
+  dr = DiffResults();
+  EXPECT_TRUE(cf.addNewResults({r1, r2}, dr, true, std::time(0), db).ok());
+  EXPECT_TRUE(dr.added.empty());
+  EXPECT_TRUE(dr.removed.empty());
+}
+
+TEST_F(QueryTests, test_add_unescaped_results) {
+  auto query = getOsqueryScheduledQuery();
+  query.name = "unescaped_query";
+  auto cf = Query(query);
+
+  // Results are stored as they were returned, escaping is left to loggers.
+  QueryData results = {{{"path", "/tmp/caf\xc3\xa9 \"quoted\""}}};
+  DiffResults dr;
+  auto s = cf.addNewResults(results, dr, true, std::time(0), db);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(dr.added, results);
+
+  QueryData qd;
+  cf.getCurrentResults(qd, db);
+  EXPECT_EQ(qd, results);
+}
+
+TEST_F(QueryTests, test_add_fingerprints) {
+  auto query = getOsqueryScheduledQuery();
+  query.name = "fingerprinted_query";
+  auto cf = Query(query);
+
+  FLAGS_query_fingerprints = true;
+  Row r1 = {{"name", "bin"}};
+  Row r2 = {{"name", "sbin"}};
+  Row r3 = {{"name", "usr"}};
+  DiffResults dr;
+  auto s = cf.addNewResults({r1, r2}, dr, true, std::time(0), db);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(dr.added, QueryData({r1, r2}));
+
+  // Only the fingerprints are stored as the results of the query.
+  std::string raw;
+  db->Get(kQueries, query.name, raw);
+  EXPECT_EQ(raw.find("bin"), std::string::npos);
+
+  dr = DiffResults();
+  s = cf.addNewResults({r2, r3}, dr, true, std::time(0), db);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(dr.added, QueryData({r3}));
+  EXPECT_EQ(dr.removed, QueryData({r1}));
+
+  QueryData qd;
+  cf.getCurrentResults(qd, db);
+  std::sort(qd.begin(), qd.end());
+  EXPECT_EQ(qd, QueryData({r2, r3}));
+  FLAGS_query_fingerprints = false;
+}
+
+TEST_F(QueryTests, test_add_fingerprints_duplicates) {
+  auto query = getOsqueryScheduledQuery();
+  query.name = "fingerprinted_duplicates_query";
+  auto cf = Query(query);
+
+  FLAGS_query_fingerprints = true;
+  Row r1 = {{"name", "bin"}};
+  Row r2 = {{"name", "sbin"}};
+  Row r3 = {{"name", "usr"}};
+  DiffResults dr;
+  EXPECT_TRUE(cf.addNewResults({r1, r1, r2}, dr, true, std::time(0), db).ok());
+  EXPECT_EQ(dr.added, QueryData({r1, r1, r2}));
+
+  // Copies of a row are added and removed by count, in result order.
+  dr = DiffResults();
+  auto s = cf.addNewResults({r3, r2, r1, r2}, dr, true, std::time(0), db);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(dr.added, QueryData({r3, r2}));
+  EXPECT_EQ(dr.removed, QueryData({r1}));
+
+  dr = DiffResults();
+  EXPECT_TRUE(cf.addNewResults({}, dr, true, std::time(0), db).ok());
+  EXPECT_TRUE(dr.added.empty());
+  std::sort(dr.removed.begin(), dr.removed.end());
+  EXPECT_EQ(dr.removed, QueryData({r1, r2, r2, r3}));
+
+  // The rows of fingerprints no longer stored are deleted.
+  size_t stored = 0;
+  db->ScanRange(kQueryRows,
+                query.name + ".",
+                query.name + "/",
+                [&stored](const rocksdb::Slice&, const rocksdb::Slice&) {
+                  stored++;
+                  return true;
+                });
+  EXPECT_EQ(stored, 0U);
+  FLAGS_query_fingerprints = false;
+}
+
 TEST_F(QueryTests, test_get_historical_query_results) {
   auto hQR = getSerializedHistoricalQueryResultsJSON();
   auto query = getOsqueryScheduledQuery();
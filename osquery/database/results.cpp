@@ -13,13 +13,23 @@
 #include <sstream>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <zlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <boost/lexical_cast.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 #include <osquery/database/results.h>
 #include <osquery/logger.h>
+#include <osquery/scheduler.h>
 
 namespace pt = boost::property_tree;
 using osquery::Status;
@@ -32,16 +42,6 @@ namespace osquery {
 // respective value
 /////////////////////////////////////////////////////////////////////////////
 
-void escapeQueryData(const QueryData &oldData, QueryData &newData) {
-  for (const auto& r : oldData) {
-    Row newRow;
-    for (auto& i : r) {
-      newRow[i.first] = pt::json_parser::create_escapes(i.second);
-    }
-    newData.push_back(newRow);
-  }
-}
-
 Status serializeRow(const Row& r, pt::ptree& tree) {
   try {
     for (auto& i : r) {
@@ -54,19 +54,117 @@ Status serializeRow(const Row& r, pt::ptree& tree) {
 }
 
 Status serializeRowJSON(const Row& r, std::string& json) {
-  pt::ptree tree;
-  try {
-    auto status = serializeRow(r, tree);
-    if (!status.ok()) {
-      return status;
+  json.clear();
+  appendRowJSON(json, r);
+  json.push_back('\n');
+  return Status(0, "OK");
+}
+
+static bool isJSONEscaped(unsigned char byte) {
+  return byte < 0x20 || byte == '"' || byte == '\\' || byte == '/';
+}
+
+/// The length of the run of bytes at the start of data without escapes.
+static size_t getUnescapedLength(const char* data, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const auto control = _mm_set1_epi8(0x1F);
+  const auto quote = _mm_set1_epi8('"');
+  const auto backslash = _mm_set1_epi8('\\');
+  const auto slash = _mm_set1_epi8('/');
+  for (; i + 16 <= size; i += 16) {
+    auto bytes = _mm_loadu_si128((const __m128i*)(data + i));
+    // Bytes below 0x20 are unchanged by an unsigned maximum with 0x1F.
+    auto escaped = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(bytes, control), control),
+                     _mm_cmpeq_epi8(bytes, quote)),
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, backslash),
+                     _mm_cmpeq_epi8(bytes, slash)));
+    int mask = _mm_movemask_epi8(escaped);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
     }
-    std::ostringstream ss;
-    pt::write_json(ss, tree, false);
-    json = ss.str();
-  } catch (const std::exception& e) {
-    return Status(1, e.what());
   }
-  return Status(0, "OK");
+#elif defined(__aarch64__)
+  for (; i + 16 <= size; i += 16) {
+    auto bytes = vld1q_u8((const uint8_t*)(data + i));
+    auto escaped = vorrq_u8(
+        vorrq_u8(vcleq_u8(bytes, vdupq_n_u8(0x1F)),
+                 vceqq_u8(bytes, vdupq_n_u8('"'))),
+        vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('\\')),
+                 vceqq_u8(bytes, vdupq_n_u8('/'))));
+    if (vmaxvq_u8(escaped) != 0) {
+      // The escaped byte is found by the scalar loop.
+      break;
+    }
+  }
+#endif
+  while (i < size && !isJSONEscaped((unsigned char)data[i])) {
+    ++i;
+  }
+  return i;
+}
+
+void appendJSONString(std::string& json, const std::string& value) {
+  static const char* kHexDigits = "0123456789ABCDEF";
+  json.push_back('"');
+  size_t pos = 0;
+  while (pos < value.size()) {
+    // Copy runs of bytes without escapes at once.
+    auto length = getUnescapedLength(value.data() + pos, value.size() - pos);
+    json.append(value, pos, length);
+    pos += length;
+    if (pos == value.size()) {
+      break;
+    }
+
+    auto c = value[pos++];
+    auto byte = (unsigned char)c;
+    if (byte == '"' || byte == '\\' || byte == '/') {
+      json.push_back('\\');
+      json.push_back(c);
+    } else if (c == '\b') {
+      json.append("\\b");
+    } else if (c == '\f') {
+      json.append("\\f");
+    } else if (c == '\n') {
+      json.append("\\n");
+    } else if (c == '\r') {
+      json.append("\\r");
+    } else if (c == '\t') {
+      json.append("\\t");
+    } else {
+      json.append("\\u00");
+      json.push_back(kHexDigits[byte >> 4]);
+      json.push_back(kHexDigits[byte & 0xf]);
+    }
+  }
+  json.push_back('"');
+}
+
+void appendRowJSON(std::string& json, const Row& r) {
+  json.push_back('{');
+  for (auto it = r.begin(); it != r.end(); ++it) {
+    if (it != r.begin()) {
+      json.push_back(',');
+    }
+    appendJSONString(json, it->first);
+    json.push_back(':');
+    appendJSONString(json, it->second);
+  }
+  json.push_back('}');
+}
+
+/// Append rows as a JSON array.
+static void appendQueryDataJSON(std::string& json, const QueryData& q) {
+  json.push_back('[');
+  for (size_t i = 0; i < q.size(); ++i) {
+    if (i > 0) {
+      json.push_back(',');
+    }
+    appendRowJSON(json, q[i]);
+  }
+  json.push_back(']');
 }
 
 Status deserializeRow(const pt::ptree& tree, Row& r) {
@@ -116,6 +214,114 @@ Status serializeQueryData(const QueryData& q, pt::ptree& tree) {
   return Status(0, "OK");
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// CompactQueryData - rows of values indexed by the ordinals of one shared
+// schema of column names
+/////////////////////////////////////////////////////////////////////////////
+
+RowSchema::RowSchema(std::vector<std::string> names)
+    : names_(std::move(names)) {
+  std::sort(names_.begin(), names_.end());
+  names_.erase(std::unique(names_.begin(), names_.end()), names_.end());
+}
+
+size_t RowSchema::ordinal(const std::string& name) const {
+  auto it = std::lower_bound(names_.begin(), names_.end(), name);
+  return (it != names_.end() && *it == name) ? it - names_.begin()
+                                             : names_.size();
+}
+
+CompactRow::CompactRow(RowSchemaRef schema)
+    : schema_(std::move(schema)),
+      values_(schema_->size()),
+      present_(schema_->size(), false),
+      size_(0) {}
+
+CompactRow::CompactRow(RowSchemaRef schema, const Row& r)
+    : CompactRow(std::move(schema)) {
+  for (const auto& column : r) {
+    auto ordinal = schema_->ordinal(column.first);
+    if (ordinal < values_.size()) {
+      set(ordinal, column.second);
+    }
+  }
+}
+
+void CompactRow::set(size_t ordinal, RowData value) {
+  values_[ordinal] = std::move(value);
+  if (!present_[ordinal]) {
+    present_[ordinal] = true;
+    size_++;
+  }
+}
+
+Row CompactRow::toRow() const {
+  Row r;
+  for (const auto& column : *this) {
+    // Columns are iterated in order, each is inserted at the end.
+    r.emplace_hint(r.end(), column.first, column.second);
+  }
+  return r;
+}
+
+CompactRow::const_iterator CompactRow::find(const std::string& column) const {
+  auto ordinal = schema_->ordinal(column);
+  if (ordinal < values_.size() && present_[ordinal]) {
+    return const_iterator(*this, ordinal);
+  }
+  return end();
+}
+
+const RowData& CompactRow::at(const std::string& column) const {
+  auto ordinal = schema_->ordinal(column);
+  if (ordinal >= values_.size() || !present_[ordinal]) {
+    throw std::out_of_range("CompactRow has no column " + column);
+  }
+  return values_[ordinal];
+}
+
+bool CompactRow::operator==(const CompactRow& other) const {
+  if (schema_ == other.schema_) {
+    return present_ == other.present_ && values_ == other.values_;
+  }
+  return size_ == other.size_ && std::equal(begin(), end(), other.begin());
+}
+
+bool CompactRow::operator==(const Row& r) const {
+  return size_ == r.size() &&
+         std::equal(begin(),
+                    end(),
+                    r.begin(),
+                    [](const value_type& column, const Row::value_type& rc) {
+                      return column.first == rc.first &&
+                             column.second == rc.second;
+                    });
+}
+
+CompactQueryData::CompactQueryData(const QueryData& q) {
+  std::set<std::string> names;
+  for (const auto& r : q) {
+    for (const auto& column : r) {
+      names.insert(column.first);
+    }
+  }
+  schema = std::make_shared<RowSchema>(
+      std::vector<std::string>(names.begin(), names.end()));
+  rows.reserve(q.size());
+  for (const auto& r : q) {
+    rows.push_back(CompactRow(schema, r));
+  }
+}
+
+QueryData CompactQueryData::toQueryData() const {
+  QueryData q;
+  q.reserve(rows.size());
+  for (const auto& row : rows) {
+    q.push_back(row.toRow());
+  }
+  return q;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // DiffResults - the representation of two diffed QueryData result sets.
 // Given and old and new QueryData, DiffResults indicates the "added" subset
@@ -144,45 +350,141 @@ Status serializeDiffResults(const DiffResults& d, pt::ptree& tree) {
 }
 
 Status serializeDiffResultsJSON(const DiffResults& d, std::string& json) {
-  try {
-    pt::ptree tree;
-    auto s = serializeDiffResults(d, tree);
-    if (!s.ok()) {
-      return s;
+  json.clear();
+  appendDiffResultsJSON(json, d);
+  json.push_back('\n');
+  return Status(0, "OK");
+}
+
+void appendDiffResultsJSON(std::string& json, const DiffResults& d) {
+  json.append("{\"added\":");
+  appendQueryDataJSON(json, d.added);
+  json.append(",\"removed\":");
+  appendQueryDataJSON(json, d.removed);
+  json.push_back('}');
+}
+
+/// 64-bit FNV-1a over each column name and value, terminated by a NUL.
+template <typename R>
+static uint64_t getColumnsFingerprint(const R& r) {
+  uint64_t hash = 14695981039346656037ULL;
+  auto update = [&hash](const std::string& data) {
+    for (const auto& c : data) {
+      hash ^= (unsigned char)c;
+      hash *= 1099511628211ULL;
     }
-    std::ostringstream ss;
-    pt::write_json(ss, tree, false);
-    json = ss.str();
-  } catch (const std::exception& e) {
-    return Status(1, e.what());
+    // The NUL terminator, XOR with 0 leaves the hash unchanged.
+    hash *= 1099511628211ULL;
+  };
+  for (const auto& column : r) {
+    update(column.first);
+    update(column.second);
   }
-  return Status(0, "OK");
+  return hash;
 }
 
-DiffResults diff(const QueryData& old_, const QueryData& new_) {
+uint64_t getRowFingerprint(const Row& r) { return getColumnsFingerprint(r); }
+
+uint64_t getRowFingerprint(const CompactRow& r) {
+  return getColumnsFingerprint(r);
+}
+
+uint64_t getQueryDataFingerprint(const QueryData& qd) {
+  // Each row fingerprint is mixed before the sum, such that rows differing
+  // in a few bits do not cancel out.
+  uint64_t sum = qd.size();
+  for (const auto& r : qd) {
+    uint64_t hash = getRowFingerprint(r);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    sum += hash ^ (hash >> 31);
+  }
+  return sum;
+}
+
+static const Row& expandRow(const Row& r) { return r; }
+
+static Row expandRow(const CompactRow& r) { return r.toRow(); }
+
+/// Distinct old rows, with their number of copies and matching new rows.
+struct RowGroup {
+  size_t row;
+  size_t copies;
+  size_t matched;
+};
+
+/// Find the group of an old row equal to a row, among groups of its hash.
+template <typename R, typename T>
+static bool findRowGroup(const std::vector<R>& old_,
+                         const std::vector<RowGroup>& groups,
+                         const T& row,
+                         const std::vector<size_t>& ids,
+                         size_t& group) {
+  for (const auto& id : ids) {
+    if (old_[groups[id].row] == row) {
+      group = id;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Diff old rows of Row or CompactRow and new rows.
+template <typename R>
+static DiffResults diffRows(const std::vector<R>& old_,
+                            const QueryData& new_) {
   DiffResults r;
-  QueryData overlap;
+  std::vector<RowGroup> groups;
+  std::vector<size_t> old_groups;
+  old_groups.reserve(old_.size());
+
+  // Groups by row fingerprint, rows are compared to rule out collisions.
+  std::unordered_map<uint64_t, std::vector<size_t> > index;
+  index.reserve(old_.size());
+
+  for (size_t i = 0; i < old_.size(); ++i) {
+    auto& ids = index[getRowFingerprint(old_[i])];
+    size_t group = 0;
+    if (!findRowGroup(old_, groups, old_[i], ids, group)) {
+      group = groups.size();
+      groups.push_back({i, 0, 0});
+      ids.push_back(group);
+    }
+    groups[group].copies++;
+    old_groups.push_back(group);
+  }
 
-  for (const auto& i : new_) {
-    auto item = std::find(old_.begin(), old_.end(), i);
-    if (item != old_.end()) {
-      overlap.push_back(i);
+  // A new row is added only if no old row is equal to it.
+  for (const auto& row : new_) {
+    auto ids = index.find(getRowFingerprint(row));
+    size_t group = 0;
+    if (ids != index.end() &&
+        findRowGroup(old_, groups, row, ids->second, group)) {
+      groups[group].matched++;
     } else {
-      r.added.push_back(i);
+      r.added.push_back(row);
     }
   }
 
-  std::multiset<Row> overlap_set(overlap.begin(), overlap.end());
+  // Old rows are removed once for each copy beyond the new rows equal to it.
+  for (size_t i = 0; i < old_.size(); ++i) {
+    auto& group = groups[old_groups[i]];
+    if (group.matched > 0) {
+      group.matched--;
+    } else {
+      r.removed.push_back(expandRow(old_[i]));
+    }
+  }
 
-  std::multiset<Row> old_set(old_.begin(), old_.end());
+  return r;
+}
 
-  std::set_difference(old_set.begin(),
-                      old_set.end(),
-                      overlap_set.begin(),
-                      overlap_set.end(),
-                      std::back_inserter(r.removed));
+DiffResults diff(const QueryData& old_, const QueryData& new_) {
+  return diffRows(old_, new_);
+}
 
-  return r;
+DiffResults diff(const CompactQueryData& old_, const QueryData& new_) {
+  return diffRows(old_.rows, new_);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -270,6 +572,385 @@ Status deserializeHistoricalQueryResultsJSON(const std::string& json,
   return deserializeHistoricalQueryResults(tree, r);
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// Binary encoding - a compact encoding of rows and results stored in RocksDB.
+/////////////////////////////////////////////////////////////////////////////
+
+const unsigned char kBinaryEncodingVersion = 1;
+
+/// The bytes before the version of a binary encoded value.
+const std::string kBinaryEncodingMagic("\0osq", 4);
+
+static void putVarint(std::string& data, uint64_t value) {
+  while (value >= 0x80) {
+    data.push_back((char)((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  data.push_back((char)value);
+}
+
+static void putString(std::string& data, const std::string& value) {
+  putVarint(data, value.size());
+  data.append(value);
+}
+
+static bool getVarint(const std::string& data, size_t& pos, uint64_t& value) {
+  value = 0;
+  for (size_t shift = 0; pos < data.size() && shift < 64; shift += 7) {
+    auto byte = (unsigned char)data[pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool getString(const std::string& data,
+                      size_t& pos,
+                      std::string& value) {
+  uint64_t size = 0;
+  if (!getVarint(data, pos, size) || size > data.size() - pos) {
+    return false;
+  }
+  value.assign(data, pos, size);
+  pos += size;
+  return true;
+}
+
+static void putHeader(std::string& data) {
+  data = kBinaryEncodingMagic;
+  data.push_back((char)kBinaryEncodingVersion);
+}
+
+/// Check the header of a binary value, 'data' is JSON if it has none.
+static Status getHeader(const std::string& data, size_t& pos, bool& binary) {
+  const auto& magic = kBinaryEncodingMagic;
+  binary = (data.compare(0, magic.size(), magic) == 0);
+  if (!binary) {
+    return Status(0, "OK");
+  }
+  pos = kBinaryEncodingMagic.size();
+  if (pos >= data.size() ||
+      (unsigned char)data[pos] != kBinaryEncodingVersion) {
+    return Status(1, "Unsupported binary encoding version");
+  }
+  pos++;
+  return Status(0, "OK");
+}
+
+Status serializeRowBinary(const Row& r, std::string& data) {
+  putHeader(data);
+  putVarint(data, r.size());
+  for (const auto& column : r) {
+    putString(data, column.first);
+    putString(data, column.second);
+  }
+  return Status(0, "OK");
+}
+
+RowEncoder::RowEncoder(size_t columns) : columns_(columns), added_(0) {
+  putHeader(data_);
+  putVarint(data_, columns);
+}
+
+RowEncoder& RowEncoder::add(const std::string& column,
+                            const std::string& value) {
+  putString(data_, column);
+  putString(data_, value);
+  added_++;
+  return *this;
+}
+
+RowEncoder& RowEncoder::addInteger(const std::string& column,
+                                   bool negative,
+                                   unsigned long long magnitude) {
+  char digits[24];
+  size_t pos = sizeof(digits);
+  do {
+    digits[--pos] = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude > 0);
+  if (negative) {
+    digits[--pos] = '-';
+  }
+
+  putString(data_, column);
+  putVarint(data_, sizeof(digits) - pos);
+  data_.append(digits + pos, sizeof(digits) - pos);
+  added_++;
+  return *this;
+}
+
+Status deserializeRowBinary(const std::string& data, Row& r) {
+  size_t pos = 0;
+  bool binary = false;
+  auto status = getHeader(data, pos, binary);
+  if (!status.ok()) {
+    return status;
+  } else if (!binary) {
+    return deserializeRowJSON(data, r);
+  }
+
+  uint64_t columns = 0;
+  if (!getVarint(data, pos, columns)) {
+    return Status(1, "Malformed binary row");
+  }
+  for (uint64_t i = 0; i < columns; ++i) {
+    std::string column, value;
+    if (!getString(data, pos, column) || !getString(data, pos, value)) {
+      return Status(1, "Malformed binary row");
+    }
+    r[column] = std::move(value);
+  }
+  return Status(0, "OK");
+}
+
+Status serializeHistoricalQueryResultsBinary(const HistoricalQueryResults& r,
+                                             std::string& data) {
+  putHeader(data);
+  putVarint(data, (uint32_t)r.mostRecentResults.first);
+
+  // Column names are stored once, rows refer to them by index.
+  std::map<std::string, size_t> dictionary;
+  for (const auto& row : r.mostRecentResults.second) {
+    for (const auto& column : row) {
+      dictionary.insert(std::make_pair(column.first, dictionary.size()));
+    }
+  }
+  std::vector<const std::string*> names(dictionary.size());
+  for (const auto& column : dictionary) {
+    names[column.second] = &column.first;
+  }
+  putVarint(data, names.size());
+  for (const auto& name : names) {
+    putString(data, *name);
+  }
+
+  putVarint(data, r.mostRecentResults.second.size());
+  for (const auto& row : r.mostRecentResults.second) {
+    putVarint(data, row.size());
+    for (const auto& column : row) {
+      putVarint(data, dictionary[column.first]);
+      putString(data, column.second);
+    }
+  }
+  return Status(0, "OK");
+}
+
+Status deserializeHistoricalQueryResultsBinary(const std::string& data,
+                                               HistoricalQueryResults& r) {
+  size_t pos = 0;
+  bool binary = false;
+  auto status = getHeader(data, pos, binary);
+  if (!status.ok()) {
+    return status;
+  } else if (!binary) {
+    return deserializeHistoricalQueryResultsJSON(data, r);
+  }
+
+  uint64_t value = 0;
+  if (!getVarint(data, pos, value)) {
+    return Status(1, "Malformed binary results");
+  }
+  r.mostRecentResults.first = (int)(uint32_t)value;
+
+  std::vector<std::string> names;
+  if (!getVarint(data, pos, value)) {
+    return Status(1, "Malformed binary results");
+  }
+  names.resize(value);
+  for (auto& name : names) {
+    if (!getString(data, pos, name)) {
+      return Status(1, "Malformed binary results");
+    }
+  }
+
+  uint64_t rows = 0;
+  if (!getVarint(data, pos, rows)) {
+    return Status(1, "Malformed binary results");
+  }
+  QueryData results;
+  for (uint64_t i = 0; i < rows; ++i) {
+    uint64_t columns = 0;
+    if (!getVarint(data, pos, columns)) {
+      return Status(1, "Malformed binary results");
+    }
+    Row row;
+    for (uint64_t j = 0; j < columns; ++j) {
+      uint64_t index = 0;
+      std::string column_value;
+      if (!getVarint(data, pos, index) || index >= names.size() ||
+          !getString(data, pos, column_value)) {
+        return Status(1, "Malformed binary results");
+      }
+      row[names[index]] = std::move(column_value);
+    }
+    results.push_back(std::move(row));
+  }
+  r.mostRecentResults.second = std::move(results);
+  return Status(0, "OK");
+}
+
+Status deserializeHistoricalQueryResultsBinary(const std::string& data,
+                                               int& time,
+                                               CompactQueryData& results) {
+  size_t pos = 0;
+  bool binary = false;
+  auto status = getHeader(data, pos, binary);
+  if (!status.ok()) {
+    return status;
+  } else if (!binary) {
+    HistoricalQueryResults r;
+    status = deserializeHistoricalQueryResultsJSON(data, r);
+    time = r.mostRecentResults.first;
+    results = CompactQueryData(r.mostRecentResults.second);
+    return status;
+  }
+
+  uint64_t value = 0;
+  if (!getVarint(data, pos, value)) {
+    return Status(1, "Malformed binary results");
+  }
+  time = (int)(uint32_t)value;
+
+  std::vector<std::string> names;
+  if (!getVarint(data, pos, value)) {
+    return Status(1, "Malformed binary results");
+  }
+  names.resize(value);
+  for (auto& name : names) {
+    if (!getString(data, pos, name)) {
+      return Status(1, "Malformed binary results");
+    }
+  }
+
+  // Stored columns are numbered as first used, ordinals are sorted.
+  auto schema = std::make_shared<RowSchema>(names);
+  std::vector<size_t> ordinals;
+  for (const auto& name : names) {
+    ordinals.push_back(schema->ordinal(name));
+  }
+
+  uint64_t rows = 0;
+  if (!getVarint(data, pos, rows)) {
+    return Status(1, "Malformed binary results");
+  }
+  std::vector<CompactRow> compact_rows;
+  for (uint64_t i = 0; i < rows; ++i) {
+    uint64_t columns = 0;
+    if (!getVarint(data, pos, columns)) {
+      return Status(1, "Malformed binary results");
+    }
+    CompactRow row(schema);
+    for (uint64_t j = 0; j < columns; ++j) {
+      uint64_t index = 0;
+      std::string column_value;
+      if (!getVarint(data, pos, index) || index >= names.size() ||
+          !getString(data, pos, column_value)) {
+        return Status(1, "Malformed binary results");
+      }
+      row.set(ordinals[index], std::move(column_value));
+    }
+    compact_rows.push_back(std::move(row));
+  }
+  results.schema = std::move(schema);
+  results.rows = std::move(compact_rows);
+  return Status(0, "OK");
+}
+
+void serializeQueryDataColumnar(const std::vector<std::string>& columns,
+                                const QueryData& q,
+                                size_t begin,
+                                size_t end,
+                                std::string& data) {
+  end = std::min(end, q.size());
+  begin = std::min(begin, end);
+  putHeader(data);
+  putVarint(data, columns.size());
+  putVarint(data, end - begin);
+
+  std::unordered_map<std::string, size_t> dictionary;
+  std::vector<const std::string*> values;
+  std::vector<size_t> indexes(end - begin);
+  for (const auto& column : columns) {
+    dictionary.clear();
+    values.clear();
+    for (size_t i = begin; i < end; ++i) {
+      auto value = q[i].find(column);
+      if (value == q[i].end()) {
+        // Index 0 marks a value missing from the row.
+        indexes[i - begin] = 0;
+        continue;
+      }
+      auto entry = dictionary.insert(
+          std::make_pair(value->second, dictionary.size() + 1));
+      if (entry.second) {
+        values.push_back(&value->second);
+      }
+      indexes[i - begin] = entry.first->second;
+    }
+
+    putString(data, column);
+    putVarint(data, values.size());
+    for (const auto& value : values) {
+      putString(data, *value);
+    }
+    for (const auto& index : indexes) {
+      putVarint(data, index);
+    }
+  }
+}
+
+Status deserializeQueryDataColumnar(const std::string& data, QueryData& q) {
+  size_t pos = 0;
+  bool binary = false;
+  auto status = getHeader(data, pos, binary);
+  if (!status.ok()) {
+    return status;
+  } else if (!binary) {
+    return Status(1, "Malformed columnar rows");
+  }
+
+  uint64_t columns = 0;
+  uint64_t rows = 0;
+  if (!getVarint(data, pos, columns) || !getVarint(data, pos, rows) ||
+      rows > data.size() - pos) {
+    return Status(1, "Malformed columnar rows");
+  }
+
+  QueryData batch(rows);
+  std::string column;
+  std::vector<std::string> values;
+  for (uint64_t i = 0; i < columns; ++i) {
+    uint64_t count = 0;
+    if (!getString(data, pos, column) || !getVarint(data, pos, count) ||
+        count > data.size() - pos) {
+      return Status(1, "Malformed columnar rows");
+    }
+    values.resize(count);
+    for (auto& value : values) {
+      if (!getString(data, pos, value)) {
+        return Status(1, "Malformed columnar rows");
+      }
+    }
+    for (uint64_t j = 0; j < rows; ++j) {
+      uint64_t index = 0;
+      if (!getVarint(data, pos, index) || index > values.size()) {
+        return Status(1, "Malformed columnar rows");
+      }
+      if (index > 0) {
+        batch[j][column] = values[index - 1];
+      }
+    }
+  }
+
+  q.insert(q.end(),
+           std::make_move_iterator(batch.begin()),
+           std::make_move_iterator(batch.end()));
+  return Status(0, "OK");
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // ScheduledQueryLogItem - the representation of a log result occuring when a
 // scheduled query yields operating system state change.
@@ -289,6 +970,9 @@ Status serializeScheduledQueryLogItem(const ScheduledQueryLogItem& i,
     tree.put<std::string>("hostIdentifier", i.hostIdentifier);
     tree.put<std::string>("calendarTime", i.calendarTime);
     tree.put<int>("unixTime", i.unixTime);
+    if (!i.snapshotHash.empty()) {
+      tree.put<std::string>("snapshotHash", i.snapshotHash);
+    }
   } catch (const std::exception& e) {
     return Status(1, e.what());
   }
@@ -302,6 +986,9 @@ Status serializeEvent(const ScheduledQueryLogItem& item,
   tree.put<std::string>("hostIdentifier", item.hostIdentifier);
   tree.put<std::string>("calendarTime", item.calendarTime);
   tree.put<int>("unixTime", item.unixTime);
+  if (!item.snapshotHash.empty()) {
+    tree.put<std::string>("snapshotHash", item.snapshotHash);
+  }
 
   pt::ptree columns;
   for (auto& i : event) {
@@ -337,39 +1024,105 @@ Status serializeScheduledQueryLogItemAsEvents(
   return Status(0, "OK");
 }
 
+/// Append the fields common to a log item and its events.
+static void appendLogItemJSON(std::string& json,
+                              const ScheduledQueryLogItem& item) {
+  json.append("\"name\":");
+  appendJSONString(json, item.name);
+  json.append(",\"hostIdentifier\":");
+  appendJSONString(json, item.hostIdentifier);
+  json.append(",\"calendarTime\":");
+  appendJSONString(json, item.calendarTime);
+  json.append(",\"unixTime\":");
+  appendJSONString(json, std::to_string(item.unixTime));
+  if (!item.snapshotHash.empty()) {
+    json.append(",\"snapshotHash\":");
+    appendJSONString(json, item.snapshotHash);
+  }
+}
+
+Status serializeUnchangedSnapshotJSON(const ScheduledQueryLogItem& i,
+                                      std::string& json) {
+  if (i.snapshotHash.empty()) {
+    return Status(1, "Unchanged snapshots require a snapshot hash");
+  }
+
+  json = "{";
+  appendLogItemJSON(json, i);
+  json.append(",\"action\":\"unchanged\"}\n");
+  return Status(0, "OK");
+}
+
+/// The start of every event of a log item, up to its columns.
+static std::string getLogItemEventPrefix(const ScheduledQueryLogItem& item) {
+  std::string prefix = "{";
+  appendLogItemJSON(prefix, item);
+  prefix.append(",\"columns\":");
+  return prefix;
+}
+
+/// The rows of each action with the end of their events.
+static std::vector<std::pair<std::string, const QueryData*> >
+getLogItemEventActions(const ScheduledQueryLogItem& item) {
+  return {{",\"action\":\"added\"}\n", &item.diffResults.added},
+          {",\"action\":\"removed\"}\n", &item.diffResults.removed}};
+}
+
 Status serializeScheduledQueryLogItemAsEventsJSON(
     const ScheduledQueryLogItem& i, std::string& json) {
-  try {
-    pt::ptree tree;
-    auto s = serializeScheduledQueryLogItemAsEvents(i, tree);
-    if (!s.ok()) {
-      return s;
+  json.clear();
+  auto prefix = getLogItemEventPrefix(i);
+  auto actions = getLogItemEventActions(i);
+  for (const auto& action : actions) {
+    for (const auto& row : *action.second) {
+      json.append(prefix);
+      appendRowJSON(json, row);
+      json.append(action.first);
     }
-    std::ostringstream ss;
-    for (auto& event : tree) {
-      pt::write_json(ss, event.second, false);
+  }
+  return Status(0, "OK");
+}
+
+Status serializeScheduledQueryLogItemAsEvents(const ScheduledQueryLogItem& i,
+                                              size_t batch_size,
+                                              const LogBatchWriter& writer) {
+  auto prefix = getLogItemEventPrefix(i);
+  auto actions = getLogItemEventActions(i);
+
+  std::vector<std::string> batch;
+  size_t size = 0;
+  for (const auto& action : actions) {
+    for (const auto& row : *action.second) {
+      std::string event = prefix;
+      appendRowJSON(event, row);
+      event.append(action.first);
+      size += event.size();
+      batch.push_back(std::move(event));
+      if (size >= batch_size) {
+        auto status = writer(batch);
+        if (!status.ok()) {
+          return status;
+        }
+        batch.clear();
+        size = 0;
+      }
     }
-    json = ss.str();
-  } catch (const std::exception& e) {
-    return Status(1, e.what());
+  }
+
+  if (!batch.empty()) {
+    return writer(batch);
   }
   return Status(0, "OK");
 }
 
 Status serializeScheduledQueryLogItemJSON(const ScheduledQueryLogItem& i,
                                           std::string& json) {
-  try {
-    pt::ptree tree;
-    auto s = serializeScheduledQueryLogItem(i, tree);
-    if (!s.ok()) {
-      return s;
-    }
-    std::ostringstream ss;
-    pt::write_json(ss, tree, false);
-    json = ss.str();
-  } catch (const std::exception& e) {
-    return Status(1, e.what());
-  }
+  json.clear();
+  json.append("{\"diffResults\":");
+  appendDiffResultsJSON(json, i.diffResults);
+  json.push_back(',');
+  appendLogItemJSON(json, i);
+  json.append("}\n");
   return Status(0, "OK");
 }
 
@@ -380,4 +1133,178 @@ bool addUniqueRowToQueryData(QueryData& q, const Row& r) {
   q.push_back(r);
   return true;
 }
+
+/////////////////////////////////////////////////////////////////////////////
+// Log frames - a compact binary encoding of log items for logger plugins.
+/////////////////////////////////////////////////////////////////////////////
+
+const unsigned char kLogFrameVersion = 1;
+const unsigned char kLogFrameCompressed = 0x01;
+
+/// The bytes before the version of a log frame.
+const std::string kLogFrameMagic = "OSQF";
+
+/// The bytes before a log item's records, which are not a frame.
+const std::string kLogFrameRecordsMagic = "OSQR";
+
+/// Items of a query encoded before its dictionary is written again.
+const size_t kLogFrameDictionaryInterval = 64;
+
+/// Payloads smaller than this are not compressed.
+const size_t kLogFrameCompressMinimum = 256;
+
+enum LogFrameValue {
+  LOG_FRAME_MISSING = 0,
+  LOG_FRAME_STRING = 1,
+  LOG_FRAME_INTEGER = 2,
+};
+
+/// Check for a decimal integer that is written back as the same string.
+static bool getCanonicalInteger(const std::string& value, int64_t& integer) {
+  size_t start = (!value.empty() && value[0] == '-') ? 1 : 0;
+  if (value.size() == start || value.size() - start > 18 ||
+      (value[start] == '0' && value.size() > 1)) {
+    return false;
+  }
+
+  int64_t magnitude = 0;
+  for (size_t i = start; i < value.size(); ++i) {
+    if (value[i] < '0' || value[i] > '9') {
+      return false;
+    }
+    magnitude = magnitude * 10 + (value[i] - '0');
+  }
+  integer = (start == 1) ? -magnitude : magnitude;
+  return true;
+}
+
+static void putLogFrameRow(std::string& data,
+                           const std::vector<std::string>& columns,
+                           const Row& row) {
+  for (const auto& column : columns) {
+    auto it = row.find(column);
+    int64_t integer = 0;
+    if (it == row.end()) {
+      data.push_back((char)LOG_FRAME_MISSING);
+    } else if (getCanonicalInteger(it->second, integer)) {
+      data.push_back((char)LOG_FRAME_INTEGER);
+      putVarint(data, ((uint64_t)integer << 1) ^ (uint64_t)(integer >> 63));
+    } else {
+      data.push_back((char)LOG_FRAME_STRING);
+      putString(data, it->second);
+    }
+  }
+}
+
+Status serializeLogItemFrameRecords(const ScheduledQueryLogItem& item,
+                                    std::string& records) {
+  // The dictionary is every column of the added and removed rows.
+  std::set<std::string> names;
+  for (const auto* rows :
+       {&item.diffResults.added, &item.diffResults.removed}) {
+    for (const auto& row : *rows) {
+      for (const auto& column : row) {
+        names.insert(column.first);
+      }
+    }
+  }
+  std::vector<std::string> columns(names.begin(), names.end());
+
+  std::string dictionary;
+  dictionary.push_back('D');
+  putString(dictionary, item.name);
+  putVarint(dictionary, columns.size());
+  for (const auto& column : columns) {
+    putString(dictionary, column);
+  }
+
+  records = kLogFrameRecordsMagic;
+  putString(records, item.name);
+  putString(records, dictionary);
+  records.push_back('I');
+  putString(records, item.name);
+  putString(records, item.hostIdentifier);
+  putString(records, item.calendarTime);
+  putVarint(records, (uint32_t)item.unixTime);
+  putVarint(records, item.diffResults.added.size());
+  putVarint(records, item.diffResults.removed.size());
+  for (const auto* rows :
+       {&item.diffResults.added, &item.diffResults.removed}) {
+    for (const auto& row : *rows) {
+      putLogFrameRow(records, columns, row);
+    }
+  }
+  return Status(0, "OK");
+}
+
+bool LogItemFrameEncoder::isRecords(const std::string& records) {
+  return (records.compare(0,
+                          kLogFrameRecordsMagic.size(),
+                          kLogFrameRecordsMagic) == 0);
+}
+
+Status LogItemFrameEncoder::encode(const ScheduledQueryLogItem& item,
+                                   std::string& frame) {
+  std::string records;
+  auto status = serializeLogItemFrameRecords(item, records);
+  if (!status.ok()) {
+    return status;
+  }
+  return encode(records, frame);
+}
+
+Status LogItemFrameEncoder::encode(const std::string& records,
+                                   std::string& frame) {
+  size_t pos = kLogFrameRecordsMagic.size();
+  std::string name, record;
+  if (!isRecords(records) || !getString(records, pos, name) ||
+      !getString(records, pos, record)) {
+    return Status(1, "Invalid log frame records");
+  }
+
+  std::string payload;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& dictionary = dictionaries_[name];
+    if (dictionary.record != record || dictionary.items == 0 ||
+        dictionary.items >= kLogFrameDictionaryInterval) {
+      payload = record;
+      dictionary.record = std::move(record);
+      dictionary.items = 0;
+    }
+    dictionary.items++;
+  }
+  payload.append(records, pos, std::string::npos);
+
+  unsigned char flags = 0;
+  if (compress_ && payload.size() >= kLogFrameCompressMinimum) {
+    auto bound = compressBound(payload.size());
+    std::string compressed(bound, '\0');
+    auto size = (uLongf)bound;
+    if (compress2((Bytef*)&compressed[0],
+                  &size,
+                  (const Bytef*)payload.data(),
+                  payload.size(),
+                  Z_DEFAULT_COMPRESSION) == Z_OK &&
+        size < payload.size()) {
+      std::string deflated;
+      putVarint(deflated, payload.size());
+      deflated.append(compressed, 0, size);
+      payload = std::move(deflated);
+      flags |= kLogFrameCompressed;
+    }
+  }
+
+  frame = kLogFrameMagic;
+  frame.push_back((char)kLogFrameVersion);
+  frame.push_back((char)flags);
+  putVarint(frame, payload.size());
+  frame.append(payload);
+  return Status(0, "OK");
+}
+
+void LogItemFrameEncoder::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  dictionaries_.clear();
+}
 }
@@ -12,10 +12,15 @@
 #include <string>
 #include <vector>
 
+#include <zlib.h>
+
+#include <boost/property_tree/json_parser.hpp>
+
 #include <gtest/gtest.h>
 
 #include <osquery/database/results.h>
 #include <osquery/logger.h>
+#include <osquery/scheduler.h>
 
 #include "osquery/core/test_util.h"
 
@@ -38,6 +43,26 @@ TEST_F(ResultsTests, test_simple_diff) {
   EXPECT_EQ(results.removed, o);
 }
 
+TEST_F(ResultsTests, test_diff_duplicates) {
+  Row r1 = {{"path", "/bin"}, {"size", "1"}};
+  Row r2 = {{"path", "/sbin"}, {"size", "2"}};
+  Row r3 = {{"path", "/usr"}, {"size", "3"}};
+  QueryData o = {r1, r2, r2, r2};
+  QueryData n = {r3, r2, r1, r3};
+
+  auto results = diff(o, n);
+  QueryData added = {r3, r3};
+  QueryData removed = {r2, r2};
+  EXPECT_EQ(results.added, added);
+  EXPECT_EQ(results.removed, removed);
+
+  // Equal rows share a fingerprint, the column names are part of it.
+  EXPECT_EQ(getRowFingerprint(r1), getRowFingerprint(Row(r1)));
+  EXPECT_NE(getRowFingerprint(r1), getRowFingerprint(r2));
+  Row renamed = {{"pathsize", "/bin1"}};
+  EXPECT_NE(getRowFingerprint(r1), getRowFingerprint(renamed));
+}
+
 TEST_F(ResultsTests, test_serialize_row) {
   auto results = getSerializedRow();
   pt::ptree tree;
@@ -47,6 +72,49 @@ TEST_F(ResultsTests, test_serialize_row) {
   EXPECT_EQ(results.first, tree);
 }
 
+TEST_F(ResultsTests, test_serialize_row_json_escapes) {
+  Row r = {{"path", "/usr/bin"},
+           {"quote \"name\"", "a\\b\tc\n\x01"},
+           {"utf8", "caf\xc3\xa9"}};
+  std::string json;
+  EXPECT_TRUE(serializeRowJSON(r, json).ok());
+
+  // The JSON writer escapes values as property_tree does.
+  pt::ptree tree;
+  serializeRow(r, tree);
+  std::ostringstream ss;
+  pt::write_json(ss, tree, false);
+  EXPECT_EQ(json, ss.str());
+
+  Row from_json;
+  EXPECT_TRUE(deserializeRowJSON(json, from_json).ok());
+  EXPECT_EQ(from_json, r);
+}
+
+TEST_F(ResultsTests, test_serialize_row_json_long_escapes) {
+  // Escapes before, within and after vectors of plain bytes.
+  std::string value;
+  for (size_t i = 0; i < 64; ++i) {
+    value += std::string(i % 19, 'x') + "/\"\\\x1f\x7f\xc3\xa9";
+  }
+  Row r = {{"long", value}, {"plain", std::string(100, 'p')}};
+  std::string json;
+  EXPECT_TRUE(serializeRowJSON(r, json).ok());
+
+  pt::ptree tree;
+  serializeRow(r, tree);
+  std::ostringstream ss;
+  pt::write_json(ss, tree, false);
+  EXPECT_EQ(json, ss.str());
+}
+
+TEST_F(ResultsTests, test_serialize_empty_diff_results_json) {
+  DiffResults d;
+  std::string json;
+  EXPECT_TRUE(serializeDiffResultsJSON(d, json).ok());
+  EXPECT_EQ(json, "{\"added\":[],\"removed\":[]}\n");
+}
+
 TEST_F(ResultsTests, test_serialize_query_data) {
   auto results = getSerializedQueryData();
   pt::ptree tree;
@@ -130,6 +198,313 @@ TEST_F(ResultsTests, test_serialize_scheduled_query_log_item_json) {
   EXPECT_EQ(results.first, json);
 }
 
+TEST_F(ResultsTests, test_serialize_unchanged_snapshot_json) {
+  Row r1 = {{"name", "zlib1g"}, {"version", "1.2.8"}};
+  Row r2 = {{"name", "adduser"}, {"version", "3.113"}};
+  Row r3 = {{"name", "adduser"}, {"version", "3.112"}};
+
+  // Snapshot hashes do not depend on the order of the rows.
+  auto hash = getQueryDataFingerprint({r1, r2});
+  EXPECT_EQ(hash, getQueryDataFingerprint({r2, r1}));
+  EXPECT_NE(hash, getQueryDataFingerprint({r1, r3}));
+  EXPECT_NE(hash, getQueryDataFingerprint({r1, r2, r2}));
+  EXPECT_NE(getQueryDataFingerprint({}), getQueryDataFingerprint({Row()}));
+
+  auto item = getSerializedScheduledQueryLogItemJSON().second;
+  std::string json;
+  EXPECT_FALSE(serializeUnchangedSnapshotJSON(item, json).ok());
+
+  item.snapshotHash = "00000000000000ff";
+  EXPECT_TRUE(serializeUnchangedSnapshotJSON(item, json).ok());
+  EXPECT_EQ(json,
+            "{\"name\":\"foobar\",\"hostIdentifier\":\"foobaz\","
+            "\"calendarTime\":\"Mon Aug 25 12:10:57 2014\","
+            "\"unixTime\":\"1408993857\","
+            "\"snapshotHash\":\"00000000000000ff\","
+            "\"action\":\"unchanged\"}\n");
+}
+
+TEST_F(ResultsTests, test_serialize_row_binary) {
+  auto results = getSerializedRow();
+  std::string data;
+  auto s = serializeRowBinary(results.second, data);
+  EXPECT_TRUE(s.ok());
+
+  Row row;
+  s = deserializeRowBinary(data, row);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(row, results.second);
+
+  // Rows stored as JSON are still read.
+  std::string json;
+  serializeRowJSON(results.second, json);
+  row.clear();
+  s = deserializeRowBinary(json, row);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(row, results.second);
+
+  // Truncated values are errors.
+  row.clear();
+  EXPECT_FALSE(deserializeRowBinary(data.substr(0, data.size() - 1), row).ok());
+}
+
+TEST_F(ResultsTests, test_row_encoder) {
+  RowEncoder encoder(4);
+  encoder.add("name", "osquery").add("pid", 1234).add("delta", -56);
+  EXPECT_FALSE(encoder.complete());
+  encoder.add("size", (unsigned long long)18446744073709551615ULL);
+  EXPECT_TRUE(encoder.complete());
+
+  // The encoding reads back as a Row with stringified integers.
+  Row row;
+  EXPECT_TRUE(deserializeRowBinary(encoder.data(), row).ok());
+  Row expected = {{"name", "osquery"},
+                  {"pid", "1234"},
+                  {"delta", "-56"},
+                  {"size", "18446744073709551615"}};
+  EXPECT_EQ(row, expected);
+
+  // Encoding columns in the Row's order is identical to serializing it.
+  std::string data;
+  serializeRowBinary(expected, data);
+  RowEncoder ordered(4);
+  ordered.add("delta", -56).add("name", "osquery").add("pid", 1234);
+  ordered.add("size", 18446744073709551615ULL);
+  EXPECT_EQ(ordered.data(), data);
+}
+
+TEST_F(ResultsTests, test_serialize_historical_query_results_binary) {
+  auto results = getSerializedHistoricalQueryResultsJSON();
+  std::string data;
+  auto s = serializeHistoricalQueryResultsBinary(results.second, data);
+  EXPECT_TRUE(s.ok());
+  EXPECT_LT(data.size(), results.first.size());
+
+  HistoricalQueryResults r;
+  s = deserializeHistoricalQueryResultsBinary(data, r);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(r, results.second);
+
+  HistoricalQueryResults from_json;
+  s = deserializeHistoricalQueryResultsBinary(results.first, from_json);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(from_json, results.second);
+}
+
+TEST_F(ResultsTests, test_compact_query_data) {
+  QueryData q = {
+      {{"name", "osquery"}, {"pid", "1"}},
+      {{"pid", "2"}, {"path", "/bin/sh"}},
+      {},
+  };
+  CompactQueryData compact(q);
+  EXPECT_EQ(compact.schema->size(), 3);
+  ASSERT_EQ(compact.rows.size(), 3);
+  EXPECT_EQ(compact.toQueryData(), q);
+
+  // Rows are read as the equivalent Row, missing columns are not present.
+  const auto& row = compact.rows[1];
+  EXPECT_EQ(row.size(), 2);
+  EXPECT_EQ(row.at("path"), "/bin/sh");
+  EXPECT_EQ(row.find("pid")->second, "2");
+  EXPECT_EQ(row.count("name"), 0);
+  EXPECT_THROW(row.at("name"), std::out_of_range);
+  EXPECT_TRUE(compact.rows[2].empty());
+  EXPECT_TRUE(row == q[1]);
+  EXPECT_FALSE(row == q[0]);
+  EXPECT_EQ(getRowFingerprint(row), getRowFingerprint(q[1]));
+
+  std::vector<std::string> columns;
+  for (const auto& column : compact.rows[0]) {
+    columns.push_back(column.first);
+  }
+  EXPECT_EQ(columns, std::vector<std::string>({"name", "pid"}));
+}
+
+TEST_F(ResultsTests, test_compact_diff) {
+  QueryData o = {
+      {{"pid", "1"}}, {{"pid", "2"}}, {{"pid", "2"}}, {{"pid", "3"}},
+  };
+  QueryData n = {
+      {{"pid", "2"}}, {{"pid", "3"}}, {{"pid", "4"}, {"name", "new"}},
+  };
+  EXPECT_EQ(diff(CompactQueryData(o), n), diff(o, n));
+
+  HistoricalQueryResults stored;
+  stored.mostRecentResults.first = 10;
+  stored.mostRecentResults.second = o;
+  std::string data;
+  serializeHistoricalQueryResultsBinary(stored, data);
+
+  int time = 0;
+  CompactQueryData previous;
+  auto s = deserializeHistoricalQueryResultsBinary(data, time, previous);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(time, 10);
+  EXPECT_EQ(previous.toQueryData(), o);
+  EXPECT_EQ(diff(previous, n), diff(o, n));
+}
+
+TEST_F(ResultsTests, test_serialize_scheduled_query_log_item_as_events) {
+  auto item = getSerializedScheduledQueryLogItem().second;
+  std::string json;
+  EXPECT_TRUE(serializeScheduledQueryLogItemAsEventsJSON(item, json).ok());
+
+  // Batches of events are identical to the events serialized at once.
+  std::vector<std::vector<std::string> > batches;
+  auto writer = [&batches](std::vector<std::string>& batch) {
+    batches.push_back(std::move(batch));
+    return Status(0, "OK");
+  };
+  EXPECT_TRUE(serializeScheduledQueryLogItemAsEvents(item, 1, writer).ok());
+  auto rows = item.diffResults.added.size() + item.diffResults.removed.size();
+  EXPECT_EQ(batches.size(), rows);
+
+  std::string events;
+  for (const auto& batch : batches) {
+    EXPECT_EQ(batch.size(), 1U);
+    for (const auto& event : batch) {
+      events += event;
+    }
+  }
+  EXPECT_EQ(events, json);
+
+  batches.clear();
+  auto status = serializeScheduledQueryLogItemAsEvents(item, 1 << 20, writer);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(batches.size(), 1U);
+  EXPECT_EQ(batches[0].size(), rows);
+
+  // A failed write stops the serialization.
+  size_t writes = 0;
+  status = serializeScheduledQueryLogItemAsEvents(
+      item, 1, [&writes](std::vector<std::string>& batch) {
+        writes++;
+        return Status(1, "failed");
+      });
+  EXPECT_FALSE(status.ok());
+  EXPECT_EQ(writes, 1U);
+}
+
+/// Read a frame's header, returning its flags and payload.
+static bool parseLogFrame(const std::string& frame,
+                          unsigned char& flags,
+                          std::string& payload) {
+  if (frame.size() < 7 || frame.compare(0, 4, "OSQF") != 0 ||
+      (unsigned char)frame[4] != kLogFrameVersion) {
+    return false;
+  }
+  flags = (unsigned char)frame[5];
+  size_t length = 0;
+  size_t i = 6;
+  for (int shift = 0; i < frame.size(); shift += 7) {
+    auto byte = (unsigned char)frame[i++];
+    length |= (size_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  payload = frame.substr(i);
+  return (payload.size() == length);
+}
+
+TEST_F(ResultsTests, test_log_item_frames) {
+  auto item = getSerializedScheduledQueryLogItem().second;
+  LogItemFrameEncoder encoder;
+  std::string frame, payload;
+  unsigned char flags = 0;
+
+  // The first item of a query is preceded by its dictionary.
+  EXPECT_TRUE(encoder.encode(item, frame).ok());
+  ASSERT_TRUE(parseLogFrame(frame, flags, payload));
+  EXPECT_EQ(flags, 0);
+  EXPECT_EQ(payload[0], 'D');
+  EXPECT_NE(payload.find("foobar"), std::string::npos);
+
+  // Later items with the same columns are not.
+  EXPECT_TRUE(encoder.encode(item, frame).ok());
+  ASSERT_TRUE(parseLogFrame(frame, flags, payload));
+  EXPECT_EQ(payload[0], 'I');
+
+  // A new column or a reset writes the dictionary again.
+  item.diffResults.added[0]["new_column"] = "1";
+  EXPECT_TRUE(encoder.encode(item, frame).ok());
+  ASSERT_TRUE(parseLogFrame(frame, flags, payload));
+  EXPECT_EQ(payload[0], 'D');
+  encoder.reset();
+  EXPECT_TRUE(encoder.encode(item, frame).ok());
+  ASSERT_TRUE(parseLogFrame(frame, flags, payload));
+  EXPECT_EQ(payload[0], 'D');
+
+  // Canonical integers are smaller than their strings.
+  EXPECT_EQ(payload.find("1408993857"), std::string::npos);
+}
+
+TEST_F(ResultsTests, test_log_item_frames_compressed) {
+  auto item = getSerializedScheduledQueryLogItem().second;
+  for (size_t i = 0; i < 64; ++i) {
+    item.diffResults.added.push_back({{"path", "/usr/local/bin/osqueryd"}});
+  }
+
+  std::string frame, payload, expected;
+  unsigned char flags = 0;
+  LogItemFrameEncoder plain;
+  EXPECT_TRUE(plain.encode(item, frame).ok());
+  ASSERT_TRUE(parseLogFrame(frame, flags, expected));
+  EXPECT_EQ(flags, 0);
+
+  LogItemFrameEncoder compressed(true);
+  EXPECT_TRUE(compressed.encode(item, frame).ok());
+  ASSERT_TRUE(parseLogFrame(frame, flags, payload));
+  EXPECT_EQ(flags, kLogFrameCompressed);
+  EXPECT_LT(payload.size(), expected.size());
+
+  // The compressed payload is prefixed by its inflated length.
+  ASSERT_GT(payload.size(), 2U);
+  size_t length = ((unsigned char)payload[0] & 0x7f) |
+                  ((size_t)(unsigned char)payload[1] << 7);
+  ASSERT_EQ(length, expected.size());
+  std::string inflated(length, '\0');
+  auto size = (uLongf)length;
+  EXPECT_EQ(uncompress((Bytef*)&inflated[0],
+                       &size,
+                       (const Bytef*)payload.data() + 2,
+                       payload.size() - 2),
+            Z_OK);
+  EXPECT_EQ(inflated, expected);
+}
+
+TEST_F(ResultsTests, test_serialize_query_data_columnar) {
+  QueryData q = {{{"path", "/bin"}, {"size", "1"}},
+                 {{"path", "/bin"}, {"size", "2"}},
+                 {{"path", "/sbin"}}};
+
+  // Repeated values are written once per batch.
+  std::string data;
+  serializeQueryDataColumnar({"path", "size"}, q, 0, q.size(), data);
+  EXPECT_EQ(data.find("/bin"), data.rfind("/bin"));
+
+  QueryData results = {{{"path", "/usr/bin"}}};
+  auto s = deserializeQueryDataColumnar(data, results);
+  EXPECT_TRUE(s.ok());
+  ASSERT_EQ(results.size(), 4);
+  EXPECT_EQ(results[0]["path"], "/usr/bin");
+  EXPECT_EQ(QueryData(results.begin() + 1, results.end()), q);
+
+  // A batch may cover a range of the rows.
+  results.clear();
+  serializeQueryDataColumnar({"path", "size"}, q, 1, 2, data);
+  EXPECT_TRUE(deserializeQueryDataColumnar(data, results).ok());
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0], q[1]);
+
+  // Truncated batches are not appended.
+  results.clear();
+  data.resize(data.size() - 1);
+  EXPECT_FALSE(deserializeQueryDataColumnar(data, results).ok());
+  EXPECT_TRUE(results.empty());
+}
+
 TEST_F(ResultsTests, test_adding_duplicate_rows_to_query_data) {
   Row r1, r2, r3;
   r1["foo"] = "bar";
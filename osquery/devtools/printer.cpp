@@ -135,6 +135,69 @@ void jsonPrint(const QueryData& q) {
   printf("\n]\n");
 }
 
+void PrettyPrinter::begin(const std::vector<std::string>& order,
+                          size_t sample_rows) {
+  order_ = order;
+  sample_rows_ = sample_rows;
+  sample_.clear();
+  lengths_.clear();
+  begun_ = true;
+  printing_ = false;
+}
+
+void PrettyPrinter::addRow(const Row& r) {
+  if (!printing_) {
+    sample_.push_back(r);
+    if (sample_rows_ > 0 && sample_.size() >= sample_rows_) {
+      printSample();
+    }
+    return;
+  }
+
+  // A value wider than its column widens it and re-prints the header.
+  bool wider = false;
+  for (const auto& it : r) {
+    int s = utf8StringSize(it.second);
+    if (s > lengths_[it.first]) {
+      lengths_[it.first] = s;
+      wider = true;
+    }
+  }
+
+  if (wider) {
+    separator_ = generateSeparator(lengths_, order_);
+    out_ << separator_ << generateHeader(lengths_, order_) << separator_;
+  }
+  out_ << generateRow(r, lengths_, order_);
+}
+
+void PrettyPrinter::printSample() {
+  lengths_ = computeQueryDataLengths(sample_);
+  separator_ = generateSeparator(lengths_, order_);
+  out_ << "\n" << separator_ << generateHeader(lengths_, order_) << separator_;
+  for (const auto& r : sample_) {
+    out_ << generateRow(r, lengths_, order_);
+  }
+  out_.flush();
+
+  sample_.clear();
+  printing_ = true;
+}
+
+void PrettyPrinter::finish() {
+  if (!printing_ && sample_.size() > 0) {
+    printSample();
+  }
+
+  if (printing_) {
+    out_ << separator_;
+    out_.flush();
+  }
+  sample_.clear();
+  begun_ = false;
+  printing_ = false;
+}
+
 std::map<std::string, int> computeQueryDataLengths(const QueryData& q) {
   std::map<std::string, int> results;
 
@@ -8,6 +8,8 @@
  *
  */
 
+#include <sstream>
+
 #include <gtest/gtest.h>
 
 #include <osquery/devtools.h>
@@ -147,6 +149,42 @@ TEST_F(PrinterTests, test_unicode) {
 )";
   EXPECT_EQ(result, expected);
 }
+
+TEST_F(PrinterTests, test_pretty_printer) {
+  // Without a sample size every row is held and printed as beautify does.
+  std::ostringstream buffered;
+  PrettyPrinter printer(buffered);
+  printer.begin(order, 0);
+  for (const auto& r : q) {
+    printer.addRow(r);
+  }
+  EXPECT_EQ(buffered.str(), "");
+  printer.finish();
+  EXPECT_EQ(buffered.str(), beautify(q, order));
+  EXPECT_FALSE(printer.begun());
+
+  // Columns are sized from the first two rows, the third widens "age".
+  std::ostringstream streamed;
+  PrettyPrinter streaming(streamed);
+  streaming.begin(order, 2);
+  for (const auto& r : q) {
+    streaming.addRow(r);
+  }
+  streaming.finish();
+  std::string expected = R"(
++------------+-----+-------------------------+--------------+
+| name       | age | favorite_food           | lucky_number |
++------------+-----+-------------------------+--------------+
+| Mike Jones | 39  | mac and cheese          | 1            |
+| John Smith | 44  | peanut butter and jelly | 2            |
++------------+------+-------------------------+--------------+
+| name       | age  | favorite_food           | lucky_number |
++------------+------+-------------------------+--------------+
+| Doctor Who | 2000 | fish sticks and custard | 11           |
++------------+------+-------------------------+--------------+
+)";
+  EXPECT_EQ(streamed.str(), expected);
+}
 }
 
 int main(int argc, char* argv[]) {
@@ -0,0 +1,174 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+#include <sys/resource.h>
+
+#include <boost/algorithm/string/join.hpp>
+
+#include <osquery/config.h>
+#include <osquery/devtools.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+#include <osquery/sql.h>
+
+#include "osquery/sql/sqlite_util.h"
+#include "osquery/sql/virtual_table.h"
+
+namespace osquery {
+
+DEFINE_shell_flag(bool,
+                  profile_schedule,
+                  false,
+                  "Run each scheduled query once and report its cost");
+
+DEFINE_shell_flag(int32,
+                  profile_budget_ms,
+                  1000,
+                  "CPU ms per hour a scheduled query may use (0 off)");
+
+void getIOCounters(size_t& bytes, size_t& syscalls) {
+  bytes = 0;
+  syscalls = 0;
+#ifdef __linux__
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  size_t value = 0;
+  while (io >> key >> value) {
+    if (key == "rchar:" || key == "wchar:") {
+      bytes += value;
+    } else if (key == "syscr:" || key == "syscw:") {
+      syscalls += value;
+    }
+  }
+#endif
+}
+
+/// The user and system CPU milliseconds used by this process.
+static double getCPUTime() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+Status measureQueryCost(const OsqueryScheduledQuery& query, QueryCost& cost) {
+  cost.name = query.name;
+  cost.interval = query.interval;
+
+  QueryPlan plan;
+  auto status = getQueryPlan(query.query, plan);
+  if (!status.ok()) {
+    return status;
+  }
+  cost.scans = plan.scans;
+
+  // Each query generates its tables, as if it ran alone.
+  tables::TableResultCache::reset();
+  auto dbc = SQLiteDBManager::get();
+  auto profile = std::make_shared<tables::QueryProfile>();
+  tables::setQueryProfile(dbc->db(), profile);
+
+  size_t bytes_start, syscalls_start;
+  getIOCounters(bytes_start, syscalls_start);
+  auto cpu_start = getCPUTime();
+  auto start = std::chrono::steady_clock::now();
+
+  QueryData results;
+  status = queryInternal(query.query, results, dbc->db());
+
+  cost.wall_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start).count() /
+                 1000.0;
+  cost.cpu_ms = getCPUTime() - cpu_start;
+  getIOCounters(cost.io_bytes, cost.syscalls);
+  cost.io_bytes -= bytes_start;
+  cost.syscalls -= syscalls_start;
+  tables::setQueryProfile(dbc->db(), nullptr);
+
+  cost.rows = results.size();
+  cost.tables = *profile;
+  cost.hourly_cpu_ms = cost.cpu_ms * 3600 / std::max(query.interval, 1);
+  return status;
+}
+
+int profileScheduledQueries() {
+  std::vector<std::string> order = {"name",
+                                    "interval",
+                                    "wall_ms",
+                                    "cpu_ms",
+                                    "cpu_ms_per_hour",
+                                    "rows",
+                                    "io_bytes",
+                                    "syscalls",
+                                    "full_scans",
+                                    "over_budget"};
+  std::vector<std::string> table_order = {"query",
+                                          "table",
+                                          "filters",
+                                          "constraints",
+                                          "generate_ms",
+                                          "rows",
+                                          "returned",
+                                          "bytes"};
+
+  PrettyPrinter queries(std::cout);
+  queries.begin(order, 0);
+  QueryData tables;
+  int expensive = 0;
+  for (const auto& query : Config::getInstance()->getScheduledQueries()) {
+    QueryCost cost;
+    auto status = measureQueryCost(query, cost);
+    if (!status.ok()) {
+      LOG(ERROR) << "Error running query " << query.name << ": "
+                 << status.toString();
+      expensive++;
+      continue;
+    }
+
+    bool over_budget = FLAGS_profile_budget_ms > 0 &&
+                       cost.hourly_cpu_ms > FLAGS_profile_budget_ms;
+    if (over_budget) {
+      expensive++;
+    }
+
+    queries.addRow({{"name", cost.name},
+                    {"interval", INTEGER(cost.interval)},
+                    {"wall_ms", INTEGER((size_t)cost.wall_ms)},
+                    {"cpu_ms", INTEGER((size_t)cost.cpu_ms)},
+                    {"cpu_ms_per_hour", INTEGER((size_t)cost.hourly_cpu_ms)},
+                    {"rows", INTEGER(cost.rows)},
+                    {"io_bytes", INTEGER(cost.io_bytes)},
+                    {"syscalls", INTEGER(cost.syscalls)},
+                    {"full_scans", boost::join(cost.scans, ",")},
+                    {"over_budget", (over_budget) ? "yes" : "no"}});
+    for (const auto& table : cost.tables) {
+      tables.push_back(
+          {{"query", cost.name},
+           {"table", table.first},
+           {"filters", INTEGER(table.second.filters)},
+           {"constraints", boost::join(table.second.constraints, ",")},
+           {"generate_ms", INTEGER(table.second.generate_us / 1000)},
+           {"rows", INTEGER(table.second.rows)},
+           {"returned", INTEGER(table.second.returned)},
+           {"bytes", INTEGER(table.second.bytes)}});
+    }
+  }
+  queries.finish();
+  prettyPrint(tables, table_order);
+
+  // A non-zero exit lets a deployment pipeline reject expensive queries.
+  return (expensive > 0) ? 1 : 0;
+}
+}
@@ -0,0 +1,76 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <set>
+
+#include <gtest/gtest.h>
+
+#include <osquery/devtools.h>
+#include <osquery/logger.h>
+#include <osquery/registry.h>
+#include <osquery/tables.h>
+
+namespace osquery {
+
+class ProfilerTests : public testing::Test {};
+
+class profiledTablePlugin : public tables::TablePlugin {
+ private:
+  tables::TableColumns columns() { return {{"path", "TEXT"}}; }
+
+  tables::TableColumnOptions columnOptions() {
+    return {{"path", tables::COLUMN_INDEX}};
+  }
+
+  QueryData generate(tables::QueryContext& request) {
+    QueryData results;
+    auto paths = request.constraints["path"].getAll(tables::EQUALS);
+    for (const auto& path : paths) {
+      results.push_back({{"path", path}});
+    }
+    if (results.empty()) {
+      results.push_back({{"path", "scanned"}});
+    }
+    return results;
+  }
+};
+
+TEST_F(ProfilerTests, test_measure_query_cost) {
+  Registry::add<profiledTablePlugin>("table", "profiled");
+  OsqueryScheduledQuery query;
+  query.name = "profiled";
+  query.query = "SELECT * FROM profiled WHERE path = 'a'";
+  query.interval = 60;
+
+  QueryCost cost;
+  ASSERT_TRUE(measureQueryCost(query, cost).ok());
+  EXPECT_EQ(cost.name, "profiled");
+  EXPECT_EQ(cost.rows, 1U);
+  EXPECT_TRUE(cost.scans.empty());
+  EXPECT_EQ(cost.tables["profiled"].filters, 1U);
+  // The generator was given the equality constraint.
+  EXPECT_EQ(cost.tables["profiled"].constraints,
+            std::set<std::string>({"path ="}));
+
+  // A constraint SQLite cannot pass to the table is a full scan.
+  query.query = "SELECT * FROM profiled WHERE length(path) > 1";
+  cost = QueryCost();
+  ASSERT_TRUE(measureQueryCost(query, cost).ok());
+  EXPECT_EQ(cost.rows, 1U);
+  EXPECT_EQ(cost.scans, std::vector<std::string>({"profiled"}));
+  EXPECT_TRUE(cost.tables["profiled"].constraints.empty());
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -29,6 +29,7 @@
 #define _LARGEFILE_SOURCE 1
 #endif
 
+#include <algorithm>
 #include <iostream>
 #include <stdlib.h>
 #include <string.h>
@@ -84,11 +85,13 @@
 #include <osquery/devtools.h>
 #include <osquery/flags.h>
 
+#include "osquery/sql/sqlite_util.h"
 #include "osquery/sql/virtual_table.h"
 
 // Json is a specific form of pretty printing.
 namespace osquery {
 DECLARE_bool(json);
+DECLARE_int32(pretty_rows);
 }
 
 /* Make sure isatty() has a prototype.
@@ -117,6 +120,9 @@ extern int pclose(FILE *);
 /* True if the timer is enabled */
 static int enableTimer = 0;
 
+/* True if each statement's virtual tables are profiled */
+static int enableProfile = 0;
+
 /* Return the current wall-clock time */
 static sqlite3_int64 timeOfDay(void) {
   static sqlite3_vfs *clockVfs = 0;
@@ -479,8 +485,13 @@ struct previous_mode_data {
 ** Pretty print structure
  */
 struct prettyprint_data {
-  osquery::QueryData queryData;
   std::vector<std::string> resultsOrder;
+  /* Prints rows as they are returned, unless printing JSON */
+  osquery::PrettyPrinter printer{std::cout};
+  /* Buffered output of the JSON and CSV modes, written to out */
+  std::string output;
+  /* Number of rows in the JSON array so far */
+  size_t jsonRows{0};
 };
 
 /*
@@ -536,6 +547,7 @@ struct callback_data {
 #define MODE_Csv 7 /* Quote strings, numbers are plain */
 #define MODE_Explain 8 /* Like MODE_Column, but do not truncate data */
 #define MODE_Pretty 9 /* Pretty print the SQL results */
+#define MODE_Json 10 /* One JSON object per line */
 
 static const char *modeDescr[] = {
     "line",
@@ -548,6 +560,7 @@ static const char *modeDescr[] = {
     "csv",
     "explain",
     "pretty",
+    "json",
 };
 
 /*
@@ -956,9 +969,9 @@ static const char needCsvQuote[] = {
 ** the null value.  Strings are quoted if necessary.
 */
 static void output_csv(struct callback_data *p, const char *z, int bSep) {
-  FILE *out = p->out;
+  std::string &out = p->prettyPrint->output;
   if (z == 0) {
-    fprintf(out, "%s", p->nullvalue);
+    out.append(p->nullvalue);
   } else {
     int i;
     int nSep = strlen30(p->separator);
@@ -971,19 +984,52 @@ static void output_csv(struct callback_data *p, const char *z, int bSep) {
       }
     }
     if (i == 0) {
-      putc('"', out);
+      out.push_back('"');
       for (i = 0; z[i]; i++) {
         if (z[i] == '"')
-          putc('"', out);
-        putc(z[i], out);
+          out.push_back('"');
+        out.push_back(z[i]);
       }
-      putc('"', out);
+      out.push_back('"');
     } else {
-      fprintf(out, "%s", z);
+      out.append(z);
     }
   }
   if (bSep) {
-    fprintf(p->out, "%s", p->separator);
+    out.append(p->separator);
+  }
+}
+
+/*
+** Append a row as a JSON object of string values, in column order.
+** NULL values are written as empty strings.
+*/
+static void output_json(struct callback_data *p,
+                        int nArg,
+                        char **azArg,
+                        char **azCol) {
+  std::string &out = p->prettyPrint->output;
+  out.push_back('{');
+  for (int i = 0; i < nArg; i++) {
+    if (i > 0) {
+      out.push_back(',');
+    }
+    osquery::appendJSONString(out, azCol[i] ? azCol[i] : "");
+    out.push_back(':');
+    osquery::appendJSONString(out, azArg[i] ? azArg[i] : "");
+  }
+  out.push_back('}');
+}
+
+/*
+** Write the buffered JSON and CSV output. Unless forced it is only written
+** once enough has been buffered.
+*/
+static void flush_output(struct callback_data *p, bool force) {
+  std::string &out = p->prettyPrint->output;
+  if (out.size() > 0 && (force || out.size() >= 64 * 1024)) {
+    fwrite(out.data(), 1, out.size(), p->out);
+    out.clear();
   }
 }
 
@@ -1031,9 +1077,23 @@ static int shell_callback(
       }
     }
 
+    if (osquery::FLAGS_json) {
+      /* rows of every statement are written to a single JSON array */
+      p->prettyPrint->output.append(
+          p->prettyPrint->jsonRows++ == 0 ? "[\n  " : ",\n  ");
+      output_json(p, nArg, azArg, azCol);
+      flush_output(p, false);
+      break;
+    }
+
     osquery::Row r;
     callback_row(nArg, azArg, azCol, r);
-    p->prettyPrint->queryData.push_back(r);
+    auto &printer = p->prettyPrint->printer;
+    if (!printer.begun()) {
+      printer.begin(p->prettyPrint->resultsOrder,
+                    (size_t)std::max(osquery::FLAGS_pretty_rows, 0));
+    }
+    printer.addRow(r);
     break;
   }
   case MODE_Line: {
@@ -1220,14 +1280,23 @@ static int shell_callback(
       for (i = 0; i < nArg; i++) {
         output_csv(p, azCol[i] ? azCol[i] : "", i < nArg - 1);
       }
-      fprintf(p->out, "\n");
+      p->prettyPrint->output.push_back('\n');
     }
     if (azArg == 0)
       break;
     for (i = 0; i < nArg; i++) {
       output_csv(p, azArg[i], i < nArg - 1);
     }
-    fprintf(p->out, "\n");
+    p->prettyPrint->output.push_back('\n');
+    flush_output(p, false);
+    break;
+  }
+  case MODE_Json: {
+    if (azArg == 0)
+      break;
+    output_json(p, nArg, azArg, azCol);
+    p->prettyPrint->output.push_back('\n');
+    flush_output(p, false);
     break;
   }
   case MODE_Insert: {
@@ -1671,6 +1740,32 @@ static void explain_data_delete(struct callback_data *p) {
   p->iIndent = 0;
 }
 
+/*
+** Print the cost of a profiled statement and each virtual table it used.
+*/
+static void display_profile(struct callback_data *pArg,
+                            const osquery::tables::QueryProfile &profile,
+                            sqlite3_int64 iBegin,
+                            size_t nRows,
+                            sqlite3_int64 iMemory) {
+  fprintf(pArg->out,
+          "Profile: real %.3f rows %zu sqlite_peak_bytes %lld\n",
+          (timeOfDay() - iBegin) * 0.001,
+          nRows,
+          sqlite3_memory_highwater(0) - iMemory);
+  for (const auto &table : profile) {
+    fprintf(pArg->out,
+            "  %s: filters %zu generate %.3f rows %zu returned %zu "
+            "bytes %zu\n",
+            table.first.c_str(),
+            table.second.filters,
+            table.second.generate_us * 0.000001,
+            table.second.rows,
+            table.second.returned,
+            table.second.bytes);
+  }
+}
+
 /*
 ** Execute a statement or set of statements.  Print
 ** any result rows/columns depending on the current mode
@@ -1693,6 +1788,10 @@ static int shell_exec(
   int rc = SQLITE_OK; /* Return Code */
   int rc2;
   const char *zLeftover; /* Tail of unprocessed SQL */
+  osquery::tables::QueryProfileRef profile; /* Set if enableProfile */
+  sqlite3_int64 iProfileBegin = 0; /* Wall-clock time of the statement */
+  sqlite3_int64 iProfileMemory = 0; /* SQLite memory before the statement */
+  size_t nRows = 0; /* Rows returned by the statement */
 
   if (pzErrMsg) {
     *pzErrMsg = NULL;
@@ -1719,6 +1818,16 @@ static int shell_exec(
         pArg->cnt = 0;
       }
 
+      /* profile the virtual tables used by the statement if profile on */
+      if (pArg && enableProfile) {
+        profile = std::make_shared<osquery::tables::QueryProfile>();
+        osquery::tables::setQueryProfile(db, profile);
+        nRows = 0;
+        iProfileMemory = sqlite3_memory_used();
+        sqlite3_memory_highwater(1);
+        iProfileBegin = timeOfDay();
+      }
+
       /* echo the sql statement if echo on */
       if (pArg && pArg->echoOn) {
         const char *zStmtSql = sqlite3_sql(pStmt);
@@ -1799,6 +1908,7 @@ static int shell_exec(
               /* if data and types extracted successfully... */
               if (SQLITE_ROW == rc) {
                 /* call the supplied callback with the result row data */
+                nRows++;
                 if (xCallback(pArg, nCol, azVals, azCols, aiTypes)) {
                   rc = SQLITE_ABORT;
                 } else {
@@ -1817,6 +1927,22 @@ static int shell_exec(
 
       explain_data_delete(pArg);
 
+      /* finish the pretty printed table of this statement's results */
+      if (pArg && pArg->mode == MODE_Pretty && !osquery::FLAGS_json) {
+        pArg->prettyPrint->printer.finish();
+        pArg->prettyPrint->resultsOrder.clear();
+      }
+      if (pArg) {
+        flush_output(pArg, true);
+      }
+
+      /* print the virtual table costs if profile on */
+      if (profile != nullptr) {
+        osquery::tables::setQueryProfile(db, nullptr);
+        display_profile(pArg, *profile, iProfileBegin, nRows, iProfileMemory);
+        profile = nullptr;
+      }
+
       /* print usage stats if stats on */
       if (pArg && pArg->statsOn) {
         display_stats(db, pArg, 0);
@@ -1845,14 +1971,18 @@ static int shell_exec(
 
   if (pArg->mode == MODE_Pretty) {
     if (osquery::FLAGS_json) {
-      osquery::jsonPrint(pArg->prettyPrint->queryData);
+      auto &output = pArg->prettyPrint->output;
+      output.append(pArg->prettyPrint->jsonRows == 0 ? "[\n\n]\n" : "\n]\n");
+      pArg->prettyPrint->jsonRows = 0;
     } else {
-      osquery::prettyPrint(pArg->prettyPrint->queryData,
-                           pArg->prettyPrint->resultsOrder);
+      /* a statement interrupted by an error may not have finished */
+      pArg->prettyPrint->printer.finish();
     }
-    pArg->prettyPrint->queryData.clear();
     pArg->prettyPrint->resultsOrder.clear();
   }
+  if (pArg) {
+    flush_output(pArg, true);
+  }
 
   return rc;
 }
@@ -2033,6 +2163,7 @@ static char zHelp[] =
     "                         insert   SQL insert statements for TABLE\n"
     "                         line     One value per line\n"
     "                         list     Values delimited by .separator string\n"
+    "                         json     One JSON object per line\n"
     "                         pretty   Pretty printed SQL results\n"
     "                         tabs     Tab-separated values\n"
     "                         tcl      TCL list elements\n"
@@ -2041,6 +2172,8 @@ static char zHelp[] =
     ".output FILENAME       Send output to FILENAME\n"
     ".output stdout         Send output to the screen\n"
     ".print STRING...       Print literal STRING\n"
+    ".profile ON|OFF        Print the cost of each virtual table a statement\n"
+    "                         uses: generate time, rows, and bytes\n"
     ".prompt MAIN CONTINUE  Replace the standard prompts\n"
     ".quit                  Exit this program\n"
     ".read FILENAME         Execute SQL in FILENAME\n"
@@ -2079,6 +2212,7 @@ static void open_db(struct callback_data *p, int keepAlive) {
     if (db && sqlite3_errcode(db) == SQLITE_OK) {
       sqlite3_create_function(
           db, "shellstatic", 0, SQLITE_UTF8, 0, shellstaticFunc, 0, 0);
+      osquery::registerSQLiteFunctions(db);
       osquery::tables::attachVirtualTables(db);
     }
     if (db == 0 || SQLITE_OK != sqlite3_errcode(db)) {
@@ -3124,6 +3258,8 @@ static int do_meta_command(char *zLine, struct callback_data *p) {
       p->mode = MODE_List;
     } else if (n2 == 6 && strncmp(azArg[1], "pretty", n2) == 0) {
       p->mode = MODE_Pretty;
+    } else if (n2 == 4 && strncmp(azArg[1], "json", n2) == 0) {
+      p->mode = MODE_Json;
     } else if (n2 == 4 && strncmp(azArg[1], "html", n2) == 0) {
       p->mode = MODE_Html;
     } else if (n2 == 3 && strncmp(azArg[1], "tcl", n2) == 0) {
@@ -3141,7 +3277,7 @@ static int do_meta_command(char *zLine, struct callback_data *p) {
     } else {
       fprintf(stderr,
               "Error: mode should be one of: "
-              "column csv html insert line list tabs tcl pretty\n");
+              "column csv html insert json line list tabs tcl pretty\n");
       rc = 1;
     }
   } else if (c == 'm' && strncmp(azArg[0], "mode", n) == 0 && nArg == 3) {
@@ -3216,6 +3352,9 @@ static int do_meta_command(char *zLine, struct callback_data *p) {
       fprintf(p->out, "%s", azArg[i]);
     }
     fprintf(p->out, "\n");
+  } else if (c == 'p' && n >= 4 && strncmp(azArg[0], "profile", n) == 0 &&
+             nArg == 2) {
+    enableProfile = booleanValue(azArg[1]);
   } else if (c == 'p' && strncmp(azArg[0], "prompt", n) == 0 &&
              (nArg == 2 || nArg == 3)) {
     if (nArg >= 2) {
@@ -3462,6 +3601,14 @@ static int do_meta_command(char *zLine, struct callback_data *p) {
       }
     }
     sqlite3_finalize(pStmt);
+#if OSQUERY_EPONYMOUS_TABLES
+    // osquery tables are not in a schema until a statement first uses them.
+    for (const auto &name : osquery::Registry::names("table")) {
+      zSql = sqlite3_mprintf(
+          "%z UNION SELECT %Q WHERE %Q LIKE ?1", zSql, name.c_str(),
+          name.c_str());
+    }
+#endif
     zSql = sqlite3_mprintf("%z ORDER BY 1", zSql);
     rc = sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, 0);
     sqlite3_free(zSql);
@@ -4021,6 +4168,7 @@ static const char zOptions[] =
     "   -column              set output mode to 'column'\n"
     "   -cmd COMMAND         run \"COMMAND\" before reading stdin\n"
     "   -csv                 set output mode to 'csv'\n"
+    "   -jsonl               set output mode to JSON lines\n"
     "   -echo                print commands before execution\n"
     "   -init FILENAME       read/process named file\n"
     "   -[no]header          turn headers on or off\n"
@@ -4114,7 +4262,12 @@ DEFINE_shell_flag(bool, column, false, "set output mode to 'column'");
 DEFINE_shell_flag(string, cmd, "", "run \"COMMAND\" before reading stdin");
 DEFINE_shell_flag(bool, csv, false, "set output mode to 'csv'");
 DEFINE_shell_flag(bool, json, false, "set output mode to 'json'");
+DEFINE_shell_flag(bool, jsonl, false, "set output mode to JSON lines");
 DEFINE_shell_flag(bool, echo, false, "print commands before execution");
+DEFINE_shell_flag(int32,
+                  pretty_rows,
+                  100,
+                  "size pretty columns from N rows, 0 for every row");
 DEFINE_shell_flag(string, init, "", "read/process named file");
 DEFINE_shell_flag(bool, header, true, "turn headers on or off");
 DEFINE_shell_flag(bool, html, false, "set output mode to HTML");
@@ -4302,6 +4455,8 @@ int launchIntoShell(int argc, char **argv) {
       data.mode = MODE_List;
     } else if (strcmp(z, "-pretty") == 0) {
       data.mode = MODE_Pretty;
+    } else if (strcmp(z, "-jsonl") == 0) {
+      data.mode = MODE_Json;
     } else if (strcmp(z, "-line") == 0) {
       data.mode = MODE_Line;
     } else if (strcmp(z, "-column") == 0) {
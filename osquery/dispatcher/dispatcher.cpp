@@ -8,12 +8,13 @@
  *
  */
 
+#include <chrono>
+
+#include <osquery/core.h>
 #include <osquery/dispatcher.h>
 #include <osquery/flags.h>
 #include <osquery/logger.h>
 
-#include "osquery/core/conversions.h"
-
 using namespace apache::thrift::concurrency;
 
 namespace osquery {
@@ -24,77 +25,260 @@ DEFINE_osquery_flag(int32,
                     4,
                     "The number of threads to use for the work dispatcher");
 
+/// The index of the Dispatcher worker running on this thread, or -1.
+static __thread int kCurrentWorker = -1;
+
+const size_t Dispatcher::kMaxWorkers;
+
 Dispatcher& Dispatcher::getInstance() {
   static Dispatcher d;
   return d;
 }
 
-Dispatcher::Dispatcher() {
-#ifdef FBOSQUERY
-  thread_manager_ = ThreadManager::newSimpleThreadManager(
-      (size_t)FLAGS_worker_threads, 0);
-  auto threadFactory =
-      std::shared_ptr<PosixThreadFactory>(new PosixThreadFactory());
-#else
-  thread_manager_ = boost_to_std_shared_ptr(
-      ThreadManager::newSimpleThreadManager((size_t)FLAGS_worker_threads, 0));
-  auto threadFactory =
-      boost::shared_ptr<PosixThreadFactory>(new PosixThreadFactory());
-#endif
-  thread_manager_->threadFactory(threadFactory);
-  thread_manager_->start();
+Dispatcher::Dispatcher()
+    : started_(0),
+      shared_count_(0),
+      state_(ThreadManager::STARTED),
+      queued_(0),
+      running_(0),
+      idle_(0),
+      active_(0),
+      retiring_(0) {
+  for (size_t i = 0; i < kMaxWorkers; ++i) {
+    workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+  }
+  addWorker((size_t)std::max(FLAGS_worker_threads, 1));
 }
 
+Dispatcher::~Dispatcher() { stop(); }
+
 Status Dispatcher::add(std::shared_ptr<Runnable> task) {
-  try {
-#ifdef FBOSQUERY
-    thread_manager_->add(task, 0, 0);
-#else
-    thread_manager_->add(std_to_boost_shared_ptr(task), 0, 0);
-#endif
-  } catch (std::exception& e) {
-    return Status(1, e.what());
+  if (task == nullptr) {
+    return Status(1, "Cannot add an empty task");
+  }
+  return add(DispatcherTask([task]() { task->run(); }));
+}
+
+Status Dispatcher::add(DispatcherTask&& task) {
+  if (!task) {
+    return Status(1, "Cannot add an empty task");
+  }
+
+  int index = kCurrentWorker;
+  if (index >= 0) {
+    // Workers push to their own deque, the newest task is run first.
+    auto& worker = *workers_[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.tasks.push_back(std::move(task));
+    queued_++;
+  } else {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != ThreadManager::STARTED) {
+      return Status(1, "The dispatcher is not accepting tasks");
+    }
+    shared_.push_back(std::move(task));
+    shared_count_++;
+    queued_++;
+  }
+
+  // A worker checks queued_ after announcing it is idle, see work.
+  if (idle_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake_.notify_one();
   }
   return Status(0, "OK");
 }
 
-std::shared_ptr<ThreadManager> Dispatcher::getThreadManager() {
-  return thread_manager_;
+bool Dispatcher::take(int index, DispatcherTask& task) {
+  if (index >= 0) {
+    auto& worker = *workers_[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (!worker.tasks.empty()) {
+      task = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    }
+  }
+
+  if (!task && shared_count_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!shared_.empty()) {
+      task = std::move(shared_.front());
+      shared_.pop_front();
+      shared_count_--;
+    }
+  }
+
+  // Steal the oldest task of another worker.
+  size_t count = started_;
+  for (size_t i = 1; !task && i <= count; ++i) {
+    size_t victim = (index + i) % count;
+    if ((int)victim == index) {
+      continue;
+    }
+    auto& worker = *workers_[victim];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (!worker.tasks.empty()) {
+      task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    }
+  }
+
+  if (!task) {
+    return false;
+  }
+  // The task is counted as running before it is no longer queued.
+  running_++;
+  queued_--;
+  return true;
 }
 
-void Dispatcher::join() { thread_manager_->join(); }
+void Dispatcher::run(DispatcherTask& task) {
+  try {
+    task();
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Dispatcher task failed: " << e.what();
+  }
+  running_--;
+}
 
-ThreadManager::STATE Dispatcher::state() const {
-  return thread_manager_->state();
+bool Dispatcher::runPending() {
+  DispatcherTask task;
+  if (!take(kCurrentWorker, task)) {
+    return false;
+  }
+  run(task);
+  return true;
 }
 
-void Dispatcher::addWorker(size_t value) { thread_manager_->addWorker(value); }
+void Dispatcher::work(size_t index) {
+  kCurrentWorker = (int)index;
+  auto policy = setThreadPolicy(kDispatcherThread);
+  if (!policy.ok() && index == 0) {
+    // Workers share a policy, only the first reports a failure.
+    LOG(WARNING) << "Worker thread policy not applied: " << policy.what();
+  }
+  while (true) {
+    DispatcherTask task;
+    if (take((int)index, task)) {
+      run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (state_ == ThreadManager::STOPPING) {
+      break;
+    } else if (retiring_ > 0) {
+      retiring_--;
+      break;
+    }
 
-void Dispatcher::removeWorker(size_t value) {
-  thread_manager_->removeWorker(value);
+    idle_++;
+    wake_.wait(lock, [this]() {
+      return queued_ > 0 || retiring_ > 0 ||
+             state_ == ThreadManager::STOPPING;
+    });
+    idle_--;
+  }
+  active_--;
 }
 
-size_t Dispatcher::idleWorkerCount() const {
-  return thread_manager_->idleWorkerCount();
+void Dispatcher::join() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != ThreadManager::STARTED) {
+      return;
+    }
+    state_ = ThreadManager::JOINING;
+  }
+
+  // Run the pending tasks, including tasks added while they run.
+  while (queued_ > 0 || running_ > 0) {
+    if (!runPending()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  stop();
 }
 
-size_t Dispatcher::workerCount() const {
-  return thread_manager_->workerCount();
+void Dispatcher::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ == ThreadManager::STOPPED) {
+      return;
+    }
+    state_ = ThreadManager::STOPPING;
+    wake_.notify_all();
+  }
+
+  for (size_t i = 0; i < started_; ++i) {
+    auto& thread = workers_[i]->thread;
+    if (thread.get_id() == std::this_thread::get_id()) {
+      // A worker stopping the dispatcher cannot join itself.
+      thread.detach();
+    } else if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  state_ = ThreadManager::STOPPED;
 }
 
-size_t Dispatcher::pendingTaskCount() const {
-  return thread_manager_->pendingTaskCount();
+ThreadManager::STATE Dispatcher::state() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return state_;
 }
 
-size_t Dispatcher::totalTaskCount() const {
-  return thread_manager_->totalTaskCount();
+void Dispatcher::addWorker(size_t value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < value; ++i) {
+    size_t index = started_;
+    if (index >= kMaxWorkers) {
+      LOG(WARNING) << "The dispatcher cannot start more than " << kMaxWorkers
+                   << " workers";
+      break;
+    }
+    active_++;
+    workers_[index]->thread = std::thread(&Dispatcher::work, this, index);
+    started_++;
+  }
+}
+
+void Dispatcher::removeWorker(size_t value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  retiring_ = std::min(retiring_ + value, (size_t)active_);
+  wake_.notify_all();
 }
 
-size_t Dispatcher::pendingTaskCountMax() const {
-  return thread_manager_->pendingTaskCountMax();
+size_t Dispatcher::idleWorkerCount() const { return idle_; }
+
+size_t Dispatcher::workerCount() const { return active_; }
+
+size_t Dispatcher::pendingTaskCount() const { return queued_; }
+
+size_t Dispatcher::totalTaskCount() const { return queued_ + running_; }
+
+size_t Dispatcher::pendingTaskCountMax() const { return 0; }
+
+size_t Dispatcher::expiredTaskCount() const { return 0; }
+
+void TaskGroup::wait() {
+  while (pending_ > 0) {
+    if (!Dispatcher::getInstance().runPending()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      complete_.wait_for(lock, std::chrono::milliseconds(1), [this]() {
+        return pending_ == 0;
+      });
+    }
+  }
+  // The last done() may still hold the lock, the group must outlive it.
+  std::lock_guard<std::mutex> lock(mutex_);
 }
 
-size_t Dispatcher::expiredTaskCount() const {
-  return thread_manager_->expiredTaskCount();
+void TaskGroup::done() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--pending_ == 0) {
+    complete_.notify_all();
+  }
 }
 }
@@ -8,6 +8,8 @@
  *
  */
 
+#include <atomic>
+
 #include <gtest/gtest.h>
 
 #include <osquery/dispatcher.h>
@@ -19,7 +21,7 @@ class DispatcherTests : public testing::Test {};
 TEST_F(DispatcherTests, test_singleton) {
   auto& one = Dispatcher::getInstance();
   auto& two = Dispatcher::getInstance();
-  EXPECT_EQ(one.getThreadManager().get(), two.getThreadManager().get());
+  EXPECT_EQ(&one, &two);
 }
 
 class TestRunnable : public apache::thrift::concurrency::Runnable {
@@ -43,6 +45,53 @@ TEST_F(DispatcherTests, test_add_work) {
 
   EXPECT_EQ(i, base + repetitions);
 }
+
+TEST_F(DispatcherTests, test_dispatcher_task) {
+  int calls = 0;
+  DispatcherTask task([&calls]() { calls++; });
+  EXPECT_TRUE((bool)task);
+
+  // Moved tasks keep their callable.
+  DispatcherTask moved(std::move(task));
+  EXPECT_FALSE((bool)task);
+  moved();
+  EXPECT_EQ(calls, 1);
+
+  // Callables larger than the inline storage are supported.
+  char large[DispatcherTask::kInlineSize * 2] = {1};
+  DispatcherTask heap([large, &calls]() { calls += large[0]; });
+  task = std::move(heap);
+  task();
+  EXPECT_EQ(calls, 2);
+}
+
+TEST_F(DispatcherTests, test_task_group) {
+  std::atomic<size_t> count(0);
+  {
+    TaskGroup group;
+    for (size_t i = 0; i < 100; i++) {
+      group.run([&count]() { count++; });
+    }
+    group.wait();
+    EXPECT_EQ(count, 100);
+  }
+
+  // Tasks may wait on groups of nested tasks without exhausting workers.
+  count = 0;
+  TaskGroup outer;
+  for (size_t i = 0; i < 16; i++) {
+    outer.run([&count]() {
+      TaskGroup inner;
+      for (size_t j = 0; j < 16; j++) {
+        inner.run([&count]() { count++; });
+      }
+      inner.wait();
+    });
+  }
+  outer.wait();
+  EXPECT_EQ(count, 256);
+  EXPECT_EQ(Dispatcher::getInstance().pendingTaskCount(), 0);
+}
 }
 
 int main(int argc, char* argv[]) {
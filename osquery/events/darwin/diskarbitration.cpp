@@ -0,0 +1,251 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <IOKit/IOKitLib.h>
+
+#include <osquery/logger.h>
+#include <osquery/tables.h>
+
+#include "osquery/core/conversions.h"
+#include "osquery/events/darwin/diskarbitration.h"
+
+namespace osquery {
+
+std::map<std::string, DiskDescription> DiskArbitrationEventPublisher::disks_;
+bool DiskArbitrationEventPublisher::disks_ready_ = false;
+boost::mutex DiskArbitrationEventPublisher::disks_lock_;
+
+REGISTER(DiskArbitrationEventPublisher,
+         "event_publisher",
+         "diskarbitration");
+
+/// A string representation of a description value, blank if missing.
+static std::string getDescriptionValue(CFDictionaryRef description,
+                                       CFStringRef key) {
+  auto value = CFDictionaryGetValue(description, key);
+  if (value == nullptr) {
+    return "";
+  }
+
+  auto type = CFGetTypeID(value);
+  if (type == CFStringGetTypeID()) {
+    return stringFromCFString((CFStringRef)value);
+  } else if (type == CFNumberGetTypeID()) {
+    return stringFromCFNumber((CFDataRef)value);
+  } else if (type == CFBooleanGetTypeID()) {
+    return (CFBooleanGetValue((CFBooleanRef)value)) ? "1" : "0";
+  } else if (type == CFUUIDGetTypeID()) {
+    auto uuid = CFUUIDCreateString(kCFAllocatorDefault, (CFUUIDRef)value);
+    if (uuid == nullptr) {
+      return "";
+    }
+    auto result = stringFromCFString(uuid);
+    CFRelease(uuid);
+    return result;
+  }
+  return "";
+}
+
+bool DiskArbitrationEventPublisher::describeDisk(DADiskRef disk,
+                                                 DiskDescription& description) {
+  // Disks without a device node, such as network volumes, are not described.
+  auto bsd_name = DADiskGetBSDName(disk);
+  if (bsd_name == nullptr) {
+    return false;
+  }
+
+  auto details = DADiskCopyDescription(disk);
+  if (details == nullptr) {
+    return false;
+  }
+
+  description.name = "/dev/" + std::string(bsd_name);
+  description.uuid =
+      getDescriptionValue(details, kDADiskDescriptionMediaUUIDKey);
+  description.size =
+      getDescriptionValue(details, kDADiskDescriptionMediaSizeKey);
+  description.label =
+      getDescriptionValue(details, kDADiskDescriptionMediaNameKey);
+  description.vendor =
+      getDescriptionValue(details, kDADiskDescriptionDeviceVendorKey);
+  description.model =
+      getDescriptionValue(details, kDADiskDescriptionDeviceModelKey);
+  description.type =
+      getDescriptionValue(details, kDADiskDescriptionDeviceProtocolKey);
+  description.whole =
+      (getDescriptionValue(details, kDADiskDescriptionMediaWholeKey) == "1");
+  CFRelease(details);
+  return true;
+}
+
+bool DiskArbitrationEventPublisher::getDisks(
+    std::vector<DiskDescription>& disks) {
+  boost::lock_guard<boost::mutex> lock(disks_lock_);
+  if (!disks_ready_) {
+    return false;
+  }
+
+  for (const auto& disk : disks_) {
+    disks.push_back(disk.second);
+  }
+  return true;
+}
+
+void DiskArbitrationEventPublisher::restart() {
+  if (run_loop_ == nullptr) {
+    // There is no run loop to restart.
+    return;
+  }
+
+  // Remove any existing session.
+  stop();
+
+  session_ = DASessionCreate(kCFAllocatorDefault);
+  if (session_ == nullptr) {
+    LOG(WARNING) << "Cannot create a DiskArbitration session";
+    return;
+  }
+
+  // Describe the existing disks before any callback is delivered.
+  std::map<std::string, DiskDescription> disks;
+  io_iterator_t it;
+  auto kr = IOServiceGetMatchingServices(
+      kIOMasterPortDefault, IOServiceMatching("IOMedia"), &it);
+  if (kr == KERN_SUCCESS) {
+    io_service_t media;
+    while ((media = IOIteratorNext(it))) {
+      auto disk = DADiskCreateFromIOMedia(kCFAllocatorDefault, session_, media);
+      if (disk != nullptr) {
+        DiskDescription description;
+        if (describeDisk(disk, description)) {
+          disks[description.name] = description;
+        }
+        CFRelease(disk);
+      }
+      IOObjectRelease(media);
+    }
+    IOObjectRelease(it);
+  }
+
+  {
+    boost::lock_guard<boost::mutex> lock(disks_lock_);
+    disks_ = std::move(disks);
+    disks_ready_ = true;
+  }
+
+  // Register callbacks, appeared is also called for each existing disk.
+  DARegisterDiskAppearedCallback(
+      session_, nullptr, DiskAppearedCallback, nullptr);
+  DARegisterDiskDisappearedCallback(
+      session_, nullptr, DiskDisappearedCallback, nullptr);
+  DARegisterDiskDescriptionChangedCallback(
+      session_, nullptr, nullptr, DiskDescriptionChangedCallback, nullptr);
+
+  DASessionScheduleWithRunLoop(session_, run_loop_, kCFRunLoopDefaultMode);
+}
+
+void DiskArbitrationEventPublisher::update(DADiskRef disk,
+                                           const std::string& action) {
+  auto ec = createEventContext();
+  ec->action = action;
+  if (action == "remove") {
+    auto bsd_name = DADiskGetBSDName(disk);
+    if (bsd_name == nullptr) {
+      return;
+    }
+
+    ec->disk.name = "/dev/" + std::string(bsd_name);
+    boost::lock_guard<boost::mutex> lock(disks_lock_);
+    if (disks_.erase(ec->disk.name) == 0) {
+      return;
+    }
+  } else {
+    if (!describeDisk(disk, ec->disk)) {
+      return;
+    }
+
+    boost::lock_guard<boost::mutex> lock(disks_lock_);
+    auto existing = disks_.count(ec->disk.name) > 0;
+    if (action == "add" && existing) {
+      // Disks described at start are appeared again, they are not events.
+      disks_[ec->disk.name] = ec->disk;
+      return;
+    }
+    disks_[ec->disk.name] = ec->disk;
+  }
+
+  EventFactory::fire<DiskArbitrationEventPublisher>(ec);
+}
+
+void DiskArbitrationEventPublisher::DiskAppearedCallback(DADiskRef disk,
+                                                         void* context) {
+  update(disk, "add");
+}
+
+void DiskArbitrationEventPublisher::DiskDisappearedCallback(DADiskRef disk,
+                                                            void* context) {
+  update(disk, "remove");
+}
+
+void DiskArbitrationEventPublisher::DiskDescriptionChangedCallback(
+    DADiskRef disk, CFArrayRef keys, void* context) {
+  update(disk, "change");
+}
+
+bool DiskArbitrationEventPublisher::shouldFire(
+    const DiskArbitrationSubscriptionContextRef& sc,
+    const DiskArbitrationEventContextRef& ec) {
+  return (sc->action.empty() || sc->action == ec->action);
+}
+
+Status DiskArbitrationEventPublisher::run() {
+  // The run entrypoint executes in a dedicated thread.
+  if (run_loop_ == nullptr) {
+    run_loop_ = CFRunLoopGetCurrent();
+    // Restart the session creation.
+    restart();
+  }
+
+  // Start the run loop, it may be removed with a tearDown.
+  CFRunLoopRun();
+
+  // Add artificial latency to run loop.
+  ::sleep(1);
+  return Status(0, "OK");
+}
+
+void DiskArbitrationEventPublisher::stop() {
+  {
+    // Without a session the registered disks are not updated.
+    boost::lock_guard<boost::mutex> lock(disks_lock_);
+    disks_ready_ = false;
+    disks_.clear();
+  }
+
+  // Stop the session.
+  if (session_ != nullptr) {
+    DASessionUnscheduleFromRunLoop(session_, run_loop_, kCFRunLoopDefaultMode);
+    CFRelease(session_);
+    session_ = nullptr;
+  }
+
+  // Stop the run loop.
+  if (run_loop_ != nullptr) {
+    CFRunLoopStop(run_loop_);
+  }
+}
+
+void DiskArbitrationEventPublisher::tearDown() {
+  stop();
+
+  // Do not keep a reference to the run loop.
+  run_loop_ = nullptr;
+}
+}
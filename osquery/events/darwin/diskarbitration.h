@@ -0,0 +1,135 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <CoreServices/CoreServices.h>
+#include <DiskArbitration/DiskArbitration.h>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <osquery/events.h>
+#include <osquery/status.h>
+
+namespace osquery {
+
+/// The DiskArbitration description of a disk, as block_devices reports it.
+struct DiskDescription {
+  /// The BSD device node, such as /dev/disk0s1.
+  std::string name;
+  std::string uuid;
+  std::string size;
+  /// The IOMedia name, the disk's label.
+  std::string label;
+  std::string vendor;
+  std::string model;
+  /// The device protocol, such as SATA or USB.
+  std::string type;
+  /// True for entire disks, false for partitions.
+  bool whole;
+
+  DiskDescription() : whole(false) {}
+};
+
+struct DiskArbitrationSubscriptionContext : public SubscriptionContext {
+  /// Limit events to an action, "add", "remove" or "change" (if not empty).
+  std::string action;
+};
+
+struct DiskArbitrationEventContext : public EventContext {
+  /// The event action: add, remove or change.
+  std::string action;
+  /// The disk's description, only its name is set for a removal.
+  DiskDescription disk;
+};
+
+typedef std::shared_ptr<DiskArbitrationEventContext>
+    DiskArbitrationEventContextRef;
+typedef std::shared_ptr<DiskArbitrationSubscriptionContext>
+    DiskArbitrationSubscriptionContextRef;
+
+/**
+ * @brief An osquery EventPublisher for DiskArbitration disk notifications.
+ *
+ * The publisher keeps one DiskArbitration session for the life of the
+ * process. Its disks are described once when it starts and then updated by
+ * appeared, disappeared and description changed callbacks, so tables may
+ * read the registered disks from memory with getDisks.
+ */
+class DiskArbitrationEventPublisher
+    : public EventPublisher<DiskArbitrationSubscriptionContext,
+                            DiskArbitrationEventContext> {
+  DECLARE_PUBLISHER("diskarbitration");
+
+ public:
+  void configure() {}
+  void tearDown();
+
+  // Entrypoint to the run loop
+  Status run();
+
+ public:
+  /// A disk was registered, existing disks are also reported at start.
+  static void DiskAppearedCallback(DADiskRef disk, void* context);
+
+  /// A disk was removed.
+  static void DiskDisappearedCallback(DADiskRef disk, void* context);
+
+  /// A disk's description changed, such as when a volume was renamed.
+  static void DiskDescriptionChangedCallback(DADiskRef disk,
+                                             CFArrayRef keys,
+                                             void* context);
+
+ public:
+  DiskArbitrationEventPublisher() : EventPublisher() {
+    session_ = nullptr;
+    run_loop_ = nullptr;
+  }
+
+  bool shouldFire(const DiskArbitrationSubscriptionContextRef& sc,
+                  const DiskArbitrationEventContextRef& ec);
+
+ public:
+  /**
+   * @brief Copy the registered disks, ordered by name.
+   *
+   * @param disks set to the disks known to the running publisher.
+   * @return false if the publisher is not running, the disks are unknown.
+   */
+  static bool getDisks(std::vector<DiskDescription>& disks);
+
+  /// Fill a description from a disk's DiskArbitration description.
+  static bool describeDisk(DADiskRef disk, DiskDescription& description);
+
+ private:
+  /// Describe a disk and update the registered disks, then fire an event.
+  static void update(DADiskRef disk, const std::string& action);
+
+  /// Restart the session.
+  void restart();
+  /// Stop the session and the run loop.
+  void stop();
+
+ private:
+  DASessionRef session_;
+  CFRunLoopRef run_loop_;
+
+ private:
+  /// The registered disks by name, valid while disks_ready_ is true.
+  static std::map<std::string, DiskDescription> disks_;
+  static bool disks_ready_;
+  static boost::mutex disks_lock_;
+};
+}
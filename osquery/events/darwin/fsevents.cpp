@@ -10,6 +10,8 @@
 
 #include <boost/numeric/ublas/matrix.hpp>
 
+#include <osquery/database.h>
+#include <osquery/flags.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
@@ -26,8 +28,55 @@ std::map<FSEventStreamEventFlags, std::string> kMaskActions = {
     {kFSEventStreamEventFlagItemRenamed, "MOVED_TO"},
 };
 
+DEFINE_osquery_flag(int32,
+                    fsevents_latency_ms,
+                    1000,
+                    "Milliseconds FSEvents coalesces changes before callback.");
+
+DEFINE_osquery_flag(bool,
+                    fsevents_defer,
+                    false,
+                    "Wait the FSEvents latency before the first callback.");
+
+/// The kEvents key storing the last delivered FSEvents event ID.
+const std::string kFSEventsLastIdKey = "fsevents.last_id";
+
 REGISTER(FSEventsEventPublisher, "event_publisher", "fsevents");
 
+FSEventStreamEventId FSEventsEventPublisher::getReplayId() {
+  if (last_id_ == 0) {
+    std::string content;
+    try {
+      auto db = DBHandle::getInstance();
+      if (db->Get(kEvents, kFSEventsLastIdKey, content).ok()) {
+        last_id_ = std::strtoull(content.c_str(), nullptr, 10);
+      }
+    } catch (const std::runtime_error& e) {
+      VLOG(1) << "Cannot read the last FSEvents event ID: " << e.what();
+    }
+  }
+
+  if (last_id_ == 0 || last_id_ > FSEventsGetCurrentEventId()) {
+    // There is no history, or the history was reset.
+    return kFSEventStreamEventIdSinceNow;
+  }
+  return last_id_;
+}
+
+void FSEventsEventPublisher::setLastId(FSEventStreamEventId id) {
+  if (id <= last_id_) {
+    return;
+  }
+
+  last_id_ = id;
+  try {
+    auto db = DBHandle::getInstance();
+    db->Put(kEvents, kFSEventsLastIdKey, std::to_string(id));
+  } catch (const std::runtime_error& e) {
+    VLOG(1) << "Cannot store the last FSEvents event ID: " << e.what();
+  }
+}
+
 void FSEventsEventPublisher::restart() {
   if (paths_.empty()) {
     // There are no paths to watch.
@@ -56,15 +105,21 @@ void FSEventsEventPublisher::restart() {
   // Remove any existing stream.
   stop();
 
-  // Create the FSEvent stream
+  // The callback receives this publisher to record event IDs.
+  FSEventStreamContext context = {0, this, nullptr, nullptr, nullptr};
+  FSEventStreamCreateFlags flags = kFSEventStreamCreateFlagFileEvents;
+  if (!FLAGS_fsevents_defer) {
+    flags |= kFSEventStreamCreateFlagNoDefer;
+  }
+
+  // Create the FSEvent stream, replaying events missed while stopped.
   stream_ = FSEventStreamCreate(NULL,
                                 &FSEventsEventPublisher::Callback,
-                                NULL,
+                                &context,
                                 watch_list,
-                                kFSEventStreamEventIdSinceNow,
-                                1,
-                                kFSEventStreamCreateFlagFileEvents |
-                                    kFSEventStreamCreateFlagNoDefer);
+                                getReplayId(),
+                                FLAGS_fsevents_latency_ms / 1000.0,
+                                flags);
   if (stream_) {
     // Schedule the stream on the run loop.
     FSEventStreamScheduleWithRunLoop(stream_, run_loop_, kCFRunLoopDefaultMode);
@@ -109,17 +164,41 @@ void FSEventsEventPublisher::tearDown() {
 
 void FSEventsEventPublisher::configure() {
   // Rebuild the watch paths.
-  paths_.clear();
-  for (const auto& subscription : subscriptions_) {
+  std::set<std::string> subscribed;
+  for (const auto& subscription : getSubscriptions()) {
     auto fs_subscription = getSubscriptionContext(subscription->context);
-    paths_.insert(fs_subscription->path);
+    subscribed.insert(fs_subscription->path);
+  }
+
+  // A stream watches a directory tree, paths within a watched path are
+  // covered. Only a change to the remaining roots restarts the stream.
+  std::set<std::string> paths;
+  for (const auto& path : subscribed) {
+    bool covered = false;
+    for (const auto& root : paths) {
+      if (path.compare(0, root.size(), root) == 0 &&
+          (path.size() == root.size() || path[root.size()] == '/')) {
+        covered = true;
+        break;
+      }
+    }
+    if (!covered) {
+      paths.insert(path);
+    }
   }
 
   // There were no paths in the subscriptions?
-  if (paths_.empty()) {
+  if (paths.empty()) {
+    paths_.clear();
+    return;
+  }
+
+  if (paths == paths_ && stream_started_) {
+    // The stream already watches every subscribed path.
     return;
   }
 
+  paths_ = paths;
   restart();
 }
 
@@ -143,7 +222,13 @@ void FSEventsEventPublisher::Callback(
     void* event_paths,
     const FSEventStreamEventFlags fsevent_flags[],
     const FSEventStreamEventId fsevent_ids[]) {
+  auto publisher = reinterpret_cast<FSEventsEventPublisher*>(callback_info);
   for (size_t i = 0; i < num_events; ++i) {
+    if (fsevent_flags[i] & kFSEventStreamEventFlagHistoryDone) {
+      // The replayed history ends, this is not a change.
+      continue;
+    }
+
     auto ec = createEventContext();
     ec->fsevent_stream = stream;
     ec->fsevent_flags = fsevent_flags[i];
@@ -160,6 +245,10 @@ void FSEventsEventPublisher::Callback(
     ec->path = std::string(((char**)event_paths)[i]);
     EventFactory::fire<FSEventsEventPublisher>(ec);
   }
+
+  if (publisher != nullptr && num_events > 0) {
+    publisher->setLastId(fsevent_ids[num_events - 1]);
+  }
 }
 
 bool FSEventsEventPublisher::shouldFire(
@@ -89,6 +89,7 @@ class FSEventsEventPublisher
     stream_started_ = false;
     stream_ = nullptr;
     run_loop_ = nullptr;
+    last_id_ = 0;
   }
 
   bool shouldFire(const FSEventsSubscriptionContextRef& mc,
@@ -107,11 +108,23 @@ class FSEventsEventPublisher
   bool isStreamRunning();
   // Count the number of subscriptioned paths.
   size_t numSubscriptionedPaths();
+  /**
+   * @brief The event ID a new stream replays from.
+   *
+   * The last delivered FSEventStreamEventId is persisted in the backing store
+   * so a restarted stream, or a restarted daemon, replays the events it
+   * missed from the FSEvents history instead of starting from "now".
+   */
+  FSEventStreamEventId getReplayId();
+  /// Remember the ID of the most recent delivered event.
+  void setLastId(FSEventStreamEventId id);
 
  private:
   FSEventStreamRef stream_;
   bool stream_started_;
   std::set<std::string> paths_;
+  /// The most recent event ID seen in the stream callback.
+  FSEventStreamEventId last_id_;
 
  private:
   CFRunLoopRef run_loop_;
@@ -124,5 +137,6 @@ class FSEventsEventPublisher
   FRIEND_TEST(FSEventsTests, test_fsevents_run);
   FRIEND_TEST(FSEventsTests, test_fsevents_fire_event);
   FRIEND_TEST(FSEventsTests, test_fsevents_event_action);
+  FRIEND_TEST(FSEventsTests, test_fsevents_replay_id);
 };
 }
@@ -252,6 +252,27 @@ TEST_F(FSEventsTests, test_fsevents_event_action) {
   }
   EndEventLoop();
 }
+
+TEST_F(FSEventsTests, test_fsevents_replay_id) {
+  StartEventLoop();
+
+  auto sub = std::make_shared<TestFSEventsEventSubscriber>();
+  sub->init();
+  auto sc = sub->GetSubscription(0);
+  sub->subscribe(&TestFSEventsEventSubscriber::SimpleCallback, sc);
+  CreateEvents();
+  sub->WaitForEvents(kMaxEventLatency);
+
+  // A restarted stream replays from the last delivered event.
+  EXPECT_GT(event_pub_->last_id_, 0);
+  EXPECT_EQ(event_pub_->getReplayId(), event_pub_->last_id_);
+
+  // Subscribing again to a watched path does not restart the stream.
+  auto stream = event_pub_->stream_;
+  sub->subscribe(&TestFSEventsEventSubscriber::SimpleCallback, sc);
+  EXPECT_EQ(event_pub_->stream_, stream);
+  EndEventLoop();
+}
 }
 
 int main(int argc, char* argv[]) {
@@ -90,7 +90,7 @@ void SCNetworkEventPublisher::addAddress(
 }
 
 void SCNetworkEventPublisher::configure() {
-  for (const auto& sub : subscriptions_) {
+  for (const auto& sub : getSubscriptions()) {
     auto sc = getSubscriptionContext(sub->context);
     if (sc->type == ADDRESS_TARGET) {
       auto existing_address = std::find(
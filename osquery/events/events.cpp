@@ -8,10 +8,17 @@
  *
  */
 
+#include <algorithm>
 #include <exception>
+#include <future>
+#include <limits>
+#include <set>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
-#include <boost/algorithm/string.hpp>
-#include <boost/algorithm/string/classification.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include <osquery/core.h>
@@ -34,12 +41,123 @@ DEFINE_osquery_flag(int32,
                     86000,
                     "Expire (remove) recorded events after a timeout.");
 
-const std::vector<size_t> kEventTimeLists = {
-    1 * 60 * 60, // 1 hour
-    1 * 60, // 1 minute
-    10, // 10 seconds
+DEFINE_osquery_flag(int32,
+                    event_pubsub_expiry_interval,
+                    60,
+                    "Seconds between removals of expired events.");
+
+DEFINE_osquery_flag(int32,
+                    event_pubsub_queue_size,
+                    4096,
+                    "Events each subscriber may queue for writing (0 sync).");
+
+DEFINE_osquery_flag(int32,
+                    event_pubsub_memory_bytes,
+                    1048576,
+                    "Bytes of recent events each subscriber reads from memory");
+
+DEFINE_osquery_flag(int32,
+                    event_pubsub_memory_seconds,
+                    600,
+                    "Seconds of recent events kept in memory (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    event_pubsub_coalesce_ms,
+                    0,
+                    "Milliseconds to merge duplicate fired events (0 off).");
+
+/**
+ * Events are stored in time order, an event key is the subscriber namespace,
+ * the big-endian event time and EventID. Reading a time range is a single
+ * range scan returning the rows.
+ */
+static void appendBigEndian(uint64_t value, std::string& key) {
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    key.push_back((char)((value >> shift) & 0xff));
+  }
+}
+
+/// The fewest stored events deserialized by each parallel chunk.
+const size_t kEventDecodeChunkSize = 4096;
+
+/**
+ * @brief Deserialize stored events into rows, keeping their time order.
+ *
+ * Wide time ranges are split into chunks deserialized by Dispatcher
+ * workers, the chunks' rows are appended in order. Malformed events are
+ * skipped.
+ */
+static void deserializeEvents(const std::vector<const std::string*>& events,
+                              QueryData& results) {
+  auto chunks = std::min(tables::parallelChunks(events.size()),
+                         events.size() / kEventDecodeChunkSize);
+  chunks = std::max(chunks, (size_t)1);
+
+  std::vector<QueryData> partial(chunks);
+  tables::parallelRun(
+      events.size(),
+      chunks,
+      [&events, &partial](size_t chunk, size_t begin, size_t end) {
+        partial[chunk].reserve(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+          Row r;
+          if (deserializeRowBinary(*events[i], r).ok()) {
+            partial[chunk].push_back(std::move(r));
+          }
+        }
+      });
+
+  results.reserve(results.size() + events.size());
+  for (auto& rows : partial) {
+    results.insert(results.end(),
+                   std::make_move_iterator(rows.begin()),
+                   std::make_move_iterator(rows.end()));
+  }
+}
+
+/// The number of EventIDs reserved from the backing store at once.
+const uint64_t kEventIDBlockSize = 1000;
+
+const std::vector<size_t> kEventLatencyBounds = {
+    100, 1000, 10000, 100000, 1000000,
 };
 
+/// Microseconds elapsed since a steady clock time point.
+static size_t elapsedMicroseconds(
+    const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start).count();
+}
+
+std::string EventSubscriberPlugin::getEventKey(uint64_t time,
+                                               const std::string& eid) const {
+  auto key = "data." + dbNamespace() + "/";
+  appendBigEndian(time, key);
+  if (!eid.empty()) {
+    key.push_back('/');
+    appendBigEndian(boost::lexical_cast<uint64_t>(eid), key);
+  }
+  return key;
+}
+
+Status EventPublisherPlugin::removeSubscription(
+    const SubscriptionContextRef& sc) {
+  boost::lock_guard<boost::mutex> lock(subscription_lock_);
+  auto size = subscriptions_.size();
+  subscriptions_.erase(
+      std::remove_if(subscriptions_.begin(),
+                     subscriptions_.end(),
+                     [&sc](const SubscriptionRef& subscription) {
+                       return subscription->context == sc;
+                     }),
+      subscriptions_.end());
+
+  if (subscriptions_.size() == size) {
+    return Status(1, "Subscription not found");
+  }
+  return Status(0, "OK");
+}
+
 void EventPublisherPlugin::fire(const EventContextRef& ec, EventTime time) {
   EventContextID ec_id;
 
@@ -63,337 +181,864 @@ void EventPublisherPlugin::fire(const EventContextRef& ec, EventTime time) {
       // Todo: add a check to assure normalized (seconds) time.
       ec->time = time;
     }
+  }
+
+  // Deliver any coalesced events whose window has elapsed before this one.
+  flushCoalesced();
+  if (ec != nullptr && FLAGS_event_pubsub_coalesce_ms > 0) {
+    auto key = getCoalesceKey(ec);
+    if (!key.empty()) {
+      boost::lock_guard<boost::mutex> lock(coalesce_lock_);
+      auto pending = coalesced_.find(key);
+      if (pending != coalesced_.end()) {
+        // Merge the duplicate into the first event of the window.
+        pending->second.first->count += ec->count;
+        coalesced_events_++;
+      } else {
+        coalesced_[key] = std::make_pair(ec, std::chrono::steady_clock::now());
+      }
+      return;
+    }
+  }
+
+  deliver(ec);
+}
 
-    // Set the optional string-verion of the time for DB columns.
-    ec->time_string = boost::lexical_cast<std::string>(ec->time);
+void EventPublisherPlugin::deliver(const EventContextRef& ec) {
+  SubscriptionVector routed;
+  if (ec != nullptr && routeEvent(ec, routed)) {
+    for (const auto& subscription : routed) {
+      fireCallback(subscription, ec);
+    }
+    return;
   }
 
-  for (const auto& subscription : subscriptions_) {
+  for (const auto& subscription : getSubscriptions()) {
     fireCallback(subscription, ec);
   }
 }
 
-std::vector<std::string> EventSubscriberPlugin::getIndexes(EventTime start,
-                                                           EventTime stop,
-                                                           int list_key) {
-  auto db = DBHandle::getInstance();
-  auto index_key = "indexes." + dbNamespace();
-  std::vector<std::string> indexes;
-
-  // Keep track of the tail/head of account time while bin searching.
-  EventTime start_max = stop, stop_min = stop, local_start, local_stop;
-  auto types = kEventTimeLists.size();
-  // List types are sized bins of time containing records for this namespace.
-  for (size_t i = 0; i < types; ++i) {
-    auto size = kEventTimeLists[i];
-    if (list_key > 0 && i != list_key) {
-      // A specific list_type was requested, only return bins of this key.
-      continue;
-    }
+bool EventPublisherPlugin::hasCoalesced() {
+  boost::lock_guard<boost::mutex> lock(coalesce_lock_);
+  return !coalesced_.empty();
+}
 
-    std::string time_list;
-    auto list_type = boost::lexical_cast<std::string>(size);
-    auto status = db->Get(kEvents, index_key + "." + list_type, time_list);
-    if (time_list.length() == 0) {
-      // No events in this binning size.
-      return indexes;
+void EventPublisherPlugin::flushCoalesced(bool force) {
+  std::vector<EventContextRef> expired;
+  {
+    boost::lock_guard<boost::mutex> lock(coalesce_lock_);
+    if (coalesced_.empty()) {
+      return;
     }
 
-    if (list_key == 0 && i == (types - 1) && types > 1) {
-      // Relax the requested start/stop bounds.
-      if (start != start_max) {
-        start = (start / size) * size;
-        start_max = ((start / size) + 1) * size;
-        if (start_max < stop) {
-          start_max = start + kEventTimeLists[types - 2];
-        }
-      }
-
-      if (stop != stop_min) {
-        stop = ((stop / size) + 1) * size;
-        stop_min = (stop / size) * size;
-        if (stop_min > start) {
-          stop_min = stop_min - kEventTimeLists[types - 1];
-        }
-      }
-    } else if (list_key > 0 || types == 1) {
-      // Relax the requested bounds to fit the requested/only index.
-      start = (start / size) * size;
-      start_max = ((start_max / size) + 1) * size;
-    }
-
-    // (1) The first iteration will have 1 range (start to start_max=stop).
-    // (2) Itermediate iterations will have 2 (start-start_max, stop-stop_min).
-    // For each iteration the range collapses based on the coverage using
-    // the first bin's start time and the last bin's stop time.
-    // (3) The last iteration's range includes relaxed bounds outside the
-    // requested start to stop range.
-    std::vector<std::string> all_bins, bins, expirations;
-    boost::split(all_bins, time_list, boost::is_any_of(","));
-    for (const auto& bin : all_bins) {
-      // Bins are identified by the binning size step.
-      auto step = boost::lexical_cast<EventTime>(bin);
-      // Check if size * step -> size * (step + 1) is within a range.
-      int bin_start = size * step, bin_stop = size * (step + 1);
-      if (expire_events_ && step * size < expire_time_) {
-        expirations.push_back(list_type + "." + bin);
-      } else if (bin_start >= start && bin_stop <= start_max) {
-        bins.push_back(bin);
-      } else if ((bin_start >= stop_min && bin_stop <= stop) || stop == 0) {
-        bins.push_back(bin);
+    auto now = std::chrono::steady_clock::now();
+    auto window = std::chrono::milliseconds(FLAGS_event_pubsub_coalesce_ms);
+    for (auto it = coalesced_.begin(); it != coalesced_.end();) {
+      if (force || now - it->second.second >= window) {
+        expired.push_back(it->second.first);
+        it = coalesced_.erase(it);
+      } else {
+        ++it;
       }
     }
+  }
 
-    expireIndexes(list_type, all_bins, expirations);
-    if (bins.size() != 0) {
-      // If more percision was acheived though this list's binning.
-      local_start = boost::lexical_cast<EventTime>(bins.front()) * size;
-      start_max = (local_start < start_max) ? local_start : start_max;
-      local_stop = (boost::lexical_cast<EventTime>(bins.back()) + 1) * size;
-      stop_min = (local_stop < stop_min) ? local_stop : stop_min;
-    }
+  // Deliver outside of the lock, in the order the events were first fired.
+  std::sort(expired.begin(),
+            expired.end(),
+            [](const EventContextRef& l, const EventContextRef& r) {
+              return l->id < r->id;
+            });
+  for (const auto& ec : expired) {
+    deliver(ec);
+  }
+}
 
-    for (const auto& bin : bins) {
-      indexes.push_back(list_type + "." + bin);
-    }
+Status EventSubscriberPlugin::openDomain() {
+  if (domain_opened_) {
+    return Status(0, "OK");
+  }
+
+  boost::lock_guard<boost::mutex> lock(domain_lock_);
+  if (domain_opened_) {
+    return Status(0, "OK");
+  }
+  auto db = DBHandle::getInstance();
+  auto status = db->createDomain(dbDomain());
+  if (!status.ok()) {
+    return status;
+  }
 
-    if (start == start_max && stop == stop_min) {
+  // Legacy events are moved in bounded batches, each batch is atomic and an
+  // interrupted move continues when the domain is next opened.
+  DBBatch batch;
+  auto domain = dbDomain();
+  std::string last;
+  size_t moved = 0;
+  auto move = [&batch, &domain, &last, &moved](const rocksdb::Slice& key,
+                                               const rocksdb::Slice& value) {
+    last = key.ToString();
+    batch.Put(domain, last, value.ToString());
+    batch.Delete(kEvents, last);
+    return ++moved < kEventMigrateChunkSize;
+  };
+  // Keys of the namespace begin with "data.<namespace>/", '0' follows '/'.
+  auto start = "data." + dbNamespace() + "/";
+  auto stop = "data." + dbNamespace() + "0";
+  do {
+    batch = DBBatch();
+    moved = 0;
+    status = db->ScanRange(kEvents, start, stop, move);
+    if (!status.ok()) {
+      return status;
+    }
+    if (batch.size() == 0) {
       break;
     }
+    status = db->Write(batch);
+    if (!status.ok()) {
+      return status;
+    }
+    start = last + '\0';
+  } while (moved >= kEventMigrateChunkSize);
+
+  // The high-water mark is moved last, once every event has been moved.
+  std::string eid;
+  if (db->Get(kEvents, "eid." + dbNamespace(), eid).ok()) {
+    batch = DBBatch();
+    move("eid." + dbNamespace(), eid);
+    status = db->Write(batch);
+    if (!status.ok()) {
+      return status;
+    }
   }
-
-  // Update the new time that events expire to now - expiry.
-  return indexes;
+  domain_ = domain;
+  domain_opened_ = true;
+  return Status(0, "OK");
 }
 
-Status EventSubscriberPlugin::expireIndexes(
-    const std::string& list_type,
-    const std::vector<std::string>& indexes,
-    const std::vector<std::string>& expirations) {
-  auto db = DBHandle::getInstance();
-  auto index_key = "indexes." + dbNamespace();
-  auto record_key = "records." + dbNamespace();
-  auto data_key = "data." + dbNamespace();
-
-  // Get the records list for the soon-to-be expired records.
-  std::vector<std::string> record_indexes;
-  for (const auto& bin : expirations) {
-    record_indexes.push_back(list_type + "." + bin);
+Status EventSubscriberPlugin::expireEvents(EventTime expire_time) {
+  auto status = openDomain();
+  if (!status.ok()) {
+    return status;
   }
-  auto expired_records = getRecords(record_indexes);
+  // Event keys sort before the EventID high-water mark of the domain.
+  return DBHandle::getInstance()->DeleteRange(
+      dbDomain(), getEventKey(0), getEventKey(expire_time));
+}
 
-  // Remove the records using the list of expired indexes.
-  std::vector<std::string> persisting_indexes = indexes;
-  for (const auto& bin : expirations) {
-    db->Delete(kEvents, record_key + "." + list_type + "." + bin);
-    persisting_indexes.erase(
-        std::remove(persisting_indexes.begin(), persisting_indexes.end(), bin),
-        persisting_indexes.end());
+EventID EventSubscriberPlugin::getEventID() {
+  if (!eid_loaded_) {
+    boost::lock_guard<boost::mutex> lock(event_id_lock_);
+    if (!eid_loaded_) {
+      // Recover the high-water mark, IDs it reserved may not have been used.
+      if (!openDomain().ok()) {
+        return "0";
+      }
+      std::string last_eid_value;
+      auto db = DBHandle::getInstance();
+      uint64_t last_eid = 0;
+      if (db->Get(dbDomain(), "eid." + dbNamespace(), last_eid_value).ok()) {
+        try {
+          last_eid = boost::lexical_cast<uint64_t>(last_eid_value);
+        } catch (const boost::bad_lexical_cast& e) {
+          LOG(ERROR) << "Invalid event ID high-water mark: " << last_eid_value;
+        }
+      }
+      next_eid_ = last_eid + 1;
+      reserved_eid_ = last_eid + 1;
+      eid_loaded_ = true;
+    }
   }
 
-  // Update the list of indexes with the non-expired indexes.
-  auto new_indexes = boost::algorithm::join(persisting_indexes, ",");
-  db->Put(kEvents, index_key + "." + list_type, new_indexes);
+  uint64_t eid = next_eid_++;
+  if (eid >= reserved_eid_) {
+    boost::lock_guard<boost::mutex> lock(event_id_lock_);
+    if (eid >= reserved_eid_) {
+      // Reserve a block of IDs from the backing store.
+      uint64_t reserved = eid + kEventIDBlockSize;
+      auto db = DBHandle::getInstance();
+      auto status = db->Put(dbDomain(),
+                            "eid." + dbNamespace(),
+                            boost::lexical_cast<std::string>(reserved - 1));
+      if (!status.ok()) {
+        return "0";
+      }
+      reserved_eid_ = reserved;
+    }
+  }
+  return boost::lexical_cast<std::string>(eid);
+}
 
-  // Delete record events.
-  for (const auto& record : expired_records) {
-    db->Delete(kEvents, data_key + "." + record.first);
+Status EventSubscriberPlugin::expire(EventTime now) {
+  if (!expire_events_ || FLAGS_event_pubsub_expiry <= 0 ||
+      now <= (EventTime)FLAGS_event_pubsub_expiry) {
+    return Status(0, "OK");
   }
 
-  return Status(0, "OK");
+  expire_time_ = now - FLAGS_event_pubsub_expiry;
+  return expireEvents(expire_time_);
 }
 
-std::vector<EventRecord> EventSubscriberPlugin::getRecords(
-    const std::vector<std::string>& indexes) {
-  auto db = DBHandle::getInstance();
-  auto record_key = "records." + dbNamespace();
-  std::vector<EventRecord> records;
+QueryData EventSubscriberPlugin::get(EventTime start,
+                                     EventTime stop,
+                                     const DBSnapshotRef& snapshot) {
+  QueryData results;
 
-  for (const auto& index : indexes) {
-    std::string record_value;
-    if (!db->Get(kEvents, record_key + "." + index, record_value).ok()) {
-      return records;
-    }
+  std::shared_ptr<DBHandle> db;
+  try {
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    LOG(ERROR) << "Cannot retrieve subscriber results database is locked";
+    return results;
+  }
+  auto status = openDomain();
+  if (!status.ok()) {
+    LOG(ERROR) << "Cannot open subscriber domain: " << status.toString();
+    return results;
+  }
 
-    if (record_value.length() == 0) {
-      // There are actually no events in this bin, interesting error case.
-      continue;
+  if (expire_events_) {
+    start = std::max(start, expire_time_.load());
+  }
+  if (snapshot == nullptr) {
+    if (getRecentEvents(start, stop, results)) {
+      // Queries of recent windows are served without reading the store.
+      return results;
     }
 
-    // Each list is tokenized into a record=event_id:time.
-    std::vector<std::string> bin_records;
-    boost::split(bin_records, record_value, boost::is_any_of(",:"));
-    auto bin_it = bin_records.begin();
-    for (; bin_it != bin_records.end(); bin_it++) {
-      std::string eid = *bin_it;
-      EventTime time = boost::lexical_cast<EventTime>(*(++bin_it));
-      records.push_back(std::make_pair(eid, time));
-    }
+    // Queries read every event added before them, but no expired events.
+    flush();
   }
 
-  return records;
+  // The events in the time range are a single scan, stop = 0 is everything
+  // and ends the scan after the namespace's keys.
+  auto first = getEventKey(start);
+  auto last = (stop == 0) ? "data." + dbNamespace() + "0"
+                          : getEventKey((uint64_t)stop + 1);
+  std::vector<std::string> values;
+  db->ScanRange(dbDomain(),
+                first,
+                last,
+                [&values](const rocksdb::Slice&, const rocksdb::Slice& value) {
+                  values.push_back(value.ToString());
+                  return true;
+                },
+                snapshot);
+
+  std::vector<const std::string*> events;
+  events.reserve(values.size());
+  for (const auto& value : values) {
+    events.push_back(&value);
+  }
+  deserializeEvents(events, results);
+  return results;
 }
 
-Status EventSubscriberPlugin::recordEvent(EventID& eid, EventTime time) {
-  Status status;
-  auto db = DBHandle::getInstance();
-  std::string time_value = boost::lexical_cast<std::string>(time);
-
-  // The record is identified by the event type then module name.
-  std::string index_key = "indexes." + dbNamespace();
-  std::string record_key = "records." + dbNamespace();
-  // The list key includes the list type (bin size) and the list ID (bin).
-  std::string list_key;
-  std::string list_id;
-
-  for (auto time_list : kEventTimeLists) {
-    // The list_id is the MOST-Specific key ID, the bin for this list.
-    // If the event time was 13 and the time_list is 5 seconds, lid = 2.
-    list_id = boost::lexical_cast<std::string>(time / time_list);
-    // The list name identifies the 'type' of list.
-    list_key = boost::lexical_cast<std::string>(time_list);
-    // list_key = list_key + "." + list_id;
+QueryData EventSubscriberPlugin::genTable(tables::QueryContext& context) {
+  // The range is inclusive, stop = 0 is unbounded.
+  uint64_t start = context.events.start;
+  uint64_t stop = (context.events.stop > 0) ? context.events.stop - 1 : 0;
+  auto narrow = [&start, &stop](uint64_t lower, uint64_t upper) {
+    start = std::max(start, lower);
+    if (upper > 0) {
+      stop = (stop == 0) ? upper : std::min(stop, upper);
+    }
+  };
+
+  auto& time = context.constraints["time"];
+  for (const auto& op : {tables::EQUALS,
+                         tables::GREATER_THAN,
+                         tables::GREATER_THAN_OR_EQUALS,
+                         tables::LESS_THAN,
+                         tables::LESS_THAN_OR_EQUALS}) {
+    for (const auto& expr : time.getAll(op)) {
+      char* end = nullptr;
+      auto value = std::strtoull(expr.c_str(), &end, 10);
+      if (expr.empty() || *end != 0) {
+        // Only integer times are pushed down, SQLite applies the rest.
+        continue;
+      }
 
-    {
-      boost::lock_guard<boost::mutex> lock(event_record_lock_);
-      // Append the record (eid, unix_time) to the list bin.
-      std::string record_value;
-      status = db->Get(
-          kEvents, record_key + "." + list_key + "." + list_id, record_value);
-
-      if (record_value.length() == 0) {
-        // This is a new list_id for list_key, append the ID to the indirect
-        // lookup for this list_key.
-        std::string index_value;
-        status = db->Get(kEvents, index_key + "." + list_key, index_value);
-        if (index_value.length() == 0) {
-          // A new index.
-          index_value = list_id;
-        } else {
-          index_value += "," + list_id;
-        }
-        status = db->Put(kEvents, index_key + "." + list_key, index_value);
-        record_value = eid + ":" + time_value;
+      if (op == tables::EQUALS) {
+        narrow(value, value);
+      } else if (op == tables::GREATER_THAN) {
+        narrow(value + 1, 0);
+      } else if (op == tables::GREATER_THAN_OR_EQUALS) {
+        narrow(value, 0);
+      } else if (op == tables::LESS_THAN && value == 0) {
+        return QueryData();
+      } else if (op == tables::LESS_THAN) {
+        narrow(0, value - 1);
       } else {
-        // Tokenize a record using ',' and the EID/time using ':'.
-        record_value += "," + eid + ":" + time_value;
-      }
-      status = db->Put(
-          kEvents, record_key + "." + list_key + "." + list_id, record_value);
-      if (!status.ok()) {
-        LOG(ERROR) << "Could not put Event Record key: " << record_key << "."
-                   << list_key << "." << list_id;
+        narrow(0, value);
       }
     }
   }
 
-  return Status(0, "OK");
+  if (stop > 0 && stop < start) {
+    return QueryData();
+  } else if (start > std::numeric_limits<EventTime>::max()) {
+    return QueryData();
+  }
+  stop = std::min(stop, (uint64_t)std::numeric_limits<EventTime>::max());
+
+  // Reads from the query's snapshot do not use the recent events in memory.
+  if (context.events.snapshot != nullptr) {
+    return get((EventTime)start, (EventTime)stop, context.events.snapshot);
+  }
+
+  // EQUALS constraints on an indexed column read only the matching events.
+  for (auto& constraint : context.constraints) {
+    auto values = constraint.second.getAll(tables::EQUALS);
+    if (values.empty()) {
+      continue;
+    }
+
+    QueryData results;
+    std::set<std::string> keys(values.begin(), values.end());
+    if (getIndexedEvents(constraint.first, keys, start, stop, results)) {
+      return results;
+    }
+  }
+  return get((EventTime)start, (EventTime)stop);
 }
 
-EventID EventSubscriberPlugin::getEventID() {
-  Status status;
-  auto db = DBHandle::getInstance();
-  // First get an event ID from the meta key.
-  std::string eid_key = "eid." + dbNamespace();
-  std::string last_eid_value;
-  std::string eid_value;
+void EventSubscriberPlugin::setLimits(const OsqueryEventLimits& limits) {
+  boost::lock_guard<boost::mutex> lock(limits_lock_);
+  limits_ = limits;
+  limits_.burst = std::max(limits.burst, limits.max_events_per_second);
+  tokens_ = limits_.burst;
+  tokens_time_ = std::chrono::steady_clock::now();
+}
 
+bool EventSubscriberPlugin::isSampled() {
+  size_t sample = 0;
   {
-    boost::lock_guard<boost::mutex> lock(event_id_lock_);
-    status = db->Get(kEvents, eid_key, last_eid_value);
-    if (!status.ok()) {
-      last_eid_value = "0";
-    }
+    boost::lock_guard<boost::mutex> lock(limits_lock_);
+    sample = limits_.sample;
+  }
+  if (sample > 1 && events_seen_++ % sample != 0) {
+    events_sampled_++;
+    return false;
+  }
+  return true;
+}
 
-    size_t eid = boost::lexical_cast<size_t>(last_eid_value) + 1;
-    eid_value = boost::lexical_cast<std::string>(eid);
-    status = db->Put(kEvents, eid_key, eid_value);
+bool EventSubscriberPlugin::isRateLimited() {
+  boost::lock_guard<boost::mutex> lock(limits_lock_);
+  if (limits_.max_events_per_second == 0) {
+    return false;
   }
 
-  if (!status.ok()) {
-    return "0";
+  // Refill the bucket for the time since the last event.
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - tokens_time_;
+  tokens_time_ = now;
+  tokens_ = std::min((double)limits_.burst,
+                     tokens_ + elapsed.count() * limits_.max_events_per_second);
+  if (tokens_ < 1) {
+    events_limited_++;
+    return true;
   }
+  tokens_ -= 1;
+  return false;
+}
 
-  return eid_value;
+Status EventSubscriberPlugin::add(const Row& r, EventTime time) {
+  // A noisy subscriber stores a sample of its events within a rate limit.
+  if (!isSampled()) {
+    return Status(0, "OK");
+  }
+  if (isRateLimited()) {
+    return Status(1, "Event rate limit exceeded");
+  }
+
+  std::string data;
+  auto status = serializeRowBinary(r, data);
+  if (!status.ok()) {
+    return status;
+  }
+  return addEvent(std::move(data), time, &r);
 }
 
-QueryData EventSubscriberPlugin::get(EventTime start, EventTime stop) {
-  QueryData results;
-  Status status;
+Status EventSubscriberPlugin::add(const RowEncoder& row, EventTime time) {
+  if (!row.complete()) {
+    return Status(1, "Event row is missing columns");
+  }
 
+  if (!isSampled()) {
+    return Status(0, "OK");
+  }
+  if (isRateLimited()) {
+    return Status(1, "Event rate limit exceeded");
+  }
+  return addEvent(row.data(), time);
+}
+
+Status EventSubscriberPlugin::addEvent(std::string data,
+                                       EventTime time,
+                                       const Row* row) {
   std::shared_ptr<DBHandle> db;
   try {
     db = DBHandle::getInstance();
   } catch (const std::runtime_error& e) {
-    LOG(ERROR) << "Cannot retrieve subscriber results database is locked";
-    return results;
+    return Status(1, e.what());
   }
 
-  // Get the records for this time range.
-  auto indexes = getIndexes(start, stop);
-  auto records = getRecords(indexes);
+  // Get and increment the EID for this module.
+  EventID eid = getEventID();
+  if (eid == "0") {
+    return Status(1, "Cannot reserve an event ID");
+  }
 
-  std::vector<EventRecord> mapped_records;
-  for (const auto& record : records) {
-    if (record.second >= start && (record.second <= stop || stop == 0)) {
-      mapped_records.push_back(record);
+  // Store the event data, keyed by time.
+  auto key = getEventKey(time, eid);
+  if (FLAGS_event_pubsub_queue_size <= 0) {
+    auto start = std::chrono::steady_clock::now();
+    auto status = db->Put(dbDomain(), key, data);
+    recordWrite(elapsedMicroseconds(start));
+    if (status.ok()) {
+      keepRecentEvent(key, data, time, row);
+      events_added_++;
     }
+    return status;
   }
 
-  std::string events_key = "data." + dbNamespace();
+  // The publisher thread only queues the event, a writer thread writes it.
+  boost::lock_guard<boost::mutex> lock(event_queue_lock_);
+  if (event_queue_.size() >= (size_t)FLAGS_event_pubsub_queue_size) {
+    events_dropped_++;
+    return Status(1, "Event queue is full");
+  }
+  if (event_writer_ == nullptr) {
+    event_writer_ = std::make_shared<boost::thread>(
+        boost::bind(&EventSubscriberPlugin::writeEvents, this));
+  }
+  keepRecentEvent(key, data, time, row);
+  event_queue_.push_back(std::make_pair(std::move(key), std::move(data)));
+  event_queue_sequence_++;
+  event_queue_cv_.notify_all();
+  events_added_++;
+  return Status(0, "OK");
+}
 
-  // Select mapped_records using event_ids as keys.
-  std::string data_value;
-  for (const auto& record : mapped_records) {
-    Row r;
-    status = db->Get(kEvents, events_key + "." + record.first, data_value);
-    if (data_value.length() == 0) {
-      // THere is no record here, interesting error case.
+void EventSubscriberPlugin::writeEvents() {
+  while (true) {
+    std::deque<std::pair<std::string, std::string> > events;
+    size_t sequence = 0;
+    {
+      boost::unique_lock<boost::mutex> lock(event_queue_lock_);
+      while (!event_writer_ending_ && event_queue_.empty()) {
+        event_queue_cv_.wait(lock);
+      }
+      if (event_queue_.empty()) {
+        break;
+      }
+      events.swap(event_queue_);
+      sequence = event_queue_sequence_;
+    }
+
+    DBBatch batch;
+    for (const auto& event : events) {
+      batch.Put(domain_, event.first, event.second);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto status = DBHandle::getInstance()->Write(batch);
+    recordWrite(elapsedMicroseconds(start));
+    if (!status.ok()) {
+      events_dropped_ += events.size();
+      LOG(ERROR) << "Cannot write " << events.size()
+                 << " events: " << status.toString();
+    }
+
+    boost::lock_guard<boost::mutex> lock(event_queue_lock_);
+    event_written_sequence_ = sequence;
+    event_queue_cv_.notify_all();
+  }
+}
+
+void EventSubscriberPlugin::keepRecentEvent(const std::string& key,
+                                            const std::string& data,
+                                            EventTime time,
+                                            const Row* row) {
+  boost::lock_guard<boost::mutex> lock(recent_lock_);
+  if (FLAGS_event_pubsub_memory_bytes <= 0 ||
+      FLAGS_event_pubsub_memory_seconds <= 0) {
+    // Reads are not served from memory once a bound is disabled.
+    recent_events_.clear();
+    recent_index_.clear();
+    recent_bytes_ = 0;
+    recent_floor_ = std::numeric_limits<EventTime>::max();
+    return;
+  }
+
+  if (time >= recent_floor_) {
+    auto& event = recent_events_[key];
+    event.time = time;
+    event.data = data;
+    event.indexed = getIndexedValues(data, row);
+    recent_bytes_ += key.size() + data.size();
+    recent_bytes_ += indexRecentEvent(key, event.indexed, true);
+  }
+
+  // Evict the oldest events, reads before the evicted times use the store.
+  auto oldest = getUnixTime() - FLAGS_event_pubsub_memory_seconds;
+  while (!recent_events_.empty() &&
+         (recent_bytes_ > (size_t)FLAGS_event_pubsub_memory_bytes ||
+          recent_events_.begin()->second.time < oldest)) {
+    auto event = recent_events_.begin();
+    recent_floor_ = std::max(recent_floor_, event->second.time + 1);
+    recent_bytes_ -= event->first.size() + event->second.data.size();
+    recent_bytes_ -= indexRecentEvent(event->first, event->second.indexed,
+                                      false);
+    recent_events_.erase(event);
+  }
+}
+
+Row EventSubscriberPlugin::getIndexedValues(const std::string& data,
+                                            const Row* row) const {
+  Row values;
+  if (indexed_columns_.empty()) {
+    return values;
+  }
+
+  // Events added as encoded rows are deserialized once, when kept.
+  Row decoded;
+  if (row == nullptr) {
+    if (!deserializeRowBinary(data, decoded).ok()) {
+      return values;
+    }
+    row = &decoded;
+  }
+  for (const auto& column : indexed_columns_) {
+    auto value = row->find(column);
+    if (value != row->end()) {
+      values[column] = value->second;
+    }
+  }
+  return values;
+}
+
+size_t EventSubscriberPlugin::indexRecentEvent(const std::string& key,
+                                               const Row& values,
+                                               bool insert) {
+  size_t bytes = 0;
+  for (const auto& value : values) {
+    bytes += key.size() + value.first.size() + value.second.size();
+    auto& index = recent_index_[value.first];
+    if (insert) {
+      index[value.second].insert(key);
       continue;
     }
-    status = deserializeRowJSON(data_value, r);
-    if (status.ok()) {
-      results.push_back(r);
+    auto keys = index.find(value.second);
+    if (keys != index.end()) {
+      keys->second.erase(key);
+      if (keys->second.empty()) {
+        index.erase(keys);
+      }
     }
   }
-  return results;
+  return bytes;
 }
 
-Status EventSubscriberPlugin::add(const Row& r, EventTime time) {
-  Status status;
+bool EventSubscriberPlugin::getIndexedEvents(
+    const std::string& column,
+    const std::set<std::string>& values,
+    EventTime start,
+    EventTime stop,
+    QueryData& results) {
+  if (expire_events_) {
+    start = std::max(start, expire_time_.load());
+  }
 
-  std::shared_ptr<DBHandle> db;
-  try {
-    db = DBHandle::getInstance();
-  } catch (const std::runtime_error& e) {
-    return Status(1, e.what());
+  boost::lock_guard<boost::mutex> lock(recent_lock_);
+  if (start < recent_floor_ || indexed_columns_.count(column) == 0) {
+    return false;
   }
 
-  // Get and increment the EID for this module.
-  EventID eid = getEventID();
+  // The keys of every value are merged into time order.
+  auto first = getEventKey(start);
+  auto last = (stop == 0) ? std::string() : getEventKey((uint64_t)stop + 1);
+  std::set<std::string> keys;
+  auto index = recent_index_.find(column);
+  for (const auto& value : values) {
+    if (index == recent_index_.end()) {
+      break;
+    }
+    auto value_keys = index->second.find(value);
+    if (value_keys == index->second.end()) {
+      continue;
+    }
+    for (auto it = value_keys->second.lower_bound(first);
+         it != value_keys->second.end() && (last.empty() || *it < last);
+         ++it) {
+      keys.insert(*it);
+    }
+  }
 
-  std::string event_key = "data." + dbNamespace() + "." + eid;
-  std::string data;
+  for (const auto& key : keys) {
+    Row r;
+    auto event = recent_events_.find(key);
+    if (event != recent_events_.end() &&
+        deserializeRowBinary(event->second.data, r).ok()) {
+      results.push_back(std::move(r));
+    }
+  }
+  return true;
+}
 
-  status = serializeRowJSON(r, data);
-  if (!status.ok()) {
-    return status;
+void EventSubscriberPlugin::indexColumn(const std::string& column) {
+  boost::lock_guard<boost::mutex> lock(recent_lock_);
+  if (!indexed_columns_.insert(column).second) {
+    return;
   }
 
-  // Store the event data.
-  status = db->Put(kEvents, event_key, data);
-  // Record the event in the indexing bins.
-  recordEvent(eid, time);
-  return status;
+  // Events kept before the column was indexed are indexed now.
+  for (auto& event : recent_events_) {
+    recent_bytes_ -= indexRecentEvent(event.first, event.second.indexed, false);
+    event.second.indexed = getIndexedValues(event.second.data, nullptr);
+    recent_bytes_ += indexRecentEvent(event.first, event.second.indexed, true);
+  }
+}
+
+bool EventSubscriberPlugin::getRecentEvents(EventTime start,
+                                            EventTime stop,
+                                            QueryData& results) {
+  boost::lock_guard<boost::mutex> lock(recent_lock_);
+  if (start < recent_floor_) {
+    return false;
+  }
+
+  auto last = (stop == 0) ? std::string() : getEventKey((uint64_t)stop + 1);
+  std::vector<const std::string*> events;
+  for (auto it = recent_events_.lower_bound(getEventKey(start));
+       it != recent_events_.end() && (last.empty() || it->first < last);
+       ++it) {
+    events.push_back(&it->second.data);
+  }
+  deserializeEvents(events, results);
+  return true;
+}
+
+size_t EventSubscriberPlugin::recentEvents() {
+  boost::lock_guard<boost::mutex> lock(recent_lock_);
+  return recent_events_.size();
+}
+
+void EventSubscriberPlugin::flush() {
+  boost::unique_lock<boost::mutex> lock(event_queue_lock_);
+  // Events queued while waiting are left to the writer, a busy publisher
+  // cannot delay the flush indefinitely.
+  auto sequence = event_queue_sequence_;
+  while (event_written_sequence_ < sequence) {
+    event_queue_cv_.wait(lock);
+  }
+}
+
+void EventSubscriberPlugin::recordWrite(size_t time) {
+  size_t bucket = 0;
+  while (bucket < kEventLatencyBounds.size() &&
+         time >= kEventLatencyBounds[bucket]) {
+    bucket++;
+  }
+  write_latencies_[bucket]++;
+}
+
+std::vector<size_t> EventSubscriberPlugin::writeLatencies() const {
+  std::vector<size_t> latencies;
+  for (const auto& bucket : write_latencies_) {
+    latencies.push_back(bucket);
+  }
+  return latencies;
+}
+
+size_t EventSubscriberPlugin::queueDepth() {
+  boost::lock_guard<boost::mutex> lock(event_queue_lock_);
+  return event_queue_.size();
+}
+
+size_t EventSubscriberPlugin::queueBytes() {
+  boost::lock_guard<boost::mutex> lock(event_queue_lock_);
+  size_t bytes = 0;
+  for (const auto& event : event_queue_) {
+    bytes += event.first.size() + event.second.size();
+  }
+  return bytes;
+}
+
+EventSubscriberPlugin::~EventSubscriberPlugin() {
+  {
+    boost::lock_guard<boost::mutex> lock(event_queue_lock_);
+    event_writer_ending_ = true;
+    event_queue_cv_.notify_all();
+  }
+  // The writer writes the remaining queued events before exiting.
+  if (event_writer_ != nullptr) {
+    event_writer_->join();
+  }
 }
 
 void EventFactory::delay() {
   auto& ef = EventFactory::getInstance();
+  std::vector<EventPublisherRef> reactor;
   for (const auto& publisher : EventFactory::getInstance().event_pubs_) {
+#ifdef __linux__
+    if (publisher.second->getDescriptor() >= 0) {
+      // Descriptor-based publishers share the reactor thread.
+      reactor.push_back(publisher.second);
+      continue;
+    }
+#endif
     auto thread_ = std::make_shared<boost::thread>(
         boost::bind(&EventFactory::run, publisher.first));
     ef.threads_.push_back(thread_);
   }
+
+#ifdef __linux__
+  if (reactor.size() > 0) {
+    ef.reactor_wake_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ef.threads_.push_back(std::make_shared<boost::thread>(
+        boost::bind(&EventFactory::runReactor, reactor)));
+  }
+#endif
+
+  // The config is loaded once subscribers are registered.
+  auto limits = Config::getInstance()->getEventLimits();
+  for (const auto& subscriber : ef.event_subs_) {
+    if (limits.count(subscriber.first) > 0) {
+      subscriber.second->setLimits(limits.at(subscriber.first));
+    }
+  }
+
+  if (FLAGS_event_pubsub_expiry > 0) {
+    ef.expiration_ending_ = false;
+    ef.threads_.push_back(
+        std::make_shared<boost::thread>(&EventFactory::runExpiration));
+  }
+}
+
+void EventFactory::runExpiration() {
+  auto& ef = EventFactory::getInstance();
+  auto seconds = std::max(FLAGS_event_pubsub_expiry_interval, 1);
+  auto interval = boost::posix_time::seconds(seconds);
+  boost::unique_lock<boost::mutex> lock(ef.expiration_lock_);
+  while (!ef.expiration_ending_) {
+    ef.expiration_cv_.timed_wait(lock, interval);
+    if (ef.expiration_ending_) {
+      break;
+    }
+
+    // Subscribers are not added or removed while events run.
+    for (const auto& subscriber : ef.event_subs_) {
+      auto status = subscriber.second->expire(getUnixTime());
+      if (!status.ok()) {
+        LOG(WARNING) << "Cannot expire events of " << subscriber.first << ": "
+                     << status.toString();
+      }
+    }
+  }
+}
+
+Status EventFactory::runReactor(std::vector<EventPublisherRef> publishers) {
+#ifdef __linux__
+  auto policy = setThreadPolicy(kEventThread);
+  if (!policy.ok()) {
+    LOG(WARNING) << "Event thread policy not applied: " << policy.what();
+  }
+
+  auto& ef = EventFactory::getInstance();
+  int reactor = ::epoll_create1(EPOLL_CLOEXEC);
+  if (reactor == -1 || ef.reactor_wake_ == -1) {
+    LOG(ERROR) << "Could not create the event reactor";
+    return Status(1, "Event reactor failed");
+  }
+
+  // Each registered descriptor is identified by its publisher's index, the
+  // wake descriptor uses the index past the last publisher.
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.u32 = publishers.size();
+  ::epoll_ctl(reactor, EPOLL_CTL_ADD, ef.reactor_wake_, &event);
+
+  std::vector<bool> active(publishers.size(), false);
+  size_t running = 0;
+  for (size_t i = 0; i < publishers.size(); ++i) {
+    event.data.u32 = i;
+    int fd = publishers[i]->getDescriptor();
+    if (::epoll_ctl(reactor, EPOLL_CTL_ADD, fd, &event) == -1) {
+      LOG(ERROR) << "Could not add event publisher to reactor: "
+                 << publishers[i]->type();
+      publishers[i]->tearDown();
+      continue;
+    }
+
+    VLOG(1) << "Starting event publisher in reactor: " << publishers[i]->type();
+    publishers[i]->hasStarted(true);
+    active[i] = true;
+    running++;
+  }
+
+  struct epoll_event events[16];
+  bool ending = false;
+  while (!ending && running > 0) {
+    // Only wake without a readable descriptor to deliver coalesced events.
+    int timeout = -1;
+    for (size_t i = 0; i < publishers.size(); ++i) {
+      if (active[i] && publishers[i]->hasCoalesced()) {
+        timeout = std::max(FLAGS_event_pubsub_coalesce_ms, 1);
+        break;
+      }
+    }
+
+    int count = ::epoll_wait(reactor, events, 16, timeout);
+    if (count == -1 && errno != EINTR) {
+      LOG(ERROR) << "Could not wait on the event reactor";
+      break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      auto index = events[i].data.u32;
+      if (index == publishers.size()) {
+        ending = true;
+        continue;
+      }
+
+      auto& publisher = publishers[index];
+      if (!active[index] || publisher->isEnding()) {
+        continue;
+      }
+
+      if (!publisher->process().ok()) {
+        // The same as a failed run loop, stop and tear down this publisher.
+        ::epoll_ctl(reactor, EPOLL_CTL_DEL, publisher->getDescriptor(), &event);
+        publisher->flushCoalesced(true);
+        publisher->tearDown();
+        active[index] = false;
+        running--;
+      }
+    }
+
+    for (size_t i = 0; i < publishers.size(); ++i) {
+      if (active[i]) {
+        publishers[i]->flushCoalesced();
+      }
+    }
+  }
+
+  for (size_t i = 0; i < publishers.size(); ++i) {
+    if (active[i]) {
+      publishers[i]->flushCoalesced(true);
+      publishers[i]->tearDown();
+    }
+  }
+
+  ::close(reactor);
+  VLOG(1) << "Event reactor terminated";
+  return Status(0, "OK");
+#else
+  return Status(1, "No event reactor on this platform");
+#endif
 }
 
 Status EventFactory::run(EventPublisherID& type_id) {
@@ -411,15 +1056,22 @@ Status EventFactory::run(EventPublisherID& type_id) {
   }
 
   VLOG(1) << "Starting event publisher runloop: " + type_id;
+  auto policy = setThreadPolicy(kEventThread);
+  if (!policy.ok()) {
+    LOG(WARNING) << "Event thread policy not applied: " << policy.what();
+  }
   publisher->hasStarted(true);
 
   auto status = Status(0, "OK");
   while (!publisher->isEnding() && status.ok()) {
     // Can optionally implement a global cooloff latency here.
     status = publisher->run();
+    publisher->flushCoalesced();
     ::usleep(20);
   }
 
+  // Deliver events still waiting in a coalescing window before tearing down.
+  publisher->flushCoalesced(true);
   // The runloop status is not reflective of the event type's.
   publisher->tearDown();
   VLOG(1) << "Event publisher " << publisher->type() << " runloop terminated";
@@ -450,6 +1102,35 @@ Status EventFactory::registerEventPublisher(const EventPublisherRef& pub) {
   return Status(0, "OK");
 }
 
+void EventFactory::registerEventPublishers(
+    const std::vector<EventPublisherRef>& pubs) {
+  // Duplicate publisher types are not set up.
+  auto& ef = EventFactory::getInstance();
+  std::set<std::string> types;
+  std::vector<EventPublisherRef> added;
+  for (const auto& pub : pubs) {
+    if (ef.event_pubs_.count(pub->type()) == 0 &&
+        types.insert(pub->type()).second) {
+      added.push_back(pub);
+    }
+  }
+
+  // Publishers set up OS resources independently of each other.
+  std::vector<std::future<Status> > setups;
+  for (const auto& pub : added) {
+    setups.push_back(
+        std::async(std::launch::async, [pub]() { return pub->setUp(); }));
+  }
+
+  for (size_t i = 0; i < added.size(); ++i) {
+    if (setups[i].get().ok()) {
+      ef.event_pubs_[added[i]->type()] = added[i];
+    } else {
+      VLOG(1) << "Event publisher " << added[i]->type() << " setUp failed";
+    }
+  }
+}
+
 Status EventFactory::registerEventSubscriber(
     const EventSubscriberRef& event_module) {
   auto& ef = EventFactory::getInstance();
@@ -482,6 +1163,23 @@ Status EventFactory::addSubscription(EventPublisherID& type_id,
   return status;
 }
 
+Status EventFactory::removeSubscription(EventPublisherID& type_id,
+                                        const SubscriptionContextRef& mc) {
+  EventPublisherRef publisher;
+  try {
+    publisher = getInstance().getEventPublisher(type_id);
+  }
+  catch (std::out_of_range& e) {
+    return Status(1, "No event type found");
+  }
+
+  auto status = publisher->removeSubscription(mc);
+  if (status.ok()) {
+    publisher->configure();
+  }
+  return status;
+}
+
 size_t EventFactory::numSubscriptions(EventPublisherID& type_id) {
   EventPublisherRef publisher;
   try {
@@ -557,6 +1255,26 @@ void EventFactory::end(bool join) {
     deregisterEventPublisher(publisher);
   }
 
+  // Write the events queued by subscribers.
+  for (const auto& subscriber : ef.event_subs_) {
+    subscriber.second->flush();
+  }
+
+  {
+    boost::lock_guard<boost::mutex> lock(ef.expiration_lock_);
+    ef.expiration_ending_ = true;
+    ef.expiration_cv_.notify_all();
+  }
+
+#ifdef __linux__
+  if (ef.reactor_wake_ != -1) {
+    uint64_t wake = 1;
+    if (::write(ef.reactor_wake_, &wake, sizeof(wake)) != sizeof(wake)) {
+      LOG(WARNING) << "Could not wake the event reactor";
+    }
+  }
+#endif
+
   // Stop handling exceptions for the publisher threads.
   for (const auto& thread : ef.threads_) {
     if (join) {
@@ -568,17 +1286,30 @@ void EventFactory::end(bool join) {
 
   ::usleep(400);
   ef.threads_.clear();
+
+#ifdef __linux__
+  // A detached reactor may still be waiting on the wake descriptor.
+  if (join && ef.reactor_wake_ != -1) {
+    ::close(ef.reactor_wake_);
+    ef.reactor_wake_ = -1;
+  }
+#endif
 }
 
 void attachEvents() {
-  const auto& publishers = Registry::all("event_publisher");
-  for (const auto& publisher : publishers) {
-    EventFactory::registerEventPublisher(std::move(publisher.second));
+  std::vector<EventPublisherRef> publishers;
+  for (const auto& publisher : Registry::all("event_publisher")) {
+    publishers.push_back(
+        reinterpret_cast<const EventPublisherRef&>(publisher.second));
   }
+  EventFactory::registerEventPublishers(publishers);
 
-  const auto& subscribers = Registry::all("event_subscriber");
-  for (const auto& subscriber : subscribers) {
-    EventFactory::registerEventSubscriber(std::move(subscriber.second));
+  // Finding each subscriber runs its setUp, failed subscribers are removed.
+  for (const auto& name : Registry::names("event_subscriber")) {
+    auto subscriber = Registry::find("event_subscriber", name);
+    if (subscriber != nullptr) {
+      EventFactory::registerEventSubscriber(subscriber);
+    }
   }
 }
 }
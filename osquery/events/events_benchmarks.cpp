@@ -0,0 +1,186 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include <osquery/database/db_handle.h>
+#include <osquery/events.h>
+
+namespace osquery {
+
+const std::string kBenchmarkEventsDBPath =
+    "/tmp/rocksdb-osquery-benchmark-events";
+
+struct BenchmarkEventContext : public EventContext {
+  std::string payload;
+};
+
+typedef std::shared_ptr<BenchmarkEventContext> BenchmarkEventContextRef;
+
+class BenchmarkEventPublisher
+    : public EventPublisher<SubscriptionContext, BenchmarkEventContext> {
+  DECLARE_PUBLISHER("BenchmarkPublisher");
+};
+
+class BenchmarkEventSubscriber
+    : public EventSubscriber<BenchmarkEventPublisher> {
+  DECLARE_SUBSCRIBER("BenchmarkSubscriber");
+
+ public:
+  BenchmarkEventSubscriber() { doNotExpire(); }
+
+  /// Add an event resembling a file change at time t.
+  Status benchmarkAdd(int t) {
+    Row r;
+    r["target_path"] = "/etc/osquery/osquery.conf";
+    r["action"] = "UPDATED";
+    r["transaction_id"] = "0";
+    r["time"] = std::to_string(t);
+    return add(r, t);
+  }
+
+  QueryData benchmarkGet(EventTime start, EventTime stop) {
+    return get(start, stop);
+  }
+
+  /// Subscribe to the publisher, the subscriber is not registered.
+  void benchmarkSubscribe() {
+    subscribe(&BenchmarkEventSubscriber::Callback, createSubscriptionContext());
+  }
+
+  Status Callback(const BenchmarkEventContextRef& ec) {
+    Row r;
+    r["target_path"] = "/etc/osquery/osquery.conf";
+    r["action"] = "UPDATED";
+    r["payload"] = ec->payload;
+    return add(r, ec->time);
+  }
+};
+
+static void BM_event_add(benchmark::State& state) {
+  // A queue size of 0 writes each event to the backing store as it is added.
+  auto queue_size = FLAGS_event_pubsub_queue_size;
+  FLAGS_event_pubsub_queue_size = state.range(0);
+  auto sub = std::make_shared<BenchmarkEventSubscriber>();
+  int t = 1;
+  while (state.KeepRunning()) {
+    sub->benchmarkAdd(t++);
+    if (state.range(0) > 0 && t % (state.range(0) / 2) == 0) {
+      // Let the writer catch up such that the queue does not drop events.
+      state.PauseTiming();
+      sub->flush();
+      state.ResumeTiming();
+    }
+  }
+  sub->flush();
+  FLAGS_event_pubsub_queue_size = queue_size;
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_event_add)->Arg(0)->Arg(4096);
+
+/**
+ * @brief Fire events with a payload of range(0) bytes into a subscriber.
+ *
+ * The queue of range(1) events is flushed as it fills while timing, such
+ * that the rate is the ingest the backing store sustains. With a range(2)
+ * of events per second the fires are paced, and the rate shows whether that
+ * load is sustained.
+ */
+static void BM_event_fire(benchmark::State& state) {
+  auto queue_size = FLAGS_event_pubsub_queue_size;
+  FLAGS_event_pubsub_queue_size = state.range(1);
+  auto pub = std::make_shared<BenchmarkEventPublisher>();
+  EventFactory::registerEventPublisher(pub);
+  auto sub = std::make_shared<BenchmarkEventSubscriber>();
+  sub->benchmarkSubscribe();
+
+  auto ec = pub->createEventContext();
+  ec->payload = std::string(state.range(0), 'A');
+  auto db = DBHandle::getInstance();
+  auto db_size = db->getDiskUsage();
+  std::vector<size_t> latencies;
+  // Fires are paced to a rate of events per second, 0 fires back to back.
+  // A rate that is not sustained shows as fewer items per second.
+  auto rate = state.range(2);
+  auto interval = std::chrono::nanoseconds((rate > 0) ? 1000000000 / rate : 0);
+  auto next = std::chrono::steady_clock::now();
+  // Events are fired after any added by earlier benchmarks.
+  int t = 100000000;
+  while (state.KeepRunning()) {
+    if (rate > 0) {
+      std::this_thread::sleep_until(next);
+      next += interval;
+    }
+    auto start = std::chrono::steady_clock::now();
+    pub->fire(ec, t++);
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count());
+    if (state.range(1) > 0 && t % (state.range(1) / 2) == 0) {
+      sub->flush();
+    }
+  }
+  sub->flush();
+  EventPublisherID type = pub->type();
+  EventFactory::deregisterEventPublisher(type);
+  FLAGS_event_pubsub_queue_size = queue_size;
+
+  std::sort(latencies.begin(), latencies.end());
+  state.counters["target_events_per_second"] = rate;
+  state.counters["p99_add_us"] =
+      latencies[latencies.size() * 99 / 100] / 1000.0;
+  // Compaction may shrink the store, the size is then not counted.
+  db_size = std::max(db->getDiskUsage(), db_size) - db_size;
+  state.counters["disk_bytes_per_event"] =
+      (double)db_size / state.iterations();
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_event_fire)
+    ->Args({64, 0, 0})
+    ->Args({64, 4096, 0})
+    ->Args({4096, 0, 0})
+    ->Args({4096, 4096, 0})
+    ->Args({64, 4096, 1000})
+    ->Args({64, 4096, 10000})
+    ->Args({4096, 4096, 10000})
+    ->UseRealTime();
+
+static void BM_event_get(benchmark::State& state) {
+  auto sub = std::make_shared<BenchmarkEventSubscriber>();
+  size_t events = state.range(0);
+  // Events are added after any from earlier benchmarks.
+  int start = 1000000 * (int)events;
+  for (size_t i = 0; i < events; ++i) {
+    sub->benchmarkAdd(start + i);
+  }
+  sub->flush();
+
+  while (state.KeepRunning()) {
+    auto results = sub->benchmarkGet(start, start + events);
+    benchmark::DoNotOptimize(results);
+  }
+  state.SetItemsProcessed(state.iterations() * events);
+}
+
+BENCHMARK(BM_event_get)->Arg(100)->Arg(10000);
+}
+
+int main(int argc, char* argv[]) {
+  benchmark::Initialize(&argc, argv);
+  osquery::FLAGS_db_path = osquery::kBenchmarkEventsDBPath;
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
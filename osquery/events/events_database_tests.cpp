@@ -8,8 +8,8 @@
  *
  */
 
-#include <boost/algorithm/string.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <gtest/gtest.h>
 
@@ -18,6 +18,10 @@
 
 namespace osquery {
 
+namespace tables {
+DECLARE_int32(table_parallelism);
+}
+
 const std::string kTestingEventsDBPath = "/tmp/rocksdb-osquery-testevents";
 
 class EventsDatabaseTests : public ::testing::Test {
@@ -43,6 +47,28 @@ class FakeEventSubscriber : public EventSubscriber<FakeEventPublisher> {
     r["testing"] = "hello from space";
     return add(r, t);
   }
+
+  /// Add a fake event at time t with a path
+  Status testAddPath(int t, const std::string& path) {
+    RowEncoder r(2);
+    r.add("path", path).add("time", t);
+    return add(r, t);
+  }
+
+  /// Add a fake event at time t with a path, from a Row
+  Status testAddPathRow(int t, const std::string& path) {
+    Row r;
+    r["path"] = path;
+    r["time"] = std::to_string(t);
+    return add(r, t);
+  }
+
+  /// Add a fake event at time t, encoded column by column
+  Status testAddEncoded(int t, size_t columns = 2) {
+    RowEncoder r(columns);
+    r.add("testing", "hello from space").add("time", t);
+    return add(r, t);
+  }
 };
 
 TEST_F(EventsDatabaseTests, test_event_module_id) {
@@ -57,91 +83,378 @@ TEST_F(EventsDatabaseTests, test_event_module_id) {
 }
 
 
+TEST_F(EventsDatabaseTests, test_event_id_reservation) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  auto first = boost::lexical_cast<size_t>(sub->getEventID());
+  EXPECT_GT(first, 2);
+
+  // A block of IDs is reserved, the next IDs are allocated in memory.
+  std::string value;
+  auto db = DBHandle::getInstance();
+  db->Get(sub->dbDomain(), "eid.FakePublisher.FakeSubscriber", value);
+  auto reserved = boost::lexical_cast<size_t>(value);
+  EXPECT_GE(reserved, first + 1);
+  EXPECT_EQ(boost::lexical_cast<size_t>(sub->getEventID()), first + 1);
+
+  // A restarted subscriber continues after the reserved IDs.
+  auto restarted = std::make_shared<FakeEventSubscriber>();
+  EXPECT_EQ(boost::lexical_cast<size_t>(restarted->getEventID()),
+            reserved + 1);
+}
+
 TEST_F(EventsDatabaseTests, test_event_add) {
   auto sub = std::make_shared<FakeEventSubscriber>();
   auto status = sub->testAdd(1);
   EXPECT_TRUE(status.ok());
 }
 
-TEST_F(EventsDatabaseTests, test_record_indexing) {
+TEST_F(EventsDatabaseTests, test_event_keys) {
   auto sub = std::make_shared<FakeEventSubscriber>();
-  auto status = sub->testAdd(2);
-  status = sub->testAdd(11);
-  status = sub->testAdd(61);
-  status = sub->testAdd((1 * 3600) + 1);
-  status = sub->testAdd((2 * 3600) + 1);
 
-  // An "all" range, will pick up everything in the largest index.
-  auto indexes = sub->getIndexes(0, 3 * 3600);
-  auto output = boost::algorithm::join(indexes, ", ");
-  EXPECT_EQ(output, "3600.0, 3600.1, 3600.2");
+  // Keys sort by time, then by the numeric EventID.
+  EXPECT_LT(sub->getEventKey(2, "10"), sub->getEventKey(11, "9"));
+  EXPECT_LT(sub->getEventKey(11, "9"), sub->getEventKey(11, "10"));
+  EXPECT_LT(sub->getEventKey(11), sub->getEventKey(11, "1"));
+  EXPECT_LT(sub->getEventKey(255, "1"), sub->getEventKey(256, "1"));
+  EXPECT_EQ(sub->getEventKey(1).find("data.FakePublisher.FakeSubscriber/"), 0);
+}
 
-  // Restrict range to "most specific".
-  indexes = sub->getIndexes(0, 5);
-  output = boost::algorithm::join(indexes, ", ");
-  EXPECT_EQ(output, "10.0");
+TEST_F(EventsDatabaseTests, test_event_range) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  sub->testAdd(2);
+  sub->testAdd(11);
+  sub->testAdd(61);
+  sub->testAdd((1 * 3600) + 1);
+  sub->testAdd((2 * 3600) + 1);
 
-  // Get a mix of indexes for the lower bounding.
-  indexes = sub->getIndexes(2, (3 * 3600));
-  output = boost::algorithm::join(indexes, ", ");
-  EXPECT_EQ(output, "3600.1, 3600.2, 60.1, 10.0, 10.1");
+  // Search within a specific range, including the event added at 1.
+  auto results = sub->get(0, 10);
+  EXPECT_EQ(results.size(), 2); // 1, 2
 
-  // Rare, but test ONLY intermediate indexes.
-  indexes = sub->getIndexes(2, (3 * 3600), 1);
-  output = boost::algorithm::join(indexes, ", ");
-  EXPECT_EQ(output, "60.0, 60.1, 60.60, 60.120");
+  // Bounds are inclusive.
+  results = sub->get(2, 61);
+  EXPECT_EQ(results.size(), 3); // 2, 11, 61
+  results = sub->get(3, 3601);
+  EXPECT_EQ(results.size(), 3); // 11, 61, 3601
 
-  // Add specific indexes to the upper bound.
-  status = sub->testAdd((2 * 3600) + 11);
-  status = sub->testAdd((2 * 3600) + 61);
-  indexes = sub->getIndexes(2 * 3600, (2 * 3600) + 62);
-  output = boost::algorithm::join(indexes, ", ");
-  EXPECT_EQ(output, "60.120, 10.726");
+  // Get all of the events.
+  results = sub->get(0, 3 * 3600);
+  EXPECT_EQ(results.size(), 6); // 1, 2, 11, 61, 3601, 7201
 
-  // Request specific lower and upper bounding.
-  indexes = sub->getIndexes(2, (2 * 3600) + 62);
-  output = boost::algorithm::join(indexes, ", ");
-  EXPECT_EQ(output, "3600.1, 60.1, 60.120, 10.0, 10.1, 10.726");
+  // stop = 0 is an alias for everything.
+  results = sub->get(0, 0);
+  EXPECT_EQ(results.size(), 6);
+  EXPECT_EQ(results[0]["testing"], "hello from space");
 }
 
-TEST_F(EventsDatabaseTests, test_record_range) {
+TEST_F(EventsDatabaseTests, test_event_expiration) {
   auto sub = std::make_shared<FakeEventSubscriber>();
 
-  // Search within a specific record range.
-  auto indexes = sub->getIndexes(0, 10);
-  auto records = sub->getRecords(indexes);
-  EXPECT_EQ(records.size(), 2); // 1, 2
+  // No expiration
+  auto results = sub->get(0, 60);
+  EXPECT_EQ(results.size(), 3); // 1, 2, 11
 
-  // Search within a large bound.
-  indexes = sub->getIndexes(3, 3601);
-  // This will include the 0-10 bucket meaning 1, 2 will show up.
-  records = sub->getRecords(indexes);
-  EXPECT_EQ(records.size(), 5); // 1, 2, 11, 61, 3601
+  sub->expire_events_ = true;
+  sub->expire_time_ = 10;
+  results = sub->get(0, 60);
+  EXPECT_EQ(results.size(), 1); // 11
 
-  // Get all of the records.
-  indexes = sub->getIndexes(0, 3 * 3600);
-  records = sub->getRecords(indexes);
-  EXPECT_EQ(records.size(), 8); // 1, 2, 11, 61, 3601, 7201, 7211, 7261
+  // Queries do not remove expired events.
+  sub->expire_time_ = 0;
+  results = sub->get(0, 60);
+  EXPECT_EQ(results.size(), 3); // 1, 2, 11
+}
 
-  // stop = 0 is an alias for everything.
-  indexes = sub->getIndexes(0, 0);
-  records = sub->getRecords(indexes);
-  EXPECT_EQ(records.size(), 8);
+TEST_F(EventsDatabaseTests, test_event_expire) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  auto expiry = FLAGS_event_pubsub_expiry;
+
+  // Events older than the expiry are removed.
+  FLAGS_event_pubsub_expiry = 100;
+  EXPECT_TRUE(sub->expire(110).ok());
+  EXPECT_EQ(sub->expire_time_, 10);
+  sub->expire_time_ = 0;
+  auto results = sub->get(0, 60);
+  EXPECT_EQ(results.size(), 1); // 11
+
+  // Subscribers that do not expire events keep them.
+  sub->doNotExpire();
+  EXPECT_TRUE(sub->expire(200000).ok());
+  results = sub->get(0, 60);
+  EXPECT_EQ(results.size(), 1);
+  FLAGS_event_pubsub_expiry = expiry;
 }
 
-TEST_F(EventsDatabaseTests, test_record_expiration) {
+TEST_F(EventsDatabaseTests, test_event_domain) {
   auto sub = std::make_shared<FakeEventSubscriber>();
+  auto db = DBHandle::getInstance();
+  auto key = sub->getEventKey(700001, "1");
+  EXPECT_TRUE(db->Put(kEvents, key, "legacy").ok());
 
-  // No expiration
-  auto indexes = sub->getIndexes(0, 60);
-  auto records = sub->getRecords(indexes);
-  EXPECT_EQ(records.size(), 3); // 1, 2, 11
+  // More events than a single batch moves.
+  size_t count = kEventMigrateChunkSize + 3;
+  for (size_t i = 0; i < count; ++i) {
+    auto chunked = sub->getEventKey(710000 + i, std::to_string(i + 2));
+    EXPECT_TRUE(db->Put(kEvents, chunked, "legacy").ok());
+  }
 
-  sub->expire_events_ = true;
-  sub->expire_time_ = 10;
-  indexes = sub->getIndexes(0, 60);
-  records = sub->getRecords(indexes);
-  EXPECT_EQ(records.size(), 1); // 11
+  // Events stored in the shared domain move to the subscriber's domain.
+  EXPECT_TRUE(sub->openDomain().ok());
+  EXPECT_FALSE(db->Exists(kEvents, key));
+  EXPECT_TRUE(db->Exists(sub->dbDomain(), key));
+  EXPECT_TRUE(db->Delete(sub->dbDomain(), key).ok());
+
+  size_t moved = 0;
+  auto first = sub->getEventKey(710000);
+  auto last = sub->getEventKey(710000 + count);
+  db->ScanRange(sub->dbDomain(),
+                first,
+                last,
+                [&moved](const rocksdb::Slice&, const rocksdb::Slice&) {
+                  moved++;
+                  return true;
+                });
+  EXPECT_EQ(moved, count);
+  EXPECT_TRUE(db->DeleteRange(sub->dbDomain(), first, last).ok());
+
+  std::vector<std::string> legacy;
+  db->Scan(kEvents, legacy);
+  for (const auto& legacy_key : legacy) {
+    EXPECT_NE(legacy_key.find("data.FakePublisher"), 0U);
+  }
+}
+
+TEST_F(EventsDatabaseTests, test_event_queue) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  auto queue_size = FLAGS_event_pubsub_queue_size;
+
+  // Adds are queued, and get reads the queued events once they are written.
+  EXPECT_TRUE(sub->testAdd(500001).ok());
+  EXPECT_TRUE(sub->testAdd(500002).ok());
+  auto results = sub->get(500001, 500002);
+  EXPECT_EQ(results.size(), 2);
+  EXPECT_EQ(sub->queueDepth(), 0);
+
+  // Events are dropped when the queue is full, the writer of a new
+  // subscriber is not started until an event is queued.
+  auto full = std::make_shared<FakeEventSubscriber>();
+  full->event_queue_.push_back(std::make_pair("pending", "pending"));
+  FLAGS_event_pubsub_queue_size = 1;
+  EXPECT_FALSE(full->testAdd(500003).ok());
+  EXPECT_EQ(full->droppedEvents(), 1);
+  EXPECT_EQ(full->queueDepth(), 1);
+
+  FLAGS_event_pubsub_queue_size = queue_size;
+  EXPECT_TRUE(full->testAdd(500003).ok());
+  full->flush();
+  EXPECT_EQ(full->queueDepth(), 0);
+  EXPECT_TRUE(DBHandle::getInstance()->Exists(full->dbDomain(), "pending"));
+  DBHandle::getInstance()->Delete(full->dbDomain(), "pending");
+}
+
+TEST_F(EventsDatabaseTests, test_event_limits) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+
+  // 1 in 2 events are sampled.
+  sub->setLimits({0, 0, 2});
+  for (size_t i = 0; i < 4; ++i) {
+    EXPECT_TRUE(sub->testAdd(600001).ok());
+  }
+  EXPECT_EQ(sub->sampledEvents(), 2);
+  EXPECT_EQ(sub->get(600001, 600001).size(), 2);
+
+  // A burst of 2 events is allowed above the rate.
+  sub->setLimits({1, 2, 1});
+  EXPECT_TRUE(sub->testAdd(600002).ok());
+  EXPECT_TRUE(sub->testAdd(600002).ok());
+  EXPECT_FALSE(sub->testAdd(600002).ok());
+  EXPECT_EQ(sub->limitedEvents(), 1);
+  EXPECT_EQ(sub->get(600002, 600002).size(), 2);
+}
+
+TEST_F(EventsDatabaseTests, test_event_add_encoded) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  EXPECT_FALSE(sub->testAddEncoded(650001, 3).ok());
+  EXPECT_TRUE(sub->testAddEncoded(650001).ok());
+
+  auto results = sub->get(650001, 650001);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["testing"], "hello from space");
+  EXPECT_EQ(results[0]["time"], "650001");
+}
+
+TEST_F(EventsDatabaseTests, test_event_time_constraints) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  sub->testAdd(700001);
+  sub->testAdd(700002);
+  sub->testAdd(700003);
+
+  // Time constraints are pushed down into the range of events read.
+  tables::QueryContext context;
+  context.constraints["time"].add(
+      tables::Constraint(tables::GREATER_THAN, "700001"));
+  EXPECT_EQ(sub->genTable(context).size(), 2);
+  context.constraints["time"].add(
+      tables::Constraint(tables::LESS_THAN_OR_EQUALS, "700002"));
+  EXPECT_EQ(sub->genTable(context).size(), 1);
+
+  // An empty range reads no events.
+  context.constraints["time"].add(tables::Constraint(tables::EQUALS, "2"));
+  EXPECT_EQ(sub->genTable(context).size(), 0);
+
+  // A query's event window excludes its stop time.
+  tables::QueryContext window;
+  window.events = tables::EventWindow(700001, 700003);
+  EXPECT_EQ(sub->genTable(window).size(), 2);
+  window.constraints["time"].add(
+      tables::Constraint(tables::GREATER_THAN_OR_EQUALS, "700002"));
+  EXPECT_EQ(sub->genTable(window).size(), 1);
+}
+
+TEST_F(EventsDatabaseTests, test_event_counters) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  EXPECT_EQ(sub->addedEvents(), 0);
+  auto latencies = sub->writeLatencies();
+  EXPECT_EQ(latencies.size(), kEventLatencyBounds.size() + 1);
+
+  // Added events are counted, then each write is counted by its latency.
+  EXPECT_TRUE(sub->testAdd(750001).ok());
+  EXPECT_TRUE(sub->testAdd(750002).ok());
+  sub->flush();
+  EXPECT_EQ(sub->addedEvents(), 2);
+
+  size_t writes = 0;
+  for (const auto& count : sub->writeLatencies()) {
+    writes += count;
+  }
+  EXPECT_GE(writes, 1);
+  EXPECT_LE(writes, 2);
+
+  // The histogram buckets are bounded by kEventLatencyBounds.
+  sub->recordWrite(0);
+  sub->recordWrite(kEventLatencyBounds[0]);
+  sub->recordWrite(kEventLatencyBounds.back() * 2);
+  latencies = sub->writeLatencies();
+  EXPECT_GE(latencies[0], 1);
+  EXPECT_GE(latencies[1], 1);
+  EXPECT_EQ(latencies.back(), 1);
+}
+
+TEST_F(EventsDatabaseTests, test_event_recent) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  sub->doNotExpire();
+  int now = getUnixTime();
+
+  // Events before the subscriber started are only in the backing store.
+  EXPECT_TRUE(sub->testAdd(now - 100).ok());
+  EXPECT_TRUE(sub->testAdd(now + 10).ok());
+  EXPECT_TRUE(sub->testAdd(now + 11).ok());
+  EXPECT_EQ(sub->recentEvents(), 2);
+
+  // Recent windows are read from memory, without their stored events.
+  sub->flush();
+  EXPECT_TRUE(sub->expireEvents(now + 12).ok());
+  EXPECT_EQ(sub->get(now + 10, now + 10).size(), 1);
+  EXPECT_EQ(sub->get(now + 10, 0).size(), 2);
+  EXPECT_EQ(sub->get(now - 100, 0).size(), 0);
+
+  // An evicted event's window is read from the backing store again.
+  auto memory_bytes = FLAGS_event_pubsub_memory_bytes;
+  FLAGS_event_pubsub_memory_bytes = 1;
+  EXPECT_TRUE(sub->testAdd(now + 12).ok());
+  EXPECT_EQ(sub->recentEvents(), 0);
+  EXPECT_EQ(sub->get(now + 12, now + 12).size(), 1);
+  FLAGS_event_pubsub_memory_bytes = memory_bytes;
+}
+
+TEST_F(EventsDatabaseTests, test_event_parallel_get) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  sub->doNotExpire();
+  auto parallelism = tables::FLAGS_table_parallelism;
+  tables::FLAGS_table_parallelism = 4;
+
+  // Wide ranges are deserialized in chunks, rows stay in time order.
+  size_t count = 4 * 4096 + 3;
+  for (size_t i = 0; i < count; ++i) {
+    EXPECT_TRUE(sub->testAddEncoded(1000 + i).ok());
+  }
+  auto results = sub->get(1000, 1000 + count - 1);
+  ASSERT_EQ(results.size(), count);
+  for (size_t i = 0; i < count; ++i) {
+    ASSERT_EQ(results[i]["time"], std::to_string(1000 + i));
+  }
+  tables::FLAGS_table_parallelism = parallelism;
+}
+
+TEST_F(EventsDatabaseTests, test_event_snapshot_get) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  sub->doNotExpire();
+  EXPECT_TRUE(sub->testAdd(800001).ok());
+  EXPECT_TRUE(sub->testAdd(800002).ok());
+  sub->flush();
+  auto snapshot = DBHandle::getInstance()->getSnapshot();
+  ASSERT_NE(snapshot, nullptr);
+
+  // Events stored after the snapshot was taken are not read from it.
+  EXPECT_TRUE(sub->testAdd(800003).ok());
+  sub->flush();
+  EXPECT_EQ(sub->get(800001, 800003, snapshot).size(), 2U);
+  EXPECT_EQ(sub->get(800001, 800003).size(), 3U);
+
+  // Table reads with the query's snapshot read the same events.
+  tables::QueryContext context;
+  context.events.start = 800001;
+  context.events.stop = 800004;
+  context.events.snapshot = snapshot;
+  EXPECT_EQ(sub->genTable(context).size(), 2U);
+  context.events.snapshot = nullptr;
+  EXPECT_EQ(sub->genTable(context).size(), 3U);
+}
+
+TEST_F(EventsDatabaseTests, test_event_recent_index) {
+  auto sub = std::make_shared<FakeEventSubscriber>();
+  sub->doNotExpire();
+  int now = getUnixTime();
+  EXPECT_TRUE(sub->testAddPath(now + 1, "/etc/hosts").ok());
+  auto unindexed_bytes = sub->recent_bytes_;
+  sub->indexColumn("path");
+  EXPECT_GT(sub->recent_bytes_, unindexed_bytes);
+  EXPECT_TRUE(sub->testAddPathRow(now + 2, "/etc/passwd").ok());
+  EXPECT_TRUE(sub->testAddPath(now + 3, "/etc/hosts").ok());
+
+  // Events kept before the column was indexed are found too.
+  QueryData results;
+  EXPECT_TRUE(
+      sub->getIndexedEvents("path", {"/etc/hosts"}, now + 1, 0, results));
+  ASSERT_EQ(results.size(), 2U);
+  EXPECT_EQ(results[0]["time"], std::to_string(now + 1));
+  EXPECT_EQ(results[1]["time"], std::to_string(now + 3));
+
+  results.clear();
+  EXPECT_TRUE(sub->getIndexedEvents(
+      "path", {"/etc/hosts", "/etc/passwd"}, now + 2, now + 2, results));
+  ASSERT_EQ(results.size(), 1U);
+  EXPECT_EQ(results[0]["path"], "/etc/passwd");
+
+  // Unindexed columns and windows before the recent events are not served.
+  EXPECT_FALSE(sub->getIndexedEvents("time", {"1"}, now + 1, 0, results));
+  EXPECT_FALSE(sub->getIndexedEvents("path", {"/etc/hosts"}, 0, 0, results));
+
+  // Table reads with an EQUALS constraint on the column use the index.
+  tables::QueryContext context;
+  context.events.start = now + 1;
+  context.constraints["path"].add(
+      tables::Constraint(tables::EQUALS, "/etc/passwd"));
+  EXPECT_EQ(sub->genTable(context).size(), 1U);
+
+  // Evicted events are removed from the index.
+  auto memory_bytes = FLAGS_event_pubsub_memory_bytes;
+  FLAGS_event_pubsub_memory_bytes = 1;
+  EXPECT_TRUE(sub->testAddPath(now + 4, "/etc/hosts").ok());
+  EXPECT_EQ(sub->recentEvents(), 0U);
+  EXPECT_TRUE(sub->recent_index_["path"].empty());
+  EXPECT_EQ(sub->recent_bytes_, 0U);
+  FLAGS_event_pubsub_memory_bytes = memory_bytes;
 }
 }
 
@@ -150,6 +150,28 @@ TEST_F(EventsTests, test_create_subscription) {
   EXPECT_EQ(EventFactory::numSubscriptions("publisher"), 1);
 }
 
+TEST_F(EventsTests, test_remove_subscription) {
+  auto pub = std::make_shared<BasicEventPublisher>();
+  EventFactory::registerEventPublisher(pub);
+
+  auto kept = std::make_shared<SubscriptionContext>();
+  auto removed = std::make_shared<SubscriptionContext>();
+  EventFactory::addSubscription("publisher", kept);
+  EventFactory::addSubscription("publisher", removed);
+  EventFactory::addSubscription("publisher", removed);
+  EXPECT_EQ(EventFactory::numSubscriptions("publisher"), 3);
+
+  // Every subscription using the context is removed.
+  auto status = EventFactory::removeSubscription("publisher", removed);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(EventFactory::numSubscriptions("publisher"), 1);
+
+  status = EventFactory::removeSubscription("publisher", removed);
+  EXPECT_FALSE(status.ok());
+  status = EventFactory::removeSubscription("FakePublisher", kept);
+  EXPECT_FALSE(status.ok());
+}
+
 TEST_F(EventsTests, test_multiple_subscriptions) {
   Status status;
 
@@ -208,6 +230,21 @@ class TestEventPublisher
   int smallest_ever_;
 };
 
+TEST_F(EventsTests, test_register_event_pubs) {
+  auto pub = std::make_shared<TestEventPublisher>();
+  auto duplicate = std::make_shared<TestEventPublisher>();
+  auto basic_pub = std::make_shared<BasicEventPublisher>();
+  EventFactory::registerEventPublishers(
+      {reinterpret_cast<const EventPublisherRef&>(pub),
+       reinterpret_cast<const EventPublisherRef&>(duplicate),
+       basic_pub});
+
+  // Each publisher type is set up once, concurrently with other types.
+  EXPECT_EQ(EventFactory::numEventPublishers(), 2);
+  EXPECT_EQ(pub->getTestValue(), 1);
+  EXPECT_EQ(duplicate->getTestValue(), 0);
+}
+
 TEST_F(EventsTests, test_create_custom_event_pub) {
   auto basic_pub = std::make_shared<BasicEventPublisher>();
   EventFactory::registerEventPublisher(basic_pub);
@@ -332,6 +369,8 @@ TEST_F(EventsTests, test_event_sub_subscribe) {
   pub->fire(ec, 0);
 
   EXPECT_TRUE(sub->bellHathTolled);
+  // The subscriber counts the calls to its callback.
+  EXPECT_EQ(sub->numCallbacks(), 1);
 }
 
 TEST_F(EventsTests, test_event_sub_context) {
@@ -376,6 +415,128 @@ TEST_F(EventsTests, test_fire_event) {
   pub->fire(ec, 0);
   EXPECT_EQ(kBellHathTolled, 4);
 }
+
+// A publisher that coalesces events with the same required value.
+class CoalesceEventPublisher
+    : public EventPublisher<FakeSubscriptionContext, FakeEventContext> {
+  DECLARE_PUBLISHER("CoalescePublisher");
+
+ protected:
+  std::string getCoalesceKey(const EventContextRef& ec) const {
+    auto fake_ec = getEventContext(ec);
+    if (fake_ec->required_value == 0) {
+      return "";
+    }
+    return std::to_string(fake_ec->required_value);
+  }
+};
+
+TEST_F(EventsTests, test_event_coalesce) {
+  auto pub = std::make_shared<CoalesceEventPublisher>();
+  EventFactory::registerEventPublisher(pub);
+
+  std::vector<size_t> counts;
+  auto subscription = Subscription::create();
+  subscription->callback = [&counts](EventContextRef ec) {
+    counts.push_back(ec->count);
+    return Status(0, "OK");
+  };
+  EventFactory::addSubscription("CoalescePublisher", subscription);
+
+  FLAGS_event_pubsub_coalesce_ms = 60000;
+  for (int value : {1, 1, 2, 1, 0}) {
+    auto ec = pub->createEventContext();
+    ec->required_value = value;
+    pub->fire(ec, 0);
+  }
+
+  // Only the event without a coalesce key was delivered immediately.
+  ASSERT_EQ(counts.size(), 1);
+  EXPECT_EQ(counts[0], 1);
+  EXPECT_EQ(pub->numEvents(), 5);
+  EXPECT_EQ(pub->numCoalesced(), 2);
+
+  // The window has not elapsed, nothing is delivered without forcing.
+  pub->flushCoalesced();
+  EXPECT_EQ(counts.size(), 1);
+
+  // Forcing delivers pending events in the order they were first fired.
+  pub->flushCoalesced(true);
+  ASSERT_EQ(counts.size(), 3);
+  EXPECT_EQ(counts[1], 3);
+  EXPECT_EQ(counts[2], 1);
+
+  // An elapsed window delivers the pending event.
+  FLAGS_event_pubsub_coalesce_ms = 1;
+  auto ec = pub->createEventContext();
+  ec->required_value = 1;
+  pub->fire(ec, 0);
+  ::usleep(5 * 1000);
+  pub->flushCoalesced();
+  EXPECT_EQ(counts.size(), 4);
+  FLAGS_event_pubsub_coalesce_ms = 0;
+}
+
+#ifdef __linux__
+// A publisher reading from a pipe, which should never need a run loop.
+class DescriptorEventPublisher : public BasicEventPublisher {
+  DECLARE_PUBLISHER("DescriptorPublisher");
+
+ public:
+  Status setUp() {
+    if (::pipe(pipe_) != 0) {
+      return Status(1, "Cannot create pipe");
+    }
+    return Status(0, "OK");
+  }
+
+  void tearDown() {
+    ::close(pipe_[0]);
+    ::close(pipe_[1]);
+    torn_down_ = true;
+  }
+
+  int getDescriptor() { return pipe_[0]; }
+
+  Status process() {
+    char buffer;
+    if (::read(pipe_[0], &buffer, 1) != 1) {
+      return Status(1, "Cannot read pipe");
+    }
+    processed_++;
+    return Status(0, "OK");
+  }
+
+  Status run() {
+    ran_ = true;
+    return Status(1, "Should use the reactor");
+  }
+
+ public:
+  int pipe_[2];
+  std::atomic<int> processed_{0};
+  std::atomic<bool> ran_{false};
+  std::atomic<bool> torn_down_{false};
+};
+
+TEST_F(EventsTests, test_event_reactor) {
+  auto pub = std::make_shared<DescriptorEventPublisher>();
+  EXPECT_TRUE(EventFactory::registerEventPublisher(pub).ok());
+  EventFactory::delay();
+
+  EXPECT_EQ(::write(pub->pipe_[1], "ab", 2), 2);
+  for (int delay = 0; delay < 3000 && pub->processed_ < 2; delay += 10) {
+    ::usleep(10 * 1000);
+  }
+  EXPECT_EQ(pub->processed_, 2);
+  EXPECT_TRUE(pub->hasStarted());
+
+  // Ending wakes and joins the reactor, which tears down the publisher.
+  EventFactory::end(true);
+  EXPECT_TRUE(pub->torn_down_);
+  EXPECT_FALSE(pub->ran_);
+}
+#endif
 }
 
 int main(int argc, char* argv[]) {
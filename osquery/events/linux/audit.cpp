@@ -0,0 +1,455 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <osquery/events.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+
+#include "osquery/events/linux/audit.h"
+
+namespace osquery {
+
+DEFINE_osquery_flag(bool,
+                    disable_audit,
+                    true,
+                    "Disable receiving events from the kernel audit system.");
+
+int kAuditULatency = 200;
+/// Audit records are sent one per datagram, text is at most a page.
+static const size_t kAuditBufferSize = 16 * 1024;
+/// The number of receives drained each time the socket is readable.
+static const size_t kAuditMaxReads = 256;
+/// Events missing an end-of-event record are dropped past this many.
+static const size_t kAuditMaxPending = 1024;
+/// Milliseconds to wait for the kernel to acknowledge a request.
+static const int kAuditAckTimeout = 1000;
+
+/// The syscalls audited by the publisher's rule.
+static const std::vector<int> kAuditSyscalls = {
+    __NR_execve, __NR_connect, __NR_bind,
+};
+
+#if defined(__x86_64__)
+static const uint32_t kAuditArch = AUDIT_ARCH_X86_64;
+#elif defined(__aarch64__)
+static const uint32_t kAuditArch = AUDIT_ARCH_AARCH64;
+#else
+/// The rule cannot name the native syscall table, setUp fails.
+static const uint32_t kAuditArch = 0;
+#endif
+
+REGISTER(AuditEventPublisher, "event_publisher", "audit");
+
+bool parseAuditRecord(const char* data,
+                      size_t size,
+                      EventTime& time,
+                      uint64_t& serial,
+                      AuditFields& fields) {
+  const char* end = data + size;
+  while (end > data && (*(end - 1) == '\0' || *(end - 1) == '\n')) {
+    --end;
+  }
+
+  // The header is "audit(<seconds>.<millis>:<serial>): ".
+  if (end - data < 6 || std::strncmp(data, "audit(", 6) != 0) {
+    return false;
+  }
+
+  const char* p = data + 6;
+  char* next = nullptr;
+  time = std::strtoul(p, &next, 10);
+  if (next == p || next >= end || *next != '.') {
+    return false;
+  }
+  p = next + 1;
+  std::strtoul(p, &next, 10);
+  if (next >= end || *next != ':') {
+    return false;
+  }
+  p = next + 1;
+  serial = std::strtoull(p, &next, 10);
+  if (next == p || next + 2 > end || *next != ')' || *(next + 1) != ':') {
+    return false;
+  }
+  p = next + 2;
+
+  // Fields are space-separated key=value pairs.
+  while (p < end) {
+    while (p < end && *p == ' ') {
+      ++p;
+    }
+    const char* token = p;
+    while (p < end && *p != ' ') {
+      ++p;
+    }
+
+    auto equal = static_cast<const char*>(std::memchr(token, '=', p - token));
+    if (equal != nullptr) {
+      fields[std::string(token, equal - token)] =
+          std::string(equal + 1, p - equal - 1);
+    }
+  }
+  return true;
+}
+
+/// Convert a single hex digit, -1 if it is not a hex digit.
+static int hexValue(char digit) {
+  if (digit >= '0' && digit <= '9') {
+    return digit - '0';
+  } else if (digit >= 'a' && digit <= 'f') {
+    return digit - 'a' + 10;
+  } else if (digit >= 'A' && digit <= 'F') {
+    return digit - 'A' + 10;
+  }
+  return -1;
+}
+
+std::string decodeAuditValue(const std::string& value) {
+  if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+    return value.substr(1, value.size() - 2);
+  } else if (value == "(null)") {
+    return "";
+  }
+
+  std::string decoded;
+  decoded.reserve(value.size() / 2);
+  for (size_t i = 0; i + 1 < value.size(); i += 2) {
+    int high = hexValue(value[i]);
+    int low = hexValue(value[i + 1]);
+    if (high < 0 || low < 0) {
+      // Not an encoded value.
+      return value;
+    }
+    decoded.push_back(static_cast<char>((high << 4) | low));
+  }
+  return decoded;
+}
+
+bool parseAuditAck(const char* data,
+                   size_t size,
+                   uint32_t sequence,
+                   int& error) {
+  int length = (int)size;
+  auto header = reinterpret_cast<const struct nlmsghdr*>(data);
+  for (; NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+    if (header->nlmsg_type != NLMSG_ERROR || header->nlmsg_seq != sequence ||
+        header->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+      continue;
+    }
+    auto ack = static_cast<const struct nlmsgerr*>(NLMSG_DATA(header));
+    error = -ack->error;
+    return true;
+  }
+  return false;
+}
+
+Status AuditEventPublisher::setUp() {
+  if (FLAGS_disable_audit) {
+    return Status(1, "Audit publisher disabled via configuration");
+  }
+
+  if (kAuditArch == 0) {
+    return Status(1, "Audit publisher does not support this architecture");
+  }
+
+  socket_ = ::socket(PF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     NETLINK_AUDIT);
+  if (socket_ == -1) {
+    return Status(1, "Could not create audit netlink socket.");
+  }
+
+  // Become the audit daemon, the kernel unicasts records to this process.
+  struct audit_status status;
+  memset(&status, 0, sizeof(status));
+  status.mask = AUDIT_STATUS_ENABLED | AUDIT_STATUS_PID;
+  status.enabled = 1;
+  status.pid = ::getpid();
+  int error = 0;
+  auto result = send(AUDIT_SET, &status, sizeof(status), error);
+  if (result.ok() && error != 0) {
+    result = Status(1, "Could not become the audit daemon: " +
+                           std::string(strerror(error)));
+  }
+
+  if (result.ok()) {
+    is_daemon_ = true;
+    result = controlRule(AUDIT_ADD_RULE, error);
+  }
+
+  // An identical rule installed by another tool (EEXIST) is used as is, and
+  // is not removed by tearDown.
+  if (result.ok() && error == 0) {
+    added_rule_ = true;
+  } else if (result.ok() && error != EEXIST) {
+    result = Status(1, "Could not add the audit rule: " +
+                           std::string(strerror(error)));
+  }
+
+  if (!result.ok()) {
+    tearDown();
+    return result;
+  }
+
+  buffer_.resize(kAuditBufferSize);
+  return Status(0, "OK");
+}
+
+void AuditEventPublisher::tearDown() {
+  if (socket_ == -1) {
+    return;
+  }
+
+  // Remove only the rule this publisher added, then stop receiving records.
+  int error = 0;
+  if (added_rule_ &&
+      (!controlRule(AUDIT_DEL_RULE, error).ok() || error != 0)) {
+    LOG(WARNING) << "Could not remove the audit rule";
+  }
+
+  if (is_daemon_) {
+    struct audit_status status;
+    memset(&status, 0, sizeof(status));
+    status.mask = AUDIT_STATUS_PID;
+    status.pid = 0;
+    send(AUDIT_SET, &status, sizeof(status), error);
+  }
+
+  ::close(socket_);
+  socket_ = -1;
+  added_rule_ = false;
+  is_daemon_ = false;
+  pending_.clear();
+}
+
+Status AuditEventPublisher::send(int type,
+                                 const void* data,
+                                 size_t size,
+                                 int& error) {
+  std::vector<char> request(NLMSG_SPACE(size), 0);
+  auto header = reinterpret_cast<struct nlmsghdr*>(request.data());
+  header->nlmsg_len = NLMSG_LENGTH(size);
+  header->nlmsg_type = type;
+  header->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  header->nlmsg_seq = ++sequence_;
+  memcpy(NLMSG_DATA(header), data, size);
+
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  if (::sendto(socket_,
+               request.data(),
+               header->nlmsg_len,
+               0,
+               (struct sockaddr*)&address,
+               sizeof(address)) == -1) {
+    return Status(1, "Could not send audit netlink request.");
+  }
+  return receiveAck(header->nlmsg_seq, error);
+}
+
+Status AuditEventPublisher::receiveAck(uint32_t sequence, int& error) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(kAuditAckTimeout);
+  std::vector<char> buffer(kAuditBufferSize);
+  while (true) {
+    ssize_t length = ::recv(socket_, buffer.data(), buffer.size(), 0);
+    if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadline - std::chrono::steady_clock::now()).count();
+      if (remaining <= 0) {
+        return Status(1, "Audit netlink request was not acknowledged.");
+      }
+      struct pollfd descriptor = {socket_, POLLIN, 0};
+      ::poll(&descriptor, 1, (int)remaining);
+      continue;
+    } else if (length == -1 && errno == ENOBUFS) {
+      overflows_++;
+      continue;
+    } else if (length <= 0) {
+      return Status(1, "Audit netlink receive failed.");
+    }
+
+    // Audit records received meanwhile are dropped, no event is pending.
+    if (parseAuditAck(buffer.data(), length, sequence, error)) {
+      return Status(0, "OK");
+    }
+  }
+}
+
+Status AuditEventPublisher::controlRule(int type, int& error) {
+  struct audit_rule_data rule;
+  memset(&rule, 0, sizeof(rule));
+  rule.flags = AUDIT_FILTER_EXIT;
+  rule.action = AUDIT_ALWAYS;
+  for (const auto& syscall : kAuditSyscalls) {
+    rule.mask[syscall / 32] |= 1U << (syscall % 32);
+  }
+
+  // Only audit calls made using the native syscall table.
+  rule.field_count = 1;
+  rule.fields[0] = AUDIT_ARCH;
+  rule.fieldflags[0] = AUDIT_EQUAL;
+  rule.values[0] = kAuditArch;
+  return send(type, &rule, sizeof(rule), error);
+}
+
+Status AuditEventPublisher::run() {
+  fd_set set;
+
+  FD_ZERO(&set);
+  FD_SET(socket_, &set);
+
+  struct timeval timeout = {0, kAuditULatency};
+  int selector = ::select(socket_ + 1, &set, nullptr, nullptr, &timeout);
+  if (selector == -1) {
+    LOG(ERROR) << "Could not read audit netlink socket";
+    return Status(1, "Audit socket failed");
+  }
+
+  if (selector == 0) {
+    // Read timeout.
+    return Status(0, "Continue");
+  }
+
+  auto status = process();
+  ::usleep(kAuditULatency);
+  return status;
+}
+
+Status AuditEventPublisher::process() {
+  std::vector<AuditEventContextRef> contexts;
+  for (size_t reads = 0; reads < kAuditMaxReads; ++reads) {
+    ssize_t length = ::recv(socket_, buffer_.data(), buffer_.size(), 0);
+    if (length == -1 && errno == ENOBUFS) {
+      // The kernel dropped audit records, continue with the next.
+      overflows_++;
+      continue;
+    } else if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+      // The socket is drained.
+      break;
+    } else if (length <= 0) {
+      return Status(1, "Audit netlink receive failed");
+    }
+
+    // The kernel does not always count the header in the message length.
+    auto header = reinterpret_cast<struct nlmsghdr*>(buffer_.data());
+    if ((size_t)length < NLMSG_HDRLEN) {
+      continue;
+    }
+    auto data = static_cast<const char*>(NLMSG_DATA(header));
+    handleRecord(header->nlmsg_type,
+                 data,
+                 length - (data - buffer_.data()),
+                 contexts);
+  }
+
+  for (const auto& ec : contexts) {
+    fire(ec);
+  }
+  return Status(0, "Continue");
+}
+
+void AuditEventPublisher::handleRecord(
+    int type,
+    const char* data,
+    size_t size,
+    std::vector<AuditEventContextRef>& contexts) {
+  if (type != AUDIT_SYSCALL && type != AUDIT_EXECVE && type != AUDIT_CWD &&
+      type != AUDIT_SOCKADDR && type != AUDIT_EOE) {
+    // Acknowledgements and records of unaudited types.
+    return;
+  }
+
+  EventTime time = 0;
+  uint64_t serial = 0;
+  AuditFields fields;
+  if (!parseAuditRecord(data, size, time, serial, fields)) {
+    return;
+  }
+
+  if (type == AUDIT_EOE) {
+    auto pending = pending_.find(serial);
+    if (pending != pending_.end()) {
+      if (pending->second->syscall != 0) {
+        contexts.push_back(pending->second);
+      }
+      pending_.erase(pending);
+    }
+    return;
+  }
+
+  auto& ec = pending_[serial];
+  if (ec == nullptr) {
+    if (pending_.size() > kAuditMaxPending) {
+      // The oldest event will never see its end-of-event record.
+      pending_.erase(pending_.begin());
+      overflows_++;
+    }
+    ec = createEventContext();
+    ec->serial = serial;
+    ec->time = time;
+  }
+
+  if (type == AUDIT_SYSCALL) {
+    ec->syscall = std::strtol(fields["syscall"].c_str(), nullptr, 10);
+    ec->success = (fields["success"] == "yes");
+    ec->fields = std::move(fields);
+  } else if (type == AUDIT_EXECVE) {
+    // Arguments are a0, a1..., long arguments are split into aN[i] parts.
+    std::map<size_t, std::map<size_t, std::string> > arguments;
+    for (const auto& field : fields) {
+      if (field.first.size() < 2 || field.first[0] != 'a' ||
+          !isdigit(field.first[1])) {
+        continue;
+      }
+
+      char* suffix = nullptr;
+      auto index = std::strtoul(field.first.c_str() + 1, &suffix, 10);
+      size_t part = 0;
+      if (*suffix == '[') {
+        part = std::strtoul(suffix + 1, nullptr, 10);
+      } else if (*suffix != '\0') {
+        // The aN_len field.
+        continue;
+      }
+      arguments[index][part] = decodeAuditValue(field.second);
+    }
+
+    for (const auto& argument : arguments) {
+      if (argument.first >= ec->argv.size()) {
+        ec->argv.resize(argument.first + 1);
+      }
+      for (const auto& part : argument.second) {
+        ec->argv[argument.first] += part.second;
+      }
+    }
+  } else if (type == AUDIT_CWD) {
+    ec->cwd = decodeAuditValue(fields["cwd"]);
+  } else if (type == AUDIT_SOCKADDR) {
+    ec->sockaddr = decodeAuditValue(fields["saddr"]);
+  }
+}
+
+bool AuditEventPublisher::shouldFire(const AuditSubscriptionContextRef& sc,
+                                     const AuditEventContextRef& ec) {
+  return (sc->syscalls.empty() || sc->syscalls.count(ec->syscall) > 0);
+}
+}
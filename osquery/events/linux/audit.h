@@ -0,0 +1,182 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <linux/audit.h>
+
+#include <osquery/events.h>
+#include <osquery/status.h>
+
+namespace osquery {
+
+/// The `key=value` fields of an audit record.
+typedef std::map<std::string, std::string> AuditFields;
+
+/**
+ * @brief Parse the text of a single audit record.
+ *
+ * Records begin with "audit(<seconds>.<millis>:<serial>): ", followed by
+ * space-separated `key=value` fields. Values containing spaces are always
+ * hex-encoded by the kernel, so no regular expression is required.
+ *
+ * @param data The record text, not necessarily NULL-terminated.
+ * @param size The length of the record text.
+ * @param time Output, the record time in seconds.
+ * @param serial Output, the serial shared by records of the same event.
+ * @param fields Output, the record fields with raw (undecoded) values.
+ * @return If the record header was parsed.
+ */
+bool parseAuditRecord(const char* data,
+                      size_t size,
+                      EventTime& time,
+                      uint64_t& serial,
+                      AuditFields& fields);
+
+/**
+ * @brief Decode an audit field value.
+ *
+ * Quoted values are unquoted, "(null)" is empty, and any other value is
+ * hex-encoded: each byte of the value as two hex digits.
+ */
+std::string decodeAuditValue(const std::string& value);
+
+/**
+ * @brief Find the acknowledgement of a netlink request in a received buffer.
+ *
+ * @param data The received netlink messages.
+ * @param size The length of the received messages.
+ * @param sequence The sequence number of the request.
+ * @param error Output, the errno reported for the request, 0 on success.
+ * @return If the buffer contained the request's acknowledgement.
+ */
+bool parseAuditAck(const char* data,
+                   size_t size,
+                   uint32_t sequence,
+                   int& error);
+
+/**
+ * @brief Subscription details for AuditEventPublisher events.
+ *
+ * A subscription names the syscalls it wants; if the set is empty then every
+ * audited syscall (execve, connect, and bind) is passed.
+ */
+struct AuditSubscriptionContext : public SubscriptionContext {
+  /// The native syscall numbers, as in `__NR_execve`.
+  std::set<int> syscalls;
+};
+
+/**
+ * @brief Event details for AuditEventPublisher events.
+ *
+ * The records of a single audited syscall are joined by their serial and
+ * fired once the kernel sends the end-of-event record.
+ */
+struct AuditEventContext : public EventContext {
+  /// The audit event serial.
+  uint64_t serial;
+  /// The native syscall number.
+  int syscall;
+  /// Did the syscall succeed.
+  bool success;
+  /// The fields of the SYSCALL record: pid, ppid, uid, auid, exe, a0...
+  AuditFields fields;
+  /// The arguments of an execve, from the EXECVE record.
+  std::vector<std::string> argv;
+  /// The working directory of the process, from the CWD record.
+  std::string cwd;
+  /// The raw socket address argument, from the SOCKADDR record.
+  std::string sockaddr;
+
+  AuditEventContext() : serial(0), syscall(0), success(false) {}
+};
+
+typedef std::shared_ptr<AuditEventContext> AuditEventContextRef;
+typedef std::shared_ptr<AuditSubscriptionContext> AuditSubscriptionContextRef;
+
+/**
+ * @brief A Linux kernel audit (`NETLINK_AUDIT`) EventPublisher.
+ *
+ * The publisher becomes the audit daemon for the kernel, installs a rule for
+ * the execve, connect, and bind syscalls, and removes it on tearDown if it
+ * was not already installed. Only
+ * one process may receive audit events, so the publisher is disabled unless
+ * the `disable_audit` flag is false (and auditd is not running).
+ */
+class AuditEventPublisher
+    : public EventPublisher<AuditSubscriptionContext, AuditEventContext> {
+  DECLARE_PUBLISHER("audit");
+
+ public:
+  /// Take over the audit netlink socket and install the syscall rules.
+  Status setUp();
+  /// Remove the syscall rules and release the audit netlink socket.
+  void tearDown();
+
+  Status run();
+
+  /// The audit socket is multiplexed by the shared event reactor.
+  int getDescriptor() { return socket_; }
+  /// Receive audit records, firing events once they are complete.
+  Status process();
+
+  AuditEventPublisher() : EventPublisher() {
+    socket_ = -1;
+    overflows_ = 0;
+    sequence_ = 0;
+    added_rule_ = false;
+    is_daemon_ = false;
+  }
+
+  /// The number of times the socket or pending events overflowed.
+  size_t numOverflows() const { return overflows_; }
+
+ private:
+  /// Send an audit netlink request, error is the errno the kernel acked.
+  Status send(int type, const void* data, size_t size, int& error);
+  /// Wait for the kernel to acknowledge the request with a sequence.
+  Status receiveAck(uint32_t sequence, int& error);
+  /// Add or delete the rule auditing the publisher's syscalls.
+  Status controlRule(int type, int& error);
+  /// Merge one audit record into its pending event, fire on end-of-event.
+  void handleRecord(int type,
+                    const char* data,
+                    size_t size,
+                    std::vector<AuditEventContextRef>& contexts);
+  /// Given a SubscriptionContext and event context match the syscall.
+  bool shouldFire(const AuditSubscriptionContextRef& sc,
+                  const AuditEventContextRef& ec);
+
+ private:
+  /// The `NETLINK_AUDIT` socket.
+  int socket_;
+  /// Count of receives that failed with ENOBUFS, or dropped pending events.
+  std::atomic<size_t> overflows_;
+  /// The receive buffer, reused for each read.
+  std::vector<char> buffer_;
+  /// Events waiting for their end-of-event record, by serial.
+  std::map<uint64_t, AuditEventContextRef> pending_;
+  /// The sequence number of the last netlink request.
+  uint32_t sequence_;
+  /// True if setUp added the rule, and tearDown should delete it.
+  bool added_rule_;
+  /// True if setUp registered this process as the audit daemon.
+  bool is_daemon_;
+
+ private:
+  friend class AuditTests;
+  FRIEND_TEST(AuditTests, test_audit_handle_records);
+};
+}
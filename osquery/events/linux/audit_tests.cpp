@@ -0,0 +1,131 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <cerrno>
+
+#include <linux/netlink.h>
+#include <sys/syscall.h>
+
+#include <gtest/gtest.h>
+
+#include <osquery/events.h>
+
+#include "osquery/events/linux/audit.h"
+
+namespace osquery {
+
+class AuditTests : public testing::Test {
+ protected:
+  void HandleRecord(AuditEventPublisher& pub,
+                    int type,
+                    const std::string& record,
+                    std::vector<AuditEventContextRef>& contexts) {
+    pub.handleRecord(type, record.c_str(), record.size() + 1, contexts);
+  }
+};
+
+TEST_F(AuditTests, test_parse_audit_record) {
+  std::string record =
+      "audit(1423456789.123:4567): arch=c000003e syscall=59 success=yes "
+      "exit=0 pid=100 exe=\"/bin/ls\" key=(null)";
+
+  EventTime time = 0;
+  uint64_t serial = 0;
+  AuditFields fields;
+  EXPECT_TRUE(
+      parseAuditRecord(record.c_str(), record.size(), time, serial, fields));
+  EXPECT_EQ(time, 1423456789);
+  EXPECT_EQ(serial, 4567);
+  EXPECT_EQ(fields.size(), 7);
+  EXPECT_EQ(fields["syscall"], "59");
+  EXPECT_EQ(fields["exe"], "\"/bin/ls\"");
+
+  // Records without the audit header are not parsed.
+  fields.clear();
+  record = "type=SYSCALL msg=audit(1423456789.123:4567)";
+  EXPECT_FALSE(
+      parseAuditRecord(record.c_str(), record.size(), time, serial, fields));
+}
+
+TEST_F(AuditTests, test_decode_audit_value) {
+  EXPECT_EQ(decodeAuditValue("\"/bin/ls\""), "/bin/ls");
+  EXPECT_EQ(decodeAuditValue("(null)"), "");
+  // Values with spaces are hex-encoded.
+  EXPECT_EQ(decodeAuditValue("6120622063"), "a b c");
+  EXPECT_EQ(decodeAuditValue("yes"), "yes");
+}
+
+TEST_F(AuditTests, test_parse_audit_ack) {
+  std::vector<char> buffer(NLMSG_SPACE(sizeof(struct nlmsgerr)), 0);
+  auto header = reinterpret_cast<struct nlmsghdr*>(buffer.data());
+  header->nlmsg_len = NLMSG_LENGTH(sizeof(struct nlmsgerr));
+  header->nlmsg_type = NLMSG_ERROR;
+  header->nlmsg_seq = 7;
+  auto ack = static_cast<struct nlmsgerr*>(NLMSG_DATA(header));
+  ack->error = -EEXIST;
+
+  int error = 0;
+  EXPECT_TRUE(parseAuditAck(buffer.data(), buffer.size(), 7, error));
+  EXPECT_EQ(error, EEXIST);
+
+  // The acknowledgement of another request is not matched.
+  EXPECT_FALSE(parseAuditAck(buffer.data(), buffer.size(), 8, error));
+
+  // Audit records are not acknowledgements.
+  header->nlmsg_type = AUDIT_SYSCALL;
+  EXPECT_FALSE(parseAuditAck(buffer.data(), buffer.size(), 7, error));
+}
+
+TEST_F(AuditTests, test_audit_handle_records) {
+  AuditEventPublisher pub;
+  std::vector<AuditEventContextRef> contexts;
+
+  HandleRecord(pub,
+               AUDIT_SYSCALL,
+               "audit(1423456789.123:10): arch=c000003e syscall=" +
+                   std::to_string(__NR_execve) +
+                   " success=yes exit=0 ppid=1 pid=100 exe=\"/bin/ls\"",
+               contexts);
+  HandleRecord(pub,
+               AUDIT_EXECVE,
+               "audit(1423456789.123:10): argc=3 a0=\"ls\" a1=\"-la\" "
+               "a2_len=10 a2[0]=2f746d702f a2[1]=6120622063",
+               contexts);
+  HandleRecord(
+      pub, AUDIT_CWD, "audit(1423456789.123:10): cwd=\"/root\"", contexts);
+
+  // Records are joined until the end of the event.
+  EXPECT_TRUE(contexts.empty());
+  HandleRecord(pub, AUDIT_EOE, "audit(1423456789.123:10): ", contexts);
+  ASSERT_EQ(contexts.size(), 1);
+  EXPECT_TRUE(pub.pending_.empty());
+
+  auto& ec = contexts[0];
+  EXPECT_EQ(ec->serial, 10);
+  EXPECT_EQ(ec->syscall, __NR_execve);
+  EXPECT_TRUE(ec->success);
+  EXPECT_EQ(ec->fields["pid"], "100");
+  EXPECT_EQ(ec->cwd, "/root");
+  ASSERT_EQ(ec->argv.size(), 3);
+  EXPECT_EQ(ec->argv[1], "-la");
+  EXPECT_EQ(ec->argv[2], "/tmp/a b c");
+
+  // Only subscribed syscalls are fired.
+  auto sc = std::make_shared<AuditSubscriptionContext>();
+  EXPECT_TRUE(pub.shouldFire(sc, ec));
+  sc->syscalls.insert(__NR_connect);
+  EXPECT_FALSE(pub.shouldFire(sc, ec));
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
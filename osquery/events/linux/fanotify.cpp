@@ -0,0 +1,202 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <unistd.h>
+
+#include <osquery/events.h>
+#include <osquery/logger.h>
+
+#include "osquery/events/linux/fanotify.h"
+
+namespace osquery {
+
+int kFanotifyULatency = 200;
+/// Read many event metadata structures at a time.
+static const size_t kFanotifyBufferSize =
+    4096 * sizeof(struct fanotify_event_metadata);
+/// The number of full buffers drained each time the handle is readable.
+static const size_t kFanotifyMaxReads = 8;
+/// Actions delivered when a Subscription does not supply a mask.
+static const uint64_t kFanotifyDefaultMask =
+    FAN_OPEN | FAN_MODIFY | FAN_CLOSE_WRITE;
+
+std::map<uint64_t, std::string> kFanotifyActions = {
+    {FAN_CLOSE_WRITE, "UPDATED"},
+    {FAN_MODIFY, "MODIFIED"},
+    {FAN_CLOSE_NOWRITE, "CLOSED"},
+    {FAN_ACCESS, "ACCESSED"},
+    {FAN_OPEN, "OPENED"},
+};
+
+REGISTER(FanotifyEventPublisher, "event_publisher", "fanotify");
+
+Status FanotifyEventPublisher::setUp() {
+  // Events are notifications only, access is never blocked.
+  fanotify_handle_ = ::fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+                                         FAN_NONBLOCK,
+                                     O_RDONLY | O_LARGEFILE);
+  if (fanotify_handle_ == -1) {
+    return Status(1, "Could not init fanotify (requires CAP_SYS_ADMIN).");
+  }
+
+  buffer_.resize(kFanotifyBufferSize);
+  return Status(0, "OK");
+}
+
+void FanotifyEventPublisher::configure() {
+  if (!isHandleOpen()) {
+    return;
+  }
+
+  // Combine the masks of subscriptions to the same path.
+  std::map<std::string, uint64_t> marks;
+  for (const auto& sub : getSubscriptions()) {
+    auto sc = getSubscriptionContext(sub->context);
+    marks[sc->path] |= (sc->mask == 0) ? kFanotifyDefaultMask : sc->mask;
+  }
+
+  if (marks == marks_) {
+    return;
+  }
+
+  // Mount marks are replaced, removing those no longer subscribed.
+  ::fanotify_mark(fanotify_handle_, FAN_MARK_FLUSH | FAN_MARK_MOUNT, 0, 0,
+                  nullptr);
+  marks_.clear();
+  for (const auto& mark : marks) {
+    if (::fanotify_mark(fanotify_handle_, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                        mark.second, AT_FDCWD, mark.first.c_str()) == -1) {
+      LOG(ERROR) << "Could not add fanotify mark on: " << mark.first;
+      continue;
+    }
+    marks_.insert(mark);
+  }
+}
+
+void FanotifyEventPublisher::tearDown() {
+  if (fanotify_handle_ != -1) {
+    ::close(fanotify_handle_);
+  }
+  fanotify_handle_ = -1;
+  marks_.clear();
+}
+
+Status FanotifyEventPublisher::run() {
+  fd_set set;
+
+  FD_ZERO(&set);
+  FD_SET(fanotify_handle_, &set);
+
+  struct timeval timeout = {0, kFanotifyULatency};
+  int selector =
+      ::select(fanotify_handle_ + 1, &set, nullptr, nullptr, &timeout);
+  if (selector == -1) {
+    LOG(ERROR) << "Could not read fanotify handle";
+    return Status(1, "fanotify handle failed");
+  }
+
+  if (selector == 0) {
+    // Read timeout.
+    return Status(0, "Continue");
+  }
+
+  auto status = process();
+  ::usleep(kFanotifyULatency);
+  return status;
+}
+
+Status FanotifyEventPublisher::process() {
+  std::vector<FanotifyEventContextRef> contexts;
+  auto self = ::getpid();
+  char path[PATH_MAX];
+
+  for (size_t reads = 0; reads < kFanotifyMaxReads; ++reads) {
+    ssize_t length = ::read(fanotify_handle_, buffer_.data(), buffer_.size());
+    if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+      // The handle is drained.
+      break;
+    } else if (length <= 0) {
+      return Status(1, "fanotify read failed");
+    }
+
+    auto event =
+        reinterpret_cast<const struct fanotify_event_metadata*>(buffer_.data());
+    for (; FAN_EVENT_OK(event, length); event = FAN_EVENT_NEXT(event, length)) {
+      if (event->vers != FANOTIFY_METADATA_VERSION) {
+        return Status(1, "fanotify metadata version mismatch");
+      }
+
+      if (event->mask & FAN_Q_OVERFLOW) {
+        overflows_++;
+        LOG(WARNING) << "The fanotify event queue overflowed (" << overflows_
+                     << " times)";
+        continue;
+      }
+
+      if (event->fd < 0) {
+        continue;
+      }
+
+      // Resolve the path from the descriptor of the accessed file.
+      auto link = "/proc/self/fd/" + std::to_string(event->fd);
+      auto size = ::readlink(link.c_str(), path, sizeof(path) - 1);
+      ::close(event->fd);
+      if (size <= 0 || event->pid == self) {
+        // Accesses made by this process are not reported.
+        continue;
+      }
+      contexts.push_back(
+          createEventContextFrom(event, std::string(path, size)));
+    }
+
+    if ((size_t)length + sizeof(struct fanotify_event_metadata) <=
+        buffer_.size()) {
+      // A partial read means the queue was emptied.
+      break;
+    }
+  }
+
+  for (const auto& ec : contexts) {
+    fire(ec);
+  }
+  return Status(0, "Continue");
+}
+
+FanotifyEventContextRef FanotifyEventPublisher::createEventContextFrom(
+    const struct fanotify_event_metadata* event, const std::string& path) {
+  auto ec = createEventContext();
+  ec->mask = event->mask;
+  ec->pid = event->pid;
+  ec->path = path;
+
+  // Set the action (may be multiple).
+  for (const auto& action : kFanotifyActions) {
+    if (event->mask & action.first) {
+      ec->action = action.second;
+      break;
+    }
+  }
+  return ec;
+}
+
+bool FanotifyEventPublisher::shouldFire(
+    const FanotifySubscriptionContextRef& sc,
+    const FanotifyEventContextRef& ec) {
+  if (ec->path.compare(0, sc->path.size(), sc->path) != 0) {
+    // The mount is marked but the path is not within the subscription.
+    return false;
+  }
+
+  auto mask = (sc->mask == 0) ? kFanotifyDefaultMask : sc->mask;
+  return (ec->mask & mask) != 0;
+}
+}
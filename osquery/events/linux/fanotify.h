@@ -0,0 +1,135 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <sys/fanotify.h>
+
+#include <osquery/events.h>
+#include <osquery/status.h>
+
+namespace osquery {
+
+extern std::map<uint64_t, std::string> kFanotifyActions;
+
+/**
+ * @brief Subscription details for FanotifyEventPublisher events.
+ *
+ * A `fanotify` mark covers the entire mount (filesystem) containing the
+ * subscribed path, a single descriptor sees every file within. Events are
+ * passed to the EventSubscriber if the event path is within the subscribed
+ * path and the event action is part of the mask. If the mask is 0 then the
+ * open, modify, and close-write actions are passed.
+ */
+struct FanotifySubscriptionContext : public SubscriptionContext {
+  /// Subscribe to files within this filesystem path, the mount is marked.
+  std::string path;
+  /// Limit the `fanotify` actions to the subscribed mask (if not 0).
+  uint64_t mask;
+
+  FanotifySubscriptionContext() : mask(0) {}
+
+  /**
+   * @brief Helper method to map a string action to `fanotify` mask bits.
+   *
+   * @param action The string action, a value in kFanotifyActions.
+   */
+  void requireAction(const std::string& action) {
+    for (const auto& bit : kFanotifyActions) {
+      if (action == bit.second) {
+        mask = mask | bit.first;
+      }
+    }
+  }
+};
+
+/**
+ * @brief Event details for FanotifyEventPublisher events.
+ */
+struct FanotifyEventContext : public EventContext {
+  /// The `fanotify` event mask bits.
+  uint64_t mask;
+  /// The process that accessed the file.
+  pid_t pid;
+  /// The file path, resolved from the event's descriptor.
+  std::string path;
+  /// A string action representing the event action `fanotify` bit.
+  std::string action;
+
+  FanotifyEventContext() : mask(0), pid(0) {}
+};
+
+typedef std::shared_ptr<FanotifyEventContext> FanotifyEventContextRef;
+typedef std::shared_ptr<FanotifySubscriptionContext>
+    FanotifySubscriptionContextRef;
+
+/**
+ * @brief A Linux `fanotify` EventPublisher.
+ *
+ * Unlike `inotify`, which requires a watch per directory, `fanotify` marks
+ * whole mounts and reports the process responsible for each access. This
+ * requires CAP_SYS_ADMIN; setUp fails without it and the publisher is not
+ * started.
+ */
+class FanotifyEventPublisher
+    : public EventPublisher<FanotifySubscriptionContext, FanotifyEventContext> {
+  DECLARE_PUBLISHER("fanotify");
+
+ public:
+  /// Create the `fanotify` handle descriptor.
+  Status setUp();
+  /// Mark the mount of each subscribed path.
+  void configure();
+  /// Release the `fanotify` handle descriptor.
+  void tearDown();
+
+  Status run();
+
+  /// The `fanotify` handle is multiplexed by the shared event reactor.
+  int getDescriptor() { return fanotify_handle_; }
+  /// Read and fire the available `fanotify` events.
+  Status process();
+
+  FanotifyEventPublisher() : EventPublisher() {
+    fanotify_handle_ = -1;
+    overflows_ = 0;
+  }
+
+  /// Check if the `fanotify` handle is alive.
+  bool isHandleOpen() { return fanotify_handle_ > 0; }
+
+  /// The number of times the kernel `fanotify` event queue overflowed.
+  size_t numOverflows() const { return overflows_; }
+
+ private:
+  /// Build an EventContext from `fanotify` metadata and its resolved path.
+  FanotifyEventContextRef createEventContextFrom(
+      const struct fanotify_event_metadata* event, const std::string& path);
+  /// Given a SubscriptionContext and FanotifyEventContext match path and mask.
+  bool shouldFire(const FanotifySubscriptionContextRef& sc,
+                  const FanotifyEventContextRef& ec);
+
+ private:
+  int fanotify_handle_;
+  /// The mask marked on each path, remarked when Subscription%s change.
+  std::map<std::string, uint64_t> marks_;
+  /// Count of FAN_Q_OVERFLOW events read.
+  std::atomic<size_t> overflows_;
+  /// The read buffer, sized for many event metadata structures.
+  std::vector<char> buffer_;
+
+ public:
+  FRIEND_TEST(FanotifyTests, test_fanotify_should_fire);
+};
+}
@@ -0,0 +1,99 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <stdio.h>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/thread.hpp>
+
+#include <gtest/gtest.h>
+
+#include <osquery/events.h>
+
+#include "osquery/events/linux/fanotify.h"
+
+namespace osquery {
+
+const std::string kRealTestPath = "/tmp/osquery-fanotify-trigger";
+
+int kMaxEventLatency = 3000;
+
+class FanotifyTests : public testing::Test {
+ protected:
+  void TearDown() { boost::filesystem::remove_all(kRealTestPath); }
+};
+
+TEST_F(FanotifyTests, test_fanotify_require_action) {
+  auto sc = std::make_shared<FanotifySubscriptionContext>();
+  sc->requireAction("UPDATED");
+  sc->requireAction("OPENED");
+  EXPECT_EQ(sc->mask, FAN_CLOSE_WRITE | FAN_OPEN);
+}
+
+TEST_F(FanotifyTests, test_fanotify_should_fire) {
+  auto pub = std::make_shared<FanotifyEventPublisher>();
+  auto sc = std::make_shared<FanotifySubscriptionContext>();
+  sc->path = "/tmp";
+
+  auto ec = pub->createEventContext();
+  ec->path = kRealTestPath;
+  ec->mask = FAN_CLOSE_WRITE;
+
+  // Without a mask the default open, modify, and close-write are passed.
+  EXPECT_TRUE(pub->shouldFire(sc, ec));
+  ec->mask = FAN_ACCESS;
+  EXPECT_FALSE(pub->shouldFire(sc, ec));
+
+  // The subscription mask limits actions.
+  sc->mask = FAN_ACCESS;
+  EXPECT_TRUE(pub->shouldFire(sc, ec));
+
+  // Other paths on the marked mount are not passed.
+  ec->path = "/var/tmp/file";
+  EXPECT_FALSE(pub->shouldFire(sc, ec));
+}
+
+TEST_F(FanotifyTests, test_fanotify_run) {
+  auto pub = std::make_shared<FanotifyEventPublisher>();
+  if (!EventFactory::registerEventPublisher(pub).ok()) {
+    // The test is not running with CAP_SYS_ADMIN.
+    return;
+  }
+  EXPECT_TRUE(pub->isHandleOpen());
+
+  auto sc = std::make_shared<FanotifySubscriptionContext>();
+  sc->path = "/tmp";
+  sc->requireAction("UPDATED");
+  EventFactory::addSubscription("fanotify", sc);
+
+  // Writes made by osquery are not reported, write from a child process.
+  auto thread = boost::thread(EventFactory::run, "fanotify");
+  while (!pub->hasStarted()) {
+    ::usleep(20);
+  }
+  auto command = "echo fanotify > " + kRealTestPath;
+  EXPECT_EQ(::system(command.c_str()), 0);
+
+  for (int delay = 0; delay < kMaxEventLatency; delay += 10) {
+    if (pub->numEvents() > 0) {
+      break;
+    }
+    ::usleep(10 * 1000);
+  }
+  EXPECT_GT(pub->numEvents(), 0);
+  EventFactory::end(true);
+  thread.join();
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,21 +8,34 @@
  *
  */
 
+#include <algorithm>
+#include <set>
 #include <sstream>
 
 #include <linux/limits.h>
 
 #include <osquery/events.h>
 #include <osquery/filesystem.h>
+#include <osquery/flags.h>
 #include <osquery/logger.h>
 
 #include "osquery/events/linux/inotify.h"
 
 namespace osquery {
 
+DEFINE_osquery_flag(int32,
+                    inotify_buffer_kb,
+                    64,
+                    "Kilobytes of inotify events read at a time.");
+
 int kINotifyULatency = 200;
-static const uint32_t BUFFER_SIZE =
-    (10 * ((sizeof(struct inotify_event)) + NAME_MAX + 1));
+/// The smallest read buffer must hold a single event with a full name.
+static const size_t kINotifyMinBuffer =
+    sizeof(struct inotify_event) + NAME_MAX + 1;
+/// The number of full buffers drained each time the handle is readable.
+static const size_t kINotifyMaxReads = 8;
+
+const std::string kINotifyRescanAction = "RESCAN";
 
 std::map<int, std::string> kMaskActions = {
     {IN_ACCESS, "ACCESSED"},
@@ -38,33 +51,126 @@ std::map<int, std::string> kMaskActions = {
 
 REGISTER(INotifyEventPublisher, "event_publisher", "inotify");
 
+/// The per-user limit of inotify watches, used if it cannot be read.
+static const size_t kDefaultMaxUserWatches = 8192;
+
 Status INotifyEventPublisher::setUp() {
-  inotify_handle_ = ::inotify_init();
+  // Reads drain the handle until no events remain.
+  inotify_handle_ = ::inotify_init1(IN_NONBLOCK);
   // If this does not work throw an exception.
   if (inotify_handle_ == -1) {
     return Status(1, "Could not init inotify.");
   }
+
+  // Recursive monitors stop adding watches at the per-user limit.
+  std::string content;
+  max_watches_ = kDefaultMaxUserWatches;
+  if (readFile("/proc/sys/fs/inotify/max_user_watches", content).ok()) {
+    auto limit = std::strtoul(content.c_str(), nullptr, 10);
+    max_watches_ = (limit > 0) ? limit : kDefaultMaxUserWatches;
+  }
+
+  size_t buffer_size = (FLAGS_inotify_buffer_kb > 0)
+                           ? (size_t)FLAGS_inotify_buffer_kb * 1024
+                           : kINotifyMinBuffer;
+  buffer_.resize(std::max(buffer_size, kINotifyMinBuffer));
   return Status(0, "OK");
 }
 
 void INotifyEventPublisher::configure() {
-  for (const auto& sub : subscriptions_) {
-    // Anytime a configure is called, try to monitor all subscriptions.
-    // Configure is called as a response to removing/adding subscriptions.
-    // This means recalculating all monitored paths.
+  boost::lock_guard<boost::mutex> lock(monitor_lock_);
+  // Configure is called as a response to removing/adding subscriptions.
+  // Only the difference from the previously configured paths is applied.
+  std::map<std::string, bool> paths;
+  for (const auto& sub : getSubscriptions()) {
     auto sc = getSubscriptionContext(sub->context);
-    addMonitor(sc->path, sc->recursive);
+    paths[sc->path] = paths[sc->path] || sc->recursive;
+  }
+
+  // Remove watches only used by removed (or no longer recursive) paths.
+  for (const auto& configured : configured_paths_) {
+    auto path = paths.find(configured.first);
+    if (path == paths.end() || (configured.second && !path->second)) {
+      removeUnusedMonitors(configured.first, configured.second, paths);
+    }
+  }
+
+  for (const auto& path : paths) {
+    auto configured = configured_paths_.find(path.first);
+    if (configured == configured_paths_.end() ||
+        (path.second && !configured->second)) {
+      addMonitor(path.first, path.second);
+    } else if (!path.second) {
+      // A removed directory watch may have covered this path.
+      addMonitor(path.first, false);
+    }
+  }
+
+  configured_paths_ = paths;
+  recursive_paths_.clear();
+  for (const auto& path : paths) {
+    if (path.second) {
+      recursive_paths_.add(path.first);
+      recursive_paths_.add(path.first + "/" + kWildcardCharacterRecursive);
+    }
+  }
+  routes_dirty_ = true;
+  VLOG(1) << "Using " << descriptors_.size() << " of " << max_watches_
+          << " inotify watches";
+}
+
+void INotifyEventPublisher::removeUnusedMonitors(
+    const std::string& path,
+    bool recursive,
+    const std::map<std::string, bool>& paths) {
+  // A watch is used if it is a path, or is within a recursive path.
+  auto used = [&paths](const std::string& watched) {
+    for (const auto& path : paths) {
+      if (watched == path.first) {
+        return true;
+      }
+      auto directory = path.first + "/";
+      if (path.second &&
+          watched.compare(0, directory.size(), directory) == 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  std::vector<std::string> removed;
+  auto watch = path_descriptors_.find(path);
+  if (watch != path_descriptors_.end() && !used(watch->first)) {
+    removed.push_back(watch->first);
+  }
+
+  if (recursive) {
+    // Every watch beneath a recursive path sorts after its directory prefix,
+    // siblings sharing the path's prefix such as "/tmp/ab" are not beneath.
+    auto directory = path + "/";
+    for (watch = path_descriptors_.lower_bound(directory);
+         watch != path_descriptors_.end() &&
+             watch->first.compare(0, directory.size(), directory) == 0;
+         ++watch) {
+      if (!used(watch->first)) {
+        removed.push_back(watch->first);
+      }
+    }
+  }
+
+  for (const auto& watched : removed) {
+    removeMonitor(watched, true);
   }
 }
 
 void INotifyEventPublisher::tearDown() {
   ::close(inotify_handle_);
   inotify_handle_ = -1;
+  configured_paths_.clear();
 }
 
 Status INotifyEventPublisher::run() {
   // Get a while wrapper for free.
-  char buffer[BUFFER_SIZE];
   fd_set set;
 
   FD_ZERO(&set);
@@ -81,40 +187,92 @@ Status INotifyEventPublisher::run() {
     // Read timeout.
     return Status(0, "Continue");
   }
-  ssize_t record_num = ::read(getHandle(), buffer, BUFFER_SIZE);
-  if (record_num == 0 || record_num == -1) {
-    return Status(1, "INotify read failed");
-  }
 
-  for (char* p = buffer; p < buffer + record_num;) {
-    // Cast the inotify struct, make shared pointer, and append to contexts.
-    auto event = reinterpret_cast<struct inotify_event*>(p);
-    if (event->mask & IN_Q_OVERFLOW) {
-      // The inotify queue was overflown (remove all paths).
-      return Status(1, "Overflow");
+  auto status = process();
+  ::usleep(kINotifyULatency);
+  return status;
+}
+
+Status INotifyEventPublisher::process() {
+  // Watches are updated while locked, events are fired afterward.
+  std::vector<INotifyEventContextRef> contexts;
+  for (size_t reads = 0; reads < kINotifyMaxReads; ++reads) {
+    ssize_t record_num = ::read(getHandle(), buffer_.data(), buffer_.size());
+    if (record_num == -1 && (errno == EAGAIN || errno == EINTR)) {
+      // The handle is drained.
+      break;
+    } else if (record_num == 0 || record_num == -1) {
+      return Status(1, "INotify read failed");
+    }
+
+    char* buffer = buffer_.data();
+    boost::lock_guard<boost::mutex> lock(monitor_lock_);
+    for (char* p = buffer; p < buffer + record_num;) {
+      // Cast the inotify struct, make shared pointer, and append to contexts.
+      auto event = reinterpret_cast<struct inotify_event*>(p);
+      if (event->mask & IN_Q_OVERFLOW) {
+        // The inotify queue was overflown, events were lost.
+        resync(contexts);
+      } else if (event->mask & IN_IGNORED) {
+        // This inotify watch was removed.
+        removeMonitor(event->wd, false);
+      } else if (event->mask & IN_MOVE_SELF) {
+        // This inotify path was moved, but is still watched.
+        removeMonitor(event->wd, true);
+      } else if (event->mask & IN_DELETE_SELF) {
+        // A file was moved to replace the watched path.
+        removeMonitor(event->wd, false);
+      } else {
+        auto ec = createEventContextFrom(event);
+        bool created = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+        if (created && (event->mask & IN_ISDIR) && isPathRecursive(ec->path)) {
+          // Watch directories created within a recursive subscription.
+          addMonitor(ec->path, true);
+        }
+        contexts.push_back(ec);
+      }
+      // Continue to iterate
+      p += (sizeof(struct inotify_event)) + event->len;
     }
 
-    if (event->mask & IN_IGNORED) {
-      // This inotify watch was removed.
-      removeMonitor(event->wd, false);
-    } else if (event->mask & IN_MOVE_SELF) {
-      // This inotify path was moved, but is still watched.
-      removeMonitor(event->wd, true);
-    } else if (event->mask & IN_DELETE_SELF) {
-      // A file was moved to replace the watched path.
-      removeMonitor(event->wd, false);
-    } else {
-      auto ec = createEventContextFrom(event);
-      fire(ec);
+    if ((size_t)record_num + kINotifyMinBuffer <= buffer_.size()) {
+      // A partial read means the queue was emptied.
+      break;
     }
-    // Continue to iterate
-    p += (sizeof(struct inotify_event)) + event->len;
   }
 
-  ::usleep(kINotifyULatency);
+  for (const auto& ec : contexts) {
+    fire(ec);
+  }
   return Status(0, "Continue");
 }
 
+void INotifyEventPublisher::resync(
+    std::vector<INotifyEventContextRef>& contexts) {
+  overflows_++;
+  LOG(WARNING) << "The inotify event queue overflowed (" << overflows_
+               << " times), rescanning subscribed paths";
+
+  std::set<std::string> paths;
+  for (const auto& sub : getSubscriptions()) {
+    auto sc = getSubscriptionContext(sub->context);
+    // Directories created while events were lost are not yet watched.
+    addMonitor(sc->path, sc->recursive);
+    paths.insert(sc->path);
+  }
+  routes_dirty_ = true;
+
+  for (const auto& path : paths) {
+    auto ec = createEventContext();
+    ec->event = std::make_shared<struct inotify_event>();
+    ec->event->wd = -1;
+    ec->event->mask = IN_Q_OVERFLOW;
+    ec->path = path;
+    ec->action = kINotifyRescanAction;
+    contexts.push_back(ec);
+  }
+}
+
 INotifyEventContextRef INotifyEventPublisher::createEventContextFrom(
     struct inotify_event* event) {
   auto shared_event = std::make_shared<struct inotify_event>(*event);
@@ -139,6 +297,74 @@ INotifyEventContextRef INotifyEventPublisher::createEventContextFrom(
   return ec;
 }
 
+std::string INotifyEventPublisher::getCoalesceKey(
+    const EventContextRef& ec) const {
+  auto inotify_ec = getEventContext(ec);
+  if (inotify_ec->event == nullptr ||
+      !(inotify_ec->event->mask & (IN_MODIFY | IN_ATTRIB))) {
+    // Only repeated writes and attribute changes are merged.
+    return "";
+  }
+  return inotify_ec->path + ":" + inotify_ec->action;
+}
+
+bool INotifyEventPublisher::routeEvent(const EventContextRef& ec,
+                                       SubscriptionVector& subscriptions) {
+  auto inotify_ec = getEventContext(ec);
+  if (inotify_ec->event == nullptr ||
+      (inotify_ec->event->mask & IN_Q_OVERFLOW)) {
+    // Rescan events are not read from a watch.
+    return false;
+  }
+
+  boost::lock_guard<boost::mutex> lock(monitor_lock_);
+  if (routes_dirty_) {
+    buildRoutes();
+  }
+
+  auto route = watch_subscriptions_.find(inotify_ec->event->wd);
+  if (route != watch_subscriptions_.end()) {
+    subscriptions = route->second;
+  }
+  return true;
+}
+
+void INotifyEventPublisher::buildRoutes() {
+  watch_subscriptions_.clear();
+  auto route = [this](int watch, const SubscriptionRef& sub) {
+    auto& subscriptions = watch_subscriptions_[watch];
+    if (subscriptions.empty() || subscriptions.back() != sub) {
+      subscriptions.push_back(sub);
+    }
+  };
+
+  for (const auto& sub : getSubscriptions()) {
+    auto sc = getSubscriptionContext(sub->context);
+    // A path is watched directly or as a file within a watched directory.
+    auto watch = path_descriptors_.find(sc->path);
+    if (watch != path_descriptors_.end()) {
+      route(watch->second, sub);
+    }
+
+    auto parent = boost::filesystem::path(sc->path).parent_path().string();
+    watch = path_descriptors_.find(parent);
+    if (watch != path_descriptors_.end()) {
+      route(watch->second, sub);
+    }
+
+    if (sc->recursive) {
+      // Every watch beneath a recursive path sorts directly after it.
+      for (watch = path_descriptors_.upper_bound(sc->path);
+           watch != path_descriptors_.end() &&
+               watch->first.compare(0, sc->path.size(), sc->path) == 0;
+           ++watch) {
+        route(watch->second, sub);
+      }
+    }
+  }
+  routes_dirty_ = false;
+}
+
 bool INotifyEventPublisher::shouldFire(const INotifySubscriptionContextRef& sc,
                                        const INotifyEventContextRef& ec) {
   if (!sc->recursive && sc->path != ec->path) {
@@ -151,6 +377,11 @@ bool INotifyEventPublisher::shouldFire(const INotifySubscriptionContextRef& sc,
     return false;
   }
 
+  if (ec->event->mask & IN_Q_OVERFLOW) {
+    // Every subscription of a rescanned path is told events were lost.
+    return true;
+  }
+
   // The subscription may supply a required event mask.
   if (sc->mask != 0 && !(ec->event->mask & sc->mask)) {
     return false;
@@ -161,6 +392,12 @@ bool INotifyEventPublisher::shouldFire(const INotifySubscriptionContextRef& sc,
 bool INotifyEventPublisher::addMonitor(const std::string& path,
                                        bool recursive) {
   if (!isPathMonitored(path)) {
+    if (descriptors_.size() >= max_watches_) {
+      LOG(WARNING) << "Cannot watch " << path << ", all " << max_watches_
+                   << " inotify watches are used";
+      return false;
+    }
+
     int watch = ::inotify_add_watch(getHandle(), path.c_str(), IN_ALL_EVENTS);
     if (watch == -1) {
       LOG(ERROR) << "Could not add inotfy watch on: " << path;
@@ -173,19 +410,25 @@ bool INotifyEventPublisher::addMonitor(const std::string& path,
     path_descriptors_[path] = watch;
     // Keep a map of the opposite (descriptor -> path)
     descriptor_paths_[watch] = path;
+    routes_dirty_ = true;
   }
 
   if (recursive && isDirectory(path).ok()) {
     std::vector<std::string> children;
-    // Get a list of children of this directory (requesed recursive watches).
-    if (!listFilesInDirectory(path, children).ok()) {
+    // Get a list of child directories (requesed recursive watches).
+    if (!listDirectoriesInDirectory(path, children).ok()) {
       return false;
     }
 
     for (const auto& child : children) {
-      // Only watch child directories, a watch on the directory implies files.
-      if (isDirectory(child).ok()) {
-        addMonitor(child, recursive);
+      // A watch on the directory implies files, do not follow links.
+      if (boost::filesystem::is_symlink(child)) {
+        continue;
+      }
+      if (!addMonitor(child, recursive) &&
+          descriptors_.size() >= max_watches_) {
+        // Stop walking the tree once every watch is used.
+        return false;
       }
     }
   }
@@ -193,6 +436,16 @@ bool INotifyEventPublisher::addMonitor(const std::string& path,
   return true;
 }
 
+bool INotifyEventPublisher::isPathRecursive(const std::string& path) {
+  // Created directories are checked without comparing every subscription.
+  return recursive_paths_.matches(path);
+}
+
+size_t INotifyEventPublisher::numWatches() {
+  boost::lock_guard<boost::mutex> lock(monitor_lock_);
+  return descriptors_.size();
+}
+
 bool INotifyEventPublisher::removeMonitor(const std::string& path, bool force) {
   // If force then remove from INotify, otherwise cleanup file descriptors.
   if (path_descriptors_.find(path) == path_descriptors_.end()) {
@@ -202,6 +455,7 @@ bool INotifyEventPublisher::removeMonitor(const std::string& path, bool force) {
   int watch = path_descriptors_[path];
   path_descriptors_.erase(path);
   descriptor_paths_.erase(watch);
+  routes_dirty_ = true;
 
   auto position = std::find(descriptors_.begin(), descriptors_.end(), watch);
   descriptors_.erase(position);
@@ -10,6 +10,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <map>
 #include <vector>
 
@@ -17,6 +18,7 @@
 #include <sys/stat.h>
 
 #include <osquery/events.h>
+#include <osquery/filesystem.h>
 #include <osquery/status.h>
 
 namespace osquery {
@@ -73,6 +75,9 @@ struct INotifyEventContext : public EventContext {
   std::string action;
 };
 
+/// The action of a synthetic event fired after the `inotify` queue overflows.
+extern const std::string kINotifyRescanAction;
+
 typedef std::shared_ptr<INotifyEventContext> INotifyEventContextRef;
 typedef std::shared_ptr<INotifySubscriptionContext>
     INotifySubscriptionContextRef;
@@ -107,22 +112,71 @@ class INotifyEventPublisher
 
   Status run();
 
-  INotifyEventPublisher() : EventPublisher() { inotify_handle_ = -1; }
+  /// The `inotify` handle is multiplexed by the shared event reactor.
+  int getDescriptor() { return inotify_handle_; }
+  /// Read and fire the available `inotify` events.
+  Status process();
+
+  INotifyEventPublisher() : EventPublisher() {
+    inotify_handle_ = -1;
+    max_watches_ = 0;
+    routes_dirty_ = true;
+    overflows_ = 0;
+  }
   /// Check if the application-global `inotify` handle is alive.
   bool isHandleOpen() { return inotify_handle_ > 0; }
 
+  /// The number of `inotify` watches used, at most max_user_watches.
+  size_t numWatches();
+
+  /// The number of times the kernel `inotify` event queue overflowed.
+  size_t numOverflows() const { return overflows_; }
+
  private:
   INotifyEventContextRef createEventContextFrom(struct inotify_event* event);
   /// Check all added Subscription%s for a path.
   bool isPathMonitored(const std::string& path);
-  /// Add an INotify watch (monitor) on this path.
+  /**
+   * @brief Add an INotify watch (monitor) on this path.
+   *
+   * A recursive monitor adds a watch on every directory beneath the path,
+   * until the per-user max_user_watches limit is reached.
+   */
   bool addMonitor(const std::string& path, bool recursive);
+  /**
+   * @brief Recover after the kernel dropped events from a full queue.
+   *
+   * Each Subscription's watches are added again, picking up directories
+   * created while events were lost, and a RESCAN event is appended for each
+   * subscribed path so subscribers may re-read the state they track.
+   */
+  void resync(std::vector<INotifyEventContextRef>& contexts);
+  /// Check if a path is within a recursive Subscription.
+  bool isPathRecursive(const std::string& path);
+  /**
+   * @brief Remove the watches of a path no longer subscribed.
+   *
+   * Watches still used by another subscribed path are kept.
+   *
+   * @param path The previously configured path.
+   * @param recursive Remove watches beneath the path.
+   * @param paths The subscribed paths, and if each is recursive.
+   */
+  void removeUnusedMonitors(const std::string& path,
+                            bool recursive,
+                            const std::map<std::string, bool>& paths);
   /// Remove an INotify watch (monitor) from our tracking.
   bool removeMonitor(const std::string& path, bool force = false);
   bool removeMonitor(int watch, bool force = false);
   /// Given a SubscriptionContext and INotifyEventContext match path and action.
   bool shouldFire(const INotifySubscriptionContextRef& mc,
                   const INotifyEventContextRef& ec);
+  /// Coalesce bursts of content and attribute changes to the same path.
+  std::string getCoalesceKey(const EventContextRef& ec) const;
+  /// Route an event to the Subscription%s of the watch it was read from.
+  bool routeEvent(const EventContextRef& ec, SubscriptionVector& subscriptions);
+  /// Map each watch to the Subscription%s its events may match.
+  void buildRoutes();
   /// Get the INotify file descriptor.
   int getHandle() { return inotify_handle_; }
   /// Get the number of actual INotify active descriptors.
@@ -133,8 +187,29 @@ class INotifyEventPublisher
   PathDescriptorMap path_descriptors_;
   DescriptorPathMap descriptor_paths_;
   int inotify_handle_;
+  /// The most watches added, read from max_user_watches.
+  size_t max_watches_;
+  /// Protects the watches added by configure and the event reader.
+  boost::mutex monitor_lock_;
+  /// The candidate Subscription%s of each watch descriptor.
+  std::map<int, SubscriptionVector> watch_subscriptions_;
+  /// The subscribed paths, and if each is recursive, of the last configure.
+  std::map<std::string, bool> configured_paths_;
+  /// The recursive subscribed paths, and every path below them.
+  FilePatternMatcher recursive_paths_;
+  /// Set when watches or Subscription%s change, routes are rebuilt lazily.
+  bool routes_dirty_;
+  /// The read buffer, sized by the inotify_buffer_kb flag.
+  std::vector<char> buffer_;
+  /// Count of IN_Q_OVERFLOW events read.
+  std::atomic<size_t> overflows_;
 
  public:
   FRIEND_TEST(INotifyTests, test_inotify_optimization);
+  FRIEND_TEST(INotifyTests, test_inotify_coalesce_key);
+  FRIEND_TEST(INotifyTests, test_inotify_routing);
+  FRIEND_TEST(INotifyTests, test_inotify_overflow_resync);
+  FRIEND_TEST(INotifyTests, test_inotify_configure_diff);
+  FRIEND_TEST(INotifyTests, test_inotify_configure_sibling);
 };
 }
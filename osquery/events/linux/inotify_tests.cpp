@@ -265,6 +265,22 @@ TEST_F(INotifyTests, test_inotify_event_action) {
   StopEventLoop();
 }
 
+TEST_F(INotifyTests, test_inotify_coalesce_key) {
+  auto pub = std::make_shared<INotifyEventPublisher>();
+  auto ec = pub->createEventContext();
+  ec->event = std::make_shared<struct inotify_event>();
+  ec->path = kRealTestPath;
+  ec->action = "UPDATED";
+
+  // Repeated writes to the same path share a key.
+  ec->event->mask = IN_MODIFY;
+  EXPECT_EQ(pub->getCoalesceKey(ec), kRealTestPath + ":UPDATED");
+
+  // Closing a written file is always delivered.
+  ec->event->mask = IN_CLOSE_WRITE;
+  EXPECT_TRUE(pub->getCoalesceKey(ec).empty());
+}
+
 TEST_F(INotifyTests, test_inotify_optimization) {
   // Assume event type is registered.
   StartEventLoop();
@@ -303,6 +319,157 @@ TEST_F(INotifyTests, test_inotify_recursion) {
   EXPECT_TRUE(sub->count() > 0);
   StopEventLoop();
 }
+
+TEST_F(INotifyTests, test_inotify_routing) {
+  StartEventLoop();
+  boost::filesystem::create_directory(kRealTestDir);
+  boost::filesystem::create_directory(kRealTestSubDir);
+
+  // A subscription to the file, its directory, and another recursive tree.
+  SubscriptionAction(kRealTestPath);
+  SubscriptionAction(kRealTestDir);
+  auto mc = std::make_shared<INotifySubscriptionContext>();
+  mc->path = kRealTestDir;
+  mc->recursive = true;
+  EventFactory::addSubscription("inotify", mc);
+
+  auto ec = event_pub_->createEventContext();
+  ec->event = std::make_shared<struct inotify_event>();
+
+  // Events of the file's watch only reach the file's subscription.
+  SubscriptionVector routed;
+  ec->event->wd = event_pub_->path_descriptors_[kRealTestPath];
+  EXPECT_TRUE(event_pub_->routeEvent(ec, routed));
+  EXPECT_EQ(routed.size(), 1);
+
+  // The directory's watch reaches both directory subscriptions.
+  routed.clear();
+  ec->event->wd = event_pub_->path_descriptors_[kRealTestDir];
+  EXPECT_TRUE(event_pub_->routeEvent(ec, routed));
+  EXPECT_EQ(routed.size(), 2);
+
+  // A subdirectory's watch only reaches the recursive subscription.
+  routed.clear();
+  ec->event->wd = event_pub_->path_descriptors_[kRealTestSubDir];
+  EXPECT_TRUE(event_pub_->routeEvent(ec, routed));
+  ASSERT_EQ(routed.size(), 1);
+  EXPECT_TRUE(event_pub_->getSubscriptionContext(routed[0]->context)
+                  ->recursive);
+  StopEventLoop();
+}
+
+TEST_F(INotifyTests, test_inotify_recursion_new_directory) {
+  StartEventLoop();
+
+  auto sub = std::make_shared<TestINotifyEventSubscriber>();
+  sub->init();
+
+  // The subdirectory tree is watched when the subscription is configured.
+  boost::filesystem::create_directories(kRealTestSubDir + "/nested");
+  auto mc = sub->createSubscriptionContext();
+  mc->path = kRealTestDir;
+  mc->recursive = true;
+  sub->subscribe(&TestINotifyEventSubscriber::Callback, mc);
+  EXPECT_EQ(event_pub_->numWatches(), 3);
+
+  // A directory created later is watched once its creation is read.
+  auto created = kRealTestDir + "/3";
+  boost::filesystem::create_directory(created);
+  for (int delay = 0; delay < kMaxEventLatency; delay += 10) {
+    if (event_pub_->numWatches() == 4) {
+      break;
+    }
+    ::usleep(10 * 1000);
+  }
+  EXPECT_EQ(event_pub_->numWatches(), 4);
+
+  // Events within the new directory are delivered.
+  auto count = sub->count();
+  TriggerEvent(created + "/1");
+  sub->WaitForEvents(kMaxEventLatency, count + 1);
+  EXPECT_GT(sub->count(), count);
+  StopEventLoop();
+}
+
+TEST_F(INotifyTests, test_inotify_overflow_resync) {
+  StartEventLoop();
+  boost::filesystem::create_directory(kRealTestDir);
+
+  auto mc = std::make_shared<INotifySubscriptionContext>();
+  mc->path = kRealTestDir;
+  mc->recursive = true;
+  EventFactory::addSubscription("inotify", mc);
+  SubscriptionAction(kRealTestPath, IN_CLOSE_WRITE);
+  auto watches = event_pub_->numWatches();
+
+  // A directory created while events were lost is watched on resync.
+  boost::filesystem::create_directory(kRealTestSubDir);
+  std::vector<INotifyEventContextRef> contexts;
+  {
+    boost::lock_guard<boost::mutex> lock(event_pub_->monitor_lock_);
+    event_pub_->resync(contexts);
+  }
+  EXPECT_EQ(event_pub_->numOverflows(), 1);
+  EXPECT_EQ(event_pub_->numWatches(), watches + 1);
+
+  // Each subscribed path is rescanned, regardless of the subscription mask.
+  ASSERT_EQ(contexts.size(), 2);
+  for (const auto& ec : contexts) {
+    EXPECT_EQ(ec->action, kINotifyRescanAction);
+    SubscriptionVector routed;
+    EXPECT_FALSE(event_pub_->routeEvent(ec, routed));
+  }
+  auto sc = std::make_shared<INotifySubscriptionContext>();
+  sc->path = kRealTestPath;
+  sc->mask = IN_CLOSE_WRITE;
+  EXPECT_TRUE(event_pub_->shouldFire(sc, contexts[0]));
+  StopEventLoop();
+}
+
+TEST_F(INotifyTests, test_inotify_configure_diff) {
+  StartEventLoop();
+  boost::filesystem::create_directories(kRealTestSubDir);
+
+  // A recursive subscription watches the directory and its subdirectory.
+  auto mc = std::make_shared<INotifySubscriptionContext>();
+  mc->path = kRealTestDir;
+  mc->recursive = true;
+  EventFactory::addSubscription("inotify", mc);
+  SubscriptionAction(kRealTestPath);
+  EXPECT_EQ(event_pub_->numWatches(), 3);
+
+  // Removing the recursive subscription only removes its watches.
+  EXPECT_TRUE(EventFactory::removeSubscription("inotify", mc).ok());
+  EXPECT_EQ(event_pub_->numWatches(), 1);
+  EXPECT_EQ(event_pub_->path_descriptors_.count(kRealTestPath), 1);
+  EXPECT_EQ(event_pub_->numSubscriptions(), 1);
+
+  // The context is no longer subscribed.
+  EXPECT_FALSE(EventFactory::removeSubscription("inotify", mc).ok());
+  StopEventLoop();
+}
+
+TEST_F(INotifyTests, test_inotify_configure_sibling) {
+  StartEventLoop();
+  boost::filesystem::create_directories(kRealTestSubDir);
+  auto sibling = kRealTestSubDir + "1";
+  TriggerEvent(sibling);
+
+  // A path sharing a recursive path's prefix is not beneath it.
+  auto mc = std::make_shared<INotifySubscriptionContext>();
+  mc->path = kRealTestSubDir;
+  mc->recursive = true;
+  EventFactory::addSubscription("inotify", mc);
+  auto sibling_mc = std::make_shared<INotifySubscriptionContext>();
+  sibling_mc->path = sibling;
+  EventFactory::addSubscription("inotify", sibling_mc);
+  EXPECT_EQ(event_pub_->numWatches(), 2);
+
+  EXPECT_TRUE(EventFactory::removeSubscription("inotify", sibling_mc).ok());
+  EXPECT_EQ(event_pub_->numWatches(), 1);
+  EXPECT_EQ(event_pub_->path_descriptors_.count(sibling), 0);
+  StopEventLoop();
+}
 }
 
 int main(int argc, char* argv[]) {
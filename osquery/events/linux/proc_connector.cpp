@@ -0,0 +1,237 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <linux/connector.h>
+#include <linux/limits.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <osquery/events.h>
+#include <osquery/filesystem.h>
+#include <osquery/logger.h>
+
+#include "osquery/events/linux/proc_connector.h"
+
+namespace osquery {
+
+int kProcConnectorULatency = 200;
+/// Many process events are received at once during fork storms.
+static const size_t kProcConnectorBufferSize = 64 * 1024;
+/// The number of receives drained each time the socket is readable.
+static const size_t kProcConnectorMaxReads = 64;
+
+std::map<uint32_t, std::string> kProcConnectorActions = {
+    {proc_event::PROC_EVENT_FORK, "FORK"},
+    {proc_event::PROC_EVENT_EXEC, "EXEC"},
+    {proc_event::PROC_EVENT_EXIT, "EXIT"},
+};
+
+REGISTER(ProcConnectorEventPublisher, "event_publisher", "proc_connector");
+
+Status ProcConnectorEventPublisher::setUp() {
+  socket_ = ::socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     NETLINK_CONNECTOR);
+  if (socket_ == -1) {
+    return Status(1, "Could not create process connector socket.");
+  }
+
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  address.nl_groups = CN_IDX_PROC;
+  address.nl_pid = ::getpid();
+  if (::bind(socket_, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    tearDown();
+    return Status(1, "Could not bind process connector socket.");
+  }
+
+  auto status = control(PROC_CN_MCAST_LISTEN);
+  if (!status.ok()) {
+    tearDown();
+    return status;
+  }
+
+  buffer_.resize(kProcConnectorBufferSize);
+  return Status(0, "OK");
+}
+
+void ProcConnectorEventPublisher::tearDown() {
+  if (socket_ != -1) {
+    control(PROC_CN_MCAST_IGNORE);
+    ::close(socket_);
+  }
+  socket_ = -1;
+}
+
+Status ProcConnectorEventPublisher::control(enum proc_cn_mcast_op op) {
+  // A netlink header containing a connector message with the operation.
+  char request[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(op))];
+  memset(request, 0, sizeof(request));
+
+  auto header = reinterpret_cast<struct nlmsghdr*>(request);
+  header->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+  header->nlmsg_pid = ::getpid();
+  header->nlmsg_type = NLMSG_DONE;
+
+  auto message = reinterpret_cast<struct cn_msg*>(NLMSG_DATA(header));
+  message->id.idx = CN_IDX_PROC;
+  message->id.val = CN_VAL_PROC;
+  message->len = sizeof(op);
+  memcpy(message->data, &op, sizeof(op));
+
+  if (::send(socket_, request, header->nlmsg_len, 0) == -1) {
+    return Status(1, "Could not control process connector.");
+  }
+  return Status(0, "OK");
+}
+
+Status ProcConnectorEventPublisher::run() {
+  fd_set set;
+
+  FD_ZERO(&set);
+  FD_SET(socket_, &set);
+
+  struct timeval timeout = {0, kProcConnectorULatency};
+  int selector = ::select(socket_ + 1, &set, nullptr, nullptr, &timeout);
+  if (selector == -1) {
+    LOG(ERROR) << "Could not read process connector socket";
+    return Status(1, "Process connector socket failed");
+  }
+
+  if (selector == 0) {
+    // Read timeout.
+    return Status(0, "Continue");
+  }
+
+  auto status = process();
+  ::usleep(kProcConnectorULatency);
+  return status;
+}
+
+Status ProcConnectorEventPublisher::process() {
+  std::vector<ProcConnectorEventContextRef> contexts;
+  for (size_t reads = 0; reads < kProcConnectorMaxReads; ++reads) {
+    ssize_t length = ::recv(socket_, buffer_.data(), buffer_.size(), 0);
+    if (length == -1 && errno == ENOBUFS) {
+      // The kernel dropped process events, continue with the next.
+      overflows_++;
+      LOG(WARNING) << "The process connector socket overflowed ("
+                   << overflows_ << " times)";
+      continue;
+    } else if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+      // The socket is drained.
+      break;
+    } else if (length <= 0) {
+      return Status(1, "Process connector receive failed");
+    }
+
+    auto header = reinterpret_cast<struct nlmsghdr*>(buffer_.data());
+    for (size_t size = length; NLMSG_OK(header, size);
+         header = NLMSG_NEXT(header, size)) {
+      if (header->nlmsg_type == NLMSG_NOOP ||
+          header->nlmsg_type == NLMSG_ERROR) {
+        continue;
+      }
+
+      auto message = reinterpret_cast<struct cn_msg*>(NLMSG_DATA(header));
+      if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC) {
+        continue;
+      }
+
+      auto event = reinterpret_cast<const struct proc_event*>(message->data);
+      auto ec = createEventContextFrom(event);
+      if (ec != nullptr) {
+        contexts.push_back(ec);
+      }
+    }
+  }
+
+  for (const auto& ec : contexts) {
+    fire(ec);
+  }
+  return Status(0, "Continue");
+}
+
+/// Read an exec'd process's path, arguments, and parent from /proc.
+static void readProcess(ProcConnectorEventContextRef& ec) {
+  auto process = "/proc/" + std::to_string(ec->pid);
+
+  char path[PATH_MAX];
+  auto size = ::readlink((process + "/exe").c_str(), path, sizeof(path) - 1);
+  if (size > 0) {
+    ec->path = std::string(path, size);
+  }
+
+  std::string content;
+  if (readFile(process + "/cmdline", content).ok()) {
+    // Arguments are NULL-separated.
+    std::replace(content.begin(), content.end(), '\0', ' ');
+    auto end = content.find_last_not_of(' ');
+    ec->cmdline = (end == std::string::npos) ? "" : content.substr(0, end + 1);
+  }
+
+  // The parent follows the state, after the (possibly spaced) name.
+  if (readFile(process + "/stat", content).ok()) {
+    auto name_end = content.rfind(')');
+    if (name_end != std::string::npos && name_end + 4 < content.size()) {
+      auto parent = content.find(' ', name_end + 2);
+      if (parent != std::string::npos) {
+        ec->parent = std::strtol(content.c_str() + parent + 1, nullptr, 10);
+      }
+    }
+  }
+}
+
+ProcConnectorEventContextRef
+ProcConnectorEventPublisher::createEventContextFrom(
+    const struct proc_event* event) {
+  auto ec = createEventContext();
+  ec->what = event->what;
+  switch (event->what) {
+  case proc_event::PROC_EVENT_FORK:
+    if (event->event_data.fork.child_pid !=
+        event->event_data.fork.child_tgid) {
+      // A thread was created.
+      return nullptr;
+    }
+    ec->pid = event->event_data.fork.child_tgid;
+    ec->parent = event->event_data.fork.parent_tgid;
+    break;
+  case proc_event::PROC_EVENT_EXEC:
+    ec->pid = event->event_data.exec.process_tgid;
+    readProcess(ec);
+    break;
+  case proc_event::PROC_EVENT_EXIT:
+    if (event->event_data.exit.process_pid !=
+        event->event_data.exit.process_tgid) {
+      // A thread exited.
+      return nullptr;
+    }
+    ec->pid = event->event_data.exit.process_tgid;
+    ec->exit_code = event->event_data.exit.exit_code;
+    break;
+  default:
+    return nullptr;
+  }
+
+  ec->action = kProcConnectorActions[ec->what];
+  return ec;
+}
+
+bool ProcConnectorEventPublisher::shouldFire(
+    const ProcConnectorSubscriptionContextRef& sc,
+    const ProcConnectorEventContextRef& ec) {
+  return (sc->mask == 0 || (sc->mask & ec->what) != 0);
+}
+}
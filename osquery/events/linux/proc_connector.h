@@ -0,0 +1,137 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <linux/cn_proc.h>
+
+#include <osquery/events.h>
+#include <osquery/status.h>
+
+namespace osquery {
+
+extern std::map<uint32_t, std::string> kProcConnectorActions;
+
+/**
+ * @brief Subscription details for ProcConnectorEventPublisher events.
+ *
+ * Processes are reported as they fork, exec, and exit. The mask is a set of
+ * `PROC_EVENT_*` bits; if the mask is 0 then every process event is passed.
+ * Threads created and exiting within a process are never reported.
+ */
+struct ProcConnectorSubscriptionContext : public SubscriptionContext {
+  /// Limit the process events to the subscribed mask (if not 0).
+  uint32_t mask;
+
+  ProcConnectorSubscriptionContext() : mask(0) {}
+
+  /**
+   * @brief Helper method to map a string action to a process event bit.
+   *
+   * @param action The string action, a value in kProcConnectorActions.
+   */
+  void requireAction(const std::string& action) {
+    for (const auto& bit : kProcConnectorActions) {
+      if (action == bit.second) {
+        mask = mask | bit.first;
+      }
+    }
+  }
+};
+
+/**
+ * @brief Event details for ProcConnectorEventPublisher events.
+ *
+ * The executable path and command line of an exec are read from /proc when
+ * the event is received, while the process is most likely still running.
+ */
+struct ProcConnectorEventContext : public EventContext {
+  /// The `PROC_EVENT_*` event bit.
+  uint32_t what;
+  /// A string action representing the event bit.
+  std::string action;
+  /// The process ID (thread group) that forked, exec'd, or exited.
+  pid_t pid;
+  /// The parent process ID, for fork and exec events.
+  pid_t parent;
+  /// The executable path of an exec'd process.
+  std::string path;
+  /// The space-separated arguments of an exec'd process.
+  std::string cmdline;
+  /// The exit code of an exited process.
+  int exit_code;
+
+  ProcConnectorEventContext() : what(0), pid(0), parent(0), exit_code(0) {}
+};
+
+typedef std::shared_ptr<ProcConnectorEventContext> ProcConnectorEventContextRef;
+typedef std::shared_ptr<ProcConnectorSubscriptionContext>
+    ProcConnectorSubscriptionContextRef;
+
+/**
+ * @brief A Linux netlink process connector EventPublisher.
+ *
+ * The kernel multicasts a message on the `NETLINK_CONNECTOR` socket for each
+ * process fork, exec, and exit. Polling /proc misses processes that live for
+ * less than the poll interval, this publisher sees every one. Joining the
+ * multicast group requires CAP_NET_ADMIN.
+ */
+class ProcConnectorEventPublisher
+    : public EventPublisher<ProcConnectorSubscriptionContext,
+                            ProcConnectorEventContext> {
+  DECLARE_PUBLISHER("proc_connector");
+
+ public:
+  /// Create the netlink socket and join the process events group.
+  Status setUp();
+  /// Leave the process events group and close the socket.
+  void tearDown();
+
+  Status run();
+
+  /// The netlink socket is multiplexed by the shared event reactor.
+  int getDescriptor() { return socket_; }
+  /// Receive and fire the available process events.
+  Status process();
+
+  ProcConnectorEventPublisher() : EventPublisher() {
+    socket_ = -1;
+    overflows_ = 0;
+  }
+
+  /// The number of times the socket buffer overflowed and events were lost.
+  size_t numOverflows() const { return overflows_; }
+
+ private:
+  /// Send a multicast listen or ignore operation to the process connector.
+  Status control(enum proc_cn_mcast_op op);
+  /// Create an EventContext from a kernel process event, NULL if filtered.
+  ProcConnectorEventContextRef createEventContextFrom(
+      const struct proc_event* event);
+  /// Given a SubscriptionContext and event context match the event bit.
+  bool shouldFire(const ProcConnectorSubscriptionContextRef& sc,
+                  const ProcConnectorEventContextRef& ec);
+
+ private:
+  /// The `NETLINK_CONNECTOR` socket.
+  int socket_;
+  /// Count of receives that failed with ENOBUFS.
+  std::atomic<size_t> overflows_;
+  /// The receive buffer, reused for each read.
+  std::vector<char> buffer_;
+
+ public:
+  FRIEND_TEST(ProcConnectorTests, test_proc_connector_event_context);
+};
+}
@@ -0,0 +1,104 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <boost/thread.hpp>
+
+#include <gtest/gtest.h>
+
+#include <osquery/events.h>
+
+#include "osquery/events/linux/proc_connector.h"
+
+namespace osquery {
+
+int kMaxEventLatency = 3000;
+
+class ProcConnectorTests : public testing::Test {};
+
+TEST_F(ProcConnectorTests, test_proc_connector_require_action) {
+  auto sc = std::make_shared<ProcConnectorSubscriptionContext>();
+  sc->requireAction("EXEC");
+  sc->requireAction("EXIT");
+  EXPECT_EQ(sc->mask,
+            proc_event::PROC_EVENT_EXEC | proc_event::PROC_EVENT_EXIT);
+}
+
+TEST_F(ProcConnectorTests, test_proc_connector_event_context) {
+  auto pub = std::make_shared<ProcConnectorEventPublisher>();
+
+  struct proc_event event;
+  memset(&event, 0, sizeof(event));
+
+  // Threads created within a process are not reported.
+  event.what = proc_event::PROC_EVENT_FORK;
+  event.event_data.fork.parent_tgid = 1;
+  event.event_data.fork.child_pid = 101;
+  event.event_data.fork.child_tgid = 100;
+  EXPECT_EQ(pub->createEventContextFrom(&event), nullptr);
+
+  event.event_data.fork.child_pid = 100;
+  auto ec = pub->createEventContextFrom(&event);
+  ASSERT_NE(ec, nullptr);
+  EXPECT_EQ(ec->action, "FORK");
+  EXPECT_EQ(ec->pid, 100);
+  EXPECT_EQ(ec->parent, 1);
+
+  // An exec reads the process details, use this process.
+  memset(&event, 0, sizeof(event));
+  event.what = proc_event::PROC_EVENT_EXEC;
+  event.event_data.exec.process_pid = ::getpid();
+  event.event_data.exec.process_tgid = ::getpid();
+  ec = pub->createEventContextFrom(&event);
+  ASSERT_NE(ec, nullptr);
+  EXPECT_EQ(ec->action, "EXEC");
+  EXPECT_FALSE(ec->path.empty());
+  EXPECT_FALSE(ec->cmdline.empty());
+  EXPECT_EQ(ec->parent, ::getppid());
+
+  // Only subscribed events are fired.
+  auto sc = std::make_shared<ProcConnectorSubscriptionContext>();
+  EXPECT_TRUE(pub->shouldFire(sc, ec));
+  sc->requireAction("EXIT");
+  EXPECT_FALSE(pub->shouldFire(sc, ec));
+}
+
+TEST_F(ProcConnectorTests, test_proc_connector_run) {
+  auto pub = std::make_shared<ProcConnectorEventPublisher>();
+  if (!EventFactory::registerEventPublisher(pub).ok()) {
+    // The test is not running with CAP_NET_ADMIN.
+    return;
+  }
+
+  auto sc = std::make_shared<ProcConnectorSubscriptionContext>();
+  sc->requireAction("EXEC");
+  EventFactory::addSubscription("proc_connector", sc);
+  auto thread = boost::thread(EventFactory::run, "proc_connector");
+  while (!pub->hasStarted()) {
+    ::usleep(20);
+  }
+
+  // Running a shell forks and execs.
+  EXPECT_EQ(::system("true"), 0);
+  for (int delay = 0; delay < kMaxEventLatency; delay += 10) {
+    if (pub->numEvents() > 0) {
+      break;
+    }
+    ::usleep(10 * 1000);
+  }
+  EXPECT_GT(pub->numEvents(), 0);
+  EventFactory::end(true);
+  thread.join();
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
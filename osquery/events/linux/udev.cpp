@@ -17,6 +17,34 @@
 namespace osquery {
 
 int kUdevULatency = 200;
+/// The most device events received each time the monitor is readable.
+static const size_t kUdevMaxReceives = 256;
+/// The most parent devices with cached attributes.
+static const size_t kUdevMaxCachedDevices = 512;
+
+/// Parent device syspath to system attribute values.
+static std::map<std::string, std::map<std::string, std::string> >
+    kUdevParentCache;
+static boost::mutex kUdevParentCacheLock;
+
+/// The process-wide device enumeration context and rows by subsystem.
+struct UdevDeviceCache {
+  /// A udev context kept for every enumeration.
+  struct udev* handle;
+  /// Set while a publisher's monitor receives device events.
+  bool monitoring;
+  /// Set while the monitor's filter drops the events of some subsystems.
+  bool filtered;
+  /// The subsystems whose every event passes the monitor's filter.
+  std::set<std::string> subsystems;
+  /// Generated rows of each enumerated subsystem.
+  std::map<std::string, QueryData> devices;
+
+  UdevDeviceCache() : handle(nullptr), monitoring(false), filtered(false) {}
+};
+
+static UdevDeviceCache kUdevDeviceCache;
+static boost::mutex kUdevDeviceCacheLock;
 
 REGISTER(UdevEventPublisher, "event_publisher", "udev");
 
@@ -29,17 +57,82 @@ Status UdevEventPublisher::setUp() {
 
   // Set up the udev monitor before scanning/polling.
   monitor_ = udev_monitor_new_from_netlink(handle_, "udev");
-  udev_monitor_enable_receiving(monitor_);
+  if (monitor_ == nullptr || udev_monitor_enable_receiving(monitor_) != 0) {
+    return Status(1, "Could not create udev monitor.");
+  }
 
+  // Devices cached from now on are invalidated by received events.
+  boost::lock_guard<boost::mutex> lock(kUdevDeviceCacheLock);
+  kUdevDeviceCache.devices.clear();
+  kUdevDeviceCache.monitoring = true;
   return Status(0, "OK");
 }
 
-void UdevEventPublisher::configure() {}
+void UdevEventPublisher::configure() {
+  // Subscriptions to a subsystem are matched by a socket filter in the
+  // kernel, a subscription to every subsystem receives every event.
+  std::map<std::string, std::set<std::string> > filters;
+  for (const auto& sub : getSubscriptions()) {
+    auto sc = getSubscriptionContext(sub->context);
+    if (sc->subsystem.empty()) {
+      filters.clear();
+      break;
+    }
+    filters[sc->subsystem].insert(sc->devtype);
+  }
+
+  boost::lock_guard<boost::mutex> lock(monitor_lock_);
+  if (monitor_ == nullptr || filters == filters_) {
+    return;
+  }
+
+  // The previous filter is detached, adding matches extends it otherwise.
+  udev_monitor_filter_remove(monitor_);
+  for (const auto& filter : filters) {
+    if (filter.second.count("") > 0) {
+      udev_monitor_filter_add_match_subsystem_devtype(
+          monitor_, filter.first.c_str(), nullptr);
+      continue;
+    }
+    for (const auto& devtype : filter.second) {
+      udev_monitor_filter_add_match_subsystem_devtype(
+          monitor_, filter.first.c_str(), devtype.c_str());
+    }
+  }
+  if (!filters.empty() && udev_monitor_filter_update(monitor_) != 0) {
+    LOG(WARNING) << "Could not filter udev monitor, receiving every event";
+    udev_monitor_filter_remove(monitor_);
+    filters.clear();
+  }
+  filters_ = filters;
+
+  // Devices of filtered subsystems are not invalidated, stop caching them.
+  boost::lock_guard<boost::mutex> cache_lock(kUdevDeviceCacheLock);
+  kUdevDeviceCache.devices.clear();
+  kUdevDeviceCache.filtered = !filters.empty();
+  kUdevDeviceCache.subsystems.clear();
+  for (const auto& filter : filters) {
+    if (filter.second.count("") > 0) {
+      kUdevDeviceCache.subsystems.insert(filter.first);
+    }
+  }
+}
 
 void UdevEventPublisher::tearDown() {
+  {
+    boost::lock_guard<boost::mutex> lock(kUdevDeviceCacheLock);
+    kUdevDeviceCache.devices.clear();
+    kUdevDeviceCache.filtered = false;
+    kUdevDeviceCache.subsystems.clear();
+    kUdevDeviceCache.monitoring = false;
+  }
+
+  boost::lock_guard<boost::mutex> lock(monitor_lock_);
   if (monitor_ != nullptr) {
     udev_monitor_unref(monitor_);
+    monitor_ = nullptr;
   }
+  filters_.clear();
 
   if (handle_ != nullptr) {
     udev_unref(handle_);
@@ -65,18 +158,49 @@ Status UdevEventPublisher::run() {
     return Status(0, "Timeout");
   }
 
-  struct udev_device *device = udev_monitor_receive_device(monitor_);
-  if (device == nullptr) {
-    LOG(ERROR) << "udev monitor returned invalid device.";
-    return Status(1, "udev monitor failed.");
+  auto status = process();
+  ::usleep(kUdevULatency);
+  return status;
+}
+
+int UdevEventPublisher::getDescriptor() {
+  if (monitor_ == nullptr) {
+    return -1;
   }
+  return udev_monitor_get_fd(monitor_);
+}
 
-  auto ec = createEventContextFrom(device);
-  fire(ec);
+Status UdevEventPublisher::process() {
+  // The monitor socket is non-blocking, drain a hotplug burst at once.
+  size_t received = 0;
+  for (; received < kUdevMaxReceives; ++received) {
+    struct udev_device* device = nullptr;
+    {
+      boost::lock_guard<boost::mutex> lock(monitor_lock_);
+      device = udev_monitor_receive_device(monitor_);
+    }
+    if (device == nullptr) {
+      break;
+    }
 
-  udev_device_unref(device);
+    auto ec = createEventContextFrom(device);
+    invalidateDevices(ec->subsystem);
+    if (ec->action == UDEV_EVENT_ACTION_REMOVE) {
+      auto syspath = udev_device_get_syspath(device);
+      if (syspath != nullptr) {
+        removeCachedDevice(syspath);
+      }
+    }
+    fire(ec);
+    udev_device_unref(device);
+  }
 
-  ::usleep(kUdevULatency);
+  if (received == 0) {
+    // Events may have been dropped, cached devices cannot be trusted.
+    invalidateDevices("");
+    LOG(ERROR) << "udev monitor returned invalid device.";
+    return Status(1, "udev monitor failed.");
+  }
   return Status(0, "Continue");
 }
 
@@ -98,6 +222,97 @@ std::string UdevEventPublisher::getAttr(struct udev_device* device,
   return "";
 }
 
+std::string UdevEventPublisher::getParentAttr(struct udev_device* device,
+                                              const std::string& attr) {
+  // The parent is owned by the device, it is not unreferenced.
+  auto parent = udev_device_get_parent(device);
+  if (parent == nullptr) {
+    return "";
+  }
+
+  auto syspath = udev_device_get_syspath(parent);
+  if (syspath == nullptr) {
+    return getAttr(parent, attr);
+  }
+
+  boost::lock_guard<boost::mutex> lock(kUdevParentCacheLock);
+  auto& attrs = kUdevParentCache[syspath];
+  auto cached = attrs.find(attr);
+  if (cached != attrs.end()) {
+    return cached->second;
+  }
+
+  if (kUdevParentCache.size() > kUdevMaxCachedDevices) {
+    // Parents of long-gone devices are not always removed, start over.
+    kUdevParentCache.clear();
+  }
+  auto value = getAttr(parent, attr);
+  kUdevParentCache[syspath][attr] = value;
+  return value;
+}
+
+void UdevEventPublisher::removeCachedDevice(const std::string& syspath) {
+  boost::lock_guard<boost::mutex> lock(kUdevParentCacheLock);
+  kUdevParentCache.erase(syspath);
+}
+
+QueryData UdevEventPublisher::genDevices(
+    const std::string& subsystem, const UdevDeviceGenerator& generator) {
+  // The udev context is not thread safe, enumerations are serialized.
+  boost::lock_guard<boost::mutex> lock(kUdevDeviceCacheLock);
+  auto& cache = kUdevDeviceCache;
+  auto cacheable = cache.monitoring && (!cache.filtered ||
+                                        cache.subsystems.count(subsystem) > 0);
+  if (cacheable) {
+    auto cached = cache.devices.find(subsystem);
+    if (cached != cache.devices.end()) {
+      return cached->second;
+    }
+  }
+
+  QueryData results;
+  if (cache.handle == nullptr) {
+    cache.handle = udev_new();
+    if (cache.handle == nullptr) {
+      VLOG(1) << "Could not get udev handle.";
+      return results;
+    }
+  }
+
+  auto enumerate = udev_enumerate_new(cache.handle);
+  if (enumerate == nullptr) {
+    return results;
+  }
+  udev_enumerate_add_match_subsystem(enumerate, subsystem.c_str());
+  udev_enumerate_scan_devices(enumerate);
+
+  struct udev_list_entry *device_entries, *entry;
+  device_entries = udev_enumerate_get_list_entry(enumerate);
+  udev_list_entry_foreach(entry, device_entries) {
+    auto path = udev_list_entry_get_name(entry);
+    auto device = udev_device_new_from_syspath(cache.handle, path);
+    if (device != nullptr) {
+      generator(device, results);
+      udev_device_unref(device);
+    }
+  }
+  udev_enumerate_unref(enumerate);
+
+  if (cacheable) {
+    cache.devices[subsystem] = results;
+  }
+  return results;
+}
+
+void UdevEventPublisher::invalidateDevices(const std::string& subsystem) {
+  boost::lock_guard<boost::mutex> lock(kUdevDeviceCacheLock);
+  if (subsystem.empty()) {
+    kUdevDeviceCache.devices.clear();
+  } else {
+    kUdevDeviceCache.devices.erase(subsystem);
+  }
+}
+
 UdevEventContextRef UdevEventPublisher::createEventContextFrom(
     struct udev_device* device) {
   auto ec = createEventContext();
@@ -10,6 +10,10 @@
 
 #pragma once
 
+#include <functional>
+#include <map>
+#include <set>
+
 #include <libudev.h>
 
 #include <osquery/events.h>
@@ -65,6 +69,10 @@ struct UdevEventContext : public EventContext {
 typedef std::shared_ptr<UdevEventContext> UdevEventContextRef;
 typedef std::shared_ptr<UdevSubscriptionContext> UdevSubscriptionContextRef;
 
+/// Append the rows of an enumerated device to the results.
+typedef std::function<void(struct udev_device*, QueryData&)>
+    UdevDeviceGenerator;
+
 /**
  * @brief A Linux `udev` EventPublisher.
  *
@@ -80,6 +88,11 @@ class UdevEventPublisher
 
   Status run();
 
+  /// The udev monitor socket is multiplexed by the shared event reactor.
+  int getDescriptor();
+  /// Receive and fire every pending device event.
+  Status process();
+
   UdevEventPublisher() : EventPublisher() {
     handle_ = nullptr;
     monitor_ = nullptr;
@@ -105,11 +118,57 @@ class UdevEventPublisher
   static std::string getAttr(struct udev_device* device,
                              const std::string& attr);
 
+  /**
+   * @brief Return a system attribute of the device's parent, cached.
+   *
+   * Hotplugging a hub or dock adds many sibling devices sharing a parent.
+   * Parent attributes are cached by the parent's syspath so each sibling does
+   * not read sysfs again. The entry is dropped when the parent is removed.
+   *
+   * @param device the udev device pointer.
+   * @param attr the udev system attribute identifier string.
+   * @return string representation of the attribute or empty if null.
+   */
+  static std::string getParentAttr(struct udev_device* device,
+                                   const std::string& attr);
+
+  /// Forget cached attributes of a removed device.
+  static void removeCachedDevice(const std::string& syspath);
+
+  /**
+   * @brief Generate rows for every device of a subsystem, cached.
+   *
+   * Devices are enumerated with a process-wide udev context. While the
+   * publisher's monitor is receiving, the rows of a subsystem are kept until
+   * a device event of that subsystem is received. Without a monitor every
+   * call enumerates the subsystem again.
+   *
+   * @param subsystem the udev subsystem to enumerate, such as "block".
+   * @param generator called with each device of the subsystem.
+   * @return the rows of every device of the subsystem.
+   */
+  static QueryData genDevices(const std::string& subsystem,
+                              const UdevDeviceGenerator& generator);
+
+  /// Drop the cached rows of a subsystem, or every subsystem if empty.
+  static void invalidateDevices(const std::string& subsystem);
+
  private:
   /// udev handle (socket descriptor contained within).
   struct udev *handle_;
   struct udev_monitor *monitor_;
 
+  /**
+   * @brief The devtypes of each subsystem the monitor's socket filter passes.
+   *
+   * Empty if every event is received, an empty devtype passes every devtype
+   * of its subsystem.
+   */
+  std::map<std::string, std::set<std::string> > filters_;
+
+  /// Protect the monitor, its filters change while events are received.
+  boost::mutex monitor_lock_;
+
  private:
   /// Check subscription details.
   bool shouldFire(const UdevSubscriptionContextRef& mc,
@@ -8,172 +8,228 @@
  *
  */
 
-#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
 
-#import <Foundation/Foundation.h>
+#include <CoreFoundation/CoreFoundation.h>
 
 #include <boost/filesystem/path.hpp>
-#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 #include <osquery/filesystem.h>
 #include <osquery/logger.h>
 
+#include "osquery/core/conversions.h"
+
 namespace pt = boost::property_tree;
 
 namespace osquery {
 
-NSMutableArray* filterArray(id dataStructure);
-NSMutableDictionary* filterDictionary(id dataStructure);
-
-NSMutableDictionary* filterDictionary(id dataStructure) {
-  @autoreleasepool {
-    NSMutableDictionary* result = [NSMutableDictionary new];
-    for (id key in [dataStructure allKeys]) {
-      id value = [dataStructure objectForKey:key];
-      if ([value isKindOfClass:[NSArray class]]) {
-        [result setObject:filterArray([dataStructure objectForKey:key])
-                   forKey:key];
-      } else if ([value isKindOfClass:[NSDictionary class]]) {
-        [result setObject:filterDictionary([dataStructure objectForKey:key])
-                   forKey:key];
-      } else if ([value isKindOfClass:[NSData class]]) {
-        NSString* dataString = [value base64EncodedStringWithOptions:0];
-        [result setObject:dataString forKey:key];
-      } else if ([value isKindOfClass:[NSDate class]]) {
-        NSNumber* seconds =
-            [[NSNumber alloc] initWithDouble:[value timeIntervalSince1970]];
-        [result setObject:seconds forKey:key];
-      } else {
-        [result setObject:[dataStructure objectForKey:key] forKey:key];
-      }
-    }
-    return result;
-  }
-}
-
-NSMutableArray* filterArray(id dataStructure) {
-  @autoreleasepool {
-    NSMutableArray* result = [NSMutableArray new];
-    for (id value in dataStructure) {
-      if ([value isKindOfClass:[NSDictionary class]]) {
-        [result addObject:filterDictionary(value)];
-      } else if ([value isKindOfClass:[NSArray class]]) {
-        [result addObject:filterArray(value)];
-      } else if ([value isKindOfClass:[NSData class]]) {
-        NSString* dataString = [value base64EncodedStringWithOptions:0];
-        [result addObject:dataString];
-      } else if ([value isKindOfClass:[NSDate class]]) {
-        NSNumber* seconds =
-            [[NSNumber alloc] initWithDouble:[value timeIntervalSince1970]];
-        [result addObject:seconds];
-      } else {
-        [result addObject:value];
-      }
-    }
-    return result;
+/// The most nested containers walked, deeper plists are rejected.
+const size_t kPlistMaxDepth = 64;
+
+/// The UTF-8 value of a CFString, without a copy when CF stores it as such.
+static std::string stringFromCF(CFStringRef value) {
+  auto direct = CFStringGetCStringPtr(value, kCFStringEncodingUTF8);
+  if (direct != nullptr) {
+    return direct;
+  }
+
+  auto length = CFStringGetLength(value);
+  auto size =
+      CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8) + 1;
+  std::string result(size, '\0');
+  if (!CFStringGetCString(value, &result[0], size, kCFStringEncodingUTF8)) {
+    return "";
   }
+  result.resize(std::strlen(result.c_str()));
+  return result;
 }
 
-NSMutableDictionary* filterPlist(NSData* plist) {
-  @autoreleasepool {
-    if ([plist isKindOfClass:[NSDictionary class]]) {
-      return filterDictionary((NSMutableDictionary*)plist);
-    } else {
-      NSMutableDictionary* result = [NSMutableDictionary new];
-      [result setObject:filterArray((NSMutableArray*)plist) forKey:@"root"];
-      return result;
+/// The shortest decimal representation that reads back as the same double.
+static std::string stringFromDouble(double value) {
+  if (std::floor(value) == value && std::fabs(value) < 1e15) {
+    return std::to_string((long long)value);
+  }
+
+  char buffer[32];
+  for (int precision = 15; precision <= 17; ++precision) {
+    std::snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+    if (std::strtod(buffer, nullptr) == value) {
+      break;
     }
   }
+  return buffer;
 }
 
-Status parsePlistContent(const std::string& fileContent, pt::ptree& tree) {
-  @autoreleasepool {
-    int statusCode = 0;
-    std::string statusString = "OK";
-
-    std::stringstream ss;
-    std::string jsonStringCxx;
-    NSString* jsonStringObjc;
-    NSData* jsonDataObjc;
-
-    NSData* plistContent =
-        [NSData dataWithBytes:fileContent.c_str() length:fileContent.size()];
-
-    NSError* error = nil;
-    NSMutableDictionary* plist;
-    NSPropertyListFormat plistFormat;
-    id plistData = [NSPropertyListSerialization
-        propertyListWithData:plistContent
-                     options:NSPropertyListImmutable
-                      format:&plistFormat
-                       error:&error];
-
-    if (plistData == nil) {
-      std::string errorMessage([[error localizedFailureReason] UTF8String]);
-      LOG(ERROR) << errorMessage;
-      statusCode = 1;
-      statusString = errorMessage;
-      goto cleanup;
+/**
+ * @brief The string representation of a scalar property list value.
+ *
+ * Booleans are "true" or "false" and dates are seconds since the epoch. Data
+ * and containers are not scalars and return false.
+ */
+static bool stringFromScalar(CFPropertyListRef value, std::string& result) {
+  auto type = CFGetTypeID(value);
+  if (type == CFStringGetTypeID()) {
+    result = stringFromCF((CFStringRef)value);
+  } else if (type == CFBooleanGetTypeID()) {
+    result = CFBooleanGetValue((CFBooleanRef)value) ? "true" : "false";
+  } else if (type == CFNumberGetTypeID()) {
+    auto number = (CFNumberRef)value;
+    if (CFNumberIsFloatType(number)) {
+      double real = 0;
+      CFNumberGetValue(number, kCFNumberDoubleType, &real);
+      result = stringFromDouble(real);
     } else {
-      switch (plistFormat) {
-      case NSPropertyListOpenStepFormat:
-        VLOG(1) << "plist was in openstep format";
-        break;
-      case NSPropertyListXMLFormat_v1_0:
-        VLOG(1) << "plist was in xml format";
-        break;
-      case NSPropertyListBinaryFormat_v1_0:
-        VLOG(1) << "plist was in binary format";
-        break;
-      default:
-        VLOG(1) << "plist was in unknown format";
-        break;
-      }
+      long long integer = 0;
+      CFNumberGetValue(number, kCFNumberLongLongType, &integer);
+      result = std::to_string(integer);
     }
+  } else if (type == CFDateGetTypeID()) {
+    auto seconds = CFDateGetAbsoluteTime((CFDateRef)value) +
+                   kCFAbsoluteTimeIntervalSince1970;
+    result = stringFromDouble(seconds);
+  } else {
+    return false;
+  }
+  return true;
+}
 
-    try {
-      plist = filterPlist(plistData);
-    } catch (const std::exception& e) {
-      LOG(ERROR)
-          << "An exception occurred while filtering the plist: " << e.what();
-      statusCode = 1;
-      statusString = e.what();
-      goto cleanup;
-    }
+static bool walkPlist(CFPropertyListRef value, pt::ptree& tree, size_t depth);
 
-    if ([NSJSONSerialization isValidJSONObject:plist]) {
-      jsonDataObjc =
-          [NSJSONSerialization dataWithJSONObject:plist options:0 error:&error];
-    } else {
-      statusCode = 1;
-      statusString = "Valid JSON was not deserialized";
-      goto cleanup;
+static void walkDictionaryEntry(const void* key,
+                                const void* value,
+                                void* context) {
+  auto tree = static_cast<std::pair<pt::ptree*, size_t>*>(context);
+  if (CFGetTypeID(key) != CFStringGetTypeID()) {
+    return;
+  }
+
+  // Keys are added verbatim, a '.' in a key is not a path separator.
+  pt::ptree child;
+  if (walkPlist((CFPropertyListRef)value, child, tree->second + 1)) {
+    tree->first->push_back(
+        std::make_pair(stringFromCF((CFStringRef)key), std::move(child)));
+  }
+}
+
+/**
+ * @brief Fill a property tree from a property list value.
+ *
+ * Dictionaries become children by key and arrays become children with empty
+ * keys, as a JSON parser would create them. Data is base64 encoded, dates are
+ * seconds since the epoch, and booleans are "true" or "false".
+ */
+static bool walkPlist(CFPropertyListRef value, pt::ptree& tree, size_t depth) {
+  if (depth > kPlistMaxDepth) {
+    return false;
+  }
+
+  auto type = CFGetTypeID(value);
+  if (type == CFDictionaryGetTypeID()) {
+    auto context = std::make_pair(&tree, depth);
+    CFDictionaryApplyFunction(
+        (CFDictionaryRef)value, walkDictionaryEntry, &context);
+  } else if (type == CFArrayGetTypeID()) {
+    auto array = (CFArrayRef)value;
+    auto count = CFArrayGetCount(array);
+    for (CFIndex i = 0; i < count; ++i) {
+      pt::ptree child;
+      if (walkPlist(CFArrayGetValueAtIndex(array, i), child, depth + 1)) {
+        tree.push_back(std::make_pair("", std::move(child)));
+      }
     }
-    if (jsonDataObjc == nil) {
-      std::string errorMessage([[error localizedFailureReason] UTF8String]);
-      LOG(ERROR) << errorMessage;
-      statusCode = 1;
-      statusString = errorMessage;
-      goto cleanup;
+  } else if (type == CFDataGetTypeID()) {
+    auto data = (CFDataRef)value;
+    tree.put_value(base64Encode(std::string(
+        (const char*)CFDataGetBytePtr(data), CFDataGetLength(data))));
+  } else {
+    std::string scalar;
+    if (!stringFromScalar(value, scalar)) {
+      // Unknown value types are omitted.
+      return false;
     }
+    tree.put_value(scalar);
+  }
+  return true;
+}
 
-    jsonStringObjc = [[NSString alloc] initWithBytes:[jsonDataObjc bytes]
-                                              length:[jsonDataObjc length]
-                                            encoding:NSUTF8StringEncoding];
-    jsonStringCxx = std::string([jsonStringObjc UTF8String]);
-    ss << jsonStringCxx;
-    try {
-      pt::read_json(ss, tree);
-    } catch (pt::json_parser::json_parser_error& e) {
-      LOG(ERROR) << "Error reading JSON: " << e.what();
-      statusCode = 1;
-      statusString = e.what();
-      goto cleanup;
+/// Parse property list content, the caller releases the created plist.
+static Status createPlist(const std::string& content,
+                          CFPropertyListRef& plist) {
+  // The content is read in place, without copying it into a CFData.
+  auto data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,
+                                          (const UInt8*)content.data(),
+                                          content.size(),
+                                          kCFAllocatorNull);
+  if (data == nullptr) {
+    return Status(1, "Could not read plist content");
+  }
+
+  CFErrorRef error = nullptr;
+  CFPropertyListFormat format;
+  plist = CFPropertyListCreateWithData(
+      kCFAllocatorDefault, data, kCFPropertyListImmutable, &format, &error);
+  CFRelease(data);
+
+  if (plist == nullptr) {
+    std::string message = "Could not parse plist";
+    if (error != nullptr) {
+      auto reason = CFErrorCopyFailureReason(error);
+      if (reason != nullptr) {
+        message = stringFromCF(reason);
+        CFRelease(reason);
+      }
+      CFRelease(error);
     }
+    LOG(ERROR) << message;
+    return Status(1, message);
+  }
+
+  switch (format) {
+  case kCFPropertyListOpenStepFormat:
+    VLOG(1) << "plist was in openstep format";
+    break;
+  case kCFPropertyListXMLFormat_v1_0:
+    VLOG(1) << "plist was in xml format";
+    break;
+  case kCFPropertyListBinaryFormat_v1_0:
+    VLOG(1) << "plist was in binary format";
+    break;
+  default:
+    VLOG(1) << "plist was in unknown format";
+    break;
+  }
+  return Status(0, "OK");
+}
 
-  cleanup:
-    return Status(statusCode, statusString);
+Status parsePlistContent(const std::string& fileContent, pt::ptree& tree) {
+  CFPropertyListRef plist = nullptr;
+  auto status = createPlist(fileContent, plist);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // A plist that is not a dictionary is placed under "root".
+  bool walked = false;
+  if (CFGetTypeID(plist) == CFDictionaryGetTypeID()) {
+    walked = walkPlist(plist, tree, 0);
+  } else {
+    pt::ptree root;
+    walked = walkPlist(plist, root, 0);
+    tree.push_back(std::make_pair("root", std::move(root)));
+  }
+  CFRelease(plist);
+
+  if (!walked) {
+    return Status(1, "Could not walk plist");
   }
+  return Status(0, "OK");
 }
 
 Status parsePlist(const boost::filesystem::path& path, pt::ptree& tree) {
@@ -184,4 +240,311 @@ Status parsePlist(const boost::filesystem::path& path, pt::ptree& tree) {
   }
   return parsePlistContent(fileContent, tree);
 }
+
+/// The trailer of a binary property list and its offset table.
+struct BinaryPlist {
+  const std::string& content;
+  /// The offset of the 32 byte trailer, the end of the objects.
+  size_t trailer;
+  size_t offset_size;
+  size_t ref_size;
+  uint64_t objects;
+  uint64_t top;
+  uint64_t table;
+
+  explicit BinaryPlist(const std::string& plist_content)
+      : content(plist_content),
+        trailer(0),
+        offset_size(0),
+        ref_size(0),
+        objects(0),
+        top(0),
+        table(0) {}
+};
+
+/// Read a big-endian unsigned integer of up to 8 bytes.
+static bool readBigEndian(const std::string& content,
+                          size_t offset,
+                          size_t size,
+                          uint64_t& value) {
+  if (size == 0 || size > 8 || offset > content.size() ||
+      content.size() - offset < size) {
+    return false;
+  }
+
+  value = 0;
+  for (size_t i = 0; i < size; ++i) {
+    value = (value << 8) | (unsigned char)content[offset + i];
+  }
+  return true;
+}
+
+static bool readBinaryTrailer(BinaryPlist& plist) {
+  const auto& content = plist.content;
+  if (content.size() < 40 || content.compare(0, 8, "bplist00") != 0) {
+    return false;
+  }
+
+  plist.trailer = content.size() - 32;
+  plist.offset_size = (unsigned char)content[plist.trailer + 6];
+  plist.ref_size = (unsigned char)content[plist.trailer + 7];
+  if (!readBigEndian(content, plist.trailer + 8, 8, plist.objects) ||
+      !readBigEndian(content, plist.trailer + 16, 8, plist.top) ||
+      !readBigEndian(content, plist.trailer + 24, 8, plist.table)) {
+    return false;
+  }
+
+  // The offset table must fit between the objects and the trailer.
+  if (plist.offset_size == 0 || plist.offset_size > 8 || plist.ref_size == 0 ||
+      plist.ref_size > 8 || plist.top >= plist.objects ||
+      plist.table > plist.trailer ||
+      plist.objects > (plist.trailer - plist.table) / plist.offset_size) {
+    return false;
+  }
+  return true;
+}
+
+/// The offset of an object's marker byte, read from the offset table.
+static bool getBinaryObject(const BinaryPlist& plist,
+                            uint64_t ref,
+                            size_t& offset) {
+  uint64_t value = 0;
+  if (ref >= plist.objects ||
+      !readBigEndian(plist.content,
+                     plist.table + ref * plist.offset_size,
+                     plist.offset_size,
+                     value) ||
+      value < 8 || value >= plist.trailer) {
+    return false;
+  }
+  offset = value;
+  return true;
+}
+
+/**
+ * @brief Read the length of an object.
+ *
+ * A length of 15 in the marker is followed by an integer object with the
+ * length. On return the offset is the start of the object's content.
+ */
+static bool getBinaryLength(const BinaryPlist& plist,
+                            size_t& offset,
+                            uint64_t& length) {
+  length = (unsigned char)plist.content[offset] & 0x0F;
+  offset += 1;
+  if (length != 0x0F) {
+    return true;
+  }
+
+  if (offset >= plist.trailer) {
+    return false;
+  }
+  auto marker = (unsigned char)plist.content[offset];
+  size_t size = 1 << (marker & 0x0F);
+  if ((marker & 0xF0) != 0x10 ||
+      !readBigEndian(plist.content, offset + 1, size, length)) {
+    return false;
+  }
+  offset += 1 + size;
+  return true;
+}
+
+/// True if an object's content of a length fits before the trailer.
+static bool hasBinaryContent(const BinaryPlist& plist,
+                             size_t offset,
+                             uint64_t length) {
+  return offset <= plist.trailer && length <= plist.trailer - offset;
+}
+
+/// Read an ASCII or UTF-16 string object.
+static bool readBinaryString(const BinaryPlist& plist,
+                             uint64_t ref,
+                             std::string& value) {
+  size_t offset = 0;
+  uint64_t length = 0;
+  if (!getBinaryObject(plist, ref, offset)) {
+    return false;
+  }
+
+  auto type = (unsigned char)plist.content[offset] & 0xF0;
+  if ((type != 0x50 && type != 0x60) ||
+      !getBinaryLength(plist, offset, length)) {
+    return false;
+  }
+
+  if (type == 0x50) {
+    if (!hasBinaryContent(plist, offset, length)) {
+      return false;
+    }
+    value.assign(plist.content, offset, length);
+    return true;
+  }
+
+  // UTF-16 strings have a length in characters.
+  if (length > plist.trailer || !hasBinaryContent(plist, offset, length * 2)) {
+    return false;
+  }
+  auto string = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                        (const UInt8*)&plist.content[offset],
+                                        length * 2,
+                                        kCFStringEncodingUTF16BE,
+                                        false);
+  if (string == nullptr) {
+    return false;
+  }
+  value = stringFromCF(string);
+  CFRelease(string);
+  return true;
+}
+
+/**
+ * @brief Read a scalar object like stringFromScalar.
+ *
+ * Only the marker of data and container objects is read, they are skipped.
+ */
+static bool readBinaryScalar(const BinaryPlist& plist,
+                             uint64_t ref,
+                             std::string& value) {
+  size_t offset = 0;
+  if (!getBinaryObject(plist, ref, offset)) {
+    return false;
+  }
+
+  auto marker = (unsigned char)plist.content[offset];
+  auto type = marker & 0xF0;
+  size_t size = 1 << (marker & 0x0F);
+  uint64_t bits = 0;
+  if (marker == 0x08 || marker == 0x09) {
+    value = (marker == 0x09) ? "true" : "false";
+  } else if (type == 0x10 && size <= 8) {
+    // Integers of less than 8 bytes are unsigned.
+    if (!readBigEndian(plist.content, offset + 1, size, bits)) {
+      return false;
+    }
+    value = (size == 8) ? std::to_string((long long)bits)
+                        : std::to_string((unsigned long long)bits);
+  } else if ((type == 0x20 && (size == 4 || size == 8)) || marker == 0x33) {
+    if (!readBigEndian(plist.content, offset + 1, size, bits)) {
+      return false;
+    }
+
+    double real = 0;
+    if (size == 4) {
+      uint32_t single = bits;
+      float narrow = 0;
+      std::memcpy(&narrow, &single, sizeof(narrow));
+      real = narrow;
+    } else {
+      std::memcpy(&real, &bits, sizeof(real));
+    }
+
+    // Dates are seconds since 2001, like a CFAbsoluteTime.
+    if (marker == 0x33) {
+      real += kCFAbsoluteTimeIntervalSince1970;
+    }
+    value = stringFromDouble(real);
+  } else if (type == 0x50 || type == 0x60) {
+    return readBinaryString(plist, ref, value);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Read top-level keys of a binary property list.
+ *
+ * The root dictionary's keys are compared in place and only the values of
+ * requested keys are read, through the offset table. The remaining objects,
+ * including large data objects, are never parsed.
+ */
+static Status parseBinaryPlistKeys(const std::string& content,
+                                   const std::vector<std::string>& keys,
+                                   std::map<std::string, std::string>& values) {
+  BinaryPlist plist(content);
+  size_t offset = 0;
+  if (!readBinaryTrailer(plist) || !getBinaryObject(plist, plist.top, offset)) {
+    return Status(1, "Invalid binary plist");
+  }
+
+  uint64_t count = 0;
+  if (((unsigned char)content[offset] & 0xF0) != 0xD0) {
+    return Status(1, "Binary plist is not a dictionary");
+  } else if (!getBinaryLength(plist, offset, count) ||
+             count > plist.trailer ||
+             !hasBinaryContent(plist, offset, count * 2 * plist.ref_size)) {
+    return Status(1, "Invalid binary plist dictionary");
+  }
+
+  // The dictionary has count key references followed by value references.
+  // Reading stops once every requested key was found.
+  size_t found = 0;
+  for (uint64_t i = 0; i < count && found < keys.size(); ++i) {
+    uint64_t key_ref = 0;
+    std::string key;
+    auto key_offset = offset + i * plist.ref_size;
+    readBigEndian(content, key_offset, plist.ref_size, key_ref);
+    if (!readBinaryString(plist, key_ref, key) ||
+        std::find(keys.begin(), keys.end(), key) == keys.end()) {
+      continue;
+    }
+
+    found++;
+
+    uint64_t value_ref = 0;
+    std::string value;
+    readBigEndian(content,
+                  offset + (count + i) * plist.ref_size,
+                  plist.ref_size,
+                  value_ref);
+    if (readBinaryScalar(plist, value_ref, value)) {
+      values[key] = std::move(value);
+    }
+  }
+  return Status(0, "OK");
+}
+
+Status parsePlistKeys(const boost::filesystem::path& path,
+                      const std::vector<std::string>& keys,
+                      std::map<std::string, std::string>& values) {
+  std::string content;
+  auto status = readFile(path, content);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (content.compare(0, 8, "bplist00") == 0) {
+    return parseBinaryPlistKeys(content, keys, values);
+  }
+
+  // XML and OpenStep plists are parsed by CF, only the requested values are
+  // converted.
+  CFPropertyListRef plist = nullptr;
+  status = createPlist(content, plist);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
+    CFRelease(plist);
+    return Status(1, "Plist is not a dictionary");
+  }
+
+  for (const auto& key : keys) {
+    auto name = CFStringCreateWithCString(
+        kCFAllocatorDefault, key.c_str(), kCFStringEncodingUTF8);
+    if (name == nullptr) {
+      continue;
+    }
+
+    auto value = CFDictionaryGetValue((CFDictionaryRef)plist, name);
+    std::string scalar;
+    if (value != nullptr && stringFromScalar(value, scalar)) {
+      values[key] = std::move(scalar);
+    }
+    CFRelease(name);
+  }
+  CFRelease(plist);
+  return Status(0, "OK");
+}
 }
@@ -59,6 +59,65 @@ TEST_F(PlistTests, test_parse_plist_content) {
   EXPECT_EQ(program_arguments_parsed, program_arguments);
 }
 
+TEST_F(PlistTests, test_parse_plist_content_types) {
+  std::string content =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<plist version=\"1.0\"><dict>"
+      "<key>Integer</key><integer>42</integer>"
+      "<key>Real</key><real>1.5</real>"
+      "<key>False</key><false/>"
+      "<key>Date</key><date>1970-01-01T00:01:00Z</date>"
+      "<key>Data</key><data>aGVsbG8=</data>"
+      "<key>com.example.key</key><string>dotted</string>"
+      "<key>Array</key><array><string>a</string><integer>1</integer></array>"
+      "</dict></plist>";
+
+  pt::ptree tree;
+  auto s = parsePlistContent(content, tree);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(tree.get<std::string>("Integer"), "42");
+  EXPECT_EQ(tree.get<std::string>("Real"), "1.5");
+  EXPECT_EQ(tree.get<bool>("False"), false);
+  EXPECT_EQ(tree.get<std::string>("Date"), "60");
+  EXPECT_EQ(base64Decode(tree.get<std::string>("Data")), "hello");
+
+  // Keys containing a '.' are not split into paths.
+  auto dotted = tree.find("com.example.key");
+  ASSERT_TRUE(dotted != tree.not_found());
+  EXPECT_EQ(dotted->second.data(), "dotted");
+
+  std::vector<std::string> values;
+  for (const auto& value : tree.get_child("Array")) {
+    EXPECT_EQ(value.first, "");
+    values.push_back(value.second.data());
+  }
+  EXPECT_EQ(values, std::vector<std::string>({"a", "1"}));
+}
+
+TEST_F(PlistTests, test_parse_plist_keys) {
+  std::map<std::string, std::string> values;
+  auto s = parsePlistKeys(kTestDataPath + "test.plist",
+                          {"Label", "Disabled", "ProgramArguments", "foobar"},
+                          values);
+  EXPECT_TRUE(s.ok());
+
+  // Only scalar values of the requested keys are read.
+  std::map<std::string, std::string> expected = {
+      {"Label", "com.apple.FileSyncAgent.sshd"}, {"Disabled", "true"},
+  };
+  EXPECT_EQ(values, expected);
+
+  // The binary plist's only key is a dictionary, with data within.
+  values.clear();
+  fs::path bin_path(argv0);
+  s = parsePlistKeys((bin_path.parent_path() /
+                      "../../../../tools/tests/test_binary.plist").string(),
+                     {"SessionItems"},
+                     values);
+  EXPECT_TRUE(s.ok());
+  EXPECT_TRUE(values.empty());
+}
+
 TEST_F(PlistTests, test_parse_plist_from_file) {
   // Now read the plist from a file and parse.
   boost::property_tree::ptree tree;
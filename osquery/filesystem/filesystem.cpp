@@ -8,13 +8,17 @@
  *
  */
 
+#include <algorithm>
 #include <exception>
 #include <sstream>
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
 
-#include <boost/algorithm/string/join.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
@@ -175,189 +179,541 @@ Status listDirectoriesInDirectory(const boost::filesystem::path& path,
   }
 }
 
+/// The kind of a compiled file pattern component.
+enum FilePatternType {
+  /// A literal directory or file name, which is never listed.
+  FILE_PATTERN_LITERAL,
+  /// A '%' (or '*') matching every name.
+  FILE_PATTERN_ANY,
+  /// A name containing '%' or '*', each matching any run of characters.
+  FILE_PATTERN_GLOB,
+  /// A trailing '%%', every file below the directory.
+  FILE_PATTERN_RECURSIVE,
+};
+
+struct FilePatternComponent {
+  std::string text;
+  FilePatternType type;
+};
+
+/// An entry of a listed directory, types follow symlinks.
+struct FilePatternEntry {
+  std::string name;
+  bool is_dir;
+  bool is_link;
+};
+
+/// Match a name against a glob where '%' and '*' match any characters.
+static bool globMatches(const char* glob, const char* name) {
+  const char* star = nullptr;
+  const char* retry = nullptr;
+  while (*name != '\0') {
+    if (*glob == '%' || *glob == '*') {
+      star = glob++;
+      retry = name;
+    } else if (*glob == *name) {
+      ++glob;
+      ++name;
+    } else if (star != nullptr) {
+      glob = star + 1;
+      name = ++retry;
+    } else {
+      return false;
+    }
+  }
+
+  while (*glob == '%' || *glob == '*') {
+    ++glob;
+  }
+  return (*glob == '\0');
+}
+
 /**
- * @brief Drill down recursively and list all sub files
- *
- * This functions purpose is to take a path with no wildcards
- * and it will recursively go through all files and and return
- * them in the results vector.
- *
- * @param fs_path The entire resolved path
- * @param results The vector where results will be returned
- * @param rec_depth How many recursions deep the current execution is at
+ * @brief Resolve file patterns, sharing directory listings between them.
  *
- * @return An instance of osquery::Status indicating the success of failure of
- * the operation
+ * A pattern is compiled into components once. Literal components are
+ * appended to a single path buffer without listing their directory, and a
+ * listed directory's entries are typed with fstatat relative to the open
+ * directory. Listings are kept for the resolver's lifetime, so patterns
+ * resolved together (such as those of a config) read each directory once.
  */
-Status doubleStarTraversal(const boost::filesystem::path& fs_path,
-                           std::vector<std::string>& results,
-                           unsigned int rec_depth) {
-  if (rec_depth >= kMaxDirectoryTraversalDepth) {
-    return Status(2, fs_path.string().c_str());
-  }
-  // List files first
-  Status stat = listFilesInDirectory(fs_path, results);
-  if (!stat.ok()) {
-    return Status(0, "OK");
+class FilePatternResolver {
+ public:
+  Status resolve(const std::string& pattern, std::vector<std::string>& results);
+
+  /// Resolve a SQL LIKE pattern, see resolveLikePatterns.
+  Status resolveLike(const std::string& pattern,
+                     std::vector<std::string>& results);
+
+ private:
+  /// Resolve the components from index, within the directory at path.
+  Status resolve(const std::vector<FilePatternComponent>& components,
+                 size_t index,
+                 std::string& path,
+                 unsigned int depth,
+                 std::vector<std::string>& results);
+
+  /// Add every file below a directory, without following symlinks.
+  Status resolveRecursive(std::string& path,
+                          unsigned int depth,
+                          std::vector<std::string>& results);
+
+  /// Add every entry below a directory, without following symlinks.
+  Status resolveEntries(std::string& path,
+                        unsigned int depth,
+                        std::vector<std::string>& results);
+
+  /// List a directory, nullptr if it cannot be read.
+  const std::vector<FilePatternEntry>* list(const std::string& path);
+
+ private:
+  std::map<std::string, std::vector<FilePatternEntry> > listings_;
+};
+
+/// Split a pattern into its typed components.
+static std::vector<FilePatternComponent> compileFilePattern(
+    const std::string& pattern) {
+  std::vector<FilePatternComponent> components;
+  for (const auto& text : split(pattern, "/")) {
+    FilePatternComponent component;
+    component.text = text;
+    if (text == kWildcardCharacterRecursive) {
+      component.type = FILE_PATTERN_RECURSIVE;
+    } else if (text == kWildcardCharacter || text == "*") {
+      component.type = FILE_PATTERN_ANY;
+    } else if (text.find_first_of("%*") != std::string::npos) {
+      component.type = FILE_PATTERN_GLOB;
+    } else {
+      component.type = FILE_PATTERN_LITERAL;
+    }
+    components.push_back(component);
   }
-  std::vector<std::string> folders;
-  stat = listDirectoriesInDirectory(fs_path, folders);
-  if (!stat.ok()) {
+  return components;
+}
+
+Status FilePatternResolver::resolve(const std::string& pattern,
+                                    std::vector<std::string>& results) {
+  auto components = compileFilePattern(pattern);
+  if (components.empty()) {
     return Status(0, "OK");
   }
 
-  for (const auto& folder : folders) {
-    boost::filesystem::path p(folder);
-    if (boost::filesystem::is_symlink(p)) {
+  std::string path;
+  path.reserve(PATH_MAX);
+  return resolve(components, 0, path, 0, results);
+}
+
+Status FilePatternResolver::resolve(
+    const std::vector<FilePatternComponent>& components,
+    size_t index,
+    std::string& path,
+    unsigned int depth,
+    std::vector<std::string>& results) {
+  const auto& component = components[index];
+  bool last = (index + 1 == components.size());
+  auto length = path.size();
+
+  if (component.type == FILE_PATTERN_RECURSIVE) {
+    if (!last) {
+      return Status(1, "%% NOT LAST COMPONENT");
+    }
+    return resolveRecursive(path, depth, results);
+  }
+
+  if (component.type == FILE_PATTERN_LITERAL) {
+    path += "/" + component.text;
+    if (!last) {
+      // The directory is only read if a later component needs a listing.
+      auto status = resolve(components, index + 1, path, depth, results);
+      path.resize(length);
+      return status;
+    }
+
+    // A directory lists its files, a file is itself.
+    struct stat info;
+    Status status(0, "OK");
+    if (::stat(path.c_str(), &info) != 0) {
+      // Back out if this path doesn't exist due to invalid path.
+    } else if (S_ISDIR(info.st_mode)) {
+      auto entries = list(path);
+      if (entries != nullptr) {
+        for (const auto& entry : *entries) {
+          if (!entry.is_dir) {
+            results.push_back(path + "/" + entry.name);
+          }
+        }
+      }
+    } else if (S_ISREG(info.st_mode)) {
+      results.push_back(path);
+    } else {
+      status = Status(1, "UNKNOWN FILE TYPE");
+    }
+    path.resize(length);
+    return status;
+  }
+
+  // The component is a wildcard or glob.
+  if (!last && depth >= kMaxDirectoryTraversalDepth) {
+    return Status(STATUS_MAX_DEPTH, "MAX_DEPTH");
+  }
+
+  auto entries = list(path.empty() ? "/" : path);
+  if (entries == nullptr) {
+    // Only a trailing wildcard reports an unreadable directory.
+    return (last) ? Status(1, "Cannot list directory: " + path)
+                  : Status(0, "OK");
+  }
+
+  for (const auto& entry : *entries) {
+    if (entry.is_dir == last ||
+        (component.type == FILE_PATTERN_GLOB &&
+         !globMatches(component.text.c_str(), entry.name.c_str()))) {
+      // Directories are descended into, files are results.
       continue;
     }
-    stat = doubleStarTraversal(folder, results, rec_depth + 1);
-    if (!stat.ok() && stat.getCode() == 2) {
-      return stat;
+
+    path += "/" + entry.name;
+    if (last) {
+      results.push_back(path);
+    } else {
+      // Failures other than the depth limit only prune this branch.
+      auto status = resolve(components, index + 1, path, depth + 1, results);
+      if (status.getCode() == STATUS_MAX_DEPTH) {
+        path.resize(length);
+        return status;
+      }
     }
+    path.resize(length);
   }
   return Status(0, "OK");
 }
 
-/**
- * @brief Resolve the last component of a file path
- *
- * This function exists because unlike the other parts of of a file
- * path, which should only resolve to folder, a wildcard at the end
- * means to list all files in that directory, as does just listing
- * folder. Also, a double means to drill down recursively into that
- * that folder and list all sub file.
- *
- * @param fs_path The entire resolved path (except last component)
- * @param results The vector where results will be returned
- * @param components A path, split by forward slashes
- * @param rec_depth How many recursions deep the current execution is at
- *
- * @return An instance of osquery::Status indicating the success of failure of
- * the operation
- */
-Status resolveLastPathComponent(const boost::filesystem::path& fs_path,
-                                std::vector<std::string>& results,
-                                const std::vector<std::string>& components,
-                                unsigned int rec_depth) {
-  // Is the last component a double star?
-  if (components[components.size() - 1] == kWildcardCharacterRecursive) {
-    Status stat =
-        doubleStarTraversal(fs_path.parent_path(), results, rec_depth);
-    return stat;
-  }
-  // Is the last component a wildcard?
-  if (components[components.size() - 1] == kWildcardCharacter) {
-    std::vector<std::string> files;
-    Status stat = listFilesInDirectory(fs_path.parent_path(), files);
-    if (!stat.ok()) {
-      return stat;
+Status FilePatternResolver::resolveRecursive(
+    std::string& path,
+    unsigned int depth,
+    std::vector<std::string>& results) {
+  if (depth >= kMaxDirectoryTraversalDepth) {
+    return Status(STATUS_MAX_DEPTH, path);
+  }
+
+  auto entries = list(path.empty() ? "/" : path);
+  if (entries == nullptr) {
+    return Status(0, "OK");
+  }
+
+  // List files first.
+  auto length = path.size();
+  for (const auto& entry : *entries) {
+    if (!entry.is_dir) {
+      results.push_back(path + "/" + entry.name);
     }
-    for (const auto& file : files) {
-      results.push_back(file);
+  }
+
+  for (const auto& entry : *entries) {
+    if (!entry.is_dir || entry.is_link) {
+      continue;
+    }
+
+    path += "/" + entry.name;
+    auto status = resolveRecursive(path, depth + 1, results);
+    path.resize(length);
+    if (!status.ok() && status.getCode() == STATUS_MAX_DEPTH) {
+      return status;
     }
-    return Status(0, "OK");
   }
+  return Status(0, "OK");
+}
 
-  // Back out if this path doesn't exist due to invalid path
-  if (!(pathExists(fs_path).ok())) {
-    return Status(0, "OK");
+/// Compare a name with LIKE text ignoring ASCII case, as SQLite's LIKE does.
+static bool likeMatches(const std::string& name,
+                        const std::string& text,
+                        bool prefix) {
+  if (name.size() < text.size() || (!prefix && name.size() != text.size())) {
+    return false;
   }
+  for (size_t i = 0; i < text.size(); ++i) {
+    auto a = name[i], b = text[i];
+    a = (a >= 'A' && a <= 'Z') ? a - 'A' + 'a' : a;
+    b = (b >= 'A' && b <= 'Z') ? b - 'A' + 'a' : b;
+    if (a != b) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  // Is the path a directory
-  if (boost::filesystem::is_directory(fs_path)) {
-    std::vector<std::string> files;
-    Status stat = listFilesInDirectory(fs_path, files);
-    if (!stat.ok()) {
-      return stat;
+Status FilePatternResolver::resolveLike(const std::string& pattern,
+                                        std::vector<std::string>& results) {
+  // Only a trailing '%' is resolved, it matches '/' as any other character.
+  auto wildcard = pattern.find('%');
+  bool recursive = (wildcard != std::string::npos);
+  if (pattern.empty() || pattern[0] != '/' ||
+      pattern.find('_') != std::string::npos ||
+      (recursive && pattern.find_first_not_of('%', wildcard) !=
+                        std::string::npos)) {
+    return Status(1, "Cannot resolve LIKE pattern: " + pattern);
+  }
+
+  auto text = pattern.substr(0, wildcard);
+  auto slash = text.rfind('/');
+  auto stem = text.substr(slash + 1);
+  std::vector<std::string> components;
+  boost::split(components, text.substr(1, slash), boost::is_any_of("/"));
+  components.pop_back();
+
+  // Directories are matched ignoring case, only names with letters are listed.
+  std::vector<std::string> directories = {""};
+  for (const auto& component : components) {
+    if (component.empty()) {
+      // Paths have no empty components.
+      return Status(0, "OK");
     }
-    for (auto& file : files) {
-      results.push_back(file);
+
+    std::vector<std::string> matched;
+    for (const auto& directory : directories) {
+      auto letter = std::find_if(component.begin(),
+                                 component.end(),
+                                 [](char c) {
+                                   return (c >= 'A' && c <= 'Z') ||
+                                          (c >= 'a' && c <= 'z');
+                                 });
+      if (letter == component.end()) {
+        matched.push_back(directory + "/" + component);
+        continue;
+      }
+
+      auto entries = list(directory.empty() ? "/" : directory);
+      if (entries == nullptr) {
+        continue;
+      }
+      for (const auto& entry : *entries) {
+        if (entry.is_dir && likeMatches(entry.name, component, false)) {
+          matched.push_back(directory + "/" + entry.name);
+        }
+      }
     }
-    return Status(0, "OK");
+    directories.swap(matched);
+  }
+
+  Status status(0, "OK");
+  for (auto& directory : directories) {
+    auto entries = list(directory.empty() ? "/" : directory);
+    if (entries == nullptr) {
+      continue;
+    }
+
+    auto length = directory.size();
+    for (const auto& entry : *entries) {
+      if (!likeMatches(entry.name, stem, recursive)) {
+        continue;
+      }
+
+      directory += "/" + entry.name;
+      results.push_back(directory);
+      if (recursive && entry.is_dir && !entry.is_link) {
+        auto resolved = resolveEntries(directory, 1, results);
+        status = (resolved.ok()) ? status : resolved;
+      }
+      directory.resize(length);
+    }
+  }
+  return status;
+}
+
+Status FilePatternResolver::resolveEntries(
+    std::string& path,
+    unsigned int depth,
+    std::vector<std::string>& results) {
+  if (depth >= kMaxDirectoryTraversalDepth) {
+    return Status(STATUS_MAX_DEPTH, path);
   }
 
-  // Is the path a file
-  if (boost::filesystem::is_regular_file(fs_path)) {
-    results.push_back(fs_path.string());
+  auto entries = list(path);
+  if (entries == nullptr) {
     return Status(0, "OK");
   }
-  return Status(1, "UNKNOWN FILE TYPE");
+
+  auto length = path.size();
+  for (const auto& entry : *entries) {
+    path += "/" + entry.name;
+    results.push_back(path);
+    if (entry.is_dir && !entry.is_link) {
+      auto status = resolveEntries(path, depth + 1, results);
+      if (status.getCode() == STATUS_MAX_DEPTH) {
+        path.resize(length);
+        return status;
+      }
+    }
+    path.resize(length);
+  }
+  return Status(0, "OK");
 }
 
-/**
- * @brief List all files in a directory recursively
- *
- * This is an overloaded version of the exported `resolveFilePattern`. This
- * version is used internally to facilitate the tracking of the recursion
- * depth.
- *
- * @param results The vector where results will be returned
- * @param components A path, split by forward slashes
- * @param processed_index What index of components has been resolved so far
- * @param rec_depth How many recursions deep the current execution is at
- *
- * @return An instance of osquery::Status indicating the success of failure of
- * the operation
- */
-Status resolveFilePattern(std::vector<std::string> components,
-                          std::vector<std::string>& results,
-                          unsigned int processed_index = 0,
-                          unsigned int rec_depth = 0) {
-  // Handle all parts of the path except last because then we want to get files,
-  // not directories
-  for (auto i = processed_index; i < components.size() - 1; i++) {
-    // A wildcard only component
-    if (components[i] == kWildcardCharacter) {
-      if (rec_depth >= kMaxDirectoryTraversalDepth) {
-        return Status(2, "MAX_DEPTH");
+const std::vector<FilePatternEntry>* FilePatternResolver::list(
+    const std::string& path) {
+  auto listing = listings_.find(path);
+  if (listing != listings_.end()) {
+    return &listing->second;
+  }
+
+  auto dir = ::opendir(path.c_str());
+  if (dir == nullptr) {
+    return nullptr;
+  }
+
+  auto& entries = listings_[path];
+  struct dirent* entry = nullptr;
+  while ((entry = ::readdir(dir)) != nullptr) {
+    const char* name = entry->d_name;
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
+    }
+
+    FilePatternEntry typed;
+    typed.name = name;
+    typed.is_link = (entry->d_type == DT_LNK);
+    typed.is_dir = (entry->d_type == DT_DIR);
+    if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+      // Symlinks are typed by their target.
+      struct stat info;
+      if (::fstatat(::dirfd(dir), name, &info, 0) == 0) {
+        typed.is_dir = S_ISDIR(info.st_mode);
       }
-      std::vector<std::string> folders;
-      std::string processed_path =
-          "/" + boost::algorithm::join(
-                    std::vector<std::string>(components.begin(),
-                                             components.begin() + i),
-                    "/");
-
-      Status stat = listDirectoriesInDirectory(processed_path, folders);
-
-      // If we couldn't list the directories it's probably because
-      // the path is invalid (or we don't have permission). Return
-      // here because this branch is no good.
-      if (!stat.ok()) {
-        return Status(0, "OK");
+      if (entry->d_type == DT_UNKNOWN &&
+          ::fstatat(::dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+        typed.is_link = S_ISLNK(info.st_mode);
       }
+    }
+    entries.push_back(typed);
+  }
+  ::closedir(dir);
+  return &entries;
+}
 
-      for (const auto& dir : folders) {
-        boost::filesystem::path p(dir);
-        components[i] = p.filename().string();
-        Status stat =
-            resolveFilePattern(components, results, i + 1, rec_depth + 1);
-        if (!stat.ok() && stat.getCode() == 2) {
-          return stat;
+Status resolveFilePatterns(const std::vector<std::string>& patterns,
+                           std::vector<std::string>& results) {
+  FilePatternResolver resolver;
+  Status status(0, "OK");
+  for (const auto& pattern : patterns) {
+    auto resolved = resolver.resolve(pattern, results);
+    status = (resolved.ok()) ? status : resolved;
+  }
+  return status;
+}
+
+Status resolveLikePatterns(const std::vector<std::string>& patterns,
+                           std::vector<std::string>& results) {
+  FilePatternResolver resolver;
+  Status status(0, "OK");
+  for (const auto& pattern : patterns) {
+    auto resolved = resolver.resolveLike(pattern, results);
+    status = (resolved.ok()) ? status : resolved;
+  }
+  return status;
+}
+
+Status resolveFilePattern(const boost::filesystem::path& fs_path,
+                          std::vector<std::string>& results) {
+  FilePatternResolver resolver;
+  return resolver.resolve(fs_path.string(), results);
+}
+
+/// A directory of the combined patterns, children are keyed by component.
+struct FilePatternMatcher::Node {
+  /// Literal names, looked up without comparing every pattern.
+  std::map<std::string, std::unique_ptr<Node> > literals;
+  /// Wildcard and glob components, '%' for a whole name.
+  std::vector<std::pair<std::string, std::unique_ptr<Node> > > globs;
+  /// A pattern ends with this component.
+  bool end;
+  /// A pattern ends with '%%' below this directory.
+  bool recursive;
+
+  Node() : end(false), recursive(false) {}
+};
+
+FilePatternMatcher::FilePatternMatcher() : root_(new Node()), patterns_(0) {}
+
+FilePatternMatcher::~FilePatternMatcher() {}
+
+void FilePatternMatcher::add(const std::string& pattern) {
+  auto node = root_.get();
+  for (const auto& component : compileFilePattern(pattern)) {
+    if (component.type == FILE_PATTERN_RECURSIVE) {
+      // Components after a '%%' are not resolved, nor matched.
+      node->recursive = true;
+      patterns_++;
+      return;
+    }
+
+    std::unique_ptr<Node>* child = nullptr;
+    if (component.type == FILE_PATTERN_LITERAL) {
+      child = &node->literals[component.text];
+    } else {
+      // Globs of several patterns are compared once.
+      auto glob = (component.type == FILE_PATTERN_ANY) ? kWildcardCharacter
+                                                       : component.text;
+      for (auto& existing : node->globs) {
+        if (existing.first == glob) {
+          child = &existing.second;
+          break;
         }
       }
-      // Our subcalls that handle processing are now complete, return
-      return Status(0, "OK");
-    } else if (components[i] == kWildcardCharacterRecursive) {
-      return Status(1, "%% NOT LAST COMPONENT");
-    } else {
-      // When we want to support wildcards like "foobar%", this is where it
-      // will happen
+      if (child == nullptr) {
+        node->globs.push_back(std::make_pair(glob, std::unique_ptr<Node>()));
+        child = &node->globs.back().second;
+      }
+    }
+
+    if (*child == nullptr) {
+      child->reset(new Node());
     }
+    node = child->get();
   }
-  
-  // At this point, all of our call paths have been resolved, so know we want to
-  // list the files at this point or do our ** traversal
-  return resolveLastPathComponent("/" + boost::algorithm::join(components, "/"),
-                                  results,
-                                  components,
-                                  rec_depth);
+  node->end = true;
+  patterns_++;
 }
 
-Status resolveFilePattern(const boost::filesystem::path& fs_path,
-                          std::vector<std::string>& results) {
-  return resolveFilePattern(split(fs_path.string(), "/"), results, 0, 0);
+void FilePatternMatcher::clear() {
+  root_.reset(new Node());
+  patterns_ = 0;
+}
+
+bool FilePatternMatcher::matches(const std::string& path) const {
+  // Every directory of the tree the path may be within, as in an NFA.
+  std::vector<const Node*> nodes = {root_.get()};
+  std::vector<const Node*> next;
+  for (const auto& name : split(path, "/")) {
+    next.clear();
+    for (const auto& node : nodes) {
+      if (node->recursive) {
+        return true;
+      }
+
+      auto literal = node->literals.find(name);
+      if (literal != node->literals.end()) {
+        next.push_back(literal->second.get());
+      }
+      for (const auto& glob : node->globs) {
+        if (globMatches(glob.first.c_str(), name.c_str())) {
+          next.push_back(glob.second.get());
+        }
+      }
+    }
+
+    if (next.empty()) {
+      return false;
+    }
+    nodes.swap(next);
+  }
+
+  for (const auto& node : nodes) {
+    if (node->end) {
+      return true;
+    }
+  }
+  return false;
 }
 
 Status getDirectory(const boost::filesystem::path& path,
@@ -0,0 +1,80 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <fstream>
+
+#include <boost/filesystem/operations.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <osquery/database.h>
+#include <osquery/filesystem.h>
+#include <osquery/flags.h>
+#include <osquery/hash.h>
+
+namespace fs = boost::filesystem;
+
+namespace osquery {
+
+DECLARE_bool(hash_cache);
+
+const std::string kBenchmarkFilesPath = "/tmp/osquery-benchmark-files";
+const std::string kBenchmarkDBPath = "/tmp/rocksdb-osquery-benchmark-files";
+
+/// Create 10 directories of 100 files, and a 1MB file to hash.
+static void createBenchmarkFiles() {
+  for (int i = 0; i < 10; ++i) {
+    auto directory = kBenchmarkFilesPath + "/dir_" + std::to_string(i);
+    fs::create_directories(directory);
+    for (int j = 0; j < 100; ++j) {
+      std::ofstream(directory + "/file_" + std::to_string(j) + ".conf");
+    }
+  }
+
+  std::ofstream large(kBenchmarkFilesPath + "/large");
+  large << std::string(1024 * 1024, 'A');
+}
+
+static void BM_resolve_file_pattern(benchmark::State& state) {
+  size_t files = 0;
+  while (state.KeepRunning()) {
+    std::vector<std::string> results;
+    resolveFilePattern(kBenchmarkFilesPath + "/%/%.conf", results);
+    files = results.size();
+  }
+  state.SetItemsProcessed(state.iterations() * files);
+}
+
+BENCHMARK(BM_resolve_file_pattern);
+
+/// Hash the file, or with an argument of 1 reuse the hash from the cache.
+static void BM_hash_from_file(benchmark::State& state) {
+  auto hash_cache = FLAGS_hash_cache;
+  FLAGS_hash_cache = (state.range(0) == 1);
+  auto path = kBenchmarkFilesPath + "/large";
+  while (state.KeepRunning()) {
+    auto hash = hashFromFile(HASH_TYPE_SHA256, path);
+    benchmark::DoNotOptimize(hash);
+  }
+  FLAGS_hash_cache = hash_cache;
+  state.SetBytesProcessed(state.iterations() * 1024 * 1024);
+}
+
+BENCHMARK(BM_hash_from_file)->Arg(0)->Arg(1);
+}
+
+int main(int argc, char* argv[]) {
+  benchmark::Initialize(&argc, argv);
+  osquery::FLAGS_db_path = osquery::kBenchmarkDBPath;
+  osquery::createBenchmarkFiles();
+  benchmark::RunSpecifiedBenchmarks();
+  fs::remove_all(osquery::kBenchmarkFilesPath);
+  return 0;
+}
@@ -9,9 +9,11 @@
  */
 
 
+#include <algorithm>
 #include <fstream>
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 
@@ -19,12 +21,15 @@
 #include <boost/property_tree/ptree.hpp>
 
 #include <osquery/filesystem.h>
+#include <osquery/flags.h>
 #include <osquery/logger.h>
 
 namespace pt = boost::property_tree;
 
 namespace osquery {
 
+DECLARE_bool(disable_memory);
+
 const std::string kFakeDirectory = "/tmp/osquery-fstests-pattern";
 const std::string kFakeFile = "/tmp/osquery-fstests-pattern/file0";
 const std::string kFakeSubFile = "/tmp/osquery-fstests-pattern/1/file1";
@@ -89,12 +94,94 @@ TEST_F(FilesystemTests, test_wildcard_full_recursion) {
             files.end());
 }
 
+TEST_F(FilesystemTests, test_wildcard_glob) {
+  std::vector<std::string> files;
+  auto status = resolveFilePattern(kFakeDirectory + "/%/fi*1", files);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(files, std::vector<std::string>({kFakeSubFile}));
+
+  // Globs only match within a name.
+  files.clear();
+  status = resolveFilePattern(kFakeDirectory + "/%file2", files);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(files.size(), 0U);
+}
+
+TEST_F(FilesystemTests, test_wildcard_patterns) {
+  std::vector<std::string> files;
+  auto status = resolveFilePatterns(
+      {kFakeDirectory + "/%", kFakeDirectory + "/1/%%", kFakeDirectory + "/1"},
+      files);
+  EXPECT_TRUE(status.ok());
+  std::sort(files.begin(), files.end());
+  std::vector<std::string> expected = {
+      kFakeSubSubFile, kFakeSubFile, kFakeSubFile, kFakeFile};
+  EXPECT_EQ(files, expected);
+}
+
 TEST_F(FilesystemTests, test_wildcard_invalid_path) {
   std::vector<std::string> files;
   auto status = resolveFilePattern("/foo/bar/%%", files);
   EXPECT_TRUE(status.ok());
   EXPECT_EQ(files.size(), 0);
 }
+
+TEST_F(FilesystemTests, test_like_patterns) {
+  // A trailing '%' matches files and directories at any depth.
+  std::vector<std::string> paths;
+  auto status = resolveLikePatterns({kFakeDirectory + "/%"}, paths);
+  EXPECT_TRUE(status.ok());
+  std::sort(paths.begin(), paths.end());
+  std::vector<std::string> expected = {kFakeDirectory + "/1",
+                                       kFakeDirectory + "/1/2",
+                                       kFakeSubSubFile,
+                                       kFakeSubFile,
+                                       kFakeFile};
+  EXPECT_EQ(paths, expected);
+
+  // Letters are compared ignoring case, as LIKE does.
+  paths.clear();
+  status = resolveLikePatterns({"/TMP/osquery-FSTESTS-pattern/1/FILE%"}, paths);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(paths, std::vector<std::string>({kFakeSubFile}));
+
+  // Patterns that cannot be resolved exactly are not.
+  paths.clear();
+  status = resolveLikePatterns(
+      {kFakeDirectory + "/%/file1", kFakeDirectory + "/file_"}, paths);
+  EXPECT_FALSE(status.ok());
+  EXPECT_EQ(paths.size(), 0U);
+}
+
+TEST_F(FilesystemTests, test_pattern_matcher) {
+  FilePatternMatcher matcher;
+  EXPECT_FALSE(matcher.matches("/etc/hosts"));
+
+  matcher.add("/etc/hosts");
+  matcher.add("/etc/%.conf");
+  matcher.add("/etc/ssh/%");
+  matcher.add("/var/www/%%");
+  matcher.add("/home/*/.ssh/authorized_keys");
+  EXPECT_EQ(matcher.size(), 5U);
+
+  EXPECT_TRUE(matcher.matches("/etc/hosts"));
+  EXPECT_TRUE(matcher.matches("/etc/resolv.conf"));
+  EXPECT_TRUE(matcher.matches("/etc/ssh/sshd_config"));
+  EXPECT_TRUE(matcher.matches("/var/www/html/index.html"));
+  EXPECT_TRUE(matcher.matches("/home/user/.ssh/authorized_keys"));
+
+  // Wildcards and literals match one whole component.
+  EXPECT_FALSE(matcher.matches("/etc"));
+  EXPECT_FALSE(matcher.matches("/etc/hosts.allow"));
+  EXPECT_FALSE(matcher.matches("/etc/ssh/keys/host_key"));
+  EXPECT_FALSE(matcher.matches("/var/www"));
+  EXPECT_FALSE(matcher.matches("/var/www2/index.html"));
+  EXPECT_FALSE(matcher.matches("/home/user/.ssh/known_hosts"));
+
+  matcher.clear();
+  EXPECT_EQ(matcher.size(), 0U);
+  EXPECT_FALSE(matcher.matches("/etc/hosts"));
+}
 // End Recursive Tests
 
 TEST_F(FilesystemTests, test_list_files_in_directory_not_dir) {
@@ -112,6 +199,87 @@ TEST_F(FilesystemTests, test_list_files_in_directorty) {
   EXPECT_NE(std::find(results.begin(), results.end(), "/etc/hosts"),
             results.end());
 }
+
+TEST_F(FilesystemTests, test_filesystem_walker) {
+  // The fake directory's files, subdirectories, and a symlink to a directory.
+  symlink((kFakeDirectory + "/1").c_str(), (kFakeDirectory + "/link").c_str());
+  FilesystemWalkOptions options;
+  options.parallelism = 2;
+
+  std::vector<std::string> paths;
+  std::string path;
+  struct stat info;
+  {
+    FilesystemWalker walker({kFakeDirectory}, options);
+    while (walker.next(path, info)) {
+      paths.push_back(path);
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+
+  // Symlinked directories are returned but not followed.
+  std::vector<std::string> expected = {kFakeDirectory + "/1",
+                                       kFakeDirectory + "/1/2",
+                                       kFakeSubSubFile,
+                                       kFakeSubFile,
+                                       kFakeFile,
+                                       kFakeDirectory + "/link"};
+  EXPECT_EQ(paths, expected);
+
+  // Excluded directories are returned but not read.
+  paths.clear();
+  options.excludes = {kFakeDirectory + "/1/2"};
+  FilesystemWalker walker({kFakeDirectory, "/does/not/exist"}, options);
+  while (walker.next(path, info)) {
+    paths.push_back(path);
+  }
+  EXPECT_EQ(paths.size(), 5U);
+  EXPECT_EQ(std::find(paths.begin(), paths.end(), kFakeSubSubFile),
+            paths.end());
+}
+
+#ifdef __linux__
+TEST_F(FilesystemTests, test_proc_processes) {
+  std::vector<std::string> processes;
+  EXPECT_TRUE(procProcesses(processes).ok());
+  auto self = std::to_string(getpid());
+  EXPECT_NE(std::find(processes.begin(), processes.end(), self),
+            processes.end());
+
+  // The descriptors of a process link to their virtual paths.
+  FILE* fd = fopen(kFakeFile.c_str(), "r");
+  std::map<std::string, std::string> descriptors;
+  EXPECT_TRUE(procDescriptors(self, descriptors).ok());
+  EXPECT_EQ(descriptors[std::to_string(fileno(fd))], kFakeFile);
+  fclose(fd);
+
+  // Only numeric process names are read.
+  EXPECT_FALSE(procDescriptors("self", descriptors).ok());
+}
+
+TEST_F(FilesystemTests, test_proc_socket_inode) {
+  std::string inode;
+  EXPECT_TRUE(procSocketInode("socket:[12345]", inode));
+  EXPECT_EQ(inode, "12345");
+  EXPECT_FALSE(procSocketInode("pipe:[12345]", inode));
+  EXPECT_FALSE(procSocketInode("socket:[]", inode));
+  EXPECT_FALSE(procSocketInode("/tmp/socket:[1]", inode));
+}
+
+TEST_F(FilesystemTests, test_map_raw_mem_limits) {
+  RawMemView view;
+  EXPECT_FALSE(mapRawMem(0xF0000, 0x10001, view).ok());
+  EXPECT_EQ(view, nullptr);
+
+  FLAGS_disable_memory = true;
+  EXPECT_FALSE(mapRawMem(0xF0000, 0x10, view).ok());
+  EXPECT_EQ(view, nullptr);
+  FLAGS_disable_memory = false;
+
+  // Releasing without mapped windows is a no-op.
+  releaseRawMem();
+}
+#endif
 }
 
 int main(int argc, char* argv[]) {
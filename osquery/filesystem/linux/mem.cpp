@@ -13,8 +13,12 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <mutex>
+#include <vector>
+
 #include <osquery/filesystem.h>
 #include <osquery/flags.h>
 #include <osquery/logger.h>
@@ -30,6 +34,37 @@ DEFINE_osquery_flag(bool,
                     false,
                     "Disable physical memory reads.");
 
+/// The most mapped windows of physical memory kept for reuse.
+const size_t kLinuxMaxMemWindows = 8;
+
+/// A page-aligned range of physical memory, mapped or read once.
+struct RawMemWindow {
+  size_t base;
+  size_t length;
+  RawMemView data;
+};
+
+/// Windows in the order they were mapped, the oldest is dropped first.
+struct RawMemWindows {
+  std::vector<RawMemWindow> windows;
+  std::mutex mutex;
+};
+
+static RawMemWindows& getRawMemWindows() {
+  static RawMemWindows windows;
+  return windows;
+}
+
+static size_t getPageSize() {
+#ifdef _SC_PAGESIZE
+  static size_t page_size = sysconf(_SC_PAGESIZE);
+#else
+  // getpagesize() is more or less deprecated.
+  static size_t page_size = getpagesize();
+#endif
+  return page_size;
+}
+
 Status readMem(int fd, size_t base, size_t length, uint8_t* buffer) {
   if (lseek(fd, base, SEEK_SET) == -1) {
     return Status(1, "Cannot seek to physical base");
@@ -38,13 +73,14 @@ Status readMem(int fd, size_t base, size_t length, uint8_t* buffer) {
   // Read from raw memory until an unrecoverable read error or the all of the
   // requested bytes are read.
   size_t total_read = 0;
-  size_t bytes_read = 0;
-  while (total_read != length && bytes_read != 0) {
-    bytes_read = read(fd, buffer + total_read, length - total_read);
+  while (total_read < length) {
+    auto bytes_read = read(fd, buffer + total_read, length - total_read);
     if (bytes_read == -1) {
       if (errno != EINTR) {
         return Status(1, "Cannot read requested length");
       }
+    } else if (bytes_read == 0) {
+      break;
     } else {
       total_read += bytes_read;
     }
@@ -58,8 +94,56 @@ Status readMem(int fd, size_t base, size_t length, uint8_t* buffer) {
   return Status(0, "OK");
 }
 
-Status readRawMem(size_t base, size_t length, void** buffer) {
-  *buffer = 0;
+/// Map the pages containing a range, or read the range if it cannot be mapped.
+static Status mapRawMemWindow(size_t base,
+                              size_t length,
+                              RawMemWindow& window) {
+  auto status = isReadable(kLinuxMemPath);
+  if (!status.ok()) {
+    // For non-su users *hopefully* raw memory is not readable.
+    return status;
+  }
+
+  int fd = open(kLinuxMemPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Status(1, std::string("Cannot open ") + kLinuxMemPath);
+  }
+
+  auto page_size = getPageSize();
+  window.base = base - (base % page_size);
+  window.length =
+      ((base + length - window.base + page_size - 1) / page_size) * page_size;
+  auto map = mmap(0, window.length, PROT_READ, MAP_SHARED, fd, window.base);
+  if (map != MAP_FAILED) {
+    auto map_length = window.length;
+    window.data = RawMemView((const uint8_t*)map,
+                             [map_length](const uint8_t* data) {
+      if (munmap((void*)data, map_length) == -1) {
+        LOG(WARNING) << "Unable to unmap raw memory";
+      }
+    });
+    close(fd);
+    return Status(0, "OK");
+  }
+
+  // Fallback to a lseek/read of only the requested range.
+  auto buffer = (uint8_t*)malloc(length);
+  if (buffer == nullptr || !readMem(fd, base, length, buffer).ok()) {
+    free(buffer);
+    close(fd);
+    return Status(1, "Cannot memory map or seek/read memory");
+  }
+  window.base = base;
+  window.length = length;
+  window.data = RawMemView(buffer, [](const uint8_t* data) {
+    free((void*)data);
+  });
+  close(fd);
+  return Status(0, "OK");
+}
+
+Status mapRawMem(size_t base, size_t length, RawMemView& view) {
+  view.reset();
 
   if (FLAGS_disable_memory) {
     return Status(1, "Configuration has disabled physical memory reads");
@@ -69,47 +153,57 @@ Status readRawMem(size_t base, size_t length, void** buffer) {
     return Status(1, "Cowardly refusing to read a large number of bytes");
   }
 
-  auto status = isReadable(kLinuxMemPath);
+  auto& windows = getRawMemWindows();
+  {
+    std::lock_guard<std::mutex> lock(windows.mutex);
+    for (const auto& window : windows.windows) {
+      if (base >= window.base &&
+          base + length <= window.base + window.length) {
+        view = RawMemView(window.data, window.data.get() + base - window.base);
+        return Status(0, "OK");
+      }
+    }
+  }
+
+  RawMemWindow window;
+  auto status = mapRawMemWindow(base, length, window);
   if (!status.ok()) {
-    // For non-su users *hopefully* raw memory is not readable.
     return status;
   }
 
-  int fd = open(kLinuxMemPath.c_str(), O_RDONLY);
-  if (fd < 0) {
-    return Status(1, std::string("Cannot open ") + kLinuxMemPath);
+  view = RawMemView(window.data, window.data.get() + base - window.base);
+  std::lock_guard<std::mutex> lock(windows.mutex);
+  if (windows.windows.size() >= kLinuxMaxMemWindows) {
+    // Views of a dropped window keep it mapped until they are released.
+    windows.windows.erase(windows.windows.begin());
   }
+  windows.windows.push_back(std::move(window));
+  return Status(0, "OK");
+}
 
-  if ((*buffer = malloc(length)) == nullptr) {
-    close(fd);
-    return Status(1, "Cannot allocate memory for read");
+void releaseRawMem() {
+  std::vector<RawMemWindow> released;
+  {
+    auto& windows = getRawMemWindows();
+    std::lock_guard<std::mutex> lock(windows.mutex);
+    released.swap(windows.windows);
   }
+  // The windows are unmapped outside the lock, as their last views release.
+}
 
-#ifdef _SC_PAGESIZE
-  size_t offset = base % sysconf(_SC_PAGESIZE);
-#else
-  // getpagesize() is more or less deprecated.
-  size_t offset = base % getpagesize();
-#endif
+Status readRawMem(size_t base, size_t length, void** buffer) {
+  *buffer = 0;
 
-  // Use memmap for maximum portability over read().
-  auto map = mmap(0, offset + length, PROT_READ, MAP_SHARED, fd, base - offset);
-  if (map == MAP_FAILED) {
-    // Could fallback to a lseek/read.
-    if (!readMem(fd, base, length, (uint8_t*)*buffer).ok()) {
-      close(fd);
-      free(*buffer);
-      return Status(1, "Cannot memory map or seek/read memory");
-    }
-  } else {
-    // Memory map succeeded, copy and unmap.
-    memcpy(*buffer, (uint8_t*)map + offset, length);
-    if (munmap(map, offset + length) == -1) {
-      LOG(WARNING) << "Unable to unmap raw memory";
-    }
+  RawMemView view;
+  auto status = mapRawMem(base, length, view);
+  if (!status.ok()) {
+    return status;
   }
 
-  close(fd);
+  if ((*buffer = malloc(length)) == nullptr) {
+    return Status(1, "Cannot allocate memory for read");
+  }
+  memcpy(*buffer, view.get(), length);
   return Status(0, "OK");
 }
 }
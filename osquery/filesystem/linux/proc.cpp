@@ -8,15 +8,15 @@
  *
  */
 
-#include <exception>
 #include <map>
 #include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
-#include <boost/regex.hpp>
-#include <boost/filesystem.hpp>
-
 #include <osquery/filesystem.h>
 #include <osquery/logger.h>
 
@@ -24,46 +24,117 @@ namespace osquery {
 
 const std::string kLinuxProcPath = "/proc";
 
-Status procProcesses(std::vector<std::string>& processes) {
-  boost::regex process_filter("\\d+");
-
-  // Iterate over each process-like directory in proc.
-  boost::filesystem::directory_iterator it(kLinuxProcPath), end;
-  try {
-    for (; it != end; ++it) {
-      if (boost::filesystem::is_directory(it->status())) {
-        boost::smatch what;
-        if (boost::regex_match(
-                it->path().leaf().string(), what, process_filter)) {
-          processes.push_back(it->path().leaf().string());
-        }
+/// The size of the stack buffer used for each getdents64 call.
+#define PROC_DIRENT_BUFFER_SIZE (32 * 1024)
+
+/// The record layout returned by getdents64, libc does not declare it.
+struct ProcDirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/// Check that a NULL-terminated name is a non-empty string of digits.
+static bool isNumericName(const char* name) {
+  if (*name == '\0') {
+    return false;
+  }
+
+  for (; *name != '\0'; ++name) {
+    if (*name < '0' || *name > '9') {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Call a callback for each numeric entry of an open directory.
+ *
+ * Entries are read with getdents64 into a stack buffer, without the
+ * allocations of readdir or a directory_iterator.
+ *
+ * @param dir An open directory descriptor.
+ * @param callback Called with each entry's name and type, stops if false.
+ * @return false if the directory could not be read.
+ */
+template <typename F>
+static bool procNumericEntries(int dir, F callback) {
+  char buffer[PROC_DIRENT_BUFFER_SIZE];
+  while (true) {
+    auto size = ::syscall(SYS_getdents64, dir, buffer, sizeof(buffer));
+    if (size == 0) {
+      return true;
+    } else if (size < 0) {
+      return false;
+    }
+
+    for (long offset = 0; offset < size;) {
+      auto entry = reinterpret_cast<struct ProcDirent64*>(buffer + offset);
+      offset += entry->d_reclen;
+      if (isNumericName(entry->d_name) &&
+          !callback(entry->d_name, entry->d_type)) {
+        return true;
       }
     }
-  } catch (boost::filesystem::filesystem_error& e) {
-    VLOG(1) << "Exception iterating Linux processes " << e.what();
-    return Status(1, e.what());
+  }
+}
+
+Status procProcesses(std::vector<std::string>& processes) {
+  int proc = ::open(kLinuxProcPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (proc == -1) {
+    VLOG(1) << "Cannot open " << kLinuxProcPath;
+    return Status(1, "Cannot open " + kLinuxProcPath);
   }
 
+  // Each process is a numeric directory.
+  auto add = [&processes](const char* name, int type) {
+    if (type == DT_DIR || type == DT_UNKNOWN) {
+      processes.push_back(name);
+    }
+    return true;
+  };
+  bool read = procNumericEntries(proc, add);
+  ::close(proc);
+
+  if (!read) {
+    return Status(1, "Cannot read " + kLinuxProcPath);
+  }
   return Status(0, "OK");
 }
 
 Status procDescriptors(const std::string& process,
                        std::map<std::string, std::string>& descriptors) {
+  if (!isNumericName(process.c_str())) {
+    // Process constraints from a query may name anything.
+    return Status(1, "Not a process: " + process);
+  }
+
+  // Access to the process' /fd may be restricted.
   auto descriptors_path = kLinuxProcPath + "/" + process + "/fd";
-  try {
-    // Access to the process' /fd may be restricted.
-    boost::filesystem::directory_iterator it(descriptors_path), end;
-    for (; it != end; ++it) {
-      auto fd = it->path().leaf().string();
-      std::string linkname;
-      if (procReadDescriptor(process, fd, linkname).ok()) {
-        descriptors[fd] = linkname;
-      }
-    }
-  } catch (boost::filesystem::filesystem_error& e) {
+  int dir =
+      ::open(descriptors_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir == -1) {
     return Status(1, "Cannot access descriptors for " + process);
   }
 
+  // Links are read relative to the open fd directory into a stack buffer.
+  char link[PATH_MAX];
+  auto add = [dir, &link, &descriptors](const char* name, int) {
+    auto size = ::readlinkat(dir, name, link, sizeof(link));
+    if (size >= 0) {
+      descriptors[name] = std::string(link, size);
+    }
+    return true;
+  };
+  bool read = procNumericEntries(dir, add);
+  ::close(dir);
+
+  if (!read) {
+    return Status(1, "Cannot access descriptors for " + process);
+  }
   return Status(0, "OK");
 }
 
@@ -71,20 +142,24 @@ Status procReadDescriptor(const std::string& process,
                           const std::string& descriptor,
                           std::string& result) {
   auto link = kLinuxProcPath + "/" + process + "/fd/" + descriptor;
-  auto path_max = pathconf(link.c_str(), _PC_PATH_MAX);
-  auto result_path = (char*)malloc(path_max);
-
-  memset(result_path, 0, path_max);
-  auto size = readlink(link.c_str(), result_path, path_max);
-  if (size >= 0) {
-    result = std::string(result_path);
+  char result_path[PATH_MAX];
+  auto size = ::readlink(link.c_str(), result_path, sizeof(result_path));
+  if (size < 0) {
+    return Status(1, "Could not read path");
   }
 
-  free(result_path);
-  if (size >= 0) {
-    return Status(0, "OK");
-  } else {
-    return Status(1, "Could not read path");
+  result = std::string(result_path, size);
+  return Status(0, "OK");
+}
+
+bool procSocketInode(const std::string& link, std::string& inode) {
+  // Socket descriptors link to "socket:[<inode>]".
+  if (link.size() < 10 || link.compare(0, 8, "socket:[") != 0 ||
+      link.back() != ']') {
+    return false;
   }
+
+  inode = link.substr(8, link.size() - 9);
+  return isNumericName(inode.c_str());
 }
 }
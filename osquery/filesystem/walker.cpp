@@ -0,0 +1,256 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <osquery/core.h>
+#include <osquery/dispatcher.h>
+#include <osquery/filesystem.h>
+#include <osquery/flags.h>
+
+namespace osquery {
+
+DEFINE_osquery_flag(int32,
+                    walk_parallelism,
+                    4,
+                    "Directories read concurrently by filesystem walks.");
+
+DEFINE_osquery_flag(string,
+                    walk_exclude_paths,
+                    "/proc,/sys,/dev",
+                    "Comma-separated paths filesystem walks skip.");
+
+/// Workers stop reading directories while this many entries are queued.
+const size_t kWalkMaxEntries = 4096;
+
+/// A directory to read, and the device of the root it was found below.
+typedef std::pair<std::string, dev_t> WalkDirectory;
+
+/// An entry read from a directory.
+typedef std::pair<std::string, struct stat> WalkEntry;
+
+struct FilesystemWalkState {
+  FilesystemWalkOptions options;
+  std::set<std::string> excludes;
+
+  std::mutex mutex;
+  /// Signaled when entries or directories are queued, or a read finishes.
+  std::condition_variable changed;
+  /// Directories waiting to be read.
+  std::deque<WalkDirectory> directories;
+  /// Entries read and waiting to be returned by the walker.
+  std::deque<WalkEntry> entries;
+  /// The number of directories being read.
+  size_t reading;
+  /// The number of scheduled workers.
+  size_t workers;
+  /// Set when the walker is destroyed, workers stop.
+  bool stopped;
+
+  FilesystemWalkState() : reading(0), workers(0), stopped(false) {}
+};
+
+FilesystemWalkOptions::FilesystemWalkOptions() : same_device(true) {
+  parallelism = std::max(FLAGS_walk_parallelism, 1);
+  for (const auto& path : split(FLAGS_walk_exclude_paths, ",")) {
+    excludes.push_back(path);
+  }
+}
+
+/**
+ * @brief Call a callback with the name of each directory entry.
+ *
+ * Linux entries are read with getdents64 into a stack buffer, otherwise the
+ * descriptor is read with readdir.
+ */
+template <typename F>
+static void readEntries(int dir, F callback) {
+#ifdef __linux__
+  struct WalkDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+
+  char buffer[32 * 1024];
+  long size = 0;
+  while ((size = ::syscall(SYS_getdents64, dir, buffer, sizeof(buffer))) > 0) {
+    for (long offset = 0; offset < size;) {
+      auto entry = reinterpret_cast<struct WalkDirent64*>(buffer + offset);
+      offset += entry->d_reclen;
+      callback(entry->d_name);
+    }
+  }
+#else
+  auto listing = ::fdopendir(::dup(dir));
+  if (listing == nullptr) {
+    return;
+  }
+
+  struct dirent* entry = nullptr;
+  while ((entry = ::readdir(listing)) != nullptr) {
+    callback(entry->d_name);
+  }
+  ::closedir(listing);
+#endif
+}
+
+/// Read a directory, queueing its entries and subdirectories.
+static void readDirectory(FilesystemWalkState& state,
+                          const WalkDirectory& directory) {
+  std::vector<WalkEntry> entries;
+  std::vector<WalkDirectory> directories;
+
+  // Only roots may be symlinks, subdirectories were lstat'd.
+  int dir =
+      ::open(directory.first.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir != -1) {
+    // Entries are stat'd relative to the open directory, without following.
+    auto prefix = directory.first;
+    if (prefix.empty() || prefix.back() != '/') {
+      prefix += '/';
+    }
+
+    auto add = [&](const char* name) {
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return;
+      }
+
+      struct stat info;
+      if (::fstatat(dir, name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+        return;
+      }
+
+      entries.push_back(WalkEntry(prefix + name, info));
+      if (S_ISDIR(info.st_mode) &&
+          (!state.options.same_device || info.st_dev == directory.second) &&
+          state.excludes.count(entries.back().first) == 0) {
+        directories.push_back(WalkDirectory(entries.back().first,
+                                            directory.second));
+      }
+    };
+    readEntries(dir, add);
+    ::close(dir);
+  }
+
+  std::lock_guard<std::mutex> lock(state.mutex);
+  for (auto& entry : entries) {
+    state.entries.push_back(std::move(entry));
+  }
+  for (auto& subdirectory : directories) {
+    state.directories.push_back(std::move(subdirectory));
+  }
+  state.reading--;
+  state.changed.notify_all();
+}
+
+/// A Dispatcher worker reading directories ahead of the walker.
+class FilesystemWalkTask : public apache::thrift::concurrency::Runnable {
+ public:
+  explicit FilesystemWalkTask(
+      const std::shared_ptr<FilesystemWalkState>& state)
+      : state_(state) {}
+
+  void run() {
+    auto& state = *state_;
+    std::unique_lock<std::mutex> lock(state.mutex);
+    while (!state.stopped && !state.directories.empty() &&
+           state.entries.size() < kWalkMaxEntries) {
+      auto directory = std::move(state.directories.front());
+      state.directories.pop_front();
+      state.reading++;
+      lock.unlock();
+      readDirectory(state, directory);
+      lock.lock();
+    }
+    state.workers--;
+  }
+
+ private:
+  std::shared_ptr<FilesystemWalkState> state_;
+};
+
+/// Schedule workers if directories are waiting, the state must be locked.
+static void scheduleWorkers(
+    const std::shared_ptr<FilesystemWalkState>& state) {
+  // The walker itself is one of the readers.
+  while (state->workers + 1 < state->options.parallelism &&
+         state->directories.size() > state->workers &&
+         state->entries.size() < kWalkMaxEntries / 2) {
+    state->workers++;
+    Dispatcher::getInstance().add(
+        std::make_shared<FilesystemWalkTask>(state));
+  }
+}
+
+FilesystemWalker::FilesystemWalker(const std::vector<std::string>& roots,
+                                   const FilesystemWalkOptions& options)
+    : state_(std::make_shared<FilesystemWalkState>()) {
+  state_->options = options;
+  for (const auto& path : options.excludes) {
+    state_->excludes.insert(path);
+  }
+
+  // Roots are followed if they are symlinks.
+  for (const auto& root : roots) {
+    struct stat info;
+    if (state_->excludes.count(root) == 0 &&
+        ::stat(root.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+      state_->directories.push_back(WalkDirectory(root, info.st_dev));
+    }
+  }
+}
+
+FilesystemWalker::~FilesystemWalker() {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  state_->stopped = true;
+}
+
+bool FilesystemWalker::next(std::string& path, struct stat& info) {
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  while (true) {
+    scheduleWorkers(state_);
+    if (!state_->entries.empty()) {
+      path = std::move(state_->entries.front().first);
+      info = state_->entries.front().second;
+      state_->entries.pop_front();
+      return true;
+    }
+
+    if (!state_->directories.empty()) {
+      // Read a directory rather than wait for a worker.
+      auto directory = std::move(state_->directories.front());
+      state_->directories.pop_front();
+      state_->reading++;
+      lock.unlock();
+      readDirectory(*state_, directory);
+      lock.lock();
+    } else if (state_->reading > 0) {
+      state_->changed.wait(lock);
+    } else {
+      return false;
+    }
+  }
+}
+}
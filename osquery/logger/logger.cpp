@@ -9,36 +9,750 @@
  */
 
 #include <algorithm>
+#include <chrono>
+#include <ctime>
 #include <thread>
 
+#include <osquery/core.h>
+#include <osquery/database/db_handle.h>
 #include <osquery/flags.h>
 #include <osquery/logger.h>
+#include <osquery/scheduler.h>
+
+#include "osquery/scheduler/pipeline.h"
 
 namespace osquery {
 
-/// `log_receiver` defines the default log receiver plugin name.
+/// `log_receiver` defines the default log receiver plugin names.
 DEFINE_osquery_flag(string,
                     log_receiver,
                     "filesystem",
-                    "The upstream log receiver to log messages to.");
+                    "Comma-separated upstream log receivers");
+
+DEFINE_osquery_flag(int32,
+                    logger_queue_size,
+                    1024,
+                    "Strings queued for each receiver, 0 logs inline");
+
+DEFINE_osquery_flag(string,
+                    logger_queue_policy,
+                    "block",
+                    "Action of a full receiver queue: block or drop");
+
+DEFINE_osquery_flag(int32,
+                    logger_spool_size,
+                    16 * 1024 * 1024,
+                    "Bytes of failed strings spooled for each receiver");
+
+DEFINE_osquery_flag(int32,
+                    logger_spool_retry,
+                    10,
+                    "Seconds between retries of spooled strings");
+
+DEFINE_osquery_flag(string,
+                    logger_status_receiver,
+                    "",
+                    "Comma-separated receivers of status logs");
+
+DEFINE_osquery_flag(int32,
+                    logger_status_level,
+                    0,
+                    "Least severity of forwarded status logs");
+
+DEFINE_osquery_flag(int32,
+                    logger_status_rate,
+                    10,
+                    "Status logs forwarded per call site each second");
+
+/// The most spooled strings sent by one retry.
+const size_t kLoggerSpoolBatch = 256;
+
+/// The width of a spooled string's zero-padded sequence number.
+const size_t kLoggerSpoolDigits = 20;
+
+/// The most call sites a status log sink tracks rate limits for.
+const size_t kStatusLogMaxSites = 1024;
 
 DEFINE_osquery_flag(bool,
                     log_result_events,
                     true,
                     "Log scheduled results as events.");
 
+DEFINE_osquery_flag(int32,
+                    log_result_events_batch,
+                    65536,
+                    "Bytes of result events in each logger call");
+
+DEFINE_osquery_flag(string,
+                    log_result_format,
+                    "json",
+                    "Format of logged results: json or frames");
+
+DEFINE_osquery_flag(bool,
+                    log_result_compress,
+                    false,
+                    "Compress large framed results with zlib");
+
 Status LoggerPlugin::call(const PluginRequest& request,
                           PluginResponse& response) {
   if (request.count("string") == 0) {
     return Status(1, "Logger plugins only support a request string");
   }
 
-  this->logString(request.at("string"));
+  return this->logString(request.at("string"));
+}
+
+Status LoggerPlugin::logStringBatch(const std::vector<std::string>& strings) {
+  Status result(0, "OK");
+  for (const auto& s : strings) {
+    auto status = logString(s);
+    if (!status.ok()) {
+      result = status;
+    }
+  }
+  return result;
+}
+
+LoggerSpool::LoggerSpool(const std::string& name, size_t size)
+    : name_(name), size_(size), head_(0), bytes_(0), evicted_(0) {}
+
+std::string LoggerSpool::getKey(size_t sequence) const {
+  auto number = std::to_string(sequence);
+  if (number.size() < kLoggerSpoolDigits) {
+    number.insert(0, kLoggerSpoolDigits - number.size(), '0');
+  }
+  return name_ + "." + number;
+}
+
+void LoggerSpool::recover() {
+  std::map<size_t, size_t> spooled;
+  auto prefix = name_ + ".";
+  DBHandle::getInstance()->Scan(
+      kLogs,
+      prefix,
+      [&prefix, &spooled](const rocksdb::Slice& key,
+                          const rocksdb::Slice& value) {
+        // Skip the keys of receivers named with this receiver's prefix.
+        auto number = key.ToString().substr(prefix.size());
+        if (number.size() == kLoggerSpoolDigits &&
+            number.find_first_not_of("0123456789") == std::string::npos) {
+          spooled[std::stoull(number)] = value.size();
+        }
+        return true;
+      });
+
+  sizes_.clear();
+  bytes_ = 0;
+  if (spooled.empty()) {
+    head_ = 0;
+    return;
+  }
+
+  // Missing sequence numbers are kept as empty strings, retry skips them.
+  head_ = spooled.begin()->first;
+  for (size_t i = head_; i <= spooled.rbegin()->first; ++i) {
+    auto it = spooled.find(i);
+    sizes_.push_back((it != spooled.end()) ? it->second : 0);
+    bytes_ += sizes_.back();
+  }
+}
+
+Status LoggerSpool::add(const std::string& s) {
+  if (s.size() > size_) {
+    evicted_++;
+    return Status(1, "String is larger than the spool");
+  }
+
+  // Remove the oldest strings, in the same write, until the string fits.
+  DBBatch batch;
+  size_t evict = 0;
+  size_t freed = 0;
+  while (evict < sizes_.size() && bytes_ - freed + s.size() > size_) {
+    batch.Delete(kLogs, getKey(head_ + evict));
+    freed += sizes_[evict++];
+  }
+  batch.Put(kLogs, getKey(head_ + sizes_.size()), s);
+
+  auto status = DBHandle::getInstance()->Write(batch);
+  if (!status.ok()) {
+    return status;
+  }
+
+  sizes_.erase(sizes_.begin(), sizes_.begin() + evict);
+  head_ += evict;
+  bytes_ -= freed;
+  evicted_ += evict;
+  sizes_.push_back(s.size());
+  bytes_ += s.size();
+  return Status(0, "OK");
+}
+
+size_t LoggerSpool::retry(const Sender& sender, size_t batch) {
+  if (sizes_.empty()) {
+    return 0;
+  }
+
+  std::vector<std::pair<size_t, std::string> > strings;
+  auto db = DBHandle::getInstance();
+  auto prefix = name_ + ".";
+  db->ScanRange(kLogs,
+                getKey(head_),
+                getKey(head_ + sizes_.size()),
+                [&prefix, &strings, batch](const rocksdb::Slice& key,
+                                           const rocksdb::Slice& value) {
+                  auto number = key.ToString().substr(prefix.size());
+                  strings.push_back(
+                      std::make_pair(std::stoull(number), value.ToString()));
+                  return (strings.size() < batch);
+                });
+
+  size_t sent = 0;
+  for (const auto& s : strings) {
+    if (!sender(s.second).ok()) {
+      break;
+    }
+    sent++;
+  }
+
+  // Sent strings, and any missing before them, are removed.
+  auto end = (sent == strings.size() && strings.size() < batch)
+                 ? head_ + sizes_.size()
+                 : ((sent > 0) ? strings[sent - 1].first + 1 : head_);
+  if (end == head_) {
+    return 0;
+  }
+
+  DBBatch removed;
+  for (size_t i = 0; i < sent; ++i) {
+    removed.Delete(kLogs, getKey(strings[i].first));
+  }
+  auto status = db->Write(removed);
+  if (!status.ok()) {
+    // The strings are sent again by the next retry.
+    VLOG(1) << "Cannot remove spooled strings: " << status.toString();
+    return 0;
+  }
+
+  for (; head_ < end; ++head_) {
+    bytes_ -= sizes_.front();
+    sizes_.pop_front();
+  }
+  return sent;
+}
+
+/// A logger plugin that is called directly, nullptr for an extension's.
+static std::shared_ptr<LoggerPlugin> getLocalLoggerPlugin(
+    const std::string& name) {
+  if (!Registry::exists("logger", name)) {
+    return nullptr;
+  }
+  return std::dynamic_pointer_cast<LoggerPlugin>(Registry::get("logger", name));
+}
+
+LoggerReceiver::LoggerReceiver(const std::string& name,
+                               size_t capacity,
+                               bool block,
+                               size_t spool)
+    : name_(name),
+      block_(block),
+      sent_(0),
+      dropped_(0),
+      failures_(0),
+      calls_(0),
+      call_time_(0),
+      spooled_(0),
+      evicted_(0),
+      frames_(new LogItemFrameEncoder(FLAGS_log_result_compress)),
+      streams_(0) {
+  if (spool > 0) {
+    // Strings spooled by a previous run are retried first.
+    spool_.reset(new LoggerSpool(name, spool));
+    spool_->recover();
+    spooled_ = spool_->count();
+    next_retry_ = std::chrono::steady_clock::now();
+  }
+
+  if (capacity > 0) {
+    queue_.reset(new BoundedQueue<std::string>(capacity));
+    worker_ = std::thread(&LoggerReceiver::run, this);
+  }
+}
+
+LoggerReceiver::~LoggerReceiver() { stop(); }
+
+Status LoggerReceiver::add(std::string s) {
+  if (queue_ == nullptr) {
+    return deliver(s);
+  }
+
+  auto queued =
+      (block_) ? queue_->push(std::move(s)) : queue_->tryPush(std::move(s));
+  if (!queued) {
+    dropped_++;
+    return Status(1, "Logger receiver " + name_ + " dropped a string");
+  }
   return Status(0, "OK");
 }
 
+Status LoggerReceiver::add(std::vector<std::string> strings) {
+  if (queue_ == nullptr) {
+    return deliver(strings);
+  }
+
+  Status result(0, "OK");
+  for (auto& s : strings) {
+    auto queued =
+        (block_) ? queue_->push(std::move(s)) : queue_->tryPush(std::move(s));
+    if (!queued) {
+      dropped_++;
+      result = Status(1, "Logger receiver " + name_ + " dropped a string");
+    }
+  }
+  return result;
+}
+
+void LoggerReceiver::stop() {
+  std::call_once(stopped_, [this]() {
+    if (queue_ != nullptr) {
+      queue_->close();
+      worker_.join();
+    }
+  });
+}
+
+const std::string& LoggerReceiver::encode(const std::string& s,
+                                          std::string& frame) {
+  if (!LogItemFrameEncoder::isRecords(s)) {
+    return s;
+  }
+
+  // A reader of a new stream has not seen any dictionary.
+  auto plugin = getLocalLoggerPlugin(name_);
+  auto streams = (plugin != nullptr) ? plugin->getStreams() : 0;
+  if (streams_.exchange(streams) != streams) {
+    frames_->reset();
+  }
+
+  auto status = frames_->encode(s, frame);
+  if (!status.ok()) {
+    VLOG(1) << "Logger receiver " << name_
+            << " cannot encode a frame: " << status.toString();
+    return s;
+  }
+  return frame;
+}
+
+Status LoggerReceiver::send(const std::string& s) {
+  // Local plugins are called without copying the string into a request.
+  auto plugin = getLocalLoggerPlugin(name_);
+  std::string frame;
+  const auto& line = encode(s, frame);
+  auto start = std::chrono::steady_clock::now();
+  auto status = (plugin != nullptr)
+                    ? plugin->logString(line)
+                    : Registry::call("logger", name_, {{"string", line}});
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  calls_++;
+  call_time_ += static_cast<size_t>(elapsed.count());
+  if (status.ok()) {
+    sent_++;
+  } else {
+    // The frame may not have been written, its dictionaries are written again.
+    failures_++;
+    frames_->reset();
+  }
+  return status;
+}
+
+Status LoggerReceiver::send(const std::vector<std::string>& strings) {
+  auto plugin = getLocalLoggerPlugin(name_);
+  if (plugin == nullptr) {
+    // Plugins that are not local, such as an extension's, are called.
+    Status result(0, "OK");
+    for (const auto& s : strings) {
+      auto status = send(s);
+      if (!status.ok()) {
+        result = status;
+      }
+    }
+    return result;
+  }
+
+  // Log frame records are encoded in order, as the plugin writes them.
+  std::vector<std::string> frames;
+  const auto* lines = &strings;
+  if (std::any_of(strings.begin(),
+                  strings.end(),
+                  LogItemFrameEncoder::isRecords)) {
+    frames.reserve(strings.size());
+    for (const auto& s : strings) {
+      std::string frame;
+      frames.push_back(encode(s, frame));
+    }
+    lines = &frames;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto status = plugin->logStringBatch(*lines);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  calls_++;
+  call_time_ += static_cast<size_t>(elapsed.count());
+  if (status.ok()) {
+    sent_ += strings.size();
+  } else {
+    failures_ += strings.size();
+    frames_->reset();
+  }
+  return status;
+}
+
+Status LoggerReceiver::deliver(const std::vector<std::string>& strings) {
+  if (spool_ == nullptr) {
+    return send(strings);
+  }
+
+  retrySpool();
+  {
+    std::lock_guard<std::mutex> lock(spool_mutex_);
+    if (spool_->count() > 0) {
+      Status result(0, "OK");
+      for (const auto& s : strings) {
+        auto status = spool_->add(s);
+        if (!status.ok()) {
+          result = status;
+        }
+      }
+      spooled_ = spool_->count();
+      evicted_ = spool_->evicted();
+      return result;
+    }
+  }
+
+  auto status = send(strings);
+  if (!status.ok()) {
+    std::lock_guard<std::mutex> lock(spool_mutex_);
+    for (const auto& s : strings) {
+      spool_->add(s);
+    }
+    next_retry_ = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(FLAGS_logger_spool_retry);
+    spooled_ = spool_->count();
+    evicted_ = spool_->evicted();
+  }
+  return status;
+}
+
+Status LoggerReceiver::deliver(const std::string& s) {
+  if (spool_ == nullptr) {
+    return send(s);
+  }
+
+  retrySpool();
+  {
+    // Strings are not sent ahead of the strings spooled before them.
+    std::lock_guard<std::mutex> lock(spool_mutex_);
+    if (spool_->count() > 0) {
+      auto status = spool_->add(s);
+      spooled_ = spool_->count();
+      evicted_ = spool_->evicted();
+      return status;
+    }
+  }
+
+  auto status = send(s);
+  if (!status.ok()) {
+    std::lock_guard<std::mutex> lock(spool_mutex_);
+    if (spool_->add(s).ok()) {
+      next_retry_ = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(FLAGS_logger_spool_retry);
+    }
+    spooled_ = spool_->count();
+    evicted_ = spool_->evicted();
+  }
+  return status;
+}
+
+void LoggerReceiver::retrySpool() {
+  std::lock_guard<std::mutex> lock(spool_mutex_);
+  auto now = std::chrono::steady_clock::now();
+  if (spool_->count() == 0 || now < next_retry_) {
+    return;
+  }
+
+  // Retry batches until one fails, then wait for the retry interval.
+  size_t sent = 0;
+  do {
+    sent = spool_->retry(
+        [this](const std::string& s) { return send(s); }, kLoggerSpoolBatch);
+  } while (sent == kLoggerSpoolBatch);
+  spooled_ = spool_->count();
+
+  if (spool_->count() > 0) {
+    next_retry_ = now + std::chrono::seconds(FLAGS_logger_spool_retry);
+  }
+}
+
+void LoggerReceiver::run() {
+  std::vector<std::string> strings;
+  auto interval = std::chrono::milliseconds(
+      std::max(FLAGS_logger_spool_retry, 1) * 1000);
+  while (true) {
+    bool open;
+    if (spooled_ > 0) {
+      // Wake to retry spooled strings when nothing is logged.
+      open = queue_->popAllFor(strings, interval);
+      if (open && strings.empty()) {
+        retrySpool();
+      }
+    } else {
+      open = queue_->popAll(strings);
+    }
+    if (!open) {
+      break;
+    }
+
+    // Every string waiting is logged with one plugin call.
+    if (!strings.empty()) {
+      auto status = deliver(strings);
+      if (!status.ok()) {
+        VLOG(1) << "Logger receiver " << name_
+                << " failed: " << status.toString();
+      }
+    }
+    strings.clear();
+  }
+}
+
+LoggerReceiverStats LoggerReceiver::getStats() {
+  LoggerReceiverStats stats;
+  stats.sent = sent_;
+  stats.dropped = dropped_;
+  stats.failures = failures_;
+  stats.backlog = (queue_ != nullptr) ? queue_->size() : 0;
+  size_t calls = calls_;
+  stats.latency = (calls > 0) ? call_time_ / calls : 0;
+
+  stats.spooled = spooled_;
+  stats.evicted = evicted_;
+  return stats;
+}
+
+void LoggerDispatcher::setReceivers(const std::string& receivers) {
+  for (auto& receiver : receivers_) {
+    receiver.second->stop();
+  }
+  receivers_.clear();
+  receivers_flag_ = receivers;
+
+  size_t capacity = std::max(FLAGS_logger_queue_size, 0);
+  bool block = (FLAGS_logger_queue_policy != "drop");
+  size_t spool = std::max(FLAGS_logger_spool_size, 0);
+  for (const auto& name : split(receivers, ",")) {
+    if (!Registry::exists("logger", name)) {
+      LOG(ERROR) << "Logger receiver " << name << " not found";
+      continue;
+    }
+    receivers_[name] =
+        std::make_shared<LoggerReceiver>(name, capacity, block, spool);
+  }
+}
+
+std::map<std::string, std::shared_ptr<LoggerReceiver> >
+LoggerDispatcher::getReceivers() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (receivers_flag_ != FLAGS_log_receiver) {
+    setReceivers(FLAGS_log_receiver);
+  }
+  return receivers_;
+}
+
+Status LoggerDispatcher::log(std::string s) {
+  auto receivers = getReceivers();
+  if (receivers.empty()) {
+    return Status(1, "Logger receiver not found");
+  }
+
+  // A blocking receiver is waited on without holding the dispatcher lock.
+  Status result(0, "OK");
+  size_t remaining = receivers.size();
+  for (const auto& receiver : receivers) {
+    auto status = (--remaining > 0) ? receiver.second->add(s)
+                                    : receiver.second->add(std::move(s));
+    if (!status.ok()) {
+      result = status;
+    }
+  }
+  return result;
+}
+
+Status LoggerDispatcher::log(std::vector<std::string> strings) {
+  auto receivers = getReceivers();
+  if (receivers.empty()) {
+    return Status(1, "Logger receiver not found");
+  }
+
+  Status result(0, "OK");
+  size_t remaining = receivers.size();
+  for (const auto& receiver : receivers) {
+    auto status = (--remaining > 0) ? receiver.second->add(strings)
+                                    : receiver.second->add(std::move(strings));
+    if (!status.ok()) {
+      result = status;
+    }
+  }
+  return result;
+}
+
+void LoggerDispatcher::stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& receiver : receivers_) {
+    receiver.second->stop();
+  }
+  receivers_.clear();
+  receivers_flag_.clear();
+}
+
+std::map<std::string, LoggerReceiverStats> LoggerDispatcher::getStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::string, LoggerReceiverStats> stats;
+  for (const auto& receiver : receivers_) {
+    stats[receiver.first] = receiver.second->getStats();
+  }
+  return stats;
+}
+
+StatusLogSink::StatusLogSink(const std::string& receivers,
+                             int severity,
+                             size_t rate)
+    : severity_(severity), rate_(rate) {
+  // Status logs are dropped rather than waiting for a slow receiver.
+  size_t capacity = std::max(FLAGS_logger_queue_size, 1);
+  for (const auto& name : split(receivers, ",")) {
+    if (!Registry::exists("logger", name)) {
+      LOG(ERROR) << "Status logger receiver " << name << " not found";
+      continue;
+    }
+    receivers_[name] = std::make_shared<LoggerReceiver>(name, capacity, false);
+  }
+}
+
+StatusLogSink::~StatusLogSink() { stop(); }
+
+void StatusLogSink::send(google::LogSeverity severity,
+                         const char* full_filename,
+                         const char* base_filename,
+                         int line,
+                         const struct ::tm* tm_time,
+                         const char* message,
+                         size_t message_len) {
+  if (severity < severity_ || receivers_.empty()) {
+    return;
+  }
+
+  size_t suppressed = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    auto key = std::make_pair(full_filename, line);
+    if (sites_.size() >= kStatusLogMaxSites && sites_.count(key) == 0) {
+      // Windows that expired with nothing suppressed hold no state.
+      for (auto it = sites_.begin(); it != sites_.end();) {
+        if (it->second.suppressed == 0 &&
+            now - it->second.start >= std::chrono::seconds(1)) {
+          it = sites_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      if (sites_.size() >= kStatusLogMaxSites) {
+        sites_.clear();
+      }
+    }
+    auto& site = sites_[key];
+    if (site.count == 0 || now - site.start >= std::chrono::seconds(1)) {
+      site.start = now;
+      site.count = 0;
+    }
+    if (rate_ > 0 && site.count >= rate_) {
+      site.suppressed++;
+      return;
+    }
+    site.count++;
+    suppressed = site.suppressed;
+    site.suppressed = 0;
+  }
+
+  std::string json = "{\"severity\":";
+  appendJSONString(json, std::to_string(severity));
+  json.append(",\"filename\":");
+  appendJSONString(json, base_filename);
+  json.append(",\"line\":");
+  appendJSONString(json, std::to_string(line));
+  json.append(",\"message\":");
+  appendJSONString(json, std::string(message, message_len));
+  json.append(",\"suppressed\":");
+  appendJSONString(json, std::to_string(suppressed));
+  json.append(",\"unixTime\":");
+  appendJSONString(json, std::to_string(std::time(nullptr)));
+  json.append("}\n");
+  for (const auto& receiver : receivers_) {
+    receiver.second->add(json);
+  }
+}
+
+void StatusLogSink::stop() {
+  for (auto& receiver : receivers_) {
+    receiver.second->stop();
+  }
+}
+
+std::map<std::string, LoggerReceiverStats> StatusLogSink::getStats() {
+  std::map<std::string, LoggerReceiverStats> stats;
+  for (const auto& receiver : receivers_) {
+    stats[receiver.first] = receiver.second->getStats();
+  }
+  return stats;
+}
+
+/// The sink added by initStatusLogger.
+static std::unique_ptr<StatusLogSink> kStatusLogSink;
+
+void initStatusLogger() {
+  if (FLAGS_logger_status_receiver.empty() || kStatusLogSink != nullptr) {
+    return;
+  }
+
+  size_t rate = std::max(FLAGS_logger_status_rate, 0);
+  kStatusLogSink.reset(new StatusLogSink(
+      FLAGS_logger_status_receiver, FLAGS_logger_status_level, rate));
+  google::AddLogSink(kStatusLogSink.get());
+}
+
+void shutdownStatusLogger() {
+  if (kStatusLogSink != nullptr) {
+    google::RemoveLogSink(kStatusLogSink.get());
+    kStatusLogSink.reset();
+  }
+}
+
 Status logString(const std::string& s) {
-  return logString(s, FLAGS_log_receiver);
+  return LoggerDispatcher::getInstance().log(s);
+}
+
+Status logString(std::string&& s) {
+  return LoggerDispatcher::getInstance().log(std::move(s));
+}
+
+Status logStringBatch(const std::vector<std::string>& strings) {
+  return LoggerDispatcher::getInstance().log(strings);
+}
+
+Status logStringBatch(std::vector<std::string>&& strings) {
+  return LoggerDispatcher::getInstance().log(std::move(strings));
 }
 
 Status logString(const std::string& s, const std::string& receiver) {
@@ -47,23 +761,69 @@ Status logString(const std::string& s, const std::string& receiver) {
     return Status(1, "Logger receiver not found");
   }
 
-  auto status = Registry::call("logger", receiver, {{"string", s}});
-  return Status(0, "OK");
+  // Strings logged outside a receiver are frames with every dictionary.
+  std::string frame;
+  if (LogItemFrameEncoder::isRecords(s)) {
+    auto status =
+        LogItemFrameEncoder(FLAGS_log_result_compress).encode(s, frame);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  const auto& line = (frame.empty()) ? s : frame;
+
+  auto plugin = getLocalLoggerPlugin(receiver);
+  if (plugin != nullptr) {
+    return plugin->logString(line);
+  }
+  return Registry::call("logger", receiver, {{"string", line}});
 }
 
 Status logScheduledQueryLogItem(const osquery::ScheduledQueryLogItem& results) {
-  return logScheduledQueryLogItem(results, FLAGS_log_receiver);
+  TraceSpan span("logScheduledQueryLogItem", results.name);
+  std::string json;
+  auto status = serializeScheduledQueryLogItemForLogger(results, json);
+  if (!status.ok()) {
+    return status;
+  }
+  return logString(std::move(json));
+}
+
+Status serializeScheduledQueryLogItemForLogger(
+    const osquery::ScheduledQueryLogItem& results, std::string& json) {
+  if (FLAGS_log_result_format == "frames") {
+    // Frames depend on the dictionaries already written to a stream, each
+    // receiver encodes the records for its own.
+    return serializeLogItemFrameRecords(results, json);
+  }
+  if (FLAGS_log_result_events) {
+    return serializeScheduledQueryLogItemAsEventsJSON(results, json);
+  }
+  return serializeScheduledQueryLogItemJSON(results, json);
+}
+
+Status serializeScheduledQueryLogItemForLogger(
+    const osquery::ScheduledQueryLogItem& results,
+    const LogBatchWriter& writer) {
+  if (FLAGS_log_result_format != "frames" && FLAGS_log_result_events) {
+    // Large diffs are not serialized into one string.
+    return serializeScheduledQueryLogItemAsEvents(
+        results, std::max(FLAGS_log_result_events_batch, 1), writer);
+  }
+
+  std::vector<std::string> batch(1);
+  auto status = serializeScheduledQueryLogItemForLogger(results, batch[0]);
+  if (!status.ok()) {
+    return status;
+  }
+  return writer(batch);
 }
 
 Status logScheduledQueryLogItem(const osquery::ScheduledQueryLogItem& results,
                                 const std::string& receiver) {
+  TraceSpan span("logScheduledQueryLogItem", results.name);
   std::string json;
-  Status status;
-  if (FLAGS_log_result_events) {
-    status = serializeScheduledQueryLogItemAsEventsJSON(results, json);
-  } else {
-    status = serializeScheduledQueryLogItemJSON(results, json);
-  }
+  auto status = serializeScheduledQueryLogItemForLogger(results, json);
   if (!status.ok()) {
     return status;
   }
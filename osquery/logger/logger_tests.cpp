@@ -8,16 +8,38 @@
  *
  */
 
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+
 #include <gtest/gtest.h>
 
 #include <osquery/core.h>
+#include <osquery/database/db_handle.h>
+#include <osquery/filesystem.h>
+#include <osquery/flags.h>
 #include <osquery/logger.h>
+#include <osquery/scheduler.h>
+
+#include "osquery/logger/plugins/filesystem.h"
 
 namespace osquery {
 
+DECLARE_string(log_receiver);
+DECLARE_int32(logger_spool_retry);
+
+const std::string kTestLogPath = "/tmp/osquery-loggertests.log";
+const std::string kTestingLoggerDBPath = "/tmp/rocksdb-osquery-loggertests";
+
 class LoggerTests : public testing::Test {
  public:
-  LoggerTests() { Registry::setUp(); }
+  LoggerTests() {
+    DBHandle::getInstanceAtPath(kTestingLoggerDBPath);
+    Registry::setUp();
+  }
 };
 
 class TestLoggerPlugin : public LoggerPlugin {
@@ -29,10 +51,455 @@ class TestLoggerPlugin : public LoggerPlugin {
   virtual ~TestLoggerPlugin() {}
 };
 
+/// Counts logged strings and may wait, as a slow receiver, until released.
+class CountingLoggerPlugin : public LoggerPlugin {
+ public:
+  Status logString(const std::string& s) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    count_++;
+    entered_.notify_all();
+    released_.wait(lock, [this]() { return !hold_; });
+    return Status(0, "OK");
+  }
+
+  /// Make logString wait, or release any waiting call.
+  void hold(bool hold) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hold_ = hold;
+    released_.notify_all();
+  }
+
+  /// Wait until a number of strings were received.
+  void wait(size_t count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    entered_.wait(lock, [this, count]() { return count_ >= count; });
+  }
+
+  size_t count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+  }
+
+ private:
+  size_t count_{0};
+  bool hold_{false};
+  std::mutex mutex_;
+  std::condition_variable entered_;
+  std::condition_variable released_;
+};
+
+/// Records logged strings, or fails to log them as an unreachable receiver.
+class FlakyLoggerPlugin : public LoggerPlugin {
+ public:
+  Status logString(const std::string& s) {
+    if (fail) {
+      return Status(1, "Unreachable");
+    }
+    logged.push_back(s);
+    return Status(0, "OK");
+  }
+
+  bool fail{false};
+  std::vector<std::string> logged;
+};
+
+/// Records the batches it was called with.
+class BatchLoggerPlugin : public LoggerPlugin {
+ public:
+  Status logString(const std::string& s) {
+    batches.push_back({s});
+    return Status(0, "OK");
+  }
+
+  Status logStringBatch(const std::vector<std::string>& strings) {
+    batches.push_back(strings);
+    return Status(0, "OK");
+  }
+
+  std::vector<std::vector<std::string> > batches;
+};
+
 TEST_F(LoggerTests, test_plugin) {
   Registry::add<TestLoggerPlugin>("logger", "test");
   auto s = Registry::call("logger", "test", {{"string", "foobar"}});
   EXPECT_EQ(s.ok(), true);
+
+  // Local plugins are called directly with the logged string.
+  s = logString("foobar", "test");
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(s.toString(), "foobar");
+}
+
+TEST_F(LoggerTests, test_dispatcher_receivers) {
+  Registry::add<CountingLoggerPlugin>("logger", "counting_one");
+  Registry::add<CountingLoggerPlugin>("logger", "counting_two");
+  auto one = std::dynamic_pointer_cast<CountingLoggerPlugin>(
+      Registry::get("logger", "counting_one"));
+  auto two = std::dynamic_pointer_cast<CountingLoggerPlugin>(
+      Registry::get("logger", "counting_two"));
+  ASSERT_NE(one, nullptr);
+  ASSERT_NE(two, nullptr);
+
+  auto receivers = FLAGS_log_receiver;
+  FLAGS_log_receiver = "counting_one, counting_two";
+  EXPECT_TRUE(logString("one").ok());
+  EXPECT_TRUE(logString("two").ok());
+
+  auto stats = LoggerDispatcher::getInstance().getStats();
+  EXPECT_EQ(stats.size(), 2U);
+  EXPECT_EQ(stats.count("counting_one"), 1U);
+
+  // Stopping the dispatcher logs every queued string.
+  LoggerDispatcher::getInstance().stop();
+  EXPECT_EQ(one->count(), 2U);
+  EXPECT_EQ(two->count(), 2U);
+  FLAGS_log_receiver = receivers;
+}
+
+TEST_F(LoggerTests, test_receiver_drop) {
+  Registry::add<CountingLoggerPlugin>("logger", "counting_slow");
+  auto slow = std::dynamic_pointer_cast<CountingLoggerPlugin>(
+      Registry::get("logger", "counting_slow"));
+  ASSERT_NE(slow, nullptr);
+
+  slow->hold(true);
+  LoggerReceiver receiver("counting_slow", 1, false);
+  EXPECT_TRUE(receiver.add("one").ok());
+  slow->wait(1);
+
+  // The receiver's thread is waiting on the plugin, the queue holds one.
+  EXPECT_TRUE(receiver.add("two").ok());
+  EXPECT_FALSE(receiver.add("three").ok());
+  EXPECT_EQ(receiver.getStats().backlog, 1U);
+
+  slow->hold(false);
+  receiver.stop();
+  auto stats = receiver.getStats();
+  EXPECT_EQ(stats.sent, 2U);
+  EXPECT_EQ(stats.dropped, 1U);
+  EXPECT_EQ(stats.failures, 0U);
+  EXPECT_EQ(stats.backlog, 0U);
+}
+
+TEST_F(LoggerTests, test_plugin_batch) {
+  // The default batch calls logString for each string.
+  CountingLoggerPlugin counting;
+  EXPECT_TRUE(counting.logStringBatch({"one", "two", "three"}).ok());
+  EXPECT_EQ(counting.count(), 3U);
+
+  Registry::add<BatchLoggerPlugin>("logger", "batch");
+  auto batch = std::dynamic_pointer_cast<BatchLoggerPlugin>(
+      Registry::get("logger", "batch"));
+  ASSERT_NE(batch, nullptr);
+
+  LoggerReceiver receiver("batch", 0, true);
+  EXPECT_TRUE(receiver.add(std::vector<std::string>{"one", "two"}).ok());
+  EXPECT_TRUE(receiver.add("three").ok());
+  ASSERT_EQ(batch->batches.size(), 2U);
+  EXPECT_EQ(batch->batches[0].size(), 2U);
+  EXPECT_EQ(batch->batches[1][0], "three");
+
+  auto stats = receiver.getStats();
+  EXPECT_EQ(stats.sent, 3U);
+  EXPECT_EQ(stats.failures, 0U);
+}
+
+TEST_F(LoggerTests, test_receiver_spool) {
+  Registry::add<FlakyLoggerPlugin>("logger", "flaky");
+  auto flaky = std::dynamic_pointer_cast<FlakyLoggerPlugin>(
+      Registry::get("logger", "flaky"));
+  ASSERT_NE(flaky, nullptr);
+
+  auto retry = FLAGS_logger_spool_retry;
+  FLAGS_logger_spool_retry = 0;
+  {
+    LoggerReceiver receiver("flaky", 0, true, 1024);
+    flaky->fail = true;
+    EXPECT_FALSE(receiver.add("one").ok());
+    // Later strings are spooled behind the failed string.
+    EXPECT_TRUE(receiver.add("two").ok());
+    EXPECT_EQ(receiver.getStats().spooled, 2U);
+
+    flaky->fail = false;
+    EXPECT_TRUE(receiver.add("three").ok());
+    EXPECT_EQ(receiver.getStats().spooled, 0U);
+    std::vector<std::string> expected = {"one", "two", "three"};
+    EXPECT_EQ(flaky->logged, expected);
+
+    flaky->fail = true;
+    EXPECT_FALSE(receiver.add("four").ok());
+  }
+
+  // A new receiver retries the strings spooled by the previous one.
+  flaky->logged.clear();
+  flaky->fail = false;
+  LoggerReceiver receiver("flaky", 0, true, 1024);
+  EXPECT_EQ(receiver.getStats().spooled, 1U);
+  EXPECT_TRUE(receiver.add("five").ok());
+  std::vector<std::string> expected = {"four", "five"};
+  EXPECT_EQ(flaky->logged, expected);
+  FLAGS_logger_spool_retry = retry;
+}
+
+/// Check if a log frame's payload begins with a dictionary record.
+static bool hasDictionary(const std::string& frame) {
+  // The magic, version and flags are followed by the varint payload length.
+  size_t i = 6;
+  while (i < frame.size() && ((unsigned char)frame[i] & 0x80) != 0) {
+    i++;
+  }
+  return (i + 1 < frame.size() && frame[i + 1] == 'D');
+}
+
+TEST_F(LoggerTests, test_receiver_frames) {
+  Registry::add<FlakyLoggerPlugin>("logger", "frames_one");
+  Registry::add<FlakyLoggerPlugin>("logger", "frames_two");
+  auto one = std::dynamic_pointer_cast<FlakyLoggerPlugin>(
+      Registry::get("logger", "frames_one"));
+  auto two = std::dynamic_pointer_cast<FlakyLoggerPlugin>(
+      Registry::get("logger", "frames_two"));
+  ASSERT_NE(one, nullptr);
+  ASSERT_NE(two, nullptr);
+
+  ScheduledQueryLogItem item;
+  item.name = "frames";
+  item.diffResults.added = {{{"path", "/bin/ls"}}};
+  std::string records;
+  ASSERT_TRUE(serializeLogItemFrameRecords(item, records).ok());
+
+  LoggerReceiver first("frames_one", 0, true);
+  EXPECT_TRUE(first.add(records).ok());
+  EXPECT_TRUE(first.add(records).ok());
+  ASSERT_EQ(one->logged.size(), 2U);
+  EXPECT_EQ(one->logged[0].substr(0, 4), "OSQF");
+  EXPECT_TRUE(hasDictionary(one->logged[0]));
+  EXPECT_FALSE(hasDictionary(one->logged[1]));
+
+  // Each receiver writes the dictionaries its own stream needs.
+  LoggerReceiver second("frames_two", 0, true);
+  EXPECT_TRUE(second.add(records).ok());
+  ASSERT_EQ(two->logged.size(), 1U);
+  EXPECT_TRUE(hasDictionary(two->logged[0]));
+
+  // A frame that failed to log may have held the dictionary.
+  one->fail = true;
+  EXPECT_FALSE(first.add(records).ok());
+  one->fail = false;
+  EXPECT_TRUE(first.add(records).ok());
+  ASSERT_EQ(one->logged.size(), 3U);
+  EXPECT_TRUE(hasDictionary(one->logged[2]));
+}
+
+TEST_F(LoggerTests, test_spool_evict) {
+  LoggerSpool spool("spool_test", 8);
+  spool.recover();
+  EXPECT_TRUE(spool.add("aaaa").ok());
+  EXPECT_TRUE(spool.add("bbbb").ok());
+  EXPECT_TRUE(spool.add("cc").ok());
+  EXPECT_FALSE(spool.add("too large").ok());
+  EXPECT_EQ(spool.count(), 2U);
+  EXPECT_EQ(spool.evicted(), 2U);
+
+  std::vector<std::string> sent;
+  auto sender = [&sent](const std::string& s) {
+    sent.push_back(s);
+    return Status(0, "OK");
+  };
+  EXPECT_EQ(spool.retry(sender, 1), 1U);
+  EXPECT_EQ(spool.retry(sender, 10), 1U);
+  EXPECT_EQ(spool.count(), 0U);
+  std::vector<std::string> expected = {"bbbb", "cc"};
+  EXPECT_EQ(sent, expected);
+}
+
+TEST_F(LoggerTests, test_status_log_sink) {
+  Registry::add<FlakyLoggerPlugin>("logger", "status");
+  auto status = std::dynamic_pointer_cast<FlakyLoggerPlugin>(
+      Registry::get("logger", "status"));
+  ASSERT_NE(status, nullptr);
+
+  StatusLogSink sink("status", google::GLOG_WARNING, 2);
+  const char* file = "/src/osquery/scheduler.cpp";
+  const char* other = "/src/osquery/config.cpp";
+  std::string message = "Executing \"query\"";
+
+  // Logs below the sink's severity are not forwarded.
+  sink.send(google::GLOG_INFO, file, "scheduler.cpp", 1, nullptr, "a", 1);
+
+  // Each call site forwards at most the rate in a second.
+  for (size_t i = 0; i < 5; ++i) {
+    sink.send(google::GLOG_WARNING,
+              file,
+              "scheduler.cpp",
+              10,
+              nullptr,
+              message.data(),
+              message.size());
+  }
+  sink.send(google::GLOG_ERROR, other, "config.cpp", 10, nullptr, "b", 1);
+
+  // The next log of a rate limited call site counts the suppressed logs.
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  sink.send(google::GLOG_WARNING, file, "scheduler.cpp", 10, nullptr, "c", 1);
+  sink.stop();
+
+  ASSERT_EQ(status->logged.size(), 4U);
+  EXPECT_NE(status->logged[0].find("\"suppressed\":\"0\""),
+            std::string::npos);
+  EXPECT_NE(status->logged[3].find("\"suppressed\":\"3\""),
+            std::string::npos);
+  EXPECT_EQ(status->logged[0].find("{\"severity\":\"1\","), 0U);
+  EXPECT_NE(status->logged[0].find("\"filename\":\"scheduler.cpp\""),
+            std::string::npos);
+  EXPECT_NE(status->logged[0].find("\"line\":\"10\""), std::string::npos);
+  auto escaped = "\"message\":\"Executing \\\"query\\\"\"";
+  EXPECT_NE(status->logged[0].find(escaped), std::string::npos);
+  EXPECT_NE(status->logged[2].find("\"filename\":\"config.cpp\""),
+            std::string::npos);
+
+  auto stats = sink.getStats();
+  EXPECT_EQ(stats["status"].sent, 4U);
+  EXPECT_EQ(stats["status"].dropped, 0U);
+}
+
+TEST_F(LoggerTests, test_buffered_log_file) {
+  ::remove(kTestLogPath.c_str());
+  BufferedLogOptions options;
+  options.buffer_size = 8;
+  options.flush_interval = 0;
+
+  std::string content;
+  {
+    BufferedLogFile log(kTestLogPath, options);
+    EXPECT_TRUE(log.write("one\n").ok());
+    // The line is buffered until the buffer is full.
+    EXPECT_FALSE(pathExists(kTestLogPath).ok());
+
+    EXPECT_TRUE(log.write("two\n").ok());
+    EXPECT_TRUE(readFile(kTestLogPath, content).ok());
+    EXPECT_EQ(content, "one\ntwo\n");
+
+    EXPECT_TRUE(log.write("three\n").ok());
+  }
+
+  // Destroying the log writes the remaining lines.
+  EXPECT_TRUE(readFile(kTestLogPath, content).ok());
+  EXPECT_EQ(content, "one\ntwo\nthree\n");
+
+  struct stat info;
+  ASSERT_EQ(::stat(kTestLogPath.c_str(), &info), 0);
+  EXPECT_EQ(info.st_mode & 0777, 0640);
+  ::remove(kTestLogPath.c_str());
+}
+
+TEST_F(LoggerTests, test_buffered_log_file_rotation) {
+  ::remove(kTestLogPath.c_str());
+  auto rotated = kTestLogPath + ".1";
+  ::remove(rotated.c_str());
+
+  BufferedLogOptions options;
+  options.buffer_size = 0;
+  options.flush_interval = 0;
+  BufferedLogFile log(kTestLogPath, options);
+  EXPECT_TRUE(log.write("before\n").ok());
+
+  // An external rotation renames the file, the next write creates it again.
+  ASSERT_EQ(::rename(kTestLogPath.c_str(), rotated.c_str()), 0);
+  EXPECT_TRUE(log.write("after\n").ok());
+
+  std::string content;
+  EXPECT_TRUE(readFile(rotated, content).ok());
+  EXPECT_EQ(content, "before\n");
+  EXPECT_TRUE(readFile(kTestLogPath, content).ok());
+  EXPECT_EQ(content, "after\n");
+  EXPECT_EQ(log.streams(), 1U);
+
+  ::remove(kTestLogPath.c_str());
+  ::remove(rotated.c_str());
+}
+
+TEST_F(LoggerTests, test_buffered_log_file_streams) {
+  ::remove(kTestLogPath.c_str());
+  auto rotated = kTestLogPath + ".1";
+  ::remove(rotated.c_str());
+
+  BufferedLogOptions options;
+  options.buffer_size = 1024;
+  options.flush_interval = 0;
+  BufferedLogFile log(kTestLogPath, options);
+  EXPECT_TRUE(log.write("first\n").ok());
+  EXPECT_TRUE(log.flush().ok());
+  EXPECT_TRUE(log.write("buffered\n").ok());
+
+  // Checking the stream finds the rotation before the next line is encoded,
+  // the buffered line ends the previous file.
+  ASSERT_EQ(::rename(kTestLogPath.c_str(), rotated.c_str()), 0);
+  EXPECT_EQ(log.streams(), 1U);
+  EXPECT_TRUE(log.write("next\n").ok());
+  EXPECT_TRUE(log.flush().ok());
+  EXPECT_EQ(log.streams(), 1U);
+
+  std::string content;
+  EXPECT_TRUE(readFile(rotated, content).ok());
+  EXPECT_EQ(content, "first\nbuffered\n");
+  EXPECT_TRUE(readFile(kTestLogPath, content).ok());
+  EXPECT_EQ(content, "next\n");
+
+  ::remove(kTestLogPath.c_str());
+  ::remove(rotated.c_str());
+}
+
+TEST_F(LoggerTests, test_buffered_log_file_rotate) {
+  std::vector<std::string> paths = {kTestLogPath,
+                                    kTestLogPath + ".1",
+                                    kTestLogPath + ".2",
+                                    kTestLogPath + ".3",
+                                    kTestLogPath + ".1.gz",
+                                    kTestLogPath + ".2.gz"};
+  for (const auto& path : paths) {
+    ::remove(path.c_str());
+  }
+
+  BufferedLogOptions options;
+  options.buffer_size = 0;
+  options.flush_interval = 0;
+  options.rotate_size = 4;
+  options.rotate_count = 2;
+  options.compress = false;
+  {
+    BufferedLogFile log(kTestLogPath, options);
+    EXPECT_TRUE(log.write("one\n").ok());
+    EXPECT_TRUE(log.write("two\n").ok());
+    EXPECT_TRUE(log.write("three\n").ok());
+    EXPECT_TRUE(log.write("4").ok());
+  }
+
+  // Only the two most recent rotated files are kept.
+  std::string content;
+  EXPECT_TRUE(readFile(kTestLogPath, content).ok());
+  EXPECT_EQ(content, "4");
+  EXPECT_TRUE(readFile(kTestLogPath + ".1", content).ok());
+  EXPECT_EQ(content, "three\n");
+  EXPECT_TRUE(readFile(kTestLogPath + ".2", content).ok());
+  EXPECT_EQ(content, "two\n");
+  EXPECT_FALSE(pathExists(kTestLogPath + ".3").ok());
+
+  options.compress = true;
+  {
+    BufferedLogFile log(kTestLogPath, options);
+    EXPECT_TRUE(log.write("five\n").ok());
+  }
+
+  // The rotated file is compressed, and the uncompressed files are shifted.
+  EXPECT_TRUE(pathExists(kTestLogPath + ".1.gz").ok());
+  EXPECT_FALSE(pathExists(kTestLogPath + ".1").ok());
+  EXPECT_TRUE(readFile(kTestLogPath + ".2", content).ok());
+  EXPECT_EQ(content, "three\n");
+  EXPECT_FALSE(pathExists(kTestLogPath).ok());
+
+  for (const auto& path : paths) {
+    ::remove(path.c_str());
+  }
 }
 }
 
@@ -38,7 +38,10 @@ class ScribeLoggerPlugin : public LoggerPlugin {
     if (FLAGS_dev_machine) {
       category += "_dev";
     }
-    scribe::ScribeClient::get()->put(category, message);
+    // A failed put is spooled by the logger and retried in order.
+    if (!scribe::ScribeClient::get()->put(category, message)) {
+      return Status(1, "Could not log to scribe category " + category);
+    }
     return Status(0, "OK");
   }
 
@@ -8,26 +8,371 @@
  *
  */
 
-#include <exception>
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <mutex>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
 #include <osquery/filesystem.h>
 #include <osquery/flags.h>
 #include <osquery/logger.h>
 
+#include "osquery/logger/plugins/filesystem.h"
+
 using osquery::Status;
 
 namespace osquery {
 
+DEFINE_osquery_flag(int32,
+                    logger_buffer_size,
+                    65536,
+                    "Bytes of results buffered before writing");
+
+DEFINE_osquery_flag(int32,
+                    logger_flush_interval,
+                    1,
+                    "Seconds before buffered results are written");
+
+DEFINE_osquery_flag(bool,
+                    logger_sync,
+                    false,
+                    "Sync the results log after each write");
+
+DEFINE_osquery_flag(int32,
+                    logger_rotate_size,
+                    0,
+                    "Rotate the results log at this size in bytes");
+
+DEFINE_osquery_flag(int32,
+                    logger_rotate_max_files,
+                    10,
+                    "Number of rotated results logs to keep");
+
+DEFINE_osquery_flag(bool,
+                    logger_rotate_compress,
+                    true,
+                    "Compress rotated results logs with gzip");
+
 std::mutex filesystemLoggerPluginMutex;
 
+/// Set by SIGHUP, the results log is opened again before the next write.
+static volatile sig_atomic_t kFilesystemLoggerReopen = 0;
+
+static void reopenSignalHandler(int signal) { kFilesystemLoggerReopen = 1; }
+
+BufferedLogOptions::BufferedLogOptions()
+    : permissions(0640),
+      buffer_size(std::max(FLAGS_logger_buffer_size, 0)),
+      flush_interval(std::max(FLAGS_logger_flush_interval, 0)),
+      sync(FLAGS_logger_sync),
+      rotate_size(std::max(FLAGS_logger_rotate_size, 0)),
+      rotate_count(std::max(FLAGS_logger_rotate_max_files, 1)),
+      compress(FLAGS_logger_rotate_compress) {}
+
+/// Compress a rotated file to path.gz and remove it, or leave it as it is.
+static void compressRotatedFile(const std::string& path, int permissions) {
+  auto input = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (input < 0) {
+    return;
+  }
+
+  auto compressed_path = path + ".gz";
+  auto output = ::open(compressed_path.c_str(),
+                       O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                       permissions);
+  auto gz = (output >= 0) ? gzdopen(output, "wb") : nullptr;
+  if (gz == nullptr) {
+    if (output >= 0) {
+      ::close(output);
+    }
+    ::close(input);
+    return;
+  }
+
+  bool ok = true;
+  std::vector<char> buffer(65536);
+  ssize_t bytes;
+  while ((bytes = ::read(input, buffer.data(), buffer.size())) != 0) {
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ok = false;
+      break;
+    }
+    if (gzwrite(gz, buffer.data(), static_cast<unsigned>(bytes)) != bytes) {
+      ok = false;
+      break;
+    }
+  }
+
+  ::close(input);
+  if (gzclose(gz) != Z_OK || !ok) {
+    ::remove(compressed_path.c_str());
+    VLOG(1) << "Cannot compress rotated results log: " << path;
+    return;
+  }
+  ::remove(path.c_str());
+}
+
+BufferedLogFile::BufferedLogFile(const std::string& path,
+                                 const BufferedLogOptions& options)
+    : path_(path),
+      options_(options),
+      fd_(-1),
+      dev_(0),
+      ino_(0),
+      file_size_(0),
+      size_(0),
+      reopen_(false),
+      streams_(0),
+      stopping_(false) {
+  if (options_.buffer_size > 0 && options_.flush_interval > 0) {
+    flusher_ = std::thread(&BufferedLogFile::flushLoop, this);
+  }
+}
+
+BufferedLogFile::~BufferedLogFile() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+  if (flusher_.joinable()) {
+    flusher_.join();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  flushLocked();
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  if (compressor_.joinable()) {
+    compressor_.join();
+  }
+}
+
+Status BufferedLogFile::open() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  fd_ = ::open(path_.c_str(),
+               O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC,
+               options_.permissions);
+  if (fd_ < 0) {
+    return Status(1, "Could not create file: " + path_);
+  }
+
+  // If the file existed with different permissions they must be restricted.
+  struct stat info;
+  if (::fchmod(fd_, options_.permissions) != 0 || ::fstat(fd_, &info) != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return Status(1, "Failed to change permissions for file: " + path_);
+  }
+
+  dev_ = info.st_dev;
+  ino_ = info.st_ino;
+  file_size_ = static_cast<size_t>(info.st_size);
+  return Status(0, "OK");
+}
+
+std::string BufferedLogFile::getRotatedPath(size_t index,
+                                            bool compressed) const {
+  return path_ + "." + std::to_string(index) + ((compressed) ? ".gz" : "");
+}
+
+void BufferedLogFile::rotate() {
+  // The previous rotated file must be compressed before it is shifted.
+  if (compressor_.joinable()) {
+    compressor_.join();
+  }
+
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  // Remove the oldest file and shift the others, compressed or not.
+  auto count = std::max(options_.rotate_count, static_cast<size_t>(1));
+  for (const auto compressed : {false, true}) {
+    ::remove(getRotatedPath(count, compressed).c_str());
+    for (size_t i = count - 1; i > 0; --i) {
+      ::rename(getRotatedPath(i, compressed).c_str(),
+               getRotatedPath(i + 1, compressed).c_str());
+    }
+  }
+
+  auto rotated = getRotatedPath(1, false);
+  if (::rename(path_.c_str(), rotated.c_str()) != 0) {
+    VLOG(1) << "Cannot rotate results log: " << path_;
+    return;
+  }
+  streams_++;
+
+  if (options_.compress) {
+    compressor_ =
+        std::thread(compressRotatedFile, rotated, options_.permissions);
+  }
+}
+
+bool BufferedLogFile::replaced() const {
+  struct stat info;
+  if (::stat(path_.c_str(), &info) != 0) {
+    return true;
+  }
+  return (info.st_dev != dev_ || info.st_ino != ino_);
+}
+
+Status BufferedLogFile::write(const std::string& line) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  lines_.push_back(line);
+  size_ += line.size();
+  if (size_ < options_.buffer_size) {
+    return Status(0, "OK");
+  }
+  return flushLocked();
+}
+
+Status BufferedLogFile::flush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return flushLocked();
+}
+
+size_t BufferedLogFile::streams() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (fd_ >= 0 && (reopen_.exchange(false) || replaced())) {
+    // Buffered lines may refer to dictionaries in the previous file.
+    auto status = writeLocked();
+    if (!status.ok()) {
+      VLOG(1) << "Cannot write buffered results: " << status.toString();
+    }
+    streams_++;
+    // A failed open is retried by the next flush.
+    open();
+  }
+  return streams_;
+}
+
+Status BufferedLogFile::flushLocked() {
+  if (lines_.empty()) {
+    return Status(0, "OK");
+  }
+
+  if (fd_ < 0 || reopen_.exchange(false) || replaced()) {
+    if (fd_ >= 0) {
+      streams_++;
+    }
+    auto status = open();
+    if (!status.ok()) {
+      // The buffer does not grow while the file cannot be opened.
+      lines_.clear();
+      size_ = 0;
+      return status;
+    }
+  }
+
+  auto status = writeLocked();
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (options_.rotate_size > 0 && file_size_ >= options_.rotate_size) {
+    // The next write opens a new file.
+    rotate();
+  }
+  return Status(0, "OK");
+}
+
+Status BufferedLogFile::writeLocked() {
+  // Every buffered line is written or dropped, the buffer does not grow.
+  auto lines = std::move(lines_);
+  lines_.clear();
+  size_ = 0;
+  if (fd_ < 0) {
+    return Status(1, "The file is not open: " + path_);
+  }
+
+  std::vector<struct iovec> iov(lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    iov[i].iov_base = const_cast<char*>(lines[i].data());
+    iov[i].iov_len = lines[i].size();
+  }
+
+  size_t offset = 0;
+  while (offset < iov.size()) {
+    auto count = std::min(iov.size() - offset, static_cast<size_t>(IOV_MAX));
+    auto bytes = ::writev(fd_, &iov[offset], count);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return Status(1, "Failed to write contents to file: " + path_);
+    }
+
+    // Skip the written lines and any partially written line's prefix.
+    auto written = static_cast<size_t>(bytes);
+    file_size_ += written;
+    while (offset < iov.size() && written >= iov[offset].iov_len) {
+      written -= iov[offset++].iov_len;
+    }
+    if (written > 0) {
+      iov[offset].iov_base = static_cast<char*>(iov[offset].iov_base) + written;
+      iov[offset].iov_len -= written;
+    }
+  }
+
+  if (options_.sync) {
+#ifdef __APPLE__
+    auto result = ::fsync(fd_);
+#else
+    auto result = ::fdatasync(fd_);
+#endif
+    if (result != 0) {
+      return Status(1, "Failed to sync file: " + path_);
+    }
+  }
+  return Status(0, "OK");
+}
+
+void BufferedLogFile::flushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    condition_.wait_for(lock,
+                        std::chrono::seconds(options_.flush_interval),
+                        [this]() { return stopping_; });
+    if (!stopping_) {
+      auto status = flushLocked();
+      if (!status.ok()) {
+        VLOG(1) << "Cannot write buffered results: " << status.toString();
+      }
+    }
+  }
+}
+
 class FilesystemLoggerPlugin : public LoggerPlugin {
  public:
   Status setUp();
   Status logString(const std::string& s);
+  size_t getStreams();
+  void tearDown();
 
  private:
   std::string log_path_;
+  /// Opened by the first logged string, setUp runs for every logger.
+  std::unique_ptr<BufferedLogFile> log_;
 };
 
 REGISTER(FilesystemLoggerPlugin, "logger", "filesystem");
@@ -39,18 +384,46 @@ Status FilesystemLoggerPlugin::setUp() {
 
 Status FilesystemLoggerPlugin::logString(const std::string& s) {
   std::lock_guard<std::mutex> lock(filesystemLoggerPluginMutex);
-  try {
+  if (log_ == nullptr) {
     VLOG(3) << "filesystem logger plugin: logging to " << log_path_;
-
     // The results log may contain sensitive information if run as root.
-    auto status = writeTextFile(log_path_, s, 0640, true);
-    if (!status.ok()) {
-      return status;
+    log_.reset(new BufferedLogFile(log_path_, BufferedLogOptions()));
+
+    // Open the results log again on SIGHUP, unless it is otherwise handled.
+    struct sigaction action;
+    if (::sigaction(SIGHUP, nullptr, &action) == 0 &&
+        action.sa_handler == SIG_DFL) {
+      action.sa_handler = reopenSignalHandler;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      ::sigaction(SIGHUP, &action, nullptr);
     }
-  } catch (const std::exception& e) {
-    return Status(1, e.what());
   }
-  return Status(0, "OK");
+
+  if (kFilesystemLoggerReopen != 0) {
+    kFilesystemLoggerReopen = 0;
+    log_->reopen();
+  }
+  return log_->write(s);
+}
+
+size_t FilesystemLoggerPlugin::getStreams() {
+  std::lock_guard<std::mutex> lock(filesystemLoggerPluginMutex);
+  if (log_ == nullptr) {
+    return 0;
+  }
+
+  // A frame is encoded after the check, it must see a reopened file.
+  if (kFilesystemLoggerReopen != 0) {
+    kFilesystemLoggerReopen = 0;
+    log_->reopen();
+  }
+  return log_->streams();
+}
+
+void FilesystemLoggerPlugin::tearDown() {
+  std::lock_guard<std::mutex> lock(filesystemLoggerPluginMutex);
+  log_.reset();
 }
 
 class TestLoggerPlugin : public LoggerPlugin {
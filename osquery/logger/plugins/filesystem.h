@@ -0,0 +1,130 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <osquery/status.h>
+
+namespace osquery {
+
+/// Options for a BufferedLogFile, defaults are set by logger flags.
+struct BufferedLogOptions {
+  /// File permissions, applied when the file is opened.
+  int permissions;
+  /// Bytes of buffered lines that cause a write, 0 writes every line.
+  size_t buffer_size;
+  /// Seconds after which buffered lines are written, 0 disables the timer.
+  size_t flush_interval;
+  /// Synchronize the file's data after each write.
+  bool sync;
+  /// Bytes after which the file is rotated, 0 disables rotation.
+  size_t rotate_size;
+  /// The number of rotated files kept, path.1 is the most recent.
+  size_t rotate_count;
+  /// Compress rotated files with gzip, as path.N.gz, on a thread.
+  bool compress;
+
+  BufferedLogOptions();
+};
+
+/**
+ * @brief An append-only log file kept open between writes.
+ *
+ * Lines are buffered in memory and written together with a single writev
+ * when the buffer is full or, from a flush thread, once every flush
+ * interval. Concurrent writers share those writes.
+ *
+ * The file is opened again if it is replaced or removed, such as by an
+ * external rotation, or after reopen is called. It may also rotate itself
+ * once a write makes it larger than the rotation size.
+ */
+class BufferedLogFile {
+ public:
+  BufferedLogFile(const std::string& path, const BufferedLogOptions& options);
+  ~BufferedLogFile();
+
+  /// Buffer a line, writing the buffered lines if the buffer is full.
+  Status write(const std::string& line);
+
+  /// Write every buffered line.
+  Status flush();
+
+  /// Open the file again before the next write.
+  void reopen() { reopen_ = true; }
+
+  /// The path of the log file.
+  const std::string& path() const { return path_; }
+
+  /**
+   * @brief The number of files started after the first, by rotation or
+   * reopening.
+   *
+   * A replaced file, or one to reopen, is opened again first. The lines
+   * buffered until then are written to the previous file, such that lines
+   * encoded after the check begin the new file.
+   */
+  size_t streams();
+
+ private:
+  /// Open the path for appending, closing any previous descriptor.
+  Status open();
+
+  /// Check if the path no longer names the open file.
+  bool replaced() const;
+
+  /// Write the buffered lines, the lock must be held.
+  Status flushLocked();
+
+  /// Write the buffered lines to the open file, the lock must be held.
+  Status writeLocked();
+
+  /// The flush thread's loop.
+  void flushLoop();
+
+  /// Shift the rotated files and move the file to path.1, the lock is held.
+  void rotate();
+
+  /// The path of a rotated file.
+  std::string getRotatedPath(size_t index, bool compressed) const;
+
+ private:
+  std::string path_;
+  BufferedLogOptions options_;
+
+  /// The open descriptor, or -1.
+  int fd_;
+  dev_t dev_;
+  ino_t ino_;
+  /// The size of the open file, including this descriptor's writes.
+  size_t file_size_;
+
+  /// Buffered lines and their total size.
+  std::vector<std::string> lines_;
+  size_t size_;
+  std::atomic<bool> reopen_;
+  std::atomic<size_t> streams_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stopping_;
+  std::thread flusher_;
+  /// Compresses the most recently rotated file.
+  std::thread compressor_;
+};
+}
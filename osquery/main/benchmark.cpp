@@ -0,0 +1,197 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <gflags/gflags.h>
+
+#include <osquery/core.h>
+#include <osquery/devtools.h>
+#include <osquery/events.h>
+#include <osquery/logger.h>
+#include <osquery/registry.h>
+#include <osquery/tables.h>
+
+namespace pt = boost::property_tree;
+
+DEFINE_int32(iterations, 10, "times to generate each table");
+DEFINE_string(tables, "", "comma-separated tables to generate, default all");
+DEFINE_string(exclude_tables, "", "comma-separated tables to skip");
+
+namespace osquery {
+
+DECLARE_string(db_path);
+
+/// Values for required columns, tables with other required columns get 0.
+const std::map<std::string, std::string> kSyntheticValues = {
+    {"path", "/etc/hosts"},
+    {"directory", "/etc"},
+    {"pid", std::to_string(getpid())},
+    {"uid", std::to_string(getuid())},
+    {"gid", std::to_string(getgid())},
+};
+
+static std::set<std::string> splitTables(const std::string& tables) {
+  std::set<std::string> names;
+  boost::split(names, tables, boost::is_any_of(","));
+  names.erase("");
+  return names;
+}
+
+/// The peak resident set size in kilobytes.
+static size_t getPeakRSS() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/// Constrain each required column to a value the table can generate.
+static tables::QueryContext getSyntheticContext(
+    const tables::TableDefinition& definition) {
+  tables::QueryContext context;
+  for (const auto& column : definition.columns) {
+    auto option = definition.options.find(column.first);
+    if (option == definition.options.end() ||
+        !(option->second & tables::COLUMN_REQUIRED)) {
+      continue;
+    }
+
+    auto value = kSyntheticValues.find(column.first);
+    context.constraints[column.first].setAffinity(column.second);
+    auto expr = (value != kSyntheticValues.end()) ? value->second : "0";
+    context.constraints[column.first].add(
+        tables::Constraint(tables::EQUALS, expr));
+  }
+  return context;
+}
+
+/// Generate the rows of a table, pulling them from its cursor if it has one.
+static size_t generateTable(tables::TablePlugin& table,
+                            tables::QueryContext& context) {
+  auto cursor = table.cursor(context);
+  if (cursor == nullptr) {
+    return table.generateRows(context).size();
+  }
+
+  size_t rows = 0;
+  Row r;
+  while (cursor->next(r)) {
+    rows++;
+    r.clear();
+  }
+  return rows;
+}
+
+static size_t getPercentile(const std::vector<size_t>& sorted, double p) {
+  return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
+
+/**
+ * @brief Generate a table FLAGS_iterations times and report its cost.
+ *
+ * Latencies are in microseconds. Tables with source files reuse their rows
+ * while the files are unchanged, as they do in the daemon.
+ */
+static pt::ptree benchmarkTable(const std::string& name,
+                                tables::TablePlugin& table) {
+  auto context = getSyntheticContext(table.definition());
+
+  size_t bytes_start, syscalls_start;
+  getIOCounters(bytes_start, syscalls_start);
+  auto rss_start = getPeakRSS();
+
+  std::vector<size_t> latencies;
+  size_t rows = 0;
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    rows += generateTable(table, context);
+    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start).count());
+  }
+
+  size_t bytes, syscalls;
+  getIOCounters(bytes, syscalls);
+  size_t total_us = 0;
+  for (const auto& latency : latencies) {
+    total_us += latency;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  pt::ptree result;
+  result.put("name", name);
+  result.put("iterations", FLAGS_iterations);
+  result.put("constraints", context.constraints.size());
+  result.put("rows", rows / FLAGS_iterations);
+  result.put("p50_us", getPercentile(latencies, 0.50));
+  result.put("p90_us", getPercentile(latencies, 0.90));
+  result.put("p99_us", getPercentile(latencies, 0.99));
+  result.put("max_us", latencies.back());
+  result.put("rows_per_second",
+             (total_us > 0) ? (size_t)(rows * 1000000.0 / total_us) : 0);
+  result.put("peak_rss_delta_kb", getPeakRSS() - rss_start);
+  result.put("io_bytes", (bytes - bytes_start) / FLAGS_iterations);
+  result.put("syscalls", (syscalls - syscalls_start) / FLAGS_iterations);
+  return result;
+}
+}
+
+int main(int argc, char* argv[]) {
+  // Only log to stderr, the results are written to stdout.
+  FLAGS_logtostderr = true;
+  osquery::FLAGS_db_path = "/tmp/rocksdb-osquery-tables-benchmark";
+
+  __GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, false);
+  __GFLAGS_NAMESPACE::InitGoogleLogging(argv[0]);
+  if (FLAGS_iterations < 1) {
+    fprintf(stderr, "Usage: %s --iterations=N [--tables=a,b]\n", argv[0]);
+    return 1;
+  }
+
+  osquery::Registry::setUp();
+  osquery::attachEvents();
+
+  auto tables = osquery::splitTables(FLAGS_tables);
+  auto excluded = osquery::splitTables(FLAGS_exclude_tables);
+  pt::ptree results;
+  for (const auto& name : osquery::Registry::names("table")) {
+    if ((!tables.empty() && tables.count(name) == 0) || excluded.count(name)) {
+      continue;
+    }
+
+    // Tables provided by an extension are not generated in this process.
+    auto table = std::dynamic_pointer_cast<osquery::tables::TablePlugin>(
+        osquery::Registry::get("table", name));
+    if (table == nullptr) {
+      continue;
+    }
+
+    VLOG(1) << "Benchmarking table: " << name;
+    results.push_back(
+        std::make_pair("", osquery::benchmarkTable(name, *table)));
+  }
+
+  pt::ptree tree;
+  tree.add_child("tables", results);
+  pt::write_json(std::cout, tree);
+
+  // Instead of calling "shutdownOsquery" force the EF to join its threads.
+  osquery::EventFactory::end(true);
+  __GFLAGS_NAMESPACE::ShutDownCommandLineFlags();
+  return 0;
+}
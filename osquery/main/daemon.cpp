@@ -17,6 +17,7 @@
 #include <osquery/scheduler.h>
 
 #include "osquery/core/watcher.h"
+#include "osquery/sql/query_socket.h"
 
 const std::string kWatcherWorkerName = "osqueryd-worker";
 
@@ -36,6 +37,11 @@ DEFINE_osquery_flag(bool,
                     disable_watchdog,
                     false,
                     "Do not use a userland watchdog process.");
+
+DEFINE_osquery_flag(string,
+                    query_socket,
+                    "",
+                    "Serve local queries on this UNIX socket (osqueryd only)");
 }
 
 int main(int argc, char* argv[]) {
@@ -101,10 +107,28 @@ int main(int argc, char* argv[]) {
   // Start event threads.
   osquery::EventFactory::delay();
 
+  // Samples are taken in the worker, SIGUSR2 starts or stops sampling.
+  osquery::initSampler();
+
+  // The worker answers osqueryi --connect with its tables and caches.
+  if (!osquery::FLAGS_query_socket.empty()) {
+    auto s = osquery::startQuerySocket(osquery::FLAGS_query_socket);
+    if (!s.ok()) {
+      LOG(WARNING) << s.getMessage();
+    }
+  }
+
+  // Ad-hoc queries from the config retriever run beside the schedule.
+  boost::thread distributed_thread(osquery::initializeDistributed);
+
   boost::thread scheduler_thread(osquery::initializeScheduler);
   scheduler_thread.join();
 
   // Finally shutdown.
+  osquery::stopDistributed();
+  distributed_thread.join();
+  osquery::stopQuerySocket();
+  osquery::stopSampling();
   osquery::shutdownOsquery();
 
   return 0;
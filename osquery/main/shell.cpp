@@ -8,16 +8,113 @@
  *
  */
  
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+#include <sqlite3.h>
+
 #include <osquery/core.h>
 #include <osquery/database.h>
 #include <osquery/devtools.h>
 #include <osquery/events.h>
+#include <osquery/flags.h>
+
+#include "osquery/sql/query_socket.h"
+
+namespace osquery {
+DECLARE_bool(profile_schedule);
+DECLARE_bool(json);
+
+DEFINE_shell_flag(string,
+                  connect,
+                  "",
+                  "send queries to the osqueryd --query_socket at PATH");
+
+/// True if the shell is asked to send its queries to a daemon.
+static bool hasConnectFlag(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.find("--connect") == 0 || arg.find("-connect") == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Print the results of a query run by the daemon, 1 if the query failed.
+static int printDaemonQuery(const std::string &q) {
+  std::vector<std::string> columns;
+  QueryData results;
+  auto status = queryDaemon(FLAGS_connect, q, columns, results);
+  if (!status.ok()) {
+    std::cerr << "Error: " << status.getMessage() << "\n";
+    return 1;
+  }
+
+  if (FLAGS_json) {
+    jsonPrint(results);
+  } else if (!results.empty()) {
+    prettyPrint(results, columns);
+  }
+  return 0;
+}
+
+/**
+ * @brief Run queries in a daemon, without setting up tables in the shell.
+ *
+ * A statement given as arguments is run alone, otherwise complete statements
+ * are read from stdin and sent as they end.
+ */
+static int launchIntoDaemonShell(int argc, char *argv[]) {
+  __GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc > 1) {
+    std::string q;
+    for (int i = 1; i < argc; ++i) {
+      q += ((i > 1) ? " " : "") + std::string(argv[i]);
+    }
+    return printDaemonQuery(q);
+  }
+
+  int retcode = 0;
+  bool interactive = isatty(STDIN_FILENO);
+  std::string q;
+  std::string line;
+  while (true) {
+    if (interactive) {
+      std::cout << ((q.empty()) ? "osquery> " : "    ...> ") << std::flush;
+    }
+    if (!std::getline(std::cin, line)) {
+      break;
+    }
+    q += line + "\n";
+    if (sqlite3_complete(q.c_str())) {
+      retcode |= printDaemonQuery(q);
+      q.clear();
+    }
+  }
+  return retcode;
+}
+}
 
 int main(int argc, char *argv[]) {
+  if (osquery::hasConnectFlag(argc, argv)) {
+    // The daemon's tables, caches and event buffers answer the queries.
+    return osquery::launchIntoDaemonShell(argc, argv);
+  }
+
   osquery::FLAGS_db_path = "/tmp/rocksdb-osquery-shell";
   // Parse/apply flags, start registry, load logger/config plugins.
   osquery::initOsquery(argc, argv, osquery::OSQUERY_TOOL_SHELL);
 
+  if (osquery::FLAGS_profile_schedule) {
+    // Measure the configured schedule without event threads adding noise.
+    int retcode = osquery::profileScheduledQueries();
+    osquery::shutdownOsquery();
+    return retcode;
+  }
+
   // Start event threads.
   osquery::EventFactory::delay();
 
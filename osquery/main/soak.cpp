@@ -0,0 +1,255 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/thread.hpp>
+
+#include <osquery/config.h>
+#include <osquery/core.h>
+#include <osquery/database/db_handle.h>
+#include <osquery/events.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+#include <osquery/scheduler.h>
+
+#include "osquery/scheduler/stats.h"
+
+namespace pt = boost::property_tree;
+
+namespace osquery {
+
+DECLARE_string(config_path);
+DECLARE_string(config_retriever);
+DECLARE_string(db_path);
+DECLARE_int32(schedule_timeout);
+
+DEFINE_osquery_flag(int32,
+                    soak_duration,
+                    3600,
+                    "Seconds to replay the schedule for");
+
+DEFINE_osquery_flag(int32,
+                    soak_acceleration,
+                    60,
+                    "Divide each scheduled query interval by this factor");
+
+DEFINE_osquery_flag(int32,
+                    soak_sample_interval,
+                    10,
+                    "Seconds between resource samples");
+
+DEFINE_osquery_flag(int32,
+                    soak_max_rss_growth_mb,
+                    64,
+                    "Fail if resident memory grows by more MB (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    soak_max_query_cpu_ms,
+                    1000,
+                    "Fail if a query's average run uses more CPU ms (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    soak_max_db_mb,
+                    1024,
+                    "Fail if the backing store grows to more MB (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    soak_max_log_mb,
+                    1024,
+                    "Fail if more MB of results are logged (0 off)");
+
+/**
+ * @brief Replay the pack at config_path with accelerated intervals.
+ *
+ * The pack is parsed as the daemon would and each interval is divided by
+ * soak_acceleration, such that an hour of soaking replays days of runs.
+ */
+class SoakConfigPlugin : public ConfigPlugin {
+ public:
+  std::pair<Status, std::string> genConfig() {
+    std::ifstream pack(FLAGS_config_path);
+    if (!pack.good()) {
+      return std::make_pair(Status(1, "Cannot read " + FLAGS_config_path), "");
+    }
+
+    std::string content((std::istreambuf_iterator<char>(pack)),
+                        std::istreambuf_iterator<char>());
+    OsqueryConfig conf;
+    auto status = Config::parseConfig(content, conf);
+    if (!status.ok()) {
+      return std::make_pair(status, "");
+    }
+
+    pt::ptree queries;
+    auto acceleration = std::max(FLAGS_soak_acceleration, 1);
+    for (const auto& q : conf.scheduledQueries) {
+      pt::ptree query;
+      query.put("name", q.name);
+      query.put("query", q.query);
+      query.put("interval", std::max(q.interval / acceleration, 1));
+      query.put("timeout_ms", q.timeout_ms);
+      query.put("cpu_ms", q.cpu_ms);
+      query.put("max_bytes", q.max_bytes);
+      query.put("rollup", q.rollup);
+      query.put("rollup_key", q.rollup_key);
+      query.put("snapshot", q.snapshot);
+      queries.push_back(std::make_pair("", query));
+    }
+
+    pt::ptree tree;
+    tree.add_child("scheduledQueries", queries);
+    std::stringstream json;
+    pt::write_json(json, tree, false);
+    return std::make_pair(Status(0, "OK"), json.str());
+  }
+};
+
+REGISTER(SoakConfigPlugin, "config", "soak");
+
+/// The current resident set size in bytes, or the peak if unavailable.
+static size_t getResidentSize() {
+#ifdef __linux__
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  if (statm >> pages >> resident) {
+    return resident * sysconf(_SC_PAGESIZE);
+  }
+#endif
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024;
+#endif
+}
+
+/// Check a sample against its budget, logging the first overrun.
+static bool withinBudget(const std::string& metric,
+                         double value,
+                         int budget,
+                         std::set<std::string>& exceeded) {
+  if (budget <= 0 || value <= budget) {
+    return true;
+  }
+  if (exceeded.insert(metric).second) {
+    LOG(ERROR) << "Soak " << metric << " of " << value
+               << " is over its budget of " << budget;
+  }
+  return false;
+}
+
+/**
+ * @brief Sample resources until the scheduler returns, then check budgets.
+ *
+ * @return 1 if any metric was over its budget.
+ */
+static int soak(boost::thread& scheduler) {
+  auto queries = Config::getInstance()->getScheduledQueries();
+  auto start = std::chrono::steady_clock::now();
+  auto sample_interval = std::max(FLAGS_soak_sample_interval, 1);
+
+  pt::ptree samples;
+  std::set<std::string> exceeded;
+  size_t baseline_rss = 0;
+  bool running = true;
+  while (running) {
+    running = !scheduler.try_join_for(
+        boost::chrono::seconds(sample_interval));
+
+    // The first sample includes the first run of every query, growth after
+    // that is compared to it.
+    auto rss = getResidentSize();
+    if (baseline_rss == 0) {
+      baseline_rss = rss;
+    }
+
+    size_t executions = 0;
+    size_t bytes_logged = 0;
+    double max_cpu = 0;
+    std::string max_cpu_query;
+    for (const auto& query : queries) {
+      QueryPerformance performance;
+      if (!SchedulerStats::getInstance().get(query.name, performance)) {
+        continue;
+      }
+      executions += performance.executions;
+      bytes_logged += performance.bytes_logged;
+      if (performance.cpu_time > max_cpu) {
+        max_cpu = performance.cpu_time;
+        max_cpu_query = query.name;
+      }
+    }
+
+    pt::ptree sample;
+    sample.put("seconds",
+               std::chrono::duration_cast<std::chrono::seconds>(
+                   std::chrono::steady_clock::now() - start).count());
+    sample.put("rss_bytes", rss);
+    sample.put("db_bytes", DBHandle::getInstance()->getDiskUsage());
+    sample.put("log_bytes", bytes_logged);
+    sample.put("executions", executions);
+    sample.put("max_query_cpu_ms", max_cpu);
+    sample.put("max_query_cpu_name", max_cpu_query);
+    samples.push_back(std::make_pair("", sample));
+
+    double mb = 1024 * 1024;
+    withinBudget("rss_growth_mb",
+                 (rss - std::min(rss, baseline_rss)) / mb,
+                 FLAGS_soak_max_rss_growth_mb,
+                 exceeded);
+    withinBudget("query_cpu_ms:" + max_cpu_query,
+                 max_cpu,
+                 FLAGS_soak_max_query_cpu_ms,
+                 exceeded);
+    withinBudget("db_mb",
+                 sample.get<size_t>("db_bytes") / mb,
+                 FLAGS_soak_max_db_mb,
+                 exceeded);
+    withinBudget("log_mb", bytes_logged / mb, FLAGS_soak_max_log_mb, exceeded);
+  }
+
+  pt::ptree tree;
+  tree.put("duration", FLAGS_soak_duration);
+  tree.put("acceleration", FLAGS_soak_acceleration);
+  tree.put("queries", queries.size());
+  pt::ptree over_budget;
+  for (const auto& metric : exceeded) {
+    over_budget.push_back(std::make_pair("", pt::ptree(metric)));
+  }
+  tree.add_child("over_budget", over_budget);
+  tree.add_child("samples", samples);
+  pt::write_json(std::cout, tree);
+  return (exceeded.empty()) ? 0 : 1;
+}
+}
+
+int main(int argc, char* argv[]) {
+  // The pack is replayed through the soak config plugin.
+  osquery::FLAGS_config_retriever = "soak";
+  osquery::FLAGS_db_path = "/tmp/rocksdb-osquery-soak";
+  osquery::initOsquery(argc, argv);
+  osquery::FLAGS_schedule_timeout = osquery::FLAGS_soak_duration;
+
+  osquery::EventFactory::delay();
+  boost::thread scheduler_thread(osquery::initializeScheduler);
+  auto result = osquery::soak(scheduler_thread);
+
+  osquery::shutdownOsquery();
+  return result;
+}
@@ -35,4 +35,47 @@ void Plugin::setResponse(const std::string& key,
   boost::property_tree::write_json(output, tree, false);
   response.push_back({{key, output.str()}});
 }
+
+void applyBroadcastDelta(const RegistryBroadcastDelta& delta,
+                         RegistryBroadcast& broadcast,
+                         RegistryVersions& versions) {
+  for (const auto& registry : delta.reset) {
+    broadcast.erase(registry);
+  }
+
+  for (const auto& registry : delta.removed) {
+    auto& routes = broadcast[registry.first];
+    for (const auto& item : registry.second) {
+      routes.erase(item);
+    }
+  }
+
+  for (const auto& registry : delta.added) {
+    auto& routes = broadcast[registry.first];
+    for (const auto& item : registry.second) {
+      routes[item.first] = item.second;
+    }
+  }
+
+  versions = delta.versions;
+}
+
+std::shared_ptr<Plugin> PluginHandle::get() {
+  auto generation = Registry::generation(registry_name_);
+  if (!resolved_ || generation != generation_) {
+    plugin_ = Registry::find(registry_name_, item_name_);
+    generation_ = generation;
+    resolved_ = true;
+  }
+  return plugin_;
+}
+
+Status PluginHandle::call(const PluginRequest& request,
+                          PluginResponse& response) {
+  auto plugin = get();
+  if (plugin == nullptr) {
+    return Status(1, "Cannot call registry item: " + item_name_);
+  }
+  return plugin->call(request, response);
+}
 }
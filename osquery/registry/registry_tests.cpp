@@ -8,6 +8,9 @@
  *
  */
  
+#include <atomic>
+#include <thread>
+
 #include <gtest/gtest.h>
 
 #include <osquery/logger.h>
@@ -54,9 +57,9 @@ TEST_F(RegistryTests, test_registry) {
   cats.add<HouseCat>("house2");
   EXPECT_EQ(cats.count(), 2);
 
-  /// Request a plugin to call an API method.
-  auto cat = cats.get("house");
+  /// Request a plugin to call an API method, it is set up when first used.
   cats.setUp();
+  auto cat = cats.get("house");
 
   EXPECT_EQ(cat->getValue(), 9000);
 
@@ -67,6 +70,21 @@ TEST_F(RegistryTests, test_registry) {
   }
 }
 
+TEST_F(RegistryTests, test_registry_generation) {
+  CatRegistry cats;
+  EXPECT_EQ(cats.generation(), 0);
+
+  cats.add<HouseCat>("house");
+  EXPECT_EQ(cats.generation(), 1);
+
+  // A duplicate add does not change the set of items.
+  cats.add<HouseCat>("house");
+  EXPECT_EQ(cats.generation(), 1);
+
+  cats.remove("house");
+  EXPECT_EQ(cats.generation(), 2);
+}
+
 /// To track registry types and then broadcast them via Thrift we must define
 /// a plugin API. All broadcasted registry types and the plugins of that type
 /// must conform to this API.
@@ -142,9 +160,12 @@ TEST_F(RegistryTests, test_persistant_registries) {
 
 TEST_F(RegistryTests, test_registry_exceptions) {
   EXPECT_TRUE(TestCoreRegistry::add<Doge>("dog", "duplicate_dog").ok());
-  // Bad dog will be added fine, but when setup is run, it will be removed.
+  // Bad dog will be added fine, but when it is first used setup will fail
+  // and it will be removed.
   EXPECT_TRUE(TestCoreRegistry::add<BadDoge>("dog", "bad_doge").ok());
   TestCoreRegistry::registry("dog")->setUp();
+  EXPECT_TRUE(TestCoreRegistry::exists("dog", "bad_doge"));
+  EXPECT_EQ(TestCoreRegistry::find("dog", "bad_doge"), nullptr);
   // Make sure bad dog does not exist.
   EXPECT_FALSE(TestCoreRegistry::exists("dog", "bad_doge"));
   EXPECT_EQ(TestCoreRegistry::count("dog"), 2);
@@ -228,6 +249,156 @@ TEST_F(RegistryTests, test_registry_api) {
   status = TestCoreRegistry::call("widgets", "special", request, response);
   EXPECT_EQ(response[0].at("secret_power"), "magic");
 }
+
+TEST_F(RegistryTests, test_registry_find) {
+  CatRegistry cats;
+  cats.add<HouseCat>("house");
+
+  EXPECT_NE(cats.find("house"), nullptr);
+  EXPECT_EQ(cats.find("does_not_exist"), nullptr);
+  EXPECT_EQ(TestCoreRegistry::find("does_not_exist", "house"), nullptr);
+  EXPECT_EQ(TestCoreRegistry::find("cat", "does_not_exist"), nullptr);
+  EXPECT_NE(TestCoreRegistry::find("cat", "auto_house"), nullptr);
+}
+
+TEST_F(RegistryTests, test_plugin_handle) {
+  Registry::create<WidgetPlugin>("handle_widgets");
+  PluginHandle handle("handle_widgets", "special");
+  EXPECT_EQ(handle.get(), nullptr);
+
+  PluginResponse response;
+  EXPECT_FALSE(handle.call({}, response).ok());
+
+  // The handle resolves items added after it was created.
+  Registry::add<SpecialWidget>("handle_widgets", "special");
+  auto plugin = handle.get();
+  EXPECT_NE(plugin, nullptr);
+  EXPECT_EQ(plugin, handle.get());
+  EXPECT_TRUE(handle.call({{"secret_power", "magic"}}, response).ok());
+  EXPECT_EQ(response[0].at("secret_power"), "magic");
+
+  // And stops calling removed items, the reference remains usable.
+  Registry::registry("handle_widgets")->remove("special");
+  EXPECT_EQ(handle.get(), nullptr);
+  response.clear();
+  EXPECT_TRUE(plugin->call({}, response).ok());
+}
+
+class CountingCat : public CatPlugin {
+ public:
+  Status setUp() {
+    some_value_++;
+    return Status(0, "OK");
+  }
+};
+
+TEST_F(RegistryTests, test_registry_lazy_setup) {
+  CatRegistry cats;
+  cats.add<CountingCat>("used");
+  cats.add<CountingCat>("unused");
+
+  // Items are not set up until they are used, and only once.
+  cats.setUp();
+  auto all = cats.all();
+  EXPECT_EQ(all.at("used")->getValue(), 0);
+  EXPECT_EQ(cats.get("used")->getValue(), 1);
+  EXPECT_EQ(cats.find("used")->getValue(), 1);
+  EXPECT_EQ(all.at("unused")->getValue(), 0);
+
+  // Items added after the registry is set up are set up on first use.
+  cats.add<CountingCat>("late");
+  EXPECT_EQ(cats.find("late")->getValue(), 1);
+
+  // Setting up the registry again does not repeat item setUp calls.
+  cats.setUp();
+  EXPECT_EQ(cats.find("used")->getValue(), 1);
+}
+
+TEST_F(RegistryTests, test_registry_broadcast_delta) {
+  Registry::create<WidgetPlugin>("delta_widgets");
+  Registry::add<SpecialWidget>("delta_widgets", "first");
+
+  RegistryVersions versions;
+  auto broadcast = Registry::getBroadcast(versions);
+  EXPECT_EQ(broadcast.at("delta_widgets").size(), 1);
+
+  // Nothing changed since the full broadcast.
+  RegistryBroadcastDelta delta;
+  Registry::getBroadcastDelta(versions, delta);
+  EXPECT_TRUE(delta.empty());
+
+  // Only the changed items are sent.
+  auto registry = Registry::registry("delta_widgets");
+  registry->add<SpecialWidget>("second");
+  registry->add<SpecialWidget>("third");
+  registry->remove("third");
+  registry->remove("first");
+  delta = RegistryBroadcastDelta();
+  Registry::getBroadcastDelta(versions, delta);
+  EXPECT_TRUE(delta.reset.empty());
+  EXPECT_EQ(delta.added.size(), 1);
+  EXPECT_EQ(delta.added.at("delta_widgets").size(), 1);
+  EXPECT_EQ(delta.added.at("delta_widgets").at("second").at("name"),
+            "second");
+  EXPECT_EQ(delta.removed.at("delta_widgets"),
+            std::vector<std::string>({"first", "third"}));
+
+  applyBroadcastDelta(delta, broadcast, versions);
+  EXPECT_EQ(broadcast, Registry::getBroadcast());
+  delta = RegistryBroadcastDelta();
+  Registry::getBroadcastDelta(versions, delta);
+  EXPECT_TRUE(delta.empty());
+
+  // Registries whose changes are no longer retained are sent in full.
+  for (size_t i = 0; i <= kRegistryChangeHistory; i++) {
+    registry->add<SpecialWidget>("other");
+    registry->remove("other");
+  }
+  delta = RegistryBroadcastDelta();
+  Registry::getBroadcastDelta(versions, delta);
+  EXPECT_EQ(delta.reset, std::vector<std::string>({"delta_widgets"}));
+  applyBroadcastDelta(delta, broadcast, versions);
+  EXPECT_EQ(broadcast, Registry::getBroadcast());
+
+  // As are registries the consumer has not seen.
+  versions.erase("delta_widgets");
+  delta = RegistryBroadcastDelta();
+  Registry::getBroadcastDelta(versions, delta);
+  EXPECT_EQ(delta.reset, std::vector<std::string>({"delta_widgets"}));
+}
+
+TEST_F(RegistryTests, test_registry_concurrent_calls) {
+  Registry::create<WidgetPlugin>("concurrent_widgets");
+  Registry::add<SpecialWidget>("concurrent_widgets", "special");
+
+  // Calls continue while other items are added and removed.
+  std::atomic<size_t> failures(0);
+  std::vector<std::thread> callers;
+  for (size_t i = 0; i < 4; i++) {
+    callers.push_back(std::thread([&failures]() {
+      PluginHandle handle("concurrent_widgets", "special");
+      for (size_t j = 0; j < 1000; j++) {
+        PluginResponse response;
+        if (!handle.call({}, response).ok() ||
+            !Registry::call("concurrent_widgets", "special", {}, response)
+                 .ok()) {
+          failures++;
+        }
+      }
+    }));
+  }
+
+  auto registry = Registry::registry("concurrent_widgets");
+  for (size_t i = 0; i < 100; i++) {
+    registry->add<SpecialWidget>("other");
+    registry->remove("other");
+  }
+
+  for (auto& caller : callers) {
+    caller.join();
+  }
+  EXPECT_EQ(failures, 0);
+}
 }
 
 int main(int argc, char* argv[]) {
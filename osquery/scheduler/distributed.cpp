@@ -0,0 +1,176 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+#include <osquery/config.h>
+#include <osquery/core.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+#include <osquery/scheduler.h>
+
+#include "osquery/sql/sqlite_util.h"
+
+namespace osquery {
+
+DEFINE_osquery_flag(int32,
+                    distributed_interval,
+                    0,
+                    "Seconds between distributed query requests (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    distributed_page_bytes,
+                    262144,
+                    "Bytes of distributed query results logged per page");
+
+DEFINE_osquery_flag(int32,
+                    distributed_timeout_ms,
+                    60000,
+                    "Wall-clock ms of distributed queries without a limit");
+
+DEFINE_osquery_flag(int32,
+                    distributed_cpu_ms,
+                    0,
+                    "CPU ms of distributed queries without a limit (0 off)");
+
+/// The stop request of the distributed thread and the query it runs.
+struct DistributedState {
+  std::mutex mutex;
+  std::condition_variable stopped;
+  bool stop{false};
+  tables::QueryBudgetRef budget;
+};
+
+static DistributedState& getDistributedState() {
+  static DistributedState state;
+  return state;
+}
+
+/// The fields shared by every line of a distributed query's results.
+static std::string getDistributedPrefix(const DistributedQueryRequest& request,
+                                        const std::string& ident,
+                                        int unix_time) {
+  std::string prefix = "{\"name\":\"distributed\",\"id\":";
+  appendJSONString(prefix, request.id);
+  prefix.append(",\"hostIdentifier\":");
+  appendJSONString(prefix, ident);
+  prefix.append(",\"unixTime\":" + std::to_string(unix_time));
+  return prefix;
+}
+
+Status runDistributedQuery(const DistributedQueryRequest& request,
+                           const LogBatchWriter& writer) {
+  std::string ident;
+  getHostIdentifier(ident);
+  auto prefix = getDistributedPrefix(request, ident, getUnixTime());
+
+  auto timeout_ms = (request.timeout_ms > 0)
+                        ? request.timeout_ms
+                        : std::max(FLAGS_distributed_timeout_ms, 0);
+  auto cpu_ms = (request.cpu_ms > 0) ? request.cpu_ms
+                                     : std::max(FLAGS_distributed_cpu_ms, 0);
+  auto budget = std::make_shared<tables::QueryBudget>(timeout_ms, cpu_ms);
+  auto& state = getDistributedState();
+  {
+    // A stopped daemon cancels the running query.
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.stop) {
+      budget->cancel();
+    }
+    state.budget = budget;
+  }
+
+  // Rows are serialized as they are generated and the page is written once
+  // it is full, the result set is never held in memory.
+  auto page_bytes = (size_t)std::max(FLAGS_distributed_page_bytes, 1);
+  std::vector<std::string> page;
+  size_t page_size = 0;
+  size_t page_number = 0;
+  size_t rows = 0;
+  auto status = queryInternalStream(
+      request.query, budget, [&](Row& r) -> Status {
+        std::string line = prefix;
+        line.append(",\"page\":" + std::to_string(page_number) +
+                    ",\"columns\":");
+        appendRowJSON(line, r);
+        line.append("}\n");
+        page_size += line.size();
+        page.push_back(std::move(line));
+        rows++;
+        if (page_size < page_bytes) {
+          return Status(0, "OK");
+        }
+
+        auto written = writer(page);
+        page.clear();
+        page_size = 0;
+        page_number++;
+        return written;
+      });
+
+  // The last page ends with the query's status, consumers wait for it.
+  std::string done = prefix;
+  done.append(",\"page\":" + std::to_string(page_number) + ",\"status\":");
+  appendJSONString(done, status.ok() ? "OK" : status.getMessage());
+  done.append(",\"rows\":" + std::to_string(rows) + "}\n");
+  page.push_back(std::move(done));
+  auto written = writer(page);
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.budget = nullptr;
+  }
+  return (status.ok()) ? written : status;
+}
+
+void initializeDistributed() {
+  if (FLAGS_distributed_interval <= 0) {
+    return;
+  }
+
+  LogBatchWriter writer = [](std::vector<std::string>& page) {
+    return logStringBatch(std::move(page));
+  };
+  auto& state = getDistributedState();
+  while (true) {
+    std::vector<DistributedQueryRequest> requests;
+    auto status = Config::genDistributedQueries(requests);
+    if (!status.ok()) {
+      VLOG(1) << "Cannot request distributed queries: " << status.what();
+    }
+
+    for (const auto& request : requests) {
+      status = runDistributedQuery(request, writer);
+      if (!status.ok()) {
+        LOG(WARNING) << "Distributed query " << request.id
+                     << " failed: " << status.what();
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    if (state.stopped.wait_for(lock,
+                               std::chrono::seconds(FLAGS_distributed_interval),
+                               [&state]() { return state.stop; })) {
+      return;
+    }
+  }
+}
+
+void stopDistributed() {
+  auto& state = getDistributedState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.stop = true;
+  if (state.budget != nullptr) {
+    state.budget->cancel();
+  }
+  state.stopped.notify_all();
+}
+}
@@ -0,0 +1,148 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <osquery/core.h>
+#include <osquery/flags.h>
+#include <osquery/scheduler.h>
+
+namespace osquery {
+
+DECLARE_int32(distributed_interval);
+DECLARE_int32(distributed_page_bytes);
+
+class DistributedTests : public testing::Test {};
+
+TEST_F(DistributedTests, test_run_distributed_query_pages) {
+  DistributedQueryRequest request;
+  request.id = "incident";
+  request.query =
+      "WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c "
+      "WHERE n < 1000) SELECT n FROM c";
+
+  auto page_bytes = FLAGS_distributed_page_bytes;
+  FLAGS_distributed_page_bytes = 1024;
+  std::vector<std::vector<std::string> > pages;
+  auto status =
+      runDistributedQuery(request, [&pages](std::vector<std::string>& page) {
+        pages.push_back(page);
+        return Status(0, "OK");
+      });
+  FLAGS_distributed_page_bytes = page_bytes;
+  EXPECT_TRUE(status.ok());
+
+  // Each page is written once it holds the page size, rows are in order.
+  ASSERT_GT(pages.size(), 10U);
+  size_t rows = 0;
+  for (size_t i = 0; i < pages.size(); ++i) {
+    size_t size = 0;
+    for (size_t j = 0; j + 1 < pages[i].size(); ++j) {
+      size += pages[i][j].size();
+      EXPECT_LT(size - pages[i][j].size(), 1024U);
+    }
+    for (const auto& line : pages[i]) {
+      EXPECT_NE(line.find("\"id\":\"incident\""), std::string::npos);
+      EXPECT_NE(line.find("\"page\":" + std::to_string(i) + ","),
+                std::string::npos);
+      if (line.find("\"columns\":") != std::string::npos) {
+        rows++;
+        EXPECT_NE(line.find("\"n\":\"" + std::to_string(rows) + "\""),
+                  std::string::npos);
+      }
+    }
+  }
+  EXPECT_EQ(rows, 1000U);
+
+  // The last line reports the status and number of rows.
+  const auto& done = pages.back().back();
+  EXPECT_NE(done.find("\"status\":\"OK\",\"rows\":1000"), std::string::npos);
+}
+
+TEST_F(DistributedTests, test_run_distributed_query_failures) {
+  std::vector<std::string> lines;
+  LogBatchWriter writer = [&lines](std::vector<std::string>& page) {
+    lines.insert(lines.end(), page.begin(), page.end());
+    return Status(0, "OK");
+  };
+
+  // Only single statements are run.
+  DistributedQueryRequest request;
+  request.id = "compound";
+  request.query = "SELECT 1; SELECT 2";
+  EXPECT_FALSE(runDistributedQuery(request, writer).ok());
+  ASSERT_EQ(lines.size(), 1U);
+  EXPECT_NE(lines[0].find("\"rows\":0"), std::string::npos);
+  EXPECT_EQ(lines[0].find("\"status\":\"OK\""), std::string::npos);
+
+  // A query over its budget is interrupted and its failure is logged.
+  lines.clear();
+  request.id = "budget";
+  request.query =
+      "WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c) "
+      "SELECT count(*) FROM c";
+  request.timeout_ms = 10;
+  auto status = runDistributedQuery(request, writer);
+  EXPECT_FALSE(status.ok());
+  ASSERT_EQ(lines.size(), 1U);
+  EXPECT_NE(lines[0].find("exceeded its budget"), std::string::npos);
+
+  // A failed write stops the query.
+  lines.clear();
+  request.id = "write";
+  request.query = "SELECT 1 AS n UNION ALL SELECT 2";
+  request.timeout_ms = 0;
+  auto page_bytes = FLAGS_distributed_page_bytes;
+  FLAGS_distributed_page_bytes = 1;
+  size_t writes = 0;
+  status = runDistributedQuery(
+      request, [&writes](std::vector<std::string>& page) {
+        writes++;
+        return Status(1, "Logger unavailable");
+      });
+  FLAGS_distributed_page_bytes = page_bytes;
+  EXPECT_EQ(status.getMessage(), "Logger unavailable");
+  EXPECT_EQ(writes, 2U);
+}
+
+TEST_F(DistributedTests, test_stop_distributed) {
+  // The thread waiting for its next request returns once stopped.
+  auto interval = FLAGS_distributed_interval;
+  FLAGS_distributed_interval = 3600;
+  std::thread distributed(initializeDistributed);
+  stopDistributed();
+  distributed.join();
+  FLAGS_distributed_interval = interval;
+
+  // Queries run after the stop are cancelled, rather than run to their limits.
+  std::vector<std::string> lines;
+  DistributedQueryRequest request;
+  request.id = "stopped";
+  request.query =
+      "WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c) "
+      "SELECT count(*) FROM c";
+  auto status =
+      runDistributedQuery(request, [&lines](std::vector<std::string>& page) {
+        lines.insert(lines.end(), page.begin(), page.end());
+        return Status(0, "OK");
+      });
+  EXPECT_FALSE(status.ok());
+  ASSERT_EQ(lines.size(), 1U);
+  EXPECT_EQ(lines[0].find("\"status\":\"OK\""), std::string::npos);
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  osquery::initOsquery(argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,330 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <osquery/database/results.h>
+#include <osquery/scheduler.h>
+#include <osquery/tables.h>
+
+namespace osquery {
+
+/**
+ * @brief A bounded FIFO connecting two stages of the ResultsPipeline.
+ *
+ * Producers block while the queue is full, such that a slow consumer applies
+ * backpressure instead of buffering without limit.
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_((capacity > 0) ? capacity : 1), closed_(false) {}
+
+  /// Append an item, blocking while full. Returns false once closed.
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock,
+                   [this]() { return closed_ || items_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /// Append an item unless the queue is full or closed.
+  bool tryPush(T item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_ || items_.size() >= capacity_) {
+      return false;
+    }
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * @brief Remove every queued item, blocking while empty.
+   *
+   * @param items output, the items in the order they were pushed.
+   * @return false if the queue is closed and no items remain.
+   */
+  bool popAll(std::vector<T>& items) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return false;
+    }
+    for (auto& item : items_) {
+      items.push_back(std::move(item));
+    }
+    items_.clear();
+    not_full_.notify_all();
+    return true;
+  }
+
+  /**
+   * @brief Remove every queued item, blocking while empty for a timeout.
+   *
+   * @param items output, the items in the order they were pushed.
+   * @param timeout the longest time to wait for an item.
+   * @return false if the queue is closed and no items remain.
+   */
+  bool popAllFor(std::vector<T>& items, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait_for(
+        lock, timeout, [this]() { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return !closed_;
+    }
+    for (auto& item : items_) {
+      items.push_back(std::move(item));
+    }
+    items_.clear();
+    not_full_.notify_all();
+    return true;
+  }
+
+  /// Stop accepting items, the queued items may still be removed.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+  /// The number of queued items.
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return items_.size();
+  }
+
+ private:
+  size_t capacity_;
+  bool closed_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+/// The results of a scheduled query run, waiting to be diffed and logged.
+struct QueryExecution {
+  OsqueryScheduledQuery query;
+  QueryData results;
+  int unix_time;
+  /// The run's file read offsets, stored once its results are logged.
+  tables::ReadOffsetsRef offsets;
+};
+
+/**
+ * @brief Diff, serialize and log scheduled query results off the query path.
+ *
+ * launchQuery executes a query and adds its results. A diff thread compares
+ * them with the stored results and serializes the log item, and a log thread
+ * writes every serialized item waiting at once with a single logger call.
+ * Both stages are connected by bounded queues of `capacity` items, a slow
+ * logger stalls the query path only once they are full.
+ */
+class ResultsPipeline {
+ public:
+  /// Writes a batch of log strings, normally with logStringBatch.
+  typedef LogBatchWriter Writer;
+
+  ResultsPipeline(size_t capacity, const Writer& writer);
+  ~ResultsPipeline();
+
+  /**
+   * @brief Queue the results of a run, blocking while the pipeline is full.
+   *
+   * @return false if the pipeline was stopped.
+   */
+  bool add(const OsqueryScheduledQuery& query,
+           QueryData results,
+           int unix_time,
+           const tables::ReadOffsetsRef& offsets = nullptr);
+
+  /// Diff and log every queued result, then stop the stage threads.
+  void stop();
+
+ private:
+  /// The diff and serialize stage.
+  void diff();
+
+  /// The log stage.
+  void log();
+
+ private:
+  Writer writer_;
+  BoundedQueue<QueryExecution> executed_;
+  /// Pairs of query name and a batch of its serialized log strings.
+  BoundedQueue<std::pair<std::string, std::vector<std::string> > > serialized_;
+  std::thread differ_;
+  std::thread logger_;
+  std::once_flag stopped_;
+};
+
+typedef std::shared_ptr<ResultsPipeline> ResultsPipelineRef;
+
+/**
+ * @brief Limit the bytes of results logged by each query and in total.
+ *
+ * Quotas apply to windows of `interval` seconds. A query's log strings are
+ * logged while both its `max_bytes` and the global quota allow, then the
+ * rest of the window's strings are removed. With a `sample` of N, one in N
+ * of the removed strings is logged anyway. The first string over a quota in
+ * each window logs a warning describing the quota. A run's results are
+ * stored even if strings were removed, the removed bytes are counted.
+ */
+class OutputQuota {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  /// The quotas of the schedule_quota_* flags.
+  static OutputQuota& getInstance();
+
+  /**
+   * @param interval the seconds of each quota window.
+   * @param max_bytes the bytes logged by every query each window, or 0.
+   * @param sample log one in this many strings over quota, or 0 for none.
+   */
+  OutputQuota(size_t interval, size_t max_bytes, size_t sample);
+
+  /**
+   * @brief Remove a query's log strings that are over its quotas.
+   *
+   * A string is logged or removed whole, such that a query logging a single
+   * string per run is limited by runs.
+   *
+   * @return the bytes removed from the batch.
+   */
+  size_t limit(const OsqueryScheduledQuery& query,
+               std::vector<std::string>& batch,
+               const Clock::time_point& now = Clock::now());
+
+  /// Forget the bytes counted in the current windows.
+  void reset();
+
+ private:
+  /// The bytes counted in a quota window.
+  struct Window {
+    Clock::time_point start;
+    size_t bytes;
+    size_t limited;
+    bool warned;
+  };
+
+  /// Start a new window if the interval has passed.
+  void update(Window& window, const Clock::time_point& now);
+
+ private:
+  std::chrono::seconds interval_;
+  size_t max_bytes_;
+  size_t sample_;
+  Window global_;
+  std::map<std::string, Window> queries_;
+  std::mutex mutex_;
+};
+
+/**
+ * @brief Aggregate the numeric columns of a query's runs over a window.
+ *
+ * Metrics-like queries run often but are only needed as aggregates. Rows of
+ * each run are grouped by their key columns, a query's `rollup_key`, or the
+ * columns with non-numeric values if it has none. For each numeric column
+ * `c` the aggregate row has `c_min`, `c_max`, `c_avg`, and the last value as
+ * `c`; other columns keep their last value. A column is numeric while every
+ * one of its values in the window is a number.
+ */
+class QueryRollup {
+ public:
+  /**
+   * @param window the seconds of runs aggregated in each logged batch.
+   * @param key the columns identifying a row, empty for non-numeric columns.
+   */
+  QueryRollup(size_t window, const std::string& key);
+
+  /**
+   * @brief Add the rows of a run, ending the window if it has passed.
+   *
+   * @param results the run's rows.
+   * @param unix_time the time of the run.
+   * @param rollup output, the aggregates of the ended window, if any.
+   * @return true if a window ended and its aggregates are in rollup.
+   */
+  bool add(const QueryData& results, int unix_time, QueryData& rollup);
+
+  /// The aggregate rows of the runs added since the window started.
+  QueryData aggregate() const;
+
+ private:
+  /// A numeric column's aggregates, or the last value of any column.
+  struct Column {
+    std::string last;
+    std::string min;
+    std::string max;
+    double min_value;
+    double max_value;
+    double sum;
+    size_t count;
+    bool numeric;
+
+    Column() : min_value(0), max_value(0), sum(0), count(0), numeric(true) {}
+  };
+
+  /// The columns of the rows sharing a key.
+  typedef std::map<std::string, Column> Series;
+
+  /// The key of a row, its key column names and values.
+  std::string getKey(const Row& r) const;
+
+ private:
+  size_t window_;
+  std::vector<std::string> key_;
+  int start_;
+  std::map<std::string, Series> series_;
+};
+
+/**
+ * @brief Drop the rollups of queries a refreshed schedule does not roll up.
+ *
+ * A query removed from the schedule, or whose rollup is set back to 0, no
+ * longer ends its window, its partial aggregates are dropped instead.
+ *
+ * @param schedule the scheduled queries, as configured.
+ * @return the number of rollups dropped.
+ */
+size_t pruneRollups(const std::vector<OsqueryScheduledQuery>& schedule);
+
+/**
+ * @brief Execute a scheduled query and log its differential results.
+ *
+ * @param query the scheduled query to execute.
+ * @param snapshot optional tables shared with other due queries.
+ * @param pipeline optional pipeline to diff and log the results, otherwise
+ * they are logged before returning.
+ */
+void launchQuery(const OsqueryScheduledQuery& query,
+                 const tables::TableSnapshotRef& snapshot = nullptr,
+                 const ResultsPipelineRef& pipeline = nullptr);
+}
@@ -0,0 +1,220 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <osquery/scheduler.h>
+#include <osquery/tables.h>
+
+#include "osquery/scheduler/stats.h"
+
+namespace osquery {
+
+/**
+ * @brief Run due scheduled queries on the Dispatcher thread pool.
+ *
+ * The scheduler adds queries as they become due and continues counting
+ * seconds while they run. At most `concurrency` queries run at once, the rest
+ * wait in order. A query is never run while an earlier run of the same query
+ * is pending or running, overlapping runs are skipped.
+ *
+ * With budgets set, a query is only admitted while its projected cost and
+ * that of the running queries fit them. Queries are admitted in the order
+ * they became due: the first pending query that does not fit waits for
+ * running queries to finish and later queries wait behind it, such that an
+ * expensive query is not starved. A query runs alone whatever its cost.
+ */
+class SchedulerQueue : public std::enable_shared_from_this<SchedulerQueue> {
+ public:
+  /// The function executing a scheduled query, normally launchQuery.
+  typedef std::function<void(const OsqueryScheduledQuery&,
+                             const tables::TableSnapshotRef&)> Launcher;
+
+  /// Project the cost of a query's next run, normally from SchedulerStats.
+  typedef std::function<ScheduledQueryCost(const OsqueryScheduledQuery&)>
+      Estimator;
+
+  SchedulerQueue(const Launcher& launcher, size_t concurrency)
+      : launcher_(launcher),
+        concurrency_((concurrency > 0) ? concurrency : 1),
+        running_(0) {}
+
+  /**
+   * @brief Admit queries only while their projected costs fit budgets.
+   *
+   * @param estimator projects the cost of each query as it is admitted.
+   * @param budget the total cost of the running queries, a budget of 0
+   * memory or cpu is not enforced.
+   */
+  void setBudget(const Estimator& estimator, const ScheduledQueryCost& budget);
+
+  /**
+   * @brief Queue a due query.
+   *
+   * @param query the due query.
+   * @param snapshot the tables shared with queries due at the same time.
+   * @return false if a run of the query is already pending or running.
+   */
+  bool add(const OsqueryScheduledQuery& query,
+           const tables::TableSnapshotRef& snapshot = nullptr);
+
+  /// Block until no queries are pending or running.
+  void wait();
+
+  /// The number of queries waiting for an available run.
+  size_t pending();
+
+  /// The number of queries currently running.
+  size_t running();
+
+ private:
+  /// Start pending queries while below the limit and budgets, locked.
+  void dispatch();
+
+  /// Check if a query fits the budgets with the running queries, locked.
+  bool admits(const ScheduledQueryCost& cost) const;
+
+  /// Forget a query that finished or failed to start, locked.
+  void release(const std::string& name);
+
+  /// Run a query and start the next pending query.
+  void run(const OsqueryScheduledQuery& query,
+           const tables::TableSnapshotRef& snapshot);
+
+ private:
+  Launcher launcher_;
+  size_t concurrency_;
+  size_t running_;
+  std::deque<std::pair<OsqueryScheduledQuery, tables::TableSnapshotRef> >
+      pending_;
+  /// Names of the queries pending or running.
+  std::set<std::string> active_;
+  Estimator estimator_;
+  ScheduledQueryCost budget_;
+  /// The projected costs of the running queries and their total.
+  std::map<std::string, ScheduledQueryCost> costs_;
+  ScheduledQueryCost used_;
+  std::mutex mutex_;
+  std::condition_variable idle_;
+
+ private:
+  friend class SchedulerQueueRunner;
+};
+
+/**
+ * @brief Track the absolute deadline of each scheduled query.
+ *
+ * Deadlines are kept in a min-heap on the monotonic clock. A query's next
+ * deadline is its previous deadline plus its interval, such that the time
+ * spent running queries or waking late does not accumulate as drift.
+ */
+class ScheduleTimer {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  /// Get the multiplier applied to a query's interval.
+  typedef std::function<size_t(const OsqueryScheduledQuery&)> Backoff;
+
+  explicit ScheduleTimer(const Clock::time_point& start) : start_(start) {}
+
+  /// Stretch intervals when rescheduling, e.g., by SchedulerStats::backoff.
+  void setBackoff(const Backoff& backoff) { backoff_ = backoff; }
+
+  /**
+   * @brief Schedule a query, replacing a scheduled query of the same name.
+   *
+   * @param query the scheduled query, an interval below 1 is treated as 1.
+   * @param offset the seconds after the timer's start the query is first due.
+   */
+  void add(const OsqueryScheduledQuery& query, size_t offset);
+
+  /**
+   * @brief Stop scheduling a query.
+   *
+   * @return false if no query of that name is scheduled.
+   */
+  bool remove(const std::string& name);
+
+  /**
+   * @brief Take the queries due by a time and schedule their next runs.
+   *
+   * A query that missed several deadlines, such as after the system slept,
+   * is returned once and rescheduled at its first deadline after now.
+   *
+   * @param now the current time.
+   * @return the due queries, ordered by deadline.
+   */
+  std::vector<OsqueryScheduledQuery> due(const Clock::time_point& now);
+
+  /// The earliest deadline, the timer must not be empty.
+  Clock::time_point next() const { return deadlines_.top().first; }
+
+  bool empty() const { return slots_.empty(); }
+
+ private:
+  typedef std::pair<Clock::time_point, size_t> Deadline;
+
+  /// Drop the deadlines of removed queries from the top of the heap.
+  void prune();
+
+ private:
+  Clock::time_point start_;
+  Backoff backoff_;
+  std::vector<OsqueryScheduledQuery> queries_;
+  /// Indexes of the scheduled queries by name, removed queries are absent.
+  std::map<std::string, size_t> slots_;
+  /// Query indexes whose deadlines are discarded when they reach the top.
+  std::vector<bool> removed_;
+  /// Deadlines and query indexes, earliest first.
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> >
+      deadlines_;
+};
+
+/**
+ * @brief Compare a running schedule with a refreshed one by query name.
+ *
+ * Queries found in both with the same text, interval, and options are left
+ * alone, such that their deadlines and stored results are kept. A changed
+ * query is both removed and added.
+ *
+ * @param current the scheduled queries, as configured.
+ * @param refreshed the scheduled queries of the refreshed config.
+ * @param added output, the new and changed queries.
+ * @param removed output, the names of the removed and changed queries.
+ */
+void diffSchedules(const std::vector<OsqueryScheduledQuery>& current,
+                   const std::vector<OsqueryScheduledQuery>& refreshed,
+                   std::vector<OsqueryScheduledQuery>& added,
+                   std::vector<std::string>& removed);
+
+/**
+ * @brief Create the table snapshot for a group of due queries.
+ *
+ * @param queries the queries due at the same time.
+ * @param tables the tables read by each query, by query name.
+ * @return a snapshot sharing the tables read by more than one query, or
+ * nullptr if no table is shared.
+ */
+tables::TableSnapshotRef getSharedScans(
+    const std::vector<OsqueryScheduledQuery>& queries,
+    const std::map<std::string, std::set<std::string> >& tables);
+}
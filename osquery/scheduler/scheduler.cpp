@@ -8,18 +8,39 @@
  *
  */
  
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
 #include <random>
+#include <thread>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
 
 #include <osquery/config.h>
 #include <osquery/core.h>
 #include <osquery/database.h>
+#include <osquery/dispatcher.h>
 #include <osquery/flags.h>
 #include <osquery/logger.h>
 #include <osquery/sql.h>
 #include <osquery/scheduler.h>
 
+#include "osquery/scheduler/pipeline.h"
+#include "osquery/scheduler/queue.h"
+#include "osquery/scheduler/stats.h"
+#include "osquery/sql/sqlite_util.h"
+#include "osquery/sql/virtual_table.h"
+
 namespace osquery {
 
 DEFINE_osquery_flag(string,
@@ -32,7 +53,108 @@ DEFINE_osquery_flag(int32,
                     10,
                     "Percent to splay config times.");
 
-Status getHostIdentifier(std::string& ident) {
+DEFINE_osquery_flag(bool,
+                    schedule_shared_scans,
+                    true,
+                    "Generate tables read by several due queries once");
+
+DEFINE_osquery_flag(int32,
+                    schedule_max_cpu_percent,
+                    10,
+                    "Back off queries using more CPU of their interval (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    schedule_max_backoff,
+                    8,
+                    "The maximum multiple of an interval a query backs off to");
+
+DEFINE_osquery_flag(int32,
+                    schedule_results_queue,
+                    64,
+                    "Query results queued for diffing and logging (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    schedule_quota_interval,
+                    3600,
+                    "Seconds of each scheduled query output quota");
+
+DEFINE_osquery_flag(int32,
+                    schedule_max_bytes,
+                    0,
+                    "Bytes all queries may log each quota interval (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    schedule_quota_sample,
+                    0,
+                    "Log one in this many results over quota (0 drops all)");
+
+DEFINE_osquery_flag(int32,
+                    scheduler_concurrency,
+                    1,
+                    "The number of scheduled queries to run concurrently");
+
+DEFINE_osquery_flag(int32,
+                    schedule_memory_budget,
+                    10,
+                    "MB of memory growth of concurrent queries (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    schedule_cpu_budget,
+                    450,
+                    "CPU ms per second of concurrent queries (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    schedule_events_lag,
+                    60,
+                    "Seconds snapshot queries wait for late added events");
+
+DEFINE_osquery_flag(bool,
+                    schedule_events_snapshot,
+                    false,
+                    "Read each run's event tables from one snapshot");
+
+DEFINE_osquery_flag(bool,
+                    log_snapshot_unchanged,
+                    false,
+                    "Log a reference to unchanged snapshot results by hash");
+
+DEFINE_osquery_flag(int32,
+                    log_snapshot_full_interval,
+                    3600,
+                    "Seconds before unchanged snapshot results are logged "
+                    "in full again");
+
+DECLARE_string(log_result_format);
+
+DEFINE_osquery_flag(int32,
+                    config_refresh,
+                    0,
+                    "Seconds between schedule config reloads (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    schedule_catch_up,
+                    300,
+                    "Seconds to spread runs missed while stopped (0 off)");
+
+DEFINE_osquery_flag(int32,
+                    release_memory_rows,
+                    10000,
+                    "Release free memory after results this large (0 off)");
+
+#ifdef OSQUERY_TEST_DAEMON
+// If we're testing the daemon, only run for 15 seconds.
+const int kScheduleTimeout = 15;
+#else
+const int kScheduleTimeout = 0;
+#endif
+
+DEFINE_osquery_flag(int32,
+                    schedule_timeout,
+                    kScheduleTimeout,
+                    "Seconds to run the schedule before returning (0 forever)");
+
+/// Resolve the host identifier named by host_identifier, without caching.
+static Status resolveHostIdentifier(std::string& ident) {
   std::shared_ptr<DBHandle> db;
   try {
     db = DBHandle::getInstance();
@@ -73,37 +195,599 @@ Status getHostIdentifier(std::string& ident) {
   }
 }
 
-void launchQuery(const OsqueryScheduledQuery& query) {
-  LOG(INFO) << "Executing query: " << query.query;
-  int unix_time = std::time(0);
-  auto sql = SQL(query.query);
-  if (!sql.ok()) {
-    LOG(ERROR) << "Error executing query (" << query.query
-               << "): " << sql.getMessageString();
+Status getHostIdentifier(std::string& ident) {
+  // The identifier is resolved when first needed and again only if the flag
+  // is changed, for example by a config option.
+  static std::mutex mutex;
+  static std::string cached_ident;
+  static std::string cached_source;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!cached_ident.empty() && cached_source == FLAGS_host_identifier) {
+    ident = cached_ident;
+    return Status(0, "OK");
+  }
+
+  auto status = resolveHostIdentifier(ident);
+  if (status.ok() && !ident.empty()) {
+    cached_ident = ident;
+    cached_source = FLAGS_host_identifier;
+  }
+  return status;
+}
+
+/// The weight of a new run in a query's average performance.
+const double kPerformanceWeight = 0.2;
+
+/// The seconds due queries are deferred when the worker is under pressure.
+const size_t kPressureDeferSeconds = 10;
+
+/// Set by deferScheduledQueries, consumed by the scheduler loop.
+static std::atomic<bool> kDeferQueries(false);
+
+SchedulerStats& SchedulerStats::getInstance() {
+  static SchedulerStats stats;
+  return stats;
+}
+
+void SchedulerStats::record(const OsqueryScheduledQuery& query,
+                            double wall_time,
+                            double user_time,
+                            double system_time,
+                            size_t rows,
+                            double memory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& performance = queries_[query.name];
+  double weight = (performance.executions == 0) ? 1 : kPerformanceWeight;
+  double cpu_time = user_time + system_time;
+  performance.executions++;
+  performance.last_wall_time = wall_time;
+  performance.max_wall_time = std::max(performance.max_wall_time, wall_time);
+  performance.user_time += user_time;
+  performance.system_time += system_time;
+  performance.output_rows += rows;
+  performance.wall_time += weight * (wall_time - performance.wall_time);
+  performance.cpu_time += weight * (cpu_time - performance.cpu_time);
+  performance.rows += weight * ((double)rows - performance.rows);
+  performance.memory += weight * (memory - performance.memory);
+  performance.max_memory = std::max(performance.max_memory, memory);
+
+  if (FLAGS_schedule_max_cpu_percent <= 0 || query.interval <= 0) {
+    performance.backoff = 1;
     return;
   }
 
-  auto dbQuery = Query(query);
-  DiffResults diff_results;
-  auto status = dbQuery.addNewResults(sql.rows(), diff_results, unix_time);
+  // The percent of the query's effective interval spent on the CPU.
+  double interval_ms = query.interval * 1000.0;
+  double percent = 100 * performance.cpu_time / interval_ms;
+  size_t max_backoff = std::max(FLAGS_schedule_max_backoff, 1);
+  if (percent > FLAGS_schedule_max_cpu_percent * performance.backoff &&
+      performance.backoff < max_backoff) {
+    performance.backoff = std::min(performance.backoff * 2, max_backoff);
+    LOG(WARNING) << "Scheduled query " << query.name << " uses " << percent
+                 << "% CPU, backing off to " << performance.backoff
+                 << "x its interval";
+  } else if (performance.backoff > 1 &&
+             2 * percent / performance.backoff <
+                 FLAGS_schedule_max_cpu_percent / 2.0) {
+    performance.backoff /= 2;
+    VLOG(1) << "Scheduled query " << query.name << " reduced backoff to "
+            << performance.backoff << "x its interval";
+  }
+}
+
+void SchedulerStats::recordResults(const std::string& name,
+                                   size_t added,
+                                   size_t removed,
+                                   size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& performance = queries_[name];
+  performance.added += added;
+  performance.removed += removed;
+  performance.bytes_logged += bytes;
+}
+
+void SchedulerStats::recordLimited(const std::string& name, size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queries_[name].bytes_limited += bytes;
+}
+
+void SchedulerStats::recordError(const std::string& name,
+                                 const std::string& error) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queries_[name].last_error = error;
+}
+
+void SchedulerStats::recordPlan(const std::string& name,
+                                const QueryPlan& plan) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queries_[name].plan = plan;
+}
+
+size_t SchedulerStats::backoff(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto performance = queries_.find(name);
+  return (performance != queries_.end()) ? performance->second.backoff : 1;
+}
+
+ScheduledQueryCost SchedulerStats::cost(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ScheduledQueryCost cost;
+  auto performance = queries_.find(name);
+  if (performance != queries_.end()) {
+    cost.memory = performance->second.max_memory;
+    if (performance->second.wall_time > 0) {
+      cost.cpu = 1000 * performance->second.cpu_time /
+                 performance->second.wall_time;
+    }
+  }
+  return cost;
+}
+
+bool SchedulerStats::get(const std::string& name,
+                         QueryPerformance& performance) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto result = queries_.find(name);
+  if (result == queries_.end()) {
+    return false;
+  }
+  performance = result->second;
+  return true;
+}
+
+void SchedulerStats::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queries_.clear();
+}
+
+OutputQuota& OutputQuota::getInstance() {
+  static OutputQuota quota(std::max(FLAGS_schedule_quota_interval, 1),
+                           std::max(FLAGS_schedule_max_bytes, 0),
+                           std::max(FLAGS_schedule_quota_sample, 0));
+  return quota;
+}
+
+OutputQuota::OutputQuota(size_t interval, size_t max_bytes, size_t sample)
+    : interval_(std::max(interval, (size_t)1)),
+      max_bytes_(max_bytes),
+      sample_(sample) {
+  global_ = {Clock::now(), 0, 0, false};
+}
+
+void OutputQuota::update(Window& window, const Clock::time_point& now) {
+  if (now - window.start >= interval_) {
+    window = {now, 0, 0, false};
+  }
+}
+
+/// Warn, as a JSON object of the quota's details, that output is limited.
+static void warnOverQuota(const OsqueryScheduledQuery& query,
+                          const std::string& scope,
+                          size_t max_bytes,
+                          size_t interval,
+                          size_t sample) {
+  std::string json = "{\"name\":";
+  appendJSONString(json, query.name);
+  json.append(",\"scope\":");
+  appendJSONString(json, scope);
+  json.append(",\"max_bytes\":");
+  appendJSONString(json, std::to_string(max_bytes));
+  json.append(",\"interval\":");
+  appendJSONString(json, std::to_string(interval));
+  json.append(",\"action\":");
+  appendJSONString(json, (sample > 0) ? "sample" : "truncate");
+  json.push_back('}');
+  LOG(WARNING) << "Scheduled query output over quota: " << json;
+}
+
+size_t OutputQuota::limit(const OsqueryScheduledQuery& query,
+                          std::vector<std::string>& batch,
+                          const Clock::time_point& now) {
+  if (max_bytes_ == 0 && query.max_bytes <= 0) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  update(global_, now);
+  auto it = queries_.find(query.name);
+  if (it == queries_.end()) {
+    Window window = {now, 0, 0, false};
+    it = queries_.insert(std::make_pair(query.name, window)).first;
+  }
+  auto& window = it->second;
+  update(window, now);
+
+  size_t removed = 0;
+  size_t kept = 0;
+  size_t query_bytes = std::max(query.max_bytes, 0);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    auto size = batch[i].size();
+    bool over_query = (query_bytes > 0 && window.bytes + size > query_bytes);
+    bool over_global = (max_bytes_ > 0 && global_.bytes + size > max_bytes_);
+    bool keep = (!over_query && !over_global);
+    if (keep) {
+      window.bytes += size;
+      global_.bytes += size;
+    } else {
+      auto interval = static_cast<size_t>(interval_.count());
+      if (over_query && !window.warned) {
+        window.warned = true;
+        warnOverQuota(query, "query", query_bytes, interval, sample_);
+      } else if (!over_query && !global_.warned) {
+        global_.warned = true;
+        warnOverQuota(query, "global", max_bytes_, interval, sample_);
+      }
+
+      window.limited++;
+      global_.limited++;
+      keep = (sample_ > 0 && window.limited % sample_ == 0);
+      if (!keep) {
+        removed += size;
+      }
+    }
+
+    if (keep) {
+      if (kept != i) {
+        batch[kept] = std::move(batch[i]);
+      }
+      kept++;
+    }
+  }
+  batch.resize(kept);
+  return removed;
+}
+
+void OutputQuota::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  global_ = {Clock::now(), 0, 0, false};
+  queries_.clear();
+}
+
+/// Parse a rolled up value, true if it is a finite number.
+static bool getRollupNumber(const std::string& value, double& number) {
+  if (value.empty()) {
+    return false;
+  }
+  char* end = nullptr;
+  errno = 0;
+  number = strtod(value.c_str(), &end);
+  return *end == 0 && errno == 0 && std::isfinite(number);
+}
+
+QueryRollup::QueryRollup(size_t window, const std::string& key)
+    : window_(window), key_(split(key, ",")), start_(0) {}
+
+std::string QueryRollup::getKey(const Row& r) const {
+  std::string key;
+  double number = 0;
+  if (key_.empty()) {
+    for (const auto& column : r) {
+      if (!getRollupNumber(column.second, number)) {
+        key += column.first + '=' + column.second + '\0';
+      }
+    }
+    return key;
+  }
+
+  for (const auto& column : key_) {
+    auto value = r.find(column);
+    key += column + '=' + ((value == r.end()) ? "" : value->second) + '\0';
+  }
+  return key;
+}
+
+bool QueryRollup::add(const QueryData& results,
+                      int unix_time,
+                      QueryData& rollup) {
+  bool ended = false;
+  if (start_ > 0 && unix_time >= start_ + (int)window_) {
+    rollup = aggregate();
+    series_.clear();
+    start_ = 0;
+    ended = true;
+  }
+  if (start_ == 0) {
+    start_ = unix_time;
+  }
+
+  for (const auto& r : results) {
+    auto& series = series_[getKey(r)];
+    for (const auto& value : r) {
+      auto& column = series[value.first];
+      column.last = value.second;
+      double number = 0;
+      if (!column.numeric ||
+          std::find(key_.begin(), key_.end(), value.first) != key_.end() ||
+          !getRollupNumber(value.second, number)) {
+        column.numeric = false;
+        continue;
+      }
+
+      if (column.count == 0 || number < column.min_value) {
+        column.min_value = number;
+        column.min = value.second;
+      }
+      if (column.count == 0 || number > column.max_value) {
+        column.max_value = number;
+        column.max = value.second;
+      }
+      column.sum += number;
+      column.count++;
+    }
+  }
+  return ended;
+}
+
+QueryData QueryRollup::aggregate() const {
+  QueryData results;
+  for (const auto& series : series_) {
+    Row r;
+    for (const auto& column : series.second) {
+      r[column.first] = column.second.last;
+      if (!column.second.numeric || column.second.count == 0) {
+        continue;
+      }
+
+      // Averages are printed with the precision SQLite prints a REAL.
+      char average[32];
+      snprintf(average,
+               sizeof(average),
+               "%.15g",
+               column.second.sum / column.second.count);
+      r[column.first + "_min"] = column.second.min;
+      r[column.first + "_max"] = column.second.max;
+      r[column.first + "_avg"] = average;
+    }
+    results.push_back(std::move(r));
+  }
+  return results;
+}
+
+/// The window and key of each rolled up query, and its rollup, by name.
+static std::map<std::string,
+                std::pair<std::string, std::shared_ptr<QueryRollup> > >
+    kRollups;
+static std::mutex kRollupsMutex;
+
+/**
+ * @brief Add a run of a rolled up query.
+ *
+ * @return true if the query's window ended, rollup is its aggregate rows.
+ */
+static bool addRollupResults(const OsqueryScheduledQuery& query,
+                             const QueryData& results,
+                             int unix_time,
+                             QueryData& rollup) {
+  auto config = std::to_string(query.rollup) + ";" + query.rollup_key;
+  std::lock_guard<std::mutex> lock(kRollupsMutex);
+  auto& state = kRollups[query.name];
+  if (state.second == nullptr || state.first != config) {
+    // A changed window or key starts over, the aggregates are not comparable.
+    state.first = config;
+    state.second =
+        std::make_shared<QueryRollup>(query.rollup, query.rollup_key);
+  }
+  return state.second->add(results, unix_time, rollup);
+}
+
+size_t pruneRollups(const std::vector<OsqueryScheduledQuery>& schedule) {
+  std::set<std::string> rolled_up;
+  for (const auto& query : schedule) {
+    if (query.rollup > 0) {
+      rolled_up.insert(query.name);
+    }
+  }
+
+  size_t pruned = 0;
+  std::lock_guard<std::mutex> lock(kRollupsMutex);
+  for (auto it = kRollups.begin(); it != kRollups.end();) {
+    if (rolled_up.count(it->first) == 0) {
+      it = kRollups.erase(it);
+      pruned++;
+    } else {
+      ++it;
+    }
+  }
+  return pruned;
+}
+
+/// The current resident size of the process in bytes, or its peak if the
+/// platform does not report the current size.
+static double getResidentSize() {
+#if defined(__linux__)
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm != nullptr) {
+    unsigned long pages = 0, resident = 0;
+    int fields = fscanf(statm, "%lu %lu", &pages, &resident);
+    fclose(statm);
+    if (fields == 2) {
+      return (double)resident * sysconf(_SC_PAGESIZE);
+    }
+  }
+#elif defined(__APPLE__)
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(),
+                MACH_TASK_BASIC_INFO,
+                (task_info_t)&info,
+                &count) == KERN_SUCCESS) {
+    return info.resident_size;
+  }
+#endif
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024.0;
+#endif
+}
+
+/// The CPU times in milliseconds of the calling thread and the current
+/// resident size of the process in bytes.
+static void getResourceUsage(double& user_time,
+                             double& system_time,
+                             double& memory) {
+  struct rusage usage;
+#ifdef RUSAGE_THREAD
+  getrusage(RUSAGE_THREAD, &usage);
+#else
+  getrusage(RUSAGE_SELF, &usage);
+#endif
+  user_time = usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0;
+  system_time =
+      usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+  memory = getResidentSize();
+}
+
+/// Return the pages of a large, now freed, result to the operating system.
+static void releaseResultsMemory(size_t rows) {
+  if (FLAGS_release_memory_rows > 0 &&
+      rows >= (size_t)FLAGS_release_memory_rows) {
+    releaseFreeMemory();
+  }
+}
+
+/// The hex content hash of a snapshot's rows.
+static std::string getSnapshotHash(const QueryData& results) {
+  char hash[17];
+  snprintf(hash,
+           sizeof(hash),
+           "%016llx",
+           (unsigned long long)getQueryDataFingerprint(results));
+  return hash;
+}
+
+/**
+ * @brief True if a snapshot's hash is that of its last results logged in full.
+ *
+ * The hash is stored once the results are handed to the logger, which may
+ * still drop them. A hash older than `--log_snapshot_full_interval` seconds
+ * is not referenced, the results are logged in full again.
+ */
+static bool isSnapshotUnchanged(const std::string& name,
+                                const std::string& hash) {
+  std::shared_ptr<DBHandle> db;
+  try {
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    return false;
+  }
+
+  std::string last;
+  if (db == nullptr || !db->Get(kSnapshots, name, last).ok()) {
+    return false;
+  }
+
+  // The stored value is the hash and the time it was logged in full.
+  auto separator = last.find(':');
+  if (separator == std::string::npos || last.substr(0, separator) != hash) {
+    return false;
+  }
+  auto logged = strtoll(last.c_str() + separator + 1, nullptr, 10);
+  return getUnixTime() - logged <
+         (long long)std::max(FLAGS_log_snapshot_full_interval, 0);
+}
+
+/// Store the hash of a snapshot's results, once they are all logged.
+static void setSnapshotHash(const std::string& name, const std::string& hash) {
+  try {
+    auto db = DBHandle::getInstance();
+    if (db != nullptr) {
+      db->Put(kSnapshots,
+              name,
+              (hash.empty()) ? ""
+                             : hash + ":" + std::to_string(getUnixTime()));
+    }
+  } catch (const std::runtime_error& e) {
+    // The next results are logged in full.
+  }
+}
+
+/// Store the results of a differential query once its diff is logged.
+static Status storePendingResults(DBBatch& pending) {
+  if (pending.size() == 0) {
+    return Status(0, "OK");
+  }
+
+  Status status;
+  try {
+    auto db = DBHandle::getInstance();
+    status = (db != nullptr) ? db->Write(pending)
+                             : Status(1, "Cannot open the database");
+  } catch (const std::runtime_error& e) {
+    status = Status(1, e.what());
+  }
   if (!status.ok()) {
-    LOG(ERROR) << "Error adding new results to database: " << status.what();
-    return;
+    return Status(1,
+                  "Error adding new results to database: " + status.what());
   }
+  return Status(0, "OK");
+}
 
+/**
+ * @brief Diff the results of a run and serialize the log item.
+ *
+ * @param offsets the run's file read offsets, stored with its results.
+ * @param writer receives each batch of the serialized log item within the
+ * query's output quotas, it is not called if nothing changed.
+ */
+static Status serializeQueryResults(const OsqueryScheduledQuery& query,
+                                    QueryData results,
+                                    int unix_time,
+                                    const tables::ReadOffsetsRef& offsets,
+                                    const LogBatchWriter& writer) {
+  TraceSpan span("serializeQueryResults", query.name);
+  DiffResults diff_results;
+  std::string snapshot_hash;
+  // The results of a differential query, and the offsets of the files read,
+  // are stored once the diff is logged.
+  DBBatch pending;
+  if (offsets != nullptr) {
+    for (const auto& offset : offsets->take()) {
+      pending.Put(kFileOffsets, offset.first, offset.second);
+    }
+  }
+  if (query.rollup > 0) {
+    QueryData rollup;
+    if (!addRollupResults(query, results, unix_time, rollup)) {
+      // Runs are aggregated until the window ends.
+      return storePendingResults(pending);
+    }
+    // The aggregates of a window are logged whole, as a snapshot.
+    diff_results.added = std::move(rollup);
+  } else if (query.snapshot) {
+    // References to unchanged results are JSON, frames log every result.
+    if (FLAGS_log_snapshot_unchanged && FLAGS_log_result_format != "frames") {
+      snapshot_hash = getSnapshotHash(results);
+    }
+    // Snapshot queries log every result without storing them for a diff.
+    diff_results.added = std::move(results);
+  } else {
+    auto dbQuery = Query(query);
+    auto status = dbQuery.addNewResults(
+        std::move(results), diff_results, unix_time, pending);
+    if (!status.ok()) {
+      return Status(1,
+                    "Error adding new results to database: " + status.what());
+    }
+  }
+
+  SchedulerStats::getInstance().recordResults(
+      query.name, diff_results.added.size(), diff_results.removed.size(), 0);
   if (diff_results.added.size() == 0 && diff_results.removed.size() == 0) {
-    // No diff results or events to emit.
-    return;
+    // No diff results or events to emit, the next snapshot is logged.
+    if (!snapshot_hash.empty()) {
+      setSnapshotHash(query.name, "");
+    }
+    return storePendingResults(pending);
   }
 
   ScheduledQueryLogItem item;
-  Status s;
-
-  item.diffResults = diff_results;
+  item.diffResults = std::move(diff_results);
   item.name = query.name;
 
   std::string ident;
-  s = getHostIdentifier(ident);
+  auto s = getHostIdentifier(ident);
   if (s.ok()) {
     item.hostIdentifier = ident;
   } else {
@@ -118,23 +802,550 @@ void launchQuery(const OsqueryScheduledQuery& query) {
 
   LOG(INFO) << "Found results for query " << query.name
             << " for host: " << ident;
-  s = logScheduledQueryLogItem(item);
-  if (!s.ok()) {
-    LOG(ERROR) << "Error logging the results of query \"" << query.query << "\""
-               << ": " << s.toString();
+
+  // Results over the query's output quotas are not logged.
+  bool complete = true;
+  auto limited = [&query, &writer, &complete](std::vector<std::string>& batch) {
+    auto bytes = OutputQuota::getInstance().limit(query, batch);
+    if (bytes > 0) {
+      SchedulerStats::getInstance().recordLimited(query.name, bytes);
+      complete = false;
+    }
+    if (batch.empty()) {
+      return Status(0, "OK");
+    }
+    return writer(batch);
+  };
+
+  // Unchanged snapshots are logged as a reference to the last logged rows.
+  item.snapshotHash = snapshot_hash;
+  if (!snapshot_hash.empty() &&
+      isSnapshotUnchanged(query.name, snapshot_hash)) {
+    std::vector<std::string> batch(1);
+    serializeUnchangedSnapshotJSON(item, batch[0]);
+    auto status = limited(batch);
+    return (status.ok()) ? storePendingResults(pending) : status;
+  }
+
+  auto status = serializeScheduledQueryLogItemForLogger(item, limited);
+  if (!snapshot_hash.empty()) {
+    // Only results logged in full may be referenced.
+    setSnapshotHash(query.name, (status.ok() && complete) ? snapshot_hash : "");
+  }
+  if (!status.ok()) {
+    return status;
   }
+  // A diff partly dropped by the output quotas is stored as well, the bytes
+  // dropped are counted, otherwise the logged part is logged again each run.
+  return storePendingResults(pending);
 }
 
-void launchQueries(const std::vector<OsqueryScheduledQuery>& queries,
-                   const int64_t& second) {
+/// The kEvents key of a snapshot query's high-water mark.
+static std::string getEventsMarkKey(const std::string& name) {
+  return "mark." + name;
+}
+
+/**
+ * @brief Get the event window of a snapshot query's run.
+ *
+ * Snapshot queries log every result, so each run reads only the events added
+ * since the previous run: from the stored high-water mark up to, and not
+ * including, `schedule_events_lag` seconds before the run started.
+ *
+ * Publishers may add an event some time after the event's time, the lag
+ * leaves such events in the next run's window rather than behind the mark.
+ *
+ * With `schedule_events_snapshot` every event table the run reads, such as
+ * the subscribers of a join, reads one backing store snapshot taken here.
+ * Events in the window were added at least the lag before, and have been
+ * written from the subscribers' queues, but the recent events kept in memory
+ * are not used.
+ */
+static tables::EventWindow getEventWindow(const OsqueryScheduledQuery& query,
+                                          int unix_time) {
+  auto lag = std::max(FLAGS_schedule_events_lag, 0);
+  tables::EventWindow events(0, std::max(unix_time - lag, 1));
+  std::shared_ptr<DBHandle> db;
+  try {
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    return events;
+  }
+  if (db != nullptr && FLAGS_schedule_events_snapshot) {
+    events.snapshot = db->getSnapshot();
+  }
+
+  std::string mark;
+  if (db == nullptr ||
+      !db->Get(kEvents, getEventsMarkKey(query.name), mark).ok()) {
+    return events;
+  }
+  events.start = std::strtoul(mark.c_str(), nullptr, 10);
+  // A clock set back leaves the mark, rather than reading events again.
+  events.stop = std::max(events.stop, events.start);
+  return events;
+}
+
+/// Store the high-water mark of a snapshot query's successful run.
+static void setEventsMark(const OsqueryScheduledQuery& query,
+                          const tables::EventWindow& events) {
+  std::shared_ptr<DBHandle> db;
+  try {
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    return;
+  }
+
+  if (db != nullptr) {
+    db->Put(
+        kEvents, getEventsMarkKey(query.name), std::to_string(events.stop));
+  }
+}
+
+/// The unix time a query's last successful run started, or 0 if unknown.
+static int getLastRun(const std::string& name) {
+  std::shared_ptr<DBHandle> db;
+  try {
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    return 0;
+  }
+
+  std::string last_run;
+  if (db == nullptr || !db->Get(kQueryRuns, name, last_run).ok()) {
+    return 0;
+  }
+  return std::atoi(last_run.c_str());
+}
+
+/// Store the start time of a query's successful run.
+static void setLastRun(const std::string& name, int unix_time) {
+  std::shared_ptr<DBHandle> db;
+  try {
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    return;
+  }
+
+  if (db != nullptr) {
+    db->Put(kQueryRuns, name, std::to_string(unix_time));
+  }
+}
+
+void launchQuery(const OsqueryScheduledQuery& query,
+                 const tables::TableSnapshotRef& snapshot,
+                 const ResultsPipelineRef& pipeline) {
+  LOG(INFO) << "Executing query: " << query.query;
+  SampleTag tag(SAMPLE_TAG_QUERY, query.name);
+  TraceSpan span("launchQuery", query.name);
+  int unix_time = std::time(0);
+  tables::QueryBudgetRef budget;
+  if (query.timeout_ms > 0 || query.cpu_ms > 0) {
+    budget = std::make_shared<tables::QueryBudget>(std::max(query.timeout_ms, 0),
+                                                   std::max(query.cpu_ms, 0));
+  }
+
+  double user_start, system_start, memory_start;
+  getResourceUsage(user_start, system_start, memory_start);
+  auto start = std::chrono::steady_clock::now();
+
+  tables::EventWindow events;
+  if (query.snapshot) {
+    events = getEventWindow(query, unix_time);
+  }
+  events.offsets = std::make_shared<tables::ReadOffsets>(query.name);
+
+  // Scheduled queries repeat, reuse their prepared statements.
+  QueryData results;
+  auto status = queryCached(query.query, results, budget, snapshot, events);
+
+  double user_end, system_end, memory_end;
+  getResourceUsage(user_end, system_end, memory_end);
+  auto wall_time = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start).count() /
+                   1000.0;
+  auto& stats = SchedulerStats::getInstance();
+  stats.record(query,
+               wall_time,
+               user_end - user_start,
+               system_end - system_start,
+               results.size(),
+               std::max(memory_end - memory_start, 0.0));
+  if (!status.ok() && budget != nullptr && budget->exceeded()) {
+    LOG(ERROR) << "Cancelled query " << query.name << " exceeding its budget "
+               << "(timeout_ms: " << query.timeout_ms
+               << ", cpu_ms: " << query.cpu_ms << ")";
+    stats.recordError(query.name, status.toString());
+    return;
+  } else if (!status.ok()) {
+    LOG(ERROR) << "Error executing query (" << query.query
+               << "): " << status.toString();
+    stats.recordError(query.name, status.toString());
+    return;
+  }
+
+  if (query.snapshot) {
+    // The next run reads the events from the end of this run's window.
+    setEventsMark(query, events);
+  }
+  // A restarted daemon catches up on the runs missed since.
+  setLastRun(query.name, unix_time);
+
+  if (pipeline != nullptr) {
+    if (!pipeline->add(
+            query, std::move(results), unix_time, events.offsets)) {
+      LOG(ERROR) << "Dropping the results of query " << query.name
+                 << ", the results pipeline is stopped";
+    }
+    return;
+  }
+
+  // Results are logged as they are serialized, a batch at a time.
+  auto rows = results.size();
+  status = serializeQueryResults(
+      query,
+      std::move(results),
+      unix_time,
+      events.offsets,
+      [&query, &stats](std::vector<std::string>& batch) {
+        size_t bytes = 0;
+        for (const auto& line : batch) {
+          bytes += line.size();
+        }
+        auto status = logStringBatch(std::move(batch));
+        if (!status.ok()) {
+          return Status(1,
+                        "Error logging the results of query \"" +
+                            query.query + "\": " + status.toString());
+        }
+        stats.recordResults(query.name, 0, 0, bytes);
+        return status;
+      });
+  releaseResultsMemory(rows);
+  if (!status.ok()) {
+    LOG(ERROR) << status.toString();
+    stats.recordError(query.name, status.toString());
+  }
+}
+
+ResultsPipeline::ResultsPipeline(size_t capacity, const Writer& writer)
+    : writer_(writer),
+      executed_(capacity),
+      serialized_(capacity),
+      differ_(&ResultsPipeline::diff, this),
+      logger_(&ResultsPipeline::log, this) {}
+
+ResultsPipeline::~ResultsPipeline() { stop(); }
+
+bool ResultsPipeline::add(const OsqueryScheduledQuery& query,
+                          QueryData results,
+                          int unix_time,
+                          const tables::ReadOffsetsRef& offsets) {
+  QueryExecution execution = {query, std::move(results), unix_time, offsets};
+  return executed_.push(std::move(execution));
+}
+
+void ResultsPipeline::stop() {
+  std::call_once(stopped_, [this]() {
+    // Close each stage after its producer has finished.
+    executed_.close();
+    differ_.join();
+    serialized_.close();
+    logger_.join();
+  });
+}
+
+void ResultsPipeline::diff() {
+  std::vector<QueryExecution> executions;
+  while (executed_.popAll(executions)) {
+    for (auto& execution : executions) {
+      const auto& name = execution.query.name;
+      auto rows = execution.results.size();
+      auto status = serializeQueryResults(
+          execution.query,
+          std::move(execution.results),
+          execution.unix_time,
+          execution.offsets,
+          [this, &name](std::vector<std::string>& batch) {
+            // Each batch waits in the bounded queue, not the whole item.
+            if (!serialized_.push(std::make_pair(name, std::move(batch)))) {
+              return Status(1, "The results pipeline is stopped");
+            }
+            return Status(0, "OK");
+          });
+      releaseResultsMemory(rows);
+      if (!status.ok()) {
+        LOG(ERROR) << status.toString();
+        SchedulerStats::getInstance().recordError(name, status.toString());
+      }
+    }
+    executions.clear();
+  }
+}
+
+void ResultsPipeline::log() {
+  std::vector<std::pair<std::string, std::vector<std::string> > > items;
+  while (serialized_.popAll(items)) {
+    // Every log string waiting is written with one call to the logger.
+    std::vector<std::string> batch;
+    std::vector<size_t> bytes(items.size(), 0);
+    for (size_t i = 0; i < items.size(); ++i) {
+      for (auto& line : items[i].second) {
+        bytes[i] += line.size();
+        batch.push_back(std::move(line));
+      }
+    }
+
+    auto lines = batch.size();
+    auto status = writer_(batch);
+    if (!status.ok()) {
+      LOG(ERROR) << "Error logging " << lines << " results of "
+                 << items.size() << " queries: " << status.toString();
+    }
+    auto& stats = SchedulerStats::getInstance();
+    for (size_t i = 0; i < items.size(); ++i) {
+      if (status.ok()) {
+        stats.recordResults(items[i].first, 0, 0, bytes[i]);
+      } else {
+        stats.recordError(items[i].first, status.toString());
+      }
+    }
+    items.clear();
+  }
+}
+
+/// A Dispatcher task running one query for a SchedulerQueue.
+class SchedulerQueueRunner : public apache::thrift::concurrency::Runnable {
+ public:
+  SchedulerQueueRunner(const std::shared_ptr<SchedulerQueue>& queue,
+                       const OsqueryScheduledQuery& query,
+                       const tables::TableSnapshotRef& snapshot)
+      : queue_(queue), query_(query), snapshot_(snapshot) {}
+
+  void run() { queue_->run(query_, snapshot_); }
+
+ private:
+  std::shared_ptr<SchedulerQueue> queue_;
+  OsqueryScheduledQuery query_;
+  tables::TableSnapshotRef snapshot_;
+};
+
+bool SchedulerQueue::add(const OsqueryScheduledQuery& query,
+                         const tables::TableSnapshotRef& snapshot) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (active_.count(query.name) > 0) {
+    return false;
+  }
+
+  active_.insert(query.name);
+  pending_.push_back(std::make_pair(query, snapshot));
+  dispatch();
+  return true;
+}
+
+void SchedulerQueue::setBudget(const Estimator& estimator,
+                               const ScheduledQueryCost& budget) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  estimator_ = estimator;
+  budget_ = budget;
+}
+
+bool SchedulerQueue::admits(const ScheduledQueryCost& cost) const {
+  if (running_ == 0) {
+    return true;
+  }
+  bool memory =
+      budget_.memory <= 0 || used_.memory + cost.memory <= budget_.memory;
+  bool cpu = budget_.cpu <= 0 || used_.cpu + cost.cpu <= budget_.cpu;
+  return memory && cpu;
+}
+
+void SchedulerQueue::dispatch() {
+  while (running_ < concurrency_ && !pending_.empty()) {
+    auto query = pending_.front().first;
+    ScheduledQueryCost cost;
+    if (estimator_ != nullptr) {
+      cost = estimator_(query);
+    }
+    if (!admits(cost)) {
+      // Later queries wait behind the first due query, it is not starved.
+      VLOG(1) << "Scheduled query " << query.name
+              << " waits for running queries within budget";
+      return;
+    }
+
+    auto task = std::make_shared<SchedulerQueueRunner>(
+        shared_from_this(), query, pending_.front().second);
+    pending_.pop_front();
+    running_++;
+    costs_[query.name] = cost;
+    used_.memory += cost.memory;
+    used_.cpu += cost.cpu;
+    auto status = Dispatcher::getInstance().add(task);
+    if (!status.ok()) {
+      // The query is skipped, its next interval will queue it again.
+      LOG(ERROR) << "Could not dispatch query " << query.name << ": "
+                 << status.what();
+      release(query.name);
+    }
+  }
+}
+
+void SchedulerQueue::release(const std::string& name) {
+  auto cost = costs_.find(name);
+  if (cost != costs_.end()) {
+    used_.memory -= cost->second.memory;
+    used_.cpu -= cost->second.cpu;
+    costs_.erase(cost);
+  }
+  running_--;
+  active_.erase(name);
+}
+
+void SchedulerQueue::run(const OsqueryScheduledQuery& query,
+                         const tables::TableSnapshotRef& snapshot) {
+  launcher_(query, snapshot);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  release(query.name);
+  dispatch();
+  if (running_ == 0 && pending_.empty()) {
+    idle_.notify_all();
+  }
+}
+
+void SchedulerQueue::wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this]() { return running_ == 0 && pending_.empty(); });
+}
+
+size_t SchedulerQueue::pending() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size();
+}
+
+size_t SchedulerQueue::running() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return running_;
+}
+
+tables::TableSnapshotRef getSharedScans(
+    const std::vector<OsqueryScheduledQuery>& queries,
+    const std::map<std::string, std::set<std::string> >& tables) {
+  std::map<std::string, size_t> readers;
   for (const auto& q : queries) {
-    if (second % q.interval == 0) {
-      launchQuery(q);
+    auto query_tables = tables.find(q.name);
+    if (query_tables == tables.end()) {
+      continue;
+    }
+    for (const auto& table : query_tables->second) {
+      readers[table]++;
     }
   }
+
+  std::set<std::string> shared;
+  for (const auto& table : readers) {
+    if (table.second > 1) {
+      shared.insert(table.first);
+    }
+  }
+
+  if (shared.empty()) {
+    return nullptr;
+  }
+  return std::make_shared<tables::TableSnapshot>(shared);
 }
 
-int splayValue(int original, int splayPercent) {
+void ScheduleTimer::add(const OsqueryScheduledQuery& query, size_t offset) {
+  remove(query.name);
+  queries_.push_back(query);
+  removed_.push_back(false);
+  if (queries_.back().interval < 1) {
+    queries_.back().interval = 1;
+  }
+  slots_[query.name] = queries_.size() - 1;
+  deadlines_.push(
+      std::make_pair(start_ + std::chrono::seconds(offset), queries_.size() - 1));
+}
+
+bool ScheduleTimer::remove(const std::string& name) {
+  auto slot = slots_.find(name);
+  if (slot == slots_.end()) {
+    return false;
+  }
+  removed_[slot->second] = true;
+  slots_.erase(slot);
+  prune();
+  return true;
+}
+
+void ScheduleTimer::prune() {
+  while (!deadlines_.empty() && removed_[deadlines_.top().second]) {
+    deadlines_.pop();
+  }
+}
+
+std::vector<OsqueryScheduledQuery> ScheduleTimer::due(
+    const Clock::time_point& now) {
+  std::vector<OsqueryScheduledQuery> queries;
+  while (!deadlines_.empty() && deadlines_.top().first <= now) {
+    auto deadline = deadlines_.top();
+    deadlines_.pop();
+
+    const auto& query = queries_[deadline.second];
+    queries.push_back(query);
+    size_t backoff = (backoff_) ? std::max(backoff_(query), (size_t)1) : 1;
+    auto interval = std::chrono::seconds(query.interval * backoff);
+    do {
+      deadline.first += interval;
+    } while (deadline.first <= now);
+    deadlines_.push(deadline);
+    prune();
+  }
+  return queries;
+}
+
+void diffSchedules(const std::vector<OsqueryScheduledQuery>& current,
+                   const std::vector<OsqueryScheduledQuery>& refreshed,
+                   std::vector<OsqueryScheduledQuery>& added,
+                   std::vector<std::string>& removed) {
+  std::map<std::string, const OsqueryScheduledQuery*> previous;
+  for (const auto& query : current) {
+    previous[query.name] = &query;
+  }
+
+  for (const auto& query : refreshed) {
+    auto it = previous.find(query.name);
+    if (it != previous.end()) {
+      bool changed = (*it->second != query);
+      previous.erase(it);
+      if (!changed) {
+        continue;
+      }
+      removed.push_back(query.name);
+    }
+    added.push_back(query);
+  }
+
+  for (const auto& query : previous) {
+    removed.push_back(query.first);
+  }
+}
+
+/// A stable FNV-1a hash of a splay seed, independent of the standard library.
+static uint64_t hashSplaySeed(const std::string& seed) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const auto& c : seed) {
+    hash ^= (unsigned char)c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/// Choose a value in [min_value, max_value] using a random or seeded source.
+static int splayChoice(int original,
+                       int splayPercent,
+                       const std::function<uint64_t()>& source) {
   if (splayPercent <= 0 || splayPercent > 100) {
     return original;
   }
@@ -148,40 +1359,299 @@ int splayValue(int original, int splayPercent) {
     return max_value;
   }
 
-  std::default_random_engine generator;
-  std::uniform_int_distribution<int> distribution(min_value, max_value);
-  return distribution(generator);
+  return min_value + (int)(source() % (uint64_t)(max_value - min_value + 1));
+}
+
+int splayValue(int original, int splayPercent) {
+  return splayChoice(original, splayPercent, []() {
+    static std::mt19937_64 generator(std::random_device{}());
+    return generator();
+  });
+}
+
+int splayValue(int original, int splayPercent, const std::string& seed) {
+  return splayChoice(original, splayPercent, [&seed]() {
+    return hashSplaySeed(seed);
+  });
+}
+
+int splayPhase(int interval, const std::string& seed) {
+  if (interval <= 1) {
+    return 0;
+  }
+  // Use a different hash than the interval splay for an independent choice.
+  return (int)(hashSplaySeed("phase:" + seed) % (uint64_t)interval);
+}
+
+int catchUpOffset(int interval,
+                  int since_run,
+                  int next,
+                  int window,
+                  const std::string& seed) {
+  if (window <= 0 || since_run < interval) {
+    return -1;
+  }
+  auto offset = splayPhase(std::min(window, interval), "catch-up\n" + seed);
+  // The query's scheduled run comes first.
+  return (offset < next) ? offset : -1;
 }
 
+void deferScheduledQueries() { kDeferQueries = true; }
+
 void initializeScheduler() {
   DLOG(INFO) << "osquery::initializeScheduler";
-  time_t t = time(0);
-  struct tm* local = localtime(&t);
-  unsigned long int second = local->tm_sec;
+  time_t unix_time = time(0);
 
-#ifdef OSQUERY_TEST_DAEMON
-  // if we're testing the daemon, only iterate through 15 "seconds"
-  static unsigned long int stop_at = second + 15;
-#else
-  // if this is production, count forever
-  static unsigned long int stop_at = ULONG_MAX;
-#endif
+  auto policy = setThreadPolicy(kSchedulerThread);
+  if (!policy.ok()) {
+    LOG(WARNING) << "Scheduler thread policy not applied: " << policy.what();
+  }
+
+  auto start = ScheduleTimer::Clock::now();
+  auto stop = ScheduleTimer::Clock::time_point::max();
+  if (FLAGS_schedule_timeout > 0) {
+    stop = start + std::chrono::seconds(FLAGS_schedule_timeout);
+  }
 
   auto cfg = Config::getInstance();
 
-  // Iterate over scheduled queryies and add a splay to each.
-  auto schedule = cfg->getScheduledQueries();
-  for (auto& q : schedule) {
+  // The splay is seeded by the host such that hosts run each query at
+  // different times, and the same splay is chosen across restarts.
+  std::string ident;
+  getHostIdentifier(ident);
+
+  ScheduleTimer timer(start);
+  timer.setBackoff([](const OsqueryScheduledQuery& query) {
+    return SchedulerStats::getInstance().backoff(query.name);
+  });
+
+  // The tables each query reads, to share scans between queries.
+  std::map<std::string, std::set<std::string> > tables;
+
+  // One-off runs of queries that missed runs while osqueryd was stopped.
+  std::multimap<ScheduleTimer::Clock::time_point, OsqueryScheduledQuery>
+      catch_up;
+
+  // Add a splay to each scheduled query, including those added by a refresh.
+  auto schedule_query = [&](OsqueryScheduledQuery q) {
+    // Prepare the query when the config is loaded such that an invalid query
+    // is reported now rather than when it is first due.
+    QueryPlan plan;
+    auto status = getQueryPlan(q.query, plan);
+    if (!status.ok()) {
+      // A table may be registered later, such as by an extension, the query
+      // stays scheduled and each failed run records its error.
+      LOG(ERROR) << "Cannot prepare scheduled query " << q.name << ": "
+                 << status.toString();
+      SchedulerStats::getInstance().recordError(q.name, status.toString());
+      plan.tables.clear();
+    } else {
+      for (const auto& scan : plan.scans) {
+        LOG(WARNING) << "Scheduled query " << q.name
+                     << " generates every row of " << scan;
+      }
+      SchedulerStats::getInstance().recordPlan(q.name, plan);
+    }
+
+    auto seed = ident + "\n" + q.name;
     auto old_interval = q.interval;
-    auto new_interval = splayValue(old_interval, FLAGS_schedule_splay_percent);
+    auto new_interval =
+        splayValue(old_interval, FLAGS_schedule_splay_percent, seed);
     VLOG(1) << "Splay changing the interval for " << q.name << " from  "
             << old_interval << " to " << new_interval;
-    q.interval = new_interval;
+    q.interval = std::max(new_interval, 1);
+
+    // The query is due when the unix time modulo its interval is its phase.
+    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+                       ScheduleTimer::Clock::now() - start).count();
+    auto now = unix_time + elapsed;
+    int phase = splayPhase(q.interval, seed);
+    auto offset = (phase - now % q.interval + q.interval) % q.interval;
+    timer.add(q, elapsed + offset);
+
+    auto last_run = getLastRun(q.name);
+    if (last_run > 0) {
+      auto catch_up_offset = catchUpOffset(
+          q.interval, now - last_run, offset, FLAGS_schedule_catch_up, seed);
+      if (catch_up_offset >= 0) {
+        auto missed = elapsed + catch_up_offset;
+        catch_up.emplace(start + std::chrono::seconds(missed), q);
+      }
+    }
+
+    if (FLAGS_schedule_shared_scans) {
+      tables[q.name] = plan.tables;
+    }
+  };
+
+  auto schedule = cfg->getScheduledQueries();
+  for (const auto& q : schedule) {
+    schedule_query(q);
   }
 
-  for (; second <= stop_at; ++second) {
-    launchQueries(schedule, second);
-    ::sleep(1);
+  // Queries run on the Dispatcher such that a slow query does not delay the
+  // queries due after it.
+  ResultsPipelineRef pipeline;
+  if (FLAGS_schedule_results_queue > 0) {
+    pipeline = std::make_shared<ResultsPipeline>(
+        FLAGS_schedule_results_queue,
+        [](std::vector<std::string>& batch) {
+          return logStringBatch(std::move(batch));
+        });
+  }
+
+  auto queue = std::make_shared<SchedulerQueue>(
+      [pipeline](const OsqueryScheduledQuery& query,
+                 const tables::TableSnapshotRef& snapshot) {
+        launchQuery(query, snapshot, pipeline);
+      },
+      (size_t)std::max(FLAGS_scheduler_concurrency, 1));
+
+  // Concurrent queries are admitted from their measured costs, such that
+  // several heavy queries do not run into the watchdog's limits together.
+  ScheduledQueryCost budget;
+  budget.memory = std::max(FLAGS_schedule_memory_budget, 0) * 1024.0 * 1024;
+  budget.cpu = std::max(FLAGS_schedule_cpu_budget, 0);
+  queue->setBudget(
+      [](const OsqueryScheduledQuery& query) {
+        return SchedulerStats::getInstance().cost(query.name);
+      },
+      budget);
+
+  // An in-memory backing-store may be checkpointed to disk periodically.
+  auto checkpoint_interval = std::chrono::seconds(FLAGS_db_checkpoint_interval);
+  auto next_checkpoint = start + checkpoint_interval;
+  // The config may be reloaded, only changed queries are rescheduled.
+  auto refresh_interval = std::chrono::seconds(FLAGS_config_refresh);
+  auto next_refresh = start + refresh_interval;
+  // Queries due while the worker is under pressure run after a deferral.
+  std::vector<OsqueryScheduledQuery> deferred;
+  auto defer_until = start;
+  while (ScheduleTimer::Clock::now() <= stop) {
+    if (kDeferQueries.exchange(false)) {
+      LOG(WARNING) << "Worker is near its limits, dropping caches and "
+                   << "deferring scheduled queries";
+      // Attribute the worker's memory before the caches are dropped.
+      std::vector<MemoryUsage> usage;
+      getMemoryUsage(usage);
+      for (const auto& subsystem : usage) {
+        LOG(WARNING) << "Worker memory " << subsystem.subsystem << ": "
+                     << subsystem.bytes << " bytes";
+      }
+      tables::TableResultCache::reset();
+      SQLiteDBManager::reset();
+      defer_until = ScheduleTimer::Clock::now() +
+                    std::chrono::seconds(kPressureDeferSeconds);
+    }
+
+    if (FLAGS_config_refresh > 0 &&
+        ScheduleTimer::Clock::now() >= next_refresh) {
+      auto status = cfg->load();
+      if (status.ok()) {
+        // The refreshed config may change the tracing flags.
+        initTracing();
+        auto refreshed = cfg->getScheduledQueries();
+        std::vector<OsqueryScheduledQuery> added;
+        std::vector<std::string> removed;
+        diffSchedules(schedule, refreshed, added, removed);
+        for (const auto& name : removed) {
+          timer.remove(name);
+          tables.erase(name);
+          auto is_removed = [&name](const OsqueryScheduledQuery& d) {
+            return d.name == name;
+          };
+          deferred.erase(
+              std::remove_if(deferred.begin(), deferred.end(), is_removed),
+              deferred.end());
+          for (auto it = catch_up.begin(); it != catch_up.end();) {
+            it = is_removed(it->second) ? catch_up.erase(it) : std::next(it);
+          }
+        }
+        for (const auto& q : added) {
+          schedule_query(q);
+        }
+        if (!added.empty() || !removed.empty()) {
+          LOG(INFO) << "Config refresh scheduled " << added.size()
+                    << " and removed " << removed.size() << " queries";
+        }
+        schedule = std::move(refreshed);
+        pruneRollups(schedule);
+      } else {
+        LOG(WARNING) << "Config refresh failed: " << status.toString();
+      }
+      next_refresh = ScheduleTimer::Clock::now() + refresh_interval;
+    }
+
+    auto due = timer.due(ScheduleTimer::Clock::now());
+    while (!catch_up.empty() &&
+           catch_up.begin()->first <= ScheduleTimer::Clock::now()) {
+      const auto& missed = catch_up.begin()->second;
+      if (std::none_of(due.begin(),
+                       due.end(),
+                       [&missed](const OsqueryScheduledQuery& q) {
+            return q.name == missed.name;
+          })) {
+        due.push_back(missed);
+      }
+      catch_up.erase(catch_up.begin());
+    }
+    if (ScheduleTimer::Clock::now() < defer_until || !deferred.empty()) {
+      // A query due several times during the deferral runs once.
+      for (const auto& q : due) {
+        auto it = std::find_if(deferred.begin(),
+                               deferred.end(),
+                               [&q](const OsqueryScheduledQuery& d) {
+          return d.name == q.name;
+        });
+        if (it == deferred.end()) {
+          deferred.push_back(q);
+        }
+      }
+      due.clear();
+      if (ScheduleTimer::Clock::now() >= defer_until) {
+        due.swap(deferred);
+      }
+    }
+    auto snapshot = getSharedScans(due, tables);
+    for (const auto& q : due) {
+      if (!queue->add(q, snapshot)) {
+        LOG(WARNING) << "Skipping query " << q.name
+                     << ", the previous run has not completed";
+      }
+    }
+
+    if (FLAGS_db_checkpoint_interval > 0 &&
+        ScheduleTimer::Clock::now() >= next_checkpoint) {
+      auto status = DBHandle::getInstance()->Checkpoint();
+      if (!status.ok()) {
+        LOG(WARNING) << "Backing-store checkpoint failed: "
+                     << status.toString();
+      }
+      next_checkpoint = ScheduleTimer::Clock::now() + checkpoint_interval;
+    }
+
+    // Sleep until the next deadline, waking at least hourly when idle.
+    auto wake = ScheduleTimer::Clock::now() + std::chrono::hours(1);
+    if (!timer.empty()) {
+      wake = std::min(wake, timer.next());
+    }
+    if (FLAGS_db_checkpoint_interval > 0) {
+      wake = std::min(wake, next_checkpoint);
+    }
+    if (FLAGS_config_refresh > 0) {
+      wake = std::min(wake, next_refresh);
+    }
+    if (!deferred.empty()) {
+      wake = std::min(wake, defer_until);
+    }
+    if (!catch_up.empty()) {
+      wake = std::min(wake, catch_up.begin()->first);
+    }
+    std::this_thread::sleep_until(std::min(wake, stop));
+  }
+  queue->wait();
+  if (pipeline != nullptr) {
+    pipeline->stop();
   }
 }
 }
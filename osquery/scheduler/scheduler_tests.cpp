@@ -8,10 +8,17 @@
  *
  */
  
+#include <algorithm>
+#include <set>
+
 #include <gtest/gtest.h>
 
 #include <osquery/scheduler.h>
 
+#include "osquery/scheduler/pipeline.h"
+#include "osquery/scheduler/queue.h"
+#include "osquery/scheduler/stats.h"
+
 namespace osquery {
 
 class SchedulerTests : public testing::Test {};
@@ -37,6 +44,484 @@ TEST_F(SchedulerTests, test_splay) {
   auto val5 = splayValue(1, 10);
   EXPECT_EQ(val5, 1);
 }
+
+TEST_F(SchedulerTests, test_seeded_splay) {
+  // A seed always chooses the same value within the splay range.
+  auto value = splayValue(100, 10, "host\nquery");
+  EXPECT_GE(value, 90);
+  EXPECT_LE(value, 110);
+  EXPECT_EQ(value, splayValue(100, 10, "host\nquery"));
+  EXPECT_EQ(splayValue(100, 0, "host\nquery"), 100);
+
+  // Hosts are spread across the range of values and phases.
+  std::set<int> values;
+  std::set<int> phases;
+  for (size_t i = 0; i < 100; ++i) {
+    auto seed = "host" + std::to_string(i) + "\nquery";
+    values.insert(splayValue(100, 10, seed));
+    auto phase = splayPhase(60, seed);
+    EXPECT_GE(phase, 0);
+    EXPECT_LT(phase, 60);
+    phases.insert(phase);
+  }
+  EXPECT_GT(values.size(), 10);
+  EXPECT_GT(phases.size(), 30);
+  EXPECT_EQ(splayPhase(60, "host\nquery"), splayPhase(60, "host\nquery"));
+  EXPECT_EQ(splayPhase(1, "host\nquery"), 0);
+}
+
+TEST_F(SchedulerTests, test_catch_up_offset) {
+  // A query that did not miss a run, or is disabled, does not catch up.
+  EXPECT_EQ(catchUpOffset(3600, 60, 3000, 300, "host\nquery"), -1);
+  EXPECT_EQ(catchUpOffset(3600, 7200, 3000, 0, "host\nquery"), -1);
+
+  // Missed runs are spread across the window.
+  std::set<int> offsets;
+  for (size_t i = 0; i < 100; ++i) {
+    auto seed = "host" + std::to_string(i) + "\nquery";
+    auto offset = catchUpOffset(3600, 7200, 3000, 300, seed);
+    EXPECT_GE(offset, 0);
+    EXPECT_LT(offset, 300);
+    offsets.insert(offset);
+  }
+  EXPECT_GT(offsets.size(), 30);
+
+  // The window is at most the interval, and a sooner scheduled run wins.
+  EXPECT_LT(catchUpOffset(10, 20, 10, 300, "host\nquery"), 10);
+  EXPECT_EQ(catchUpOffset(3600, 7200, 0, 300, "host\nquery"), -1);
+}
+
+TEST_F(SchedulerTests, test_shared_scans) {
+  std::vector<OsqueryScheduledQuery> due = {
+      {"procs", "SELECT * FROM processes WHERE pid = 1", 10},
+      {"names", "SELECT name FROM processes", 10},
+      {"users", "SELECT * FROM users", 10},
+  };
+  std::map<std::string, std::set<std::string> > tables = {
+      {"procs", {"processes"}},
+      {"names", {"processes"}},
+      {"users", {"users"}},
+  };
+
+  // Only tables read by several queries are shared.
+  auto snapshot = getSharedScans(due, tables);
+  ASSERT_NE(snapshot, nullptr);
+  EXPECT_TRUE(snapshot->shares("processes"));
+  EXPECT_FALSE(snapshot->shares("users"));
+
+  due.pop_back();
+  due.pop_back();
+  EXPECT_EQ(getSharedScans(due, tables), nullptr);
+
+  // Each shared table is generated once.
+  size_t generated = 0;
+  auto generate = [&generated]() {
+    generated++;
+    return std::make_shared<QueryData>(QueryData{{{"pid", "1"}}});
+  };
+  snapshot = getSharedScans({due[0], due[0]}, tables);
+  ASSERT_NE(snapshot, nullptr);
+  auto first = snapshot->get("processes", generate);
+  auto second = snapshot->get("processes", generate);
+  EXPECT_EQ(generated, 1);
+  EXPECT_EQ(first, second);
+}
+
+TEST_F(SchedulerTests, test_query_backoff) {
+  auto& stats = SchedulerStats::getInstance();
+  stats.reset();
+  OsqueryScheduledQuery query = {"expensive", "SELECT 1", 10};
+  EXPECT_EQ(stats.backoff("expensive"), 1);
+
+  // 5 seconds of CPU every 10 seconds exceeds the 10 percent limit.
+  stats.record(query, 5000, 4000, 1000, 10, 0);
+  EXPECT_EQ(stats.backoff("expensive"), 2);
+  stats.record(query, 5000, 4000, 1000, 10, 0);
+  stats.record(query, 5000, 4000, 1000, 10, 0);
+  stats.record(query, 5000, 4000, 1000, 10, 0);
+  EXPECT_EQ(stats.backoff("expensive"), 8);
+
+  QueryPerformance performance;
+  EXPECT_TRUE(stats.get("expensive", performance));
+  EXPECT_EQ(performance.executions, 4);
+  EXPECT_EQ(performance.rows, 10);
+
+  // Cheap runs shrink the backoff as the average decays.
+  for (size_t i = 0; i < 50; ++i) {
+    stats.record(query, 1, 1, 0, 10, 0);
+  }
+  EXPECT_EQ(stats.backoff("expensive"), 1);
+
+  // The timer stretches intervals by the backoff.
+  auto start = ScheduleTimer::Clock::now();
+  ScheduleTimer timer(start);
+  timer.setBackoff([](const OsqueryScheduledQuery& q) { return 3; });
+  timer.add(query, 0);
+  timer.due(start);
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(30));
+  stats.reset();
+}
+
+TEST_F(SchedulerTests, test_query_stats) {
+  auto& stats = SchedulerStats::getInstance();
+  stats.reset();
+  OsqueryScheduledQuery query = {"stats", "SELECT 1", 10};
+  stats.record(query, 30, 4, 2, 5, 0);
+  stats.record(query, 10, 2, 1, 3, 0);
+  stats.recordResults("stats", 5, 0, 0);
+  stats.recordResults("stats", 0, 0, 120);
+  stats.recordError("stats", "no such table: missing");
+  QueryPlan plan;
+  plan.tables = {"processes"};
+  plan.scans = {"processes"};
+  stats.recordPlan("stats", plan);
+
+  QueryPerformance performance;
+  EXPECT_TRUE(stats.get("stats", performance));
+  EXPECT_EQ(performance.executions, 2);
+  EXPECT_EQ(performance.last_wall_time, 10);
+  EXPECT_EQ(performance.max_wall_time, 30);
+  EXPECT_EQ(performance.user_time, 6);
+  EXPECT_EQ(performance.system_time, 3);
+  EXPECT_EQ(performance.output_rows, 8);
+  EXPECT_EQ(performance.added, 5);
+  EXPECT_EQ(performance.removed, 0);
+  EXPECT_EQ(performance.bytes_logged, 120);
+  EXPECT_EQ(performance.last_error, "no such table: missing");
+  EXPECT_EQ(performance.plan.scans, std::vector<std::string>({"processes"}));
+  EXPECT_FALSE(stats.get("unknown", performance));
+  stats.reset();
+}
+
+TEST_F(SchedulerTests, test_results_pipeline) {
+  auto& stats = SchedulerStats::getInstance();
+  stats.reset();
+
+  std::vector<std::vector<std::string> > batches;
+  auto pipeline = std::make_shared<ResultsPipeline>(
+      2, [&batches](const std::vector<std::string>& batch) {
+        batches.push_back(batch);
+        return Status(0, "OK");
+      });
+
+  // Snapshot queries are logged without reading stored results.
+  OsqueryScheduledQuery query = {"pipeline", "SELECT 1", 10};
+  query.snapshot = true;
+  for (size_t i = 0; i < 5; ++i) {
+    EXPECT_TRUE(pipeline->add(query, {{{"value", "1"}}}, 0));
+  }
+  // Queries without results are not logged.
+  EXPECT_TRUE(pipeline->add(query, {}, 0));
+  pipeline->stop();
+  EXPECT_FALSE(pipeline->add(query, {}, 0));
+
+  size_t lines = 0, bytes = 0;
+  for (const auto& batch : batches) {
+    for (const auto& item : batch) {
+      lines += std::count(item.begin(), item.end(), '\n');
+      bytes += item.size();
+    }
+  }
+  EXPECT_EQ(lines, 5);
+  EXPECT_LE(batches.size(), 5);
+
+  QueryPerformance performance;
+  EXPECT_TRUE(stats.get("pipeline", performance));
+  EXPECT_EQ(performance.added, 5);
+  EXPECT_EQ(performance.bytes_logged, bytes);
+  stats.reset();
+}
+
+TEST_F(SchedulerTests, test_output_quota) {
+  OutputQuota quota(60, 100, 0);
+  auto start = OutputQuota::Clock::now();
+  OsqueryScheduledQuery query = {"quota", "SELECT 1", 10};
+  query.max_bytes = 25;
+
+  // Strings are logged until the query's quota is reached.
+  std::vector<std::string> batch = {"0123456789", "0123456789", "0123456789"};
+  EXPECT_EQ(quota.limit(query, batch, start), 10U);
+  EXPECT_EQ(batch.size(), 2U);
+  batch = {"0123456789"};
+  EXPECT_EQ(quota.limit(query, batch, start), 10U);
+  EXPECT_TRUE(batch.empty());
+
+  // The global quota limits every query.
+  OsqueryScheduledQuery other = {"other", "SELECT 2", 10};
+  batch = std::vector<std::string>(10, "0123456789");
+  EXPECT_EQ(quota.limit(other, batch, start), 20U);
+  EXPECT_EQ(batch.size(), 8U);
+
+  // Quotas are counted again in the next window.
+  auto later = start + std::chrono::seconds(60);
+  batch = {"0123456789", "0123456789", "0123456789"};
+  EXPECT_EQ(quota.limit(query, batch, later), 10U);
+  EXPECT_EQ(batch.size(), 2U);
+
+  // Queries without quotas are not limited.
+  OutputQuota unlimited(60, 0, 0);
+  batch = std::vector<std::string>(10, "0123456789");
+  EXPECT_EQ(unlimited.limit(other, batch, start), 0U);
+  EXPECT_EQ(batch.size(), 10U);
+
+  // Sampling logs one in every few strings over quota.
+  OutputQuota sampled(60, 0, 3);
+  batch = std::vector<std::string>(8, "0123456789");
+  EXPECT_EQ(sampled.limit(query, batch, start), 40U);
+  EXPECT_EQ(batch.size(), 4U);
+}
+
+TEST_F(SchedulerTests, test_query_rollup) {
+  QueryRollup rollup(300, "pid");
+  QueryData aggregates;
+  EXPECT_FALSE(rollup.add({{{"pid", "1"}, {"name", "init"}, {"rss", "10"}},
+                           {{"pid", "2"}, {"name", "bash"}, {"rss", "5"}}},
+                          1000,
+                          aggregates));
+  EXPECT_FALSE(rollup.add({{{"pid", "1"}, {"name", "init"}, {"rss", "30"}},
+                           {{"pid", "2"}, {"name", "bash"}, {"rss", "x"}}},
+                          1010,
+                          aggregates));
+  EXPECT_EQ(aggregates.size(), 0U);
+
+  // The first run after the window logs its aggregates and starts the next.
+  EXPECT_TRUE(rollup.add({{{"pid", "1"}, {"rss", "40"}}}, 1300, aggregates));
+  ASSERT_EQ(aggregates.size(), 2U);
+  EXPECT_EQ(aggregates[0]["pid"], "1");
+  EXPECT_EQ(aggregates[0]["name"], "init");
+  EXPECT_EQ(aggregates[0]["rss"], "30");
+  EXPECT_EQ(aggregates[0]["rss_min"], "10");
+  EXPECT_EQ(aggregates[0]["rss_max"], "30");
+  EXPECT_EQ(aggregates[0]["rss_avg"], "20");
+  EXPECT_EQ(aggregates[0].count("pid_min"), 0U);
+
+  // A column with a non-numeric value keeps only its last value.
+  EXPECT_EQ(aggregates[1]["rss"], "x");
+  EXPECT_EQ(aggregates[1].count("rss_avg"), 0U);
+
+  auto next = rollup.aggregate();
+  ASSERT_EQ(next.size(), 1U);
+  EXPECT_EQ(next[0]["rss_avg"], "40");
+
+  // Without key columns, rows are grouped by their non-numeric values.
+  QueryRollup unkeyed(60, "");
+  unkeyed.add({{{"interface", "eth0"}, {"bytes", "1.5"}},
+               {{"interface", "eth0"}, {"bytes", "2"}},
+               {{"interface", "lo"}, {"bytes", "7"}}},
+              0,
+              aggregates);
+  next = unkeyed.aggregate();
+  ASSERT_EQ(next.size(), 2U);
+  EXPECT_EQ(next[0]["bytes_avg"], "1.75");
+  EXPECT_EQ(next[1]["bytes"], "7");
+}
+
+TEST_F(SchedulerTests, test_prune_rollups) {
+  auto pipeline = std::make_shared<ResultsPipeline>(
+      2, [](const std::vector<std::string>&) { return Status(0, "OK"); });
+  OsqueryScheduledQuery kept = {"rollup_kept", "SELECT 1", 10};
+  kept.rollup = 300;
+  OsqueryScheduledQuery unset = {"rollup_unset", "SELECT 1", 10};
+  unset.rollup = 300;
+  OsqueryScheduledQuery removed = {"rollup_removed", "SELECT 1", 10};
+  removed.rollup = 300;
+  for (const auto& query : {kept, unset, removed}) {
+    EXPECT_TRUE(pipeline->add(query, {{{"value", "1"}}}, 1000));
+  }
+  pipeline->stop();
+
+  // Removed queries and queries no longer rolled up drop their windows.
+  unset.rollup = 0;
+  EXPECT_EQ(pruneRollups({kept, unset}), 2U);
+  EXPECT_EQ(pruneRollups({kept, unset}), 0U);
+  EXPECT_EQ(pruneRollups({}), 1U);
+}
+
+TEST_F(SchedulerTests, test_schedule_timer) {
+  auto start = ScheduleTimer::Clock::now();
+  ScheduleTimer timer(start);
+  timer.add({"three", "SELECT 3", 3}, 0);
+  timer.add({"five", "SELECT 5", 5}, 2);
+  EXPECT_TRUE(timer.next() == start);
+
+  auto due = timer.due(start);
+  ASSERT_EQ(due.size(), 1);
+  EXPECT_EQ(due[0].name, "three");
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(2));
+  EXPECT_EQ(timer.due(start + std::chrono::seconds(1)).size(), 0);
+
+  // Late wakes do not shift the deadlines.
+  due = timer.due(start + std::chrono::milliseconds(3500));
+  ASSERT_EQ(due.size(), 2);
+  EXPECT_EQ(due[0].name, "five");
+  EXPECT_EQ(due[1].name, "three");
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(6));
+
+  // Missed deadlines are run once.
+  due = timer.due(start + std::chrono::seconds(20));
+  EXPECT_EQ(due.size(), 2);
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(21));
+  EXPECT_EQ(timer.due(start + std::chrono::seconds(21)).size(), 1);
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(22));
+}
+
+TEST_F(SchedulerTests, test_schedule_timer_remove) {
+  auto start = ScheduleTimer::Clock::now();
+  ScheduleTimer timer(start);
+  timer.add({"three", "SELECT 3", 3}, 0);
+  timer.add({"five", "SELECT 5", 5}, 2);
+
+  EXPECT_TRUE(timer.remove("three"));
+  EXPECT_FALSE(timer.remove("three"));
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(2));
+  auto due = timer.due(start + std::chrono::seconds(2));
+  ASSERT_EQ(due.size(), 1);
+  EXPECT_EQ(due[0].name, "five");
+
+  // Adding a query of the same name replaces its interval and deadline.
+  timer.add({"five", "SELECT 5", 10}, 4);
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(4));
+  due = timer.due(start + std::chrono::seconds(10));
+  ASSERT_EQ(due.size(), 1);
+  EXPECT_EQ(due[0].interval, 10);
+  EXPECT_TRUE(timer.next() == start + std::chrono::seconds(14));
+
+  timer.remove("five");
+  EXPECT_TRUE(timer.empty());
+}
+
+TEST_F(SchedulerTests, test_diff_schedules) {
+  std::vector<OsqueryScheduledQuery> current = {
+      {"same", "SELECT 1", 10},
+      {"retimed", "SELECT 2", 10},
+      {"rewritten", "SELECT 3", 10},
+      {"gone", "SELECT 4", 10},
+  };
+  std::vector<OsqueryScheduledQuery> refreshed = {
+      {"same", "SELECT 1", 10},
+      {"retimed", "SELECT 2", 20},
+      {"rewritten", "SELECT 30", 10},
+      {"new", "SELECT 5", 10},
+  };
+
+  std::vector<OsqueryScheduledQuery> added;
+  std::vector<std::string> removed;
+  diffSchedules(current, refreshed, added, removed);
+  ASSERT_EQ(added.size(), 3);
+  EXPECT_EQ(added[0].name, "retimed");
+  EXPECT_EQ(added[0].interval, 20);
+  EXPECT_EQ(added[1].query, "SELECT 30");
+  EXPECT_EQ(added[2].name, "new");
+  EXPECT_EQ(removed,
+            std::vector<std::string>({"retimed", "rewritten", "gone"}));
+
+  added.clear();
+  removed.clear();
+  diffSchedules(refreshed, refreshed, added, removed);
+  EXPECT_TRUE(added.empty());
+  EXPECT_TRUE(removed.empty());
+}
+
+TEST_F(SchedulerTests, test_scheduler_queue) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool release = false;
+  std::vector<std::string> launched;
+  auto launcher = [&](const OsqueryScheduledQuery& query,
+                      const tables::TableSnapshotRef& snapshot) {
+    std::unique_lock<std::mutex> lock(mutex);
+    launched.push_back(query.name);
+    cv.wait(lock, [&release]() { return release; });
+  };
+
+  auto queue = std::make_shared<SchedulerQueue>(launcher, 2);
+  EXPECT_TRUE(queue->add({"first", "SELECT 1", 1}));
+  EXPECT_TRUE(queue->add({"second", "SELECT 2", 1}));
+  EXPECT_TRUE(queue->add({"third", "SELECT 3", 1}));
+
+  // Only two queries run at once, and a query does not overlap itself.
+  EXPECT_EQ(queue->running(), 2);
+  EXPECT_EQ(queue->pending(), 1);
+  EXPECT_FALSE(queue->add({"first", "SELECT 1", 1}));
+  EXPECT_FALSE(queue->add({"third", "SELECT 3", 1}));
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    release = true;
+  }
+  cv.notify_all();
+  queue->wait();
+  EXPECT_EQ(queue->running(), 0);
+  EXPECT_EQ(queue->pending(), 0);
+  EXPECT_EQ(launched.size(), 3);
+
+  // Completed queries may run again.
+  EXPECT_TRUE(queue->add({"first", "SELECT 1", 1}));
+  queue->wait();
+  EXPECT_EQ(launched.size(), 4);
+}
+
+TEST_F(SchedulerTests, test_scheduler_queue_budget) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool release = false;
+  std::vector<std::string> launched;
+  auto launcher = [&](const OsqueryScheduledQuery& query,
+                      const tables::TableSnapshotRef& snapshot) {
+    std::unique_lock<std::mutex> lock(mutex);
+    launched.push_back(query.name);
+    cv.notify_all();
+    cv.wait(lock, [&release]() { return release; });
+  };
+
+  auto queue = std::make_shared<SchedulerQueue>(launcher, 4);
+  ScheduledQueryCost budget;
+  budget.memory = 10;
+  queue->setBudget(
+      [](const OsqueryScheduledQuery& query) {
+        ScheduledQueryCost cost;
+        cost.memory = (query.name.find("heavy") == 0) ? 6 : 1;
+        return cost;
+      },
+      budget);
+
+  EXPECT_TRUE(queue->add({"heavy1", "SELECT 1", 1}));
+  EXPECT_TRUE(queue->add({"light", "SELECT 2", 1}));
+  EXPECT_TRUE(queue->add({"heavy2", "SELECT 3", 1}));
+  EXPECT_TRUE(queue->add({"later", "SELECT 4", 1}));
+
+  // The second heavy query does not fit, the query after it waits in order.
+  EXPECT_EQ(queue->running(), 2);
+  EXPECT_EQ(queue->pending(), 2);
+
+  {
+    // Release the first group only once both of its queries have started.
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&launched]() { return launched.size() >= 2; });
+    release = true;
+  }
+  cv.notify_all();
+  queue->wait();
+  // Each group is dispatched together, its queries may start in any order.
+  ASSERT_EQ(launched.size(), 4U);
+  EXPECT_EQ(std::set<std::string>(launched.begin(), launched.begin() + 2),
+            std::set<std::string>({"heavy1", "light"}));
+  EXPECT_EQ(std::set<std::string>(launched.begin() + 2, launched.end()),
+            std::set<std::string>({"heavy2", "later"}));
+
+  // A query over the budget still runs alone.
+  budget.memory = 1;
+  queue->setBudget(
+      [](const OsqueryScheduledQuery& query) {
+        ScheduledQueryCost cost;
+        cost.memory = 6;
+        return cost;
+      },
+      budget);
+  EXPECT_TRUE(queue->add({"heavy1", "SELECT 1", 1}));
+  queue->wait();
+  EXPECT_EQ(launched.size(), 5);
+}
 }
 
 int main(int argc, char* argv[]) {
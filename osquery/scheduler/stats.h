@@ -0,0 +1,177 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <osquery/scheduler.h>
+#include <osquery/sql.h>
+
+namespace osquery {
+
+/// The projected cost of a scheduled query's run, from its measured runs.
+struct ScheduledQueryCost {
+  /// The resident memory growth in bytes.
+  double memory;
+
+  /// The CPU milliseconds used per second of wall-clock time.
+  double cpu;
+
+  ScheduledQueryCost() : memory(0), cpu(0) {}
+};
+
+/**
+ * @brief The measured cost of a scheduled query's runs.
+ *
+ * Averages are exponentially weighted such that recent runs dominate.
+ */
+struct QueryPerformance {
+  /// The number of measured runs.
+  size_t executions;
+
+  /// Average wall-clock time in milliseconds.
+  double wall_time;
+
+  /// Average CPU time of the executing thread in milliseconds.
+  double cpu_time;
+
+  /// Average number of result rows.
+  double rows;
+
+  /// Average growth of the process resident size over a run in bytes.
+  double memory;
+
+  /// The largest growth of the process resident size over a run in bytes.
+  double max_memory;
+
+  /// The multiplier applied to the query's configured interval.
+  size_t backoff;
+
+  /// Wall-clock time of the last and the slowest run in milliseconds.
+  double last_wall_time;
+  double max_wall_time;
+
+  /// Total user and system CPU time of the executing thread in milliseconds.
+  double user_time;
+  double system_time;
+
+  /// Total result rows, and rows added and removed by result differentials.
+  size_t output_rows;
+  size_t added;
+  size_t removed;
+
+  /// Total bytes of results logged.
+  size_t bytes_logged;
+
+  /// Total bytes of results not logged because of an output quota.
+  size_t bytes_limited;
+
+  /// The error of the last failed run, empty if none failed.
+  std::string last_error;
+
+  /// The query's columns, tables, and full scans when it was scheduled.
+  QueryPlan plan;
+
+  QueryPerformance()
+      : executions(0),
+        wall_time(0),
+        cpu_time(0),
+        rows(0),
+        memory(0),
+        max_memory(0),
+        backoff(1),
+        last_wall_time(0),
+        max_wall_time(0),
+        user_time(0),
+        system_time(0),
+        output_rows(0),
+        added(0),
+        removed(0),
+        bytes_logged(0),
+        bytes_limited(0) {}
+};
+
+/**
+ * @brief Per-query performance of the schedule.
+ *
+ * Queries whose average CPU time exceeds `--schedule_max_cpu_percent` of their
+ * interval have the interval doubled, up to `--schedule_max_backoff` times
+ * the configured interval. The backoff halves again once the query would
+ * use less than half the limit at the shorter interval.
+ */
+class SchedulerStats {
+ public:
+  /// The process-wide schedule statistics.
+  static SchedulerStats& getInstance();
+
+  /**
+   * @brief Record a run of a query and update its backoff.
+   *
+   * @param query the scheduled query, with its configured interval.
+   * @param wall_time the run's wall-clock time in milliseconds.
+   * @param user_time the run's user CPU time in milliseconds.
+   * @param system_time the run's system CPU time in milliseconds.
+   * @param rows the number of result rows.
+   * @param memory the growth of the resident size over the run in bytes.
+   */
+  void record(const OsqueryScheduledQuery& query,
+              double wall_time,
+              double user_time,
+              double system_time,
+              size_t rows,
+              double memory);
+
+  /// Record the differential results of a run and the bytes logged.
+  void recordResults(const std::string& name,
+                     size_t added,
+                     size_t removed,
+                     size_t bytes);
+
+  /// Record the bytes of results removed by an output quota.
+  void recordLimited(const std::string& name, size_t bytes);
+
+  /// Record the error of a failed run.
+  void recordError(const std::string& name, const std::string& error);
+
+  /// Record the plan of a query prepared when it was scheduled.
+  void recordPlan(const std::string& name, const QueryPlan& plan);
+
+  /// The interval multiplier of a query, 1 if it is not backed off.
+  size_t backoff(const std::string& name);
+
+  /**
+   * @brief Project the cost of a query's next run from its measured runs.
+   *
+   * The memory is the largest growth of a run and the CPU is the average
+   * share of the run's wall-clock time, a query that has not run costs 0.
+   */
+  ScheduledQueryCost cost(const std::string& name);
+
+  /**
+   * @brief Get the performance of a query.
+   *
+   * @return false if the query has not run.
+   */
+  bool get(const std::string& name, QueryPerformance& performance);
+
+  /// Remove all statistics.
+  void reset();
+
+ private:
+  SchedulerStats() {}
+
+ private:
+  std::map<std::string, QueryPerformance> queries_;
+  std::mutex mutex_;
+};
+}
@@ -0,0 +1,395 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <osquery/logger.h>
+#include <osquery/sql.h>
+
+#include "osquery/sql/query_socket.h"
+#include "osquery/sql/sqlite_util.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace osquery {
+
+/// The largest request or response frame, larger frames are refused.
+const size_t kQuerySocketMaxFrame = 16 * 1024 * 1024;
+
+/// Seconds a client may take to send its request or read a frame.
+const int kQuerySocketTimeout = 5;
+
+/// Milliseconds between checks for a stop while waiting for a client.
+const int kQuerySocketPollMs = 200;
+
+/// The most clients served at once, others are refused.
+const size_t kQuerySocketMaxClients = 4;
+
+/// The listening socket and the thread serving it.
+struct QuerySocket {
+  int fd;
+  std::string path;
+  std::thread server;
+  std::atomic<bool> stop;
+  std::mutex mutex;
+
+  QuerySocket() : fd(-1), stop(false) {}
+};
+
+static QuerySocket& getQuerySocket() {
+  static QuerySocket socket;
+  return socket;
+}
+
+static bool sendAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    auto sent = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    } else if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+static bool recvAll(int fd, char* data, size_t size) {
+  while (size > 0) {
+    auto received = ::recv(fd, data, size, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    } else if (received <= 0) {
+      return false;
+    }
+    data += received;
+    size -= received;
+  }
+  return true;
+}
+
+static void encodeLength(size_t length, char* header) {
+  header[0] = (char)((length >> 24) & 0xff);
+  header[1] = (char)((length >> 16) & 0xff);
+  header[2] = (char)((length >> 8) & 0xff);
+  header[3] = (char)(length & 0xff);
+}
+
+static size_t decodeLength(const char* header) {
+  const auto bytes = reinterpret_cast<const unsigned char*>(header);
+  return ((size_t)bytes[0] << 24) | ((size_t)bytes[1] << 16) |
+         ((size_t)bytes[2] << 8) | (size_t)bytes[3];
+}
+
+static bool sendFrame(int fd, char type, const std::string& payload) {
+  char header[5];
+  header[0] = type;
+  encodeLength(payload.size(), header + 1);
+  return sendAll(fd, header, sizeof(header)) &&
+         sendAll(fd, payload.data(), payload.size());
+}
+
+static bool recvFrame(int fd, char& type, std::string& payload) {
+  char header[5];
+  if (!recvAll(fd, header, sizeof(header))) {
+    return false;
+  }
+  type = header[0];
+  auto length = decodeLength(header + 1);
+  if (length > kQuerySocketMaxFrame) {
+    return false;
+  }
+  payload.resize(length);
+  return length == 0 || recvAll(fd, &payload[0], length);
+}
+
+static void setSocketTimeout(int fd) {
+  struct timeval timeout;
+  timeout.tv_sec = kQuerySocketTimeout;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/// Send the column names frame, once, before the first row.
+static bool sendColumns(int fd, const std::string& names, bool& sent) {
+  if (sent) {
+    return true;
+  }
+  sent = true;
+  return sendFrame(fd, 'C', names);
+}
+
+/// Answer the one request of a client connection, streaming its rows.
+static void serveClient(int fd) {
+  setSocketTimeout(fd);
+  char header[4];
+  if (!recvAll(fd, header, sizeof(header))) {
+    return;
+  }
+  auto length = decodeLength(header);
+  if (length == 0 || length > kQuerySocketMaxFrame) {
+    sendFrame(fd, 'E', "Invalid request length");
+    return;
+  }
+  std::string q(length, 0);
+  if (!recvAll(fd, &q[0], length)) {
+    return;
+  }
+
+  // Expressions are not typed but are still named by the analysis.
+  std::string names;
+  tables::TableColumns columns;
+  bool analyzed = getQueryColumns(q, columns).ok() && !columns.empty();
+  for (const auto& column : columns) {
+    names += column.first + '\0';
+  }
+
+  // Each row is sent as it is stepped, a client that stops reading or a
+  // stopped socket ends the query.
+  auto& socket = getQuerySocket();
+  bool sent_columns = false;
+  bool disconnected = false;
+  std::string data;
+  auto writer = [&](Row& row) {
+    if (!analyzed && !sent_columns) {
+      for (const auto& column : row) {
+        names += column.first + '\0';
+      }
+    }
+    data.clear();
+    if (socket.stop || !serializeRowBinary(row, data).ok() ||
+        !sendColumns(fd, names, sent_columns) || !sendFrame(fd, 'R', data)) {
+      disconnected = true;
+      return Status(1, "Query socket client disconnected");
+    }
+    return Status(0, "OK");
+  };
+
+  auto status = queryInternalStream(q, nullptr, writer);
+  if (disconnected) {
+    return;
+  } else if (!status.ok() && !sent_columns &&
+             status.getMessage().find("single statement") !=
+                 std::string::npos) {
+    // Compound statements are not streamed, their rows are collected.
+    QueryData results;
+    status = query(q, results);
+    for (size_t i = 0; status.ok() && i < results.size(); ++i) {
+      if (!writer(results[i]).ok()) {
+        return;
+      }
+    }
+  }
+  if (!status.ok()) {
+    sendFrame(fd, 'E', status.getMessage());
+  } else if (sendColumns(fd, names, sent_columns)) {
+    sendFrame(fd, 'D', "");
+  }
+}
+
+/// A client connection served on its own thread.
+struct QueryClient {
+  std::thread thread;
+  std::shared_ptr<std::atomic<bool> > done;
+};
+
+/// Serve each client on its own thread until the socket is stopped.
+static void serveQueries(int listen_fd) {
+  auto& socket = getQuerySocket();
+  std::list<QueryClient> clients;
+  while (!socket.stop) {
+    // Join the threads of clients that were answered.
+    for (auto it = clients.begin(); it != clients.end();) {
+      if (*it->done) {
+        it->thread.join();
+        it = clients.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, kQuerySocketPollMs) <= 0) {
+      continue;
+    }
+
+    int client = ::accept(listen_fd, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    } else if (clients.size() >= kQuerySocketMaxClients) {
+      sendFrame(client, 'E', "Too many query socket clients");
+      ::close(client);
+      continue;
+    }
+
+    QueryClient served;
+    served.done = std::make_shared<std::atomic<bool> >(false);
+    auto done = served.done;
+    served.thread = std::thread([client, done]() {
+      serveClient(client);
+      ::close(client);
+      *done = true;
+    });
+    clients.push_back(std::move(served));
+  }
+
+  for (auto& served : clients) {
+    served.thread.join();
+  }
+}
+
+Status startQuerySocket(const std::string& path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return Status(1, "Invalid query socket path: " + path);
+  }
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  auto& socket = getQuerySocket();
+  std::lock_guard<std::mutex> lock(socket.mutex);
+  if (socket.fd >= 0) {
+    return Status(1, "The query socket is already started");
+  }
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return Status(1, "Cannot create socket: " + std::string(strerror(errno)));
+  }
+
+  // A socket left by an earlier worker would fail the bind.
+  struct stat info;
+  if (::lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+    ::unlink(path.c_str());
+  }
+
+  // Only the owner may connect. The process umask is shared with every
+  // thread, so the bound socket's mode is set before it accepts connections.
+  bool bound = (::bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+  if (!bound || ::chmod(path.c_str(), 0600) != 0 || ::listen(fd, 4) != 0) {
+    auto error = std::string(strerror(errno));
+    ::close(fd);
+    if (bound) {
+      ::unlink(path.c_str());
+    }
+    return Status(1, "Cannot listen on " + path + ": " + error);
+  }
+
+  socket.fd = fd;
+  socket.path = path;
+  socket.stop = false;
+  socket.server = std::thread(serveQueries, fd);
+  return Status(0, "OK");
+}
+
+void stopQuerySocket() {
+  auto& socket = getQuerySocket();
+  std::lock_guard<std::mutex> lock(socket.mutex);
+  if (socket.fd < 0) {
+    return;
+  }
+
+  socket.stop = true;
+  if (socket.server.joinable()) {
+    socket.server.join();
+  }
+  ::close(socket.fd);
+  ::unlink(socket.path.c_str());
+  socket.fd = -1;
+}
+
+Status queryDaemon(const std::string& path,
+                   const std::string& q,
+                   std::vector<std::string>& columns,
+                   QueryData& results) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return Status(1, "Invalid query socket path: " + path);
+  } else if (q.empty() || q.size() > kQuerySocketMaxFrame) {
+    return Status(1, "Invalid query length");
+  }
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return Status(1, "Cannot create socket: " + std::string(strerror(errno)));
+  }
+  if (::connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    auto error = std::string(strerror(errno));
+    ::close(fd);
+    return Status(1, "Cannot connect to " + path + ": " + error);
+  }
+
+  char header[4];
+  encodeLength(q.size(), header);
+  if (!sendAll(fd, header, sizeof(header)) ||
+      !sendAll(fd, q.data(), q.size())) {
+    ::close(fd);
+    return Status(1, "Cannot send the query to " + path);
+  }
+
+  // Rows are read as they stream in, without a timeout for long queries.
+  char type = 0;
+  std::string payload;
+  Status status(1, "The connection to " + path + " was closed");
+  while (recvFrame(fd, type, payload)) {
+    if (type == 'C') {
+      columns.clear();
+      size_t start = 0;
+      for (size_t i = 0; i < payload.size(); ++i) {
+        if (payload[i] == '\0') {
+          columns.push_back(payload.substr(start, i - start));
+          start = i + 1;
+        }
+      }
+      continue;
+    } else if (type == 'R') {
+      Row r;
+      auto row_status = deserializeRowBinary(payload, r);
+      if (row_status.ok()) {
+        results.push_back(std::move(r));
+        continue;
+      }
+      status = row_status;
+    } else if (type == 'E') {
+      status = Status(1, payload);
+    } else if (type == 'D') {
+      status = Status(0, "OK");
+    } else {
+      status = Status(1, "Unexpected response from " + path);
+    }
+    break;
+  }
+  ::close(fd);
+  return status;
+}
+}
@@ -0,0 +1,55 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <osquery/database/results.h>
+#include <osquery/status.h>
+
+namespace osquery {
+
+/**
+ * @brief Serve queries from a local UNIX socket in the calling process.
+ *
+ * A client writes one request: a 4-byte big-endian length and the SQL. The
+ * server answers with frames of a type byte and a 4-byte big-endian length:
+ * 'C' carries the NUL-separated column names, each 'R' one row in the binary
+ * row encoding, and the response ends with 'D', or 'E' and an error message.
+ * Rows are sent as the query steps, such that an 'E' may follow rows. Up to
+ * kQuerySocketMaxClients clients are served at once, each on a thread.
+ *
+ * The socket is created readable and writable by its owner only, queries
+ * run with the privileges and warm caches of the serving process.
+ *
+ * @param path the socket path, a stale socket at the path is replaced.
+ * @return success if the socket is listening.
+ */
+Status startQuerySocket(const std::string& path);
+
+/// Stop serving queries and remove the socket, if one was started.
+void stopQuerySocket();
+
+/**
+ * @brief Run a query in the process serving the socket at path.
+ *
+ * @param path the socket path given to startQuerySocket.
+ * @param q the query to execute.
+ * @param columns the result column names, in order.
+ * @param results the rows returned, those received before an error.
+ * @return the status of the query, or of the connection.
+ */
+Status queryDaemon(const std::string& path,
+                   const std::string& q,
+                   std::vector<std::string>& columns,
+                   QueryData& results);
+}
@@ -0,0 +1,114 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <osquery/core.h>
+
+#include "osquery/sql/query_socket.h"
+
+namespace osquery {
+
+const std::string kTestQuerySocket = "/tmp/osquery-query-socket-test.sock";
+
+class QuerySocketTests : public testing::Test {
+ protected:
+  void SetUp() { ASSERT_TRUE(startQuerySocket(kTestQuerySocket).ok()); }
+
+  void TearDown() { stopQuerySocket(); }
+};
+
+TEST_F(QuerySocketTests, test_query_daemon) {
+  std::vector<std::string> columns;
+  QueryData results;
+  auto status = queryDaemon(kTestQuerySocket,
+                            "SELECT 1 AS one, 'a' AS two UNION ALL "
+                            "SELECT 2, NULL",
+                            columns,
+                            results);
+  EXPECT_TRUE(status.ok());
+
+  std::vector<std::string> expected_columns = {"one", "two"};
+  EXPECT_EQ(columns, expected_columns);
+  ASSERT_EQ(results.size(), 2U);
+  EXPECT_EQ(results[0]["one"], "1");
+  EXPECT_EQ(results[0]["two"], "a");
+  EXPECT_EQ(results[1]["one"], "2");
+  EXPECT_EQ(results[1].count("two"), 1U);
+}
+
+TEST_F(QuerySocketTests, test_query_daemon_clients) {
+  // Clients are served at once, each reading its own streamed rows.
+  std::vector<Status> statuses(3);
+  std::vector<QueryData> results(3);
+  std::vector<std::thread> clients;
+  for (size_t i = 0; i < statuses.size(); ++i) {
+    clients.push_back(std::thread([&statuses, &results, i]() {
+      std::vector<std::string> columns;
+      statuses[i] = queryDaemon(kTestQuerySocket,
+                                "WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL "
+                                "SELECT x + 1 FROM n WHERE x < 1000) "
+                                "SELECT x FROM n",
+                                columns,
+                                results[i]);
+    }));
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  for (size_t i = 0; i < statuses.size(); ++i) {
+    EXPECT_TRUE(statuses[i].ok());
+    ASSERT_EQ(results[i].size(), 1000U);
+    EXPECT_EQ(results[i].back()["x"], "1000");
+  }
+
+  // Compound queries are collected rather than streamed.
+  std::vector<std::string> columns;
+  QueryData compound;
+  auto status = queryDaemon(
+      kTestQuerySocket, "SELECT 1 AS a; SELECT 2 AS a", columns, compound);
+  EXPECT_TRUE(status.ok());
+  EXPECT_FALSE(compound.empty());
+}
+
+TEST_F(QuerySocketTests, test_query_daemon_errors) {
+  std::vector<std::string> columns;
+  QueryData results;
+  // The query error is returned by the serving process.
+  auto status =
+      queryDaemon(kTestQuerySocket, "SELECT * FROM", columns, results);
+  EXPECT_FALSE(status.ok());
+  EXPECT_TRUE(results.empty());
+
+  // A second socket may not be started while the first is served.
+  EXPECT_FALSE(startQuerySocket(kTestQuerySocket).ok());
+  // Only the owner may connect to the socket.
+  struct stat info;
+  ASSERT_EQ(stat(kTestQuerySocket.c_str(), &info), 0);
+  EXPECT_EQ(info.st_mode & 0777, 0600U);
+
+  // The socket is removed when it is stopped.
+  stopQuerySocket();
+  EXPECT_NE(stat(kTestQuerySocket.c_str(), &info), 0);
+  status = queryDaemon(kTestQuerySocket, "SELECT 1", columns, results);
+  EXPECT_FALSE(status.ok());
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  osquery::initOsquery(argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -28,6 +28,7 @@ const std::map<tables::ConstraintOperator, std::string> kSQLOperatorRepr = {
     {tables::LESS_THAN_OR_EQUALS, "<="},
     {tables::LESS_THAN, "<"},
     {tables::GREATER_THAN_OR_EQUALS, ">="},
+    {tables::LIKE, "LIKE"},
 };
 
 SQL::SQL(const std::string& q) { status_ = query(q, results_); }
@@ -77,6 +78,18 @@ Status query(const std::string& q, QueryData& results) {
 #endif
 }
 
+Status queryCached(const std::string& q,
+                   QueryData& results,
+                   const tables::QueryBudgetRef& budget,
+                   const tables::TableSnapshotRef& snapshot,
+                   const tables::EventWindow& events) {
+#ifndef OSQUERY_BUILD_SDK
+  return queryInternalCached(q, results, budget, snapshot, events);
+#else
+  return query(q, results);
+#endif
+}
+
 Status getQueryColumns(const std::string& q, tables::TableColumns& columns) {
 // Depending on the build type (core or sdk/extension) osquery will call the
 // internal SQL implementation or the Thrift API endpoint.
@@ -86,4 +99,20 @@ Status getQueryColumns(const std::string& q, tables::TableColumns& columns) {
   return Status(0, "OK");
 #endif
 }
+
+Status getQueryTables(const std::string& q, std::set<std::string>& tables) {
+#ifndef OSQUERY_BUILD_SDK
+  return getQueryTablesInternal(q, tables);
+#else
+  return Status(0, "OK");
+#endif
+}
+
+Status getQueryPlan(const std::string& q, QueryPlan& plan) {
+#ifndef OSQUERY_BUILD_SDK
+  return getQueryPlanInternal(q, plan);
+#else
+  return Status(0, "OK");
+#endif
+}
 }
@@ -0,0 +1,83 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <osquery/core.h>
+#include <osquery/registry.h>
+#include <osquery/tables.h>
+
+#include "osquery/sql/sqlite_util.h"
+#include "osquery/sql/virtual_table.h"
+
+namespace osquery {
+namespace tables {
+
+/// The rows generated by the benchmark table.
+static size_t kBenchmarkRows = 0;
+
+class benchmarkTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() {
+    return {{"id", "INTEGER"}, {"name", "TEXT"}, {"path", "TEXT"}};
+  }
+
+  QueryData generate(QueryContext& request) {
+    QueryData results;
+    for (size_t i = 0; i < kBenchmarkRows; ++i) {
+      results.push_back({{"id", INTEGER(i)},
+                         {"name", "name_" + std::to_string(i)},
+                         {"path", "/usr/local/bin/name_" + std::to_string(i)}});
+    }
+    return results;
+  }
+};
+
+/// Each SELECT calls xFilter once, and xColumn for every value read.
+static void BM_virtual_table_scan(benchmark::State& state) {
+  kBenchmarkRows = state.range(0);
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  attachTable(db, "benchmark");
+  while (state.KeepRunning()) {
+    QueryData results;
+    queryInternal("SELECT * FROM benchmark", results, db);
+  }
+  sqlite3_close(db);
+  state.SetItemsProcessed(state.iterations() * kBenchmarkRows);
+}
+
+BENCHMARK(BM_virtual_table_scan)->Arg(100)->Arg(10000);
+
+/// SQLite checks the constraint, only one row is returned.
+static void BM_virtual_table_filter(benchmark::State& state) {
+  kBenchmarkRows = state.range(0);
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  attachTable(db, "benchmark");
+  while (state.KeepRunning()) {
+    QueryData results;
+    queryInternal("SELECT path FROM benchmark WHERE id = 1", results, db);
+  }
+  sqlite3_close(db);
+  state.SetItemsProcessed(state.iterations() * kBenchmarkRows);
+}
+
+BENCHMARK(BM_virtual_table_filter)->Arg(100)->Arg(10000);
+}
+}
+
+int main(int argc, char* argv[]) {
+  benchmark::Initialize(&argc, argv);
+  osquery::Registry::add<osquery::tables::benchmarkTablePlugin>("table",
+                                                                "benchmark");
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
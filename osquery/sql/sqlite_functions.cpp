@@ -0,0 +1,265 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <memory>
+#include <string>
+
+#include <arpa/inet.h>
+
+#include <boost/regex.hpp>
+
+#include <osquery/core.h>
+#include <osquery/database/hash_cache.h>
+
+#include "osquery/core/conversions.h"
+#include "osquery/sql/sqlite_util.h"
+
+namespace osquery {
+
+/// The text of a function argument, empty if it is NULL.
+static std::string getTextArgument(sqlite3_value* value) {
+  auto text = (const char*)sqlite3_value_text(value);
+  return (text == nullptr) ? "" : std::string(text, sqlite3_value_bytes(value));
+}
+
+static void resultText(sqlite3_context* context, const std::string& text) {
+  sqlite3_result_text(
+      context, text.c_str(), (int)text.size(), SQLITE_TRANSIENT);
+}
+
+/// The bytes are UTF-8 without NUL characters, they may be a text result.
+static bool isText(const std::string& bytes) {
+  size_t i = 0;
+  while (i < bytes.size()) {
+    auto byte = (unsigned char)bytes[i];
+    size_t continuation = 0;
+    if (byte == 0) {
+      return false;
+    } else if (byte < 0x80) {
+      continuation = 0;
+    } else if (byte >= 0xC2 && byte <= 0xDF) {
+      continuation = 1;
+    } else if (byte >= 0xE0 && byte <= 0xEF) {
+      continuation = 2;
+    } else if (byte >= 0xF0 && byte <= 0xF4) {
+      continuation = 3;
+    } else {
+      return false;
+    }
+
+    if (bytes.size() - i - 1 < continuation) {
+      return false;
+    }
+    for (size_t j = 1; j <= continuation; j++) {
+      if (((unsigned char)bytes[i + j] & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    i += continuation + 1;
+  }
+  return true;
+}
+
+static void destroyRegex(void* regex) { delete (boost::regex*)regex; }
+
+/// sha256(path): the SHA256 of a file's content, from the hash cache.
+static void sqliteSHA256(sqlite3_context* context,
+                         int argc,
+                         sqlite3_value** argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  auto hashes =
+      hashMultiFromFileCached(HASH_TYPE_SHA256, getTextArgument(argv[0]));
+  if (hashes.sha256.empty()) {
+    // The path is not a readable file.
+    sqlite3_result_null(context);
+    return;
+  }
+  resultText(context, hashes.sha256);
+}
+
+/**
+ * regex_match(text, pattern, group): a group of the pattern's first match.
+ *
+ * The group 0 is the whole match. A pattern is compiled once per statement
+ * and kept as the statement's auxiliary data while it is constant.
+ */
+static void sqliteRegexMatch(sqlite3_context* context,
+                             int argc,
+                             sqlite3_value** argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  auto regex = (boost::regex*)sqlite3_get_auxdata(context, 1);
+  std::unique_ptr<boost::regex> compiled;
+  if (regex == nullptr) {
+    try {
+      compiled.reset(new boost::regex(getTextArgument(argv[1])));
+    } catch (const boost::regex_error& e) {
+      sqlite3_result_error(context, "Invalid regex pattern", -1);
+      return;
+    }
+    regex = compiled.get();
+  }
+
+  auto text = getTextArgument(argv[0]);
+  auto group = (argc > 2) ? sqlite3_value_int64(argv[2]) : 0;
+  boost::smatch match;
+  bool found = false;
+  try {
+    found = boost::regex_search(text, match, *regex);
+  } catch (const std::runtime_error& e) {
+    // Boost refuses matches whose backtracking exceeds its complexity bound.
+    sqlite3_result_error(context, "Regex match is too complex", -1);
+    return;
+  }
+  if (!found || group < 0 || (size_t)group >= match.size() ||
+      !match[group].matched) {
+    sqlite3_result_null(context);
+  } else {
+    resultText(context, match[group].str());
+  }
+
+  if (compiled != nullptr) {
+    // SQLite may destroy the pattern at once, it is not used after this.
+    sqlite3_set_auxdata(context, 1, compiled.release(), destroyRegex);
+  }
+}
+
+/// split(text, delimiters, index): a token of the text, as osquery::split.
+static void sqliteSplit(sqlite3_context* context,
+                        int argc,
+                        sqlite3_value** argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  auto tokens =
+      osquery::split(getTextArgument(argv[0]), getTextArgument(argv[1]));
+  auto index = sqlite3_value_int64(argv[2]);
+  if (index < 0 || (size_t)index >= tokens.size()) {
+    sqlite3_result_null(context);
+    return;
+  }
+  resultText(context, tokens[index]);
+}
+
+/// inet_aton(address): the host-order integer of a dotted IPv4 address.
+static void sqliteInetAton(sqlite3_context* context,
+                           int argc,
+                           sqlite3_value** argv) {
+  struct in_addr address;
+  auto text = getTextArgument(argv[0]);
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      ::inet_pton(AF_INET, text.c_str(), &address) != 1) {
+    sqlite3_result_null(context);
+    return;
+  }
+  sqlite3_result_int64(context, (sqlite3_int64)ntohl(address.s_addr));
+}
+
+/// inet_ntoa(integer): the dotted IPv4 address of a host-order integer.
+static void sqliteInetNtoa(sqlite3_context* context,
+                           int argc,
+                           sqlite3_value** argv) {
+  auto value = sqlite3_value_int64(argv[0]);
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL || value < 0 ||
+      value > 0xFFFFFFFFLL) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  struct in_addr address;
+  address.s_addr = htonl((uint32_t)value);
+  char text[INET_ADDRSTRLEN] = {0};
+  ::inet_ntop(AF_INET, &address, text, sizeof(text));
+  resultText(context, text);
+}
+
+/// to_base64(text) and from_base64(text), using the core conversions.
+static void sqliteToBase64(sqlite3_context* context,
+                           int argc,
+                           sqlite3_value** argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+  resultText(context, base64Encode(getTextArgument(argv[0])));
+}
+
+static void sqliteFromBase64(sqlite3_context* context,
+                             int argc,
+                             sqlite3_value** argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+  std::string decoded;
+  try {
+    decoded = base64Decode(getTextArgument(argv[0]));
+  } catch (const std::exception& e) {
+    // Text with characters outside the base64 alphabet decodes to NULL.
+    sqlite3_result_null(context);
+    return;
+  }
+
+  // Decoded bytes that are not text, such as a digest, are a blob.
+  if (isText(decoded)) {
+    resultText(context, decoded);
+  } else {
+    sqlite3_result_blob(
+        context, decoded.data(), (int)decoded.size(), SQLITE_TRANSIENT);
+  }
+}
+
+/// A scalar function, its name, argument count, and implementation.
+struct SQLiteFunction {
+  const char* name;
+  int argc;
+  /// File hashes depend on the filesystem, SQLite must not fold them.
+  bool deterministic;
+  void (*function)(sqlite3_context*, int, sqlite3_value**);
+};
+
+const std::vector<SQLiteFunction> kSQLiteFunctions = {
+    {"sha256", 1, false, sqliteSHA256},
+    {"regex_match", 2, true, sqliteRegexMatch},
+    {"regex_match", 3, true, sqliteRegexMatch},
+    {"split", 3, true, sqliteSplit},
+    {"inet_aton", 1, true, sqliteInetAton},
+    {"inet_ntoa", 1, true, sqliteInetNtoa},
+    {"to_base64", 1, true, sqliteToBase64},
+    {"from_base64", 1, true, sqliteFromBase64},
+};
+
+void registerSQLiteFunctions(sqlite3* db) {
+  for (const auto& function : kSQLiteFunctions) {
+    int flags = SQLITE_UTF8;
+#ifdef SQLITE_DETERMINISTIC
+    flags |= (function.deterministic) ? SQLITE_DETERMINISTIC : 0;
+#endif
+    sqlite3_create_function(db,
+                            function.name,
+                            function.argc,
+                            flags,
+                            nullptr,
+                            function.function,
+                            nullptr,
+                            nullptr);
+  }
+}
+}
@@ -8,6 +8,9 @@
  *
  */
 
+#include <algorithm>
+#include <cctype>
+
 #include <osquery/core.h>
 #include <osquery/database.h>
 #include <osquery/logger.h>
@@ -18,6 +21,19 @@
 
 namespace osquery {
 
+DEFINE_osquery_flag(int32,
+                    sqlite_pool_size,
+                    4,
+                    "Number of idle attached SQLite connections to keep.");
+
+DEFINE_osquery_flag(int32,
+                    sqlite_statement_cache_size,
+                    64,
+                    "Number of prepared statements cached per connection.");
+
+std::atomic<size_t> SQLiteStatementCache::hits_(0);
+std::atomic<size_t> SQLiteStatementCache::misses_(0);
+
 const std::map<int, std::string> kSQLiteReturnCodes = {
     {0, "SQLITE_OK: Successful result"},
     {1, "SQLITE_ERROR: SQL error or missing database"},
@@ -65,10 +81,165 @@ std::string getStringForSQLiteReturnCode(int code) {
 sqlite3* createDB() {
   sqlite3* db = nullptr;
   sqlite3_open(":memory:", &db);
+  registerSQLiteFunctions(db);
   tables::attachVirtualTables(db);
   return db;
 }
 
+Status SQLiteStatementCache::prepare(const std::string& q,
+                                     sqlite3_stmt** stmt) {
+  auto it = lookup_.find(q);
+  if (it != lookup_.end()) {
+    // Move the statement to the front of the LRU.
+    statements_.splice(statements_.begin(), statements_, it->second);
+    *stmt = it->second->second;
+    sqlite3_reset(*stmt);
+    hits_++;
+    return Status(0, "OK");
+  }
+
+  misses_++;
+  VLOG(1) << "Preparing statement (hits: " << hits_ << ", misses: " << misses_
+          << "): " << q;
+  const char* tail = nullptr;
+  int rc = sqlite3_prepare_v2(db_, q.c_str(), q.size() + 1, stmt, &tail);
+  if (rc != SQLITE_OK || *stmt == nullptr) {
+    sqlite3_finalize(*stmt);
+    *stmt = nullptr;
+    return Status(1, (rc != SQLITE_OK) ? sqlite3_errmsg(db_) : "Empty query");
+  }
+
+  // Only the first statement is prepared, do not cache compound queries.
+  while (tail != nullptr && (*tail == ';' || isspace(*tail))) {
+    tail++;
+  }
+  if (tail != nullptr && *tail != 0) {
+    sqlite3_finalize(*stmt);
+    *stmt = nullptr;
+    return Status(1, "Query contains multiple statements");
+  }
+
+  if (FLAGS_sqlite_statement_cache_size <= 0) {
+    sqlite3_finalize(*stmt);
+    *stmt = nullptr;
+    return Status(1, "Statement cache is disabled");
+  }
+
+  while (statements_.size() >= (size_t)FLAGS_sqlite_statement_cache_size) {
+    // Evict the least recently used statement.
+    sqlite3_finalize(statements_.back().second);
+    lookup_.erase(statements_.back().first);
+    statements_.pop_back();
+  }
+
+  statements_.push_front(std::make_pair(q, *stmt));
+  lookup_[q] = statements_.begin();
+  return Status(0, "OK");
+}
+
+void SQLiteStatementCache::clear() {
+  for (auto& statement : statements_) {
+    sqlite3_finalize(statement.second);
+  }
+  statements_.clear();
+  lookup_.clear();
+}
+
+SQLiteDBInstance::~SQLiteDBInstance() {
+  SQLiteDBManager::instance().release(std::make_pair(db_, statements_),
+                                      generation_);
+}
+
+SQLiteDBManager& SQLiteDBManager::instance() {
+  static SQLiteDBManager manager;
+  return manager;
+}
+
+SQLiteDBManager::~SQLiteDBManager() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closeIdle();
+}
+
+void SQLiteDBManager::close(const Connection& connection) {
+  if (connection.second != nullptr) {
+    // Statements must be finalized before the connection will close.
+    connection.second->clear();
+  }
+  sqlite3_close(connection.first);
+}
+
+void SQLiteDBManager::closeIdle() {
+  for (const auto& connection : idle_) {
+    close(connection);
+  }
+  idle_.clear();
+}
+
+void SQLiteDBManager::checkGeneration() {
+  auto generation = Registry::generation("table");
+  if (generation != generation_) {
+    // Tables were added or removed, the idle connections are stale.
+    closeIdle();
+    generation_ = generation;
+  }
+}
+
+SQLiteDBInstanceRef SQLiteDBManager::get() {
+  auto& self = instance();
+  size_t generation = 0;
+  Connection connection(nullptr, nullptr);
+  {
+    std::lock_guard<std::mutex> lock(self.mutex_);
+    self.checkGeneration();
+    generation = self.generation_;
+    if (self.idle_.size() > 0) {
+      connection = self.idle_.back();
+      self.idle_.pop_back();
+    }
+  }
+
+  if (connection.first == nullptr) {
+    // Attaching tables is expensive, do not hold the pool lock.
+    connection.first = createDB();
+    connection.second =
+        std::make_shared<SQLiteStatementCache>(connection.first);
+  }
+  return std::make_shared<SQLiteDBInstance>(
+      connection.first, connection.second, generation);
+}
+
+void SQLiteDBManager::release(const Connection& connection,
+                              size_t generation) {
+  if (connection.first == nullptr) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkGeneration();
+    if (generation == generation_ &&
+        idle_.size() < (size_t)FLAGS_sqlite_pool_size) {
+      idle_.push_back(connection);
+      return;
+    }
+  }
+
+  // The connection is stale or the pool is full.
+  close(connection);
+}
+
+void SQLiteDBManager::reset() {
+  auto& self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  self.closeIdle();
+}
+
+size_t SQLiteDBManager::idleCount() {
+  auto& self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  return self.idle_.size();
+}
+
 int queryDataCallback(void* argument, int argc, char* argv[], char* column[]) {
   if (argument == nullptr) {
     LOG(ERROR) << "queryDataCallback received nullptr as data argument";
@@ -78,22 +249,26 @@ int queryDataCallback(void* argument, int argc, char* argv[], char* column[]) {
   QueryData* qData = (QueryData*)argument;
   Row r;
   for (int i = 0; i < argc; i++) {
-    r[column[i]] = argv[i];
+    // NULL values, such as unknown generated numbers, are empty strings.
+    r[column[i]] = (argv[i] != nullptr) ? argv[i] : "";
   }
   (*qData).push_back(r);
   return 0;
 }
 
 Status queryInternal(const std::string& q, QueryData& results) {
-  sqlite3* db = createDB();
-  auto status = queryInternal(q, results, db);
-  sqlite3_close(db);
-  return status;
+  auto dbc = SQLiteDBManager::get();
+  return queryInternal(q, results, dbc->db());
 }
 
 Status queryInternal(const std::string& q, QueryData& results, sqlite3* db) {
+  TraceSpan span("sqlite.exec");
   char* err = nullptr;
+  tables::setQueryScope(db, std::make_shared<tables::QueryScope>());
+  tables::TablePrefetch::start(db, q);
   sqlite3_exec(db, q.c_str(), queryDataCallback, &results, &err);
+  tables::TablePrefetch::finish(db);
+  tables::setQueryScope(db, nullptr);
   if (err != nullptr) {
     sqlite3_free(err);
     return Status(1, "Error running query: " + q);
@@ -102,12 +277,171 @@ Status queryInternal(const std::string& q, QueryData& results, sqlite3* db) {
   return Status(0, "OK");
 }
 
+/// Execute a query on a borrowed connection using its statement cache.
+static Status queryStatement(const SQLiteDBInstance& dbc,
+                             const std::string& q,
+                             QueryData& results) {
+  sqlite3_stmt* stmt = nullptr;
+  Status prepared;
+  {
+    TraceSpan span("sqlite.prepare");
+    prepared = dbc.statements().prepare(q, &stmt);
+  }
+  if (!prepared.ok()) {
+    // Compound or invalid queries use the non-cached path for error handling.
+    return queryInternal(q, results, dbc.db());
+  }
+
+  TraceSpan span("sqlite.step");
+  int rc;
+  int num_columns = sqlite3_column_count(stmt);
+  tables::setQueryScope(dbc.db(), std::make_shared<tables::QueryScope>());
+  tables::TablePrefetch::start(dbc.db(), q);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    Row r;
+    for (int i = 0; i < num_columns; i++) {
+      auto value = (const char*)sqlite3_column_text(stmt, i);
+      r[sqlite3_column_name(stmt, i)] = (value != nullptr) ? value : "";
+    }
+    results.push_back(std::move(r));
+  }
+
+  // Release any table cursors held by the cached statement.
+  sqlite3_reset(stmt);
+  tables::TablePrefetch::finish(dbc.db());
+  tables::setQueryScope(dbc.db(), nullptr);
+  if (rc != SQLITE_DONE) {
+    return Status(1, "Error running query: " + q);
+  }
+  return Status(0, "OK");
+}
+
+Status queryInternalCached(const std::string& q,
+                           QueryData& results,
+                           const tables::QueryBudgetRef& budget,
+                           const tables::TableSnapshotRef& snapshot,
+                           const tables::EventWindow& events) {
+  auto dbc = SQLiteDBManager::get();
+  if (budget == nullptr && snapshot == nullptr && !events.bounded() &&
+      events.offsets == nullptr) {
+    return queryStatement(*dbc, q, results);
+  }
+
+  if (budget != nullptr) {
+    tables::setQueryBudget(dbc->db(), budget);
+  }
+  tables::setQuerySnapshot(dbc->db(), snapshot);
+  tables::setQueryEvents(dbc->db(), events);
+  auto status = queryStatement(*dbc, q, results);
+  tables::setQueryEvents(dbc->db(), tables::EventWindow());
+  tables::setQuerySnapshot(dbc->db(), nullptr);
+  if (budget == nullptr) {
+    return status;
+  }
+
+  tables::setQueryBudget(dbc->db(), nullptr);
+  if (!status.ok() && budget->exceeded()) {
+    // Partial results of an interrupted query are not reported.
+    results.clear();
+    return Status(1, "Query exceeded its budget: " + q);
+  }
+  return status;
+}
+
+Status queryInternalStream(const std::string& q,
+                           const tables::QueryBudgetRef& budget,
+                           const QueryRowWriter& writer) {
+  auto dbc = SQLiteDBManager::get();
+  sqlite3_stmt* stmt = nullptr;
+  const char* tail = nullptr;
+  int rc = sqlite3_prepare_v2(dbc->db(), q.c_str(), -1, &stmt, &tail);
+  if (rc != SQLITE_OK) {
+    return Status(1, sqlite3_errmsg(dbc->db()));
+  }
+  std::unique_ptr<sqlite3_stmt, decltype(sqlite3_finalize)*> stmt_managed(
+      stmt, sqlite3_finalize);
+  if (stmt == nullptr) {
+    return Status(1, "Query has no statement: " + q);
+  }
+
+  // Text after the first statement may only hold whitespace or comments.
+  sqlite3_stmt* next = nullptr;
+  rc = sqlite3_prepare_v2(dbc->db(), tail, -1, &next, nullptr);
+  sqlite3_finalize(next);
+  if (rc != SQLITE_OK || next != nullptr) {
+    return Status(1, "Query must be a single statement: " + q);
+  }
+
+  if (budget != nullptr) {
+    tables::setQueryBudget(dbc->db(), budget);
+  }
+
+  TraceSpan span("sqlite.step");
+  Status status;
+  int num_columns = sqlite3_column_count(stmt);
+  tables::setQueryScope(dbc->db(), std::make_shared<tables::QueryScope>());
+  tables::TablePrefetch::start(dbc->db(), q);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    Row r;
+    for (int i = 0; i < num_columns; i++) {
+      auto value = (const char*)sqlite3_column_text(stmt, i);
+      r[sqlite3_column_name(stmt, i)] = (value != nullptr) ? value : "";
+    }
+    status = writer(r);
+    if (!status.ok()) {
+      break;
+    }
+  }
+
+  // Finalize before the prefetch finishes, releasing the table cursors.
+  stmt_managed.reset();
+  tables::TablePrefetch::finish(dbc->db());
+  tables::setQueryScope(dbc->db(), nullptr);
+  if (budget != nullptr) {
+    tables::setQueryBudget(dbc->db(), nullptr);
+  }
+  if (!status.ok()) {
+    return status;
+  } else if (rc != SQLITE_DONE) {
+    if (budget != nullptr && budget->exceeded()) {
+      return Status(1, "Query exceeded its budget: " + q);
+    }
+    return Status(1, "Error running query: " + q);
+  }
+  return Status(0, "OK");
+}
+
+/// Collect the tables read by a statement as SQLite authorizes the reads.
+static int tableReadAuthorizer(void* tables,
+                               int action,
+                               const char* table,
+                               const char* column,
+                               const char* database,
+                               const char* trigger) {
+  if (action == SQLITE_READ && table != nullptr) {
+    ((std::set<std::string>*)tables)->insert(table);
+  }
+  return SQLITE_OK;
+}
+
+Status getQueryTablesInternal(const std::string& q,
+                              std::set<std::string>& tables) {
+  auto dbc = SQLiteDBManager::get();
+  sqlite3_stmt* stmt = nullptr;
+  sqlite3_set_authorizer(dbc->db(), tableReadAuthorizer, &tables);
+  int rc = sqlite3_prepare_v2(dbc->db(), q.c_str(), -1, &stmt, nullptr);
+  sqlite3_set_authorizer(dbc->db(), nullptr, nullptr);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    return Status(1, sqlite3_errmsg(dbc->db()));
+  }
+  return Status(0, "OK");
+}
+
 Status getQueryColumnsInternal(const std::string& q,
     tables::TableColumns& columns) {
-  sqlite3* db = createDB();
-  Status status = getQueryColumnsInternal(q, columns, db);
-  sqlite3_close(db);
-  return status;
+  auto dbc = SQLiteDBManager::get();
+  return getQueryColumnsInternal(q, columns, dbc->db());
 }
 
 Status getQueryColumnsInternal(const std::string& q,
@@ -152,4 +486,125 @@ Status getQueryColumnsInternal(const std::string& q,
 
   return Status(0, "OK");
 }
+
+/// Split a query into lowercase identifiers and single punctuation tokens.
+static std::vector<std::string> getQueryTokens(const std::string& q) {
+  std::vector<std::string> tokens;
+  size_t i = 0;
+  while (i < q.size()) {
+    auto c = q[i];
+    if (std::isspace((unsigned char)c)) {
+      i++;
+    } else if (c == '\'') {
+      // String literals are skipped, quotes within them are doubled.
+      auto end = q.find('\'', i + 1);
+      while (end != std::string::npos && end + 1 < q.size() &&
+             q[end + 1] == '\'') {
+        end = q.find('\'', end + 2);
+      }
+      i = (end == std::string::npos) ? q.size() : end + 1;
+      tokens.push_back("'");
+    } else if (c == '"' || c == '`' || c == '[') {
+      auto close = (c == '[') ? ']' : c;
+      auto end = q.find(close, i + 1);
+      if (end == std::string::npos) {
+        end = q.size();
+      }
+      tokens.push_back(q.substr(i + 1, end - i - 1));
+      i = end + 1;
+    } else if (std::isalnum((unsigned char)c) || c == '_') {
+      auto start = i;
+      while (i < q.size() &&
+             (std::isalnum((unsigned char)q[i]) || q[i] == '_')) {
+        i++;
+      }
+      tokens.push_back(q.substr(start, i - start));
+    } else {
+      tokens.push_back(std::string(1, c));
+      i++;
+    }
+  }
+  for (auto& token : tokens) {
+    std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+  }
+  return tokens;
+}
+
+/**
+ * @brief Map the aliases given to a query's tables to the table names.
+ *
+ * A table name followed by an identifier, or by AS and an identifier, names
+ * the table by that alias.
+ */
+static std::map<std::string, std::string> getTableAliases(
+    const std::string& q, const std::set<std::string>& tables) {
+  std::map<std::string, std::string> aliases;
+  auto tokens = getQueryTokens(q);
+  for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+    if (tables.count(tokens[i]) == 0) {
+      continue;
+    }
+    auto j = (tokens[i + 1] == "as") ? i + 2 : i + 1;
+    if (j < tokens.size() && !tokens[j].empty() &&
+        (std::isalpha((unsigned char)tokens[j][0]) || tokens[j][0] == '_')) {
+      aliases[tokens[j]] = tokens[i];
+    }
+  }
+  return aliases;
+}
+
+Status getQueryPlanInternal(const std::string& q, QueryPlan& plan) {
+  auto dbc = SQLiteDBManager::get();
+  // Keep the statement prepared for the query's runs, compound queries and a
+  // disabled cache are not cached. This also reads the connection's schema
+  // before the authorizer collects the query's tables.
+  sqlite3_stmt* stmt = nullptr;
+  dbc->statements().prepare(q, &stmt);
+
+  sqlite3_set_authorizer(dbc->db(), tableReadAuthorizer, &plan.tables);
+  auto status = getQueryColumnsInternal(q, plan.columns, dbc->db());
+  sqlite3_set_authorizer(dbc->db(), nullptr, nullptr);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // Virtual tables report the number of constraints given to the generator
+  // as the plan's index number, a table without constraints generates every
+  // row.
+  QueryData details;
+  queryInternal("EXPLAIN QUERY PLAN " + q, details, dbc->db());
+  // Scans are reported by table name, SQLite may report a table's alias.
+  std::map<std::string, std::string> aliases;
+  for (const auto& detail : details) {
+    auto it = detail.find("detail");
+    if (it == detail.end() || it->second.find("SCAN ") != 0 ||
+        it->second.find("VIRTUAL TABLE INDEX 0:") == std::string::npos) {
+      continue;
+    }
+
+    // SQLite before 3.24 prefixes the table name with "TABLE", newer versions
+    // may name an aliased table by its alias instead.
+    auto name = it->second.substr(5);
+    if (name.find("TABLE ") == 0) {
+      name = name.substr(6);
+    }
+    name = name.substr(0, name.find(' '));
+    if (plan.tables.count(name) == 0) {
+      if (aliases.empty()) {
+        aliases = getTableAliases(q, plan.tables);
+      }
+      auto lower = name;
+      std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+      auto alias = aliases.find(lower);
+      if (alias != aliases.end()) {
+        name = alias->second;
+      }
+    }
+    if (std::find(plan.scans.begin(), plan.scans.end(), name) ==
+        plan.scans.end()) {
+      plan.scans.push_back(name);
+    }
+  }
+  return Status(0, "OK");
+}
 }
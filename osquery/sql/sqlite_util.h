@@ -10,9 +10,28 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
 #include <sqlite3.h>
 
+#include <osquery/flags.h>
+#include <osquery/sql.h>
+#include <osquery/tables.h>
+
 namespace osquery {
+
+DECLARE_int32(sqlite_pool_size);
+DECLARE_int32(sqlite_statement_cache_size);
+
 /**
  * @brief A map of SQLite status codes to their corresponding message string
  *
@@ -20,7 +39,11 @@ namespace osquery {
  */
 extern const std::map<int, std::string> kSQLiteReturnCodes;
 
-/// Internal (core) SQL implementation of the osquery query API.
+/**
+ * @brief Internal (core) SQL implementation of the osquery query API.
+ *
+ * The query is executed using a connection borrowed from SQLiteDBManager.
+ */
 Status queryInternal(const std::string& q, QueryData& results);
 
 /**
@@ -38,6 +61,58 @@ Status queryInternal(const std::string& q, QueryData& results);
  */
 Status queryInternal(const std::string& q, QueryData& results, sqlite3* db);
 
+/**
+ * @brief Execute a query using a cached prepared statement.
+ *
+ * Queries that run repeatedly, such as the scheduled queries, skip the SQLite
+ * parse and plan step after their first execution. The statement is cached
+ * on the pooled connection that borrowed it, see SQLiteStatementCache.
+ *
+ * Query text containing multiple statements is not cached and is executed
+ * with queryInternal.
+ *
+ * A query given a budget is interrupted once the budget is exceeded, see
+ * tables::setQueryBudget. A query given a snapshot reads its shared tables
+ * from the snapshot, see tables::TableSnapshot. A query given an event window
+ * reads only the events within it from event tables, see tables::EventWindow.
+ */
+Status queryInternalCached(
+    const std::string& q,
+    QueryData& results,
+    const tables::QueryBudgetRef& budget = nullptr,
+    const tables::TableSnapshotRef& snapshot = nullptr,
+    const tables::EventWindow& events = tables::EventWindow());
+
+/// Receives each result row of a streamed query, which it may move from.
+typedef std::function<Status(Row&)> QueryRowWriter;
+
+/**
+ * @brief Execute a single-statement query, giving each row to a writer.
+ *
+ * Rows are not collected, such that large results use constant memory. The
+ * statement is prepared on a pooled connection and not cached, ad-hoc query
+ * text would only evict the scheduled queries' statements.
+ *
+ * @param q the query to execute, compound queries are refused.
+ * @param budget optional time and CPU limits, the query fails if exceeded.
+ * @param writer called for each row, a failure stops the query.
+ * @return the status of the query, or the writer's first failure.
+ */
+Status queryInternalStream(const std::string& q,
+                           const tables::QueryBudgetRef& budget,
+                           const QueryRowWriter& writer);
+
+/**
+ * @brief Get the tables a query reads.
+ *
+ * The query is prepared, not executed, on a pooled connection.
+ *
+ * @param q the query to analyze.
+ * @param tables [output] the table names read by the query.
+ */
+Status getQueryTablesInternal(const std::string& q,
+                              std::set<std::string>& tables);
+
 /// Internal (core) SQL implementation of the osquery getQueryColumns API.
 Status getQueryColumnsInternal(const std::string& q, tables::TableColumns& columns);
 
@@ -59,6 +134,9 @@ Status getQueryColumnsInternal(const std::string& q,
                                tables::TableColumns& columns,
                                sqlite3* db);
 
+/// Internal (core) SQL implementation of the osquery getQueryPlan API.
+Status getQueryPlanInternal(const std::string& q, QueryPlan& plan);
+
 /**
  * @brief Return a fully configured sqlite3 database object
  *
@@ -73,6 +151,162 @@ Status getQueryColumnsInternal(const std::string& q,
  */
 sqlite3* createDB();
 
+/**
+ * @brief Register osquery's scalar SQL functions on a connection.
+ *
+ * Queries may hash, match, and convert values inline rather than joining
+ * helper tables: sha256(path), regex_match(text, pattern[, group]),
+ * split(text, delimiters, index), inet_aton, inet_ntoa, to_base64, and
+ * from_base64. Functions return NULL for NULL or unusable arguments.
+ *
+ * @param db the connection, createDB registers the functions on each.
+ */
+void registerSQLiteFunctions(sqlite3* db);
+
+/**
+ * @brief An LRU cache of prepared statements for a single SQLite connection.
+ *
+ * Statements are keyed by their query text. At most
+ * `--sqlite_statement_cache_size` statements are kept per connection, the
+ * least recently used statement is finalized when the cache is full.
+ * The hit and miss counters are shared by every connection's cache.
+ */
+class SQLiteStatementCache : private boost::noncopyable {
+ public:
+  explicit SQLiteStatementCache(sqlite3* db) : db_(db) {}
+  ~SQLiteStatementCache() { clear(); }
+
+  /**
+   * @brief Return a reset prepared statement for a query, preparing on miss.
+   *
+   * @param q the query text to prepare.
+   * @param stmt [output] the cached statement, owned by the cache.
+   * @return Failure if the query could not be prepared or is not cacheable.
+   */
+  Status prepare(const std::string& q, sqlite3_stmt** stmt);
+
+  /// Finalize every cached statement.
+  void clear();
+
+  /// The number of statements in this cache.
+  size_t size() const { return statements_.size(); }
+
+  /// The number of cached statement lookups across all connections.
+  static size_t hits() { return hits_; }
+
+  /// The number of statement lookups that required a prepare.
+  static size_t misses() { return misses_; }
+
+ private:
+  typedef std::pair<std::string, sqlite3_stmt*> CachedStatement;
+
+  /// The connection statements are prepared against.
+  sqlite3* db_;
+  /// Statements, most recently used first.
+  std::list<CachedStatement> statements_;
+  /// Lookup from query text to the LRU position.
+  std::unordered_map<std::string, std::list<CachedStatement>::iterator>
+      lookup_;
+
+  static std::atomic<size_t> hits_;
+  static std::atomic<size_t> misses_;
+};
+
+typedef std::shared_ptr<SQLiteStatementCache> SQLiteStatementCacheRef;
+
+/**
+ * @brief A borrowed, fully-attached SQLite database connection.
+ *
+ * Instances are handed out by SQLiteDBManager::get and return the underlying
+ * connection to the manager's pool when destroyed. Callers must not close
+ * the sqlite3 handle themselves.
+ */
+class SQLiteDBInstance : private boost::noncopyable {
+ public:
+  SQLiteDBInstance(sqlite3* db,
+                   const SQLiteStatementCacheRef& statements,
+                   size_t generation)
+      : db_(db), statements_(statements), generation_(generation) {}
+  ~SQLiteDBInstance();
+
+  /// Accessor to the borrowed SQLite database handle.
+  sqlite3* db() const { return db_; }
+
+  /// Accessor to the connection's prepared statement cache.
+  SQLiteStatementCache& statements() const { return *statements_; }
+
+ private:
+  /// The connection, owned by the manager's pool once released.
+  sqlite3* db_;
+  /// Prepared statements, which live as long as the connection.
+  SQLiteStatementCacheRef statements_;
+  /// The table registry generation the connection's tables were attached at.
+  size_t generation_;
+};
+
+typedef std::shared_ptr<SQLiteDBInstance> SQLiteDBInstanceRef;
+
+/**
+ * @brief A pool of SQLite connections with all virtual tables attached.
+ *
+ * Creating a database with createDB issues a module and CREATE VIRTUAL TABLE
+ * for every registered table, which may cost more than a query itself.
+ * The manager keeps released connections idle and hands them back out to
+ * scheduler threads, the watcher, and the shell.
+ *
+ * Idle connections are closed when the table registry generation changes,
+ * such that each borrowed connection reflects the current set of tables.
+ * At most `--sqlite_pool_size` idle connections are retained.
+ */
+class SQLiteDBManager : private boost::noncopyable {
+ public:
+  /// The process-wide connection pool.
+  static SQLiteDBManager& instance();
+
+  /**
+   * @brief Borrow a connection from the pool, creating one if none are idle.
+   *
+   * @return A connection reference that is returned to the pool on release.
+   */
+  static SQLiteDBInstanceRef get();
+
+  /// Close every idle connection, the next get will attach tables again.
+  static void reset();
+
+  /// The number of connections waiting in the pool.
+  static size_t idleCount();
+
+ protected:
+  SQLiteDBManager() : generation_(0) {}
+  virtual ~SQLiteDBManager();
+
+ private:
+  typedef std::pair<sqlite3*, SQLiteStatementCacheRef> Connection;
+
+  /// Return a connection to the pool, or close it if it is stale.
+  void release(const Connection& connection, size_t generation);
+
+  /// Close idle connections if the table registry has changed.
+  void checkGeneration();
+
+  /// Finalize a connection's statements then close the connection.
+  static void close(const Connection& connection);
+
+  /// Close every idle connection, the pool lock must be held.
+  void closeIdle();
+
+ private:
+  /// Idle connections ready to be borrowed.
+  std::vector<Connection> idle_;
+  /// The table registry generation of the idle connections.
+  size_t generation_;
+  /// Protect the idle pool and generation.
+  std::mutex mutex_;
+
+ private:
+  friend class SQLiteDBInstance;
+};
+
 /**
  * @brief Get a string representation of a SQLite return code
  */
@@ -90,6 +90,144 @@ TEST_F(SQLiteUtilTests, test_get_test_db_result_stream) {
   sqlite3_close(db);
 }
 
+TEST_F(SQLiteUtilTests, test_pooled_connection_reuse) {
+  SQLiteDBManager::reset();
+  sqlite3* first = nullptr;
+  {
+    auto dbc = SQLiteDBManager::get();
+    first = dbc->db();
+    EXPECT_TRUE(first != nullptr);
+    EXPECT_EQ(SQLiteDBManager::idleCount(), 0);
+  }
+
+  // The released connection is kept idle and handed back out.
+  EXPECT_EQ(SQLiteDBManager::idleCount(), 1);
+  auto dbc1 = SQLiteDBManager::get();
+  EXPECT_EQ(dbc1->db(), first);
+
+  // A concurrent borrow must not share the connection.
+  auto dbc2 = SQLiteDBManager::get();
+  EXPECT_NE(dbc2->db(), first);
+}
+
+TEST_F(SQLiteUtilTests, test_pooled_connection_query) {
+  QueryData results;
+  auto status = queryInternal("SELECT 1 AS one", results);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["one"], "1");
+
+  // The pooled connection survives for the next query.
+  EXPECT_GE(SQLiteDBManager::idleCount(), 1);
+}
+
+TEST_F(SQLiteUtilTests, test_cached_statement_query) {
+  SQLiteDBManager::reset();
+  auto misses = SQLiteStatementCache::misses();
+  auto hits = SQLiteStatementCache::hits();
+
+  QueryData results;
+  auto status = queryInternalCached("SELECT 1 AS one, NULL AS none", results);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["one"], "1");
+  EXPECT_EQ(results[0]["none"], "");
+  EXPECT_EQ(SQLiteStatementCache::misses(), misses + 1);
+
+  // The same query text reuses the statement prepared on the connection.
+  results.clear();
+  status = queryInternalCached("SELECT 1 AS one, NULL AS none", results);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(results.size(), 1);
+  EXPECT_EQ(SQLiteStatementCache::hits(), hits + 1);
+
+  // Compound queries are not cached but still execute.
+  results.clear();
+  status = queryInternalCached("SELECT 1 AS one; SELECT 2 AS one;", results);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(results.size(), 2);
+  EXPECT_EQ(SQLiteStatementCache::hits(), hits + 1);
+}
+
+TEST_F(SQLiteUtilTests, test_statement_cache_eviction) {
+  auto db = createDB();
+  FLAGS_sqlite_statement_cache_size = 2;
+  {
+    SQLiteStatementCache cache(db);
+    sqlite3_stmt* stmt = nullptr;
+    EXPECT_TRUE(cache.prepare("SELECT 1", &stmt).ok());
+    EXPECT_TRUE(cache.prepare("SELECT 2", &stmt).ok());
+    EXPECT_TRUE(cache.prepare("SELECT 3", &stmt).ok());
+    EXPECT_EQ(cache.size(), 2);
+    EXPECT_FALSE(cache.prepare("SELECT * FROM not_a_table", &stmt).ok());
+    EXPECT_EQ(cache.size(), 2);
+  }
+  FLAGS_sqlite_statement_cache_size = 64;
+  sqlite3_close(db);
+}
+
+TEST_F(SQLiteUtilTests, test_get_query_tables) {
+  std::set<std::string> tables;
+  auto status = getQueryTablesInternal(
+      "SELECT m.name FROM sqlite_master m, sqlite_temp_master t "
+      "WHERE m.name = t.name",
+      tables);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(tables,
+            std::set<std::string>({"sqlite_master", "sqlite_temp_master"}));
+
+  tables.clear();
+  status = getQueryTablesInternal("SELECT * FROM not_a_table", tables);
+  EXPECT_FALSE(status.ok());
+}
+
+TEST_F(SQLiteUtilTests, test_sql_functions) {
+  auto db = createDB();
+  QueryData results;
+  auto status = queryInternal(
+      "SELECT regex_match('osquery-1.4.5', '([0-9]+)\\.([0-9]+)', 2) AS minor, "
+      "regex_match('osquery', '[0-9]+') AS missing, "
+      "split('a, b,,c', ',', 2) AS token, "
+      "inet_aton('10.0.1.2') AS address, "
+      "inet_ntoa(167772418) AS dotted, "
+      "inet_aton('10.0.1') AS invalid, "
+      "to_base64('osquery') AS encoded, "
+      "from_base64('b3NxdWVyeQ==') AS decoded, "
+      "typeof(from_base64('AP8=')) AS binary_type, "
+      "hex(from_base64('AP8=')) AS binary, "
+      "from_base64('%%%%') AS undecodable, "
+      "sha256('/does/not/exist') AS digest",
+      results,
+      db);
+  ASSERT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 1U);
+  EXPECT_EQ(results[0]["minor"], "4");
+  EXPECT_EQ(results[0]["missing"], "");
+  EXPECT_EQ(results[0]["token"], "c");
+  EXPECT_EQ(results[0]["address"], "167772418");
+  EXPECT_EQ(results[0]["dotted"], "10.0.1.2");
+  EXPECT_EQ(results[0]["invalid"], "");
+  EXPECT_EQ(results[0]["encoded"], "b3NxdWVyeQ==");
+  EXPECT_EQ(results[0]["decoded"], "osquery");
+  EXPECT_EQ(results[0]["binary_type"], "blob");
+  EXPECT_EQ(results[0]["binary"], "00FF");
+  EXPECT_EQ(results[0]["undecodable"], "");
+  EXPECT_EQ(results[0]["digest"], "");
+
+  // An invalid pattern fails the query.
+  results.clear();
+  status = queryInternal("SELECT regex_match('a', '(', 0)", results, db);
+  EXPECT_FALSE(status.ok());
+
+  // A match exceeding the regex complexity bound fails the query.
+  status = queryInternal(
+      "SELECT regex_match(replace(hex(zeroblob(20)), '0', 'a'), '(a*)*b')",
+      results,
+      db);
+  EXPECT_FALSE(status.ok());
+  sqlite3_close(db);
+}
+
 TEST_F(SQLiteUtilTests, test_get_query_columns) {
   std::unique_ptr<sqlite3, decltype(sqlite3_close)*> db_managed(createDB(),
                                                                 sqlite3_close);
@@ -8,13 +8,256 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <future>
+
+#include <osquery/dispatcher.h>
 #include <osquery/logger.h>
+#include <osquery/sql.h>
 
 #include "osquery/sql/virtual_table.h"
 
 namespace osquery {
 namespace tables {
 
+DEFINE_osquery_flag(int32,
+                    table_cache_ttl,
+                    0,
+                    "Seconds to reuse results of cacheable tables (0 disables)");
+
+DEFINE_osquery_flag(bool,
+                    table_prefetch,
+                    false,
+                    "Generate independent tables of a query concurrently");
+
+TableResultCache &TableResultCache::instance() {
+  static TableResultCache cache;
+  return cache;
+}
+
+QueryDataRef TableResultCache::get(const std::string &table,
+                                   const std::string &key) {
+  auto &self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  auto result = self.results_.find(table + "\n" + key);
+  if (result == self.results_.end() ||
+      result->second.first < std::chrono::steady_clock::now()) {
+    return nullptr;
+  }
+  return result->second.second;
+}
+
+void TableResultCache::set(const std::string &table,
+                           const std::string &key,
+                           const QueryDataRef &rows) {
+  auto &self = instance();
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  for (auto it = self.results_.begin(); it != self.results_.end();) {
+    if (it->second.first < now) {
+      it = self.results_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  self.results_[table + "\n" + key] = std::make_pair(
+      now + std::chrono::seconds(FLAGS_table_cache_ttl), rows);
+}
+
+void TableResultCache::reset() {
+  auto &self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  self.results_.clear();
+}
+
+size_t TableResultCache::size() {
+  auto &self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  return self.results_.size();
+}
+
+size_t TableResultCache::bytes() {
+  auto &self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  size_t bytes = 0;
+  for (const auto &result : self.results_) {
+    for (const auto &row : *result.second.second) {
+      for (const auto &column : row) {
+        bytes += column.first.size() + column.second.size();
+      }
+    }
+  }
+  return bytes;
+}
+
+/**
+ * @brief Convert a generated value to a numeric column value.
+ *
+ * @param value the generated string value.
+ * @param type the column storage, INTEGER values must fit in an int.
+ * @param result [output] the converted value.
+ * @return true if the value was a well-formed number of the column type.
+ */
+static bool castInteger(const std::string &value,
+                        VirtualColumnType type,
+                        long long int &result) {
+  char *end = nullptr;
+  errno = 0;
+  result = strtoll(value.c_str(), &end, 10);
+  return !(value.empty() || isspace(value[0]) || errno != 0 || *end != 0 ||
+           (type == kColumnInteger && (result > INT_MAX || result < INT_MIN)));
+}
+
+/// True for the decimal text of an integer, which may be out of range.
+static bool isIntegerText(const std::string &value) {
+  size_t start = (!value.empty() && value[0] == '-') ? 1 : 0;
+  return value.size() > start &&
+         value.find_first_not_of("0123456789", start) == std::string::npos;
+}
+
+/// Append a number out of the column type's range, SQLite reads it as TEXT.
+static void appendOutOfRange(VirtualTableColumn &column,
+                             const std::string &text) {
+  column.texts[column.integers.size()] = text;
+  column.integers.push_back(0);
+  column.nulls.push_back(false);
+}
+
+/// Append an integer, values out of the column type's range are TEXT.
+static void appendInteger(VirtualTableColumn &column,
+                          bool valid,
+                          long long int value) {
+  if (valid && column.type == kColumnInteger &&
+      (value > INT_MAX || value < INT_MIN)) {
+    appendOutOfRange(column, std::to_string(value));
+    return;
+  }
+  column.integers.push_back((valid) ? value : 0);
+  column.nulls.push_back(!valid);
+}
+
+static void appendMissing(const VirtualTableContent &content, size_t i) {
+  VLOG(1) << "Table " << content.name << " row " << content.n
+          << " did not include column " << content.columns[i].first;
+}
+
+/// Append a generated row to the column storage of a virtual table.
+static void appendRow(VirtualTableContent &content, const Row &row) {
+  for (size_t i = 0; i < content.columns.size(); ++i) {
+    auto &column = content.data[i];
+    auto value = row.find(content.columns[i].first);
+    if (value == row.end()) {
+      appendMissing(content, i);
+    }
+
+    if (column.type == kColumnText) {
+      if (value != row.end()) {
+        column.arena.append(value->second);
+      }
+      column.offsets.push_back(column.arena.size());
+    } else if (column.type != kColumnNull) {
+      long long int afinite = 0;
+      bool valid = value != row.end() &&
+                   castInteger(value->second, column.type, afinite);
+      if (!valid && value != row.end() && isIntegerText(value->second)) {
+        appendOutOfRange(column, value->second);
+        continue;
+      } else if (!valid && value != row.end() && !value->second.empty()) {
+        // An empty value is an unknown value, others are generator bugs.
+        LOG(WARNING) << "Error casting " << content.columns[i].first << " ("
+                     << value->second << ") to " << content.columns[i].second;
+      }
+      appendInteger(column, valid, afinite);
+    }
+  }
+  content.n++;
+}
+
+/// Append a typed row, numbers are stored without a TEXT conversion.
+static void appendTypedRow(VirtualTableContent &content, const TypedRow &row) {
+  for (size_t i = 0; i < content.columns.size(); ++i) {
+    auto &column = content.data[i];
+    auto value = row.find(content.columns[i].first);
+    if (value == row.end()) {
+      appendMissing(content, i);
+    }
+
+    if (column.type == kColumnText) {
+      if (value != row.end()) {
+        column.arena.append(value->second.toString());
+      }
+      column.offsets.push_back(column.arena.size());
+    } else if (column.type != kColumnNull) {
+      long long int afinite = 0;
+      bool valid = false;
+      if (value != row.end()) {
+        const auto &typed = value->second;
+        if (typed.type == ColumnValue::kInteger) {
+          afinite = typed.integer;
+          valid = true;
+        } else if (typed.type == ColumnValue::kDouble) {
+          // Truncating a double outside the long long range is undefined.
+          valid = std::isfinite(typed.real) && typed.real > -9.2e18 &&
+                  typed.real < 9.2e18;
+          afinite = (valid) ? (long long int)typed.real : 0;
+          if (!valid && std::isfinite(typed.real)) {
+            appendOutOfRange(column, typed.toString());
+            continue;
+          }
+        } else if (typed.type == ColumnValue::kText) {
+          valid = castInteger(typed.text, column.type, afinite);
+          if (!valid && isIntegerText(typed.text)) {
+            appendOutOfRange(column, typed.text);
+            continue;
+          }
+        }
+      }
+      appendInteger(column, valid, afinite);
+    }
+  }
+  content.n++;
+}
+
+/**
+ * @brief Pull the next row from a streaming table cursor.
+ *
+ * The column storage holds only the current row, at index 0. When the cursor
+ * is exhausted it is released and n is left equal to the cursor row, such
+ * that xEof reports the end of the table.
+ */
+static void fetchRow(BaseCursor *pCur, VirtualTableContent &content) {
+  for (auto &column : content.data) {
+    column.clear();
+  }
+  content.n = pCur->row;
+
+  if (content.cursor != nullptr && content.cursor->typed()) {
+    TypedRow r;
+    if (content.cursor->nextTyped(r)) {
+      appendTypedRow(content, r);
+      content.n = pCur->row + 1;
+    } else {
+      content.cursor.reset();
+    }
+    return;
+  }
+
+  Row r;
+  if (content.cursor != nullptr && content.cursor->next(r)) {
+    appendRow(content, r);
+    content.n = pCur->row + 1;
+  } else {
+    content.cursor.reset();
+  }
+}
+
 int xOpen(sqlite3_vtab *pVTab, sqlite3_vtab_cursor **ppCursor) {
   int rc = SQLITE_NOMEM;
   BaseCursor *pCur;
@@ -30,8 +273,49 @@ int xOpen(sqlite3_vtab *pVTab, sqlite3_vtab_cursor **ppCursor) {
   return rc;
 }
 
+/// The bytes of generated values stored in a table's columns.
+static size_t contentBytes(const VirtualTableContent &content) {
+  size_t bytes = 0;
+  for (const auto &column : content.data) {
+    bytes += column.arena.size() + column.offsets.size() * sizeof(size_t) +
+             column.integers.size() * sizeof(long long int) +
+             column.nulls.size() / 8;
+    for (const auto &text : column.texts) {
+      bytes += text.second.size() + sizeof(size_t);
+    }
+  }
+  return bytes;
+}
+
+/// Add a filter or a streamed row, which took the given time, to a profile.
+static void profileTable(BaseCursor *pCur,
+                         VirtualTableContent &content,
+                         std::chrono::steady_clock::time_point start,
+                         bool filter) {
+  auto &table = (*content.profile)[content.name];
+  table.generate_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start).count();
+  bool row = pCur->row < content.n;
+  if (filter) {
+    table.filters++;
+  }
+  if (content.streaming) {
+    table.rows += (row) ? 1 : 0;
+  } else if (filter) {
+    table.rows += content.n;
+  }
+  if (content.streaming || filter) {
+    table.bytes += contentBytes(content);
+  }
+  table.returned += (row) ? 1 : 0;
+}
+
 int xClose(sqlite3_vtab_cursor *cur) {
   BaseCursor *pCur = (BaseCursor *)cur;
+  auto *pVtab = (VirtualTable *)cur->pVtab;
+
+  // Stop a streaming table, the query no longer needs rows.
+  pVtab->content->cursor.reset();
 
   delete pCur;
   return SQLITE_OK;
@@ -45,6 +329,7 @@ int xEof(sqlite3_vtab_cursor *cur) {
 
 int xDestroy(sqlite3_vtab *p) {
   auto *pVtab = (VirtualTable *)p;
+  TablePrefetch::detach(pVtab);
   delete pVtab->content;
   delete pVtab;
   return SQLITE_OK;
@@ -52,7 +337,24 @@ int xDestroy(sqlite3_vtab *p) {
 
 int xNext(sqlite3_vtab_cursor *cur) {
   BaseCursor *pCur = (BaseCursor *)cur;
+  auto *pVtab = (VirtualTable *)cur->pVtab;
   pCur->row++;
+  if (pVtab->content->profile != nullptr) {
+    auto start = std::chrono::steady_clock::now();
+    if (pVtab->content->streaming) {
+      fetchRow(pCur, *pVtab->content);
+    }
+    profileTable(pCur, *pVtab->content, start, false);
+  } else if (pVtab->content->streaming) {
+    fetchRow(pCur, *pVtab->content);
+  }
+
+  if (pVtab->content->streaming) {
+    if (pVtab->content->context.cancelled()) {
+      // The cursor may have stopped early, the rows are incomplete.
+      return SQLITE_INTERRUPT;
+    }
+  }
   return SQLITE_OK;
 }
 
@@ -76,32 +378,71 @@ int xCreate(sqlite3 *db,
 
   memset(pVtab, 0, sizeof(VirtualTable));
   pVtab->content = new VirtualTableContent;
+  pVtab->content->db = db;
 
-  PluginResponse response;
   pVtab->content->name = std::string(argv[0]);
-  auto status = Registry::call(
-      "table", pVtab->content->name, {{"action", "statement"}}, response);
-  if (!status.ok() || response.size() == 0) {
+  pVtab->content->plugin = PluginHandle("table", pVtab->content->name);
+
+  // Local tables share a definition, others describe it through the
+  // registry call API.
+  TableDefinition remote;
+  const TableDefinition *table = nullptr;
+  auto plugin =
+      std::dynamic_pointer_cast<TablePlugin>(pVtab->content->plugin.get());
+  if (plugin != nullptr) {
+    table = &plugin->definition();
+  } else {
+    PluginResponse statement;
+    PluginResponse columns;
+    auto status =
+        pVtab->content->plugin.call({{"action", "statement"}}, statement);
+    if (status.ok()) {
+      status = pVtab->content->plugin.call({{"action", "columns"}}, columns);
+    }
+    if (status.ok()) {
+      status =
+          TablePlugin::setDefinitionFromResponse(statement, columns, remote);
+    }
+    if (!status.ok()) {
+      return SQLITE_ERROR;
+    }
+    table = &remote;
+  }
+
+  if (table->columns.empty()) {
     return SQLITE_ERROR;
   }
 
-  int rc = sqlite3_declare_vtab(db, response[0].at("statement").c_str());
+  int rc = sqlite3_declare_vtab(db, table->statement.c_str());
   if (rc != SQLITE_OK) {
     return rc;
   }
 
-  // Also set the table column information.
-  status = Registry::call(
-      "table", pVtab->content->name, {{"action", "columns"}}, response);
-  if (!status.ok() || response.size() == 0) {
-    return SQLITE_ERROR;
-  }
+  pVtab->content->cacheable = table->cacheable;
+  pVtab->content->incremental = table->incremental;
+  pVtab->content->estimated_rows = table->estimated_rows;
+  pVtab->content->columns = table->columns;
+  for (const auto &column : table->columns) {
+    if (column.first == table->ordered) {
+      pVtab->content->ordered = pVtab->content->options.size();
+    }
+    auto option = table->options.find(column.first);
+    pVtab->content->options.push_back(
+        (option != table->options.end()) ? option->second : 0);
 
-  for (const auto &column : response) {
-    pVtab->content->columns.push_back(
-        std::make_pair(column.at("name"), column.at("type")));
+    VirtualTableColumn storage;
+    if (column.second == "TEXT") {
+      storage.type = kColumnText;
+    } else if (column.second == "INTEGER") {
+      storage.type = kColumnInteger;
+    } else if (column.second == "BIGINT") {
+      storage.type = kColumnBigInt;
+    }
+    storage.clear();
+    pVtab->content->data.push_back(std::move(storage));
   }
 
+  TablePrefetch::attach(pVtab);
   *ppVtab = (sqlite3_vtab *)pVtab;
   return rc;
 }
@@ -110,123 +451,771 @@ int xColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col) {
   BaseCursor *pCur = (BaseCursor *)cur;
   auto *pVtab = (VirtualTable *)cur->pVtab;
 
-  if (col >= pVtab->content->columns.size()) {
+  if (col < 0 || col >= pVtab->content->data.size() ||
+      pCur->row >= pVtab->content->n) {
     return SQLITE_ERROR;
   }
 
-  const auto &column_name = pVtab->content->columns[col].first;
-  const auto &type = pVtab->content->columns[col].second;
-  if (pCur->row >= pVtab->content->data[column_name].size()) {
-    return SQLITE_ERROR;
-  }
-
-  const auto &value = pVtab->content->data[column_name][pCur->row];
-  if (type == "TEXT") {
-    sqlite3_result_text(ctx, value.c_str(), -1, nullptr);
-  } else if (type == "INTEGER") {
-    int afinite;
-    try {
-      afinite = boost::lexical_cast<int>(value);
-    } catch (const boost::bad_lexical_cast &e) {
-      afinite = -1;
-      LOG(WARNING) << "Error casting " << column_name << " (" << value
-                   << ") to INTEGER";
-    }
-    sqlite3_result_int(ctx, afinite);
-  } else if (type == "BIGINT") {
-    long long int afinite;
-    try {
-      afinite = boost::lexical_cast<long long int>(value);
-    } catch (const boost::bad_lexical_cast &e) {
-      afinite = -1;
-      LOG(WARNING) << "Error casting " << column_name << " (" << value
-                   << ") to BIGINT";
-    }
-    sqlite3_result_int64(ctx, afinite);
+  // Streaming tables only store the current row.
+  size_t row = (pVtab->content->streaming) ? 0 : pCur->row;
+  const auto &column = pVtab->content->data[col];
+  auto text = (column.texts.empty()) ? column.texts.end()
+                                     : column.texts.find(row);
+  if (column.type != kColumnText && column.type != kColumnNull &&
+      column.nulls[row]) {
+    sqlite3_result_null(ctx);
+  } else if (text != column.texts.end()) {
+    sqlite3_result_text(
+        ctx, text->second.data(), text->second.size(), SQLITE_TRANSIENT);
+  } else if (column.type == kColumnText) {
+    // SQLite may hold column values (e.g., in aggregates) after the storage
+    // is reused by xNext or xFilter, let it copy into its reusable register.
+    size_t start = column.offsets[row];
+    sqlite3_result_text(ctx,
+                        column.arena.data() + start,
+                        column.offsets[row + 1] - start,
+                        SQLITE_TRANSIENT);
+  } else if (column.type == kColumnInteger) {
+    sqlite3_result_int(ctx, (int)column.integers[row]);
+  } else if (column.type == kColumnBigInt) {
+    sqlite3_result_int64(ctx, column.integers[row]);
   }
 
   return SQLITE_OK;
 }
 
+/// The full scan row estimate for tables that do not declare one.
+const double kDefaultEstimatedRows = 1000;
+
+/// The cost of a plan missing constraints on a table's required columns.
+const double kRequiredConstraintCost = 1e9;
+
+/// Plan markers for the LIMIT and OFFSET values passed to xFilter.
+const char kPlanLimit = 'L';
+const char kPlanOffset = 'O';
+
 static int xBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
   auto *pVtab = (VirtualTable *)tab;
-  pVtab->content->constraints.clear();
+  const auto &content = *pVtab->content;
 
-  int expr_index = 0;
-  int cost = 0;
+  // SQLite may call xBestIndex for several candidate plans, and a prepared
+  // statement keeps its plan across executions. The chosen plan's used columns
+  // and constraints are encoded in idxStr, which SQLite passes to xFilter.
+  unsigned long long cols_used = ~0ULL;
+#if SQLITE_VERSION_NUMBER >= 3010000
+  cols_used = (unsigned long long)pIdxInfo->colUsed;
+#endif
+  std::string plan = std::to_string(cols_used);
+
+  int limit_index = -1;
+  int offset_index = -1;
+  // Usable column constraints, and the EQUALS constraints on index columns.
+  std::vector<size_t> usable;
+  std::vector<size_t> index_equals;
+  size_t index_constraints = 0;
+  bool required_satisfied = false;
+  // Constraints checked only by SQLite filter rows after generation.
+  bool constrained = false;
   for (size_t i = 0; i < pIdxInfo->nConstraint; ++i) {
-    if (!pIdxInfo->aConstraint[i].usable) {
-      // A higher cost less priority, prefer more usable query constraints.
-      cost += 10;
+    const auto &constraint = pIdxInfo->aConstraint[i];
+#ifdef SQLITE_INDEX_CONSTRAINT_LIMIT
+    if (constraint.op == SQLITE_INDEX_CONSTRAINT_LIMIT) {
+      limit_index = i;
+      continue;
+    } else if (constraint.op == SQLITE_INDEX_CONSTRAINT_OFFSET) {
+      offset_index = i;
+      continue;
+    }
+#endif
+
+    if (constraint.iColumn < 0 || constraint.iColumn >= content.columns.size()) {
+      // Constraints on the rowid are not passed to the generator.
+      constrained = true;
+      continue;
+    }
+
+    int options = content.options[constraint.iColumn];
+    if (options & COLUMN_INDEX) {
+      index_constraints++;
+    }
+
+    if (!constraint.usable) {
       // TODO: OR is not usable.
+      constrained = true;
       continue;
     }
 
-    const auto &name =
-        pVtab->content->columns[pIdxInfo->aConstraint[i].iColumn].first;
-    pVtab->content->constraints.push_back(
-        std::make_pair(name, Constraint(pIdxInfo->aConstraint[i].op)));
+    usable.push_back(i);
+    if (constraint.op == EQUALS && (options & COLUMN_INDEX)) {
+      index_equals.push_back(i);
+    }
+    if (constraint.op == EQUALS && (options & COLUMN_REQUIRED)) {
+      required_satisfied = true;
+    }
+  }
+
+  // A single EQUALS on an index column is applied exactly by the generator.
+  // With several index constraints the generator may emit a union of rows.
+  bool omit = (index_equals.size() == 1 && index_constraints == 1);
+  int expr_index = 0;
+  for (const auto &i : usable) {
+    plan += "," + std::to_string(pIdxInfo->aConstraint[i].iColumn) + ":" +
+            std::to_string(pIdxInfo->aConstraint[i].op);
     pIdxInfo->aConstraintUsage[i].argvIndex = ++expr_index;
+    if (omit && i == index_equals[0]) {
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+    } else {
+      constrained = true;
+    }
+  }
+
+  // SQLite does not sort the table's natural ascending order.
+  bool ordered = (pIdxInfo->nOrderBy == 0);
+  if (pIdxInfo->nOrderBy == 1 && content.ordered >= 0 &&
+      pIdxInfo->aOrderBy[0].iColumn == content.ordered &&
+      !pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+    ordered = true;
+  }
+
+  // Pass the limit and offset only if every generated row is a result row.
+  if (!constrained && ordered && limit_index >= 0 &&
+      pIdxInfo->aConstraint[limit_index].usable) {
+    plan += std::string(",") + kPlanLimit;
+    pIdxInfo->aConstraintUsage[limit_index].argvIndex = ++expr_index;
+    if (offset_index >= 0 && pIdxInfo->aConstraint[offset_index].usable) {
+      plan += std::string(",") + kPlanOffset;
+      pIdxInfo->aConstraintUsage[offset_index].argvIndex = ++expr_index;
+    }
   }
 
+  // Estimate the rows generated by this plan, an index lookup yields only
+  // the rows for each expression.
+  double rows = (content.estimated_rows > 0) ? content.estimated_rows
+                                             : kDefaultEstimatedRows;
+  if (index_equals.size() > 0) {
+    rows = 1;
+  }
+
+  double cost = rows;
+  bool required = false;
+  for (const auto &options : content.options) {
+    required = required || (options & COLUMN_REQUIRED);
+  }
+  if (required && !required_satisfied) {
+    // The table cannot generate rows without a required constraint, prefer
+    // any plan that provides one (e.g., a join from another table).
+    cost = kRequiredConstraintCost;
+  }
+
+  // The number of constraints given to the generator, 0 for a full scan.
+  pIdxInfo->idxNum = (int)usable.size();
+  pIdxInfo->idxStr = sqlite3_mprintf("%s", plan.c_str());
+  pIdxInfo->needToFreeIdxStr = 1;
   pIdxInfo->estimatedCost = cost;
+#if SQLITE_VERSION_NUMBER >= 3008002
+  pIdxInfo->estimatedRows = (sqlite3_int64)rows;
+#endif
   return SQLITE_OK;
 }
 
-static int xFilter(sqlite3_vtab_cursor *pVtabCursor,
-                   int idxNum,
-                   const char *idxStr,
-                   int argc,
-                   sqlite3_value **argv) {
+/**
+ * @brief Decode the plan written to idxStr by xBestIndex.
+ *
+ * @param content the virtual table with column information.
+ * @param plan the idxStr created in xBestIndex.
+ * @param constraints [output] the column and operator for each argv.
+ * @param context [output] the used columns are set in the query context.
+ */
+static void decodePlan(const VirtualTableContent *content,
+                       const char *plan,
+                       ConstraintSet &constraints,
+                       QueryContext &context) {
+  if (plan == nullptr) {
+    return;
+  }
+
+  char *next = nullptr;
+  auto cols_used = strtoull(plan, &next, 10);
+  if (cols_used != ~0ULL) {
+    // The high bit is set when any column beyond the 63rd is used.
+    context.colsUsedSet = true;
+    for (size_t i = 0; i < content->columns.size(); ++i) {
+      if (i >= 63 || (cols_used & (1ULL << i))) {
+        context.colsUsed.insert(content->columns[i].first);
+      }
+    }
+  }
+
+  while (next != nullptr && *next == ',') {
+    if (next[1] == kPlanLimit || next[1] == kPlanOffset) {
+      // The argv is a LIMIT or OFFSET value, not a column constraint.
+      constraints.push_back(std::make_pair("", Constraint(next[1])));
+      next += 2;
+      continue;
+    }
+
+    auto column = strtoul(next + 1, &next, 10);
+    if (next == nullptr || *next != ':' || column >= content->columns.size()) {
+      break;
+    }
+    auto op = strtoul(next + 1, &next, 10);
+    constraints.push_back(std::make_pair(content->columns[column].first,
+                                         Constraint((unsigned char)op)));
+  }
+}
+
+/// Create the context for a plan, with column affinities, used columns, and
+/// the connection's query budget, event window, and scope.
+static void planContext(const VirtualTableContent &content,
+                        const char *plan,
+                        ConstraintSet &constraints,
+                        QueryContext &context) {
+  for (const auto &column : content.columns) {
+    context.constraints[column.first].setAffinity(column.second);
+  }
+  decodePlan(&content, plan, constraints, context);
+  context.budget = getQueryBudget(content.db);
+  context.events = getQueryEvents(content.db);
+  context.scope = getQueryScope(content.db);
+}
+
+/// Generate a local table's rows, sharing cacheable results.
+static QueryDataRef generateTable(const std::shared_ptr<TablePlugin> &plugin,
+                                  const std::string &name,
+                                  bool cacheable,
+                                  QueryContext &context) {
+  std::string key;
+  bool cache = (cacheable && FLAGS_table_cache_ttl > 0);
+  if (cache) {
+    key = context.key();
+    auto rows = TableResultCache::get(name, key);
+    if (rows != nullptr) {
+      return rows;
+    }
+  }
+
+  // In-process tables are given the context without serialization.
+  QueryDataRef rows = std::make_shared<QueryData>(plugin->generateRows(context));
+  if (cache && !context.cancelled()) {
+    TableResultCache::set(name, key, rows);
+  }
+  return rows;
+}
+
+/**
+ * @brief Check if a table's full scan may replace its constrained scans.
+ *
+ * Generators of tables with index or required columns produce rows for their
+ * constraints only, and SQLite may omit checks of index constraints.
+ */
+static bool isShareable(const VirtualTableContent &content) {
+  if (content.incremental) {
+    // Each scheduled query reads from its own file offsets.
+    return false;
+  }
+  for (const auto &options : content.options) {
+    if (options != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief The generation of one table by a query's prefetch.
+ *
+ * The task is generated once, by the first of a Dispatcher worker or the
+ * query's xFilter to claim it.
+ */
+class PrefetchTask : public apache::thrift::concurrency::Runnable {
+ public:
+  PrefetchTask(const std::shared_ptr<TablePlugin> &plugin,
+               const VirtualTableContent &content,
+               QueryContext &&context)
+      : plugin_(plugin),
+        name_(content.name),
+        cacheable_(content.cacheable),
+        context_(std::move(context)),
+        claimed_(false),
+        rows_(promise_.get_future().share()) {}
+
+  void run() {
+    if (claim()) {
+      generate();
+    }
+  }
+
+  /// Get the generated rows, generating them now if no worker started.
+  QueryDataRef get() {
+    if (claim()) {
+      generate();
+    }
+    return rows_.get();
+  }
+
+  /// Claim the task such that a worker will not generate it.
+  bool claim() {
+    bool expected = false;
+    return claimed_.compare_exchange_strong(expected, true);
+  }
+
+ private:
+  void generate() {
+    promise_.set_value(generateTable(plugin_, name_, cacheable_, context_));
+  }
+
+ private:
+  std::shared_ptr<TablePlugin> plugin_;
+  std::string name_;
+  bool cacheable_;
+  QueryContext context_;
+  std::atomic<bool> claimed_;
+  std::promise<QueryDataRef> promise_;
+  std::shared_future<QueryDataRef> rows_;
+};
+
+TablePrefetch &TablePrefetch::instance() {
+  static TablePrefetch prefetch;
+  return prefetch;
+}
+
+void TablePrefetch::attach(VirtualTable *table) {
+  auto &self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  self.tables_.insert(table);
+}
+
+void TablePrefetch::detach(VirtualTable *table) {
+  auto &self = instance();
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  self.tables_.erase(table);
+}
+
+void TablePrefetch::start(sqlite3 *db, const std::string &query) {
+  if (!FLAGS_table_prefetch) {
+    return;
+  }
+
+  // The EXPLAIN program opens each virtual table cursor with a VOpen, whose
+  // P4 is the sqlite3_vtab address, then a VFilter passes its chosen plan.
+  sqlite3_stmt *stmt = nullptr;
+  auto explain = "EXPLAIN " + query;
+  if (sqlite3_prepare_v2(db, explain.c_str(), -1, &stmt, nullptr) !=
+          SQLITE_OK ||
+      stmt == nullptr) {
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  auto &self = instance();
+  std::map<int, VirtualTable *> opened;
+  std::vector<std::pair<int, std::string> > filters;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    auto opcode = (const char *)sqlite3_column_text(stmt, 1);
+    auto p4 = (const char *)sqlite3_column_text(stmt, 5);
+    if (opcode == nullptr || p4 == nullptr) {
+      continue;
+    }
+
+    int cursor = sqlite3_column_int(stmt, 2);
+    if (strcmp(opcode, "VOpen") == 0 && strncmp(p4, "vtab:", 5) == 0) {
+      auto table = (VirtualTable *)strtoull(p4 + 5, nullptr, 16);
+      std::lock_guard<std::mutex> lock(self.mutex_);
+      // Only dereference the address if it is a live osquery table.
+      if (self.tables_.count(table) > 0 && table->content->db == db) {
+        opened[cursor] = table;
+      }
+    } else if (strcmp(opcode, "VFilter") == 0) {
+      filters.push_back(std::make_pair(cursor, std::string(p4)));
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  Tasks tasks;
+  for (const auto &filter : filters) {
+    // A plan with constraints or a LIMIT depends on values from the query.
+    if (opened.count(filter.first) == 0 ||
+        filter.second.find(',') != std::string::npos) {
+      continue;
+    }
+
+    const auto &content = *opened.at(filter.first)->content;
+    auto plugin = std::dynamic_pointer_cast<TablePlugin>(
+        Registry::get("table", content.name));
+    if (plugin == nullptr) {
+      continue;
+    }
+
+    ConstraintSet constraints;
+    QueryContext context;
+    planContext(content, filter.second.c_str(), constraints, context);
+    if (plugin->cursor(context) != nullptr) {
+      // Tables implementing a cursor are pulled by xFilter, not generated.
+      continue;
+    }
+    auto key = content.name + "\n" + context.key();
+    if (tasks.count(key) == 0) {
+      tasks[key] =
+          std::make_shared<PrefetchTask>(plugin, content, std::move(context));
+    }
+  }
+
+  if (tasks.size() < 2) {
+    // A single table is generated by xFilter as the query is stepped.
+    return;
+  }
+
+  for (const auto &task : tasks) {
+    // A task the Dispatcher does not accept is generated by xFilter.
+    Dispatcher::getInstance().add(task.second);
+  }
+
+  std::lock_guard<std::mutex> lock(self.mutex_);
+  self.tasks_[db] = std::move(tasks);
+}
+
+QueryDataRef TablePrefetch::take(sqlite3 *db,
+                                 const std::string &table,
+                                 const std::string &key) {
+  auto &self = instance();
+  std::shared_ptr<PrefetchTask> task;
+  {
+    std::lock_guard<std::mutex> lock(self.mutex_);
+    auto tasks = self.tasks_.find(db);
+    if (tasks == self.tasks_.end()) {
+      return nullptr;
+    }
+
+    auto result = tasks->second.find(table + "\n" + key);
+    if (result == tasks->second.end()) {
+      return nullptr;
+    }
+    task = result->second;
+  }
+
+  // Tasks are kept for the scans of nested loops until the query finishes.
+  return task->get();
+}
+
+void TablePrefetch::finish(sqlite3 *db) {
+  auto &self = instance();
+  Tasks tasks;
+  {
+    std::lock_guard<std::mutex> lock(self.mutex_);
+    auto result = self.tasks_.find(db);
+    if (result == self.tasks_.end()) {
+      return;
+    }
+    tasks = std::move(result->second);
+    self.tasks_.erase(result);
+  }
+
+  // Workers skip tasks the query did not need, a running task's results are
+  // released when it completes.
+  for (const auto &task : tasks) {
+    task.second->claim();
+  }
+}
+
+static int filterTable(sqlite3_vtab_cursor *pVtabCursor,
+                       const char *idxStr,
+                       int argc,
+                       sqlite3_value **argv) {
   BaseCursor *pCur = (BaseCursor *)pVtabCursor;
   auto *pVtab = (VirtualTable *)pVtabCursor->pVtab;
 
   pCur->row = 0;
   pVtab->content->n = 0;
-  QueryContext context;
+  pVtab->content->cursor.reset();
+  pVtab->content->streaming = false;
+  for (auto &column : pVtab->content->data) {
+    column.clear();
+  }
 
-  for (size_t i = 0; i < pVtab->content->columns.size(); ++i) {
-    pVtab->content->data[pVtab->content->columns[i].first].clear();
-    context.constraints[pVtab->content->columns[i].first].affinity =
-        pVtab->content->columns[i].second;
+  QueryContext context;
+  ConstraintSet constraints;
+  planContext(*pVtab->content, idxStr, constraints, context);
+  if (context.cancelled()) {
+    return SQLITE_INTERRUPT;
   }
+  int limit = 0;
+  int offset = 0;
+  for (size_t i = 0; i < argc && i < constraints.size(); ++i) {
+    if (constraints[i].first.empty()) {
+      if (constraints[i].second.op == kPlanLimit) {
+        limit = sqlite3_value_int(argv[i]);
+      } else {
+        offset = sqlite3_value_int(argv[i]);
+      }
+      continue;
+    }
 
-  for (size_t i = 0; i < argc; ++i) {
     auto expr = (const char *)sqlite3_value_text(argv[i]);
+    if (expr == nullptr) {
+      // A comparison with NULL is never true, and the constraint may have
+      // been omitted from SQLite's checks.
+      return SQLITE_OK;
+    }
     // Set the expression from SQLite's now-populated argv.
-    pVtab->content->constraints[i].second.expr = std::string(expr);
+    constraints[i].second.expr = std::string(expr);
     // Add the constraint to the column-sorted query request map.
-    context.constraints[pVtab->content->constraints[i].first].add(
-        pVtab->content->constraints[i].second);
+    context.constraints[constraints[i].first].add(constraints[i].second);
   }
 
-  PluginRequest request;
-  PluginResponse response;
-  request["action"] = "generate";
-  TablePlugin::setRequestFromContext(context, request);
-  Registry::call("table", pVtab->content->name, request, response);
+  // Parse the constraints once, generators may match rows in parallel.
+  for (auto &constraint : context.constraints) {
+    constraint.second.compile();
+  }
 
-  // Now organize the response rows by column instead of row.
-  for (const auto &row : response) {
-    for (const auto &column : pVtab->content->columns) {
-      try {
-        pVtab->content->data[column.first].push_back(row.at(column.first));
-      } catch (const std::out_of_range &e) {
-        VLOG(1) << "Table " << pVtab->content->name << " row "
-                << pVtab->content->n << " did not include column "
-                << column.first;
-        pVtab->content->data[column.first].push_back("");
+  if (limit > 0) {
+    // Generators produce rows for the offset as well, SQLite skips them.
+    context.limit = limit + std::max(offset, 0);
+  }
+
+  auto plugin =
+      std::dynamic_pointer_cast<TablePlugin>(pVtab->content->plugin.get());
+  QueryDataRef rows;
+  if (plugin != nullptr) {
+    pVtab->content->context = std::move(context);
+    // Tables implementing a cursor are pulled one row at a time, their rows
+    // are neither shared nor prefetched.
+    pVtab->content->cursor = plugin->cursor(pVtab->content->context);
+    if (pVtab->content->cursor != nullptr) {
+      pVtab->content->streaming = true;
+      fetchRow(pCur, *pVtab->content);
+      return (pVtab->content->context.cancelled()) ? SQLITE_INTERRUPT
+                                                   : SQLITE_OK;
+    }
+
+    auto snapshot = getQuerySnapshot(pVtab->content->db);
+    if (snapshot != nullptr && snapshot->shares(pVtab->content->name) &&
+        isShareable(*pVtab->content)) {
+      const auto &content = *pVtab->content;
+      // Only queries reading the same event window share generated rows.
+      auto shared_key = content.name;
+      if (content.context.events.bounded()) {
+        shared_key += ";" + std::to_string(content.context.events.start) + "-" +
+                      std::to_string(content.context.events.stop);
       }
+      rows = snapshot->get(shared_key, [&plugin, &content]() {
+        // The group's rows are generated without constraints or a budget.
+        ConstraintSet none;
+        QueryContext shared;
+        planContext(content, nullptr, none, shared);
+        shared.budget = nullptr;
+        // Shared tables are not incremental, no query's offsets are read.
+        shared.events.offsets = nullptr;
+        return generateTable(plugin, content.name, content.cacheable, shared);
+      });
+    } else {
+      rows = TablePrefetch::take(pVtab->content->db,
+                                 pVtab->content->name,
+                                 pVtab->content->context.key());
+    }
+
+    if (rows == nullptr) {
+      rows = generateTable(plugin,
+                           pVtab->content->name,
+                           pVtab->content->cacheable,
+                           pVtab->content->context);
+    }
+
+    if (pVtab->content->context.cancelled()) {
+      // A generator may have stopped early, its rows are incomplete.
+      return SQLITE_INTERRUPT;
+    }
+  } else {
+    // The table is not a local TablePlugin, use the registry call API.
+    PluginRequest request;
+    PluginResponse response;
+    request["action"] = "generate_batches";
+    TablePlugin::setRequestFromContext(context, request);
+    auto status = pVtab->content->plugin.call(request, response);
+    if (status.ok()) {
+      auto batches = std::make_shared<QueryData>();
+      for (const auto &batch : response) {
+        auto data = batch.find("batch");
+        status = (data != batch.end())
+                     ? deserializeQueryDataColumnar(data->second, *batches)
+                     : Status(1, "Missing row batch");
+        if (!status.ok()) {
+          break;
+        }
+      }
+      rows = batches;
+    }
+
+    if (!status.ok()) {
+      // Plugins without columnar batches respond with each row.
+      request["action"] = "generate";
+      response.clear();
+      pVtab->content->plugin.call(request, response);
+      rows = std::make_shared<QueryData>(std::move(response));
+    }
+  }
+
+  // Now organize the response rows by column instead of row.
+  auto &content = *pVtab->content;
+  for (size_t i = 0; i < content.columns.size(); ++i) {
+    if (content.data[i].type == kColumnText) {
+      content.data[i].offsets.reserve(rows->size() + 1);
+    } else {
+      content.data[i].integers.reserve(rows->size());
+      content.data[i].nulls.reserve(rows->size());
+    }
+  }
+
+  if (rows.use_count() == 1) {
+    // Rows not shared with a cache, snapshot, or prefetch are released as
+    // they are stored, such that only one copy of the values is held.
+    auto &generated = const_cast<QueryData &>(*rows);
+    for (auto &row : generated) {
+      appendRow(content, row);
+      Row().swap(row);
+    }
+  } else {
+    for (const auto &row : *rows) {
+      appendRow(content, row);
     }
-    pVtab->content->n++;
   }
 
   return SQLITE_OK;
 }
 
-int attachTable(sqlite3 *db, const std::string &name) {
-  int rc = SQLITE_OK;
+static int xFilter(sqlite3_vtab_cursor *pVtabCursor,
+                   int idxNum,
+                   const char *idxStr,
+                   int argc,
+                   sqlite3_value **argv) {
+  auto &content = *((VirtualTable *)pVtabCursor->pVtab)->content;
+  SampleTag tag(SAMPLE_TAG_TABLE, content.name);
+  TraceSpan span("xFilter", content.name);
+  content.profile = getQueryProfile(content.db);
+  if (content.profile == nullptr) {
+    return filterTable(pVtabCursor, idxStr, argc, argv);
+  }
+
+  // The plan's constraints show whether the generator was given the query's
+  // constraints or scanned the whole table.
+  ConstraintSet constraints;
+  QueryContext plan;
+  decodePlan(&content, idxStr, constraints, plan);
+  auto &used = (*content.profile)[content.name].constraints;
+  for (const auto &constraint : constraints) {
+    auto op = (ConstraintOperator)constraint.second.op;
+    if (constraint.first.empty()) {
+      used.insert((op == kPlanLimit) ? "LIMIT" : "OFFSET");
+    } else if (kSQLOperatorRepr.count(op) > 0) {
+      used.insert(constraint.first + " " + kSQLOperatorRepr.at(op));
+    } else {
+      used.insert(constraint.first + " " + std::to_string(op));
+    }
+  }
 
+  auto start = std::chrono::steady_clock::now();
+  auto rc = filterTable(pVtabCursor, idxStr, argc, argv);
+  profileTable((BaseCursor *)pVtabCursor, content, start, true);
+  return rc;
+}
+
+/// The number of SQLite virtual machine steps between budget checks.
+const int kBudgetCheckSteps = 1000;
+
+/// The budgets, snapshots, event windows, and scopes of queries on each
+/// connection.
+static std::map<sqlite3 *, QueryBudgetRef> kQueryBudgets;
+static std::map<sqlite3 *, TableSnapshotRef> kQuerySnapshots;
+static std::map<sqlite3 *, EventWindow> kQueryEvents;
+static std::map<sqlite3 *, QueryScopeRef> kQueryScopes;
+static std::map<sqlite3 *, QueryProfileRef> kQueryProfiles;
+static std::mutex kQueryBudgetsMutex;
+
+static int budgetProgressHandler(void *budget) {
+  // A non-zero return interrupts the running statement.
+  return ((QueryBudget *)budget)->exceeded() ? 1 : 0;
+}
+
+void setQueryBudget(sqlite3 *db, const QueryBudgetRef &budget) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  if (budget == nullptr) {
+    sqlite3_progress_handler(db, 0, nullptr, nullptr);
+    kQueryBudgets.erase(db);
+  } else {
+    kQueryBudgets[db] = budget;
+    sqlite3_progress_handler(
+        db, kBudgetCheckSteps, budgetProgressHandler, budget.get());
+  }
+}
+
+QueryBudgetRef getQueryBudget(sqlite3 *db) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  auto budget = kQueryBudgets.find(db);
+  return (budget != kQueryBudgets.end()) ? budget->second : nullptr;
+}
+
+void setQuerySnapshot(sqlite3 *db, const TableSnapshotRef &snapshot) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  if (snapshot == nullptr) {
+    kQuerySnapshots.erase(db);
+  } else {
+    kQuerySnapshots[db] = snapshot;
+  }
+}
+
+TableSnapshotRef getQuerySnapshot(sqlite3 *db) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  auto snapshot = kQuerySnapshots.find(db);
+  return (snapshot != kQuerySnapshots.end()) ? snapshot->second : nullptr;
+}
+
+void setQueryEvents(sqlite3 *db, const EventWindow &events) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  if (!events.bounded() && events.offsets == nullptr &&
+      events.snapshot == nullptr) {
+    kQueryEvents.erase(db);
+  } else {
+    kQueryEvents[db] = events;
+  }
+}
+
+EventWindow getQueryEvents(sqlite3 *db) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  auto events = kQueryEvents.find(db);
+  return (events != kQueryEvents.end()) ? events->second : EventWindow();
+}
+
+void setQueryScope(sqlite3 *db, const QueryScopeRef &scope) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  if (scope == nullptr) {
+    kQueryScopes.erase(db);
+  } else {
+    kQueryScopes[db] = scope;
+  }
+}
+
+QueryScopeRef getQueryScope(sqlite3 *db) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  auto scope = kQueryScopes.find(db);
+  return (scope != kQueryScopes.end()) ? scope->second : nullptr;
+}
+
+void setQueryProfile(sqlite3 *db, const QueryProfileRef &profile) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  if (profile == nullptr) {
+    kQueryProfiles.erase(db);
+  } else {
+    kQueryProfiles[db] = profile;
+  }
+}
+
+QueryProfileRef getQueryProfile(sqlite3 *db) {
+  std::lock_guard<std::mutex> lock(kQueryBudgetsMutex);
+  auto profile = kQueryProfiles.find(db);
+  return (profile != kQueryProfiles.end()) ? profile->second : nullptr;
+}
+
+int attachTable(sqlite3 *db, const std::string &name) {
   static sqlite3_module module = {
       0,
       xCreate,
@@ -250,21 +1239,39 @@ int attachTable(sqlite3 *db, const std::string &name) {
       0,
   };
 
-  // Column information is nice for virtual table create call.
-  PluginResponse response;
-  auto status = Registry::call(
-      "table", name, {{"action", "columns_definition"}}, response);
-  if (!status.ok() || response.size() == 0) {
+#if OSQUERY_EPONYMOUS_TABLES
+  // The module shares the table name, so SQLite connects the table when a
+  // statement uses it. Unused tables are never created in this connection.
+  if (!Registry::exists("table", name)) {
     return SQLITE_ERROR;
   }
+  return sqlite3_create_module(db, name.c_str(), &module, 0);
+#else
+  // Column information is nice for virtual table create call.
+  std::string definition;
+  auto plugin =
+      std::dynamic_pointer_cast<TablePlugin>(Registry::find("table", name));
+  if (plugin != nullptr) {
+    definition = plugin->definition().column_definition;
+  } else {
+    PluginResponse response;
+    auto status = Registry::call(
+        "table", name, {{"action", "columns_definition"}}, response);
+    if (!status.ok() || response.size() == 0 ||
+        response[0].count("definition") == 0) {
+      return SQLITE_ERROR;
+    }
+    definition = response[0].at("definition");
+  }
 
-  rc = sqlite3_create_module(db, name.c_str(), &module, 0);
+  int rc = sqlite3_create_module(db, name.c_str(), &module, 0);
   if (rc == SQLITE_OK) {
     auto format = "CREATE VIRTUAL TABLE temp." + name + " USING " + name +
-                  response[0].at("definition");
+                  definition;
     rc = sqlite3_exec(db, format.c_str(), 0, 0, 0);
   }
   return rc;
+#endif
 }
 
 void attachVirtualTables(sqlite3 *db) {
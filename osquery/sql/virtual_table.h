@@ -10,13 +10,29 @@
 
 #pragma once
 
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+#include <osquery/flags.h>
 #include <osquery/tables.h>
 
 #include "osquery/sql/sqlite_util.h"
 
+/// SQLite 3.9.0 creates eponymous virtual tables on first use.
+#if SQLITE_VERSION_NUMBER >= 3009000
+#define OSQUERY_EPONYMOUS_TABLES 1
+#else
+#define OSQUERY_EPONYMOUS_TABLES 0
+#endif
+
 namespace osquery {
 namespace tables {
 
+struct VirtualTable;
+
 /**
  * @brief osquery cursor object.
  *
@@ -29,12 +45,186 @@ struct BaseCursor {
   int row;
 };
 
+/// The storage used for a column's values, chosen from its SQL affinity.
+enum VirtualColumnType {
+  kColumnText,
+  kColumnInteger,
+  kColumnBigInt,
+  /// Unsupported affinities produce NULL values.
+  kColumnNull,
+};
+
+/**
+ * @brief Typed storage for the generated values of a single column.
+ *
+ * Numeric affinities are converted once when the generated rows are stored
+ * such that xColumn does not parse values. Missing or malformed numbers are
+ * NULL. TEXT values are copied into one contiguous arena, value i spans
+ * offsets[i] to offsets[i + 1].
+ */
+struct VirtualTableColumn {
+  VirtualColumnType type;
+  /// Values for INTEGER and BIGINT affinities.
+  std::vector<long long int> integers;
+  /// Set for each NULL value of INTEGER and BIGINT affinities.
+  std::vector<bool> nulls;
+  /// Numbers out of the range of INTEGER and BIGINT affinities, by row.
+  std::map<size_t, std::string> texts;
+  /// Contiguous TEXT values.
+  std::string arena;
+  /// The start of each TEXT value in the arena, with a trailing end offset.
+  std::vector<size_t> offsets;
+
+  VirtualTableColumn() : type(kColumnNull) {}
+
+  /// Remove all values, retaining allocated capacity for the next filter.
+  void clear() {
+    integers.clear();
+    nulls.clear();
+    texts.clear();
+    arena.clear();
+    offsets.assign(1, 0);
+  }
+};
+
 struct VirtualTableContent {
   TableName name;
+  /// The table's registry item, resolved once per connection.
+  PluginHandle plugin;
   TableColumns columns;
-  TableData data;
-  ConstraintSet constraints;
+  /// Generated values indexed by column ordinal.
+  std::vector<VirtualTableColumn> data;
   size_t n;
+  /// The ordinal of the column rows are generated sorted by, or -1.
+  int ordered;
+  /// The ColumnOptions bitmask for each column ordinal.
+  std::vector<int> options;
+  /// The table's expected number of rows in a full scan, 0 if unknown.
+  size_t estimated_rows;
+  /// Generated results may be shared through the TableResultCache.
+  bool cacheable;
+  /// Generated rows depend on the query's read offsets, and are not shared.
+  bool incremental;
+  /// The table is read from a cursor, data only holds the current row.
+  bool streaming;
+  /// The open cursor of a streaming table.
+  TableCursorRef cursor;
+  /// The context of the open cursor, which must outlive it.
+  QueryContext context;
+  /// The database connection the table is attached to.
+  sqlite3 *db;
+  /// The profile of the query scanning the table, if it is profiled.
+  QueryProfileRef profile;
+
+  VirtualTableContent()
+      : n(0),
+        ordered(-1),
+        estimated_rows(0),
+        cacheable(false),
+        incremental(false),
+        streaming(false),
+        db(nullptr) {}
+};
+
+DECLARE_int32(table_cache_ttl);
+
+/**
+ * @brief A short-lived cache of generated table results.
+ *
+ * Scheduled queries due at the same time often scan the same expensive
+ * tables. Results of tables declaring TablePlugin::cacheable are kept for
+ * `--table_cache_ttl` seconds, keyed by the table name and the QueryContext
+ * key, and shared by every connection's xFilter.
+ */
+class TableResultCache {
+ public:
+  /**
+   * @brief Find unexpired results for a table and context key.
+   *
+   * @return The cached rows, or nullptr if there is no fresh entry.
+   */
+  static QueryDataRef get(const std::string &table, const std::string &key);
+
+  /// Store generated results, expiring stale entries.
+  static void set(const std::string &table,
+                  const std::string &key,
+                  const QueryDataRef &rows);
+
+  /// Remove all cached results.
+  static void reset();
+
+  /// The number of cached results.
+  static size_t size();
+
+  /// The approximate bytes of the cached rows' names and values.
+  static size_t bytes();
+
+ private:
+  typedef std::chrono::steady_clock::time_point Expiration;
+
+  static TableResultCache &instance();
+
+ private:
+  /// Cached results and their expiration, keyed by table then context.
+  std::map<std::string, std::pair<Expiration, QueryDataRef> > results_;
+  /// Protect the cache across scheduler and connection threads.
+  std::mutex mutex_;
+};
+
+DECLARE_bool(table_prefetch);
+
+class PrefetchTask;
+
+/**
+ * @brief Generate the independent tables of a query concurrently.
+ *
+ * SQLite steps a join one table at a time and xFilter generates each table
+ * when its loop is first entered, so the slowest generators run serially.
+ * Before a query is stepped, its EXPLAIN program is inspected for virtual
+ * tables scanned without constraints. When there are several, each is
+ * generated on the Dispatcher thread pool and xFilter takes the results.
+ */
+class TablePrefetch {
+ public:
+  /**
+   * @brief Start generating the unconstrained tables of a query.
+   *
+   * @param db the connection the query will be stepped on.
+   * @param query a single SQL statement.
+   */
+  static void start(sqlite3 *db, const std::string &query);
+
+  /**
+   * @brief Take the prefetched results of a table.
+   *
+   * If the table's task has not started it is run on the calling thread,
+   * otherwise this waits for the worker generating it.
+   *
+   * @return The generated rows, or nullptr if the table was not prefetched
+   * with an equal QueryContext.
+   */
+  static QueryDataRef take(sqlite3 *db,
+                           const std::string &table,
+                           const std::string &key);
+
+  /// Release the prefetched results and cancel unstarted tasks of a query.
+  static void finish(sqlite3 *db);
+
+  /// Track the tables that may be found in EXPLAIN programs.
+  static void attach(VirtualTable *table);
+  static void detach(VirtualTable *table);
+
+ private:
+  typedef std::map<std::string, std::shared_ptr<PrefetchTask> > Tasks;
+
+  static TablePrefetch &instance();
+
+ private:
+  /// The prefetch tasks of each connection's query, keyed by table then context.
+  std::map<sqlite3 *, Tasks> tasks_;
+  /// The addresses of live virtual tables.
+  std::set<VirtualTable *> tables_;
+  std::mutex mutex_;
 };
 
 /**
@@ -48,7 +238,79 @@ struct VirtualTable {
   VirtualTableContent *content;
 };
 
-/// Attach a table plugin name to an in-memory SQLite datable.
+/**
+ * @brief Set the budget of the query running on a connection.
+ *
+ * SQLite checks the budget every few thousand virtual machine steps and
+ * interrupts the query when it is exceeded. xFilter passes the budget to
+ * generators through QueryContext::budget.
+ *
+ * @param db the connection.
+ * @param budget the query's budget, or nullptr to remove it.
+ */
+void setQueryBudget(sqlite3 *db, const QueryBudgetRef &budget);
+
+/// Get the budget of the query running on a connection, or nullptr.
+QueryBudgetRef getQueryBudget(sqlite3 *db);
+
+/**
+ * @brief Set the shared table snapshot of the query running on a connection.
+ *
+ * @param db the connection.
+ * @param snapshot the snapshot shared by the query's group, or nullptr.
+ */
+void setQuerySnapshot(sqlite3 *db, const TableSnapshotRef &snapshot);
+
+/// Get the shared table snapshot of the query running on a connection.
+TableSnapshotRef getQuerySnapshot(sqlite3 *db);
+
+/**
+ * @brief Set the event window of the query running on a connection.
+ *
+ * xFilter passes the window to generators through QueryContext::events.
+ *
+ * @param db the connection.
+ * @param events the query's event window, an unbounded window without read
+ *        offsets removes it.
+ */
+void setQueryEvents(sqlite3 *db, const EventWindow &events);
+
+/// Get the event window of the query running on a connection.
+EventWindow getQueryEvents(sqlite3 *db);
+
+/**
+ * @brief Set the generator state of the query running on a connection.
+ *
+ * xFilter passes the scope to generators through QueryContext::scope.
+ *
+ * @param db the connection.
+ * @param scope a new scope for the query, or nullptr once it finished.
+ */
+void setQueryScope(sqlite3 *db, const QueryScopeRef &scope);
+
+/// Get the generator state of the query running on a connection.
+QueryScopeRef getQueryScope(sqlite3 *db);
+
+/**
+ * @brief Profile the virtual tables used by queries on a connection.
+ *
+ * Each xFilter adds its time, rows, and stored bytes to the profile.
+ *
+ * @param db the connection.
+ * @param profile the profile to add to, or nullptr to stop profiling.
+ */
+void setQueryProfile(sqlite3 *db, const QueryProfileRef &profile);
+
+/// Get the profile of the queries running on a connection, or nullptr.
+QueryProfileRef getQueryProfile(sqlite3 *db);
+
+/**
+ * @brief Attach a table plugin name to an in-memory SQLite datable.
+ *
+ * With OSQUERY_EPONYMOUS_TABLES only the table's module is registered, the
+ * table is created in the connection when a statement first uses its name.
+ * Otherwise the table is created in the temp schema immediately.
+ */
 int attachTable(sqlite3 *db, const std::string &name);
 
 /// Attach all table plugins to an in-memory SQLite datable.
@@ -8,12 +8,15 @@
  *
  */
 
+#include <atomic>
+
 #include <gtest/gtest.h>
 
 #include <osquery/core.h>
 #include <osquery/registry.h>
 #include <osquery/sql.h>
 
+#include "osquery/sql/sqlite_util.h"
 #include "osquery/sql/virtual_table.h"
 
 namespace osquery {
@@ -42,6 +45,34 @@ TEST_F(VirtualTableTests, test_tableplugin_statement) {
   EXPECT_EQ("CREATE TABLE sample(foo INTEGER, bar TEXT)", table->statement());
 }
 
+TEST_F(VirtualTableTests, test_tableplugin_definition) {
+  auto table = std::make_shared<sampleTablePlugin>();
+  table->setName("sample");
+  const auto& definition = table->definition();
+  EXPECT_EQ("CREATE TABLE sample(foo INTEGER, bar TEXT)",
+            definition.statement);
+  EXPECT_EQ("(foo INTEGER, bar TEXT)", definition.column_definition);
+  EXPECT_EQ(2U, definition.columns.size());
+  EXPECT_TRUE(definition.ordered.empty());
+  EXPECT_FALSE(definition.cacheable);
+
+  // A definition read through the registry call API matches.
+  PluginResponse statement;
+  PluginResponse columns;
+  EXPECT_TRUE(table->call({{"action", "statement"}}, statement).ok());
+  EXPECT_TRUE(table->call({{"action", "columns"}}, columns).ok());
+  TableDefinition remote;
+  auto status =
+      TablePlugin::setDefinitionFromResponse(statement, columns, remote);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(definition.statement, remote.statement);
+  EXPECT_EQ(definition.columns, remote.columns);
+
+  columns.clear();
+  EXPECT_FALSE(
+      TablePlugin::setDefinitionFromResponse(statement, columns, remote).ok());
+}
+
 TEST_F(VirtualTableTests, test_sqlite3_attach_vtable) {
   auto table = std::make_shared<sampleTablePlugin>();
   table->setName("sample");
@@ -57,11 +88,719 @@ TEST_F(VirtualTableTests, test_sqlite3_attach_vtable) {
   rc = osquery::tables::attachTable(db, "sample");
   EXPECT_EQ(rc, SQLITE_OK);
 
+#if OSQUERY_EPONYMOUS_TABLES
+  // The table is created when a statement first uses it.
+  sqlite3_stmt* stmt = nullptr;
+  rc = sqlite3_prepare_v2(db, "SELECT * FROM sample", -1, &stmt, nullptr);
+  EXPECT_EQ(rc, SQLITE_OK);
+  ASSERT_EQ(sqlite3_column_count(stmt), 2);
+  EXPECT_EQ(std::string(sqlite3_column_name(stmt, 0)), "foo");
+  EXPECT_EQ(std::string(sqlite3_column_name(stmt, 1)), "bar");
+  sqlite3_finalize(stmt);
+#else
   std::string q = "SELECT sql FROM sqlite_temp_master WHERE tbl_name='sample';";
   QueryData results;
   auto status = queryInternal(q, results, db);
   EXPECT_EQ("CREATE VIRTUAL TABLE sample USING sample(foo INTEGER, bar TEXT)",
             results[0]["sql"]);
+#endif
+  sqlite3_close(db);
+}
+
+/// Count the rows pulled from streaming table cursors.
+static size_t kCountingRowsPulled = 0;
+
+class countingTableCursor : public TableCursor {
+ public:
+  countingTableCursor() : next_(0) {}
+
+  bool next(Row& r) {
+    if (next_ >= 1000) {
+      return false;
+    }
+    r["value"] = INTEGER(next_++);
+    kCountingRowsPulled++;
+    return true;
+  }
+
+ private:
+  int next_;
+};
+
+class countingTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"value", "INTEGER"}}; }
+
+ public:
+  TableCursorRef cursor(QueryContext& request) {
+    return std::make_shared<countingTableCursor>();
+  }
+};
+
+TEST_F(VirtualTableTests, test_tableplugin_cursor) {
+  Registry::add<countingTablePlugin>("table", "counting");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "counting"), SQLITE_OK);
+
+  // SQLite stops pulling rows once the limit is satisfied.
+  kCountingRowsPulled = 0;
+  QueryData results;
+  auto status =
+      queryInternal("SELECT value FROM counting LIMIT 3", results, db);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 3);
+  EXPECT_EQ(results[2]["value"], "2");
+  EXPECT_LE(kCountingRowsPulled, 4);
+
+  // A full scan drains the cursor.
+  results.clear();
+  status = queryInternal("SELECT count(*) AS c FROM counting", results, db);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["c"], "1000");
+  sqlite3_close(db);
+
+  // The registry API drains the cursor into a response.
+  PluginResponse response;
+  status = Registry::call("table", "counting", {{"action", "generate"}},
+                          response);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(response.size(), 1000);
+}
+
+class typedTableCursor : public TypedTableCursor {
+ public:
+  typedTableCursor() : next_(0) {}
+
+  bool nextTyped(TypedRow& r) {
+    if (next_ >= 3) {
+      return false;
+    }
+    r["name"] = "row";
+    r["size"] = 18446744073709551615ULL;
+    r["ratio"] = (next_ == 2) ? 1e30 : 0.5;
+    if (next_ > 0) {
+      // The first row has an unknown value, stored as NULL.
+      r["value"] = next_ * 10;
+    }
+    next_++;
+    return true;
+  }
+
+ private:
+  int next_;
+};
+
+class typedTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() {
+    return {{"name", "TEXT"},
+            {"value", "INTEGER"},
+            {"size", "BIGINT"},
+            {"ratio", "BIGINT"}};
+  }
+
+ public:
+  TableCursorRef cursor(QueryContext& request) {
+    return std::make_shared<typedTableCursor>();
+  }
+};
+
+class untypedTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() {
+    return {{"name", "TEXT"},
+            {"value", "INTEGER"},
+            {"size", "BIGINT"},
+            {"count", "INTEGER"}};
+  }
+
+ public:
+  QueryData generate(QueryContext& request) {
+    return {
+        {{"name", "row"}, {"size", "not_a_number"}, {"count", "4294967296"}}};
+  }
+};
+
+TEST_F(VirtualTableTests, test_tableplugin_typed_cursor) {
+  Registry::add<typedTablePlugin>("table", "typed");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "typed"), SQLITE_OK);
+
+  QueryData results;
+  auto status = queryInternal(
+      "SELECT typeof(value) AS t, value, size, typeof(size) AS size_t, "
+      "ratio FROM typed",
+      results,
+      db);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 3);
+  EXPECT_EQ(results[0]["t"], "null");
+  EXPECT_EQ(results[1]["t"], "integer");
+  EXPECT_EQ(results[2]["value"], "20");
+  // An unsigned value out of the range of SQLite integers is kept as TEXT.
+  EXPECT_EQ(results[0]["size"], "18446744073709551615");
+  EXPECT_EQ(results[0]["size_t"], "text");
+  // Doubles are truncated, those out of the integer range are kept as TEXT.
+  EXPECT_EQ(results[0]["ratio"], "0");
+  EXPECT_EQ(results[2]["ratio"], "1e+30");
+
+  results.clear();
+  status = queryInternal("SELECT * FROM typed WHERE value > 10", results, db);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["name"], "row");
+
+  // Missing and malformed generated numbers are NULL rather than -1.
+  Registry::add<untypedTablePlugin>("table", "untyped");
+  EXPECT_EQ(osquery::tables::attachTable(db, "untyped"), SQLITE_OK);
+  results.clear();
+  status = queryInternal(
+      "SELECT typeof(value) AS v, typeof(size) AS s, count FROM untyped",
+      results,
+      db);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["v"], "null");
+  EXPECT_EQ(results[0]["s"], "null");
+  EXPECT_EQ(results[0]["count"], "4294967296");
+  sqlite3_close(db);
+
+  // Callers pulling Rows receive the typed values as TEXT.
+  typedTableCursor cursor;
+  Row r;
+  EXPECT_TRUE(cursor.next(r));
+  EXPECT_EQ(r.count("value"), 0);
+  EXPECT_EQ(r["size"], "18446744073709551615");
+  r.clear();
+  EXPECT_TRUE(cursor.next(r));
+  EXPECT_EQ(r["value"], "10");
+}
+
+TEST_F(VirtualTableTests, test_tableplugin_generate_batches) {
+  if (!Registry::exists("table", "counting")) {
+    Registry::add<countingTablePlugin>("table", "counting");
+  }
+
+  // Streaming tables stop at the limit of the serialized context.
+  QueryContext context;
+  context.limit = 10;
+  PluginRequest request = {{"action", "generate_batches"},
+                           {"batch_rows", "4"}};
+  TablePlugin::setRequestFromContext(context, request);
+  kCountingRowsPulled = 0;
+  PluginResponse response;
+  auto status = Registry::call("table", "counting", request, response);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(kCountingRowsPulled, 10);
+  ASSERT_EQ(response.size(), 3);
+
+  QueryData rows;
+  for (const auto& batch : response) {
+    EXPECT_TRUE(deserializeQueryDataColumnar(batch.at("batch"), rows).ok());
+  }
+  ASSERT_EQ(rows.size(), 10);
+  EXPECT_EQ(rows[0]["value"], "0");
+  EXPECT_EQ(rows[9]["value"], "9");
+}
+
+/// The limit provided to the most recent orderedTablePlugin generate.
+static int kOrderedLimit = 0;
+
+class orderedTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"value", "INTEGER"}, {"name", "TEXT"}}; }
+
+  std::string naturalOrder() { return "value"; }
+
+  QueryData generate(QueryContext& request) {
+    kOrderedLimit = request.limit;
+    QueryData results;
+    for (int i = 0; i < 10 && !request.limitReached(results.size()); i++) {
+      results.push_back({{"value", INTEGER(i)}, {"name", TEXT(9 - i)}});
+    }
+    return results;
+  }
+};
+
+TEST_F(VirtualTableTests, test_tableplugin_limit_order) {
+  Registry::add<orderedTablePlugin>("table", "ordered");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "ordered"), SQLITE_OK);
+
+  QueryData results;
+  queryInternal(
+      "SELECT value FROM ordered ORDER BY value LIMIT 2 OFFSET 1", results, db);
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_EQ(results[0]["value"], "1");
+  EXPECT_EQ(results[1]["value"], "2");
+#ifdef SQLITE_INDEX_CONSTRAINT_LIMIT
+  // The generator must produce the offset rows too.
+  EXPECT_EQ(kOrderedLimit, 3);
+#endif
+
+  // Ordering by another column is sorted by SQLite, without a limit.
+  results.clear();
+  queryInternal("SELECT value FROM ordered ORDER BY name LIMIT 1", results, db);
+  EXPECT_EQ(kOrderedLimit, 0);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["value"], "9");
+
+  // Constraints filter rows after generation, the limit is not passed.
+  results.clear();
+  queryInternal(
+      "SELECT value FROM ordered WHERE name = '0' LIMIT 1", results, db);
+  EXPECT_EQ(kOrderedLimit, 0);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["value"], "9");
+  sqlite3_close(db);
+}
+
+/// The number of indexedTablePlugin generate calls without a path.
+static size_t kIndexedScans = 0;
+
+TEST_F(VirtualTableTests, test_query_profile) {
+  Registry::add<orderedTablePlugin>("table", "ordered");
+  Registry::add<countingTablePlugin>("table", "counting");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "ordered"), SQLITE_OK);
+  EXPECT_EQ(osquery::tables::attachTable(db, "counting"), SQLITE_OK);
+
+  auto profile = std::make_shared<QueryProfile>();
+  setQueryProfile(db, profile);
+  QueryData results;
+  queryInternal("SELECT * FROM ordered WHERE name > '6'", results, db);
+  queryInternal("SELECT value FROM counting LIMIT 5", results, db);
+  setQueryProfile(db, nullptr);
+  EXPECT_EQ(results.size(), 8);
+
+  // SQLite reads every generated row and applies the constraint itself.
+  const auto& ordered = (*profile)["ordered"];
+  EXPECT_EQ(ordered.filters, 1);
+  EXPECT_EQ(ordered.rows, 10);
+  EXPECT_EQ(ordered.returned, 10);
+  EXPECT_GT(ordered.bytes, 0);
+  // The generator was given the constraint.
+  EXPECT_EQ(ordered.constraints, std::set<std::string>({"name >"}));
+
+  // Cursor rows are counted as they are pulled.
+  const auto& counting = (*profile)["counting"];
+  EXPECT_EQ(counting.filters, 1);
+  EXPECT_GE(counting.rows, 5);
+  EXPECT_EQ(counting.returned, counting.rows);
+
+  // Queries are not profiled once the profile is removed.
+  queryInternal("SELECT * FROM ordered", results, db);
+  EXPECT_EQ((*profile)["ordered"].filters, 1);
+  sqlite3_close(db);
+}
+
+class indexedTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"path", "TEXT"}, {"size", "INTEGER"}}; }
+
+  TableColumnOptions columnOptions() {
+    return {{"path", COLUMN_INDEX | COLUMN_REQUIRED}};
+  }
+
+  size_t estimatedRows() { return 100000; }
+
+  QueryData generate(QueryContext& request) {
+    QueryData results;
+    auto paths = request.constraints["path"].getAll(EQUALS);
+    if (paths.size() == 0) {
+      kIndexedScans++;
+    }
+    for (const auto& path : paths) {
+      results.push_back({{"path", path}, {"size", INTEGER(path.size())}});
+    }
+    return results;
+  }
+};
+
+TEST_F(VirtualTableTests, test_tableplugin_index_cost) {
+  Registry::add<indexedTablePlugin>("table", "indexed");
+  Registry::add<orderedTablePlugin>("table", "ordered");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "indexed"), SQLITE_OK);
+  EXPECT_EQ(osquery::tables::attachTable(db, "ordered"), SQLITE_OK);
+
+  QueryData results;
+  queryInternal("SELECT * FROM indexed WHERE path = 'a'", results, db);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["size"], "1");
+
+  // A comparison with NULL never matches, even if the check is omitted.
+  results.clear();
+  queryInternal("SELECT * FROM indexed WHERE path = NULL", results, db);
+  EXPECT_EQ(results.size(), 0);
+
+  // The planner should drive the join from the table without requirements.
+  kIndexedScans = 0;
+  results.clear();
+  queryInternal(
+      "SELECT o.value, i.size FROM indexed i, ordered o WHERE i.path = o.name",
+      results,
+      db);
+  EXPECT_EQ(results.size(), 10);
+  EXPECT_EQ(kIndexedScans, 0);
+  sqlite3_close(db);
+}
+
+TEST_F(VirtualTableTests, test_query_plan) {
+  Registry::add<indexedTablePlugin>("table", "indexed");
+  Registry::add<orderedTablePlugin>("table", "ordered");
+  SQLiteDBManager::reset();
+
+  QueryPlan plan;
+  auto status = getQueryPlanInternal(
+      "SELECT o.value, i.size FROM indexed i, ordered o WHERE i.path = o.name",
+      plan);
+  ASSERT_TRUE(status.ok());
+  ASSERT_EQ(plan.columns.size(), 2);
+  EXPECT_EQ(plan.columns[0].first, "value");
+  EXPECT_EQ(plan.tables, std::set<std::string>({"indexed", "ordered"}));
+  // Only the table driving the join generates every row, it is reported by
+  // its name rather than its alias.
+  EXPECT_EQ(plan.scans, std::vector<std::string>({"ordered"}));
+
+  // The prepared statement is reused by the first run.
+  auto hits = SQLiteStatementCache::hits();
+  QueryData results;
+  queryInternalCached(
+      "SELECT o.value, i.size FROM indexed i, ordered o WHERE i.path = o.name",
+      results);
+  EXPECT_EQ(results.size(), 10);
+  EXPECT_EQ(SQLiteStatementCache::hits(), hits + 1);
+
+  plan = QueryPlan();
+  status = getQueryPlanInternal("SELECT * FROM indexed WHERE path = 'a'", plan);
+  ASSERT_TRUE(status.ok());
+  EXPECT_TRUE(plan.scans.empty());
+
+  plan = QueryPlan();
+  status = getQueryPlanInternal(
+      "SELECT * FROM indexed, ordered AS \"O\" WHERE path = 'ordered x'",
+      plan);
+  ASSERT_TRUE(status.ok());
+  EXPECT_EQ(plan.scans, std::vector<std::string>({"ordered"}));
+
+  plan = QueryPlan();
+  status = getQueryPlanInternal("SELECT * FROM not_a_table", plan);
+  EXPECT_FALSE(status.ok());
+}
+
+/// The number of cachedTablePlugin generate calls.
+static size_t kCachedGenerates = 0;
+
+class cachedTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"value", "INTEGER"}}; }
+
+  bool cacheable() { return true; }
+
+  QueryData generate(QueryContext& request) {
+    kCachedGenerates++;
+    return {{{"value", INTEGER(kCachedGenerates)}}};
+  }
+};
+
+TEST_F(VirtualTableTests, test_table_result_cache) {
+  Registry::add<cachedTablePlugin>("table", "cached");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "cached"), SQLITE_OK);
+
+  // Without a TTL every scan generates.
+  kCachedGenerates = 0;
+  QueryData results;
+  queryInternal("SELECT * FROM cached", results, db);
+  queryInternal("SELECT * FROM cached", results, db);
+  EXPECT_EQ(kCachedGenerates, 2);
+
+  FLAGS_table_cache_ttl = 60;
+  TableResultCache::reset();
+  results.clear();
+  queryInternal("SELECT * FROM cached", results, db);
+  queryInternal("SELECT * FROM cached", results, db);
+  EXPECT_EQ(kCachedGenerates, 3);
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_EQ(results[0]["value"], results[1]["value"]);
+
+  // A different constraint set is a different cache entry.
+  results.clear();
+  queryInternal("SELECT * FROM cached WHERE value = 3", results, db);
+  EXPECT_EQ(kCachedGenerates, 4);
+  EXPECT_EQ(TableResultCache::size(), 2);
+  // Each entry holds one "value" column of one digit.
+  EXPECT_EQ(TableResultCache::bytes(), 12);
+
+  FLAGS_table_cache_ttl = 0;
+  TableResultCache::reset();
+  sqlite3_close(db);
+}
+
+/// Count the generate calls of the prefetched tables.
+static std::atomic<int> kPrefetchGenerates(0);
+
+class prefetchTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"value", "INTEGER"}}; }
+
+  QueryData generate(QueryContext& request) {
+    kPrefetchGenerates++;
+    QueryData results;
+    for (int i = 0; i < 4; ++i) {
+      results.push_back({{"value", INTEGER(i)}});
+    }
+    return results;
+  }
+};
+
+TEST_F(VirtualTableTests, test_table_prefetch) {
+  Registry::add<prefetchTablePlugin>("table", "prefetch_left");
+  Registry::add<prefetchTablePlugin>("table", "prefetch_right");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "prefetch_left"), SQLITE_OK);
+  EXPECT_EQ(osquery::tables::attachTable(db, "prefetch_right"), SQLITE_OK);
+
+  // Without prefetching the inner table is generated for every outer row.
+  kPrefetchGenerates = 0;
+  QueryData results;
+  std::string q = "SELECT l.value FROM prefetch_left l, prefetch_right r";
+  queryInternal(q, results, db);
+  EXPECT_EQ(results.size(), 16);
+  EXPECT_EQ(kPrefetchGenerates, 5);
+
+  // Both unconstrained tables are generated once, before stepping.
+  FLAGS_table_prefetch = true;
+  kPrefetchGenerates = 0;
+  results.clear();
+  queryInternal(q, results, db);
+  EXPECT_EQ(results.size(), 16);
+  EXPECT_EQ(kPrefetchGenerates, 2);
+
+  // Prefetched results are not reused by later queries.
+  results.clear();
+  queryInternal(q, results, db);
+  EXPECT_EQ(kPrefetchGenerates, 4);
+
+  // A table constrained by the join is generated by xFilter.
+  results.clear();
+  queryInternal(
+      "SELECT l.value FROM prefetch_left l, prefetch_right r "
+      "WHERE l.value = r.value",
+      results,
+      db);
+  EXPECT_EQ(results.size(), 4);
+
+  FLAGS_table_prefetch = false;
+  sqlite3_close(db);
+}
+
+TEST_F(VirtualTableTests, test_table_snapshot) {
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "prefetch_left"), SQLITE_OK);
+  EXPECT_EQ(osquery::tables::attachTable(db, "indexed"), SQLITE_OK);
+
+  auto snapshot =
+      std::make_shared<TableSnapshot>(std::set<std::string>{"prefetch_left"});
+  setQuerySnapshot(db, snapshot);
+
+  // Queries with different constraints read one generation of the table.
+  kPrefetchGenerates = 0;
+  QueryData results;
+  queryInternal("SELECT * FROM prefetch_left WHERE value = 1", results, db);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["value"], "1");
+  results.clear();
+  queryInternal("SELECT * FROM prefetch_left WHERE value > 1", results, db);
+  EXPECT_EQ(results.size(), 2);
+  EXPECT_EQ(kPrefetchGenerates, 1);
+
+  // Tables generating rows for their constraints are not shared.
+  snapshot = std::make_shared<TableSnapshot>(std::set<std::string>{"indexed"});
+  setQuerySnapshot(db, snapshot);
+  results.clear();
+  queryInternal("SELECT * FROM indexed WHERE path = 'a'", results, db);
+  EXPECT_EQ(results.size(), 1);
+
+  setQuerySnapshot(db, nullptr);
+  EXPECT_EQ(getQuerySnapshot(db), nullptr);
+  sqlite3_close(db);
+}
+
+/// The number of incrementalTablePlugin generate calls.
+static size_t kIncrementalGenerates = 0;
+
+class incrementalTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"value", "INTEGER"}}; }
+
+  bool incremental() { return true; }
+
+  QueryData generate(QueryContext& request) {
+    kIncrementalGenerates++;
+    return {{{"value", INTEGER(kIncrementalGenerates)}}};
+  }
+};
+
+TEST_F(VirtualTableTests, test_table_snapshot_incremental) {
+  Registry::add<incrementalTablePlugin>("table", "incremental");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "incremental"), SQLITE_OK);
+
+  // Each query reads from its own offsets, incremental scans are not shared.
+  auto snapshot =
+      std::make_shared<TableSnapshot>(std::set<std::string>{"incremental"});
+  setQuerySnapshot(db, snapshot);
+  kIncrementalGenerates = 0;
+  QueryData results;
+  queryInternal("SELECT * FROM incremental", results, db);
+  queryInternal("SELECT * FROM incremental", results, db);
+  EXPECT_EQ(kIncrementalGenerates, 2);
+
+  setQuerySnapshot(db, nullptr);
+  sqlite3_close(db);
+}
+
+TEST_F(VirtualTableTests, test_table_cursor_shared) {
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "counting"), SQLITE_OK);
+  EXPECT_EQ(osquery::tables::attachTable(db, "prefetch_left"), SQLITE_OK);
+
+  // Tables implementing only a cursor are pulled, not shared.
+  auto snapshot =
+      std::make_shared<TableSnapshot>(std::set<std::string>{"counting"});
+  setQuerySnapshot(db, snapshot);
+  QueryData results;
+  queryInternal("SELECT count(*) AS c FROM counting", results, db);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["c"], "1000");
+  setQuerySnapshot(db, nullptr);
+
+  // Nor are they prefetched.
+  FLAGS_table_prefetch = true;
+  results.clear();
+  queryInternal(
+      "SELECT count(*) AS c FROM counting c, prefetch_left l", results, db);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0]["c"], "4000");
+  FLAGS_table_prefetch = false;
+  sqlite3_close(db);
+}
+
+/// Set when the slow table's generator observes its cancellation.
+static bool kSlowCancelled = false;
+
+class slowTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"value", "INTEGER"}}; }
+
+  QueryData generate(QueryContext& request) {
+    QueryData results;
+    for (size_t i = 0; i < 5000 && !request.limitReached(i); ++i) {
+      if (request.cancelled()) {
+        kSlowCancelled = true;
+        break;
+      }
+      results.push_back({{"value", INTEGER(i)}});
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return results;
+  }
+};
+
+TEST_F(VirtualTableTests, test_query_budget) {
+  Registry::add<slowTablePlugin>("table", "slow");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "slow"), SQLITE_OK);
+
+  // A generator polling its context stops and the query fails.
+  auto budget = std::make_shared<QueryBudget>(50, 0);
+  setQueryBudget(db, budget);
+  QueryData results;
+  auto status = queryInternal("SELECT * FROM slow", results, db);
+  EXPECT_FALSE(status.ok());
+  EXPECT_TRUE(kSlowCancelled);
+  EXPECT_EQ(results.size(), 0);
+
+  // SQLite interrupts long-running statements between steps.
+  budget = std::make_shared<QueryBudget>(50, 0);
+  setQueryBudget(db, budget);
+  status = queryInternal(
+      "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) "
+      "SELECT count(*) FROM c",
+      results,
+      db);
+  EXPECT_FALSE(status.ok());
+  EXPECT_TRUE(budget->exceeded());
+
+  setQueryBudget(db, nullptr);
+  EXPECT_EQ(getQueryBudget(db), nullptr);
+  status = queryInternal("SELECT * FROM slow LIMIT 1", results, db);
+  EXPECT_TRUE(status.ok());
+  sqlite3_close(db);
+}
+
+/// Count the reads of the source the scoped tables share.
+static int kScopedReads = 0;
+
+/// The source a query's scoped tables read once.
+struct ScopedSource {
+  bool read;
+  std::mutex mutex;
+
+  ScopedSource() : read(false) {}
+};
+
+class scopedTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() { return {{"value", "INTEGER"}}; }
+
+  QueryData generate(QueryContext& request) {
+    if (request.scope != nullptr) {
+      auto source = request.scope->get<ScopedSource>("scoped_source");
+      std::lock_guard<std::mutex> lock(source->mutex);
+      if (!source->read) {
+        source->read = true;
+        kScopedReads++;
+      }
+    }
+    return {{{"value", "1"}}, {{"value", "2"}}};
+  }
+};
+
+TEST_F(VirtualTableTests, test_query_scope) {
+  Registry::add<scopedTablePlugin>("table", "scoped_left");
+  Registry::add<scopedTablePlugin>("table", "scoped_right");
+  sqlite3* db = nullptr;
+  sqlite3_open(":memory:", &db);
+  EXPECT_EQ(osquery::tables::attachTable(db, "scoped_left"), SQLITE_OK);
+  EXPECT_EQ(osquery::tables::attachTable(db, "scoped_right"), SQLITE_OK);
+
+  // Every scan of a query shares its scope, the source is read once.
+  kScopedReads = 0;
+  QueryData results;
+  std::string q = "SELECT l.value FROM scoped_left l, scoped_right r";
+  EXPECT_TRUE(queryInternal(q, results, db).ok());
+  EXPECT_EQ(results.size(), 4);
+  EXPECT_EQ(kScopedReads, 1);
+
+  // The next query has a new scope, and the scope ends with the query.
+  EXPECT_TRUE(queryInternal(q, results, db).ok());
+  EXPECT_EQ(kScopedReads, 2);
+  EXPECT_EQ(getQueryScope(db), nullptr);
   sqlite3_close(db);
 }
 }
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <osquery/core.h>
+#include <osquery/events.h>
+#include <osquery/tables.h>
+
+#include "osquery/events/darwin/fsevents.h"
+#include "osquery/tables/events/file_hash_events.h"
+
+namespace osquery {
+namespace tables {
+
+/// FSEvents flags of a stream that lost changes below its paths.
+const FSEventStreamEventFlags kFileHashRescanFlags =
+    kFSEventStreamEventFlagMustScanSubDirs |
+    kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped;
+
+/**
+ * @brief Hash the files changed within directories, recording new digests.
+ *
+ * The FSEvents file events of the `--file_hash_paths` directories, which
+ * include their subdirectories, are debounced and hashed by
+ * FileHashChanges. A stream that dropped events hashes every file hashed
+ * before again.
+ */
+class FileHashEventSubscriber : public EventSubscriber<FSEventsEventPublisher> {
+  DECLARE_SUBSCRIBER("file_hash_events");
+
+ public:
+  FileHashEventSubscriber()
+      : changes_([this](const FileHashChange& change) { addChange(change); }) {
+  }
+
+  void init();
+
+  Status Callback(const FSEventsEventContextRef& ec);
+
+ private:
+  /// Add an event for a file whose digest changed.
+  void addChange(const FileHashChange& change);
+
+ private:
+  FileHashChanges changes_;
+};
+
+REGISTER(FileHashEventSubscriber, "event_subscriber", "file_hash_events");
+
+void FileHashEventSubscriber::init() {
+  for (const auto& path : osquery::split(FLAGS_file_hash_paths, ",")) {
+    auto sc = createSubscriptionContext();
+    sc->path = path;
+    subscribe(&FileHashEventSubscriber::Callback, sc);
+  }
+}
+
+Status FileHashEventSubscriber::Callback(const FSEventsEventContextRef& ec) {
+  if ((ec->fsevent_flags & kFileHashRescanFlags) != 0) {
+    // Changes were lost, every file hashed before is checked again.
+    changes_.rescan();
+  } else if (!ec->path.empty()) {
+    changes_.change(ec->path);
+  }
+  return Status(0, "OK");
+}
+
+void FileHashEventSubscriber::addChange(const FileHashChange& change) {
+  auto time = getUnixTime();
+  RowEncoder r(6);
+  r.add("action", change.action)
+      .add("target_path", change.path)
+      .add("sha256", change.sha256)
+      .add("previous_sha256", change.previous_sha256)
+      .add("size", change.size)
+      .add("time", time);
+  add(r, time);
+}
+}
+}
@@ -40,24 +40,23 @@ void HardwareEventSubscriber::init() {
 }
 
 Status HardwareEventSubscriber::Callback(const IOKitHIDEventContextRef& ec) {
-  Row r;
-
-  r["action"] = ec->action;
+  RowEncoder r(11);
+  r.add("action", ec->action);
   // There is no path in IOKit, there's a location ID (may be useful).
-  r["path"] = ec->location;
+  r.add("path", ec->location);
 
   // Type and driver are the name in IOKit
-  r["type"] = "hid";
-  r["driver"] = ec->transport;
+  r.add("type", "hid");
+  r.add("driver", ec->transport);
 
-  r["model_id"] = ec->model_id;
-  r["model"] = ec->model;
-  r["vendor_id"] = ec->vendor_id;
-  r["vendor"] = ec->vendor;
-  r["serial"] = ec->serial; // Not always filled in.
-  r["revision"] = ec->version;
+  r.add("model_id", ec->model_id);
+  r.add("model", ec->model);
+  r.add("vendor_id", ec->vendor_id);
+  r.add("vendor", ec->vendor);
+  r.add("serial", ec->serial); // Not always filled in.
+  r.add("revision", ec->version);
 
-  r["time"] = INTEGER(ec->time);
+  r.add("time", ec->time);
   add(r, ec->time);
   return Status(0, "OK");
 }
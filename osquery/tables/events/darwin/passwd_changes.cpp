@@ -66,14 +66,17 @@ void PasswdChangesEventSubscriber::init() {
 
 Status PasswdChangesEventSubscriber::Callback(
     const FSEventsEventContextRef& ec) {
-  Row r;
-  r["action"] = ec->action;
-  r["time"] = ec->time_string;
-  r["target_path"] = ec->path;
-  r["transaction_id"] = INTEGER(ec->fsevent_id);
-  if (ec->action != "") {
-    add(r, ec->time);
+  if (ec->action == "") {
+    return Status(0, "OK");
   }
+
+  RowEncoder r(5);
+  r.add("action", ec->action)
+      .add("time", ec->time)
+      .add("target_path", ec->path)
+      .add("count", ec->count)
+      .add("transaction_id", ec->fsevent_id);
+  add(r, ec->time);
   return Status(0, "OK");
 }
 }
@@ -0,0 +1,180 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <osquery/database/hash_cache.h>
+
+#include "osquery/tables/events/file_hash_events.h"
+
+namespace osquery {
+
+DEFINE_osquery_flag(string,
+                    file_hash_paths,
+                    "",
+                    "Comma-separated directories to hash changed files of");
+
+DEFINE_osquery_flag(int32,
+                    file_hash_debounce_ms,
+                    2000,
+                    "Milliseconds without changes before a file is hashed");
+
+namespace tables {
+
+/// The nice value of the hashing thread, hashing yields to other work.
+const int kFileHashNice = 19;
+
+void FileHashChanges::change(const std::string& path) {
+  boost::lock_guard<boost::mutex> lock(pending_lock_);
+  pending_[path] = Clock::now();
+  notify();
+}
+
+void FileHashChanges::rescan() {
+  boost::lock_guard<boost::mutex> lock(pending_lock_);
+  for (const auto& hash : hashes_) {
+    pending_[hash.first] = Clock::now();
+  }
+  notify();
+}
+
+void FileHashChanges::notify() {
+  if (hasher_ == nullptr) {
+    hasher_ = std::make_shared<boost::thread>(
+        boost::bind(&FileHashChanges::hashChanges, this));
+  }
+  pending_cv_.notify_all();
+}
+
+void FileHashChanges::hashChanges() {
+  // The priority applies to this thread only.
+#if defined(__linux__)
+  ::setpriority(PRIO_PROCESS, ::syscall(SYS_gettid), kFileHashNice);
+#elif defined(__APPLE__)
+  ::setpriority(PRIO_DARWIN_THREAD, 0, PRIO_DARWIN_BG);
+#endif
+
+  FileHasher hasher;
+  auto debounce =
+      std::chrono::milliseconds(std::max(FLAGS_file_hash_debounce_ms, 0));
+  while (true) {
+    std::vector<std::string> paths;
+    {
+      boost::unique_lock<boost::mutex> lock(pending_lock_);
+      while (!ending_ && pending_.empty()) {
+        pending_cv_.wait(lock);
+      }
+      if (ending_) {
+        break;
+      }
+
+      // Take the files whose windows ended, then wait for the next end.
+      auto now = Clock::now();
+      auto next = now + debounce;
+      for (auto it = pending_.begin(); it != pending_.end();) {
+        if (it->second + debounce <= now) {
+          paths.push_back(it->first);
+          it = pending_.erase(it);
+        } else {
+          next = std::min(next, it->second + debounce);
+          ++it;
+        }
+      }
+      if (paths.empty()) {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+            next - now);
+        pending_cv_.timed_wait(
+            lock, boost::posix_time::milliseconds(wait.count() + 1));
+        continue;
+      }
+    }
+
+    for (const auto& path : paths) {
+      hashChange(hasher, path);
+    }
+  }
+}
+
+void FileHashChanges::hashChange(FileHasher& hasher, const std::string& path) {
+  struct stat file;
+  bool exists = (::stat(path.c_str(), &file) == 0);
+  if (exists && !S_ISREG(file.st_mode)) {
+    return;
+  }
+
+  // The last hashes are also read by a rescan in the publisher's thread.
+  std::string previous_sha256;
+  bool known = false;
+  {
+    boost::lock_guard<boost::mutex> lock(pending_lock_);
+    auto previous = hashes_.find(path);
+    if (previous != hashes_.end()) {
+      previous_sha256 = previous->second;
+      known = true;
+    }
+  }
+  if (!known && exists) {
+    // The file was hashed before this process started, or not at all.
+    previous_sha256 = getCachedHashes(HASH_TYPE_SHA256, path).sha256;
+    known = !previous_sha256.empty();
+  }
+
+  std::string sha256;
+  if (exists) {
+    sha256 = hashMultiFromFileCached(hasher, HASH_TYPE_SHA256, path).sha256;
+    if (sha256.empty()) {
+      // The file was removed or is unreadable, a later change retries.
+      return;
+    }
+  }
+
+  {
+    boost::lock_guard<boost::mutex> lock(pending_lock_);
+    if (exists) {
+      hashes_[path] = sha256;
+    } else {
+      hashes_.erase(path);
+    }
+  }
+  if ((known && previous_sha256 == sha256) || (!known && !exists)) {
+    // The content is unchanged, or a file removed before it was hashed.
+    return;
+  }
+
+  FileHashChange change;
+  change.action = (exists) ? "UPDATED" : "DELETED";
+  change.path = path;
+  change.sha256 = sha256;
+  change.previous_sha256 = previous_sha256;
+  change.size = (exists) ? (long long)file.st_size : 0LL;
+  handler_(change);
+}
+
+FileHashChanges::~FileHashChanges() {
+  {
+    boost::lock_guard<boost::mutex> lock(pending_lock_);
+    ending_ = true;
+    pending_cv_.notify_all();
+  }
+  if (hasher_ != nullptr) {
+    hasher_->join();
+  }
+}
+}
+}
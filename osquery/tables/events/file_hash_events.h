@@ -0,0 +1,108 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <osquery/flags.h>
+#include <osquery/hash.h>
+
+namespace osquery {
+
+DECLARE_string(file_hash_paths);
+DECLARE_int32(file_hash_debounce_ms);
+
+namespace tables {
+
+/// A file whose SHA256 changed, a row of file_hash_events.
+struct FileHashChange {
+  /// UPDATED or DELETED.
+  std::string action;
+  std::string path;
+  /// Empty if the file was deleted.
+  std::string sha256;
+  /// Empty if the file was not hashed before.
+  std::string previous_sha256;
+  long long size;
+};
+
+/**
+ * @brief Debounce the changes of files and hash them once they settle.
+ *
+ * The file_hash_events subscribers of each platform report changed paths.
+ * Each change restarts a file's `--file_hash_debounce_ms` window, a file is
+ * hashed once its window passes without a change. Files are hashed by a
+ * low-priority thread rather than the publisher's, through the persistent
+ * hash cache. A change is handled when a file's SHA256 differs from the last
+ * one seen, or a hashed file was removed.
+ *
+ * The last SHA256 of a file not yet hashed by this process is read from the
+ * persistent hash cache, such that a restart does not report every file
+ * changed after it as new.
+ */
+class FileHashChanges {
+ public:
+  typedef std::function<void(const FileHashChange&)> Handler;
+
+  /// The handler is called by the hashing thread.
+  explicit FileHashChanges(const Handler& handler) : handler_(handler) {}
+
+  /// Stop the hashing thread, a file being hashed is handled first.
+  ~FileHashChanges();
+
+  /// A file changed, restart its debounce window.
+  void change(const std::string& path);
+
+  /// Changes were lost, every file hashed before is hashed again.
+  void rescan();
+
+ private:
+  /// Start the hashing thread if needed and wake it.
+  void notify();
+
+  /// The hashing thread, hashes the files whose windows ended.
+  void hashChanges();
+
+  /// Hash a changed file and handle it if its digest changed.
+  void hashChange(FileHasher& hasher, const std::string& path);
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  Handler handler_;
+
+  /// The changed files and the time of their last change.
+  std::map<std::string, Clock::time_point> pending_;
+
+  /// The last SHA256 of each hashed file.
+  std::map<std::string, std::string> hashes_;
+
+  /// Lock used when adding and taking pending files and reading hashes.
+  boost::mutex pending_lock_;
+
+  /// Signaled when files change or the hashing ends.
+  boost::condition_variable pending_cv_;
+
+  /// The hashing thread, started by the first change.
+  std::shared_ptr<boost::thread> hasher_;
+
+  /// True when the hashing thread should exit.
+  bool ending_{false};
+};
+}
+}
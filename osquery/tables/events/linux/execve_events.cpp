@@ -0,0 +1,62 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <vector>
+#include <string>
+
+#include <boost/algorithm/string/join.hpp>
+
+#include <sys/syscall.h>
+
+#include <osquery/core.h>
+#include <osquery/logger.h>
+#include <osquery/tables.h>
+
+#include "osquery/events/linux/audit.h"
+
+namespace osquery {
+namespace tables {
+
+/**
+ * @brief Track execve syscalls, and their arguments, using kernel audit.
+ */
+class ExecveEventSubscriber : public EventSubscriber<AuditEventPublisher> {
+  DECLARE_SUBSCRIBER("execve_events");
+
+ public:
+  void init();
+
+  Status Callback(const AuditEventContextRef& ec);
+};
+
+REGISTER(ExecveEventSubscriber, "event_subscriber", "execve_events");
+
+void ExecveEventSubscriber::init() {
+  auto sc = createSubscriptionContext();
+  sc->syscalls.insert(__NR_execve);
+  subscribe(&ExecveEventSubscriber::Callback, sc);
+}
+
+Status ExecveEventSubscriber::Callback(const AuditEventContextRef& ec) {
+  RowEncoder r(9);
+  r.add("pid", ec->fields["pid"])
+      .add("parent", ec->fields["ppid"])
+      .add("uid", ec->fields["uid"])
+      .add("auid", ec->fields["auid"])
+      .add("path", decodeAuditValue(ec->fields["exe"]))
+      .add("cmdline", boost::algorithm::join(ec->argv, " "))
+      .add("cwd", ec->cwd)
+      .add("success", ec->success ? 1 : 0)
+      .add("time", ec->time);
+  add(r, ec->time);
+  return Status(0, "OK");
+}
+}
+}
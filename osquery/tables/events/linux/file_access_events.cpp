@@ -0,0 +1,72 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <vector>
+#include <string>
+
+#include <osquery/core.h>
+#include <osquery/flags.h>
+#include <osquery/logger.h>
+#include <osquery/tables.h>
+
+#include "osquery/events/linux/fanotify.h"
+
+namespace osquery {
+
+DEFINE_osquery_flag(string,
+                    file_access_paths,
+                    "",
+                    "Comma-separated paths whose filesystems report writes");
+
+namespace tables {
+
+/**
+ * @brief Track writes to files on the configured filesystems, with the pid.
+ *
+ * Marking a filesystem reports every write to it, so nothing is watched
+ * unless file_access_paths names the filesystems to watch.
+ */
+class FileAccessEventSubscriber
+    : public EventSubscriber<FanotifyEventPublisher> {
+  DECLARE_SUBSCRIBER("file_access_events");
+
+ public:
+  void init();
+
+  Status Callback(const FanotifyEventContextRef& ec);
+};
+
+REGISTER(FileAccessEventSubscriber, "event_subscriber", "file_access_events");
+
+void FileAccessEventSubscriber::init() {
+  for (const auto& path : osquery::split(FLAGS_file_access_paths, ",")) {
+    auto sc = createSubscriptionContext();
+    sc->path = path;
+    sc->mask = FAN_MODIFY | FAN_CLOSE_WRITE;
+    subscribe(&FileAccessEventSubscriber::Callback, sc);
+  }
+
+  // Investigations repeatedly select the accesses of a path or an action.
+  indexColumn("target_path");
+  indexColumn("action");
+}
+
+Status FileAccessEventSubscriber::Callback(const FanotifyEventContextRef& ec) {
+  RowEncoder r(5);
+  r.add("action", ec->action)
+      .add("target_path", ec->path)
+      .add("pid", ec->pid)
+      .add("count", ec->count)
+      .add("time", ec->time);
+  add(r, ec->time);
+  return Status(0, "OK");
+}
+}
+}
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <osquery/core.h>
+#include <osquery/tables.h>
+
+#include "osquery/tables/events/linux/file_hash_events.h"
+
+namespace osquery {
+namespace tables {
+
+REGISTER(FileHashEventSubscriber, "event_subscriber", "file_hash_events");
+
+void FileHashEventSubscriber::init() {
+  for (const auto& path : osquery::split(FLAGS_file_hash_paths, ",")) {
+    auto sc = createSubscriptionContext();
+    sc->path = path;
+    sc->recursive = true;
+    sc->mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM;
+    subscribe(&FileHashEventSubscriber::Callback, sc);
+  }
+}
+
+Status FileHashEventSubscriber::Callback(const INotifyEventContextRef& ec) {
+  if (ec->action == kINotifyRescanAction) {
+    // Changes were lost, every file hashed before is checked again.
+    changes_.rescan();
+  } else if (!ec->path.empty()) {
+    changes_.change(ec->path);
+  }
+  return Status(0, "OK");
+}
+
+void FileHashEventSubscriber::addChange(const FileHashChange& change) {
+  auto time = getUnixTime();
+  RowEncoder r(6);
+  r.add("action", change.action)
+      .add("target_path", change.path)
+      .add("sha256", change.sha256)
+      .add("previous_sha256", change.previous_sha256)
+      .add("size", change.size)
+      .add("time", time);
+  add(r, time);
+}
+}
+}
@@ -0,0 +1,48 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <osquery/events.h>
+
+#include "osquery/events/linux/inotify.h"
+#include "osquery/tables/events/file_hash_events.h"
+
+namespace osquery {
+namespace tables {
+
+/**
+ * @brief Hash the files changed within directories, recording new digests.
+ *
+ * The inotify changes of the `--file_hash_paths` directories, watched
+ * recursively, are debounced and hashed by FileHashChanges. An overflow of
+ * the inotify queue hashes every file hashed before again.
+ */
+class FileHashEventSubscriber : public EventSubscriber<INotifyEventPublisher> {
+  DECLARE_SUBSCRIBER("file_hash_events");
+
+ public:
+  FileHashEventSubscriber()
+      : changes_([this](const FileHashChange& change) { addChange(change); }) {
+  }
+
+  void init();
+
+  Status Callback(const INotifyEventContextRef& ec);
+
+ private:
+  /// Add an event for a file whose digest changed.
+  void addChange(const FileHashChange& change);
+
+ private:
+  FileHashChanges changes_;
+};
+}
+}
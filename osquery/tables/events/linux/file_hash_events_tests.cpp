@@ -0,0 +1,148 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+#include <gtest/gtest.h>
+
+#include <osquery/core.h>
+#include <osquery/database.h>
+#include <osquery/hash.h>
+#include <osquery/logger.h>
+
+#include "osquery/tables/events/linux/file_hash_events.h"
+
+namespace osquery {
+
+using tables::FileHashEventSubscriber;
+
+const std::string kTestingFileHashDBPath = "/tmp/rocksdb-osquery-filehash";
+const std::string kTestingFileHashPath = "/tmp/osquery-file-hash-events";
+
+/// The subscriber, with its events readable by the tests.
+class TestFileHashEventSubscriber : public FileHashEventSubscriber {
+ public:
+  using FileHashEventSubscriber::get;
+};
+
+class FileHashEventsTests : public testing::Test {
+ public:
+  void SetUp() {
+    DBHandle::getInstanceAtPath(kTestingFileHashDBPath);
+    debounce_ = FLAGS_file_hash_debounce_ms;
+    FLAGS_file_hash_debounce_ms = 0;
+    boost::filesystem::remove_all(kTestingFileHashPath);
+    boost::filesystem::create_directories(kTestingFileHashPath);
+  }
+
+  void TearDown() {
+    FLAGS_file_hash_debounce_ms = debounce_;
+    boost::filesystem::remove_all(kTestingFileHashPath);
+  }
+
+ protected:
+  /// Write a file below the test directory.
+  std::string write(const std::string& name, const std::string& content) {
+    auto path = kTestingFileHashPath + "/" + name;
+    std::ofstream(path) << content;
+    return path;
+  }
+
+  /// A fake inotify event of a path.
+  INotifyEventContextRef event(const std::string& path,
+                               const std::string& action = "UPDATED") {
+    auto ec = std::make_shared<INotifyEventContext>();
+    ec->path = path;
+    ec->action = action;
+    return ec;
+  }
+
+  /// Wait for the subscriber to add events, at most a few seconds.
+  QueryData waitForEvents(std::shared_ptr<TestFileHashEventSubscriber>& sub,
+                          size_t count) {
+    QueryData results;
+    for (size_t i = 0; i < 500; i++) {
+      results = sub->get(0, getUnixTime() + 60);
+      if (results.size() >= count) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return results;
+  }
+
+  std::string sha256(const std::string& content) {
+    return hashFromBuffer(HASH_TYPE_SHA256, content.data(), content.size());
+  }
+
+ private:
+  int debounce_;
+};
+
+TEST_F(FileHashEventsTests, test_debounce_and_rescan) {
+  auto sub = std::make_shared<TestFileHashEventSubscriber>();
+  auto initial = sub->get(0, getUnixTime() + 60).size();
+
+  // Repeated changes of a file are hashed once its content settles.
+  auto a = write("a", "first");
+  sub->Callback(event(a));
+  sub->Callback(event(a));
+  auto results = waitForEvents(sub, initial + 1);
+  ASSERT_EQ(results.size(), initial + 1);
+  EXPECT_EQ(results.back()["target_path"], a);
+  EXPECT_EQ(results.back()["sha256"], sha256("first"));
+  EXPECT_EQ(results.back()["previous_sha256"], "");
+
+  // An unchanged file adds no event, the change of b follows a's.
+  sub->Callback(event(a));
+  auto b = write("b", "other");
+  sub->Callback(event(b));
+  results = waitForEvents(sub, initial + 2);
+  ASSERT_EQ(results.size(), initial + 2);
+  EXPECT_EQ(results.back()["target_path"], b);
+
+  // Lost changes are found by a rescan of the files hashed before.
+  write("a", "second");
+  sub->Callback(event("", kINotifyRescanAction));
+  results = waitForEvents(sub, initial + 3);
+  ASSERT_EQ(results.size(), initial + 3);
+  EXPECT_EQ(results.back()["target_path"], a);
+  EXPECT_EQ(results.back()["sha256"], sha256("second"));
+  EXPECT_EQ(results.back()["previous_sha256"], sha256("first"));
+}
+
+TEST_F(FileHashEventsTests, test_seed_from_hash_cache) {
+  auto sub = std::make_shared<TestFileHashEventSubscriber>();
+  auto initial = sub->get(0, getUnixTime() + 60).size();
+  auto c = write("c", "cached");
+  sub->Callback(event(c));
+  ASSERT_EQ(waitForEvents(sub, initial + 1).size(), initial + 1);
+  sub.reset();
+
+  // A new subscriber compares a change with the digest in the hash cache.
+  sub = std::make_shared<TestFileHashEventSubscriber>();
+  write("c", "changed");
+  sub->Callback(event(c));
+  auto results = waitForEvents(sub, initial + 2);
+  ASSERT_EQ(results.size(), initial + 2);
+  EXPECT_EQ(results.back()["sha256"], sha256("changed"));
+  EXPECT_EQ(results.back()["previous_sha256"], sha256("cached"));
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -42,8 +42,6 @@ void HardwareEventSubscriber::init() {
 }
 
 Status HardwareEventSubscriber::Callback(const UdevEventContextRef& ec) {
-  Row r;
-
   if (ec->devtype.empty()) {
     // Superfluous hardware event.
     return Status(0, "Missing type.");
@@ -51,28 +49,34 @@ Status HardwareEventSubscriber::Callback(const UdevEventContextRef& ec) {
     return Status(0, "Missing node and driver.");
   }
 
-  struct udev_device *device = ec->device;
-  r["action"] = ec->action_string;
-  r["path"] = ec->devnode;
-  r["type"] = ec->devtype;
-  r["driver"] = ec->driver;
-
   // UDEV properties.
-  r["model"] = UdevEventPublisher::getValue(device, "ID_MODEL_FROM_DATABASE");
-  if (r["path"].empty() && r["model"].empty()) {
+  struct udev_device *device = ec->device;
+  auto model = UdevEventPublisher::getValue(device, "ID_MODEL_FROM_DATABASE");
+  auto vendor = UdevEventPublisher::getValue(device, "ID_VENDOR_FROM_DATABASE");
+  if (model.empty()) {
+    // Interfaces of a hub or dock share the parent device's descriptors.
+    model = UdevEventPublisher::getParentAttr(device, "product");
+  }
+  if (vendor.empty()) {
+    vendor = UdevEventPublisher::getParentAttr(device, "manufacturer");
+  }
+  if (ec->devnode.empty() && model.empty()) {
     // Don't emit mising path/model combos.
     return Status(0, "Missing path and model.");
   }
 
-  r["model_id"] = INTEGER(UdevEventPublisher::getValue(device, "ID_MODEL_ID"));
-  r["vendor"] = UdevEventPublisher::getValue(device, "ID_VENDOR_FROM_DATABASE");
-  r["vendor_id"] =
-      INTEGER(UdevEventPublisher::getValue(device, "ID_VENDOR_ID"));
-  r["serial"] =
-      INTEGER(UdevEventPublisher::getValue(device, "ID_SERIAL_SHORT"));
-  r["revision"] = INTEGER(UdevEventPublisher::getValue(device, "ID_REVISION"));
-
-  r["time"] = INTEGER(ec->time);
+  RowEncoder r(11);
+  r.add("action", ec->action_string)
+      .add("path", ec->devnode)
+      .add("type", ec->devtype)
+      .add("driver", ec->driver)
+      .add("model", model)
+      .add("model_id", UdevEventPublisher::getValue(device, "ID_MODEL_ID"))
+      .add("vendor", vendor)
+      .add("vendor_id", UdevEventPublisher::getValue(device, "ID_VENDOR_ID"))
+      .add("serial", UdevEventPublisher::getValue(device, "ID_SERIAL_SHORT"))
+      .add("revision", UdevEventPublisher::getValue(device, "ID_REVISION"))
+      .add("time", ec->time);
   add(r, ec->time);
   return Status(0, "OK");
 }
@@ -16,6 +16,7 @@
 #include <osquery/tables.h>
 
 #include "osquery/events/linux/inotify.h"
+#include "osquery/tables/system/user_groups.h"
 
 namespace osquery {
 namespace tables {
@@ -61,17 +62,22 @@ void PasswdChangesEventSubscriber::init() {
 
 Status PasswdChangesEventSubscriber::Callback(
     const INotifyEventContextRef& ec) {
-  Row r;
-  r["action"] = ec->action;
-  r["time"] = ec->time_string;
-  r["target_path"] = ec->path;
-  r["transaction_id"] = INTEGER(ec->event->cookie);
-  if (ec->action != "" && ec->action != "OPENED") {
-    // A callback is somewhat useless unless it changes the EventSubscriber
-    // state
-    // or calls `add` to store a marked up event.
-    add(r, ec->time);
+  if (ec->action == "" || ec->action == "OPENED") {
+    return Status(0, "OK");
   }
+
+  // Cached users must be enumerated again.
+  invalidateUserGroupSnapshots();
+
+  // A callback is somewhat useless unless it changes the EventSubscriber
+  // state or calls `add` to store a marked up event.
+  RowEncoder r(5);
+  r.add("action", ec->action)
+      .add("time", ec->time)
+      .add("target_path", ec->path)
+      .add("count", ec->count)
+      .add("transaction_id", ec->event->cookie);
+  add(r, ec->time);
   return Status(0, "OK");
 }
 }
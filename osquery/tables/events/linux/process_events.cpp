@@ -0,0 +1,60 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <vector>
+#include <string>
+
+#include <osquery/core.h>
+#include <osquery/logger.h>
+#include <osquery/tables.h>
+
+#include "osquery/events/linux/proc_connector.h"
+
+namespace osquery {
+namespace tables {
+
+/**
+ * @brief Track process execution and exits without polling /proc.
+ */
+class ProcessEventSubscriber
+    : public EventSubscriber<ProcConnectorEventPublisher> {
+  DECLARE_SUBSCRIBER("process_events");
+
+ public:
+  void init();
+
+  Status Callback(const ProcConnectorEventContextRef& ec);
+};
+
+REGISTER(ProcessEventSubscriber, "event_subscriber", "process_events");
+
+void ProcessEventSubscriber::init() {
+  // Forks are followed by an exec, or are visible in the processes table.
+  auto sc = createSubscriptionContext();
+  sc->requireAction("EXEC");
+  sc->requireAction("EXIT");
+  subscribe(&ProcessEventSubscriber::Callback, sc);
+}
+
+Status ProcessEventSubscriber::Callback(
+    const ProcConnectorEventContextRef& ec) {
+  RowEncoder r(7);
+  r.add("action", ec->action)
+      .add("pid", ec->pid)
+      .add("parent", ec->parent)
+      .add("path", ec->path)
+      .add("cmdline", ec->cmdline)
+      .add("exit_code", ec->exit_code)
+      .add("time", ec->time);
+  add(r, ec->time);
+  return Status(0, "OK");
+}
+}
+}
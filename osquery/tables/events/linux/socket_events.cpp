@@ -0,0 +1,105 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <vector>
+#include <string>
+
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include <osquery/core.h>
+#include <osquery/logger.h>
+#include <osquery/tables.h>
+
+#include "osquery/events/linux/audit.h"
+
+namespace osquery {
+namespace tables {
+
+/**
+ * @brief Track socket connects and binds using the kernel audit system.
+ */
+class SocketEventSubscriber : public EventSubscriber<AuditEventPublisher> {
+  DECLARE_SUBSCRIBER("socket_events");
+
+ public:
+  void init();
+
+  Status Callback(const AuditEventContextRef& ec);
+};
+
+REGISTER(SocketEventSubscriber, "event_subscriber", "socket_events");
+
+/// Parse the family, address, and port of a raw sockaddr argument.
+static void parseSockaddr(const std::string& saddr,
+                          int& family,
+                          std::string& address,
+                          int& port) {
+  family = 0;
+  port = 0;
+  if (saddr.size() < sizeof(sa_family_t)) {
+    return;
+  }
+
+  char buffer[INET6_ADDRSTRLEN] = {0};
+  family = reinterpret_cast<const struct sockaddr*>(saddr.data())->sa_family;
+  if (family == AF_INET && saddr.size() >= sizeof(struct sockaddr_in)) {
+    struct sockaddr_in in;
+    memcpy(&in, saddr.data(), sizeof(in));
+    port = ntohs(in.sin_port);
+    address = inet_ntop(AF_INET, &in.sin_addr, buffer, sizeof(buffer));
+  } else if (family == AF_INET6 &&
+             saddr.size() >= sizeof(struct sockaddr_in6)) {
+    struct sockaddr_in6 in6;
+    memcpy(&in6, saddr.data(), sizeof(in6));
+    port = ntohs(in6.sin6_port);
+    address = inet_ntop(AF_INET6, &in6.sin6_addr, buffer, sizeof(buffer));
+  } else if (family == AF_UNIX) {
+    // The path is NULL-terminated, or the remainder of the argument.
+    auto path = saddr.substr(sizeof(sa_family_t));
+    address = path.substr(0, path.find('\0'));
+  }
+}
+
+void SocketEventSubscriber::init() {
+  auto sc = createSubscriptionContext();
+  sc->syscalls.insert(__NR_connect);
+  sc->syscalls.insert(__NR_bind);
+  subscribe(&SocketEventSubscriber::Callback, sc);
+}
+
+Status SocketEventSubscriber::Callback(const AuditEventContextRef& ec) {
+  int family = 0;
+  int port = 0;
+  std::string address;
+  parseSockaddr(ec->sockaddr, family, address, port);
+  if (family != AF_INET && family != AF_INET6 && family != AF_UNIX) {
+    // Netlink and other local families are not recorded.
+    return Status(0, "OK");
+  }
+
+  // Syscall arguments are hex, the first is the socket descriptor.
+  auto fd = std::strtoul(ec->fields["a0"].c_str(), nullptr, 16);
+  RowEncoder r(9);
+  r.add("action", (ec->syscall == __NR_bind) ? "bind" : "connect")
+      .add("pid", ec->fields["pid"])
+      .add("path", decodeAuditValue(ec->fields["exe"]))
+      .add("fd", fd)
+      .add("family", family)
+      .add("remote_address", address)
+      .add("remote_port", port)
+      .add("success", ec->success ? 1 : 0)
+      .add("time", ec->time);
+  add(r, ec->time);
+  return Status(0, "OK");
+}
+}
+}
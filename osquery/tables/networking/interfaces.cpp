@@ -15,11 +15,6 @@
 #include <net/if.h>
 #include <sys/socket.h>
 
-#ifdef __linux__
-#include <linux/if_link.h>
-#include <sys/ioctl.h>
-#endif
-
 #include <osquery/core.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
@@ -66,36 +61,6 @@ void genDetailsFromAddr(const struct ifaddrs *addr, QueryData &results) {
   r["mac"] = macAsString(addr);
 
   if (addr->ifa_data != nullptr) {
-#ifdef __linux__
-    // Linux/Netlink interface details parsing.
-    auto ifd = (struct rtnl_link_stats *)addr->ifa_data;
-    r["ipackets"] = BIGINT_FROM_UINT32(ifd->rx_packets);
-    r["opackets"] = BIGINT_FROM_UINT32(ifd->tx_packets);
-    r["ibytes"] = BIGINT_FROM_UINT32(ifd->rx_bytes);
-    r["obytes"] = BIGINT_FROM_UINT32(ifd->tx_bytes);
-    r["ierrors"] = BIGINT_FROM_UINT32(ifd->rx_errors);
-    r["oerrors"] = BIGINT_FROM_UINT32(ifd->tx_errors);
-
-    // Get Linux physical properties for the AF_PACKET entry.
-    int fd = socket(AF_INET, SOCK_DGRAM, 0); 
-    if (fd >= 0) {
-      struct ifreq ifr;
-      strncpy(ifr.ifr_name, addr->ifa_name, IFNAMSIZ);
-      if (ioctl(fd, SIOCGIFMTU, &ifr) >= 0) {
-        r["mtu"] = BIGINT_FROM_UINT32(ifr.ifr_mtu);
-      }
-
-      if (ioctl(fd, SIOCGIFMETRIC, &ifr) >= 0) {
-       r["metric"] = BIGINT_FROM_UINT32(ifr.ifr_metric);
-      }
-
-      if (ioctl(fd, SIOCGIFHWADDR, &ifr) >= 0) {
-        r["type"] = INTEGER_FROM_UCHAR(ifr.ifr_hwaddr.sa_family); 
-      }
-    }
-
-    r["last_change"] = "-1";
-#else
     // Apple and FreeBSD interface details parsing.
     auto ifd = (struct if_data *)addr->ifa_data;
     r["type"] = INTEGER_FROM_UCHAR(ifd->ifi_type);
@@ -108,7 +73,6 @@ void genDetailsFromAddr(const struct ifaddrs *addr, QueryData &results) {
     r["ierrors"] = BIGINT_FROM_UINT32(ifd->ifi_ierrors);
     r["oerrors"] = BIGINT_FROM_UINT32(ifd->ifi_oerrors);
     r["last_change"] = BIGINT_FROM_UINT32(ifd->ifi_lastchange.tv_sec);
-#endif
   }
 
   results.push_back(r);
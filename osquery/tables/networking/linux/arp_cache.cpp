@@ -8,71 +8,75 @@
  *
  */
 
-#include <fstream>
+#include <cstring>
 
-#include <boost/algorithm/string/split.hpp>
-#include <boost/algorithm/string/trim.hpp>
+#include <sys/socket.h>
+#include <linux/neighbour.h>
+#include <linux/rtnetlink.h>
 
 #include <osquery/tables.h>
-#include <osquery/filesystem.h>
 #include <osquery/logger.h>
 
+#include "osquery/tables/networking/linux/netlink.h"
+#include "osquery/tables/networking/utils.h"
+
 namespace osquery {
 namespace tables {
 
-const std::string kLinuxArpTable = "/proc/net/arp";
-
-QueryData genArpCache(QueryContext& context) {
-  QueryData results;
-
-  boost::filesystem::path arp_path = kLinuxArpTable;
-  if (!osquery::isReadable(arp_path).ok()) {
-    VLOG(1) << "Cannot read arp table.";
-    return results;
-  }
-
-  std::ifstream fd(arp_path.string(), std::ios::in | std::ios::binary);
-  std::string line;
-
-  if (fd.fail() || fd.eof()) {
-    VLOG(1) << "Empty or failed arp table.";
-    return results;
+void genNetlinkNeighbor(const struct nlmsghdr* netlink_msg,
+                        NetlinkInterfaceNames& interfaces,
+                        QueryData& results) {
+  auto message = (struct ndmsg*)NLMSG_DATA(netlink_msg);
+  if (netlink_msg->nlmsg_type != RTM_NEWNEIGH ||
+      message->ndm_family != AF_INET || (message->ndm_state & NUD_NOARP)) {
+    // Like /proc/net/arp, only IPv4 neighbors resolved with ARP.
+    return;
   }
 
-  // Read the header line.
-  std::getline(fd, line, '\n');
-  while (!(fd.fail() || fd.eof())) {
-    std::getline(fd, line, '\n');
-
-    // IP address, HW type, Flags, HW address, Mask Device
-    std::vector<std::string> fields;
-    boost::split(fields, line, boost::is_any_of(" "), boost::token_compress_on);
-    for (auto& f : fields) {
-      // Inline trim each split.
-      boost::trim(f);
+  Row r;
+  r["mac"] = "00:00:00:00:00:00";
+  auto attr = (struct rtattr*)((char*)message + NLMSG_ALIGN(sizeof(*message)));
+  int attr_size = NLMSG_PAYLOAD(netlink_msg, sizeof(*message));
+  for (; RTA_OK(attr, attr_size); attr = RTA_NEXT(attr, attr_size)) {
+    if (attr->rta_type == NDA_DST) {
+      r["address"] = getNetlinkIP(AF_INET, RTA_DATA(attr));
+    } else if (attr->rta_type == NDA_LLADDR && RTA_PAYLOAD(attr) == 6) {
+      r["mac"] = macAsString((const char*)RTA_DATA(attr));
     }
+  }
 
-    if (fields.size() != 6) {
-      // An unhandled error case.
-      continue;
-    }
+  if (r["address"].empty()) {
+    return;
+  }
 
-    Row r;
-    r["address"] = fields[0];
-    r["mac"] = fields[3];
-    r["interface"] = fields[5];
+  r["interface"] = interfaces.get(message->ndm_ifindex);
+  // Note: it's also possible to detect proxy entries (NTF_PROXY).
+  r["permanent"] = (message->ndm_state & NUD_PERMANENT) ? "1" : "0";
+  results.push_back(r);
+}
 
-    // Note: it's also possible to detect publish entries (ATF_PUB).
-    if (fields[2] == "0x6") {
-      // The string representation of ATF_COM | ATF_PERM.
-      r["permanent"] = "1";
-    } else {
-      r["permanent"] = "0";
-    }
+QueryData genArpCache(QueryContext& context) {
+  QueryData results;
 
-    results.push_back(r);
+  NetlinkClient client(NETLINK_ROUTE);
+  if (!client.ok()) {
+    VLOG(1) << "Cannot open NETLINK socket";
+    return results;
   }
 
+  struct ndmsg message;
+  memset(&message, 0, sizeof(message));
+  message.ndm_family = AF_INET;
+  NetlinkRequest request(RTM_GETNEIGH, &message, sizeof(message));
+
+  NetlinkInterfaceNames interfaces;
+  auto status = client.dump(request, [&](const struct nlmsghdr* neighbor) {
+    genNetlinkNeighbor(neighbor, interfaces, results);
+  });
+  if (!status.ok()) {
+    VLOG(1) << "Cannot read arp table: " << status.toString();
+    return {};
+  }
   return results;
 }
 }
@@ -0,0 +1,262 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <cstring>
+#include <set>
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+
+#include <osquery/logger.h>
+#include <osquery/tables.h>
+
+#include "osquery/tables/networking/linux/netlink.h"
+#include "osquery/tables/networking/utils.h"
+
+namespace osquery {
+namespace tables {
+
+/// The interface names of EQUALS constraints, empty for every interface.
+static std::set<std::string> getInterfaceConstraints(QueryContext& context) {
+  std::set<std::string> names;
+  for (const auto& name : context.constraints["interface"].getAll(EQUALS)) {
+    if (!name.empty() && name.size() < IFNAMSIZ) {
+      names.insert(name);
+    } else {
+      // No interface has the name, 'interface = ""' has no rows.
+      names.insert("");
+    }
+  }
+  return names;
+}
+
+void genNetlinkLink(const struct nlmsghdr* netlink_msg, QueryData& results) {
+  if (netlink_msg->nlmsg_type != RTM_NEWLINK) {
+    return;
+  }
+
+  auto message = (struct ifinfomsg*)NLMSG_DATA(netlink_msg);
+  Row r;
+  // Links without a hardware address report zeros, as SIOCGIFHWADDR would.
+  r["mac"] = "00:00:00:00:00:00";
+  r["type"] = INTEGER(message->ifi_type);
+  r["metric"] = "0";
+  r["last_change"] = "-1";
+
+  const struct rtnl_link_stats* stats = nullptr;
+  const struct rtnl_link_stats64* stats64 = nullptr;
+  auto attr = (struct rtattr*)IFLA_RTA(message);
+  int attr_size = IFLA_PAYLOAD(netlink_msg);
+  for (; RTA_OK(attr, attr_size); attr = RTA_NEXT(attr, attr_size)) {
+    switch (attr->rta_type) {
+    case IFLA_IFNAME:
+      r["interface"] = std::string((const char*)RTA_DATA(attr));
+      break;
+    case IFLA_ADDRESS:
+      if (RTA_PAYLOAD(attr) == 6) {
+        r["mac"] = macAsString((const char*)RTA_DATA(attr));
+      }
+      break;
+    case IFLA_MTU:
+      r["mtu"] = BIGINT(*(unsigned int*)RTA_DATA(attr));
+      break;
+    case IFLA_STATS:
+      if (RTA_PAYLOAD(attr) >= sizeof(*stats)) {
+        stats = (const struct rtnl_link_stats*)RTA_DATA(attr);
+      }
+      break;
+    case IFLA_STATS64:
+      if (RTA_PAYLOAD(attr) >= sizeof(*stats64)) {
+        stats64 = (const struct rtnl_link_stats64*)RTA_DATA(attr);
+      }
+      break;
+    }
+  }
+
+  if (r["interface"].empty()) {
+    return;
+  }
+
+  // The 64-bit counters do not wrap on busy links.
+  if (stats64 != nullptr) {
+    r["ipackets"] = BIGINT((unsigned long long)stats64->rx_packets);
+    r["opackets"] = BIGINT((unsigned long long)stats64->tx_packets);
+    r["ibytes"] = BIGINT((unsigned long long)stats64->rx_bytes);
+    r["obytes"] = BIGINT((unsigned long long)stats64->tx_bytes);
+    r["ierrors"] = BIGINT((unsigned long long)stats64->rx_errors);
+    r["oerrors"] = BIGINT((unsigned long long)stats64->tx_errors);
+  } else if (stats != nullptr) {
+    r["ipackets"] = BIGINT((uint64_t)stats->rx_packets);
+    r["opackets"] = BIGINT((uint64_t)stats->tx_packets);
+    r["ibytes"] = BIGINT((uint64_t)stats->rx_bytes);
+    r["obytes"] = BIGINT((uint64_t)stats->tx_bytes);
+    r["ierrors"] = BIGINT((uint64_t)stats->rx_errors);
+    r["oerrors"] = BIGINT((uint64_t)stats->tx_errors);
+  }
+  results.push_back(r);
+}
+
+/// The netmask of an address prefix length.
+static std::string getNetlinkMask(int family, unsigned char prefix) {
+  unsigned char mask[16] = {0};
+  size_t size = (family == AF_INET6) ? 16 : 4;
+  for (size_t i = 0; i < size && prefix > 0; ++i) {
+    auto bits = (prefix < 8) ? prefix : 8;
+    mask[i] = (unsigned char)(0xff << (8 - bits));
+    prefix -= bits;
+  }
+  return getNetlinkIP(family, mask);
+}
+
+void genNetlinkAddress(const struct nlmsghdr* netlink_msg,
+                       const std::set<int>& indexes,
+                       NetlinkInterfaceNames& interfaces,
+                       QueryData& results) {
+  auto message = (struct ifaddrmsg*)NLMSG_DATA(netlink_msg);
+  if (netlink_msg->nlmsg_type != RTM_NEWADDR ||
+      (message->ifa_family != AF_INET && message->ifa_family != AF_INET6)) {
+    return;
+  }
+
+  // Kernels without strict dump checking ignore the index filter.
+  if (!indexes.empty() && indexes.count(message->ifa_index) == 0) {
+    return;
+  }
+
+  std::string address;
+  std::string local;
+  Row r;
+  auto attr = (struct rtattr*)IFA_RTA(message);
+  int attr_size = IFA_PAYLOAD(netlink_msg);
+  for (; RTA_OK(attr, attr_size); attr = RTA_NEXT(attr, attr_size)) {
+    switch (attr->rta_type) {
+    case IFA_ADDRESS:
+      address = getNetlinkIP(message->ifa_family, RTA_DATA(attr));
+      break;
+    case IFA_LOCAL:
+      local = getNetlinkIP(message->ifa_family, RTA_DATA(attr));
+      break;
+    case IFA_BROADCAST:
+      r["broadcast"] = getNetlinkIP(message->ifa_family, RTA_DATA(attr));
+      break;
+    case IFA_LABEL:
+      // IPv4 addresses are named by their label, such as an alias "eth0:1".
+      r["interface"] = std::string((const char*)RTA_DATA(attr));
+      break;
+    }
+  }
+
+  // As with getifaddrs, a local address differing from the address is the
+  // local end of a point-to-point link.
+  if (!local.empty()) {
+    if (!address.empty() && address != local) {
+      r["point_to_point"] = address;
+    }
+    address = local;
+  }
+  if (address.empty()) {
+    return;
+  }
+
+  if (r["interface"].empty()) {
+    r["interface"] = interfaces.get(message->ifa_index);
+  }
+  r["address"] = address;
+  r["mask"] = getNetlinkMask(message->ifa_family, message->ifa_prefixlen);
+  results.push_back(r);
+}
+
+QueryData genInterfaceAddresses(QueryContext& context) {
+  QueryData results;
+
+  NetlinkClient client(NETLINK_ROUTE);
+  if (!client.ok()) {
+    VLOG(1) << "Cannot open NETLINK socket";
+    return results;
+  }
+
+  // Interface constraints are resolved to indexes for the kernel's filter,
+  // an IPv4 alias such as "eth0:1" is an address of its link "eth0".
+  auto names = getInterfaceConstraints(context);
+  std::set<int> indexes;
+  for (const auto& name : names) {
+    auto link = name.substr(0, name.find(':'));
+    auto index = (link.empty()) ? 0 : if_nametoindex(link.c_str());
+    if (index > 0) {
+      indexes.insert(index);
+    }
+  }
+  if (!names.empty() && indexes.empty()) {
+    return results;
+  }
+
+  struct ifaddrmsg message;
+  memset(&message, 0, sizeof(message));
+  message.ifa_family = AF_UNSPEC;
+  if (indexes.size() == 1) {
+    client.enableStrictDump();
+    message.ifa_index = *indexes.begin();
+  }
+
+  NetlinkRequest request(RTM_GETADDR, &message, sizeof(message));
+  NetlinkInterfaceNames interfaces;
+  auto status = client.dump(request, [&](const struct nlmsghdr* address) {
+    genNetlinkAddress(address, indexes, interfaces, results);
+  });
+  if (!status.ok()) {
+    VLOG(1) << "Cannot read interface addresses: " << status.toString();
+    return {};
+  }
+  return results;
+}
+
+QueryData genInterfaceDetails(QueryContext& context) {
+  QueryData results;
+
+  NetlinkClient client(NETLINK_ROUTE);
+  if (!client.ok()) {
+    VLOG(1) << "Cannot open NETLINK socket";
+    return results;
+  }
+
+  struct ifinfomsg message;
+  memset(&message, 0, sizeof(message));
+  message.ifi_family = AF_UNSPEC;
+
+  auto callback = [&results](const struct nlmsghdr* link) {
+    genNetlinkLink(link, results);
+  };
+  auto names = getInterfaceConstraints(context);
+  if (names.empty()) {
+    // One dump includes the name, address, MTU and counters of every link.
+    NetlinkRequest request(RTM_GETLINK, &message, sizeof(message));
+    auto status = client.dump(request, callback);
+    if (!status.ok()) {
+      VLOG(1) << "Cannot read interface details: " << status.toString();
+      return {};
+    }
+    return results;
+  }
+
+  // Constrained interfaces are requested by name, a missing name is an error.
+  for (const auto& name : names) {
+    if (name.empty()) {
+      continue;
+    }
+    NetlinkRequest request(RTM_GETLINK, &message, sizeof(message), false);
+    request.addAttribute(IFLA_IFNAME, name.c_str(), name.size() + 1);
+    client.dump(request, callback);
+  }
+  return results;
+}
+}
+}
@@ -0,0 +1,60 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <set>
+#include <tuple>
+
+#include <osquery/tables.h>
+
+#include "osquery/tables/networking/linux/sockets.h"
+
+namespace osquery {
+namespace tables {
+
+QueryData genListeningPorts(QueryContext& context) {
+  QueryData sockets;
+
+  // Only listening TCP and unconnected UDP sockets are dumped, so only their
+  // owners are searched for in process descriptors.
+  auto filter = buildPortFilter(getPortConstraint(context, "port"), 0);
+  genSockets(filter, 1 << TCP_LISTEN, 1 << TCP_CLOSE, sockets);
+
+  QueryData results;
+  std::set<std::tuple<std::string, std::string, std::string> > ports;
+  for (auto& socket : sockets) {
+    if (socket["remote_port"] != "0") {
+      // Listening UDP/TCP ports have a remote_port == "0"
+      continue;
+    }
+
+    auto port = std::make_tuple(
+        socket["local_port"], socket["protocol"], socket["family"]);
+    if (!ports.insert(port).second) {
+      // There is a duplicate socket descriptor for this bind.
+      continue;
+    }
+
+    Row r;
+    r["socket"] = socket["socket"];
+    r["port"] = socket["local_port"];
+    r["protocol"] = socket["protocol"];
+    r["family"] = socket["family"];
+    r["address"] = socket["local_address"];
+    results.push_back(r);
+  }
+
+  genSocketOwners(context, results);
+  for (auto& r : results) {
+    r.erase("socket");
+  }
+  return results;
+}
+}
+}
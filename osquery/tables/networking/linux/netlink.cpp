@@ -0,0 +1,199 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+#include <arpa/inet.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "osquery/tables/networking/linux/netlink.h"
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
+namespace osquery {
+namespace tables {
+
+/// The most idle receive buffers kept by the pool.
+const size_t kNetlinkMaxPooledBuffers = 4;
+
+/// The receive buffers of destroyed clients.
+static std::vector<std::unique_ptr<std::vector<char> > > kNetlinkBufferPool;
+static std::mutex kNetlinkBufferPoolMutex;
+
+NetlinkRequest::NetlinkRequest(unsigned short type,
+                               const void* message,
+                               size_t size,
+                               bool dump) {
+  message_.resize(NLMSG_SPACE(size), 0);
+  auto header = this->header();
+  header->nlmsg_len = NLMSG_LENGTH(size);
+  header->nlmsg_type = type;
+  header->nlmsg_flags = NLM_F_REQUEST | ((dump) ? NLM_F_DUMP : 0);
+  std::memcpy(NLMSG_DATA(header), message, size);
+}
+
+void NetlinkRequest::addAttribute(unsigned short type,
+                                  const void* data,
+                                  size_t size) {
+  // Attributes start at an aligned offset from the message.
+  auto offset = NLMSG_ALIGN(header()->nlmsg_len);
+  message_.resize(offset + RTA_SPACE(size), 0);
+
+  auto attr = reinterpret_cast<struct rtattr*>(message_.data() + offset);
+  attr->rta_type = type;
+  attr->rta_len = RTA_LENGTH(size);
+  std::memcpy(RTA_DATA(attr), data, size);
+  header()->nlmsg_len = offset + RTA_LENGTH(size);
+}
+
+NetlinkClient::NetlinkClient(int protocol) : seq_(0), port_(0) {
+  fd_ = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+  if (fd_ == -1) {
+    return;
+  }
+
+  struct sockaddr_nl local;
+  socklen_t size = sizeof(local);
+  std::memset(&local, 0, sizeof(local));
+  local.nl_family = AF_NETLINK;
+  if (::bind(fd_, (struct sockaddr*)&local, sizeof(local)) != 0 ||
+      ::getsockname(fd_, (struct sockaddr*)&local, &size) != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return;
+  }
+  port_ = local.nl_pid;
+
+  std::lock_guard<std::mutex> lock(kNetlinkBufferPoolMutex);
+  if (!kNetlinkBufferPool.empty()) {
+    buffer_ = std::move(kNetlinkBufferPool.back());
+    kNetlinkBufferPool.pop_back();
+  }
+}
+
+NetlinkClient::~NetlinkClient() {
+  if (fd_ != -1) {
+    ::close(fd_);
+  }
+
+  if (buffer_ != nullptr) {
+    std::lock_guard<std::mutex> lock(kNetlinkBufferPoolMutex);
+    if (kNetlinkBufferPool.size() < kNetlinkMaxPooledBuffers) {
+      kNetlinkBufferPool.push_back(std::move(buffer_));
+    }
+  }
+}
+
+bool NetlinkClient::enableStrictDump() {
+  int enable = 1;
+  return (fd_ != -1 &&
+          ::setsockopt(fd_,
+                       SOL_NETLINK,
+                       NETLINK_GET_STRICT_CHK,
+                       &enable,
+                       sizeof(enable)) == 0);
+}
+
+Status NetlinkClient::dump(NetlinkRequest& request,
+                           const NetlinkCallback& callback) {
+  if (fd_ == -1) {
+    return Status(1, "Cannot open NETLINK socket");
+  }
+
+  auto header = request.header();
+  header->nlmsg_seq = ++seq_;
+  header->nlmsg_pid = 0;
+
+  struct sockaddr_nl kernel;
+  std::memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  if (::sendto(fd_,
+               header,
+               header->nlmsg_len,
+               0,
+               (struct sockaddr*)&kernel,
+               sizeof(kernel)) < 0) {
+    return Status(1, "Cannot write NETLINK request");
+  }
+  return receive(seq_, callback);
+}
+
+Status NetlinkClient::receive(unsigned int seq,
+                              const NetlinkCallback& callback) {
+  if (buffer_ == nullptr) {
+    buffer_.reset(new std::vector<char>(kNetlinkBufferSize));
+  }
+
+  auto buffer = buffer_->data();
+  while (true) {
+    // A datagram larger than the buffer is truncated and reports its size.
+    auto bytes = ::recv(fd_, buffer, buffer_->size(), MSG_TRUNC);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return Status(1, "Could not read from NETLINK");
+    } else if ((size_t)bytes > buffer_->size()) {
+      return Status(1, "Truncated NETLINK message");
+    }
+
+    // Each datagram holds one or more messages of a multipart reply.
+    size_t size = bytes;
+    auto message = reinterpret_cast<struct nlmsghdr*>(buffer);
+    for (; NLMSG_OK(message, size); message = NLMSG_NEXT(message, size)) {
+      if (message->nlmsg_seq != seq || message->nlmsg_pid != port_) {
+        // A reply to an earlier request.
+        continue;
+      }
+
+      if (message->nlmsg_type == NLMSG_DONE) {
+        return Status(0, "OK");
+      } else if (message->nlmsg_type == NLMSG_ERROR) {
+        auto error = (struct nlmsgerr*)NLMSG_DATA(message);
+        return Status(1, "NETLINK error: " + std::to_string(-error->error));
+      }
+      callback(message);
+      if ((message->nlmsg_flags & NLM_F_MULTI) == 0) {
+        // The reply to a request that is not a dump.
+        return Status(0, "OK");
+      }
+    }
+  }
+}
+
+std::string getNetlinkIP(int family, const void* address) {
+  char dst[INET6_ADDRSTRLEN] = {0};
+  if (inet_ntop(family, address, dst, sizeof(dst)) == nullptr) {
+    return "";
+  }
+  return dst;
+}
+
+const std::string& NetlinkInterfaceNames::get(int index) {
+  auto cached = names_.find(index);
+  if (cached != names_.end()) {
+    return cached->second;
+  }
+
+  char name[IF_NAMESIZE] = {0};
+  if (if_indextoname(index, name) == nullptr) {
+    name[0] = '\0';
+  }
+  return names_[index] = name;
+}
+}
+}
@@ -0,0 +1,131 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <linux/netlink.h>
+
+#include <osquery/status.h>
+
+namespace osquery {
+namespace tables {
+
+/// The size of each pooled receive buffer, larger than any dump datagram.
+const size_t kNetlinkBufferSize = 64 * 1024;
+
+/// Called with each message of a dump, before NLMSG_DONE.
+typedef std::function<void(const struct nlmsghdr*)> NetlinkCallback;
+
+/**
+ * @brief A netlink request: a header, a family message and attributes.
+ */
+class NetlinkRequest {
+ public:
+  /**
+   * @brief Start a NLM_F_DUMP request, or a request for a single object.
+   *
+   * @param type The request type, such as RTM_GETROUTE.
+   * @param message The family-specific message, such as a struct rtmsg.
+   * @param size The size of the family-specific message.
+   * @param dump False to request the one object the message and attributes
+   * identify, such as a link by its IFLA_IFNAME.
+   */
+  NetlinkRequest(unsigned short type,
+                 const void* message,
+                 size_t size,
+                 bool dump = true);
+
+  /// Append a struct rtattr attribute to the request.
+  void addAttribute(unsigned short type, const void* data, size_t size);
+
+  /// The request header, followed by the message and attributes.
+  struct nlmsghdr* header() {
+    return reinterpret_cast<struct nlmsghdr*>(message_.data());
+  }
+
+ private:
+  std::vector<char> message_;
+};
+
+/**
+ * @brief A netlink socket dumping kernel tables into pooled buffers.
+ *
+ * Each client receives into a buffer taken from a process-wide pool and
+ * returned when the client is destroyed, so queries do not allocate a buffer
+ * each time. Multipart replies are read until NLMSG_DONE.
+ */
+class NetlinkClient {
+ public:
+  /// Open a netlink socket of a protocol, such as NETLINK_ROUTE.
+  explicit NetlinkClient(int protocol);
+  ~NetlinkClient();
+
+  /// True if the socket was opened.
+  bool ok() const { return fd_ != -1; }
+
+  /**
+   * @brief Ask the kernel to apply a dump request's filters.
+   *
+   * With strict checking, the kernel filters route dumps by the request's
+   * family-specific message and attributes, such as a routing table. Kernels
+   * older than 4.20 ignore dump filters and return false.
+   */
+  bool enableStrictDump();
+
+  /**
+   * @brief Send a request and call a callback with each reply.
+   *
+   * A reply to a request that is not a dump is a single message.
+   *
+   * @param request The request, its sequence number is set.
+   * @param callback Called with each message in the reply.
+   * @return An error if the request failed or the reply was invalid.
+   */
+  Status dump(NetlinkRequest& request, const NetlinkCallback& callback);
+
+ private:
+  /// Read the reply to a request until NLMSG_DONE.
+  Status receive(unsigned int seq, const NetlinkCallback& callback);
+
+ private:
+  /// The netlink socket descriptor.
+  int fd_;
+  /// The sequence number of the last request.
+  unsigned int seq_;
+  /// The port ID the kernel assigned to the socket.
+  unsigned int port_;
+  /// A receive buffer of kNetlinkBufferSize from the pool.
+  std::unique_ptr<std::vector<char> > buffer_;
+};
+
+/// The string representation of an IPv4 or IPv6 netlink address attribute.
+std::string getNetlinkIP(int family, const void* address);
+
+/**
+ * @brief The name of an interface index, cached for the length of a query.
+ *
+ * Dumps contain many entries per interface and if_indextoname calls an ioctl
+ * each time it is used.
+ */
+class NetlinkInterfaceNames {
+ public:
+  const std::string& get(int index);
+
+ private:
+  std::map<int, std::string> names_;
+};
+}
+}
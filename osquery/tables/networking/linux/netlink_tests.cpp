@@ -0,0 +1,132 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <linux/rtnetlink.h>
+
+#include <gtest/gtest.h>
+
+#include <osquery/logger.h>
+#include <osquery/tables.h>
+
+#include "osquery/tables/networking/linux/netlink.h"
+
+namespace osquery {
+namespace tables {
+
+QueryData genInterfaceDetails(QueryContext& context);
+QueryData genInterfaceAddresses(QueryContext& context);
+
+class NetlinkTests : public testing::Test {};
+
+TEST_F(NetlinkTests, test_request_attributes) {
+  struct rtmsg message;
+  memset(&message, 0, sizeof(message));
+  message.rtm_family = AF_INET;
+
+  NetlinkRequest request(RTM_GETROUTE, &message, sizeof(message));
+  auto header = request.header();
+  EXPECT_EQ(header->nlmsg_type, RTM_GETROUTE);
+  EXPECT_EQ(header->nlmsg_len, NLMSG_LENGTH(sizeof(message)));
+  EXPECT_EQ(((struct rtmsg*)NLMSG_DATA(header))->rtm_family, AF_INET);
+
+  unsigned int table = RT_TABLE_MAIN;
+  request.addAttribute(RTA_TABLE, &table, sizeof(table));
+  header = request.header();
+  EXPECT_EQ(header->nlmsg_len,
+            NLMSG_SPACE(sizeof(message)) + RTA_LENGTH(sizeof(table)));
+
+  // The attribute follows the aligned family message.
+  auto attr = (struct rtattr*)RTM_RTA(NLMSG_DATA(header));
+  int size = RTM_PAYLOAD(header);
+  ASSERT_TRUE(RTA_OK(attr, size));
+  EXPECT_EQ(attr->rta_type, RTA_TABLE);
+  EXPECT_EQ(*(unsigned int*)RTA_DATA(attr), table);
+}
+
+TEST_F(NetlinkTests, test_dump_links) {
+  NetlinkClient client(NETLINK_ROUTE);
+  ASSERT_TRUE(client.ok());
+
+  struct ifinfomsg message;
+  memset(&message, 0, sizeof(message));
+  message.ifi_family = AF_UNSPEC;
+
+  // Every host has a loopback interface, dumps may be repeated.
+  for (size_t i = 0; i < 2; ++i) {
+    NetlinkRequest request(RTM_GETLINK, &message, sizeof(message));
+    size_t links = 0;
+    auto status = client.dump(request, [&links](const struct nlmsghdr* link) {
+      links += (link->nlmsg_type == RTM_NEWLINK) ? 1 : 0;
+    });
+    EXPECT_TRUE(status.ok());
+    EXPECT_GT(links, 0U);
+  }
+}
+
+TEST_F(NetlinkTests, test_interface_names) {
+  NetlinkInterfaceNames names;
+  auto loopback = names.get(1);
+  EXPECT_FALSE(loopback.empty());
+  EXPECT_EQ(names.get(1), loopback);
+  EXPECT_TRUE(names.get(-1).empty());
+}
+
+TEST_F(NetlinkTests, test_interface_details) {
+  QueryContext context;
+  auto links = genInterfaceDetails(context);
+  auto loopback = std::find_if(links.begin(), links.end(), [](const Row& r) {
+    return r.at("interface") == "lo";
+  });
+  ASSERT_NE(loopback, links.end());
+  EXPECT_EQ(loopback->at("mac"), "00:00:00:00:00:00");
+  EXPECT_EQ(loopback->at("type"), "772");
+  EXPECT_FALSE(loopback->at("mtu").empty());
+  EXPECT_FALSE(loopback->at("ibytes").empty());
+
+  // An interface constraint requests only the named links.
+  context.constraints["interface"].add(Constraint(EQUALS, "lo"));
+  context.constraints["interface"].add(Constraint(EQUALS, "osquery-none0"));
+  links = genInterfaceDetails(context);
+  ASSERT_EQ(links.size(), 1U);
+  EXPECT_EQ(links[0].at("interface"), "lo");
+}
+
+TEST_F(NetlinkTests, test_interface_addresses) {
+  QueryContext context;
+  context.constraints["interface"].add(Constraint(EQUALS, "lo"));
+  auto addresses = genInterfaceAddresses(context);
+  auto loopback = std::find_if(addresses.begin(),
+                               addresses.end(),
+                               [](const Row& r) {
+    return r.at("address") == "127.0.0.1";
+  });
+  ASSERT_NE(loopback, addresses.end());
+  EXPECT_EQ(loopback->at("interface"), "lo");
+  EXPECT_EQ(loopback->at("mask"), "255.0.0.0");
+  for (const auto& address : addresses) {
+    EXPECT_EQ(address.at("interface"), "lo");
+  }
+
+  QueryContext missing;
+  missing.constraints["interface"].add(Constraint(EQUALS, "osquery-none0"));
+  EXPECT_TRUE(genInterfaceAddresses(missing).empty());
+}
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
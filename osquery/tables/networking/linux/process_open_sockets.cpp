@@ -8,11 +8,14 @@
  *
  */
 
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
 #include <arpa/inet.h>
 #include <linux/netlink.h>
 
 #include <boost/algorithm/string/split.hpp>
-#include <boost/regex.hpp>
 
 #include <osquery/core.h>
 #include <osquery/filesystem.h>
@@ -25,30 +28,52 @@
 #define SOCK_DIAG_BY_FAMILY 20
 #endif
 
-#include "inet_diag.h"
+#include "osquery/tables/networking/linux/sockets.h"
 
 namespace osquery {
 namespace tables {
 
-// heavily influenced by github.com/kristrev/inet-diag-example
-enum {
-  TCP_ESTABLISHED = 1,
-  TCP_SYN_SENT,
-  TCP_SYN_RECV,
-  TCP_FIN_WAIT1,
-  TCP_FIN_WAIT2,
-  TCP_TIME_WAIT,
-  TCP_CLOSE,
-  TCP_CLOSE_WAIT,
-  TCP_LAST_ACK,
-  TCP_LISTEN,
-  TCP_CLOSING
-};
-
-#define TCPF_ALL 0xFFF
-#define SOCKET_BUFFER_SIZE (getpagesize() < 8192L ? getpagesize() : 8192L)
-
-int sendNLDiagMessage(int sockfd, int protocol, int family) {
+/// Dumps are sent as many datagrams, each up to the size of the last receive.
+static const size_t kNetlinkBufferSize = 64 * 1024;
+/// A larger socket buffer lets the kernel queue datagrams between receives.
+static const int kNetlinkSocketBufferSize = 1024 * 1024;
+
+std::vector<struct inet_diag_bc_op> buildPortFilter(
+    unsigned short local_port, unsigned short remote_port) {
+  std::vector<std::pair<unsigned char, unsigned short> > conditions;
+  if (local_port != 0) {
+    conditions.push_back(std::make_pair(INET_DIAG_BC_S_GE, local_port));
+    conditions.push_back(std::make_pair(INET_DIAG_BC_S_LE, local_port));
+  }
+  if (remote_port != 0) {
+    conditions.push_back(std::make_pair(INET_DIAG_BC_D_GE, remote_port));
+    conditions.push_back(std::make_pair(INET_DIAG_BC_D_LE, remote_port));
+  }
+
+  // A condition is an operation followed by an operation holding the port.
+  std::vector<struct inet_diag_bc_op> bytecode;
+  unsigned short remaining = conditions.size() * 2 * sizeof(inet_diag_bc_op);
+  for (const auto &condition : conditions) {
+    struct inet_diag_bc_op op;
+    op.code = condition.first;
+    op.yes = 2 * sizeof(inet_diag_bc_op);
+    op.no = remaining + sizeof(inet_diag_bc_op);
+    bytecode.push_back(op);
+
+    op.code = INET_DIAG_BC_NOP;
+    op.yes = 0;
+    op.no = condition.second;
+    bytecode.push_back(op);
+    remaining -= 2 * sizeof(inet_diag_bc_op);
+  }
+  return bytecode;
+}
+
+int sendNLDiagMessage(int sockfd,
+                      int protocol,
+                      int family,
+                      unsigned int states,
+                      const std::vector<struct inet_diag_bc_op> &filter) {
   struct sockaddr_nl sa;
   memset(&sa, 0, sizeof(sa));
   sa.nl_family = AF_NETLINK;
@@ -58,19 +83,22 @@ int sendNLDiagMessage(int sockfd, int protocol, int family) {
   memset(&conn_req, 0, sizeof(conn_req));
   conn_req.sdiag_family = family;
   conn_req.sdiag_protocol = protocol;
+  conn_req.idiag_states = states;
   if (protocol == IPPROTO_TCP) {
-    conn_req.idiag_states =
-        TCPF_ALL &
-        ~((1 << TCP_SYN_RECV) | (1 << TCP_TIME_WAIT) | (1 << TCP_CLOSE));
     // Request additional TCP information.
     conn_req.idiag_ext |= (1 << (INET_DIAG_INFO - 1));
-  } else {
-    conn_req.idiag_states = -1;
   }
 
+  // The kernel applies the filter bytecode, an attribute of the request.
+  size_t filter_size = filter.size() * sizeof(struct inet_diag_bc_op);
+  struct nlattr attr;
+  attr.nla_type = INET_DIAG_REQ_BYTECODE;
+  attr.nla_len = NLA_HDRLEN + filter_size;
+
   struct nlmsghdr nlh;
   memset(&nlh, 0, sizeof(nlh));
   nlh.nlmsg_len = NLMSG_LENGTH(sizeof(conn_req));
+  nlh.nlmsg_len += (filter_size > 0) ? NLA_ALIGN(attr.nla_len) : 0;
   nlh.nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
   nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
 
@@ -79,19 +107,26 @@ int sendNLDiagMessage(int sockfd, int protocol, int family) {
   iov[0].iov_len = sizeof(nlh);
   iov[1].iov_base = (void *)&conn_req;
   iov[1].iov_len = sizeof(conn_req);
+  iov[2].iov_base = (void *)&attr;
+  iov[2].iov_len = NLA_HDRLEN;
+  iov[3].iov_base = (void *)filter.data();
+  iov[3].iov_len = filter_size;
 
   struct msghdr msg;
   memset(&msg, 0, sizeof(msg));
   msg.msg_name = (void *)&sa;
   msg.msg_namelen = sizeof(sa);
   msg.msg_iov = iov;
-  msg.msg_iovlen = 2;
+  msg.msg_iovlen = (filter_size > 0) ? 4 : 2;
 
   int retval = sendmsg(sockfd, &msg, 0);
   return retval;
 }
 
-Row getNLDiagMessage(struct inet_diag_msg *diag_msg, int protocol, int family) {
+void getNLDiagMessage(const struct inet_diag_msg *diag_msg,
+                      int protocol,
+                      int family,
+                      Row &row) {
   char local_addr_buf[INET6_ADDRSTRLEN] = {0};
   char remote_addr_buf[INET6_ADDRSTRLEN] = {0};
 
@@ -117,7 +152,6 @@ Row getNLDiagMessage(struct inet_diag_msg *diag_msg, int protocol, int family) {
   }
 
   // populate the Row from diag_msg fields
-  Row row;
   row["socket"] = INTEGER(diag_msg->idiag_inode);
   row["family"] = INTEGER(family);
   row["protocol"] = INTEGER(protocol);
@@ -125,7 +159,6 @@ Row getNLDiagMessage(struct inet_diag_msg *diag_msg, int protocol, int family) {
   row["remote_address"] = TEXT(remote_addr_buf);
   row["local_port"] = INTEGER(ntohs(diag_msg->id.idiag_sport));
   row["remote_port"] = INTEGER(ntohs(diag_msg->id.idiag_dport));
-  return row;
 }
 
 std::string addressFromHex(const std::string &encoded_address, int family) {
@@ -161,10 +194,7 @@ unsigned short portFromHex(const std::string &encoded_port) {
 }
 
 /// A fallback method for generating socket information from /proc/net
-void genSocketsFromProc(const std::map<std::string, std::string> socket_inodes,
-                        int protocol,
-                        int family,
-                        QueryData &results) {
+void genSocketsFromProc(int protocol, int family, QueryData &results) {
   std::string path = "/proc/net/";
   path += (protocol == IPPROTO_UDP) ? "udp" : "tcp";
   path += (family == AF_INET6) ? "6" : "";
@@ -211,102 +241,184 @@ void genSocketsFromProc(const std::map<std::string, std::string> socket_inodes,
     r["local_port"] = INTEGER(portFromHex(locals[1]));
     r["remote_address"] = addressFromHex(remotes[0], family);
     r["remote_port"] = INTEGER(portFromHex(remotes[1]));
-
-    if (socket_inodes.count(r["socket"]) > 0) {
-      r["pid"] = socket_inodes.at(r["socket"]);
-    } else {
-      r["pid"] = "-1";
-    }
-
     results.push_back(r);
   }
 }
 
-void genSocketsForFamily(const std::map<std::string, std::string> socket_inodes,
+/**
+ * @brief Dump the sockets of a protocol and family using a netlink socket.
+ *
+ * The socket and receive buffer are shared by each dump of a query. A dump
+ * spans many datagrams, which are received until NLMSG_DONE and parsed in
+ * place within the buffer.
+ *
+ * @return false if the netlink socket failed and should not be reused.
+ */
+bool genSocketsForFamily(int nl_sock,
+                         std::vector<char> &buffer,
                          int protocol,
                          int family,
+                         unsigned int states,
+                         const std::vector<struct inet_diag_bc_op> &filter,
                          QueryData &results) {
-  // set up the socket
-  int nl_sock = 0;
-  if ((nl_sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_INET_DIAG)) == -1) {
-    return;
+  // send the inet_diag message
+  if (sendNLDiagMessage(nl_sock, protocol, family, states, filter) < 0) {
+    genSocketsFromProc(protocol, family, results);
+    return false;
   }
 
-  // send the inet_diag message
-  if (sendNLDiagMessage(nl_sock, protocol, family) < 0) {
-    close(nl_sock);
-    return;
+  // recieve netlink messages until the dump is done
+  while (true) {
+    auto numbytes = recv(nl_sock, buffer.data(), buffer.size(), 0);
+    if (numbytes == -1 && errno == EINTR) {
+      continue;
+    } else if (numbytes <= 0) {
+      VLOG(1) << "NETLINK receive failed";
+      return false;
+    }
+
+    auto nlh = (struct nlmsghdr *)buffer.data();
+    while (NLMSG_OK(nlh, numbytes)) {
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        return true;
+      }
+
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        genSocketsFromProc(protocol, family, results);
+        return true;
+      }
+
+      // parse and process netlink message
+      results.emplace_back();
+      getNLDiagMessage((const struct inet_diag_msg *)NLMSG_DATA(nlh),
+                       protocol,
+                       family,
+                       results.back());
+      nlh = NLMSG_NEXT(nlh, numbytes);
+    }
   }
+}
 
-  // recieve netlink messages
-  uint8_t recv_buf[SOCKET_BUFFER_SIZE];
-  int numbytes = recv(nl_sock, recv_buf, sizeof(recv_buf), 0);
-  if (numbytes <= 0) {
-    VLOG(1) << "NETLINK receive failed";
-    return;
+void genSockets(const std::vector<struct inet_diag_bc_op> &filter,
+                unsigned int tcp_states,
+                unsigned int udp_states,
+                QueryData &results) {
+  // The kernel runs one dump at a time for a netlink socket.
+  static const std::vector<std::pair<int, int> > kDumps = {
+      {IPPROTO_TCP, AF_INET},
+      {IPPROTO_UDP, AF_INET},
+      {IPPROTO_TCP, AF_INET6},
+      {IPPROTO_UDP, AF_INET6},
+  };
+
+  int nl_sock =
+      socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_INET_DIAG);
+  if (nl_sock != -1) {
+    setsockopt(nl_sock,
+               SOL_SOCKET,
+               SO_RCVBUF,
+               &kNetlinkSocketBufferSize,
+               sizeof(kNetlinkSocketBufferSize));
   }
 
-  auto nlh = (struct nlmsghdr *)recv_buf;
-  while (NLMSG_OK(nlh, numbytes)) {
-    if (nlh->nlmsg_type == NLMSG_DONE) {
-      break;
+  std::vector<char> buffer(kNetlinkBufferSize);
+  for (const auto &dump : kDumps) {
+    if (nl_sock == -1) {
+      genSocketsFromProc(dump.first, dump.second, results);
+      continue;
     }
 
-    if (nlh->nlmsg_type == NLMSG_ERROR) {
-      genSocketsFromProc(socket_inodes, protocol, family, results);
-      break;
+    auto states = (dump.first == IPPROTO_TCP) ? tcp_states : udp_states;
+    if (!genSocketsForFamily(nl_sock,
+                             buffer,
+                             dump.first,
+                             dump.second,
+                             states,
+                             filter,
+                             results)) {
+      // A partial dump may remain queued, so the socket is not reused.
+      close(nl_sock);
+      nl_sock = -1;
     }
+  }
 
-    // parse and process netlink message
-    auto diag_msg = (struct inet_diag_msg *)NLMSG_DATA(nlh);
-    auto row = getNLDiagMessage(diag_msg, protocol, family);
-
-    if (socket_inodes.count(row["socket"]) > 0) {
-      row["pid"] = socket_inodes.at(row["socket"]);
-    } else {
-      row["pid"] = "-1";
-    }
+  if (nl_sock != -1) {
+    close(nl_sock);
+  }
+}
 
-    results.push_back(row);
-    nlh = NLMSG_NEXT(nlh, numbytes);
+unsigned short getPortConstraint(QueryContext &context,
+                                 const std::string &column) {
+  auto ports = context.constraints[column].getAll(EQUALS);
+  if (ports.size() != 1) {
+    return 0;
   }
 
-  close(nl_sock);
-  return;
+  auto port = std::strtoul(ports[0].c_str(), nullptr, 10);
+  return (port <= 0xFFFF) ? port : 0;
 }
 
-QueryData genOpenSockets(QueryContext &context) {
-  QueryData results;
+void genSocketOwners(QueryContext &context, QueryData &results) {
+  if (results.empty()) {
+    return;
+  }
 
-  // If a pid is given then set that as the only item in processes.
-  std::vector<std::string> processes;
-  if (!osquery::procProcesses(processes).ok()) {
+  // Index the generated sockets by inode, their owners are not yet known.
+  std::unordered_map<std::string, std::string> socket_inodes;
+  for (const auto &row : results) {
+    socket_inodes[row.at("socket")] = "-1";
+  }
+
+  // If pids are given then only read the descriptors of those processes.
+  // Sockets without a process (pid -1) are only known after reading all.
+  auto processes = context.constraints["pid"].getAll(EQUALS);
+  if (std::find(processes.begin(), processes.end(), "-1") != processes.end()) {
+    processes.clear();
+  }
+  if (processes.empty() && !osquery::procProcesses(processes).ok()) {
     VLOG(1) << "Cannot list Linux processes";
   }
 
-  // Generate a map of socket inode to process tid.
-  boost::regex inode_regex("[0-9]+");
-  std::map<std::string, std::string> socket_inodes;
-  for (const auto& process : processes) {
+  // Search the processes' descriptors until every socket's owner is found.
+  size_t remaining = socket_inodes.size();
+  for (const auto &process : processes) {
     std::map<std::string, std::string> descriptors;
-    if (osquery::procDescriptors(process, descriptors).ok()) {
-      for (const auto& fd : descriptors) {
-        if (fd.second.find("socket:") != std::string::npos) {
-          boost::smatch inode;
-          boost::regex_search(fd.second, inode, inode_regex);
-          if (inode[0].str().length() > 0) {
-            socket_inodes[inode[0].str()] = process;
-          }
-        }
+    if (!osquery::procDescriptors(process, descriptors).ok()) {
+      continue;
+    }
+
+    std::string inode;
+    for (const auto &fd : descriptors) {
+      if (!osquery::procSocketInode(fd.second, inode)) {
+        continue;
       }
+
+      auto socket = socket_inodes.find(inode);
+      if (socket != socket_inodes.end() && socket->second == "-1") {
+        socket->second = process;
+        remaining--;
+      }
+    }
+
+    if (remaining == 0) {
+      break;
     }
   }
 
-  // Use netlink messages to query socket information.
-  genSocketsForFamily(socket_inodes, IPPROTO_TCP, AF_INET, results);
-  genSocketsForFamily(socket_inodes, IPPROTO_UDP, AF_INET, results);
-  genSocketsForFamily(socket_inodes, IPPROTO_TCP, AF_INET6, results);
-  genSocketsForFamily(socket_inodes, IPPROTO_UDP, AF_INET6, results);
+  for (auto &row : results) {
+    row["pid"] = socket_inodes.at(row["socket"]);
+  }
+}
+
+QueryData genOpenSockets(QueryContext &context) {
+  QueryData results;
+
+  // Use netlink messages to query socket information, the kernel only
+  // returns sockets matching port constraints.
+  auto filter = buildPortFilter(getPortConstraint(context, "local_port"),
+                                getPortConstraint(context, "remote_port"));
+  genSockets(filter, TCPF_OPEN, -1, results);
+  genSocketOwners(context, results);
   return results;
 }
 }
@@ -13,82 +13,77 @@
 #include <linux/rtnetlink.h>
 #include <net/if.h>
 
-#include <boost/algorithm/string/trim.hpp>
-
 #include <osquery/core.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
-#include "osquery/tables/networking/utils.h"
+#include "osquery/tables/networking/linux/netlink.h"
 
 namespace osquery {
 namespace tables {
 
-#define MAX_NETLINK_SIZE 8192
-#define MAX_NETLINK_LATENCY 2000
-
-std::string getNetlinkIP(int family, const char* buffer) {
-  char dst[INET6_ADDRSTRLEN];
-  memset(dst, 0, INET6_ADDRSTRLEN);
-
-  inet_ntop(family, buffer, dst, INET6_ADDRSTRLEN);
-  std::string address(dst);
-  boost::trim(address);
-
-  return address;
-}
-
-Status readNetlink(int socket_fd, int seq, char* output, size_t* size) {
-  struct nlmsghdr* nl_hdr;
-
-  size_t message_size = 0;
-  do {
-    int latency = 0;
-    int bytes = 0;
-    while (bytes == 0) {
-      bytes = recv(socket_fd, output, MAX_NETLINK_SIZE - message_size, 0);
-      if (bytes < 0) {
-        return Status(1, "Could not read from NETLINK");
-      } else if (latency >= MAX_NETLINK_LATENCY) {
-        return Status(1, "Netlink timeout");
-      } else if (bytes == 0) {
-        ::usleep(20);
-        latency += 20;
-      }
-    }
-
-    // Assure valid header response, and not an error type.
-    nl_hdr = (struct nlmsghdr*)output;
-    if (NLMSG_OK(nl_hdr, bytes) == 0 || nl_hdr->nlmsg_type == NLMSG_ERROR) {
-      return Status(1, "Read invalid NETLINK message");
-    }
-
-    if (nl_hdr->nlmsg_type == NLMSG_DONE) {
-      break;
+/// The kernel-side filters of a routes dump, from the query's constraints.
+struct RouteFilter {
+  /// AF_INET or AF_INET6, or AF_UNSPEC for both families.
+  unsigned char family;
+  /// A routing table ID, or RT_TABLE_UNSPEC for every table.
+  unsigned int table;
+
+  RouteFilter() : family(AF_UNSPEC), table(RT_TABLE_UNSPEC) {}
+};
+
+/// Use single integer EQUALS constraints on family and routing_table.
+RouteFilter getRouteFilter(QueryContext& context) {
+  RouteFilter filter;
+
+  auto families = context.constraints["family"].getAll(EQUALS);
+  if (families.size() == 1) {
+    if (families[0] == "4") {
+      filter.family = AF_INET;
+    } else if (families[0] == "6") {
+      filter.family = AF_INET6;
     }
+  }
 
-    // Move the buffer pointer
-    output += bytes;
-    message_size += bytes;
-    if ((nl_hdr->nlmsg_flags & NLM_F_MULTI) == 0) {
-      break;
+  auto tables = context.constraints["routing_table"].getAll(EQUALS);
+  if (tables.size() == 1) {
+    char* end = nullptr;
+    auto table = std::strtoul(tables[0].c_str(), &end, 10);
+    if (!tables[0].empty() && *end == 0 && table > RT_TABLE_UNSPEC) {
+      filter.table = table;
     }
-  } while (nl_hdr->nlmsg_seq != seq || nl_hdr->nlmsg_pid != getpid());
-
-  *size = message_size;
-  return Status(0, "OK");
+  }
+  return filter;
 }
 
-void genNetlinkRoutes(const struct nlmsghdr* netlink_msg, QueryData& results) {
+void genNetlinkRoutes(const struct nlmsghdr* netlink_msg,
+                      const RouteFilter& filter,
+                      NetlinkInterfaceNames& interfaces,
+                      QueryData& results) {
   std::string address;
   int mask = 0;
-  char interface[IF_NAMESIZE];
 
   struct rtmsg* message = (struct rtmsg*)NLMSG_DATA(netlink_msg);
   struct rtattr* attr = (struct rtattr*)RTM_RTA(message);
   int attr_size = RTM_PAYLOAD(netlink_msg);
 
+  // Kernels without strict dump checking ignore the request's filters.
+  unsigned int table = message->rtm_table;
+  int remaining = attr_size;
+  for (auto table_attr = attr; RTA_OK(table_attr, remaining);
+       table_attr = RTA_NEXT(table_attr, remaining)) {
+    if (table_attr->rta_type == RTA_TABLE) {
+      table = *(unsigned int*)RTA_DATA(table_attr);
+    }
+  }
+  if ((filter.family != AF_UNSPEC && message->rtm_family != filter.family) ||
+      (filter.table != RT_TABLE_UNSPEC && table != filter.table)) {
+    return;
+  }
+
   Row r;
+  r["family"] = (message->rtm_family == AF_INET6) ? "6" : "4";
+  r["routing_table"] = BIGINT(table);
 
   // Iterate over each route in the netlink message
   bool has_destination = false;
@@ -96,22 +91,21 @@ void genNetlinkRoutes(const struct nlmsghdr* netlink_msg, QueryData& results) {
   while (RTA_OK(attr, attr_size)) {
     switch (attr->rta_type) {
     case RTA_OIF:
-      if_indextoname(*(int*)RTA_DATA(attr), interface);
-      r["interface"] = std::string(interface);
+      r["interface"] = interfaces.get(*(int*)RTA_DATA(attr));
       break;
     case RTA_GATEWAY:
-      address = getNetlinkIP(message->rtm_family, (char*)RTA_DATA(attr));
+      address = getNetlinkIP(message->rtm_family, RTA_DATA(attr));
       r["gateway"] = address;
       break;
     case RTA_PREFSRC:
-      address = getNetlinkIP(message->rtm_family, (char*)RTA_DATA(attr));
+      address = getNetlinkIP(message->rtm_family, RTA_DATA(attr));
       r["source"] = address;
       break;
     case RTA_DST:
       if (message->rtm_dst_len != 32 && message->rtm_dst_len != 128) {
         mask = (int)message->rtm_dst_len;
       }
-      address = getNetlinkIP(message->rtm_family, (char*)RTA_DATA(attr));
+      address = getNetlinkIP(message->rtm_family, RTA_DATA(attr));
       r["destination"] = address;
       has_destination = true;
       break;
@@ -123,7 +117,7 @@ void genNetlinkRoutes(const struct nlmsghdr* netlink_msg, QueryData& results) {
   }
 
   if (!has_destination) {
-    r["destination"] = "0.0.0.0";
+    r["destination"] = (message->rtm_family == AF_INET6) ? "::" : "0.0.0.0";
     if (message->rtm_dst_len) {
       mask = (int)message->rtm_dst_len;
     }
@@ -155,51 +149,31 @@ void genNetlinkRoutes(const struct nlmsghdr* netlink_msg, QueryData& results) {
 QueryData genRoutes(QueryContext& context) {
   QueryData results;
 
-  int socket_fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
-  if (socket_fd < 0) {
+  NetlinkClient client(NETLINK_ROUTE);
+  if (!client.ok()) {
     VLOG(1) << "Cannot open NETLINK socket";
     return {};
   }
 
-  // Create netlink message header
-  void* netlink_buffer = malloc(MAX_NETLINK_SIZE);
-  struct nlmsghdr* netlink_msg = (struct nlmsghdr*)netlink_buffer;
-  if (netlink_msg == nullptr) {
-    close(socket_fd);
-    return {};
-  }
+  // Let the kernel skip other families and tables, if it can.
+  auto filter = getRouteFilter(context);
+  struct rtmsg message;
+  memset(&message, 0, sizeof(message));
+  message.rtm_family = filter.family;
 
-  netlink_msg->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
-  netlink_msg->nlmsg_type = RTM_GETROUTE; // routes from kernel routing table
-  netlink_msg->nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
-  netlink_msg->nlmsg_seq = 0;
-  netlink_msg->nlmsg_pid = getpid();
-
-  // Send the netlink request to the kernel
-  if (send(socket_fd, netlink_msg, netlink_msg->nlmsg_len, 0) < 0) {
-    VLOG(1) << "Cannot write NETLINK request header to socket";
-    close(socket_fd);
-    free(netlink_buffer);
-    return {};
+  NetlinkRequest request(RTM_GETROUTE, &message, sizeof(message));
+  if (filter.table != RT_TABLE_UNSPEC && client.enableStrictDump()) {
+    request.addAttribute(RTA_TABLE, &filter.table, sizeof(filter.table));
   }
 
-  // Wrap the read socket to support multi-netlink messages
-  size_t size = 0;
-  if (!readNetlink(socket_fd, 1, (char*)netlink_msg, &size).ok()) {
-    VLOG(1) << "Cannot read NETLINK response from socket";
-    close(socket_fd);
-    free(netlink_buffer);
+  NetlinkInterfaceNames interfaces;
+  auto status = client.dump(request, [&](const struct nlmsghdr* route) {
+    genNetlinkRoutes(route, filter, interfaces, results);
+  });
+  if (!status.ok()) {
+    VLOG(1) << "Cannot read NETLINK routes: " << status.toString();
     return {};
   }
-
-  // Treat the netlink response as route information
-  while (NLMSG_OK(netlink_msg, size)) {
-    genNetlinkRoutes(netlink_msg, results);
-    netlink_msg = NLMSG_NEXT(netlink_msg, size);
-  }
-
-  close(socket_fd);
-  free(netlink_buffer);
   return results;
 }
 }
@@ -0,0 +1,85 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <osquery/tables.h>
+
+#include "osquery/tables/networking/linux/inet_diag.h"
+
+namespace osquery {
+namespace tables {
+
+// heavily influenced by github.com/kristrev/inet-diag-example
+enum {
+  TCP_ESTABLISHED = 1,
+  TCP_SYN_SENT,
+  TCP_SYN_RECV,
+  TCP_FIN_WAIT1,
+  TCP_FIN_WAIT2,
+  TCP_TIME_WAIT,
+  TCP_CLOSE,
+  TCP_CLOSE_WAIT,
+  TCP_LAST_ACK,
+  TCP_LISTEN,
+  TCP_CLOSING
+};
+
+#define TCPF_ALL 0xFFF
+
+/// The TCP states of open sockets, without half-open and closing sockets.
+#define TCPF_OPEN \
+  (TCPF_ALL &     \
+   ~((1 << TCP_SYN_RECV) | (1 << TCP_TIME_WAIT) | (1 << TCP_CLOSE)))
+
+/**
+ * @brief Build inet_diag bytecode accepting only sockets with the given ports.
+ *
+ * Each port, if not 0, is compared with a pair of greater-or-equal and
+ * less-or-equal conditions. A failed condition jumps past the end of the
+ * bytecode, which rejects the socket.
+ */
+std::vector<struct inet_diag_bc_op> buildPortFilter(
+    unsigned short local_port, unsigned short remote_port);
+
+/// The port of a single EQUALS constraint on a port column, otherwise 0.
+unsigned short getPortConstraint(QueryContext &context,
+                                 const std::string &column);
+
+/**
+ * @brief Dump the TCP and UDP sockets of both IP families.
+ *
+ * Rows have the columns of process_open_sockets, without a pid. The kernel
+ * only returns sockets in the requested states that are accepted by the
+ * filter bytecode. UDP sockets use the TCP state numbering: unconnected
+ * sockets are TCP_CLOSE and connected sockets are TCP_ESTABLISHED.
+ *
+ * @param filter inet_diag bytecode, which may be empty.
+ * @param tcp_states A mask of (1 << state) for TCP sockets.
+ * @param udp_states A mask of (1 << state) for UDP sockets.
+ * @param results Output, a row for each socket.
+ */
+void genSockets(const std::vector<struct inet_diag_bc_op> &filter,
+                unsigned int tcp_states,
+                unsigned int udp_states,
+                QueryData &results);
+
+/**
+ * @brief Set the pid of each socket row, -1 if no process owns it.
+ *
+ * Process descriptors are only read until every socket's owner is found. If
+ * the query constrains pid, only those processes are read.
+ */
+void genSocketOwners(QueryContext &context, QueryData &results);
+}
+}
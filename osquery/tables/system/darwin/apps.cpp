@@ -8,17 +8,27 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+
+#include <sys/stat.h>
+
 #include <boost/algorithm/string/join.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
 
 #include <osquery/core.h>
+#include <osquery/events.h>
 #include <osquery/filesystem.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
-#include <osquery/sql.h>
 
-namespace pt = boost::property_tree;
+#include "osquery/events/darwin/fsevents.h"
+#include "osquery/tables/system/user_groups.h"
+
+namespace fs = boost::filesystem;
 
 namespace osquery {
 namespace tables {
@@ -93,51 +103,193 @@ std::string getPathFromInfoPlistPath(const std::string& path) {
   return full.parent_path().parent_path().string();
 }
 
-Row parseInfoPlist(const std::string& path, const pt::ptree& tree) {
+const std::vector<std::string>& getInfoPlistKeys() {
+  static const std::vector<std::string> keys = []() {
+    std::vector<std::string> names;
+    for (const auto& it : kAppsInfoPlistTopLevelStringKeys) {
+      names.push_back(it.first);
+    }
+    return names;
+  }();
+  return keys;
+}
+
+Row parseInfoPlist(const std::string& path,
+                   const std::map<std::string, std::string>& values) {
   Row r;
 
-  boost::filesystem::path full = path;
   r["name"] = getNameFromInfoPlistPath(path);
   r["path"] = getPathFromInfoPlistPath(path);
   for (const auto& it : kAppsInfoPlistTopLevelStringKeys) {
-    try {
-      r[it.second] = tree.get<std::string>(it.first);
-    } catch (const pt::ptree_error& e) {
-      VLOG(1) << "Error retrieving " << it.first << " from " << path << ": "
-              << e.what();
-      r[it.second] = "";
-    }
+    auto value = values.find(it.first);
+    r[it.second] = (value != values.end()) ? value->second : "";
   }
   return r;
 }
 
+/// A parsed bundle, reused while its Info.plist is unchanged.
+struct AppsCacheEntry {
+  time_t mtime;
+  Row row;
+};
+
+/// Parsed bundles by Info.plist path and the last complete inventory.
+struct AppsCache {
+  std::map<std::string, AppsCacheEntry> bundles;
+  /// The last inventory and the application directories it enumerated.
+  QueryData inventory;
+  std::set<std::string> directories;
+  /// The value of kAppsGeneration when the inventory was enumerated.
+  size_t generation;
+  /// The application directories FSEvents reports changes within.
+  std::set<std::string> watched;
+
+  AppsCache() : generation(0) {}
+};
+
+static AppsCache kAppsCache;
+static std::mutex kAppsCacheMutex;
+
+/// Incremented by each change within a watched application directory.
+static std::atomic<size_t> kAppsGeneration{1};
+
+/// The existing directories applications are enumerated within.
+std::set<std::string> getApplicationDirectories() {
+  std::set<std::string> directories;
+  if (isDirectory("/Applications").ok()) {
+    directories.insert("/Applications");
+  }
+
+  for (const auto& user : getUserSnapshot()->users) {
+    if (user.directory.empty()) {
+      continue;
+    }
+    for (const auto& dir_to_check : kHomeDirSearchPaths) {
+      auto apps_path = (fs::path(user.directory) / dir_to_check).string();
+      if (isDirectory(apps_path).ok()) {
+        directories.insert(apps_path);
+      }
+    }
+  }
+  return directories;
+}
+
+/**
+ * @brief Invalidate the application inventory when a bundle changes.
+ *
+ * This subscriber has no table. The FSEvents publisher reports changes within
+ * the application directories that existed when it started, while they are
+ * unchanged the apps table reuses its last inventory without listing them.
+ */
+class AppsEventSubscriber : public EventSubscriber<FSEventsEventPublisher> {
+  DECLARE_SUBSCRIBER("apps_inventory");
+
+ public:
+  void init();
+
+  Status Callback(const FSEventsEventContextRef& ec);
+};
+
+REGISTER(AppsEventSubscriber, "event_subscriber", "apps_inventory");
+
+void AppsEventSubscriber::init() {
+  auto types = EventFactory::publisherTypes();
+  if (std::find(types.begin(), types.end(), type()) == types.end()) {
+    // Without FSEvents each query checks every Info.plist's mtime.
+    return;
+  }
+
+  auto directories = getApplicationDirectories();
+  for (const auto& directory : directories) {
+    auto sc = createSubscriptionContext();
+    sc->path = directory;
+    subscribe(&AppsEventSubscriber::Callback, sc);
+  }
+
+  std::lock_guard<std::mutex> lock(kAppsCacheMutex);
+  kAppsCache.watched = std::move(directories);
+  kAppsGeneration++;
+}
+
+Status AppsEventSubscriber::Callback(const FSEventsEventContextRef& ec) {
+  kAppsGeneration++;
+  return Status(0, "OK");
+}
+
+/// Append the row of a bundle, parsing its Info.plist only if it changed.
+void genApp(const std::string& path,
+            std::map<std::string, AppsCacheEntry>& bundles,
+            QueryData& results) {
+  struct stat info;
+  if (::stat(path.c_str(), &info) != 0) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(kAppsCacheMutex);
+    auto cached = kAppsCache.bundles.find(path);
+    if (cached != kAppsCache.bundles.end() &&
+        cached->second.mtime == info.st_mtime) {
+      results.push_back(cached->second.row);
+      bundles[path] = cached->second;
+      return;
+    }
+  }
+
+  // Only the keys of columns are read, an Info.plist may contain large blobs.
+  std::map<std::string, std::string> values;
+  if (!osquery::parsePlistKeys(path, getInfoPlistKeys(), values).ok()) {
+    VLOG(1) << "Error parsing application: " << path;
+    return;
+  }
+
+  auto& bundle = bundles[path];
+  bundle.mtime = info.st_mtime;
+  bundle.row = parseInfoPlist(path, values);
+  results.push_back(bundle.row);
+}
+
 QueryData genApps(QueryContext& context) {
+  auto generation = kAppsGeneration.load();
+  auto directories = getApplicationDirectories();
+  {
+    // Reuse the inventory if no watched directory changed since it was made.
+    std::lock_guard<std::mutex> lock(kAppsCacheMutex);
+    if (kAppsCache.generation == generation &&
+        kAppsCache.directories == directories &&
+        std::includes(kAppsCache.watched.begin(),
+                      kAppsCache.watched.end(),
+                      directories.begin(),
+                      directories.end())) {
+      return kAppsCache.inventory;
+    }
+  }
+
   QueryData results;
-  pt::ptree tree;
+  std::map<std::string, AppsCacheEntry> bundles;
 
   // Enumerate and parse applications in / (system applications).
   for (const auto& path : getSystemApplications()) {
-    if (osquery::parsePlist(path, tree).ok()) {
-      results.push_back(parseInfoPlist(path, tree));
-    } else {
-      VLOG(1) << "Error parsing system applications: " << path;
-    }
+    genApp(path, bundles, results);
   }
 
-  auto users = SQL::selectAllFrom("users");
-
-  // Enumerate apps for each user (several paths).
-  for (const auto& user : users) {
-    for (const auto& path : getUserApplications(user.at("directory"))) {
-      if (osquery::parsePlist(path, tree).ok()) {
-        Row r = parseInfoPlist(path, tree);
-        results.push_back(r);
-      } else {
-        VLOG(1) << "Error parsing user applications: " << path;
-      }
+  // Enumerate apps for each user (several paths), once per home directory.
+  std::set<std::string> homes;
+  for (const auto& user : getUserSnapshot()->users) {
+    if (user.directory.empty() || !homes.insert(user.directory).second) {
+      continue;
+    }
+    for (const auto& path : getUserApplications(user.directory)) {
+      genApp(path, bundles, results);
     }
   }
 
+  // Bundles that were not found again are dropped from the cache.
+  std::lock_guard<std::mutex> lock(kAppsCacheMutex);
+  kAppsCache.bundles = std::move(bundles);
+  kAppsCache.inventory = results;
+  kAppsCache.directories = std::move(directories);
+  kAppsCache.generation = generation;
   return results;
 }
 }
@@ -16,23 +16,20 @@
 
 #include "osquery/core/test_util.h"
 
-namespace pt = boost::property_tree;
-
 namespace osquery {
 namespace tables {
 
 std::vector<std::string> getSystemApplications();
 std::string getNameFromInfoPlistPath(const std::string& path);
 std::string getPathFromInfoPlistPath(const std::string& path);
-Row parseInfoPlist(const std::string& path, const pt::ptree& tree);
-
-pt::ptree getInfoPlistTree() {
-  std::string content;
-  readFile(kTestDataPath + "test_info.plist", content);
+const std::vector<std::string>& getInfoPlistKeys();
+Row parseInfoPlist(const std::string& path,
+                   const std::map<std::string, std::string>& values);
 
-  pt::ptree tree;
-  parsePlistContent(content, tree);
-  return tree;
+std::map<std::string, std::string> getInfoPlistValues(const std::string& name) {
+  std::map<std::string, std::string> values;
+  parsePlistKeys(kTestDataPath + name, getInfoPlistKeys(), values);
+  return values;
 }
 
 class AppsTests : public testing::Test {};
@@ -68,7 +65,6 @@ TEST_F(AppsTests, get_path_from_info_plist_path) {
 }
 
 TEST_F(AppsTests, test_parse_info_plist) {
-  auto tree = getInfoPlistTree();
   Row expected = {
       {"name", "Foobar.app"},
       {"path", "/Applications/Foobar.app"},
@@ -87,9 +83,14 @@ TEST_F(AppsTests, test_parse_info_plist) {
       {"applescript_enabled", ""},
       {"copyright", ""},
   };
-  EXPECT_EQ(
-      parseInfoPlist("/Applications/Foobar.app/Contents/Info.plist", tree),
-      expected);
+  EXPECT_EQ(parseInfoPlist("/Applications/Foobar.app/Contents/Info.plist",
+                           getInfoPlistValues("test_info.plist")),
+            expected);
+
+  // The same keys are read from a binary plist through its offset table.
+  EXPECT_EQ(parseInfoPlist("/Applications/Foobar.app/Contents/Info.plist",
+                           getInfoPlistValues("test_info_binary.plist")),
+            expected);
 }
 }
 }
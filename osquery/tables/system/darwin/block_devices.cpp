@@ -8,6 +8,8 @@
  *
  */
 
+#include <set>
+
 #include <DiskArbitration/DASession.h>
 #include <DiskArbitration/DADisk.h>
 
@@ -16,6 +18,7 @@
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
+#include "osquery/events/darwin/diskarbitration.h"
 #include "osquery/tables/system/darwin/iokit_utils.h"
 
 namespace osquery {
@@ -23,89 +26,84 @@ namespace tables {
 
 #define kIOMediaClassName_ "IOMedia"
 
-void genIOMediaDevice(const io_service_t& device,
-                      std::vector<std::string>& whole_devices,
-                      QueryData& results) {
-  Row r;
-
-  // Get the device properties
-  CFMutableDictionaryRef properties;
-  IORegistryEntryCreateCFProperties(
-      device, &properties, kCFAllocatorDefault, kNilOptions);
-
-  r["uuid"] = getIOKitProperty(properties, "UUID");
-  r["name"] = "/dev/" + getIOKitProperty(properties, "BSD Name");
-  r["size"] = getIOKitProperty(properties, "Size");
-
-  auto type = getIOKitProperty(properties, "Whole");
-  if (type == "1") {
-    // The "Whole" property applies to the entire disk entry, not partitions.
-    whole_devices.push_back(r["name"]);
-  } else {
-    // Otherwise search the list of whole disks to find the node parent.
-    for (const auto& parent : whole_devices) {
-      if (r.at("name").find(parent) == 0) {
-        r["parent"] = parent;
-      }
-    }
+/// Describe every IOMedia device using a single Disk Arbitration session.
+static void genIOMediaDisks(std::vector<DiskDescription>& disks) {
+  auto matching = IOServiceMatching(kIOMediaClassName_);
+  if (matching == nullptr) {
+    // No devices matched IOMedia.
+    return;
   }
 
-  // This is the IOKit name, which is the device's label.
-  io_name_t name;
-  auto kr = IORegistryEntryGetName(device, name);
-  if (kr == KERN_SUCCESS && name != nullptr) {
-    r["label"] = std::string(name);
+  io_iterator_t it;
+  auto kr = IOServiceGetMatchingServices(kIOMasterPortDefault, matching, &it);
+  if (kr != KERN_SUCCESS) {
+    return;
   }
 
-  // Remaining details come from the Disk Arbitration service.
   DASessionRef session = DASessionCreate(kCFAllocatorDefault);
-  CFDictionaryRef details;
-  if (session != nullptr) {
-    auto disk = DADiskCreateFromIOMedia(kCFAllocatorDefault, session, device);
-    if (disk != nullptr) {
-      details = DADiskCopyDescription(disk);
-      if (details != nullptr) {
-        r["vendor"] =
-            getIOKitProperty((CFMutableDictionaryRef)details, "DADeviceVendor");
-        r["model"] =
-            getIOKitProperty((CFMutableDictionaryRef)details, "DADeviceModel");
-        r["type"] = getIOKitProperty((CFMutableDictionaryRef)details,
-                                     "DADeviceProtocol");
-        CFRelease(details);
+  io_service_t device;
+  while ((device = IOIteratorNext(it))) {
+    if (session != nullptr) {
+      auto disk = DADiskCreateFromIOMedia(kCFAllocatorDefault, session, device);
+      if (disk != nullptr) {
+        DiskDescription description;
+        if (DiskArbitrationEventPublisher::describeDisk(disk, description)) {
+          disks.push_back(description);
+        }
+        CFRelease(disk);
       }
-      CFRelease(disk);
     }
+    IOObjectRelease(device);
+  }
+
+  if (session != nullptr) {
     CFRelease(session);
   }
+  IOObjectRelease(it);
+}
+
+/// The whole disk of a partition, such as /dev/disk1 for /dev/disk1s2.
+static std::string getParentDisk(const std::string& name,
+                                 const std::set<std::string>& whole_devices) {
+  auto slice = name.rfind('s');
+  if (slice == std::string::npos || slice + 1 == name.size() ||
+      name.find_first_not_of("0123456789", slice + 1) != std::string::npos) {
+    return "";
+  }
 
-  results.push_back(r);
-  CFRelease(properties);
+  auto parent = name.substr(0, slice);
+  return (whole_devices.count(parent) > 0) ? parent : "";
 }
 
 QueryData genBlockDevs(QueryContext& context) {
-  QueryData results;
-
-  auto matching = IOServiceMatching(kIOMediaClassName_);
-  if (matching == nullptr) {
-    // No devices matched IOMedia.
-    return {};
+  // The running publisher keeps described disks in memory.
+  std::vector<DiskDescription> disks;
+  if (!DiskArbitrationEventPublisher::getDisks(disks)) {
+    genIOMediaDisks(disks);
   }
 
-  io_iterator_t it;
-  auto kr = IOServiceGetMatchingServices(kIOMasterPortDefault, matching, &it);
-  if (kr != KERN_SUCCESS) {
-    return {};
+  std::set<std::string> whole_devices;
+  for (const auto& disk : disks) {
+    if (disk.whole) {
+      whole_devices.insert(disk.name);
+    }
   }
 
-  std::vector<std::string> whole_devices;
-
-  io_service_t device;
-  while ((device = IOIteratorNext(it))) {
-    genIOMediaDevice(device, whole_devices, results);
-    IOObjectRelease(device);
+  QueryData results;
+  for (const auto& disk : disks) {
+    Row r;
+    r["name"] = disk.name;
+    r["uuid"] = disk.uuid;
+    r["size"] = disk.size;
+    r["label"] = disk.label;
+    r["vendor"] = disk.vendor;
+    r["model"] = disk.model;
+    r["type"] = disk.type;
+    if (!disk.whole) {
+      r["parent"] = getParentDisk(disk.name, whole_devices);
+    }
+    results.push_back(r);
   }
-
-  IOObjectRelease(it);
   return results;
 }
 }
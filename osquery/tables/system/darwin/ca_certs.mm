@@ -8,16 +8,58 @@
  *
  */
 
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
 #include <osquery/core.h>
 //#include <osquery/logger.h>
 #include <osquery/tables.h>
 
 #include "osquery/tables/system/darwin/ca_certs.h"
+#include "osquery/tables/system/user_groups.h"
 
 namespace osquery {
 namespace tables {
 
-bool genOSXAuthorities(CFArrayRef &reference) {
+/// A decoded keychain certificate, reused while it is in a keychain.
+struct CertificateEntry {
+  /// Only certificate authorities are rows.
+  bool authority;
+  Row row;
+
+  CertificateEntry() : authority(false) {}
+};
+
+/// Decoded certificates by DER data and the last rows with their keychains.
+struct CertificateCache {
+  std::map<std::string, CertificateEntry> certificates;
+  /// The identity of the keychain files when the rows were generated.
+  std::string keychains;
+  QueryData rows;
+};
+
+static CertificateCache kCertificateCache;
+static std::mutex kCertificateCacheMutex;
+
+/// The keychain files and directories searched for certificates.
+std::vector<std::string> getKeychainPaths() {
+  std::vector<std::string> paths = kSystemKeychainPaths;
+
+  // The user keychains are those of the user running the query.
+  UserEntry user;
+  if (getUserByUid(geteuid(), user).ok() && !user.directory.empty()) {
+    for (const auto& path : kUserKeychainPaths) {
+      paths.push_back(user.directory + path);
+    }
+  }
+  return paths;
+}
+
+bool genOSXCertificates(CFArrayRef &reference) {
   CFArrayRef keychain_certs;
   CFMutableDictionaryRef query;
   OSStatus status = errSecSuccess;
@@ -41,68 +83,91 @@ bool genOSXAuthorities(CFArrayRef &reference) {
     return false;
   }
 
-  // Limit certificates to authorities (kSecOIDBasicConstraints).
-  CFMutableArrayRef authorities;
-  SecCertificateRef cert;
+  reference = keychain_certs;
+  return true;
+}
 
-  // Store just the authority certificates.
-  authorities = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+/// Decode a certificate, limited to authorities (kSecOIDBasicConstraints).
+void genCertificateEntry(const SecCertificateRef &ca,
+                         CertificateEntry &entry) {
+  entry.authority = CertificateIsCA(ca);
+  if (!entry.authority) {
+    return;
+  }
 
-  // For each certificate returned from the search, get the constraints prop.
-  for (CFIndex i = 0; i < CFArrayGetCount(keychain_certs); i++) {
-    cert = (SecCertificateRef)CFArrayGetValueAtIndex(keychain_certs, i);
-    if (CertificateIsCA(cert)) {
-      CFArrayAppendValue(authorities, cert);
+  // Iterate through each selected certificate property.
+  for (const auto &property_iterator : kCertificateProperties) {
+    auto property =
+        CreatePropertyFromCertificate(ca, property_iterator.second.first);
+    if (property == NULL) {
+      continue;
     }
+    // Each property may be stored differently, apply a generator function.
+    entry.row[property_iterator.first] =
+        property_iterator.second.second(property);
+    CFRelease(property);
   }
 
-  reference = (CFArrayRef)authorities;
-  CFRelease(keychain_certs);
-  return (status == errSecSuccess);
+  entry.row["sha1"] = genSHA1ForCertificate(ca);
 }
 
 QueryData genCerts(QueryContext &context) {
+  // The rows are reused while no keychain file changed.
+  auto keychains = FileBackedCache::identify(getKeychainPaths());
+  {
+    std::lock_guard<std::mutex> lock(kCertificateCacheMutex);
+    if (!kCertificateCache.keychains.empty() &&
+        kCertificateCache.keychains == keychains) {
+      return kCertificateCache.rows;
+    }
+  }
+
   QueryData results;
-  CFArrayRef authorities = NULL;
+  CFArrayRef certificates = NULL;
   // Keychains/certificate stores belonging to the OS.
-  if (!genOSXAuthorities(authorities)) {
+  if (!genOSXCertificates(certificates)) {
     // LOG(ERROR) << "Could not find OSX Keychain Certificate Authorities.";
     return results;
   }
 
   // Must have returned an array of matching certificates.
-  if (CFGetTypeID(authorities) != CFArrayGetTypeID()) {
+  if (CFGetTypeID(certificates) != CFArrayGetTypeID()) {
     // LOG(ERROR) << "Unknown certificate authorities type.";
+    CFRelease(certificates);
     return results;
   }
 
-  // Evaluate the certificate data, check for CA in Basic constraints.
-  unsigned int certificate_count = 0;
-  SecCertificateRef ca = NULL;
-  CFDataRef property = NULL;
-
-  certificate_count = CFArrayGetCount((CFArrayRef)authorities);
+  // Only certificates that are new to the cache are decoded and hashed.
+  std::lock_guard<std::mutex> lock(kCertificateCacheMutex);
+  std::map<std::string, CertificateEntry> entries;
+  auto certificate_count = CFArrayGetCount(certificates);
   for (CFIndex i = 0; i < certificate_count; i++) {
-    Row r;
-    ca = (SecCertificateRef)CFArrayGetValueAtIndex(authorities, i);
-
-    // Iterate through each selected certificate property.
-    for (const auto &property_iterator : kCertificateProperties) {
-      property =
-          CreatePropertyFromCertificate(ca, property_iterator.second.first);
-      if (property == NULL) {
-        continue;
-      }
-      // Each property may be stored differently, apply a generator function.
-      r[property_iterator.first] = property_iterator.second.second(property);
-      CFRelease(property);
+    auto ca = (SecCertificateRef)CFArrayGetValueAtIndex(certificates, i);
+    auto data = SecCertificateCopyData(ca);
+    if (data == NULL) {
+      continue;
+    }
+    std::string der((const char *)CFDataGetBytePtr(data),
+                    CFDataGetLength(data));
+    CFRelease(data);
+
+    auto cached = kCertificateCache.certificates.find(der);
+    if (cached != kCertificateCache.certificates.end()) {
+      entries[der] = cached->second;
+    } else {
+      genCertificateEntry(ca, entries[der]);
     }
 
-    r["sha1"] = genSHA1ForCertificate(ca);
-    results.push_back(r);
+    if (entries[der].authority) {
+      results.push_back(entries[der].row);
+    }
   }
+  CFRelease(certificates);
 
-  CFRelease(authorities);
+  // Certificates removed from every keychain are dropped.
+  kCertificateCache.certificates = std::move(entries);
+  kCertificateCache.keychains = std::move(keychains);
+  kCertificateCache.rows = results;
   return results;
 }
 }
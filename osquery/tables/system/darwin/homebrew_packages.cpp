@@ -8,6 +8,11 @@
  *
  */
 
+#include <algorithm>
+#include <mutex>
+
+#include <sys/stat.h>
+
 #include <boost/algorithm/string/join.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
@@ -64,13 +69,77 @@ std::vector<std::string> getHomebrewVersionsFromInfoPlistPath(
   return results;
 }
 
+/// The versions listed from a formula directory at its modification time.
+struct HomebrewCacheEntry {
+  struct timespec mtime;
+  std::vector<std::string> versions;
+};
+
+/// The Cellar listing, refreshed when the Cellar or a formula changes.
+struct HomebrewCache {
+  struct timespec mtime;
+  std::vector<std::string> formulae;
+  std::map<std::string, HomebrewCacheEntry> entries;
+
+  HomebrewCache() {
+    mtime.tv_sec = 0;
+    mtime.tv_nsec = 0;
+  }
+};
+
+static HomebrewCache kHomebrewCache;
+static std::mutex kHomebrewCacheMutex;
+
+static inline bool sameTime(const struct timespec& left,
+                            const struct timespec& right) {
+  return (left.tv_sec == right.tv_sec && left.tv_nsec == right.tv_nsec);
+}
+
 QueryData genHomebrewPackages(QueryContext& context) {
   QueryData results;
 
-  for (const auto& path : getHomebrewAppInfoPlistPaths()) {
-    auto versions = getHomebrewVersionsFromInfoPlistPath(path);
+  std::lock_guard<std::mutex> lock(kHomebrewCacheMutex);
+  // Adding or removing a formula changes the Cellar's modification time.
+  struct stat info;
+  if (::stat(kHomebrewRoot.c_str(), &info) != 0) {
+    info.st_mtimespec.tv_sec = 0;
+    info.st_mtimespec.tv_nsec = 0;
+  }
+
+  if (info.st_mtimespec.tv_sec == 0 ||
+      !sameTime(info.st_mtimespec, kHomebrewCache.mtime)) {
+    kHomebrewCache.formulae = getHomebrewAppInfoPlistPaths();
+    kHomebrewCache.mtime = info.st_mtimespec;
+    std::sort(kHomebrewCache.formulae.begin(), kHomebrewCache.formulae.end());
+
+    // Forget the versions of removed formulae.
+    auto& entries = kHomebrewCache.entries;
+    for (auto it = entries.begin(); it != entries.end();) {
+      if (!std::binary_search(kHomebrewCache.formulae.begin(),
+                              kHomebrewCache.formulae.end(),
+                              it->first)) {
+        it = entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  for (const auto& path : kHomebrewCache.formulae) {
+    // Installing or removing a version changes the formula's directory.
+    auto& entry = kHomebrewCache.entries[path];
+    if (::stat(path.c_str(), &info) != 0) {
+      kHomebrewCache.entries.erase(path);
+      continue;
+    }
+
+    if (entry.versions.empty() || !sameTime(info.st_mtimespec, entry.mtime)) {
+      entry.versions = getHomebrewVersionsFromInfoPlistPath(path);
+      entry.mtime = info.st_mtimespec;
+    }
+
     auto name = getHomebrewNameFromInfoPlistPath(path);
-    for (const auto& version : versions) {
+    for (const auto& version : entry.versions) {
       // Support a many to one version to package name.
       Row r;
       r["name"] = name;
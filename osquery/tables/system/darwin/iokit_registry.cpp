@@ -8,6 +8,10 @@
  *
  */
 
+#include <cstdlib>
+#include <string>
+#include <vector>
+
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
@@ -23,12 +27,8 @@ void genIOKitDevice(const io_service_t& device,
                     QueryData& results) {
   Row r;
 
-  // Get the device details
-  CFMutableDictionaryRef details;
-  IORegistryEntryCreateCFProperties(
-      device, &details, kCFAllocatorDefault, kNilOptions);
-
-  io_name_t name, location, device_class;
+  // No column reads the property dictionary, it is not copied.
+  io_name_t name, device_class;
   auto kr = IORegistryEntryGetName(device, name);
   if (kr == KERN_SUCCESS) {
     r["name"] = std::string(name);
@@ -86,12 +86,45 @@ void genIOKitDevice(const io_service_t& device,
   r["retain_count"] = INTEGER(retain_count);
 
   results.push_back(r);
-  CFRelease(details);
 }
 
+/// The name, class, and parent column values of the rows made, if set.
+struct IOKitFilter {
+  std::string name;
+  std::string device_class;
+  /// The parent column's value, as genIOKitDevice formats it.
+  std::string parent;
+
+  bool matches(const io_registry_entry_t& entry,
+               const io_registry_entry_t& entry_parent) const {
+    io_name_t value;
+    if (!name.empty()) {
+      if (IORegistryEntryGetName(entry, value) != KERN_SUCCESS ||
+          name != value) {
+        return false;
+      }
+    }
+    if (!device_class.empty()) {
+      if (IOObjectGetClass(entry, value) != KERN_SUCCESS ||
+          device_class != value) {
+        return false;
+      }
+    }
+    if (!parent.empty()) {
+      uint64_t id;
+      auto kr = IORegistryEntryGetRegistryEntryID(entry_parent, &id);
+      if (parent != ((kr == KERN_SUCCESS) ? BIGINT(id) : "-1")) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
 void genIOKitDeviceChildren(const io_registry_entry_t& service,
                             const io_name_t plane,
                             int depth,
+                            const IOKitFilter& filter,
                             QueryData& results) {
   io_iterator_t it;
   auto kr = IORegistryEntryGetChildIterator(service, plane, &it);
@@ -101,15 +134,100 @@ void genIOKitDeviceChildren(const io_registry_entry_t& service,
 
   io_service_t device;
   while ((device = IOIteratorNext(it))) {
-    // Use this entry as the parent, and generate a result row.
-    genIOKitDevice(device, service, plane, depth, results);
-    genIOKitDeviceChildren(device, plane, depth + 1, results);
+    // Use this entry as the parent, and generate a result row if it matches.
+    if (filter.matches(device, service)) {
+      genIOKitDevice(device, service, plane, depth, results);
+    }
+    genIOKitDeviceChildren(device, plane, depth + 1, filter, results);
     IOObjectRelease(device);
   }
 
   IOObjectRelease(it);
 }
 
+/**
+ * @brief Collect the depth of an entry along every path to the plane's root.
+ *
+ * The full walk lists an entry once below each of its parents, so an entry
+ * has one depth for each path from the root. The root's children are at
+ * depth 0, the root itself is at -1. Entries not attached to the root have
+ * no depth.
+ */
+void genIOKitEntryDepths(const io_registry_entry_t& entry,
+                         const io_registry_entry_t& root,
+                         const io_name_t plane,
+                         int steps,
+                         std::vector<int>& depths) {
+  if (IOObjectIsEqualTo(entry, root)) {
+    depths.push_back(steps - 1);
+    return;
+  }
+
+  io_iterator_t it;
+  auto kr = IORegistryEntryGetParentIterator(entry, plane, &it);
+  if (kr != KERN_SUCCESS) {
+    return;
+  }
+
+  io_registry_entry_t parent;
+  while ((parent = IOIteratorNext(it))) {
+    genIOKitEntryDepths(parent, root, plane, steps + 1, depths);
+    IOObjectRelease(parent);
+  }
+  IOObjectRelease(it);
+}
+
+/**
+ * @brief Make the rows of a constrained parent's children.
+ *
+ * The children are listed at every depth the parent has in the full walk.
+ * Returns false if no entry has the registry ID, the entry is unregistered
+ * or not attached to the root, and only the full walk can list its children.
+ */
+bool genIOKitParentChildren(const io_registry_entry_t& root,
+                            uint64_t parent_id,
+                            const IOKitFilter& filter,
+                            QueryData& results) {
+  uint64_t root_id;
+  io_registry_entry_t parent;
+  if (IORegistryEntryGetRegistryEntryID(root, &root_id) == KERN_SUCCESS &&
+      root_id == parent_id) {
+    // The root is not a service that can be matched.
+    IOObjectRetain(root);
+    parent = root;
+  } else {
+    parent = IOServiceGetMatchingService(
+        kIOMasterPortDefault, IORegistryEntryIDMatching(parent_id));
+  }
+  if (parent == 0) {
+    return false;
+  }
+
+  std::vector<int> depths;
+  genIOKitEntryDepths(parent, root, kIOServicePlane, 0, depths);
+  io_iterator_t it;
+  if (depths.empty() ||
+      IORegistryEntryGetChildIterator(parent, kIOServicePlane, &it) !=
+          KERN_SUCCESS) {
+    IOObjectRelease(parent);
+    return false;
+  }
+
+  io_registry_entry_t device;
+  while ((device = IOIteratorNext(it))) {
+    if (filter.matches(device, parent)) {
+      for (const auto& depth : depths) {
+        genIOKitDevice(device, parent, kIOServicePlane, depth + 1, results);
+      }
+    }
+    IOObjectRelease(device);
+  }
+
+  IOObjectRelease(it);
+  IOObjectRelease(parent);
+  return true;
+}
+
 QueryData genIOKitDeviceTree(QueryContext& context) {
   QueryData results;
 
@@ -117,7 +235,8 @@ QueryData genIOKitDeviceTree(QueryContext& context) {
   auto service = IORegistryGetRootEntry(kIOMasterPortDefault);
 
   // Begin recursing along the IODeviceTree "plane".
-  genIOKitDeviceChildren(service, kIODeviceTreePlane, 0, results);
+  genIOKitDeviceChildren(
+      service, kIODeviceTreePlane, 0, IOKitFilter(), results);
 
   IOObjectRelease(service);
   return results;
@@ -126,11 +245,39 @@ QueryData genIOKitDeviceTree(QueryContext& context) {
 QueryData genIOKitRegistry(QueryContext& context) {
   QueryData results;
 
+  // A single constrained parent is read directly. Otherwise every entry is
+  // walked, as an entry may be listed below several parents, but only the
+  // rows of a single constrained name or class are made.
+  IOKitFilter filter;
+  auto names = context.constraints["name"].getAll(EQUALS);
+  auto classes = context.constraints["class"].getAll(EQUALS);
+  auto parents = context.constraints["parent"].getAll(EQUALS);
+  if (names.size() == 1) {
+    filter.name = names[0];
+  }
+  if (classes.size() == 1) {
+    filter.device_class = classes[0];
+  }
+  if (parents.size() == 1 &&
+      (parents[0] == "-1" ||
+       parents[0] ==
+           BIGINT(std::strtoull(parents[0].c_str(), nullptr, 10)))) {
+    // Other spellings of the ID are left for SQLite to compare.
+    filter.parent = parents[0];
+  }
+
   // Get the IO registry root node.
   auto service = IORegistryGetRootEntry(kIOMasterPortDefault);
 
-  // Begin recursing along the IODeviceTree "plane".
-  genIOKitDeviceChildren(service, kIOServicePlane, 0, results);
+  if (filter.parent.empty() || filter.parent == "-1" ||
+      !genIOKitParentChildren(
+          service,
+          std::strtoull(filter.parent.c_str(), nullptr, 10),
+          filter,
+          results)) {
+    // Begin recursing along the IOService "plane".
+    genIOKitDeviceChildren(service, kIOServicePlane, 0, filter, results);
+  }
 
   IOObjectRelease(service);
   return results;
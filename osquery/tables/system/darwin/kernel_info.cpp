@@ -12,7 +12,7 @@
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
 
-#include <osquery/hash.h>
+#include <osquery/database/hash_cache.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
@@ -141,7 +141,7 @@ QueryData genKernelInfo(QueryContext& context) {
   // With the path and device, try to locate the on-disk kernel
   if (r.count("path") > 0) {
     // This does not use the device path, potential invalidation.
-    r["md5"] = hashFromFile(HASH_TYPE_MD5, "/" + r["path"]);
+    r["md5"] = hashMultiFromFileCached(HASH_TYPE_MD5, "/" + r["path"]).md5;
   }
 
   results.push_back(r);
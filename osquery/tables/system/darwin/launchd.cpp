@@ -8,7 +8,11 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/replace.hpp>
@@ -128,22 +132,95 @@ Row parseLaunchdItem(const std::string& path, const pt::ptree& tree) {
   return r;
 }
 
+/// The most threads parsing launchd plists for a query.
+const size_t kLaunchdParseWorkers = 4;
+
+/// Parsed launchd items by path, with the identity of the parsed file.
+static std::map<std::string, std::pair<std::string, Row> > kLaunchdCache;
+static std::mutex kLaunchdCacheMutex;
+
+/**
+ * @brief Parse launchd plists on a bounded number of threads.
+ *
+ * @param paths the plists to parse.
+ * @param items set to the row of each path and whether it was parsed.
+ */
+void parseLaunchdItems(const std::vector<std::string>& paths,
+                       std::vector<std::pair<bool, Row> >& items) {
+  items.resize(paths.size());
+  std::atomic<size_t> next{0};
+  auto parse = [&paths, &items, &next]() {
+    size_t i = 0;
+    while ((i = next++) < paths.size()) {
+      pt::ptree tree;
+      auto status = osquery::parsePlist(paths[i], tree);
+      if (status.ok()) {
+        items[i] = std::make_pair(true, parseLaunchdItem(paths[i], tree));
+      } else {
+        VLOG(1) << "Error parsing " << paths[i] << ": " << status.toString();
+      }
+    }
+  };
+
+  // The calling thread parses as well, a few plists do not need a thread.
+  std::vector<std::thread> workers;
+  auto count = std::min(kLaunchdParseWorkers, paths.size() / 16);
+  for (size_t i = 1; i < count; ++i) {
+    workers.push_back(std::thread(parse));
+  }
+  parse();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
 QueryData genLaunchd(QueryContext& context) {
   QueryData results;
 
+  // Rows of unchanged plists are reused, the rest are parsed.
+  std::vector<std::string> paths;
+  std::vector<std::string> identities;
+  std::vector<std::pair<bool, Row> > items;
+  std::vector<std::string> changed;
   auto launchd_files = getLaunchdFiles();
-  for (const auto& path : launchd_files) {
-    if (!context.constraints["path"].matches(path)) {
-      // Optimize by not searching when a path is a constraint.
-      continue;
+  {
+    std::lock_guard<std::mutex> lock(kLaunchdCacheMutex);
+    for (const auto& path : launchd_files) {
+      if (!context.constraints["path"].matches(path)) {
+        // Optimize by not searching when a path is a constraint.
+        continue;
+      }
+
+      auto identity = FileBackedCache::identify({path});
+      auto cached = kLaunchdCache.find(path);
+      if (cached != kLaunchdCache.end() && cached->second.first == identity) {
+        items.push_back(std::make_pair(true, cached->second.second));
+      } else {
+        items.push_back(std::make_pair(false, Row()));
+        changed.push_back(path);
+      }
+      paths.push_back(path);
+      identities.push_back(std::move(identity));
     }
+  }
 
-    pt::ptree tree;
-    auto status = osquery::parsePlist(path, tree);
-    if (status.ok()) {
-      results.push_back(parseLaunchdItem(path, tree));
-    } else {
-      VLOG(1) << "Error parsing " << path << ": " << status.toString();
+  std::vector<std::pair<bool, Row> > parsed;
+  parseLaunchdItems(changed, parsed);
+
+  std::lock_guard<std::mutex> lock(kLaunchdCacheMutex);
+  if (!context.constraints["path"].exists()) {
+    // Items that were removed are dropped from the cache.
+    kLaunchdCache.clear();
+  }
+
+  size_t next_parsed = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!items[i].first) {
+      items[i] = std::move(parsed[next_parsed++]);
+    }
+    if (items[i].first) {
+      kLaunchdCache[paths[i]] = std::make_pair(identities[i], items[i].second);
+      results.push_back(std::move(items[i].second));
     }
   }
   return results;
@@ -8,7 +8,11 @@
  *
  */
 
+#include <map>
+#include <mutex>
+#include <memory>
 #include <set>
+#include <vector>
 
 // Keep sys/socket first.
 #include <sys/socket.h>
@@ -19,6 +23,8 @@
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
+#include "osquery/tables/system/darwin/processes.h"
+
 namespace osquery {
 namespace tables {
 
@@ -32,8 +38,23 @@ enum descriptor_type {
   DESCRIPTORS_TYPE_VNODE,
 };
 
-// From processes.cpp
-std::set<int> getProcList();
+/// The descriptors of a process, as listed by PROC_PIDLISTFDS.
+typedef std::vector<struct proc_fdinfo> ProcessDescriptors;
+
+/// The times a descriptor list is grown when it fills its buffer.
+const size_t kDescriptorListRetries = 4;
+
+/**
+ * @brief The descriptor tables a query listed, by pid.
+ *
+ * process_open_files and process_open_sockets read the same tables, and a
+ * join of the two scans the inner table once for each row of the outer. The
+ * tables are kept in the QueryScope, so they are reused only by one query.
+ */
+struct DescriptorTables {
+  std::map<int, ProcessDescriptors> fds;
+  std::mutex mutex;
+};
 
 std::string socketIpAsString(const struct in_sockinfo *in,
                              int type,
@@ -77,20 +98,36 @@ void parseNetworkSocket(const struct socket_fdinfo socket_info, Row &r) {
   r["remote_port"] = INTEGER(ntohs(in->insi_fport));
 }
 
-void genFileDescriptor(int pid, int descriptor, QueryData &results) {
-  struct vnode_fdinfowithpath vi;
-  if (proc_pidfdinfo(pid,
-                     descriptor,
-                     PROC_PIDFDVNODEPATHINFO,
-                     &vi,
-                     PROC_PIDFDVNODEPATHINFO_SIZE) <= 0) {
-    return;
+void genFileDescriptor(int pid,
+                       int descriptor,
+                       bool paths,
+                       QueryData &results) {
+  // Both flavors fail for the same descriptors, the path is found after the
+  // vnode information. Without the path column it is not looked up.
+  Row r;
+  if (paths) {
+    struct vnode_fdinfowithpath vi;
+    if (proc_pidfdinfo(pid,
+                       descriptor,
+                       PROC_PIDFDVNODEPATHINFO,
+                       &vi,
+                       PROC_PIDFDVNODEPATHINFO_SIZE) <= 0) {
+      return;
+    }
+    r["path"] = std::string(vi.pvip.vip_path);
+  } else {
+    struct vnode_fdinfo vi;
+    if (proc_pidfdinfo(pid,
+                       descriptor,
+                       PROC_PIDFDVNODEINFO,
+                       &vi,
+                       PROC_PIDFDVNODEINFO_SIZE) <= 0) {
+      return;
+    }
   }
 
-  Row r;
   r["pid"] = INTEGER(pid);
   r["fd"] = INTEGER(descriptor);
-  r["path"] = std::string(vi.pvip.vip_path);
   results.push_back(r);
 }
 
@@ -129,21 +166,67 @@ void genSocketDescriptor(int pid, int descriptor, QueryData &results) {
   }
 }
 
-void genOpenDescriptors(int pid, descriptor_type type, QueryData &results) {
-  // std::vector<OpenFile> open_files;
-  int bufsize = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, 0, 0);
-  if (bufsize == -1) {
+/// List a process's descriptors, growing the buffer if the list fills it.
+static bool listDescriptors(int pid, ProcessDescriptors& fds) {
+  // The size of the table may change between the calls.
+  int bufsize = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, nullptr, 0);
+  for (size_t i = 0; bufsize > 0 && i < kDescriptorListRetries; ++i) {
+    fds.resize(bufsize / PROC_PIDLISTFD_SIZE + 1);
+    int size = fds.size() * PROC_PIDLISTFD_SIZE;
+    int bytes = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, fds.data(), size);
+    if (bytes <= 0) {
+      return false;
+    } else if (bytes < size) {
+      fds.resize(bytes / PROC_PIDLISTFD_SIZE);
+      return true;
+    }
+    bufsize = size * 2;
+  }
+
+  VLOG(1) << "Could not list every descriptor for pid: " << pid;
+  return !fds.empty();
+}
+
+/// The descriptors of a process, listed once by the tables of a query.
+static bool getDescriptors(QueryContext& context,
+                           int pid,
+                           ProcessDescriptors& fds) {
+  std::shared_ptr<DescriptorTables> tables;
+  if (context.scope != nullptr) {
+    tables = context.scope->get<DescriptorTables>("process_descriptors");
+    std::lock_guard<std::mutex> lock(tables->mutex);
+    auto table = tables->fds.find(pid);
+    if (table != tables->fds.end()) {
+      fds = table->second;
+      return true;
+    }
+  }
+
+  if (!listDescriptors(pid, fds)) {
     VLOG(1) << "Could not list descriptors for pid: " << pid;
-    return;
+    return false;
   }
+  if (tables != nullptr) {
+    std::lock_guard<std::mutex> lock(tables->mutex);
+    tables->fds[pid] = fds;
+  }
+  return true;
+}
 
-  // Allocate structs for each descriptor.
-  proc_fdinfo fds[bufsize / PROC_PIDLISTFD_SIZE];
+void genOpenDescriptors(QueryContext& context,
+                        int pid,
+                        descriptor_type type,
+                        bool paths,
+                        QueryData& results) {
+  ProcessDescriptors fds;
+  if (!getDescriptors(context, pid, fds)) {
+    return;
+  }
 
-  for (auto fd_info : fds) {
+  for (const auto& fd_info : fds) {
     if (type == DESCRIPTORS_TYPE_VNODE &&
         fd_info.proc_fdtype == PROX_FDTYPE_VNODE) {
-      genFileDescriptor(pid, fd_info.proc_fd, results);
+      genFileDescriptor(pid, fd_info.proc_fd, paths, results);
     } else if (type == DESCRIPTORS_TYPE_SOCKET &&
                fd_info.proc_fdtype == PROX_FDTYPE_SOCKET) {
       genSocketDescriptor(pid, fd_info.proc_fd, results);
@@ -153,15 +236,9 @@ void genOpenDescriptors(int pid, descriptor_type type, QueryData &results) {
 
 QueryData genOpenSockets(QueryContext &context) {
   QueryData results;
-  auto pidlist = getProcList();
-
-  for (auto &pid : pidlist) {
-    if (!context.constraints["pid"].matches(pid)) {
-      // Optimize by not searching when a pid is a constraint.
-      continue;
-    }
-
-    genOpenDescriptors(pid, DESCRIPTORS_TYPE_SOCKET, results);
+  for (const auto& process : genProcessSnapshot(context)) {
+    genOpenDescriptors(
+        context, process.pid, DESCRIPTORS_TYPE_SOCKET, true, results);
   }
 
   return results;
@@ -169,15 +246,10 @@ QueryData genOpenSockets(QueryContext &context) {
 
 QueryData genOpenFiles(QueryContext &context) {
   QueryData results;
-  auto pidlist = getProcList();
-
-  for (auto &pid : pidlist) {
-    if (!context.constraints["pid"].matches(pid)) {
-      // Optimize by not searching when a pid is a constraint.
-      continue;
-    }
-
-    genOpenDescriptors(pid, DESCRIPTORS_TYPE_VNODE, results);
+  auto paths = context.isColumnUsed("path");
+  for (const auto& process : genProcessSnapshot(context)) {
+    genOpenDescriptors(
+        context, process.pid, DESCRIPTORS_TYPE_VNODE, paths, results);
   }
 
   return results;
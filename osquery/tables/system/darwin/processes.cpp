@@ -8,7 +8,11 @@
  *
  */
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <map>
+#include <memory>
 #include <set>
 
 #include <libproc.h>
@@ -22,6 +26,8 @@
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
+#include "osquery/tables/system/darwin/processes.h"
+
 namespace osquery {
 namespace tables {
 
@@ -35,12 +41,13 @@ std::set<int> getProcList() {
 
   // arbitrarily create a list with 2x capacity in case more processes have
   // been loaded since the last proc_listpids was executed
-  pid_t pids[2 * bufsize / sizeof(pid_t)];
+  std::vector<pid_t> pids(2 * bufsize / sizeof(pid_t));
 
   // now that we've allocated "pids", let's overwrite num_pids with the actual
   // amount of data that was returned for proc_listpids when we populate the
   // pids data structure
-  bufsize = proc_listpids(PROC_ALL_PIDS, 0, pids, sizeof(pids));
+  bufsize = proc_listpids(
+      PROC_ALL_PIDS, 0, pids.data(), pids.size() * sizeof(pid_t));
   if (bufsize <= 0) {
     LOG(ERROR) << "An error occurred retrieving the process list";
     return pidlist;
@@ -59,30 +66,78 @@ std::set<int> getProcList() {
   return pidlist;
 }
 
-std::map<int, int> getParentMap(std::set<int> &pidlist) {
-  std::map<int, int> pidmap;
-  auto num_pids = pidlist.size();
-  pid_t children[num_pids];
+/// A fixed size, possibly unterminated, process name field.
+static std::string getProcField(const char* field, size_t size) {
+  return std::string(field, strnlen(field, size));
+}
 
-  // Find children for each pid, and mark that pid as their parent
-  for (auto &pid : pidlist) {
-    int num_children = proc_listchildpids(pid, children, sizeof(children));
-    for (int i = 0; i < num_children; ++i) {
-      pidmap[children[i]] = pid;
+/// Fill an entry with a process's BSD information, false if it exited.
+static bool getProcEntry(int pid, ProcessEntry& entry) {
+  entry.pid = pid;
+
+  struct proc_bsdinfo info;
+  if (proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &info, sizeof(info)) ==
+      sizeof(info)) {
+    entry.parent = info.pbi_ppid;
+    entry.uid = info.pbi_ruid;
+    entry.gid = info.pbi_rgid;
+    entry.euid = info.pbi_uid;
+    entry.egid = info.pbi_gid;
+    entry.name = getProcField(info.pbi_name, sizeof(info.pbi_name));
+    if (entry.name.empty()) {
+      entry.name = getProcField(info.pbi_comm, sizeof(info.pbi_comm));
     }
+    return true;
   }
 
-  return pidmap;
+  // The full information is restricted to processes of the same user, the
+  // short information is available for every process.
+  struct proc_bsdshortinfo short_info;
+  if (proc_pidinfo(pid,
+                   PROC_PIDT_SHORTBSDINFO,
+                   0,
+                   &short_info,
+                   sizeof(short_info)) == sizeof(short_info)) {
+    entry.parent = short_info.pbsi_ppid;
+    entry.uid = short_info.pbsi_ruid;
+    entry.gid = short_info.pbsi_rgid;
+    entry.euid = short_info.pbsi_uid;
+    entry.egid = short_info.pbsi_gid;
+    entry.name =
+        getProcField(short_info.pbsi_comm, sizeof(short_info.pbsi_comm));
+    return true;
+  }
+  return false;
 }
 
-std::string getProcName(int pid) {
-  char name[1024] = "\0";
-  int bufsize = proc_name(pid, name, sizeof(name));
-  if (bufsize <= 0) {
-    name[0] = '\0';
+std::vector<ProcessEntry> genProcessSnapshot(QueryContext& context) {
+  std::set<int> pidlist;
+  auto pids = context.constraints["pid"].getAll(EQUALS);
+  if (!pids.empty()) {
+    // Only the constrained pids are read.
+    for (const auto& expr : pids) {
+      char* end = nullptr;
+      auto pid = std::strtol(expr.c_str(), &end, 10);
+      if (!expr.empty() && *end == 0 && pid > 0) {
+        pidlist.insert(pid);
+      }
+    }
+  } else {
+    pidlist = getProcList();
   }
 
-  return std::string(name);
+  std::vector<ProcessEntry> processes;
+  for (const auto& pid : pidlist) {
+    if (!context.constraints["pid"].matches<int>(pid)) {
+      continue;
+    }
+
+    ProcessEntry entry;
+    if (getProcEntry(pid, entry)) {
+      processes.push_back(std::move(entry));
+    }
+  }
+  return processes;
 }
 
 std::string getProcPath(int pid) {
@@ -95,27 +150,6 @@ std::string getProcPath(int pid) {
   return std::string(path);
 }
 
-struct proc_cred {
-  struct {
-    uid_t uid;
-    gid_t gid;
-  } real, effective;
-};
-
-bool getProcCred(int pid, proc_cred &cred) {
-  struct proc_bsdshortinfo bsdinfo;
-
-  if (proc_pidinfo(pid, PROC_PIDT_SHORTBSDINFO, 0, &bsdinfo, sizeof bsdinfo) !=
-      -1) {
-    cred.real.uid = bsdinfo.pbsi_ruid;
-    cred.real.gid = bsdinfo.pbsi_ruid;
-    cred.effective.uid = bsdinfo.pbsi_uid;
-    cred.effective.gid = bsdinfo.pbsi_gid;
-    return true;
-  }
-  return false;
-}
-
 // Get the max args space
 int genMaxArgs() {
   int mib[2] = {CTL_KERN, KERN_ARGMAX};
@@ -130,15 +164,15 @@ int genMaxArgs() {
   return argmax;
 }
 
-std::vector<std::string> getProcRawArgs(int pid, size_t argmax) {
+ProcessArgsReader::ProcessArgsReader() : buffer_(genMaxArgs()) {}
+
+std::vector<std::string> ProcessArgsReader::getRawArgs(int pid) {
   std::vector<std::string> args;
   uid_t euid = geteuid();
 
-  char procargs[argmax];
-  const char *cp = procargs;
+  size_t argmax = buffer_.size();
   int mib[3] = {CTL_KERN, KERN_PROCARGS2, pid};
-
-  if (sysctl(mib, 3, &procargs, &argmax, NULL, 0) == -1) {
+  if (argmax == 0 || sysctl(mib, 3, buffer_.data(), &argmax, NULL, 0) == -1) {
     if (euid == 0) {
       VLOG(1) << "An error occurred retrieving the env for " << pid;
     }
@@ -148,19 +182,21 @@ std::vector<std::string> getProcRawArgs(int pid, size_t argmax) {
 
   // Here we make the assertion that we are interested in all non-empty strings
   // in the proc args+env
-  do {
-    std::string s = std::string(cp);
-    if (s.length() > 0) {
-      args.push_back(s);
+  const char* cp = buffer_.data();
+  const char* end = buffer_.data() + argmax;
+  while (cp < end) {
+    auto size = strnlen(cp, end - cp);
+    if (size > 0) {
+      args.push_back(std::string(cp, size));
     }
-    cp += args.back().size() + 1;
-  } while (cp < procargs + argmax);
+    cp += size + 1;
+  }
   return args;
 }
 
-std::map<std::string, std::string> getProcEnv(int pid, size_t argmax) {
+std::map<std::string, std::string> ProcessArgsReader::getEnv(int pid) {
   std::map<std::string, std::string> env;
-  auto args = getProcRawArgs(pid, argmax);
+  auto args = getRawArgs(pid);
 
   // Since we know that all envs will have an = sign and are at the end of the
   // list, we iterate from the end forward until we stop seeing = signs.
@@ -180,8 +216,8 @@ std::map<std::string, std::string> getProcEnv(int pid, size_t argmax) {
   return env;
 }
 
-std::vector<std::string> getProcArgs(int pid, size_t argmax) {
-  auto raw_args = getProcRawArgs(pid, argmax);
+std::string ProcessArgsReader::getCmdline(int pid) {
+  auto raw_args = getRawArgs(pid);
   std::vector<std::string> args;
   bool collect = false;
 
@@ -205,61 +241,74 @@ std::vector<std::string> getProcArgs(int pid, size_t argmax) {
   // We pushed them on backwards, so we need to fix that.
   std::reverse(args.begin(), args.end());
 
-  return args;
+  std::string cmdline = boost::algorithm::join(args, " ");
+  boost::algorithm::trim(cmdline);
+  return cmdline;
 }
 
 QueryData genProcesses(QueryContext &context) {
   QueryData results;
-  auto pidlist = getProcList();
-  auto parent_pid = getParentMap(pidlist);
-  int argmax = genMaxArgs();
 
-  for (auto &pid : pidlist) {
-    if (!context.constraints["pid"].matches<int>(pid)) {
-      // Optimize by not searching when a pid is a constraint.
-      continue;
+  // Each column that needs another call per pid is only read if it is used.
+  bool path_used =
+      context.isColumnUsed("path") || context.isColumnUsed("on_disk");
+  bool rusage_used = context.isColumnUsed("wired_size") ||
+                     context.isColumnUsed("resident_size") ||
+                     context.isColumnUsed("phys_footprint") ||
+                     context.isColumnUsed("user_time") ||
+                     context.isColumnUsed("system_time") ||
+                     context.isColumnUsed("start_time");
+  std::unique_ptr<ProcessArgsReader> args;
+  if (context.isColumnUsed("cmdline")) {
+    args.reset(new ProcessArgsReader());
+  }
+
+  for (const auto& process : genProcessSnapshot(context)) {
+    if (context.limitReached(results.size())) {
+      // Processes are generated in pid order, stop at the query's limit.
+      break;
     }
 
+    auto pid = process.pid;
     Row r;
     r["pid"] = INTEGER(pid);
-    r["name"] = getProcName(pid);
-    r["path"] = getProcPath(pid);
+    r["name"] = process.name;
+    if (path_used) {
+      r["path"] = getProcPath(pid);
+    }
     if (r["name"] == "") {
       // The name was not available, use the basename of the path.
-      r["name"] = boost::filesystem::path(r["path"]).filename().string();
+      auto path = path_used ? r["path"] : getProcPath(pid);
+      r["name"] = boost::filesystem::path(path).filename().string();
     }
 
     // The command line invocation including arguments.
-    std::string cmdline = boost::algorithm::join(getProcArgs(pid, argmax), " ");
-    boost::algorithm::trim(cmdline);
-    r["cmdline"] = cmdline;
-
-    proc_cred cred;
-    if (getProcCred(pid, cred)) {
-      r["uid"] = BIGINT(cred.real.uid);
-      r["gid"] = BIGINT(cred.real.gid);
-      r["euid"] = BIGINT(cred.effective.uid);
-      r["egid"] = BIGINT(cred.effective.gid);
+    if (args != nullptr) {
+      r["cmdline"] = args->getCmdline(pid);
     }
 
-    const auto parent_it = parent_pid.find(pid);
-    if (parent_it != parent_pid.end()) {
-      r["parent"] = INTEGER(parent_it->second);
-    } else {
-      r["parent"] = "-1";
-    }
+    r["uid"] = BIGINT(process.uid);
+    r["gid"] = BIGINT(process.gid);
+    r["euid"] = BIGINT(process.euid);
+    r["egid"] = BIGINT(process.egid);
+    r["parent"] = INTEGER(process.parent);
 
     // if the path of the executable that started the process is available and
     // the path exists on disk, set on_disk to 1.  if the path is not
     // available, set on_disk to -1.  if, and only if, the path of the
     // executable is available and the file does not exist on disk, set on_disk
     // to 0.
-    r["on_disk"] = osquery::pathExists(r["path"]).toString();
+    if (context.isColumnUsed("on_disk")) {
+      r["on_disk"] = osquery::pathExists(r["path"]).toString();
+    }
 
     // systems usage and time information
     struct rusage_info_v2 rusage_info_data;
-    int rusage_status = proc_pid_rusage(
-        pid, RUSAGE_INFO_V2, (rusage_info_t *)&rusage_info_data);
+    int rusage_status = -1;
+    if (rusage_used) {
+      rusage_status = proc_pid_rusage(
+          pid, RUSAGE_INFO_V2, (rusage_info_t *)&rusage_info_data);
+    }
     // proc_pid_rusage returns -1 if it was unable to gather information
     if (rusage_status == 0) {
       // size information
@@ -282,22 +331,24 @@ QueryData genProcesses(QueryContext &context) {
 
 QueryData genProcessEnvs(QueryContext &context) {
   QueryData results;
-  auto pidlist = getProcList();
-  int argmax = genMaxArgs();
+  ProcessArgsReader args;
 
-  for (auto &pid : pidlist) {
-    if (!context.constraints["pid"].matches<int>(pid)) {
-      // Optimize by not searching when a pid is a constraint.
+  for (const auto& process : genProcessSnapshot(context)) {
+    auto env = args.getEnv(process.pid);
+    if (env.empty()) {
       continue;
     }
 
-    auto env = getProcEnv(pid, argmax);
+    std::string path;
+    if (context.isColumnUsed("path")) {
+      path = getProcPath(process.pid);
+    }
     for (auto env_itr = env.begin(); env_itr != env.end(); ++env_itr) {
       Row r;
 
-      r["pid"] = INTEGER(pid);
-      r["name"] = getProcName(pid);
-      r["path"] = getProcPath(pid);
+      r["pid"] = INTEGER(process.pid);
+      r["name"] = process.name;
+      r["path"] = path;
       r["key"] = env_itr->first;
       r["value"] = env_itr->second;
 
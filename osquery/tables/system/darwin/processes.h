@@ -0,0 +1,75 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <osquery/tables.h>
+
+namespace osquery {
+namespace tables {
+
+/// The BSD information of a process, read with a single proc_pidinfo call.
+struct ProcessEntry {
+  pid_t pid;
+  pid_t parent;
+  uid_t uid;
+  gid_t gid;
+  uid_t euid;
+  gid_t egid;
+  /// The process name, as proc_name would return it.
+  std::string name;
+
+  ProcessEntry() : pid(0), parent(-1), uid(0), gid(0), euid(0), egid(0) {}
+};
+
+/**
+ * @brief The processes matching a query's pid constraints, in pid order.
+ *
+ * The name, parent and credentials of each process come from one
+ * PROC_PIDTBSDINFO call, instead of proc_name and proc_listchildpids for
+ * each pid. If the query has pid equality constraints only those pids are
+ * read, otherwise every pid from proc_listpids.
+ */
+std::vector<ProcessEntry> genProcessSnapshot(QueryContext& context);
+
+/// The path of a process's executable, or an empty string.
+std::string getProcPath(int pid);
+
+/**
+ * @brief Reads the arguments and environment of processes.
+ *
+ * The KERN_PROCARGS2 buffer, of the kernel's maximum argument size, is
+ * allocated once and reused for each process.
+ */
+class ProcessArgsReader {
+ public:
+  ProcessArgsReader();
+
+  /// The command line invocation of a process, including arguments.
+  std::string getCmdline(int pid);
+
+  /// The environment variables of a process.
+  std::map<std::string, std::string> getEnv(int pid);
+
+ private:
+  /// The non-empty strings of a process's arguments and environment.
+  std::vector<std::string> getRawArgs(int pid);
+
+ private:
+  std::vector<char> buffer_;
+};
+}
+}
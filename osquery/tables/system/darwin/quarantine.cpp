@@ -9,6 +9,8 @@
  */
 
 #include <ctime>
+#include <string>
+#include <vector>
 
 #include <pwd.h>
 #include <grp.h>
@@ -28,25 +30,32 @@ namespace tables {
 
 const std::string kXattrQuarantine = "com.apple.quarantine";
 
-Status genQuarantineFile(const fs::path &path, QueryData &results) {
-  int bufferLength =
-      getxattr(path.string().c_str(), kXattrQuarantine.c_str(), NULL, 0, 0, 0);
-  if (bufferLength <= 0) {
+/// Quarantine attributes are short strings, larger values are not read.
+const size_t kXattrQuarantineSize = 1024;
+
+Status genQuarantineFile(const fs::path &path,
+                         std::vector<char> &buffer,
+                         QueryData &results) {
+  // A single call reads the attribute, files without it fail with ENOATTR.
+  buffer.resize(kXattrQuarantineSize);
+  auto length = getxattr(path.string().c_str(),
+                         kXattrQuarantine.c_str(),
+                         buffer.data(),
+                         buffer.size(),
+                         0,
+                         0);
+  if (length <= 0) {
     return Status(1, "Failed to getxattr.");
   }
 
-  char *value = (char *)malloc(sizeof(char) * bufferLength);
-  getxattr(path.string().c_str(),
-           kXattrQuarantine.c_str(),
-           value,
-           bufferLength,
-           0,
-           0);
-
+  // The value is "flags;time;creator;identifier", without a terminator.
   std::vector<std::string> values;
+  std::string value(buffer.data(), length);
   boost::split(values, value, boost::is_any_of(";"));
+  if (values.size() < 3) {
+    return Status(1, "Invalid quarantine attribute");
+  }
   boost::trim(values[2]);
-  free(value);
 
   Row r;
   r["path"] = path.string();
@@ -58,6 +67,16 @@ Status genQuarantineFile(const fs::path &path, QueryData &results) {
 
 QueryData genQuarantine(QueryContext &context) {
   QueryData results;
+  std::vector<char> buffer;
+
+  // Only the paths of equality constraints are read.
+  auto paths = context.constraints["path"].getAll(EQUALS);
+  if (!paths.empty()) {
+    for (const auto &path : paths) {
+      genQuarantineFile(path, buffer, results);
+    }
+    return results;
+  }
 
   auto it = fs::recursive_directory_iterator(fs::path("/"));
   fs::recursive_directory_iterator end;
@@ -65,7 +84,7 @@ QueryData genQuarantine(QueryContext &context) {
   while (it != end) {
     fs::path path = *it;
 
-    genQuarantineFile(path, results);
+    genQuarantineFile(path, buffer, results);
 
     try {
       ++it;
@@ -1,7 +1,9 @@
 // Copyright 2004-present Facebook. All Rights Reserved.
 
+#include <cerrno>
 #include <string>
 #include <iomanip>
+#include <vector>
 
 #include <sys/xattr.h>
 
@@ -57,22 +59,40 @@ std::string handleError() {
   }
 }
 
-// Broken out into it's own function so we can use it to get attributes later
+/// The initial size of a reused attribute buffer, grown for larger values.
+const size_t kXAttrBufferSize = 4096;
+
+/**
+ * @brief Read an attribute into a buffer reused across files.
+ *
+ * The value is read with a single getxattr call unless it is larger than the
+ * buffer, then the buffer is grown to the attribute's size.
+ */
 struct XAttrAttribute getAttribute(const std::string& path,
-                                   const std::string attribute) {
+                                   const std::string& attribute,
+                                   std::vector<char>& buffer) {
   struct XAttrAttribute x_att;
-  x_att.buffer_length =
-      getxattr(path.c_str(), attribute.c_str(), NULL, 0, 0, 0);
-  char* buffer = (char*)malloc(x_att.buffer_length);
-  x_att.return_value = getxattr(path.c_str(), attribute.c_str(), buffer,
-                                x_att.buffer_length, 0, 0);
+  if (buffer.size() < kXAttrBufferSize) {
+    buffer.resize(kXAttrBufferSize);
+  }
+
+  x_att.return_value = getxattr(
+      path.c_str(), attribute.c_str(), buffer.data(), buffer.size(), 0, 0);
+  if (x_att.return_value == -1 && errno == ERANGE) {
+    auto size = getxattr(path.c_str(), attribute.c_str(), NULL, 0, 0, 0);
+    if (size > 0) {
+      buffer.resize(size);
+      x_att.return_value = getxattr(
+          path.c_str(), attribute.c_str(), buffer.data(), buffer.size(), 0, 0);
+    }
+  }
 
   if (x_att.return_value != -1) {
-    x_att.attribute_data = std::string(buffer, x_att.buffer_length);
+    x_att.buffer_length = x_att.return_value;
+    x_att.attribute_data = std::string(buffer.data(), x_att.buffer_length);
   } else {
-    x_att.attribute_data = std::string("");
+    x_att.buffer_length = 0;
   }
-  free(buffer);
   return x_att;
 }
 
@@ -148,18 +168,18 @@ void parseWhereFromData(Row& r, const struct XAttrAttribute x_att) {
 
 void getFileData(Row& r,
                  const std::string& path,
-                 const std::string& directory) {
+                 const std::string& directory,
+                 std::vector<char>& buffer) {
   r["path"] = path;
   r["directory"] = directory;
-  int ret;
-  int buf_len;
   struct XAttrAttribute x_att =
-      getAttribute(path, "com.apple.metadata:kMDItemWhereFroms");
+      getAttribute(path, "com.apple.metadata:kMDItemWhereFroms", buffer);
   parseWhereFromData(r, x_att);
 }
 
 QueryData genXattr(QueryContext& context) {
   QueryData results;
+  std::vector<char> buffer;
   auto paths = context.constraints["path"].getAll(EQUALS);
 
   for (const auto& path_string : paths) {
@@ -168,7 +188,7 @@ QueryData genXattr(QueryContext& context) {
       continue;
     }
     Row r;
-    getFileData(r, path.string(), path.parent_path().string());
+    getFileData(r, path.string(), path.parent_path().string(), buffer);
     results.push_back(r);
   }
 
@@ -183,7 +203,7 @@ QueryData genXattr(QueryContext& context) {
 
     for (auto& file : files) {
       Row r;
-      getFileData(r, file, directory.string());
+      getFileData(r, file, directory.string(), buffer);
       results.push_back(r);
     }
   }
@@ -3,21 +3,166 @@
  *  All rights reserved.
  *
  *  This source code is licensed under the BSD-style license found in the
- *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  LICENSE file in the root directory of this source tree. An additional grant
  *  of patent rights can be found in the PATENTS file in the same directory.
  *
  */
 
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <kvm.h>
+#include <limits.h>
+#include <paths.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <sys/user.h>
+
 #include <osquery/core.h>
+#include <osquery/filesystem.h>
+#include <osquery/logger.h>
 #include <osquery/tables.h>
 
 namespace osquery {
 namespace tables {
 
+/// A kvm_getprocs request, an operation such as KERN_PROC_PID and its value.
+typedef std::pair<int, int> ProcessRequest;
+
+/**
+ * @brief The kvm_getprocs requests needed for a query's constraints.
+ *
+ * Processes are requested by pid, then by real or effective uid, and every
+ * process is read without an EQUALS constraint on one of those columns.
+ * SQLite applies the remaining constraints to the rows.
+ */
+static std::vector<ProcessRequest> getProcessRequests(QueryContext& context) {
+  std::vector<ProcessRequest> requests;
+  const std::vector<std::pair<std::string, int>> columns = {
+      {"pid", KERN_PROC_PID}, {"uid", KERN_PROC_RUID}, {"euid", KERN_PROC_UID},
+  };
+
+  for (const auto& column : columns) {
+    auto values = context.constraints[column.first].getAll(EQUALS);
+    if (values.empty()) {
+      continue;
+    }
+    for (const auto& value : values) {
+      char* end = nullptr;
+      auto id = std::strtoll(value.c_str(), &end, 10);
+      if (!value.empty() && *end == '\0' && id >= 0 && id <= INT_MAX) {
+        requests.push_back(std::make_pair(column.second, (int)id));
+      }
+    }
+    if (requests.empty()) {
+      // No process has the constrained id, such as 'pid = -1'.
+      requests.push_back(std::make_pair(-1, 0));
+    }
+    return requests;
+  }
+
+  requests.push_back(std::make_pair(KERN_PROC_PROC, 0));
+  return requests;
+}
+
+/**
+ * @brief Read the processes of a query's constraints from kvm_getprocs.
+ *
+ * @param context the query context, its constraints select the processes.
+ * @param callback called with the open kvm descriptor and each process.
+ */
+template <typename Callback>
+static void genKvmProcesses(QueryContext& context, Callback callback) {
+  char errbuf[_POSIX2_LINE_MAX];
+  auto kd = kvm_openfiles(nullptr, _PATH_DEVNULL, nullptr, O_RDONLY, errbuf);
+  if (kd == nullptr) {
+    VLOG(1) << "Could not open kvm: " << errbuf;
+    return;
+  }
+
+  for (const auto& request : getProcessRequests(context)) {
+    if (request.first < 0) {
+      continue;
+    }
+
+    int count = 0;
+    auto procs = kvm_getprocs(kd, request.first, request.second, &count);
+    if (procs == nullptr) {
+      // A pid request for an exited process finds nothing.
+      continue;
+    }
+    for (int i = 0; i < count; ++i) {
+      callback(kd, procs[i]);
+    }
+  }
+  kvm_close(kd);
+}
+
+/// Join a NULL-terminated vector of strings from kvm_getargv.
+static std::string joinKvmStrings(char** strings) {
+  std::string joined;
+  for (size_t i = 0; strings != nullptr && strings[i] != nullptr; ++i) {
+    if (i > 0) {
+      joined += ' ';
+    }
+    joined += strings[i];
+  }
+  return joined;
+}
+
+/// The path of a process's binary.
+static std::string getProcessPath(int pid) {
+  int mib[4] = {CTL_KERN, KERN_PROC, KERN_PROC_PATHNAME, pid};
+  char path[PATH_MAX] = {0};
+  size_t size = sizeof(path);
+  if (sysctl(mib, 4, path, &size, nullptr, 0) != 0 || size == 0) {
+    return "";
+  }
+  return std::string(path);
+}
+
+static bool isSystemProcess(const struct kinfo_proc& proc) {
+  return (proc.ki_flag & P_SYSTEM) != 0;
+}
+
+static long long getMilliseconds(const struct timeval& time) {
+  return (long long)time.tv_sec * 1000 + time.tv_usec / 1000;
+}
+
 QueryData genProcessEnvs(QueryContext& context) {
   QueryData results;
 
-  throw std::domain_error("Table not implemented for FreeBSD");
+  auto path_used = context.isColumnUsed("path");
+  genKvmProcesses(context, [&](kvm_t* kd, struct kinfo_proc& proc) {
+    if (isSystemProcess(proc)) {
+      // Kernel processes have no environment.
+      return;
+    }
+
+    auto env = kvm_getenvv(kd, &proc, 0);
+    if (env == nullptr) {
+      return;
+    }
+
+    auto path = (path_used) ? getProcessPath(proc.ki_pid) : "";
+    for (size_t i = 0; env[i] != nullptr; ++i) {
+      std::string variable = env[i];
+      auto equal = variable.find('=');
+
+      Row r;
+      r["pid"] = INTEGER(proc.ki_pid);
+      r["name"] = TEXT(proc.ki_comm);
+      r["path"] = path;
+      r["key"] = variable.substr(0, equal);
+      r["value"] =
+          (equal == std::string::npos) ? "" : variable.substr(equal + 1);
+      results.push_back(r);
+    }
+  });
 
   return results;
 }
@@ -25,7 +170,48 @@ QueryData genProcessEnvs(QueryContext& context) {
 QueryData genProcesses(QueryContext& context) {
   QueryData results;
 
-  throw std::domain_error("Table not implemented for FreeBSD");
+  auto cmdline_used = context.isColumnUsed("cmdline");
+  auto path_used =
+      context.isColumnUsed("path") || context.isColumnUsed("on_disk");
+  auto page_kb = getpagesize() / 1024;
+
+  genKvmProcesses(context, [&](kvm_t* kd, struct kinfo_proc& proc) {
+    if (context.limitReached(results.size())) {
+      return;
+    }
+
+    Row r;
+    r["pid"] = INTEGER(proc.ki_pid);
+    r["name"] = TEXT(proc.ki_comm);
+    r["uid"] = BIGINT(proc.ki_ruid);
+    r["gid"] = BIGINT(proc.ki_rgid);
+    r["euid"] = BIGINT(proc.ki_uid);
+    r["egid"] = BIGINT(proc.ki_groups[0]);
+
+    // Arguments and paths are read from the kernel for each process, skip
+    // them when the query ignores their columns.
+    if (cmdline_used) {
+      r["cmdline"] = (isSystemProcess(proc))
+                         ? ""
+                         : joinKvmStrings(kvm_getargv(kd, &proc, 0));
+    }
+    if (path_used) {
+      r["path"] = (isSystemProcess(proc)) ? "" : getProcessPath(proc.ki_pid);
+    }
+    if (context.isColumnUsed("on_disk")) {
+      r["on_disk"] = osquery::pathExists(r["path"]).toString();
+    }
+
+    // Memory sizes are in kilobytes and times are in milliseconds, the start
+    // time is seconds since the epoch.
+    r["resident_size"] = BIGINT((long long)proc.ki_rssize * page_kb);
+    r["phys_footprint"] = BIGINT((unsigned long long)proc.ki_size / 1024);
+    r["user_time"] = BIGINT(getMilliseconds(proc.ki_rusage.ru_utime));
+    r["system_time"] = BIGINT(getMilliseconds(proc.ki_rusage.ru_stime));
+    r["start_time"] = BIGINT((long long)proc.ki_start.tv_sec);
+    r["parent"] = INTEGER(proc.ki_ppid);
+    results.push_back(r);
+  });
 
   return results;
 }
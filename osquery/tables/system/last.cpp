@@ -8,43 +8,171 @@
  *
  */
 
+#include <algorithm>
+#include <cstring>
 #include <vector>
 #include <string>
 
 #include <utmpx.h>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <osquery/core.h>
 #include <osquery/tables.h>
 
+#ifdef __linux__
+#include <osquery/database/db_handle.h>
+#include <osquery/flags.h>
+#endif
+
 namespace osquery {
 namespace tables {
 
+/// Fixed-size utmpx fields are not always NULL-terminated.
+#define UTMPX_TEXT(field) \
+  TEXT(std::string(field, strnlen(field, sizeof(field))))
+
+void genLastRow(const struct utmpx* ut, QueryData& results) {
+  Row r;
+  r["username"] = UTMPX_TEXT(ut->ut_user);
+  r["tty"] = UTMPX_TEXT(ut->ut_line);
+  r["pid"] = INTEGER(ut->ut_pid);
+  r["type"] = INTEGER(ut->ut_type);
+  r["time"] = INTEGER(ut->ut_tv.tv_sec);
+  r["host"] = UTMPX_TEXT(ut->ut_host);
+
+  results.push_back(r);
+}
+
+#ifdef __linux__
+
+DEFINE_osquery_flag(bool,
+                    last_incremental,
+                    false,
+                    "Scheduled queries return only logins recorded since "
+                    "their last run.");
+
+const std::string kWtmpPath = "/var/log/wtmp";
+
+/// The earliest time allowed by a query's integer time constraints.
+long long getLastTimeLowerBound(QueryContext& context) {
+  long long lower = 0;
+  auto& time = context.constraints["time"];
+  for (const auto& op : {EQUALS, GREATER_THAN, GREATER_THAN_OR_EQUALS}) {
+    for (const auto& expr : time.getAll(op)) {
+      char* end = nullptr;
+      auto value = std::strtoll(expr.c_str(), &end, 10);
+      if (expr.empty() || *end != 0) {
+        // Only integer times are used, SQLite applies the rest.
+        continue;
+      }
+      lower = std::max(lower, (op == GREATER_THAN) ? value + 1 : value);
+    }
+  }
+  return lower;
+}
+
+/**
+ * @brief Read wtmp records from newest to oldest.
+ *
+ * The file is mapped and scanned backwards, records are appended in time
+ * order so the scan stops at the first record before the query's time lower
+ * bound. Incremental reads stop at the size of the file at the query's last
+ * run, kept in the backing store with the file's inode per scheduled query.
+ * The new size is recorded only by a scan reaching that stop, a scan ended
+ * early by a limit or time constraint reads the same records again.
+ */
+QueryData genLastAccess(QueryContext& context) {
+  QueryData results;
+
+  int fd = ::open(kWtmpPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return results;
+  }
+
+  struct stat file;
+  if (::fstat(fd, &file) != 0 || file.st_size < (off_t)sizeof(struct utmpx)) {
+    ::close(fd);
+    return results;
+  }
+
+  // A partially written last record is ignored.
+  size_t count = file.st_size / sizeof(struct utmpx);
+  auto mapping = ::mmap(nullptr, file.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    return results;
+  }
+
+  // Offsets are stored as "inode:offset", queries outside the schedule have
+  // no offsets and read the whole file.
+  const auto& offsets = context.events.offsets;
+  bool incremental = (FLAGS_last_incremental && offsets != nullptr);
+  size_t first = 0;
+  if (incremental) {
+    std::shared_ptr<DBHandle> db;
+    try {
+      db = DBHandle::getInstance();
+    } catch (const std::runtime_error& e) {
+      db = nullptr;
+    }
+
+    std::string value;
+    if (db != nullptr &&
+        db->Get(kFileOffsets, offsets->key(kWtmpPath), value).ok()) {
+      auto separator = value.find(':');
+      if (separator != std::string::npos &&
+          value.substr(0, separator) == std::to_string(file.st_ino)) {
+        first = std::strtoull(value.c_str() + separator + 1, nullptr, 10) /
+                sizeof(struct utmpx);
+      }
+    }
+    first = (first > count) ? 0 : first;
+  }
+
+  auto records = static_cast<const struct utmpx*>(mapping);
+  auto lower = getLastTimeLowerBound(context);
+  size_t i = count;
+  for (; i > first; --i) {
+    if (context.limitReached(results.size()) ||
+        records[i - 1].ut_tv.tv_sec < lower) {
+      break;
+    }
+    genLastRow(&records[i - 1], results);
+  }
+  ::munmap(mapping, file.st_size);
+
+  if (incremental && i == first) {
+    // The scheduler stores the offset once the run's results are logged.
+    offsets->set(kWtmpPath,
+                 std::to_string(file.st_ino) + ":" +
+                     std::to_string(count * sizeof(struct utmpx)));
+  }
+  return results;
+}
+
+#else
+
 QueryData genLastAccess(QueryContext& context) {
   QueryData results;
   struct utmpx *ut;
 #ifdef __APPLE__
   setutxent_wtmp(0); // 0 = reverse chronological order
 
-  while ((ut = getutxent_wtmp()) != NULL) {
+  while (!context.limitReached(results.size()) &&
+         (ut = getutxent_wtmp()) != NULL) {
 #else
-
-#ifndef __FreeBSD__
-  utmpxname("/var/log/wtmpx");
-#endif
   setutxent();
 
-  while ((ut = getutxent()) != NULL) {
+  while (!context.limitReached(results.size()) &&
+         (ut = getutxent()) != NULL) {
 #endif
-
-    Row r;
-    r["username"] = TEXT(ut->ut_user);
-    r["tty"] = TEXT(ut->ut_line);
-    r["pid"] = INTEGER(ut->ut_pid);
-    r["type"] = INTEGER(ut->ut_type);
-    r["time"] = INTEGER(ut->ut_tv.tv_sec);
-    r["host"] = TEXT(ut->ut_host);
-
-    results.push_back(r);
+    genLastRow(ut, results);
   }
 
 #ifdef __APPLE__
@@ -55,5 +183,7 @@ QueryData genLastAccess(QueryContext& context) {
 
   return results;
 }
+
+#endif
 }
 }
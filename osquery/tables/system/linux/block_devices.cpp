@@ -17,6 +17,8 @@
 #include <osquery/filesystem.h>
 #include <osquery/tables.h>
 
+#include "osquery/events/linux/udev.h"
+
 namespace osquery {
 namespace tables {
 
@@ -69,35 +71,13 @@ static void fillRow(struct udev_device *dev, Row &r) {
 }
 
 QueryData genBlockDevs(QueryContext &context) {
-  QueryData results;
-  struct udev *udev;
-  struct udev_enumerate *enumerate;
-  struct udev_list_entry *devices, *dev_list_entry;
-  struct udev_device *dev, *parent;
-
-  if ((udev = udev_new())) {
-    enumerate = udev_enumerate_new(udev);
-    udev_enumerate_add_match_subsystem(enumerate, "block");
-    udev_enumerate_scan_devices(enumerate);
-    devices = udev_enumerate_get_list_entry(enumerate);
-    udev_list_entry_foreach(dev_list_entry, devices) {
-      const char *path;
-      Row r;
-
-      path = udev_list_entry_get_name(dev_list_entry);
-      dev = udev_device_new_from_syspath(udev, path);
-
-      fillRow(dev, r);
-
-      results.push_back(r);
-      udev_device_unref(dev);
-    }
-
-    udev_enumerate_unref(enumerate);
-    udev_unref(udev);
-  }
-
-  return results;
+  // Probed devices are cached until a block device event is received.
+  return UdevEventPublisher::genDevices(
+      "block", [](struct udev_device *dev, QueryData &results) {
+        Row r;
+        fillRow(dev, r);
+        results.push_back(r);
+      });
 }
 }
 }
@@ -8,189 +8,168 @@
 *
 */
 
-#include <boost/algorithm/string.hpp>
-#include <osquery/tables.h>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// see README.api of libdpkg-dev
-#define LIBDPKG_VOLATILE_API
-
-extern "C" {
-#include <dpkg/dpkg-db.h>
-// copy pasted from dpkg-db.h
-// these enums are inside struct pkginfo and are not visible for other headers
-enum pkgwant {
-  want_unknown,
-  want_install,
-  want_hold,
-  want_deinstall,
-  want_purge,
-  // Not allowed except as special sentinel value in some places.
-  want_sentinel,
-} want;
-// The error flag bitmask.
-enum pkgeflag {
-  eflag_ok = 0,
-  eflag_reinstreq = 1,
-} eflag;
-enum pkgstatus {
-  stat_notinstalled,
-  stat_configfiles,
-  stat_halfinstalled,
-  stat_unpacked,
-  stat_halfconfigured,
-  stat_triggersawaited,
-  stat_triggerspending,
-  stat_installed
-} status;
-
-#include <dpkg/dpkg.h>
-#include <dpkg/pkg-array.h>
-#include <dpkg/parsedump.h>
-}
+#include <osquery/tables.h>
 
 namespace osquery {
 namespace tables {
 
-/**
-* @brief A comparator used to sort the packages array
-*/
-int pkg_sorter(const void *a, const void *b) {
-  const struct pkginfo *pa = *(const struct pkginfo **)a;
-  const struct pkginfo *pb = *(const struct pkginfo **)b;
-  const char *arch_a = pa->installed.arch->name;
-  const char *arch_b = pb->installed.arch->name;
-  int res;
-
-  res = strcmp(pa->set->name, pb->set->name);
-  if (res)
-    return res;
-
-  if (pa->installed.arch == pb->installed.arch)
-    return 0;
-
-  return strcmp(arch_a, arch_b);
-}
+/// The dpkg status database, replaced by every package transaction.
+const std::string kDPKGStatusPath = "/var/lib/dpkg/status";
 
 /**
-* @brief A field extractor to fetch the revision of a package
+* @brief The packages generated from the dpkg database at a file identity.
 *
-* dpkg tracks the revision as part of version, but we need to
-* provde our own fwritefunction for fieldinfos to extract it.
-*/
-void w_revision(struct varbuf *vb,
-                const struct pkginfo *pkg,
-                const struct pkgbin *pkgbin,
-                enum fwriteflags flags,
-                const struct fieldinfo *fip) {
-  if (flags & fw_printheader) {
-    varbuf_add_str(vb, "Revision: ");
-  }
-  varbuf_add_str(vb, pkgbin->version.revision);
-  if (flags & fw_printheader) {
-    varbuf_add_char(vb, '\n');
-  }
-}
-
-/**
-* @brief Initialize dpkg and load packages into memory
+* Parsing the dpkg database reads every package's status, but it only
+* changes when packages are installed or removed. Rows are reused while the
+* status file's device, inode, and modification time are unchanged.
 */
-void dpkg_setup(struct pkg_array *packages) {
-  dpkg_set_progname("osquery");
-  push_error_context();
-
-  modstatdb_open(msdbrw_readonly);
-
-  pkg_array_init_from_db(packages);
-  pkg_array_sort(packages, pkg_sorter);
-}
+struct DebPackagesCache {
+  dev_t device;
+  ino_t inode;
+  struct timespec mtime;
+  QueryData results;
+  std::mutex mutex;
 
-/**
-* @brief Clean up after dpkg operations
-*/
-void dpkg_teardown(struct pkg_array *packages) {
-  pkg_array_destroy(packages);
+  DebPackagesCache() : device(0), inode(0) { mtime = {0, 0}; }
+};
 
-  pkg_db_reset();
-  modstatdb_done();
+static DebPackagesCache kDebPackagesCache;
 
-  pop_error_context(ehflag_normaltidy);
-}
-
-const std::map<std::string, std::string> kFieldMappings = {
+/// The stanza fields read into columns, other fields are skipped.
+const std::vector<std::pair<std::string, std::string> > kFieldMappings = {
     {"Package", "name"},
     {"Version", "version"},
     {"Installed-Size", "size"},
     {"Architecture", "arch"},
     {"Source", "source"},
-    {"Revision", "revision"}};
+    {"Status", "status"}};
+
+/// The Debian revision of a version, after the last hyphen.
+static std::string getDebRevision(const std::string& version) {
+  auto hyphen = version.rfind('-');
+  return (hyphen == std::string::npos) ? "" : version.substr(hyphen + 1);
+}
+
+/// Add a parsed stanza, packages that are not installed have no row.
+static void addDebPackage(Row& r, QueryData& results) {
+  auto status = r.find("status");
+  auto name = r.find("name");
+  if (name != r.end() && !name->second.empty() &&
+      (status == r.end() ||
+       status->second.find("not-installed") == std::string::npos)) {
+    r["revision"] = getDebRevision(r["version"]);
+    r["arch"];
+    r.erase("status");
+    results.push_back(std::move(r));
+  }
+  r.clear();
+}
 
 /**
-* @brief Field names and function references to extract information
+* @brief Parse the stanzas of a dpkg status database.
 *
-* These are taken from lib/dpkg/parse.c, with a slight modification to
-* add an fwritefunction for Revision. Additional fields can be taken
-* as needed.
+* Stanzas are scanned in place, only the values of the mapped fields are
+* copied. Continuation lines, such as those of a Description, are skipped.
+* As dpkg's package array, rows are sorted by name then architecture.
 */
-const struct fieldinfo fieldinfos[] = {
-    {"Package", f_name, w_name},
-    {"Installed-Size", f_charfield, w_charfield, PKGIFPOFF(installedsize)},
-    {"Architecture", f_architecture, w_architecture},
-    {"Source", f_charfield, w_charfield, PKGIFPOFF(source)},
-    {"Version", f_version, w_version, PKGIFPOFF(version)},
-    {"Revision", f_revision, w_revision},
-    {NULL}};
-
-void extractDebPackageInfo(const struct pkginfo *pkg, QueryData &results) {
+QueryData parseDebPackages(const char* data, size_t size) {
+  QueryData results;
   Row r;
-  const struct fieldinfo *fip;
-  struct varbuf vb;
-  varbuf_init(&vb, 20);
-
-  // Iterate over the desired fieldinfos, calling their fwritefunctions
-  // to extract the package's information.
-  for (fip = fieldinfos; fip->name; fip++) {
-    fip->wcall(&vb, pkg, &pkg->installed, fw_printheader, fip);
-
-    std::string line = vb.string();
-    if (!line.empty()) {
-      std::size_t separator_position = line.find(':');
-      std::string key = line.substr(0, separator_position);
-      std::string value = line.substr(separator_position + 1, line.length());
-      auto it = kFieldMappings.find(key);
-      if (it != kFieldMappings.end()) {
-        boost::algorithm::trim(value);
-        r[it->second] = value;
+
+  const char* end = data + size;
+  for (const char* line = data; line < end;) {
+    auto eol = (const char*)memchr(line, '\n', end - line);
+    eol = (eol == nullptr) ? end : eol;
+    if (line == eol) {
+      // An empty line ends the stanza.
+      addDebPackage(r, results);
+    } else if (*line != ' ' && *line != '\t') {
+      auto colon = (const char*)memchr(line, ':', eol - line);
+      for (const auto& field : kFieldMappings) {
+        if (colon == nullptr || (size_t)(colon - line) != field.first.size() ||
+            strncasecmp(line, field.first.c_str(), field.first.size()) != 0) {
+          continue;
+        }
+
+        auto value = colon + 1;
+        auto value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+          value++;
+        }
+        while (value_end > value &&
+               (value_end[-1] == ' ' || value_end[-1] == '\r')) {
+          value_end--;
+        }
+        r[field.second] = std::string(value, value_end - value);
+        break;
       }
     }
-    varbuf_reset(&vb);
+    line = eol + 1;
   }
-  varbuf_destroy(&vb);
+  addDebPackage(r, results);
 
-  results.push_back(r);
+  std::sort(results.begin(), results.end(), [](const Row& a, const Row& b) {
+    return std::tie(a.at("name"), a.at("arch")) <
+           std::tie(b.at("name"), b.at("arch"));
+  });
+  return results;
 }
 
-QueryData genDebs(QueryContext &context) {
-  QueryData results;
-
-  struct pkg_array packages;
-  struct pkginfo *pkg;
-  int i;
-
-  dpkg_setup(&packages);
-
-  for (i = 0; i < packages.n_pkgs; i++) {
-    pkg = packages.pkgs[i];
+/// Map the dpkg status database and parse its stanzas.
+static QueryData genDebPackages(int fd, size_t size) {
+  if (size == 0) {
+    return QueryData();
+  }
 
-    if (pkg->status == pkg->stat_notinstalled) {
-      continue;
-    }
+  auto mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return QueryData();
+  }
+  ::madvise(mapping, size, MADV_SEQUENTIAL);
+  auto results = parseDebPackages((const char*)mapping, size);
+  ::munmap(mapping, size);
+  return results;
+}
 
-    extractDebPackageInfo(pkg, results);
+QueryData genDebs(QueryContext& context) {
+  int fd = ::open(kDPKGStatusPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return QueryData();
   }
 
-  dpkg_teardown(&packages);
+  struct stat database;
+  if (::fstat(fd, &database) != 0) {
+    ::close(fd);
+    return QueryData();
+  }
 
-  return results;
+  std::lock_guard<std::mutex> lock(kDebPackagesCache.mutex);
+  auto& cache = kDebPackagesCache;
+  if (cache.inode != database.st_ino || cache.device != database.st_dev ||
+      cache.mtime.tv_sec != database.st_mtim.tv_sec ||
+      cache.mtime.tv_nsec != database.st_mtim.tv_nsec ||
+      cache.results.empty()) {
+    // The database changed, or the last read failed.
+    cache.results = genDebPackages(fd, database.st_size);
+    cache.device = database.st_dev;
+    cache.inode = database.st_ino;
+    cache.mtime = database.st_mtim;
+  }
+  ::close(fd);
+  return cache.results;
 }
 }
 }
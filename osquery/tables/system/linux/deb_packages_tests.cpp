@@ -0,0 +1,67 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <osquery/logger.h>
+#include <osquery/database.h>
+
+namespace osquery {
+namespace tables {
+
+osquery::QueryData parseDebPackages(const char* data, size_t size);
+
+class DebPackagesTests : public testing::Test {};
+
+TEST_F(DebPackagesTests, test_parse_deb_packages) {
+  std::string content =
+      "Package: zlib1g\n"
+      "Status: install ok installed\n"
+      "Installed-Size: 163\n"
+      "Architecture: amd64\n"
+      "Source: zlib\n"
+      "Version: 1:1.2.8.dfsg-1ubuntu1\n"
+      "Description: compression library - runtime\n"
+      " zlib is a library implementing the deflate compression method.\n"
+      "\n"
+      "Package: removed\n"
+      "Status: purge ok not-installed\n"
+      "Architecture: amd64\n"
+      "\n"
+      "package: adduser\n"
+      "Status: install ok installed\n"
+      "Architecture:  all \n"
+      "Version: 3.113\n";
+
+  auto results = parseDebPackages(content.data(), content.size());
+  ASSERT_EQ(results.size(), 2U);
+
+  // Packages are sorted by name, fields are matched without case.
+  EXPECT_EQ(results[0]["name"], "adduser");
+  EXPECT_EQ(results[0]["arch"], "all");
+  EXPECT_EQ(results[0]["version"], "3.113");
+  EXPECT_EQ(results[0]["revision"], "");
+
+  // Continuation lines are not fields.
+  EXPECT_EQ(results[1]["name"], "zlib1g");
+  EXPECT_EQ(results[1]["version"], "1:1.2.8.dfsg-1ubuntu1");
+  EXPECT_EQ(results[1]["revision"], "1ubuntu1");
+  EXPECT_EQ(results[1]["size"], "163");
+  EXPECT_EQ(results[1]["source"], "zlib");
+  EXPECT_EQ(results[1].count("status"), 0U);
+}
+}
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -8,40 +8,45 @@
  *
  */
 
-#include <set>
-#include <mutex>
-
-#include <grp.h>
+#include <cstdlib>
 
 #include <osquery/core.h>
 #include <osquery/tables.h>
 
+#include "osquery/tables/system/user_groups.h"
+
 namespace osquery {
 namespace tables {
 
-std::mutex grpEnumerationMutex;
+void genGroupRow(const GroupEntry &group, QueryData &results) {
+  Row r;
+  r["gid"] = INTEGER(group.gid);
+  r["gid_signed"] = INTEGER((int32_t) group.gid);
+  r["groupname"] = TEXT(group.groupname);
+  results.push_back(r);
+}
 
 QueryData genGroups(QueryContext &context) {
-  std::lock_guard<std::mutex> lock(grpEnumerationMutex);
   QueryData results;
-  struct group *grp = nullptr;
-  std::set<long> groups_in;
-
-  setgrent();
-  while ((grp = getgrent()) != NULL) {
-    if (std::find(groups_in.begin(), groups_in.end(), grp->gr_gid) ==
-        groups_in.end()) {
-      Row r;
-      r["gid"] = INTEGER(grp->gr_gid);
-      r["gid_signed"] = INTEGER((int32_t) grp->gr_gid);
-      r["groupname"] = TEXT(grp->gr_name);
-      results.push_back(r);
-      groups_in.insert(grp->gr_gid);
+
+  // A gid constraint is answered without enumerating every group.
+  auto gids = context.constraints["gid"].getAll(EQUALS);
+  if (!gids.empty()) {
+    for (const auto &expr : gids) {
+      char *end = nullptr;
+      auto gid = std::strtoull(expr.c_str(), &end, 10);
+      GroupEntry group;
+      if (!expr.empty() && *end == 0 && getGroupByGid(gid, group).ok()) {
+        genGroupRow(group, results);
+      }
     }
+    return results;
   }
-  endgrent();
-  groups_in.clear();
 
+  auto snapshot = getGroupSnapshot();
+  for (const auto &group : snapshot->groups) {
+    genGroupRow(group, results);
+  }
   return results;
 }
 }
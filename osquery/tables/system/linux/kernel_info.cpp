@@ -11,8 +11,8 @@
 #include <boost/algorithm/string/split.hpp>
 
 #include <osquery/core.h>
+#include <osquery/database/hash_cache.h>
 #include <osquery/filesystem.h>
-#include <osquery/hash.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
@@ -69,7 +69,7 @@ QueryData genKernelInfo(QueryContext& context) {
 
   // Using the path of the boot image, attempt to calculate a hash.
   if (r.count("path") > 0) {
-    r["md5"] = hashFromFile(HASH_TYPE_MD5, r.at("path"));
+    r["md5"] = hashMultiFromFileCached(HASH_TYPE_MD5, r.at("path")).md5;
   }
 
   results.push_back(r);
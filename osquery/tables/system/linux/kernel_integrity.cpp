@@ -16,6 +16,8 @@ namespace tables {
 
 const std::string kKernelSyscallAddrModifiedPath = "/sys/kernel/camb/syscall_addr_modified";
 const std::string kKernelTextHashPath = "/sys/kernel/camb/text_segment_hash";
+const std::string kKernelTextModifiedPagesPath =
+    "/sys/kernel/camb/text_segment_modified_pages";
 
 QueryData genKernelIntegrity(QueryContext &context) {
   QueryData results;
@@ -44,6 +46,15 @@ QueryData genKernelIntegrity(QueryContext &context) {
     return results;
   }
 
+  // Reading the hash verified more pages, list those changed since load.
+  // Modules without page digests do not expose the list.
+  if (osquery::readFile(kKernelTextModifiedPagesPath, content).ok()) {
+    boost::trim(content);
+    r["text_segment_modified_pages"] = content;
+  } else {
+    r["text_segment_modified_pages"] = "";
+  }
+
   r["sycall_addr_modified"] = syscall_addr_modified;
   r["text_segment_hash"] = text_segment_hash;
   results.push_back(r);
@@ -8,8 +8,16 @@
  *
  */
 
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
 #include <mntent.h>
+#include <poll.h>
 #include <sys/vfs.h>
+#include <unistd.h>
 
 #include <osquery/core.h>
 #include <osquery/filesystem.h>
@@ -18,35 +26,108 @@
 namespace osquery {
 namespace tables {
 
+const std::string kMountsPath = "/proc/self/mounts";
+
+/// The fields of a mount table entry.
+struct MountEntry {
+  std::string device;
+  std::string device_alias;
+  std::string path;
+  std::string type;
+  std::string flags;
+};
+
+/**
+ * @brief The mount table, parsed again only when it changes.
+ *
+ * The kernel reports changes of the mount table to poll() on an open mounts
+ * file with POLLPRI. Block and inode counts change all the time, each query
+ * still reads them with statfs.
+ */
+struct MountsCache {
+  /// An open mounts file polled for changes.
+  int fd;
+  /// Set once the entries were parsed.
+  bool parsed;
+  std::vector<MountEntry> entries;
+  std::mutex mutex;
+
+  MountsCache() : fd(-1), parsed(false) {}
+};
+
+static MountsCache kMountsCache;
+
+/// True if the mount table changed since the last call, the cache is locked.
+static bool mountsChanged(MountsCache& cache) {
+  if (cache.fd == -1) {
+    cache.fd = ::open(kMountsPath.c_str(), O_RDONLY | O_CLOEXEC);
+    return true;
+  }
+
+  struct pollfd changes;
+  changes.fd = cache.fd;
+  changes.events = POLLPRI;
+  changes.revents = 0;
+  if (::poll(&changes, 1, 0) != 0) {
+    // A change, or poll failed and the table cannot be trusted.
+    return true;
+  }
+  return !cache.parsed;
+}
+
+static void parseMounts(std::vector<MountEntry>& entries) {
+  entries.clear();
+  auto mounts = setmntent(kMountsPath.c_str(), "r");
+  if (mounts == nullptr) {
+    return;
+  }
+
+  char real_path[PATH_MAX];
+  struct mntent *ent = nullptr;
+  while ((ent = getmntent(mounts))) {
+    MountEntry entry;
+    entry.device = std::string(ent->mnt_fsname);
+    entry.device_alias = std::string(
+        realpath(ent->mnt_fsname, real_path) ? real_path : ent->mnt_fsname);
+    entry.path = std::string(ent->mnt_dir);
+    entry.type = std::string(ent->mnt_type);
+    entry.flags = std::string(ent->mnt_opts);
+    entries.push_back(entry);
+  }
+  endmntent(mounts);
+}
+
 QueryData genMounts(QueryContext &context) {
   QueryData results;
-  FILE *mounts;
-  struct mntent *ent;
-  char real_path[PATH_MAX];
-  struct statfs st;
 
-  if ((mounts = setmntent("/proc/mounts", "r"))) {
-    while ((ent = getmntent(mounts))) {
-      Row r;
-
-      r["device"] = std::string(ent->mnt_fsname);
-      r["device_alias"] = std::string(
-          realpath(ent->mnt_fsname, real_path) ? real_path : ent->mnt_fsname);
-      r["path"] = std::string(ent->mnt_dir);
-      r["type"] = std::string(ent->mnt_type);
-      r["flags"] = std::string(ent->mnt_opts);
-      if (!statfs(ent->mnt_dir, &st)) {
-        r["blocks_size"] = BIGINT(st.f_bsize);
-        r["blocks"] = BIGINT(st.f_blocks);
-        r["blocks_free"] = BIGINT(st.f_bfree);
-        r["blocks_available"] = BIGINT(st.f_bavail);
-        r["inodes"] = BIGINT(st.f_files);
-        r["inodes_free"] = BIGINT(st.f_ffree);
-      }
-
-      results.push_back(r);
+  std::vector<MountEntry> entries;
+  {
+    std::lock_guard<std::mutex> lock(kMountsCache.mutex);
+    if (mountsChanged(kMountsCache)) {
+      parseMounts(kMountsCache.entries);
+      kMountsCache.parsed = (kMountsCache.fd != -1);
+    }
+    entries = kMountsCache.entries;
+  }
+
+  struct statfs st;
+  for (const auto &entry : entries) {
+    Row r;
+    r["device"] = entry.device;
+    r["device_alias"] = entry.device_alias;
+    r["path"] = entry.path;
+    r["type"] = entry.type;
+    r["flags"] = entry.flags;
+    if (!statfs(entry.path.c_str(), &st)) {
+      r["blocks_size"] = BIGINT(st.f_bsize);
+      r["blocks"] = BIGINT(st.f_blocks);
+      r["blocks_free"] = BIGINT(st.f_bfree);
+      r["blocks_available"] = BIGINT(st.f_bavail);
+      r["inodes"] = BIGINT(st.f_files);
+      r["inodes_free"] = BIGINT(st.f_ffree);
     }
-    endmntent(mounts);
+
+    results.push_back(r);
   }
 
   return results;
@@ -37,23 +37,26 @@ void genDescriptors(const std::string& process,
   return;
 }
 
+static void genProcessDescriptors(const std::string& process,
+                                  QueryData& results) {
+  std::map<std::string, std::string> descriptors;
+  if (osquery::procDescriptors(process, descriptors).ok()) {
+    genDescriptors(process, descriptors, results);
+  }
+}
+
 QueryData genOpenFiles(QueryContext& context) {
   QueryData results;
 
-  std::vector<std::string> processes;
-  if (!osquery::procProcesses(processes).ok()) {
+  // Only the descriptors of the processes of pid constraints are read.
+  auto processes = context.constraints["pid"].getAll(EQUALS);
+  if (processes.empty() && !osquery::procProcesses(processes).ok()) {
     VLOG(1) << "Cannot list Linux processes";
     return results;
   }
 
-  for (const auto& process : processes) {
-    std::map<std::string, std::string> descriptors;
-    if (osquery::procDescriptors(process, descriptors).ok()) {
-      genDescriptors(process, descriptors, results);
-    }
-  }
-
-  return results;
+  // Each process's descriptors are read independently.
+  return parallelMap(context, processes, genProcessDescriptors);
 }
 }
 }
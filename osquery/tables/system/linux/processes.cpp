@@ -8,13 +8,18 @@
  *
  */
 
-#include <string>
-#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <map>
+#include <string>
+#include <vector>
 
-#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/limits.h>
 #include <unistd.h>
-#include <proc/readproc.h>
 
 #include <boost/algorithm/string/trim.hpp>
 
@@ -25,176 +30,371 @@
 namespace osquery {
 namespace tables {
 
-#ifdef PROC_EDITCMDLCVT
-/// EDITCMDLCVT is available in libprocps3-dev
-#define PROC_SELECTS                                                 \
-  PROC_FILLCOM | PROC_EDITCMDLCVT | PROC_FILLMEM | PROC_FILLSTATUS | \
-      PROC_FILLSTAT
-#else
-#define PROC_SELECTS \
-  PROC_FILLCOM | PROC_FILLMEM | PROC_FILLSTATUS | PROC_FILLSTAT
-#endif
-
-std::string proc_name(const proc_t* proc_info) {
-  return std::string(proc_info->cmd);
-}
+/// The fields of /proc/<pid>/stat used by the processes table.
+struct ProcessStat {
+  std::string name;
+  long long parent;
+  /// The kernel's PF_* flags of the process.
+  unsigned long long flags;
+  unsigned long long user_time;
+  unsigned long long system_time;
+  unsigned long long start_time;
+  /// The virtual memory size in bytes.
+  unsigned long long virtual_size;
+  /// The resident set size in pages.
+  long long resident_pages;
+
+  ProcessStat()
+      : parent(0),
+        flags(0),
+        user_time(0),
+        system_time(0),
+        start_time(0),
+        virtual_size(0),
+        resident_pages(0) {}
+};
+
+/// The real and effective user and group IDs from /proc/<pid>/status.
+struct ProcessIds {
+  long long uid;
+  long long gid;
+  long long euid;
+  long long egid;
+
+  ProcessIds() : uid(-1), gid(-1), euid(-1), egid(-1) {}
+};
 
-std::string proc_attr(const std::string& attr, const proc_t* proc_info) {
-  std::stringstream filename;
+/**
+ * @brief Read the files of /proc/<pid> directories into a reusable buffer.
+ *
+ * Each process directory is opened once, relative to an open /proc, and its
+ * files are opened relative to the process directory. Only the files needed
+ * for the selected columns are read.
+ */
+class ProcessReader {
+ public:
+  /**
+   * @brief Read every process, or only the processes of a set of pids.
+   *
+   * @param pids If not empty, the only pids read, such as the values of a
+   * query's `pid = X` or `pid IN (...)` constraints.
+   */
+  explicit ProcessReader(const std::vector<std::string>& pids)
+      : proc_(::opendir("/proc")), process_(-1), pids_(pids), next_pid_(0) {
+    buffer_.resize(4096);
+  }
 
-  filename << "/proc/" << proc_info->tid << "/" << attr;
-  return filename.str();
-}
+  ~ProcessReader() {
+    closeProcess();
+    if (proc_ != nullptr) {
+      ::closedir(proc_);
+    }
+  }
+
+  /// Move to the next process, false once every process was read.
+  bool next() {
+    closeProcess();
+    if (proc_ == nullptr) {
+      return false;
+    }
 
-std::string proc_cmdline(const proc_t* proc_info) {
-  std::string attr;
-  std::string result;
-
-  attr = proc_attr("cmdline", proc_info);
-  std::ifstream fd(attr, std::ios::in | std::ios::binary);
-  if (fd) {
-    result = std::string(std::istreambuf_iterator<char>(fd),
-                         std::istreambuf_iterator<char>());
-    std::replace_if(
-      result.begin(),
-      result.end(),
-      [](const char& c) { return c == 0; },
-      ' ');
+    while (!pids_.empty() && next_pid_ < pids_.size()) {
+      if (open(pids_[next_pid_++])) {
+        return true;
+      }
+    }
+
+    struct dirent* entry = nullptr;
+    while (pids_.empty() && (entry = ::readdir(proc_)) != nullptr) {
+      if (open(entry->d_name)) {
+        return true;
+      }
+    }
+    return false;
   }
 
-  return result;
-}
+  /// The pid of the current process.
+  const std::string& pid() const { return pid_; }
+
+  /// Parse the current process's stat, false if the process exited.
+  bool readStat(ProcessStat& stat) {
+    if (!read("stat")) {
+      return false;
+    }
 
-std::string proc_link(const proc_t* proc_info) {
-  std::string attr;
-  std::string result;
-  char* link_path;
-  long path_max;
-  int bytes;
-
-  // The exe is a symlink to the binary on-disk.
-  attr = proc_attr("exe", proc_info);
-  path_max = pathconf(attr.c_str(), _PC_PATH_MAX);
-  link_path = (char*)malloc(path_max);
-
-  memset(link_path, 0, path_max);
-  bytes = readlink(attr.c_str(), link_path, path_max);
-  if (bytes >= 0) {
-    result = std::string(link_path);
+    // The name is within parenthesis and may itself contain spaces.
+    auto name_start = content_.find('(');
+    auto name_end = content_.rfind(')');
+    if (name_start == std::string::npos || name_end == std::string::npos ||
+        name_end < name_start) {
+      return false;
+    }
+    stat.name = content_.substr(name_start + 1, name_end - name_start - 1);
+
+    // Fields are numbered from 1, the name is the second and state the third.
+    const char* field = content_.c_str() + name_end + 1;
+    for (size_t index = 3; index <= 24 && *field != '\0'; ++index) {
+      while (*field == ' ') {
+        ++field;
+      }
+
+      char* end = nullptr;
+      if (index == 4) {
+        stat.parent = std::strtoll(field, &end, 10);
+      } else if (index == 9) {
+        stat.flags = std::strtoull(field, &end, 10);
+      } else if (index == 14) {
+        stat.user_time = std::strtoull(field, &end, 10);
+      } else if (index == 15) {
+        stat.system_time = std::strtoull(field, &end, 10);
+      } else if (index == 22) {
+        stat.start_time = std::strtoull(field, &end, 10);
+      } else if (index == 23) {
+        stat.virtual_size = std::strtoull(field, &end, 10);
+      } else if (index == 24) {
+        stat.resident_pages = std::strtoll(field, &end, 10);
+      }
+
+      // Skip the remainder of the field.
+      field = (end != nullptr) ? end : field;
+      while (*field != ' ' && *field != '\0') {
+        ++field;
+      }
+    }
+    return true;
   }
 
-  free(link_path);
-  return result;
-}
+  /// Parse the user and group IDs of the current process's status.
+  bool readIds(ProcessIds& ids) {
+    if (!read("status")) {
+      return false;
+    }
 
-std::map<std::string, std::string> proc_env(const proc_t* proc_info) {
-  std::map<std::string, std::string> env;
-  std::string attr = proc_attr("environ", proc_info);
-  std::string buf;
+    // The Uid and Gid lines are "real effective saved filesystem".
+    auto uid = content_.find("\nUid:");
+    if (uid != std::string::npos) {
+      char* end = nullptr;
+      ids.uid = std::strtoll(content_.c_str() + uid + 5, &end, 10);
+      ids.euid = std::strtoll(end, nullptr, 10);
+    }
 
-  std::ifstream fd(attr, std::ios::in | std::ios::binary);
+    auto gid = content_.find("\nGid:");
+    if (gid != std::string::npos) {
+      char* end = nullptr;
+      ids.gid = std::strtoll(content_.c_str() + gid + 5, &end, 10);
+      ids.egid = std::strtoll(end, nullptr, 10);
+    }
+    return true;
+  }
 
-  while (!(fd.fail() || fd.eof())) {
-    std::getline(fd, buf, '\0');
-    size_t idx = buf.find_first_of("=");
+  /// The current process's space-separated arguments.
+  std::string readCmdline() {
+    if (!read("cmdline")) {
+      return "";
+    }
 
-    std::string key = buf.substr(0, idx);
-    std::string value = buf.substr(idx + 1);
+    std::replace(content_.begin(), content_.end(), '\0', ' ');
+    boost::algorithm::trim(content_);
+    return content_;
+  }
 
-    env[key] = value;
+  /// The path of the current process's binary.
+  std::string readPath() const {
+    char path[PATH_MAX];
+    auto size = ::readlinkat(process_, "exe", path, sizeof(path));
+    return (size > 0) ? std::string(path, size) : "";
   }
-  return env;
-}
 
-/**
- * @brief deallocate the space allocated by readproc if the passed rbuf was NULL
- *
- * @param p The rbuf to free
- */
-void standard_freeproc(proc_t* p) {
-  if (!p) { // in case p is NULL
-    return;
+  /// The current process's environment variables.
+  std::map<std::string, std::string> readEnvironment() {
+    std::map<std::string, std::string> environment;
+    if (!read("environ")) {
+      return environment;
+    }
+
+    // Variables are NULL-terminated "key=value" strings.
+    size_t start = 0;
+    while (start < content_.size()) {
+      auto end = content_.find('\0', start);
+      end = (end == std::string::npos) ? content_.size() : end;
+      auto equal = content_.find('=', start);
+      if (equal < end) {
+        environment[content_.substr(start, equal - start)] =
+            content_.substr(equal + 1, end - equal - 1);
+      } else if (end > start) {
+        environment[content_.substr(start, end - start)] = "";
+      }
+      start = end + 1;
+    }
+    return environment;
   }
 
-#ifdef PROC_EDITCMDLCVT
-  freeproc(p);
-  return;
-#endif
+ private:
+  /// Open the /proc directory of a pid.
+  bool open(const std::string& pid) {
+    auto digit = [](char c) { return isdigit(c) != 0; };
+    if (pid.empty() || !std::all_of(pid.begin(), pid.end(), digit)) {
+      // Not a process directory.
+      return false;
+    }
 
-  // ptrs are after strings to avoid copying memory when building them.
-  // so free is called on the address of the address of strvec[0].
-  if (p->cmdline) {
-    free((void*)*p->cmdline);
+    process_ = ::openat(
+        ::dirfd(proc_), pid.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (process_ == -1) {
+      return false;
+    }
+    pid_ = pid;
+    return true;
   }
-  if (p->environ) {
-    free((void*)*p->environ);
+
+  /// Read a file of the current process into the content buffer.
+  bool read(const char* name) {
+    content_.clear();
+    int fd = ::openat(process_, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+
+    ssize_t bytes = 0;
+    while ((bytes = ::read(fd, &buffer_[0], buffer_.size())) > 0) {
+      content_.append(buffer_.data(), bytes);
+    }
+    ::close(fd);
+    return (bytes == 0);
   }
-  free(p);
+
+  void closeProcess() {
+    if (process_ != -1) {
+      ::close(process_);
+    }
+    process_ = -1;
+  }
+
+ private:
+  /// The open /proc directory.
+  DIR* proc_;
+  /// The open /proc/<pid> directory of the current process.
+  int process_;
+  /// The pid of the current process.
+  std::string pid_;
+  /// If not empty, the only pids read.
+  std::vector<std::string> pids_;
+  /// The index of the next pid to read.
+  size_t next_pid_;
+  /// The read buffer, reused for every file.
+  std::vector<char> buffer_;
+  /// The content of the last file read, its capacity is reused.
+  std::string content_;
+};
+
+/// The PF_KTHREAD flag of kernel threads, which have no binary or arguments.
+const unsigned long long kKernelThreadFlag = 0x00200000;
+
+static bool isKernelThread(const ProcessStat& stat) {
+  return (stat.flags & kKernelThreadFlag) != 0;
+}
+
+/**
+ * @brief The path of a process's binary, empty for kernel threads.
+ *
+ * The link is read for every row. A binary deleted or replaced while the
+ * process runs is reported with the kernel's " (deleted)" suffix.
+ */
+static std::string getProcessPath(ProcessReader& reader,
+                                  const ProcessStat& stat) {
+  return (isKernelThread(stat)) ? "" : reader.readPath();
 }
 
 QueryData genProcesses(QueryContext& context) {
   QueryData results;
 
-  proc_t* proc_info;
-  PROCTAB* proc = openproc(PROC_SELECTS);
+  bool ids_used = context.isColumnUsed("uid") || context.isColumnUsed("gid") ||
+                  context.isColumnUsed("euid") || context.isColumnUsed("egid");
+  auto page_kb = ::sysconf(_SC_PAGESIZE) / 1024;
+
+  // Only the processes of pid constraints are read.
+  auto pids = context.constraints["pid"].getAll(EQUALS);
+  ProcessReader reader(pids);
+  while (!context.limitReached(results.size()) && reader.next()) {
+    ProcessStat stat;
+    if (!reader.readStat(stat)) {
+      // The process exited.
+      continue;
+    }
 
-  // Populate proc struc for each process.
-  while ((proc_info = readproc(proc, NULL))) {
     Row r;
+    r["pid"] = reader.pid();
+    r["name"] = stat.name;
+
+    // Reading from /proc/<pid> is expensive, skip columns the query ignores.
+    // Kernel threads run as root without arguments, their files are not read.
+    if (ids_used) {
+      ProcessIds ids;
+      if (isKernelThread(stat)) {
+        ids.uid = ids.gid = ids.euid = ids.egid = 0;
+      } else {
+        reader.readIds(ids);
+      }
+      r["uid"] = BIGINT(ids.uid);
+      r["gid"] = BIGINT(ids.gid);
+      r["euid"] = BIGINT(ids.euid);
+      r["egid"] = BIGINT(ids.egid);
+    }
+    if (context.isColumnUsed("cmdline")) {
+      r["cmdline"] = (isKernelThread(stat)) ? "" : reader.readCmdline();
+    }
+    if (context.isColumnUsed("path") || context.isColumnUsed("on_disk")) {
+      r["path"] = getProcessPath(reader, stat);
+    }
+    if (context.isColumnUsed("on_disk")) {
+      r["on_disk"] = osquery::pathExists(r["path"]).toString();
+    }
 
-    r["pid"] = INTEGER(proc_info->tid);
-    r["uid"] = BIGINT((unsigned int)proc_info->ruid);
-    r["gid"] = BIGINT((unsigned int)proc_info->rgid);
-    r["euid"] = BIGINT((unsigned int)proc_info->euid);
-    r["egid"] = BIGINT((unsigned int)proc_info->egid);
-    r["name"] = proc_name(proc_info);
-    std::string cmdline = proc_cmdline(proc_info);
-    boost::algorithm::trim(cmdline);
-    r["cmdline"] = cmdline;
-    r["path"] = proc_link(proc_info);
-    r["on_disk"] = osquery::pathExists(r["path"]).toString();
-
-    r["resident_size"] = INTEGER(proc_info->vm_rss);
-    r["phys_footprint"] = INTEGER(proc_info->vm_size);
-    r["user_time"] = INTEGER(proc_info->utime);
-    r["system_time"] = INTEGER(proc_info->stime);
-    r["start_time"] = INTEGER(proc_info->start_time);
-    r["parent"] = INTEGER(proc_info->ppid);
+    // Memory sizes are in kilobytes and times are in clock ticks.
+    r["resident_size"] = BIGINT(stat.resident_pages * page_kb);
+    r["phys_footprint"] = BIGINT(stat.virtual_size / 1024);
+    r["user_time"] = BIGINT(stat.user_time);
+    r["system_time"] = BIGINT(stat.system_time);
+    r["start_time"] = BIGINT(stat.start_time);
+    r["parent"] = BIGINT(stat.parent);
 
     results.push_back(r);
-    standard_freeproc(proc_info);
   }
 
-  closeproc(proc);
-
   return results;
 }
 
 QueryData genProcessEnvs(QueryContext& context) {
   QueryData results;
 
-  proc_t* proc_info;
-  PROCTAB* proc = openproc(PROC_SELECTS);
+  ProcessReader reader(context.constraints["pid"].getAll(EQUALS));
+  while (reader.next()) {
+    ProcessStat stat;
+    if (!reader.readStat(stat)) {
+      continue;
+    }
 
-  // Populate proc struc for each process.
+    if (isKernelThread(stat)) {
+      // Kernel threads have no environment.
+      continue;
+    }
 
-  while ((proc_info = readproc(proc, NULL))) {
-    auto env = proc_env(proc_info);
-    for (auto itr = env.begin(); itr != env.end(); ++itr) {
+    auto env = reader.readEnvironment();
+    std::string path;
+    if (context.isColumnUsed("path")) {
+      path = getProcessPath(reader, stat);
+    }
+    for (const auto& variable : env) {
       Row r;
-      r["pid"] = INTEGER(proc_info->tid);
-      r["name"] = proc_name(proc_info);
-      r["path"] = proc_link(proc_info);
-      r["key"] = itr->first;
-      r["value"] = itr->second;
+      r["pid"] = reader.pid();
+      r["name"] = stat.name;
+      r["path"] = path;
+      r["key"] = variable.first;
+      r["value"] = variable.second;
       results.push_back(r);
     }
-
-    standard_freeproc(proc_info);
   }
 
-  closeproc(proc);
-
   return results;
 }
 }
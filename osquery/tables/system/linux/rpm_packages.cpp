@@ -9,9 +9,11 @@
  */
 
 #include <ctime>
+#include <mutex>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include <rpm/rpmlib.h>
 #include <rpm/header.h>
@@ -24,6 +26,28 @@
 namespace osquery {
 namespace tables {
 
+/// The RPM database file changed by every package transaction.
+const std::string kRPMDatabasePath = "/var/lib/rpm/Packages";
+
+/**
+ * @brief The packages generated from the RPM database at a file identity.
+ *
+ * Reading the RPM database takes seconds, but it only changes when packages
+ * are installed or removed. Rows are reused while the database's device,
+ * inode, and modification time are unchanged.
+ */
+struct RpmPackagesCache {
+  dev_t device;
+  ino_t inode;
+  struct timespec mtime;
+  QueryData results;
+  std::mutex mutex;
+
+  RpmPackagesCache() : device(0), inode(0) { mtime = {0, 0}; }
+};
+
+static RpmPackagesCache kRpmPackagesCache;
+
 /**
  * @brief Return a string representation of the RPM tag type.
  *
@@ -60,7 +84,7 @@ std::string getRpmAttribute(const Header& header, rpmTag tag, const rpmtd& td) {
   return result;
 }
 
-QueryData genRpms(QueryContext& context) {
+QueryData genRpmPackages() {
   QueryData results;
 
   // The following implementation uses http://rpm.org/api/4.11.1/
@@ -98,5 +122,27 @@ QueryData genRpms(QueryContext& context) {
 
   return results;
 }
+
+QueryData genRpms(QueryContext& context) {
+  struct stat database;
+  if (::stat(kRPMDatabasePath.c_str(), &database) != 0) {
+    // Without a database identity the result cannot be cached.
+    return genRpmPackages();
+  }
+
+  std::lock_guard<std::mutex> lock(kRpmPackagesCache.mutex);
+  auto& cache = kRpmPackagesCache;
+  if (cache.inode != database.st_ino || cache.device != database.st_dev ||
+      cache.mtime.tv_sec != database.st_mtim.tv_sec ||
+      cache.mtime.tv_nsec != database.st_mtim.tv_nsec ||
+      cache.results.empty()) {
+    // The database changed, or the last read failed.
+    cache.results = genRpmPackages();
+    cache.device = database.st_dev;
+    cache.inode = database.st_ino;
+    cache.mtime = database.st_mtim;
+  }
+  return cache.results;
+}
+}
 }
-}
\ No newline at end of file
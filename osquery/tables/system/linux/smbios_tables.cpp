@@ -28,16 +28,15 @@ void genSMBIOSFromDMI(size_t base, size_t length, QueryData& results) {
   // Linux will expose the SMBIOS/DMI entry point structures, which contain
   // a member variable with the DMI tables start address and size.
   // This applies to both the EFI-variable and physical memory search.
-  uint8_t* data;
-  auto status = osquery::readRawMem(base, length, (void**)&data);
+  RawMemView data;
+  auto status = osquery::mapRawMem(base, length, data);
   if (!status.ok()) {
     VLOG(1) << "Could not read DMI tables memory";
     return;
   }
 
-  // Attempt to parse tables from allocated data.
-  genSMBIOSTables(data, length, results);
-  free(data);
+  // Attempt to parse tables from the mapped data.
+  genSMBIOSTables(data.get(), length, results);
 }
 
 void genEFISystabTables(QueryData& results) {
@@ -46,26 +45,25 @@ void genEFISystabTables(QueryData& results) {
 }
 
 void genRawSMBIOSTables(QueryData& results) {
-  uint8_t* data;
-  auto status = osquery::readRawMem(
-      kLinuxSMBIOSRawAddress_, kLinuxSMBIOSRawLength_, (void**)&data);
+  RawMemView view;
+  auto status = osquery::mapRawMem(
+      kLinuxSMBIOSRawAddress_, kLinuxSMBIOSRawLength_, view);
   if (!status.ok()) {
     VLOG(1) << "Could not read SMBIOS memory";
     return;
   }
 
   // Search for the SMBIOS/DMI tables magic header string.
+  auto data = view.get();
   size_t offset;
   for (offset = 0; offset <= 0xFFF0; offset += 16) {
     // Could look for "_SM_" for the SMBIOS header, but the DMI header exists
     // in both SMBIOS and the legacy DMI spec.
     if (memcmp(data + offset, "_DMI_", 5) == 0) {
-      auto dmi_data = (DMIEntryPoint*)(data + offset);
+      auto dmi_data = (const DMIEntryPoint*)(data + offset);
       genSMBIOSFromDMI(dmi_data->tableAddress, dmi_data->tableLength, results);
     }
   }
-
-  free(data);
 }
 
 QueryData genSMBIOSTables(QueryContext& context) {
@@ -78,6 +76,8 @@ QueryData genSMBIOSTables(QueryContext& context) {
     genRawSMBIOSTables(results);
   }
 
+  // The rows are copied out of the views, no window stays mapped.
+  osquery::releaseRawMem();
   return results;
 }
 }
@@ -8,46 +8,51 @@
  *
  */
 
-#include <set>
-#include <mutex>
-#include <vector>
+#include <cstdlib>
 #include <string>
 
-#include <pwd.h>
-
 #include <osquery/core.h>
 #include <osquery/tables.h>
 
+#include "osquery/tables/system/user_groups.h"
+
 namespace osquery {
 namespace tables {
 
-std::mutex pwdEnumerationMutex;
+void genUserRow(const UserEntry& user, QueryData& results) {
+  Row r;
+  r["uid"] = BIGINT(user.uid);
+  r["gid"] = BIGINT(user.gid);
+  r["uid_signed"] = BIGINT((int32_t) user.uid);
+  r["gid_signed"] = BIGINT((int32_t) user.gid);
+  r["username"] = TEXT(user.username);
+  r["description"] = TEXT(user.description);
+  r["directory"] = TEXT(user.directory);
+  r["shell"] = TEXT(user.shell);
+  results.push_back(r);
+}
 
 QueryData genUsers(QueryContext& context) {
-  std::lock_guard<std::mutex> lock(pwdEnumerationMutex);
   QueryData results;
-  struct passwd *pwd = nullptr;
-  std::set<long> users_in;
-
-  while ((pwd = getpwent()) != NULL) {
-    if (std::find(users_in.begin(), users_in.end(), pwd->pw_uid) ==
-        users_in.end()) {
-      Row r;
-      r["uid"] = BIGINT(pwd->pw_uid);
-      r["gid"] = BIGINT(pwd->pw_gid);
-      r["uid_signed"] = BIGINT((int32_t) pwd->pw_uid);
-      r["gid_signed"] = BIGINT((int32_t) pwd->pw_gid);
-      r["username"] = TEXT(pwd->pw_name);
-      r["description"] = TEXT(pwd->pw_gecos);
-      r["directory"] = TEXT(pwd->pw_dir);
-      r["shell"] = TEXT(pwd->pw_shell);
-      results.push_back(r);
-      users_in.insert(pwd->pw_uid);
+
+  // A uid constraint is answered without enumerating every user.
+  auto uids = context.constraints["uid"].getAll(EQUALS);
+  if (!uids.empty()) {
+    for (const auto& expr : uids) {
+      char* end = nullptr;
+      auto uid = std::strtoull(expr.c_str(), &end, 10);
+      UserEntry user;
+      if (!expr.empty() && *end == 0 && getUserByUid(uid, user).ok()) {
+        genUserRow(user, results);
+      }
     }
+    return results;
   }
-  endpwent();
-  users_in.clear();
 
+  auto snapshot = getUserSnapshot();
+  for (const auto& user : snapshot->users) {
+    genUserRow(user, results);
+  }
   return results;
 }
 }
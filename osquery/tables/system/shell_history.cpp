@@ -8,83 +8,221 @@
  *
  */
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
-#include <pwd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string/trim.hpp>
 
 #include <osquery/core.h>
+#include <osquery/database/db_handle.h>
+#include <osquery/flags.h>
 #include <osquery/tables.h>
 #include <osquery/filesystem.h>
 #include <osquery/logger.h>
-#include <osquery/sql.h>
+
+#include "osquery/tables/system/user_groups.h"
 
 namespace osquery {
 namespace tables {
 
+DEFINE_osquery_flag(bool,
+                    shell_history_incremental,
+                    false,
+                    "Scheduled queries return only history appended since "
+                    "their last run.");
+
 const std::vector<std::string> kShellHistoryFiles = {
     ".bash_history", ".zsh_history", ".zhistory", ".history",
 };
 
-Status genShellHistoryForUser(const Row& row, QueryData& results) {
-  std::string username;
-  std::string directory;
+/// The size of each read of an appended history file.
+const size_t kShellHistoryReadSize = 64 * 1024;
+
+/// A username and home directory of a user with shell history.
+typedef std::pair<std::string, std::string> HistoryUser;
+
+/**
+ * @brief Read the lines appended to a history file since the query's last run.
+ *
+ * The file's inode and the offset after its last complete line are kept in
+ * the backing store, per scheduled query. A new inode, or a file shorter than
+ * the offset, means the history was rewritten and is read from the start.
+ * The generator records where its rows stopped, and the scheduler stores
+ * that offset once the run's rows are logged.
+ *
+ * @param path the history file.
+ * @param offsets the running query's read offsets.
+ * @param stamp output the file's inode, to store with the new offset.
+ * @param offset output the offset the content was read from.
+ * @param content output the complete lines appended since the offset.
+ */
+Status readAppendedHistory(const std::string& path,
+                           const ReadOffsetsRef& offsets,
+                           std::string& stamp,
+                           off_t& offset,
+                           std::string& content) {
+  std::shared_ptr<DBHandle> db;
   try {
-    username = row.at("username");
-    directory = row.at("directory");
-  } catch (const std::out_of_range& e) {
-    return Status(1, "Error retrieving query column");
+    db = DBHandle::getInstance();
+  } catch (const std::runtime_error& e) {
+    return Status(1, e.what());
+  }
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return Status(1, "Cannot open: " + path);
   }
 
-  std::vector<std::string> history_files;
-  if (!osquery::listFilesInDirectory(directory, history_files).ok()) {
-    return Status(1, "Cannot list files in: " + directory);
+  struct stat file;
+  if (::fstat(fd, &file) != 0) {
+    ::close(fd);
+    return Status(1, "Cannot stat: " + path);
   }
 
+  // Offsets are stored as "inode:offset".
+  stamp = std::to_string(file.st_ino);
+  offset = 0;
+  std::string value;
+  if (db->Get(kFileOffsets, offsets->key(path), value).ok()) {
+    auto separator = value.find(':');
+    if (separator != std::string::npos &&
+        value.substr(0, separator) == stamp) {
+      offset = std::strtoll(value.c_str() + separator + 1, nullptr, 10);
+    }
+  }
+  if (offset > file.st_size) {
+    offset = 0;
+  }
+
+  std::vector<char> buffer(kShellHistoryReadSize);
+  while (true) {
+    auto bytes =
+        ::pread(fd, buffer.data(), buffer.size(), offset + content.size());
+    if (bytes <= 0) {
+      break;
+    }
+    content.append(buffer.data(), bytes);
+  }
+  ::close(fd);
+
+  // A partially written last line is read again by the next run.
+  auto last_line = content.rfind('\n');
+  content.resize((last_line == std::string::npos) ? 0 : last_line + 1);
+  return Status(0, "OK");
+}
+
+void genShellHistoryForUser(const HistoryUser& user,
+                            QueryContext& context,
+                            QueryData& results) {
   for (const auto& hfile : kShellHistoryFiles) {
-    boost::filesystem::path history_file = directory;
+    boost::filesystem::path history_file = user.second;
     history_file /= hfile;
 
     std::string history_content;
-    if (!readFile(history_file, history_content).ok()) {
+    std::string stamp;
+    off_t offset = 0;
+    // Queries outside the schedule have no offsets and read in full.
+    const auto& offsets = context.events.offsets;
+    bool incremental = (FLAGS_shell_history_incremental && offsets != nullptr);
+    auto status = (incremental)
+                      ? readAppendedHistory(history_file.string(),
+                                            offsets,
+                                            stamp,
+                                            offset,
+                                            history_content)
+                      : readFile(history_file, history_content);
+    if (!status.ok()) {
       // Cannot read a specific history file.
       continue;
     }
 
-    for (const auto& line : split(history_content, "\n")) {
+    // Lines are consumed in order, a limited query stops at a line boundary.
+    size_t position = 0;
+    bool limited = false;
+    while (position < history_content.size()) {
+      if (context.limitReached(results.size())) {
+        limited = true;
+        break;
+      }
+
+      auto end = history_content.find('\n', position);
+      if (end == std::string::npos) {
+        end = history_content.size();
+      }
+      auto line = history_content.substr(position, end - position);
+      position = end + 1;
+      boost::algorithm::trim(line);
+      if (line.empty()) {
+        continue;
+      }
+
       Row r;
-      r["username"] = username;
+      r["username"] = user.first;
       r["command"] = line;
       r["history_file"] = history_file.string();
       results.push_back(r);
     }
+
+    if (incremental) {
+      // The next run reads from the first line this run did not return.
+      offset += std::min(position, history_content.size());
+      offsets->set(history_file.string(),
+                   stamp + ":" + std::to_string(offset));
+    }
+    if (limited) {
+      return;
+    }
   }
-  return Status(0, "OK");
 }
 
-QueryData genShellHistory(QueryContext& context) {
-  QueryData results;
-  std::string sql_str;
-
-  if (!getuid()) {
-    sql_str = "SELECT username,directory FROM users";
-  } else {
-    struct passwd* pwd = nullptr;
-    pwd = getpwuid(getuid());
-    // TODO: https://github.com/facebook/osquery/issues/244
-    sql_str = "SELECT username,directory FROM users WHERE username = '" +
-              std::string(pwd->pw_name) + "';";
+/**
+ * @brief Find the home directories of the users with readable history.
+ *
+ * Unprivileged processes only read their own user's history. Usernames are
+ * looked up directly if the query constrains them, otherwise the cached user
+ * snapshot is used.
+ */
+std::vector<HistoryUser> getHistoryUsers(QueryContext& context) {
+  std::vector<HistoryUser> users;
+
+  UserEntry user;
+  if (getuid() != 0) {
+    if (getUserByUid(getuid(), user).ok()) {
+      users.push_back(HistoryUser(user.username, user.directory));
+    }
+    return users;
   }
 
-  auto sql = SQL(sql_str);
+  auto usernames = context.constraints["username"].getAll(EQUALS);
+  if (!usernames.empty()) {
+    for (const auto& username : usernames) {
+      if (getUserByName(username, user).ok()) {
+        users.push_back(HistoryUser(user.username, user.directory));
+      }
+    }
+    return users;
+  }
 
-  if (!sql.ok()) {
-    LOG(ERROR) << "Error executing SQL: " << sql.getMessageString();
-    return results;
+  auto snapshot = getUserSnapshot();
+  for (const auto& entry : snapshot->users) {
+    users.push_back(HistoryUser(entry.username, entry.directory));
   }
+  return users;
+}
 
-  for (const auto& row : sql.rows()) {
-    auto status = genShellHistoryForUser(row, results);
+QueryData genShellHistory(QueryContext& context) {
+  QueryData results;
+
+  for (const auto& user : getHistoryUsers(context)) {
+    if (context.limitReached(results.size())) {
+      break;
+    }
+    genShellHistoryForUser(user, context, results);
   }
 
   return results;
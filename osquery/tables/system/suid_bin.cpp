@@ -12,14 +12,12 @@
 #include <grp.h>
 #include <sys/stat.h>
 
-#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <osquery/filesystem.h>
 #include <osquery/logger.h>
 #include <osquery/tables.h>
 
-namespace fs = boost::filesystem;
-
 namespace osquery {
 namespace tables {
 
@@ -33,16 +31,9 @@ std::vector<std::string> kBinarySearchPaths = {
   "/tmp",
 };
 
-Status genBin(const fs::path& path, int perms, QueryData& results) {
-  struct stat info;
-  // store user and group
-  if (stat(path.c_str(), &info) != 0) {
-    return Status(1, "stat failed");
-  }
-
+Status genBin(const std::string& path, const struct stat& info, Row& r) {
   // store path
-  Row r;
-  r["path"] = path.string();
+  r["path"] = path;
   struct passwd *pw = getpwuid(info.st_uid);
   struct group *gr = getgrgid(info.st_gid);
 
@@ -65,70 +56,62 @@ Status genBin(const fs::path& path, int perms, QueryData& results) {
   r["groupname"] = group;
 
   r["permissions"] = "";
-  if ((perms & 04000) == 04000) {
+  if ((info.st_mode & 04000) == 04000) {
     r["permissions"] += "S";
   }
 
-  if ((perms & 02000) == 02000) {
+  if ((info.st_mode & 02000) == 02000) {
     r["permissions"] += "G";
   }
 
-  results.push_back(r);
   return Status(0, "OK");
 }
 
-bool isSuidBin(const fs::path& path, int perms) {
-  if (!fs::is_regular_file(path)) {
+bool isSuidBin(const struct stat& info) {
+  if (!S_ISREG(info.st_mode)) {
     return false;
   }
 
-  if ((perms & 04000) == 04000 || (perms & 02000) == 02000) {
+  if ((info.st_mode & 04000) == 04000 || (info.st_mode & 02000) == 02000) {
     return true;
   }
   return false;
 }
 
-void genSuidBinsFromPath(const std::string& path, QueryData& results) {
-  if (!pathExists(path).ok()) {
-    // Creating an iterator on a missing path will except.
-    return;
-  }
-
-  auto it = fs::recursive_directory_iterator(fs::path(path));
-  fs::recursive_directory_iterator end;
-  while (it != end) {
-    fs::path path = *it;
-    try {
-      // Do not traverse symlinked directories.
-      if (fs::is_directory(path) && fs::is_symlink(path)) {
-        it.no_push();
-      }
-
-      int perms = it.status().permissions();
-      if (isSuidBin(path, perms)) {
-        // Only emit suid bins.
-        genBin(path, perms, results);
+/**
+ * @brief Walk the binary search paths, emitting one suid binary at a time.
+ *
+ * The paths are walked in parallel, without following symlinks or leaving
+ * a path's device. The walk is suspended between rows so a query with a
+ * LIMIT stops the filesystem traversal early.
+ */
+class SuidBinCursor : public TableCursor {
+ public:
+  explicit SuidBinCursor(const QueryContext& context)
+      : context_(context),
+        walker_(kBinarySearchPaths, FilesystemWalkOptions()) {}
+
+  bool next(Row& r) {
+    std::string path;
+    struct stat info;
+    while (!context_.cancelled() && walker_.next(path, info)) {
+      // Only emit suid bins.
+      if (isSuidBin(info) && genBin(path, info, r).ok()) {
+        return true;
       }
-
-      ++it;
-    } catch (fs::filesystem_error& e) {
-      VLOG(1) << "Cannot read binary from " << path;
-      it.no_push();
-      // Try to recover, otherwise break.
-      try { ++it; } catch(fs::filesystem_error& e) { break; }
     }
+    return false;
   }
-}
 
-QueryData genSuidBin(QueryContext& context) {
-  QueryData results;
+ private:
+  /// The query's context, which outlives the cursor.
+  const QueryContext& context_;
+  FilesystemWalker walker_;
+};
 
+TableCursorRef genSuidBin(QueryContext& context) {
   // Todo: add hidden column to select on that triggers non-std path searches.
-  for (const auto& path : kBinarySearchPaths) {
-    genSuidBinsFromPath(path, results);
-  }
-
-  return results;
+  return std::make_shared<SuidBinCursor>(context);
 }
 }
 }
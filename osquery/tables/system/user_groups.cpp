@@ -0,0 +1,268 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <cerrno>
+#include <ctime>
+#include <mutex>
+
+#include <grp.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <osquery/flags.h>
+
+#include "osquery/tables/system/user_groups.h"
+
+namespace osquery {
+namespace tables {
+
+DEFINE_osquery_flag(int32,
+                    users_cache_timeout,
+                    60,
+                    "Seconds a users and groups snapshot is reused.");
+
+const std::string kPasswdPath = "/etc/passwd";
+const std::string kGroupPath = "/etc/group";
+
+/// The identity of a database file, a change invalidates its snapshot.
+struct UserGroupsFile {
+  dev_t device;
+  ino_t inode;
+  time_t mtime;
+  time_t ctime;
+  off_t size;
+
+  UserGroupsFile() : device(0), inode(0), mtime(0), ctime(0), size(0) {}
+
+  bool operator==(const UserGroupsFile& other) const {
+    return device == other.device && inode == other.inode &&
+           mtime == other.mtime && ctime == other.ctime && size == other.size;
+  }
+};
+
+/// A snapshot with the identity of its file and the time it was created.
+template <typename T>
+struct UserGroupsCache {
+  std::shared_ptr<const T> snapshot;
+  UserGroupsFile file;
+  time_t created;
+
+  UserGroupsCache() : created(0) {}
+};
+
+static UserGroupsCache<UserSnapshot> kUserCache;
+static UserGroupsCache<GroupSnapshot> kGroupCache;
+
+/// Protects the caches, the database enumerations are not reentrant.
+static std::mutex kUserGroupsMutex;
+
+static UserGroupsFile getUserGroupsFile(const std::string& path) {
+  UserGroupsFile file;
+  struct stat info;
+  if (::stat(path.c_str(), &info) == 0) {
+    file.device = info.st_dev;
+    file.inode = info.st_ino;
+    file.mtime = info.st_mtime;
+    file.ctime = info.st_ctime;
+    file.size = info.st_size;
+  }
+  return file;
+}
+
+/// True if a cached snapshot may be used, the mutex must be held.
+template <typename T>
+static bool isCurrent(const UserGroupsCache<T>& cache,
+                      const UserGroupsFile& file) {
+  return cache.snapshot != nullptr && cache.file == file &&
+         std::time(nullptr) - cache.created < FLAGS_users_cache_timeout;
+}
+
+static void fillUserEntry(const struct passwd* pwd, UserEntry& user) {
+  user.uid = pwd->pw_uid;
+  user.gid = pwd->pw_gid;
+  user.username = (pwd->pw_name != nullptr) ? pwd->pw_name : "";
+  user.description = (pwd->pw_gecos != nullptr) ? pwd->pw_gecos : "";
+  user.directory = (pwd->pw_dir != nullptr) ? pwd->pw_dir : "";
+  user.shell = (pwd->pw_shell != nullptr) ? pwd->pw_shell : "";
+}
+
+static void fillGroupEntry(const struct group* grp, GroupEntry& group) {
+  group.gid = grp->gr_gid;
+  group.groupname = (grp->gr_name != nullptr) ? grp->gr_name : "";
+}
+
+/// The buffer size for the reentrant lookups, grown on ERANGE.
+static size_t getLookupBufferSize() {
+  auto size = ::sysconf(_SC_GETPW_R_SIZE_MAX);
+  return (size > 0) ? size : 16 * 1024;
+}
+
+std::shared_ptr<const UserSnapshot> getUserSnapshot() {
+  std::lock_guard<std::mutex> lock(kUserGroupsMutex);
+  auto file = getUserGroupsFile(kPasswdPath);
+  if (isCurrent(kUserCache, file)) {
+    return kUserCache.snapshot;
+  }
+
+  auto snapshot = std::make_shared<UserSnapshot>();
+  struct passwd* pwd = nullptr;
+  setpwent();
+  while ((pwd = getpwent()) != nullptr) {
+    if (snapshot->uids.count(pwd->pw_uid) > 0) {
+      continue;
+    }
+
+    UserEntry user;
+    fillUserEntry(pwd, user);
+    snapshot->uids[user.uid] = snapshot->users.size();
+    snapshot->usernames.insert(
+        std::make_pair(user.username, snapshot->users.size()));
+    snapshot->users.push_back(std::move(user));
+  }
+  endpwent();
+
+  kUserCache.snapshot = snapshot;
+  kUserCache.file = file;
+  kUserCache.created = std::time(nullptr);
+  return snapshot;
+}
+
+std::shared_ptr<const GroupSnapshot> getGroupSnapshot() {
+  std::lock_guard<std::mutex> lock(kUserGroupsMutex);
+  auto file = getUserGroupsFile(kGroupPath);
+  if (isCurrent(kGroupCache, file)) {
+    return kGroupCache.snapshot;
+  }
+
+  auto snapshot = std::make_shared<GroupSnapshot>();
+  struct group* grp = nullptr;
+  setgrent();
+  while ((grp = getgrent()) != nullptr) {
+    if (snapshot->gids.count(grp->gr_gid) > 0) {
+      continue;
+    }
+
+    GroupEntry group;
+    fillGroupEntry(grp, group);
+    snapshot->gids[group.gid] = snapshot->groups.size();
+    snapshot->groups.push_back(std::move(group));
+  }
+  endgrent();
+
+  kGroupCache.snapshot = snapshot;
+  kGroupCache.file = file;
+  kGroupCache.created = std::time(nullptr);
+  return snapshot;
+}
+
+/// The user snapshot if it is current, otherwise nullptr.
+static std::shared_ptr<const UserSnapshot> getCurrentUserSnapshot() {
+  auto file = getUserGroupsFile(kPasswdPath);
+  std::lock_guard<std::mutex> lock(kUserGroupsMutex);
+  return isCurrent(kUserCache, file) ? kUserCache.snapshot : nullptr;
+}
+
+/// The group snapshot if it is current, otherwise nullptr.
+static std::shared_ptr<const GroupSnapshot> getCurrentGroupSnapshot() {
+  auto file = getUserGroupsFile(kGroupPath);
+  std::lock_guard<std::mutex> lock(kUserGroupsMutex);
+  return isCurrent(kGroupCache, file) ? kGroupCache.snapshot : nullptr;
+}
+
+Status getUserByUid(uid_t uid, UserEntry& user) {
+  auto snapshot = getCurrentUserSnapshot();
+  if (snapshot != nullptr) {
+    auto index = snapshot->uids.find(uid);
+    if (index != snapshot->uids.end()) {
+      user = snapshot->users[index->second];
+      return Status(0, "OK");
+    }
+  }
+
+  // Directory services may not enumerate every user they can look up.
+  std::vector<char> buffer(getLookupBufferSize());
+  struct passwd pwd;
+  struct passwd* result = nullptr;
+  int error = 0;
+  while ((error = getpwuid_r(
+              uid, &pwd, buffer.data(), buffer.size(), &result)) == ERANGE) {
+    buffer.resize(buffer.size() * 2);
+  }
+
+  if (error != 0 || result == nullptr) {
+    return Status(1, "Unknown uid: " + std::to_string(uid));
+  }
+  fillUserEntry(result, user);
+  return Status(0, "OK");
+}
+
+Status getUserByName(const std::string& username, UserEntry& user) {
+  auto snapshot = getCurrentUserSnapshot();
+  if (snapshot != nullptr) {
+    auto index = snapshot->usernames.find(username);
+    if (index != snapshot->usernames.end()) {
+      user = snapshot->users[index->second];
+      return Status(0, "OK");
+    }
+  }
+
+  std::vector<char> buffer(getLookupBufferSize());
+  struct passwd pwd;
+  struct passwd* result = nullptr;
+  int error = 0;
+  while ((error = getpwnam_r(username.c_str(),
+                             &pwd,
+                             buffer.data(),
+                             buffer.size(),
+                             &result)) == ERANGE) {
+    buffer.resize(buffer.size() * 2);
+  }
+
+  if (error != 0 || result == nullptr) {
+    return Status(1, "Unknown user: " + username);
+  }
+  fillUserEntry(result, user);
+  return Status(0, "OK");
+}
+
+Status getGroupByGid(gid_t gid, GroupEntry& group) {
+  auto snapshot = getCurrentGroupSnapshot();
+  if (snapshot != nullptr) {
+    auto index = snapshot->gids.find(gid);
+    if (index != snapshot->gids.end()) {
+      group = snapshot->groups[index->second];
+      return Status(0, "OK");
+    }
+  }
+
+  std::vector<char> buffer(getLookupBufferSize());
+  struct group grp;
+  struct group* result = nullptr;
+  int error = 0;
+  while ((error = getgrgid_r(
+              gid, &grp, buffer.data(), buffer.size(), &result)) == ERANGE) {
+    buffer.resize(buffer.size() * 2);
+  }
+
+  if (error != 0 || result == nullptr) {
+    return Status(1, "Unknown gid: " + std::to_string(gid));
+  }
+  fillGroupEntry(result, group);
+  return Status(0, "OK");
+}
+
+void invalidateUserGroupSnapshots() {
+  std::lock_guard<std::mutex> lock(kUserGroupsMutex);
+  kUserCache.snapshot = nullptr;
+  kGroupCache.snapshot = nullptr;
+}
+}
+}
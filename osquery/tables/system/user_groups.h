@@ -0,0 +1,90 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <osquery/status.h>
+
+namespace osquery {
+namespace tables {
+
+/// The fields of a password database entry used by tables.
+struct UserEntry {
+  uid_t uid;
+  gid_t gid;
+  std::string username;
+  std::string description;
+  std::string directory;
+  std::string shell;
+
+  UserEntry() : uid(0), gid(0) {}
+};
+
+/// The fields of a group database entry used by tables.
+struct GroupEntry {
+  gid_t gid;
+  std::string groupname;
+
+  GroupEntry() : gid(0) {}
+};
+
+/// The enumerated users, the first entry of each uid, in database order.
+struct UserSnapshot {
+  std::vector<UserEntry> users;
+  /// Index of users by uid.
+  std::map<uid_t, size_t> uids;
+  /// Index of users by username, the first entry of each name.
+  std::map<std::string, size_t> usernames;
+};
+
+/// The enumerated groups, the first entry of each gid, in database order.
+struct GroupSnapshot {
+  std::vector<GroupEntry> groups;
+  /// Index of groups by gid.
+  std::map<gid_t, size_t> gids;
+};
+
+/**
+ * @brief The users of the password database, cached between queries.
+ *
+ * Enumerating the database through NSS may query a directory service and
+ * take seconds. A snapshot is reused until /etc/passwd changes, an event
+ * invalidates it, or it is older than the users_cache_timeout flag.
+ */
+std::shared_ptr<const UserSnapshot> getUserSnapshot();
+
+/// The groups of the group database, cached like the user snapshot.
+std::shared_ptr<const GroupSnapshot> getGroupSnapshot();
+
+/**
+ * @brief Look up a single user.
+ *
+ * A current snapshot's index is used if one exists, otherwise the user is
+ * looked up with getpwuid_r without enumerating the database.
+ */
+Status getUserByUid(uid_t uid, UserEntry& user);
+
+/// Look up a single user by name, see getUserByUid.
+Status getUserByName(const std::string& username, UserEntry& user);
+
+/// Look up a single group, see getUserByUid.
+Status getGroupByGid(gid_t gid, GroupEntry& group);
+
+/// Drop the user and group snapshots, such as when /etc/passwd changed.
+void invalidateUserGroupSnapshots();
+}
+}
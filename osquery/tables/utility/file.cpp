@@ -8,6 +8,14 @@
  *
  */
 
+#include <cstdio>
+#include <set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <boost/filesystem.hpp>
 
 #include <osquery/tables.h>
@@ -16,21 +24,110 @@
 namespace osquery {
 namespace tables {
 
+/**
+ * @brief Fill a file's row from a single lstat result.
+ *
+ * The target of a symlink is only stat'd to report whether it is a file or
+ * a directory, as is_file and is_dir follow links.
+ */
+void genFileInfo(const std::string& path,
+                 const std::string& directory,
+                 const struct stat& info,
+                 QueryData& results) {
+  Row r;
+  r["path"] = path;
+  r["directory"] = directory;
+  r["filename"] = boost::filesystem::path(path).filename().string();
+
+  r["inode"] = BIGINT(info.st_ino);
+  r["uid"] = BIGINT(info.st_uid);
+  r["gid"] = BIGINT(info.st_gid);
+  char mode[8];
+  snprintf(mode, sizeof(mode), "%04o", (unsigned int)(info.st_mode & 07777));
+  r["mode"] = TEXT(mode);
+  r["device"] = BIGINT(info.st_rdev);
+  r["size"] = BIGINT(info.st_size);
+  r["block_size"] = INTEGER(info.st_blksize);
+  r["atime"] = BIGINT(info.st_atime);
+  r["mtime"] = BIGINT(info.st_mtime);
+  r["ctime"] = BIGINT(info.st_ctime);
+  r["hard_links"] = INTEGER(info.st_nlink);
+
+  auto type = info.st_mode;
+  struct stat target;
+  if (S_ISLNK(info.st_mode)) {
+    type = (::stat(path.c_str(), &target) == 0) ? target.st_mode : 0;
+  }
+  r["is_file"] = INTEGER(S_ISREG(type));
+  r["is_dir"] = INTEGER(S_ISDIR(type));
+  r["is_link"] = INTEGER(S_ISLNK(info.st_mode));
+
+  results.push_back(r);
+}
+
+/// Generate a row for a path, if it exists.
+void genFilePath(const std::string& path, QueryData& results) {
+  struct stat info;
+  if (::lstat(path.c_str(), &info) == 0) {
+    auto directory = boost::filesystem::path(path).parent_path().string();
+    genFileInfo(path, directory, info, results);
+  }
+}
+
+/// Generate a row for each entry of a directory.
+void genFileDirectory(const std::string& directory,
+                      QueryContext& context,
+                      QueryData& results) {
+  auto listing = ::opendir(directory.c_str());
+  if (listing == nullptr) {
+    return;
+  }
+
+  // Entries are stat'd relative to the open directory.
+  auto prefix = directory;
+  if (prefix.empty() || prefix.back() != '/') {
+    prefix += '/';
+  }
+
+  struct dirent* entry = nullptr;
+  while (!context.cancelled() && (entry = ::readdir(listing)) != nullptr) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+
+    struct stat info;
+    if (::fstatat(::dirfd(listing),
+                  entry->d_name,
+                  &info,
+                  AT_SYMLINK_NOFOLLOW) == 0) {
+      genFileInfo(prefix + name, directory, info, results);
+    }
+  }
+  ::closedir(listing);
+}
+
 QueryData genFile(QueryContext& context) {
   QueryData results;
 
-  auto paths = context.constraints["path"].getAll(EQUALS);
-  for (const auto& path_string : paths) {
-    boost::filesystem::path path = path_string;
+  for (const auto& path : context.constraints["path"].getAll(EQUALS)) {
+    genFilePath(path, results);
+  }
 
-    Row r;
-    r["path"] = path.string();
-    r["filename"] = path.filename().string();
-    r["is_file"] = INTEGER(boost::filesystem::is_regular_file(path));
-    r["is_dir"] = INTEGER(boost::filesystem::is_directory(path));
-    r["is_link"] = INTEGER(boost::filesystem::is_symlink(path));
+  // Only LIKE patterns resolved exactly generate rows, listing each directory
+  // once. SQLite applies every LIKE to the results.
+  std::vector<std::string> paths;
+  resolveLikePatterns(context.constraints["path"].getAll(LIKE), paths);
+  std::set<std::string> resolved;
+  for (const auto& path : paths) {
+    if (resolved.insert(path).second) {
+      genFilePath(path, results);
+    }
+  }
 
-    results.push_back(r);
+  auto directories = context.constraints["directory"].getAll(EQUALS);
+  for (const auto& directory : directories) {
+    genFileDirectory(directory, context, results);
   }
 
   return results;
@@ -8,20 +8,155 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <set>
+
 #include <boost/filesystem.hpp>
 
+#include <osquery/database/hash_cache.h>
+#include <osquery/dispatcher.h>
 #include <osquery/filesystem.h>
+#include <osquery/flags.h>
 #include <osquery/hash.h>
 #include <osquery/tables.h>
 
 namespace osquery {
+
+DEFINE_osquery_flag(int32,
+                    hash_parallelism,
+                    4,
+                    "Files of a directory hashed concurrently.");
+
 namespace tables {
 
+/// Fill a row's digests, only the digests the query selects were computed.
+static void setHashes(MultiHashes&& hashes, Row& r) {
+  r["md5"] = std::move(hashes.md5);
+  r["sha1"] = std::move(hashes.sha1);
+  r["sha256"] = std::move(hashes.sha256);
+}
+
+/// The hasher of the calling thread, workers reuse it for each of their files.
+static FileHasher& getThreadHasher() {
+  static thread_local FileHasher hasher;
+  return hasher;
+}
+
+/**
+ * @brief Hash a single file using a Dispatcher worker.
+ *
+ * The task is hashed by the first of a worker or the table generator to
+ * claim it, so rows are never blocked on a Dispatcher with no idle workers.
+ */
+class HashTask : public apache::thrift::concurrency::Runnable {
+ public:
+  HashTask(const std::string& path, int mask)
+      : path_(path),
+        mask_(mask),
+        claimed_(false),
+        hashes_(promise_.get_future().share()) {}
+
+  void run() {
+    if (claim()) {
+      hash();
+    }
+  }
+
+  /// Get the digests, hashing the file now if no worker started.
+  MultiHashes get() {
+    if (claim()) {
+      hash();
+    }
+    return hashes_.get();
+  }
+
+  /// Claim the task such that a worker will not hash the file.
+  bool claim() {
+    bool expected = false;
+    return claimed_.compare_exchange_strong(expected, true);
+  }
+
+ private:
+  void hash() {
+    promise_.set_value(
+        hashMultiFromFileCached(getThreadHasher(), mask_, path_));
+  }
+
+ private:
+  std::string path_;
+  int mask_;
+  std::atomic<bool> claimed_;
+  std::promise<MultiHashes> promise_;
+  std::shared_future<MultiHashes> hashes_;
+};
+
+/// Hash the files of a directory, emitting rows sorted by path.
+static void genHashForDirectory(const std::string& directory,
+                                int mask,
+                                QueryContext& context,
+                                QueryData& results) {
+  std::vector<std::pair<std::string, bool> > entries;
+  boost::filesystem::directory_iterator begin(directory), end;
+  for (; begin != end; ++begin) {
+    entries.push_back(std::make_pair(
+        begin->path().string(),
+        boost::filesystem::is_regular_file(begin->status())));
+  }
+  std::sort(entries.begin(), entries.end());
+
+  // Workers hash a bounded number of files ahead of the emitted row.
+  size_t window = std::max(FLAGS_hash_parallelism, 1);
+  std::deque<std::shared_ptr<HashTask> > pending;
+  size_t emitted = 0;
+  for (size_t i = 0; i < entries.size() || !pending.empty();) {
+    if (context.cancelled()) {
+      // Workers skip the claimed tasks.
+      for (auto& task : pending) {
+        task->claim();
+      }
+      return;
+    }
+
+    if (i < entries.size() && pending.size() < window) {
+      auto task = (entries[i].second)
+                      ? std::make_shared<HashTask>(entries[i].first, mask)
+                      : nullptr;
+      if (task != nullptr && window > 1) {
+        Dispatcher::getInstance().add(task);
+      }
+      pending.push_back(task);
+      i++;
+      continue;
+    }
+
+    Row r;
+    r["path"] = entries[emitted++].first;
+    r["directory"] = directory;
+    if (pending.front() != nullptr) {
+      setHashes(pending.front()->get(), r);
+    }
+    pending.pop_front();
+    results.push_back(r);
+  }
+}
+
 QueryData genHash(QueryContext& context) {
   QueryData results;
 
+  int mask = 0;
+  mask |= context.isColumnUsed("md5") ? HASH_TYPE_MD5 : 0;
+  mask |= context.isColumnUsed("sha1") ? HASH_TYPE_SHA1 : 0;
+  mask |= context.isColumnUsed("sha256") ? HASH_TYPE_SHA256 : 0;
+
   auto paths = context.constraints["path"].getAll(EQUALS);
   for (const auto& path_string : paths) {
+    if (context.cancelled()) {
+      return results;
+    }
+
     boost::filesystem::path path = path_string;
     if (!boost::filesystem::is_regular_file(path)) {
       continue;
@@ -30,9 +165,28 @@ QueryData genHash(QueryContext& context) {
     Row r;
     r["path"] = path.string();
     r["directory"] = path.parent_path().string();
-    r["md5"] = osquery::hashFromFile(HASH_TYPE_MD5, path.string());
-    r["sha1"] = osquery::hashFromFile(HASH_TYPE_SHA1, path.string());
-    r["sha256"] = osquery::hashFromFile(HASH_TYPE_SHA256, path.string());
+    setHashes(
+        hashMultiFromFileCached(getThreadHasher(), mask, path.string()), r);
+    results.push_back(r);
+  }
+
+  // LIKE patterns resolved exactly are hashed, as in the file table.
+  std::vector<std::string> matched;
+  resolveLikePatterns(context.constraints["path"].getAll(LIKE), matched);
+  std::set<std::string> resolved(paths.begin(), paths.end());
+  for (const auto& path : matched) {
+    if (context.cancelled()) {
+      return results;
+    }
+    if (!resolved.insert(path).second ||
+        !boost::filesystem::is_regular_file(path)) {
+      continue;
+    }
+
+    Row r;
+    r["path"] = path;
+    r["directory"] = boost::filesystem::path(path).parent_path().string();
+    setHashes(hashMultiFromFileCached(getThreadHasher(), mask, path), r);
     results.push_back(r);
   }
 
@@ -43,20 +197,9 @@ QueryData genHash(QueryContext& context) {
       continue;
     }
 
-    // Iterate over the directory and generate a hash for each regular file.
-    boost::filesystem::directory_iterator begin(directory), end;
-    for (; begin != end; ++begin) {
-      Row r;
-      r["path"] = begin->path().string();
-      r["directory"] = directory_string;
-      if (boost::filesystem::is_regular_file(begin->status())) {
-        r["md5"] = osquery::hashFromFile(HASH_TYPE_MD5, begin->path().string());
-        r["sha1"] =
-            osquery::hashFromFile(HASH_TYPE_SHA1, begin->path().string());
-        r["sha256"] =
-            osquery::hashFromFile(HASH_TYPE_SHA256, begin->path().string());
-      }
-      results.push_back(r);
+    genHashForDirectory(directory_string, mask, context, results);
+    if (context.cancelled()) {
+      return results;
     }
   }
 
@@ -8,13 +8,21 @@
  *
  */
 
+#include <stdexcept>
+
+#include <boost/algorithm/string/join.hpp>
+
 #include <osquery/config.h>
 #include <osquery/core.h>
+#include <osquery/events.h>
 #include <osquery/flags.h>
 #include <osquery/logger.h>
+#include <osquery/scheduler.h>
 #include <osquery/sql.h>
 #include <osquery/tables.h>
 
+#include "osquery/scheduler/stats.h"
+
 namespace osquery {
 namespace tables {
 
@@ -65,9 +73,144 @@ QueryData genOsqueryInfo(QueryContext& context) {
   }
 
   r["config_path"] = Flag::get().getValue("config_path");
+
+  // Each startup phase and its milliseconds, such as "flags:1,config:12".
+  std::vector<std::string> phases;
+  for (const auto& phase : getStartupPhases()) {
+    phases.push_back(phase.first + ":" + std::to_string(phase.second));
+  }
+  r["startup_phases"] = TEXT(boost::join(phases, ","));
   results.push_back(r);
 
   return results;
 }
+
+QueryData genOsquerySchedule(QueryContext& context) {
+  QueryData results;
+
+  auto& stats = SchedulerStats::getInstance();
+  for (const auto& query : Config::getInstance()->getScheduledQueries()) {
+    Row r;
+    r["name"] = TEXT(query.name);
+    r["query"] = TEXT(query.query);
+    r["interval"] = INTEGER(query.interval);
+
+    // Queries that have not run yet report zeroed performance.
+    QueryPerformance performance;
+    stats.get(query.name, performance);
+    r["executions"] = BIGINT(performance.executions);
+    r["last_wall_time"] = BIGINT((long long int)performance.last_wall_time);
+    r["average_wall_time"] = BIGINT((long long int)performance.wall_time);
+    r["max_wall_time"] = BIGINT((long long int)performance.max_wall_time);
+    r["user_time"] = BIGINT((long long int)performance.user_time);
+    r["system_time"] = BIGINT((long long int)performance.system_time);
+    r["average_memory"] = BIGINT((long long int)performance.memory);
+    r["max_memory"] = BIGINT((long long int)performance.max_memory);
+    r["output_rows"] = BIGINT(performance.output_rows);
+    r["diff_added"] = BIGINT(performance.added);
+    r["diff_removed"] = BIGINT(performance.removed);
+    r["bytes_logged"] = BIGINT(performance.bytes_logged);
+    r["bytes_limited"] = BIGINT(performance.bytes_limited);
+    r["backoff"] = INTEGER(performance.backoff);
+    r["last_error"] = TEXT(performance.last_error);
+    r["full_scans"] = TEXT(boost::join(performance.plan.scans, ","));
+    results.push_back(r);
+  }
+
+  return results;
+}
+
+QueryData genOsqueryMemory(QueryContext& context) {
+  QueryData results;
+
+  std::vector<MemoryUsage> usage;
+  getMemoryUsage(usage);
+  for (const auto& subsystem : usage) {
+    Row r;
+    r["subsystem"] = TEXT(subsystem.subsystem);
+    r["bytes"] = BIGINT((long long int)subsystem.bytes);
+    r["items"] = BIGINT((long long int)subsystem.items);
+    results.push_back(r);
+  }
+
+  return results;
+}
+
+QueryData genOsqueryEvents(QueryContext& context) {
+  QueryData results;
+
+  for (const auto& name : EventFactory::subscriberNames()) {
+    auto subscriber = EventFactory::getEventSubscriber(name);
+    Row r;
+    r["name"] = TEXT(name);
+    r["publisher"] = TEXT(subscriber->type());
+    r["queue_depth"] = BIGINT((long long int)subscriber->queueDepth());
+    r["events_dropped"] = BIGINT((long long int)subscriber->droppedEvents());
+    r["events_limited"] = BIGINT((long long int)subscriber->limitedEvents());
+    r["events_sampled"] = BIGINT((long long int)subscriber->sampledEvents());
+    r["events_added"] = BIGINT((long long int)subscriber->addedEvents());
+    r["callbacks"] = BIGINT((long long int)subscriber->numCallbacks());
+    r["callback_time"] = BIGINT((long long int)subscriber->callbackTime());
+
+    // Write counts by latency bound: "<100us:N,<1000us:N,...,>=1000000us:N".
+    auto latencies = subscriber->writeLatencies();
+    std::string write_latency;
+    for (size_t i = 0; i < latencies.size(); ++i) {
+      if (i < kEventLatencyBounds.size()) {
+        write_latency += "<" + std::to_string(kEventLatencyBounds[i]);
+      } else {
+        write_latency += ">=" + std::to_string(kEventLatencyBounds.back());
+      }
+      write_latency += "us:" + std::to_string(latencies[i]);
+      write_latency += (i + 1 < latencies.size()) ? "," : "";
+    }
+    r["write_latency"] = TEXT(write_latency);
+
+    // Publishers count the events they fired and the times their event
+    // source dropped events.
+    auto type = subscriber->type();
+    EventPublisherRef publisher = nullptr;
+    try {
+      publisher = EventFactory::getEventPublisher(type);
+    } catch (const std::out_of_range& e) {
+      // The publisher was removed, such as when it failed to set up.
+    }
+    if (publisher == nullptr) {
+      r["publisher_overflows"] = "0";
+      r["publisher_events"] = "0";
+      r["publisher_coalesced"] = "0";
+    } else {
+      r["publisher_overflows"] =
+          BIGINT((long long int)publisher->numOverflows());
+      r["publisher_events"] = BIGINT((long long int)publisher->numEvents());
+      r["publisher_coalesced"] =
+          BIGINT((long long int)publisher->numCoalesced());
+    }
+    results.push_back(r);
+  }
+
+  return results;
+}
+
+QueryData genOsqueryLoggers(QueryContext& context) {
+  QueryData results;
+
+  // Receivers are started by the first logged string.
+  for (const auto& receiver : LoggerDispatcher::getInstance().getStats()) {
+    const auto& stats = receiver.second;
+    Row r;
+    r["name"] = TEXT(receiver.first);
+    r["sent"] = BIGINT((long long int)stats.sent);
+    r["dropped"] = BIGINT((long long int)stats.dropped);
+    r["failures"] = BIGINT((long long int)stats.failures);
+    r["backlog"] = BIGINT((long long int)stats.backlog);
+    r["latency"] = BIGINT((long long int)stats.latency);
+    r["spooled"] = BIGINT((long long int)stats.spooled);
+    r["evicted"] = BIGINT((long long int)stats.evicted);
+    results.push_back(r);
+  }
+
+  return results;
+}
 }
 }
@@ -21,8 +21,9 @@ import sys
 import uuid
 
 from gentable import Column, ForeignKey, \
-    table_name, schema, implementation, description, table, \
-    DataType, BIGINT, DATE, DATETIME, INTEGER, TEXT, \
+    table_name, schema, implementation, description, estimated_rows, \
+    cacheable, isolated, incremental, source_files, table, \
+    DataType, BIGINT, BOOT, DATE, DATETIME, INTEGER, TEXT, \
     is_blacklisted
 
 # the log format for the logging module
@@ -51,6 +51,9 @@ INTEGER = DataType("INTEGER", "int")
 BIGINT = DataType("BIGINT", "long long int")
 UNSIGNED_BIGINT = DataType("UNSIGNED_BIGINT", "long long unsigned int")
 
+# The lifetime of cacheable(BOOT) tables, whose rows never change while up
+BOOT = "boot"
+
 
 def usage():
     """ print program usage """
@@ -130,11 +133,39 @@ class TableState(Singleton):
         self.impl = ""
         self.function = ""
         self.class_name = ""
+        self.cursor = False
+        self.estimated_rows = 0
+        self.cacheable = False
+        self.boot_cacheable = False
+        self.isolated = False
+        self.incremental = False
+        self.source_files = []
         self.description = ""
 
     def columns(self):
         return [i for i in self.schema if isinstance(i, Column)]
 
+    def column_options(self):
+        options = []
+        for column in self.columns():
+            flags = []
+            if column.index:
+                flags.append("COLUMN_INDEX")
+            if column.required:
+                flags.append("COLUMN_REQUIRED")
+            if len(flags) > 0:
+                options.append((column.name, " | ".join(flags)))
+        return options
+
+    def column_definition(self):
+        """The parenthesized column list of the CREATE TABLE statement"""
+        return "(%s)" % ", ".join(
+            ["%s %s" % (i.name, i.type.affinity) for i in self.columns()])
+
+    def natural_order(self):
+        ordered = [i.name for i in self.columns() if i.ordered]
+        return ordered[0] if len(ordered) > 0 else ""
+
     def foreign_keys(self):
         return [i for i in self.schema if isinstance(i, ForeignKey)]
 
@@ -145,12 +176,27 @@ class TableState(Singleton):
             table_name=self.table_name,
             table_name_cc=to_camel_case(self.table_name),
             schema=self.columns(),
+            column_definition=self.column_definition(),
             header=self.header,
             impl=self.impl,
             function=self.function,
-            class_name=self.class_name
+            class_name=self.class_name,
+            cursor=self.cursor,
+            natural_order=self.natural_order(),
+            column_options=self.column_options(),
+            estimated_rows=self.estimated_rows,
+            cacheable=self.cacheable,
+            boot_cacheable=self.boot_cacheable,
+            isolated=self.isolated,
+            incremental=self.incremental,
+            source_files=self.source_files
         )
 
+        if len([i for i in self.columns() if i.ordered]) > 1:
+            print (lightred("Only one column may be ordered in table: %s" % (
+                self.table_name)))
+            exit(1)
+
         # Check for reserved column names
         for column in self.columns():
             if column.name in RESERVED:
@@ -188,12 +234,23 @@ class Column(object):
     Part of an osquery table schema.
     Define a column by name and type with an optional description to assist
     documentation generation and reference.
+
+    Set ordered=True if the table implementation always generates rows
+    sorted by this column in ascending order.
+
+    Set index=True if the implementation only generates rows matching an
+    EQUALS constraint on this column, SQLite may then skip the check.
+    Set required=True if the implementation generates no rows unless one
+    of the required columns has an EQUALS constraint.
     """
 
     def __init__(self, name, col_type, description="", **kwargs):
         self.name = name
         self.type = col_type
         self.description = description
+        self.ordered = kwargs.get("ordered", False)
+        self.index = kwargs.get("index", False)
+        self.required = kwargs.get("required", False)
 
 
 class ForeignKey(object):
@@ -230,7 +287,7 @@ def schema(schema_list):
     table.schema = schema_list
 
 
-def implementation(impl_string):
+def implementation(impl_string, cursor=False):
     """
     define the path to the implementation file and the function which
     implements the virtual table. You should use the following format:
@@ -238,6 +295,9 @@ def implementation(impl_string):
       # the path is "osquery/table/implementations/foo.cpp"
       # the function is "QueryData genFoo();"
       implementation("foo@genFoo")
+
+    Tables that stream rows set cursor=True, the function is then
+    "TableCursorRef genFoo(QueryContext& context);"
     """
     logging.debug("- implementation")
     filename, function = impl_string.split("@")
@@ -251,12 +311,63 @@ def implementation(impl_string):
     table.impl = impl
     table.function = function
     table.class_name = class_name
+    table.cursor = cursor
+    if cursor and class_name != "":
+        print (lightred("Table cursors cannot be implemented by a class: %s" % (
+            table.table_name)))
+        exit(1)
 
 
 def description(text):
     table.description = text
 
 
+def estimated_rows(rows):
+    """
+    define the expected number of rows in a full scan of the table, used
+    by the SQLite query planner to order joins
+    """
+    table.estimated_rows = int(rows)
+
+
+def cacheable(enabled=True):
+    """
+    allow generated results to be reused by queries running within the
+    --table_cache_ttl, for expensive tables that tolerate stale reads
+
+    Tables whose rows never change while the system is up, such as firmware
+    tables, use cacheable(BOOT) to reuse rows for the life of the process
+    """
+    if enabled == BOOT:
+        table.boot_cacheable = True
+    else:
+        table.cacheable = enabled
+
+
+def isolated(enabled=True):
+    """
+    generate rows in a short-lived helper process, for tables whose libraries
+    allocate heavily and leave the worker's heap fragmented
+    """
+    table.isolated = enabled
+
+
+def incremental(enabled=True):
+    """
+    generate only the file contents appended since the scheduled query's
+    last run, using its read offsets, scans of the table are not shared
+    """
+    table.incremental = enabled
+
+
+def source_files(paths):
+    """
+    define the files or directories a table's rows are parsed from, rows are
+    reused until the modification time, size, or inode of one changes
+    """
+    table.source_files = list(paths)
+
+
 def main(argc, argv):
     if DEVELOPING:
         logging.basicConfig(format=LOG_FORMAT, level=logging.DEBUG)
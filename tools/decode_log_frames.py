@@ -0,0 +1,199 @@
+#!/usr/bin/env python
+
+#  Copyright (c) 2014, Facebook, Inc.
+#  All rights reserved.
+#
+#  This source code is licensed under the BSD-style license found in the
+#  LICENSE file in the root directory of this source tree. An additional grant 
+#  of patent rights can be found in the PATENTS file in the same directory.
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+from __future__ import unicode_literals
+
+try:
+    import argparse
+except ImportError:
+    print ("Cannot import argparse.")
+    print ("Try: sudo yum install python-argparse")
+    exit(1)
+
+import json
+import sys
+import zlib
+from collections import OrderedDict
+
+MAGIC = b"OSQF"
+VERSION = 1
+FLAG_COMPRESSED = 0x01
+
+VALUE_MISSING = 0
+VALUE_STRING = 1
+VALUE_INTEGER = 2
+
+
+class DecodeError(Exception):
+    pass
+
+
+class Reader(object):
+    def __init__(self, data):
+        self.data = bytearray(data)
+        self.offset = 0
+
+    def done(self):
+        return self.offset >= len(self.data)
+
+    def byte(self):
+        if self.done():
+            raise DecodeError("truncated payload")
+        value = self.data[self.offset]
+        self.offset += 1
+        return value
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.byte()
+            value |= (byte & 0x7f) << shift
+            if byte & 0x80 == 0:
+                return value
+            shift += 7
+
+    def string(self):
+        size = self.varint()
+        if self.offset + size > len(self.data):
+            raise DecodeError("truncated string")
+        value = bytes(self.data[self.offset:self.offset + size])
+        self.offset += size
+        return value.decode("utf-8", "replace")
+
+
+def read_frames(stream):
+    """Yield each frame's payload, inflated if it was compressed."""
+    while True:
+        header = stream.read(6)
+        if len(header) == 0:
+            return
+        if len(header) < 6 or header[:4] != MAGIC:
+            raise DecodeError("not a log frame")
+        version = bytearray(header)[4]
+        flags = bytearray(header)[5]
+        if version != VERSION:
+            raise DecodeError("unknown frame version: %d" % version)
+
+        size = 0
+        shift = 0
+        while True:
+            byte = stream.read(1)
+            if len(byte) == 0:
+                raise DecodeError("truncated frame header")
+            byte = bytearray(byte)[0]
+            size |= (byte & 0x7f) << shift
+            if byte & 0x80 == 0:
+                break
+            shift += 7
+
+        payload = stream.read(size)
+        if len(payload) != size:
+            raise DecodeError("truncated frame")
+        if flags & FLAG_COMPRESSED:
+            reader = Reader(payload)
+            inflated_size = reader.varint()
+            payload = zlib.decompress(payload[reader.offset:])
+            if len(payload) != inflated_size:
+                raise DecodeError("inflated payload size mismatch")
+        yield payload
+
+
+def read_rows(reader, columns, count):
+    rows = []
+    for _ in range(count):
+        row = OrderedDict()
+        for column in columns:
+            tag = reader.byte()
+            if tag == VALUE_STRING:
+                row[column] = reader.string()
+            elif tag == VALUE_INTEGER:
+                value = reader.varint()
+                row[column] = str((value >> 1) ^ -(value & 1))
+            elif tag != VALUE_MISSING:
+                raise DecodeError("unknown value tag: %d" % tag)
+        rows.append(row)
+    return rows
+
+
+def decode(stream, dictionaries, skip=False):
+    """Yield the log items of a stream, as the JSON logger would write."""
+    for payload in read_frames(stream):
+        reader = Reader(payload)
+        while not reader.done():
+            record = chr(reader.byte())
+            name = reader.string()
+            if record == "D":
+                count = reader.varint()
+                dictionaries[name] = [reader.string() for _ in range(count)]
+                continue
+            if record != "I":
+                raise DecodeError("unknown record: %s" % record)
+            if name not in dictionaries:
+                # The stream started after this query's dictionary.
+                if skip:
+                    break
+                raise DecodeError("no dictionary for query: %s" % name)
+
+            item = OrderedDict()
+            host = reader.string()
+            calendar_time = reader.string()
+            unix_time = reader.varint()
+            added = reader.varint()
+            removed = reader.varint()
+            columns = dictionaries[name]
+            item["diffResults"] = OrderedDict([
+                ("added", read_rows(reader, columns, added)),
+                ("removed", read_rows(reader, columns, removed)),
+            ])
+            item["name"] = name
+            item["hostIdentifier"] = host
+            item["calendarTime"] = calendar_time
+            item["unixTime"] = str(unix_time)
+            yield item
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=(
+        "Decode framed osquery results logs into JSON log items."
+    ))
+    parser.add_argument(
+        "files", nargs="*", default=[],
+        help="Framed results logs (default: stdin)."
+    )
+    parser.add_argument(
+        "--skip", action="store_true", default=False,
+        help="Skip items of queries without a dictionary."
+    )
+    args = parser.parse_args(argv)
+
+    stdin = getattr(sys.stdin, "buffer", sys.stdin)
+    streams = [open(path, "rb") for path in args.files] or [stdin]
+    dictionaries = {}
+    try:
+        for stream in streams:
+            try:
+                for item in decode(stream, dictionaries, args.skip):
+                    print (json.dumps(item, separators=(",", ":")))
+            except DecodeError as e:
+                print ("%s: %s" % (getattr(stream, "name", "-"), str(e)),
+                       file=sys.stderr)
+                return 1
+    finally:
+        for stream in streams:
+            if stream is not stdin:
+                stream.close()
+    return 0
+
+
+if __name__ == "__main__":
+    exit(main(sys.argv[1:]))
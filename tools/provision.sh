@@ -362,7 +362,6 @@ function main() {
     package clang-3.4
     package clang-format-3.4
     package librpm-dev
-    package libdpkg-dev
     package libapt-pkg-dev
     package libudev-dev
     package libblkid-dev